@@ -4,8 +4,9 @@ extern ApMain
 global Start32
 global ApStart16
 
-%define MAX_CPUS 8
-%define CPU_STACK_SIZE 4096
+; boot stacks are only used until Main/ApMain switch to the cpu stack
+%define MAX_CPUS 256
+%define CPU_STACK_SIZE 1024
 
 section .trampolinedata nobits
 align 4096
@@ -5,13 +5,15 @@
 
 #include <kernel/trace.h>
 #include <kernel/asm.h>
+#include <kernel/preempt.h>
 #include <mm/memory_map.h>
 
 namespace Kernel
 {
 
 IO8042::IO8042()
-    : IntVector(-1)
+    : DecodeWork(&IO8042::DecodeWorkFunc, this)
+    , IntVector(-1)
     , Mod(0)
 {
     Trace(0, "IO8042 0x%p", this);
@@ -28,10 +30,6 @@ void IO8042::OnInterruptRegister(u8 irq, u8 vector)
     (void)irq;
 
     IntVector = vector;
-
-    Stdlib::Time period(10 * Const::NanoSecsInMs); //10ms
-
-    TimerTable::GetInstance().StartTimer(*this, period);
 }
 
 InterruptHandlerFn IO8042::GetHandlerFn()
@@ -39,21 +37,24 @@ InterruptHandlerFn IO8042::GetHandlerFn()
     return IO8042InterruptStub;
 }
 
-void IO8042::Interrupt(Context* ctx)
+void IO8042::Interrupt(IrqContext* ctx)
 {
+    InterruptTime irqTime(static_cast<u8>(IntVector));
     InterruptCounter.Inc();
     (void)ctx;
-    Stdlib::AutoLock lock(Lock);
 
     if (!Buf.Put(Inb(Port)))
     {
         Trace(0, "Kbd: can't put new code");
     }
 
+    // fails while the work is pending, it then picks the code up too. Codes
+    // that come before the workers start wait for DecodePending
+    WorkQueue::GetInstance().Queue(DecodeWork);
+
     Lapic::EOI(IntVector);
 }
 
-
 bool IO8042::RegisterObserver(IO8042Observer& observer)
 {
     Stdlib::AutoLock lock(Lock);
@@ -83,16 +84,25 @@ void IO8042::UnregisterObserver(IO8042Observer& observer)
     }
 }
 
-void IO8042::OnTick(TimerCallback& callback)
+void IO8042::DecodePending()
 {
-    (void)callback;
+    if (!Buf.IsEmpty())
+        WorkQueue::GetInstance().Queue(DecodeWork);
+}
 
+void IO8042::DecodeWorkFunc(void* ctx)
+{
+    static_cast<IO8042*>(ctx)->Decode();
+}
+
+void IO8042::Decode()
+{
     Stdlib::AutoLock lock(Lock);
 
-    while (!Buf.IsEmpty())
+    u8 code;
+    while (Buf.Get(code))
     {
         static char map[0x80] = "__1234567890-=_" "\tqwertyuiop[]\n" "_asdfghjkl;'`" "_\\zxcvbnm,./_" "*_ _";
-        u8 code = Buf.Get();
 
         Trace(KbdLL, "Kbd: code 0x%p", (ulong)code);
 
@@ -116,9 +126,10 @@ void IO8042::OnTick(TimerCallback& callback)
     }
 }
 
-extern "C" void IO8042Interrupt(Context* ctx)
+extern "C" void IO8042Interrupt(IrqContext* ctx)
 {
     IO8042::GetInstance().Interrupt(ctx);
+    PreemptIrqExit();
 }
 
 }
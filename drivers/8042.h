@@ -2,7 +2,7 @@
 
 #include <include/types.h>
 #include <kernel/idt.h>
-#include <kernel/timer.h>
+#include <kernel/work_queue.h>
 #include <kernel/spin_lock.h>
 #include <kernel/interrupt.h>
 #include <kernel/asm.h>
@@ -18,7 +18,10 @@ public:
     virtual void OnChar(char c, u8 code) = 0;
 };
 
-class IO8042 : public TimerCallback, public InterruptHandler
+// The interrupt handler stores scancodes and queues the decode work, which
+// decodes them and notifies observers in a worker task. Nothing runs while
+// no key is pressed.
+class IO8042 : public InterruptHandler
 {
 public:
     static IO8042& GetInstance()
@@ -30,15 +33,16 @@ public:
     virtual void OnInterruptRegister(u8 irq, u8 vector) override;
     virtual InterruptHandlerFn GetHandlerFn() override;
 
-    void Interrupt(Context* ctx);
-
-    virtual void OnTick(TimerCallback& callback) override;
+    void Interrupt(IrqContext* ctx);
 
     char GetCmd();
 
     bool RegisterObserver(IO8042Observer& observer);
     void UnregisterObserver(IO8042Observer& observer);
 
+    // decodes the codes that came before the workers started
+    void DecodePending();
+
 private:
     IO8042();
     virtual ~IO8042();
@@ -50,8 +54,14 @@ private:
 
     static const ulong Port = 0x60;
 
+    // decodes Buf and notifies observers
+    void Decode();
+    static void DecodeWorkFunc(void* ctx);
+
     SpinLock Lock;
-    Stdlib::RingBuffer<u8, Const::PageSize> Buf;
+    Work DecodeWork;
+    // filled by the interrupt handler, drained by the decode work
+    Stdlib::SpscRingBuffer<u8, Const::PageSize> Buf;
 
     int IntVector;
     u8 Mod;
@@ -11,13 +11,28 @@ Acpi::Acpi()
     , Rsdt(nullptr)
     , LapicAddress(nullptr)
     , IoApicAddress(nullptr)
+    , HpetAddress(nullptr)
+    , EcamCount(0)
     , IrqToGsiSize(0)
+    , NodeCount(0)
+    , MemoryRangeCount(0)
 {
     OemId[0] = '\0';
+    Stdlib::MemSet(Ecam, 0, sizeof(Ecam));
     for (size_t i = 0; i < Stdlib::ArraySize(Table); i++)
     {
         Table[i] = nullptr;
     }
+
+    Stdlib::MemSet(NodeDomain, 0, sizeof(NodeDomain));
+    Stdlib::MemSet(CpuNode, 0, sizeof(CpuNode));
+    for (size_t i = 0; i < MaxNodes; i++)
+    {
+        for (size_t j = 0; j < MaxNodes; j++)
+        {
+            NodeDistance[i][j] = (i == j) ? 10 : 20;
+        }
+    }
 }
 
 Acpi::~Acpi()
@@ -230,6 +245,211 @@ Stdlib::Error Acpi::ParseMADT()
     return MakeError(Stdlib::Error::Success);
 }
 
+bool Acpi::DomainToNode(u32 domain, ulong& node)
+{
+    for (node = 0; node < NodeCount; node++)
+    {
+        if (NodeDomain[node] == domain)
+            return true;
+    }
+
+    if (NodeCount >= Stdlib::ArraySize(NodeDomain))
+        return false;
+
+    node = NodeCount++;
+    NodeDomain[node] = domain;
+    return true;
+}
+
+Stdlib::Error Acpi::ParseSRAT()
+{
+    ACPISDTHeader* sdtHeader = LookupTable("SRAT");
+    if (sdtHeader == nullptr)
+    {
+        return MakeError(Stdlib::Error::NotFound);
+    }
+
+    Trace(AcpiLL, "Acpi: SRAT 0x%p", sdtHeader);
+
+    SratHeader* header = reinterpret_cast<SratHeader*>(sdtHeader + 1);
+    SratEntry* entry = reinterpret_cast<SratEntry*>(header + 1);
+
+    while (Stdlib::MemAdd(entry, sizeof(*entry)) <= Stdlib::MemAdd(sdtHeader, sdtHeader->Length) &&
+        Stdlib::MemAdd(entry, entry->Length) <= Stdlib::MemAdd(sdtHeader, sdtHeader->Length))
+    {
+        if (entry->Length == 0)
+        {
+            break;
+        }
+
+        ulong node;
+        switch (entry->Type)
+        {
+        case SratEntryTypeLapic:
+        {
+            SratLapicEntry* lapicEntry = reinterpret_cast<SratLapicEntry*>(entry + 1);
+            if (entry->Length < sizeof(*lapicEntry) + sizeof(*entry))
+                return MakeError(Stdlib::Error::InvalidValue);
+
+            if (!(lapicEntry->Flags & 0x1))
+                break;
+
+            u32 domain = lapicEntry->ProximityDomainLow |
+                ((u32)lapicEntry->ProximityDomainHigh[0] << 8) |
+                ((u32)lapicEntry->ProximityDomainHigh[1] << 16) |
+                ((u32)lapicEntry->ProximityDomainHigh[2] << 24);
+            if (!DomainToNode(domain, node))
+                return MakeError(Stdlib::Error::NoMemory);
+
+            Trace(AcpiLL, "Acpi: SRAT apicId %u domain %u node %u",
+                (ulong)lapicEntry->ApicId, (ulong)domain, node);
+
+            CpuNode[lapicEntry->ApicId] = node;
+            break;
+        }
+        case SratEntryTypeX2Apic:
+        {
+            SratX2ApicEntry* x2ApicEntry = reinterpret_cast<SratX2ApicEntry*>(entry + 1);
+            if (entry->Length < sizeof(*x2ApicEntry) + sizeof(*entry))
+                return MakeError(Stdlib::Error::InvalidValue);
+
+            if (!(x2ApicEntry->Flags & 0x1) || x2ApicEntry->X2ApicId >= Stdlib::ArraySize(CpuNode))
+                break;
+
+            if (!DomainToNode(x2ApicEntry->ProximityDomain, node))
+                return MakeError(Stdlib::Error::NoMemory);
+
+            CpuNode[x2ApicEntry->X2ApicId] = node;
+            break;
+        }
+        case SratEntryTypeMemory:
+        {
+            SratMemoryEntry* memEntry = reinterpret_cast<SratMemoryEntry*>(entry + 1);
+            if (entry->Length < sizeof(*memEntry) + sizeof(*entry))
+                return MakeError(Stdlib::Error::InvalidValue);
+
+            if (!(memEntry->Flags & 0x1) || memEntry->Length == 0)
+                break;
+
+            if (!DomainToNode(memEntry->ProximityDomain, node))
+                return MakeError(Stdlib::Error::NoMemory);
+
+            Trace(AcpiLL, "Acpi: SRAT memory 0x%p len 0x%p domain %u node %u",
+                memEntry->BaseAddress, memEntry->Length, (ulong)memEntry->ProximityDomain, node);
+
+            if (MemoryRangeCount >= Stdlib::ArraySize(MemoryRange))
+                return MakeError(Stdlib::Error::NoMemory);
+
+            auto& range = MemoryRange[MemoryRangeCount++];
+            range.Start = memEntry->BaseAddress;
+            range.End = memEntry->BaseAddress + memEntry->Length;
+            range.Node = node;
+            break;
+        }
+        default:
+            break;
+        }
+
+        entry = static_cast<SratEntry*>(Stdlib::MemAdd(entry, entry->Length));
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error Acpi::ParseSLIT()
+{
+    ACPISDTHeader* sdtHeader = LookupTable("SLIT");
+    if (sdtHeader == nullptr)
+    {
+        return MakeError(Stdlib::Error::NotFound);
+    }
+
+    SlitHeader* header = reinterpret_cast<SlitHeader*>(sdtHeader + 1);
+    ulong count = header->LocalityCount;
+    if (Stdlib::MemAdd(&header->Entry[0], count * count) > Stdlib::MemAdd(sdtHeader, sdtHeader->Length))
+        return MakeError(Stdlib::Error::InvalidValue);
+
+    Trace(AcpiLL, "Acpi: SLIT 0x%p localities %u", sdtHeader, count);
+
+    // SLIT is indexed by proximity domain
+    for (size_t from = 0; from < NodeCount; from++)
+    {
+        for (size_t to = 0; to < NodeCount; to++)
+        {
+            ulong fromDomain = NodeDomain[from];
+            ulong toDomain = NodeDomain[to];
+            if (fromDomain < count && toDomain < count)
+                NodeDistance[from][to] = header->Entry[fromDomain * count + toDomain];
+        }
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error Acpi::ParseHPET()
+{
+    ACPISDTHeader* sdtHeader = LookupTable("HPET");
+    if (sdtHeader == nullptr)
+    {
+        return MakeError(Stdlib::Error::NotFound);
+    }
+
+    if (sdtHeader->Length < sizeof(*sdtHeader) + sizeof(HpetHeader))
+        return MakeError(Stdlib::Error::InvalidValue);
+
+    HpetHeader* header = reinterpret_cast<HpetHeader*>(sdtHeader + 1);
+
+    Trace(AcpiLL, "Acpi: HPET id 0x%p space %u addr 0x%p number %u min tick %u",
+        (ulong)header->EventTimerBlockId, (ulong)header->AddressSpaceId, header->Address,
+        (ulong)header->HpetNumber, (ulong)header->MinimumTick);
+
+    // only the first block is used, and it has to be memory mapped
+    if (header->AddressSpaceId != AddressSpaceMemory || header->Address == 0)
+        return MakeError(Stdlib::Error::NotFound);
+
+    HpetAddress = reinterpret_cast<void*>(header->Address);
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error Acpi::ParseMCFG()
+{
+    ACPISDTHeader* sdtHeader = LookupTable("MCFG");
+    if (sdtHeader == nullptr)
+    {
+        return MakeError(Stdlib::Error::NotFound);
+    }
+
+    if (sdtHeader->Length < sizeof(*sdtHeader) + sizeof(McfgHeader))
+        return MakeError(Stdlib::Error::InvalidValue);
+
+    McfgHeader* header = reinterpret_cast<McfgHeader*>(sdtHeader + 1);
+    size_t count = (sdtHeader->Length - sizeof(*sdtHeader) - sizeof(*header)) / sizeof(McfgEntry);
+    for (size_t i = 0; i < count; i++)
+    {
+        McfgEntry& entry = header->Entry[i];
+
+        Trace(AcpiLL, "Acpi: MCFG base 0x%p segment %u bus %u-%u",
+            entry.Base, (ulong)entry.Segment, (ulong)entry.StartBus, (ulong)entry.EndBus);
+
+        if (entry.Base == 0 || entry.StartBus > entry.EndBus)
+            continue;
+
+        if (EcamCount >= MaxEcamRegions)
+        {
+            Trace(0, "Acpi: too many ecam regions");
+            break;
+        }
+
+        EcamRegion& region = Ecam[EcamCount++];
+        region.Base = entry.Base;
+        region.Segment = entry.Segment;
+        region.StartBus = entry.StartBus;
+        region.EndBus = entry.EndBus;
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
 Stdlib::Error Acpi::Parse()
 {
     Stdlib::Error err;
@@ -260,6 +480,32 @@ Stdlib::Error Acpi::Parse()
         return err;
     }
 
+    // NUMA tables are optional
+    err = ParseSRAT();
+    if (!err.Ok() && err.GetCode() != Stdlib::Error::NotFound)
+    {
+        return err;
+    }
+
+    err = ParseSLIT();
+    if (!err.Ok() && err.GetCode() != Stdlib::Error::NotFound)
+    {
+        return err;
+    }
+
+    err = ParseHPET();
+    if (!err.Ok() && err.GetCode() != Stdlib::Error::NotFound)
+    {
+        return err;
+    }
+
+    // without MCFG pci config space goes through the legacy ports
+    err = ParseMCFG();
+    if (!err.Ok() && err.GetCode() != Stdlib::Error::NotFound)
+    {
+        return err;
+    }
+
     return MakeError(Stdlib::Error::Success);
 }
 
@@ -274,6 +520,22 @@ void* Acpi::GetIoApicAddress()
     return IoApicAddress;
 }
 
+void* Acpi::GetHpetAddress()
+{
+    return HpetAddress;
+}
+
+size_t Acpi::GetEcamRegionCount()
+{
+    return EcamCount;
+}
+
+const Acpi::EcamRegion& Acpi::GetEcamRegion(size_t index)
+{
+    BugOn(index >= EcamCount);
+    return Ecam[index];
+}
+
 bool Acpi::RegisterIrqToGsi(u8 irq, u32 gsi)
 {
     if (IrqToGsiSize >= Stdlib::ArraySize(IrqToGsi))
@@ -300,4 +562,48 @@ u32 Acpi::GetGsiByIrq(u8 irq)
     return irq;
 }
 
-}
\ No newline at end of file
+size_t Acpi::GetNodeCount()
+{
+    // without SRAT node 0 stands for everything
+    return (NodeCount != 0) ? NodeCount : 1;
+}
+
+ulong Acpi::GetCpuNode(ulong apicId)
+{
+    if (apicId >= Stdlib::ArraySize(CpuNode))
+        return 0;
+
+    return CpuNode[apicId];
+}
+
+ulong Acpi::GetMemoryNode(ulong addr, ulong& rangeEnd)
+{
+    ulong nextStart = ~((ulong)0);
+
+    for (size_t i = 0; i < MemoryRangeCount; i++)
+    {
+        auto& range = MemoryRange[i];
+        if (addr >= range.Start && addr < range.End)
+        {
+            rangeEnd = range.End;
+            return range.Node;
+        }
+
+        if (range.Start > addr && range.Start < nextStart)
+            nextStart = range.Start;
+    }
+
+    // not described by SRAT, up to the next described range
+    rangeEnd = nextStart;
+    return 0;
+}
+
+u8 Acpi::GetNodeDistance(ulong fromNode, ulong toNode)
+{
+    if (fromNode >= GetNodeCount() || toNode >= GetNodeCount())
+        return 0xFF;
+
+    return NodeDistance[fromNode][toNode];
+}
+
+}
@@ -23,6 +23,38 @@ public:
 
     u32 GetGsiByIrq(u8 irq);
 
+    // HPET register block, nullptr without an HPET table
+    void* GetHpetAddress();
+
+    // PCIe ECAM region of one segment from the MCFG table, every bus has
+    // 1MB of config space at Base + (bus << 20)
+    struct EcamRegion
+    {
+        ulong Base;
+        u16 Segment;
+        u8 StartBus;
+        u8 EndBus;
+    };
+
+    static const size_t MaxEcamRegions = 4;
+
+    size_t GetEcamRegionCount();
+
+    const EcamRegion& GetEcamRegion(size_t index);
+
+    static const size_t MaxNodes = 8;
+
+    // nodes come from SRAT proximity domains
+    size_t GetNodeCount();
+
+    ulong GetCpuNode(ulong apicId);
+
+    // node of the physical address and the end of the range with that node
+    ulong GetMemoryNode(ulong addr, ulong& rangeEnd);
+
+    // SLIT relative distance, 10 is local
+    u8 GetNodeDistance(ulong fromNode, ulong toNode);
+
 private:
     Acpi();
     ~Acpi();
@@ -105,6 +137,93 @@ private:
         u16 Flags;
     } __attribute__((packed));
 
+    struct SratHeader
+    {
+        u32 Reserved1;
+        u64 Reserved2;
+    } __attribute__((packed));
+
+    struct SratEntry
+    {
+        u8 Type;
+        u8 Length;
+    } __attribute__((packed));
+
+    static const u8 SratEntryTypeLapic = 0;
+    static const u8 SratEntryTypeMemory = 1;
+    static const u8 SratEntryTypeX2Apic = 2;
+
+    struct SratLapicEntry
+    {
+        u8 ProximityDomainLow;
+        u8 ApicId;
+        u32 Flags;
+        u8 SapicEid;
+        u8 ProximityDomainHigh[3];
+        u32 ClockDomain;
+    } __attribute__((packed));
+
+    struct SratMemoryEntry
+    {
+        u32 ProximityDomain;
+        u16 Reserved1;
+        u64 BaseAddress;
+        u64 Length;
+        u32 Reserved2;
+        u32 Flags;
+        u64 Reserved3;
+    } __attribute__((packed));
+
+    struct SratX2ApicEntry
+    {
+        u16 Reserved1;
+        u32 ProximityDomain;
+        u32 X2ApicId;
+        u32 Flags;
+        u32 ClockDomain;
+        u32 Reserved2;
+    } __attribute__((packed));
+
+    struct SlitHeader
+    {
+        u64 LocalityCount;
+        u8 Entry[0];
+    } __attribute__((packed));
+
+    struct HpetHeader
+    {
+        u32 EventTimerBlockId;
+        u8 AddressSpaceId;
+        u8 RegisterBitWidth;
+        u8 RegisterBitOffset;
+        u8 Reserved;
+        u64 Address;
+        u8 HpetNumber;
+        u16 MinimumTick;
+        u8 PageProtection;
+    } __attribute__((packed));
+
+    static_assert(sizeof(HpetHeader) == 20, "Invalid size");
+
+    static const u8 AddressSpaceMemory = 0;
+
+    struct McfgEntry
+    {
+        u64 Base;
+        u16 Segment;
+        u8 StartBus;
+        u8 EndBus;
+        u32 Reserved;
+    } __attribute__((packed));
+
+    static_assert(sizeof(McfgEntry) == 16, "Invalid size");
+
+    struct McfgHeader
+    {
+        u64 Reserved;
+        McfgEntry Entry[0];
+    } __attribute__((packed));
+
     int ComputeSum(void* table, size_t len);
 
     bool ParseRsdp(RSDPDescriptor20* rsdp);
@@ -113,6 +232,12 @@ private:
 
     Stdlib::Error ParseTablePointers();
     Stdlib::Error ParseMADT();
+    Stdlib::Error ParseSRAT();
+    Stdlib::Error ParseSLIT();
+    Stdlib::Error ParseHPET();
+    Stdlib::Error ParseMCFG();
+
+    bool DomainToNode(u32 domain, ulong& node);
 
     ACPISDTHeader* LookupTable(const char *name);
 
@@ -129,6 +254,10 @@ private:
 
     void* LapicAddress;
     void* IoApicAddress;
+    void* HpetAddress;
+
+    EcamRegion Ecam[MaxEcamRegions];
+    size_t EcamCount;
 
     struct IrqToGsiEntry
     {
@@ -141,6 +270,23 @@ private:
 
     bool RegisterIrqToGsi(u8 irq, u32 gsi);
 
+    static const size_t MaxApicId = 256;
+    static const size_t MaxMemoryRanges = 32;
+
+    struct NodeMemoryRange
+    {
+        ulong Start;
+        ulong End;
+        ulong Node;
+    };
+
+    u32 NodeDomain[MaxNodes];
+    size_t NodeCount;
+    u8 CpuNode[MaxApicId];
+    NodeMemoryRange MemoryRange[MaxMemoryRanges];
+    size_t MemoryRangeCount;
+    u8 NodeDistance[MaxNodes][MaxNodes];
+
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Kernel
+{
+
+struct BlkRequest;
+
+// runs in interrupt context on the cpu of the queue
+using BlkDoneFn = void (*)(BlkRequest* req);
+
+struct BlkRequest final
+{
+    static const u32 TypeRead = 0;
+    static const u32 TypeWrite = 1;
+    static const u32 TypeFlush = 4;
+
+    u32 Type;
+    u64 Sector;
+    // page allocator memory, the device reads or writes it in place
+    void* Buf;
+    size_t Sectors;
+    BlkDoneFn Done;
+    void* Ctx;
+    // set before Done runs
+    bool Ok;
+
+    // owned by the driver while the request is queued
+    u16 Slot;
+    BlkRequest* Next;
+};
+
+// What the page cache needs from a disk driver
+class BlockDevice
+{
+public:
+    static const ulong SectorSize = 512;
+
+    // in sectors
+    virtual u64 GetCapacity() = 0;
+
+    virtual bool IsReadOnly() = 0;
+
+    // false for requests Submit would never take, tells them apart from a
+    // full device when Submit stops short
+    virtual bool IsValid(const BlkRequest& req) = 0;
+
+    // queues requests in order until one is invalid or the device is full,
+    // returns how many were queued. Done may run before Submit returns
+    virtual size_t Submit(BlkRequest** reqs, size_t count) = 0;
+
+    virtual bool Flush() = 0;
+
+protected:
+    virtual ~BlockDevice() {}
+};
+
+}
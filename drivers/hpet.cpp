@@ -0,0 +1,110 @@
+#include "hpet.h"
+#include "acpi.h"
+#include "pit.h"
+
+#include <kernel/asm.h>
+#include <kernel/atomic.h>
+#include <kernel/trace.h>
+#include <mm/mmio.h>
+
+namespace Kernel
+{
+
+Hpet::Hpet()
+    : BaseAddress(nullptr)
+    , Enabled(false)
+    , PeriodFs(0)
+    , Mult(0)
+    , CounterBase(0)
+    , TimeBase(0)
+{
+}
+
+Hpet::~Hpet()
+{
+}
+
+u64 Hpet::ReadReg(ulong offset)
+{
+    return Mm::MmIo::Read64(Stdlib::MemAdd(BaseAddress, offset));
+}
+
+void Hpet::WriteReg(ulong offset, u64 value)
+{
+    Mm::MmIo::Write64(Stdlib::MemAdd(BaseAddress, offset), value);
+}
+
+bool Hpet::Setup()
+{
+    BaseAddress = Acpi::GetInstance().GetHpetAddress();
+    if (BaseAddress == nullptr)
+    {
+        Trace(0, "Hpet: not present");
+        return false;
+    }
+
+    // only the first 4GB are identity mapped
+    if (reinterpret_cast<ulong>(BaseAddress) >= (1UL << 32))
+    {
+        Trace(0, "Hpet: addr 0x%p not mapped", BaseAddress);
+        return false;
+    }
+
+    u64 caps = ReadReg(CapsReg);
+    PeriodFs = caps >> CapsPeriodShift;
+    if (PeriodFs == 0 || PeriodFs > MaxPeriodFs || !(caps & CapsCounter64))
+    {
+        Trace(0, "Hpet: unusable caps 0x%p", caps);
+        return false;
+    }
+
+    Mult = (PeriodFs << MultShift) / FsInNs;
+
+    WriteReg(ConfigReg, ReadReg(ConfigReg) | ConfigEnable);
+
+    TimeBase = Pit::GetInstance().GetTime().GetValue();
+    CounterBase = ReadCounter();
+    Barrier();
+    Enabled = true;
+    Barrier();
+
+    Trace(0, "Hpet: addr 0x%p period fs %u timers %u",
+        BaseAddress, PeriodFs, ((caps >> 8) & 0x1F) + 1);
+    return true;
+}
+
+bool Hpet::IsEnabled()
+{
+    return Enabled;
+}
+
+ulong Hpet::GetPeriodFs()
+{
+    return PeriodFs;
+}
+
+u64 Hpet::ReadCounter()
+{
+    return ReadReg(CounterReg);
+}
+
+Stdlib::Time Hpet::GetTime()
+{
+    u64 delta = ReadCounter() - CounterBase;
+
+    return Stdlib::Time(TimeBase + (ulong)(((unsigned __int128)delta * Mult) >> MultShift));
+}
+
+void Hpet::Wait(ulong nanoSecs)
+{
+    u64 ticks = ((unsigned __int128)nanoSecs * FsInNs) / PeriodFs;
+    u64 start = ReadCounter();
+    SpinBackoff backoff;
+
+    while (ReadCounter() - start < ticks)
+    {
+        backoff.Pause();
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+// High precision event timer from the ACPI HPET table. The main counter
+// runs at a fixed rate independent of cpu frequency, so it backs boot time
+// and busy waits before the tsc is calibrated, and instead of the tsc when
+// that one is not invariant. The comparators are left unused, timer events
+// come from the lapic timer. Only 64-bit counters are used.
+class Hpet final
+{
+public:
+    static Hpet& GetInstance()
+    {
+        static Hpet Instance;
+        return Instance;
+    }
+
+    // starts the main counter, time continues from the pit
+    bool Setup();
+
+    bool IsEnabled();
+
+    u64 ReadCounter();
+
+    Stdlib::Time GetTime();
+
+    void Wait(ulong nanoSecs);
+
+    ulong GetPeriodFs();
+
+private:
+    Hpet();
+    ~Hpet();
+    Hpet(const Hpet& other) = delete;
+    Hpet(Hpet&& other) = delete;
+    Hpet& operator=(const Hpet& other) = delete;
+    Hpet& operator=(Hpet&& other) = delete;
+
+    u64 ReadReg(ulong offset);
+    void WriteReg(ulong offset, u64 value);
+
+    static const ulong CapsReg = 0x0;
+    static const ulong ConfigReg = 0x10;
+    static const ulong CounterReg = 0xF0;
+
+    static const u64 CapsCounter64 = (1UL << 13);
+    static const ulong CapsPeriodShift = 32;
+    // the spec caps the period at 100 ns
+    static const ulong MaxPeriodFs = 100000000;
+    static const ulong FsInNs = 1000000;
+
+    static const u64 ConfigEnable = (1UL << 0);
+
+    static const ulong MultShift = 32;
+
+    void* BaseAddress;
+    volatile bool Enabled;
+    ulong PeriodFs;
+    // ns = ticks * Mult >> MultShift
+    ulong Mult;
+    u64 CounterBase;
+    ulong TimeBase;
+};
+
+}
@@ -59,29 +59,41 @@ void IoApic::Enable()
     Trace(IoApicLL, "IO Apic ver 0x%p pins %u", ver, pins);
 }
 
+// the high dword goes first, so an entry retargeted while unmasked never
+// pairs the new vector with the old destination
 void IoApic::SetEntry(u8 index, u64 data)
 {
-    WriteRegister(RedTbl + 2 * index, (u32)data);
     WriteRegister(RedTbl + 2 * index + 1, (u32)(data >> 32));
+    WriteRegister(RedTbl + 2 * index, (u32)data);
 }
 
-void IoApic::SetIrq(u8 irq, u64 apicId, u8 vector)
+void IoApic::SetEntry(u8 irq, u8 vector, ulong delivMode, ulong destMode, u64 dest)
 {
     u64 data = 0;
 
     data |= vector; // interrupt vector
-    data |= DmFixed << DelivModeShift; // delivery mode: fixed
-    data |= 0 << DestModeShift; // destination: physical
+    data |= delivMode << DelivModeShift; // delivery mode
+    data |= destMode << DestModeShift; // destination mode
     data |= 0 << DelivStatusShift; // delivery status : relaxed
     data |= 0 << PolarityShift; // pin polarity: active high
     data |= TriggerEdge << TriggerModeShift; // trigger mode: edge
     data |= 0 << MaskedShift; // disable: no
-    data |= apicId << DestShift; //destination id
+    data |= dest << DestShift; //destination id
 
-    Trace(IoApicLL, "SetIrq irq 0x%p apicId 0x%p vector 0x%p data 0x%p",
-        (ulong)irq, (ulong)apicId, (ulong)vector, (ulong)data);
+    Trace(IoApicLL, "SetIrq irq 0x%p dest 0x%p mode %u vector 0x%p data 0x%p",
+        (ulong)irq, (ulong)dest, delivMode, (ulong)vector, (ulong)data);
 
     SetEntry(irq, data);
 }
 
-}
\ No newline at end of file
+void IoApic::SetIrq(u8 irq, u64 apicId, u8 vector)
+{
+    SetEntry(irq, vector, DmFixed, DestPhysical, apicId);
+}
+
+void IoApic::SetIrqLowestPriority(u8 irq, u8 logicalMask, u8 vector)
+{
+    SetEntry(irq, vector, DmLowest, DestLogical, logicalMask);
+}
+
+}
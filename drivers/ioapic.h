@@ -17,8 +17,13 @@ public:
 
     void Enable();
 
+    // fixed delivery to a single cpu
     void SetIrq(u8 irq, u64 apicId, u8 vector);
 
+    // lowest priority delivery to one of the cpus of a flat logical
+    // destination, the lapic with the lowest task priority takes the irq
+    void SetIrqLowestPriority(u8 irq, u8 logicalMask, u8 vector);
+
 private:
     IoApic();
     ~IoApic();
@@ -31,6 +36,7 @@ private:
     void WriteRegister(u8 reg, u32 value);
 
     void SetEntry(u8 index, u64 data);
+    void SetEntry(u8 irq, u8 vector, ulong delivMode, ulong destMode, u64 dest);
 
     static const ulong RegSel = 0x0;
     static const ulong RegWin = 0x10;
@@ -53,6 +59,10 @@ private:
     static const ulong TriggerLevel = 0;
 
     static const ulong DmFixed = 0x0;
+    static const ulong DmLowest = 0x1;
+
+    static const ulong DestPhysical = 0;
+    static const ulong DestLogical = 1;
 
     void *BaseAddress;
     SpinLock OpLock;
@@ -0,0 +1,228 @@
+#include "kvm.h"
+
+#include <kernel/asm.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <mm/page_table.h>
+
+namespace Kernel
+{
+
+Kvm::Kvm()
+    : Present(false)
+    , HasClock(false)
+    , HasSteal(false)
+    , HasPvEoi(false)
+    , HasUnhalt(false)
+    , Vmmcall(false)
+    , ClockEnabled(false)
+    , HostBase(0)
+    , TimeBase(0)
+    , LastClock(0)
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+    // "AuthenticAMD"
+    Vmmcall = (ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163) ? true : false;
+
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CpuidHypervisor))
+        return;
+
+    Cpuid(CpuidSignature, &eax, &ebx, &ecx, &edx);
+    // "KVMKVMKVM\0\0\0"
+    if (ebx != 0x4b4d564b || ecx != 0x564b4d56 || edx != 0x0000004d)
+        return;
+
+    if (eax < CpuidFeatures)
+        return;
+
+    Present = true;
+    Cpuid(CpuidFeatures, &eax, &ebx, &ecx, &edx);
+    HasClock = (eax & FeatureClockSource2) ? true : false;
+    HasSteal = (eax & FeatureStealTime) ? true : false;
+    HasPvEoi = (eax & FeaturePvEoi) ? true : false;
+    HasUnhalt = (eax & FeaturePvUnhalt) ? true : false;
+}
+
+Kvm::~Kvm()
+{
+}
+
+bool Kvm::IsPresent()
+{
+    return Present;
+}
+
+bool Kvm::HasPvUnhalt()
+{
+    return HasUnhalt;
+}
+
+void Kvm::KickCpu(ulong apicId)
+{
+    ulong ret;
+
+    if (Vmmcall)
+        asm volatile ("vmmcall" : "=a"(ret) : "a"(HypercallKickCpu), "b"(0UL), "c"(apicId) : "memory");
+    else
+        asm volatile ("vmcall" : "=a"(ret) : "a"(HypercallKickCpu), "b"(0UL), "c"(apicId) : "memory");
+}
+
+bool Kvm::InitCpu(KvmCpuArea& area)
+{
+    if (!Present)
+        return true;
+
+    auto& pt = Mm::PageTable::GetInstance();
+    PerCpu* perCpu = GetPerCpu();
+
+    Stdlib::MemSet(&area, 0, sizeof(area));
+
+    if (HasClock)
+    {
+        WriteMsr(MsrSystemTime, pt.VirtToPhys((ulong)&area.Clock) | MsrEnable);
+        area.ClockOn = true;
+    }
+
+    if (HasSteal)
+    {
+        WriteMsr(MsrStealTime, pt.VirtToPhys((ulong)&area.Steal) | MsrEnable);
+        area.StealOn = true;
+        perCpu->StealNs = area.Steal.Steal;
+    }
+
+    if (HasPvEoi)
+    {
+        WriteMsr(MsrPvEoi, pt.VirtToPhys((ulong)&area.PvEoi) | MsrEnable);
+        perCpu->PvEoi = &area.PvEoi;
+    }
+
+    perCpu->Kvm = &area;
+
+    Trace(0, "Cpu %u kvm clock %u steal %u pv eoi %u",
+        perCpu->Index, (ulong)HasClock, (ulong)HasSteal, (ulong)HasPvEoi);
+    return true;
+}
+
+u64 Kvm::ReadClock(const KvmPvClock& clock, u8& flags)
+{
+    const volatile KvmPvClock* c = &clock;
+    u32 version;
+    u64 ns;
+
+    do
+    {
+        version = c->Version;
+        Barrier();
+        u64 delta = ReadTsc() - c->TscTimestamp;
+        s8 shift = c->TscShift;
+        if (shift < 0)
+            delta >>= -shift;
+        else
+            delta <<= shift;
+        ns = c->SystemTime + (u64)(((unsigned __int128)delta * c->TscToSystemMul) >> 32);
+        flags = c->Flags;
+        Barrier();
+    } while ((version & 1) || version != c->Version);
+
+    return ns;
+}
+
+void Kvm::EnableClock()
+{
+    KvmCpuArea* area;
+    PER_CPU_READ(Kvm, area);
+    if (area == nullptr || !area->ClockOn)
+        return;
+
+    u8 flags;
+    TimeBase = GetBootTime().GetValue();
+    HostBase = ReadClock(area->Clock, flags);
+    Barrier();
+    ClockEnabled = true;
+    Barrier();
+
+    Trace(0, "Kvm: clock enabled flags 0x%p", (ulong)flags);
+}
+
+bool Kvm::GetTime(Stdlib::Time& time)
+{
+    if (!ClockEnabled)
+        return false;
+
+    u64 ns;
+    u8 flags;
+    for (;;)
+    {
+        // the clock must be the one of the cpu whose tsc was read
+        ulong index = GetPerCpuIndex();
+        KvmCpuArea* area;
+        PER_CPU_READ(Kvm, area);
+        if (area == nullptr || !area->ClockOn)
+            return false;
+
+        ns = ReadClock(area->Clock, flags);
+        if (GetPerCpuIndex() == index)
+            break;
+    }
+
+    // per-cpu clocks may be slightly apart, don't let time step back
+    if (!(flags & ClockTscStable))
+    {
+        u64 last = LastClock.Load(MemoryOrderRelaxed);
+        for (;;)
+        {
+            if (ns <= last)
+            {
+                ns = last;
+                break;
+            }
+
+            if (LastClock.CompareExchange(last, ns))
+                break;
+        }
+    }
+
+    if (ns < HostBase)
+        ns = HostBase;
+
+    time = Stdlib::Time(TimeBase + (ns - HostBase));
+    return true;
+}
+
+u64 Kvm::ConsumeSteal()
+{
+    KvmCpuArea* area;
+    PER_CPU_READ(Kvm, area);
+    if (area == nullptr || !area->StealOn)
+        return 0;
+
+    const volatile KvmStealTime* st = &area->Steal;
+    u32 version;
+    u64 steal;
+    do
+    {
+        version = st->Version;
+        Barrier();
+        steal = st->Steal;
+        Barrier();
+    } while ((version & 1) || version != st->Version);
+
+    PerCpu* perCpu = GetPerCpu();
+    u64 delta = steal - perCpu->StealNs;
+    perCpu->StealNs = steal;
+
+    ulong ticksPerMs = TscClock::GetInstance().GetTicksPerMs();
+    return (u64)(((unsigned __int128)delta * ticksPerMs) / Const::NanoSecsInMs);
+}
+
+void Kvm::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("kvm %u clock %u steal %u pv eoi %u pv unhalt %u clock source %u\n",
+        (ulong)Present, (ulong)HasClock, (ulong)HasSteal, (ulong)HasPvEoi, (ulong)HasUnhalt,
+        (ulong)ClockEnabled);
+}
+
+}
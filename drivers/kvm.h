@@ -0,0 +1,158 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include <kernel/atomic.h>
+#include <kernel/per_cpu.h>
+
+namespace Kernel
+{
+
+// kvmclock time info, the host updates it under an odd version
+struct KvmPvClock final
+{
+    u32 Version;
+    u32 Pad0;
+    u64 TscTimestamp;
+    u64 SystemTime;
+    u32 TscToSystemMul;
+    s8 TscShift;
+    u8 Flags;
+    u8 Pad1[2];
+} __attribute__((packed));
+
+static_assert(sizeof(KvmPvClock) == 32, "Invalid size");
+
+// ns the vcpu was runnable but not running, updated on every entry
+struct KvmStealTime final
+{
+    u64 Steal;
+    u32 Version;
+    u32 Flags;
+    u8 Preempted;
+    u8 Pad0[3];
+    u32 Pad1[11];
+} __attribute__((packed));
+
+static_assert(sizeof(KvmStealTime) == 64, "Invalid size");
+
+// Areas one cpu shares with the host, they live in its Cpu object and the
+// per-cpu area points at them once registered
+struct KvmCpuArea final
+{
+    KvmStealTime Steal __attribute__((aligned(Const::CacheLineSize)));
+    KvmPvClock Clock;
+    // bit 0 set by the host when the pending eoi needs no apic write
+    u32 PvEoi;
+    bool ClockOn;
+    bool StealOn;
+};
+
+// KVM paravirtual interfaces, detected through the hypervisor cpuid leaves
+// and turned on per cpu by InitCpu:
+// - kvmclock replaces the tsc as boot time source once EnableClock runs,
+//   the host keeps it correct across tsc frequency changes and migration
+// - steal time lets Task::UpdateRuntime leave out time the vcpu was
+//   preempted by the host
+// - PV EOI acks most interrupts with a bit clear instead of an apic write,
+//   which would exit
+class Kvm final
+{
+public:
+    static Kvm& GetInstance()
+    {
+        static Kvm Instance;
+        return Instance;
+    }
+
+    bool IsPresent();
+
+    // hlt with interrupts off is woken by KickCpu
+    bool HasPvUnhalt();
+
+    // wakes a vcpu halted in a paravirt spin lock wait
+    void KickCpu(ulong apicId);
+
+    // registers the areas of the current cpu, runs after it loads its
+    // per-cpu area
+    bool InitCpu(KvmCpuArea& area);
+
+    // switches boot time to kvmclock, continuing from the current time
+    void EnableClock();
+
+    // false until EnableClock or if the current cpu has no kvmclock
+    bool GetTime(Stdlib::Time& time);
+
+    // tsc ticks stolen from the current cpu since the last call, runs with
+    // interrupts or preemption off
+    u64 ConsumeSteal();
+
+    // acks the interrupt in service through PV EOI, false if the apic
+    // must be written. The host only writes the word while the vcpu is
+    // out, so the bit clear needs no lock prefix
+    static bool PvEoi()
+    {
+        u32* pvEoi;
+        bool acked;
+
+        PER_CPU_READ(PvEoi, pvEoi);
+        if (pvEoi == nullptr)
+            return false;
+
+        asm volatile ("btrl $0, %1\n\t"
+                      "setc %0"
+            : "=q"(acked), "+m"(*pvEoi)
+            :
+            : "memory", "cc");
+        return acked;
+    }
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    Kvm();
+    ~Kvm();
+    Kvm(const Kvm& other) = delete;
+    Kvm(Kvm&& other) = delete;
+    Kvm& operator=(const Kvm& other) = delete;
+    Kvm& operator=(Kvm&& other) = delete;
+
+    static u64 ReadClock(const KvmPvClock& clock, u8& flags);
+
+    static const u32 CpuidSignature = 0x40000000;
+    static const u32 CpuidFeatures = 0x40000001;
+    static const u32 CpuidHypervisor = (1U << 31);
+
+    static const u32 FeatureClockSource2 = (1U << 3);
+    static const u32 FeatureStealTime = (1U << 5);
+    static const u32 FeaturePvEoi = (1U << 6);
+    static const u32 FeaturePvUnhalt = (1U << 7);
+
+    static const ulong HypercallKickCpu = 5;
+
+    static const u32 MsrSystemTime = 0x4b564d01;
+    static const u32 MsrStealTime = 0x4b564d03;
+    static const u32 MsrPvEoi = 0x4b564d04;
+    static const u64 MsrEnable = 1;
+
+    // every cpu's clock agrees, no need to keep the global maximum
+    static const u8 ClockTscStable = (1U << 0);
+
+    bool Present;
+    bool HasClock;
+    bool HasSteal;
+    bool HasPvEoi;
+    bool HasUnhalt;
+    // AMD cpus use vmmcall for hypercalls
+    bool Vmmcall;
+    volatile bool ClockEnabled;
+    u64 HostBase;
+    ulong TimeBase;
+    // last time returned while some clock was not tsc stable
+    AtomicValue<u64> LastClock;
+};
+
+}
@@ -1,5 +1,8 @@
 #include "lapic.h"
 #include "acpi.h"
+#include "pit.h"
+#include "hpet.h"
+#include "kvm.h"
 
 #include <kernel/trace.h>
 #include <kernel/asm.h>
@@ -8,6 +11,9 @@
 namespace Kernel
 {
 
+ulong Lapic::TimerTicksPerMs = 0;
+bool Lapic::X2Apic = false;
+
 void* Lapic::GetRegBase(ulong index)
 {
     return Stdlib::MemAdd(Acpi::GetInstance().GetLapicAddress(), index * 0x10);
@@ -15,31 +21,77 @@ void* Lapic::GetRegBase(ulong index)
 
 u32 Lapic::ReadReg(ulong index)
 {
+    if (X2Apic)
+        return static_cast<u32>(ReadMsr(X2ApicMsrBase + index));
+
     return Mm::MmIo::Read32(GetRegBase(index));
 }
 
 void Lapic::WriteReg(ulong index, u32 value)
 {
+    if (X2Apic)
+    {
+        WriteMsr(X2ApicMsrBase + index, value);
+        return;
+    }
+
     Mm::MmIo::Write32(GetRegBase(index), value);
     Barrier();
 }
 
+bool Lapic::HasX2Apic()
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & CpuidX2Apic) ? true : false;
+}
+
+bool Lapic::IsX2Apic()
+{
+    return X2Apic;
+}
+
+u8 Lapic::GetFlatLogicalId(ulong apicId)
+{
+    if (X2Apic || apicId >= FlatLogicalCpus)
+        return 0;
+
+    return static_cast<u8>(1 << apicId);
+}
+
 void Lapic::Enable()
 {
     ulong msr = ReadMsr(BaseMsr);
 
     Trace(LapicLL, "Lapic: msr 0x%p", msr);
 
-    WriteReg(DfrIndex, 0xffffffff);// Flat mode
-    WriteReg(LdrIndex, 0x01000000);// All cpus use logical id 1
+    if (HasX2Apic())
+    {
+        WriteMsr(BaseMsr, msr | BaseEnable | BaseX2ApicEnable);
+        X2Apic = true;
+    }
+
+    // x2apic has no dfr and a read-only ldr, it always uses cluster mode
+    if (!X2Apic)
+    {
+        WriteReg(DfrIndex, 0xffffffff);// Flat mode
+        // one logical id bit per cpu, so io apic entries can name a set of
+        // cpus for lowest priority delivery
+        WriteReg(LdrIndex, static_cast<u32>(GetFlatLogicalId(GetApicId())) << 24);
+    }
     WriteReg(TprIndex, 0xFF);// Disable all interrupts
     WriteReg(SpIvIndex, 0x1FF);
 
-    Trace(LapicLL, "Lapic: tpr 0x%p dfr 0x%p ldr 0x%p spiv 0x%p",
-        (ulong)ReadReg(TprIndex), (ulong)ReadReg(DfrIndex), (ulong)ReadReg(LdrIndex), (ulong)ReadReg(SpIvIndex));
+    Trace(LapicLL, "Lapic: x2apic %u tpr 0x%p ldr 0x%p spiv 0x%p",
+        (ulong)X2Apic, (ulong)ReadReg(TprIndex), (ulong)ReadReg(LdrIndex), (ulong)ReadReg(SpIvIndex));
 
     Trace(LapicLL, "Lapic: apicId 0x%p", (ulong)GetApicId());
 
+    WriteReg(LvtTimerIndex, LvtMasked);
+    WriteReg(LvtPerfIndex, LvtMasked);
+    WriteReg(TimerDivIndex, TimerDivBy16);
+
     WriteReg(EoiIndex, 0x0); // Acknowledge any outstanding interrupts
 
     WriteReg(TprIndex, 0x0);// Clear task priority to enable all interrupts
@@ -55,35 +107,62 @@ bool Lapic::CheckIsr(u8 vector)
 
 void Lapic::EOI()
 {
+    if (Kvm::PvEoi())
+        return;
+
     WriteReg(EoiIndex, 0x0);
 }
 
 void Lapic::EOI(u8 vector)
 {
-    if (CheckIsr(vector))
+    // the host sets the pv eoi bit only for the vector it just injected
+    if (Kvm::PvEoi())
+        return;
+
+    // handlers only ack their own vector, so skip the isr read which is
+    // another msr exit under virtualization
+    if (X2Apic || CheckIsr(vector))
         WriteReg(EoiIndex, 0x0);
 }
 
 u8 Lapic::GetApicId()
 {
+    if (X2Apic)
+        return static_cast<u8>(ReadReg(ApicIdIndex));
+
     return ReadReg(ApicIdIndex) >> 24;
 }
 
-void Lapic::SendInit(u32 apicId)
+u8 Lapic::GetInitialApicId()
 {
-    WriteReg(IcrHighIndex, apicId << IcrDestinationShift);
-    WriteReg(IcrLowIndex, IcrInit | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
+    u32 eax, ebx, ecx, edx;
 
-    while (ReadReg(IcrLowIndex) & IcrSendPending)
-    {
-        Pause();
-    }
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    return static_cast<u8>(ebx >> 24);
+}
+
+void Lapic::SendInit(u32 apicId)
+{
+    SendIcr(apicId, IcrInit | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
 }
 
 void Lapic::SendStartup(u32 apicId, u32 vector)
 {
+    SendIcr(apicId, vector | IcrStartup | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
+}
+
+void Lapic::SendIcr(u32 apicId, u32 low)
+{
+    if (X2Apic)
+    {
+        // one write sends it, there is no delivery status to poll
+        WrmsrFence();
+        WriteMsr(X2ApicMsrBase + IcrLowIndex, ((u64)apicId << 32) | low);
+        return;
+    }
+
     WriteReg(IcrHighIndex, apicId << IcrDestinationShift);
-    WriteReg(IcrLowIndex, vector | IcrStartup | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
+    WriteReg(IcrLowIndex, low);
 
     while (ReadReg(IcrLowIndex) & IcrSendPending)
     {
@@ -93,13 +172,79 @@ void Lapic::SendStartup(u32 apicId, u32 vector)
 
 void Lapic::SendIPI(u32 apicId, u32 vector)
 {
-    WriteReg(IcrHighIndex, apicId << IcrDestinationShift);
-    WriteReg(IcrLowIndex, vector | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
+    SendIcr(apicId, vector | IcrPhysical | IcrAssert | IcrEdge | IcrNoShorthand);
+}
 
-    while (ReadReg(IcrLowIndex) & IcrSendPending)
+void Lapic::SendIPIAllExcludingSelf(u32 vector)
+{
+    SendIcr(0, vector | IcrPhysical | IcrAssert | IcrEdge | IcrAllExcludingSelf);
+}
+
+void Lapic::SendIPIAllIncludingSelf(u32 vector)
+{
+    SendIcr(0, vector | IcrPhysical | IcrAssert | IcrEdge | IcrAllIncludingSelf);
+}
+
+void Lapic::CalibrateTimer()
+{
+    auto& pit = Pit::GetInstance();
+    auto& hpet = Hpet::GetInstance();
+
+    // start counting right after pit tick, the hpet counts continuously
+    if (!hpet.IsEnabled())
     {
-        Pause();
+        auto start = pit.GetTime();
+        while (pit.GetTime() == start)
+        {
+            Pause();
+        }
     }
+
+    WriteReg(LvtTimerIndex, LvtMasked);
+    WriteReg(TimerInitCountIndex, 0xFFFFFFFF);
+
+    if (hpet.IsEnabled())
+        hpet.Wait(TimerCalibrateMs * Const::NanoSecsInMs);
+    else
+        pit.Wait(TimerCalibrateMs * Const::NanoSecsInMs);
+
+    u32 elapsed = 0xFFFFFFFF - ReadReg(TimerCurrCountIndex);
+    WriteReg(TimerInitCountIndex, 0);
+
+    TimerTicksPerMs = elapsed / TimerCalibrateMs;
+
+    Trace(LapicLL, "Lapic: timer ticks per ms %u", TimerTicksPerMs);
+}
+
+bool Lapic::SetTimer(u8 vector, ulong nanoSecs)
+{
+    if (TimerTicksPerMs == 0)
+        return false;
+
+    ulong ticks = (nanoSecs / Const::NanoSecsInUsec) * TimerTicksPerMs / 1000;
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > 0xFFFFFFFF)
+        ticks = 0xFFFFFFFF;
+
+    WriteReg(LvtTimerIndex, vector); // one-shot
+    WriteReg(TimerInitCountIndex, ticks);
+    return true;
+}
+
+void Lapic::StopTimer()
+{
+    WriteReg(TimerInitCountIndex, 0);
+}
+
+void Lapic::SetPerfVector(u8 vector)
+{
+    WriteReg(LvtPerfIndex, vector); // fixed delivery, unmasked
+}
+
+void Lapic::MaskPerf()
+{
+    WriteReg(LvtPerfIndex, LvtMasked);
 }
 
 }
\ No newline at end of file
@@ -6,6 +6,9 @@
 namespace Kernel
 {
 
+// Uses x2APIC mode (registers are MSRs, ICR is one 64-bit write without
+// delivery status) when the cpu supports it, xAPIC MMIO otherwise. Every cpu
+// has to call Enable before anything else touches its lapic.
 class Lapic final
 {
 public:
@@ -18,12 +21,37 @@ public:
 
     static u8 GetApicId();
 
+    // from cpuid, usable before Enable
+    static u8 GetInitialApicId();
+
     static void SendInit(u32 apicId);
 
     static void SendStartup(u32 apicId, u32 vector);
 
     static void SendIPI(u32 apicId, u32 vector);
 
+    // single ICR write with a destination shorthand
+    static void SendIPIAllExcludingSelf(u32 vector);
+    static void SendIPIAllIncludingSelf(u32 vector);
+
+    static void CalibrateTimer();
+
+    static bool SetTimer(u8 vector, ulong nanoSecs);
+
+    static void StopTimer();
+
+    // counter overflow interrupts, masked again by every delivery on some cpus
+    static void SetPerfVector(u8 vector);
+    static void MaskPerf();
+
+    static bool IsX2Apic();
+
+    // logical id bit of a cpu in xAPIC flat mode, zero if it has none
+    // (x2APIC mode or an apic id beyond the 8 bits of the flat ldr)
+    static u8 GetFlatLogicalId(ulong apicId);
+
+    static const ulong FlatLogicalCpus = 8;
+
 private:
     Lapic() = delete;
     ~Lapic() = delete;
@@ -36,6 +64,8 @@ private:
     static void WriteReg(ulong index, u32 value);
     static void* GetRegBase(ulong index);
     static bool CheckIsr(u8 vector);
+    static void SendIcr(u32 apicId, u32 low);
+    static bool HasX2Apic();
 
     static const ulong ApicIdIndex = 2;
     static const ulong TprIndex = 0x8;
@@ -48,6 +78,16 @@ private:
     static const ulong IcrLowIndex = 0x30;
     static const ulong IcrHighIndex = 0x31;
 
+    static const ulong LvtTimerIndex = 0x32;
+    static const ulong TimerInitCountIndex = 0x38;
+    static const ulong TimerCurrCountIndex = 0x39;
+    static const ulong TimerDivIndex = 0x3E;
+    static const ulong LvtPerfIndex = 0x34;
+
+    static const u32 LvtMasked = 0x10000;
+    static const u32 TimerDivBy16 = 0x3;
+    static const ulong TimerCalibrateMs = 50;
+
     static const u32 IcrFixed = 0x0;
     static const u32 IcrLowest = 0x100;
     static const u32 IcrSmi = 0x200;
@@ -69,6 +109,13 @@ private:
     static const u32 IcrDestinationShift = 24;
 
     static const ulong BaseMsr = 0x1B;
+    static const ulong BaseEnable = 0x800;
+    static const ulong BaseX2ApicEnable = 0x400;
+    static const u32 X2ApicMsrBase = 0x800;
+    static const u32 CpuidX2Apic = (1 << 21);
+
+    static ulong TimerTicksPerMs;
+    static bool X2Apic;
 
 };
 
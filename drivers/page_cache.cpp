@@ -0,0 +1,682 @@
+#include "page_cache.h"
+
+#include <kernel/panic.h>
+#include <kernel/parameters.h>
+#include <kernel/sched.h>
+#include <kernel/trace.h>
+#include <mm/page_allocator.h>
+#include <mm/object_pool.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+CachePage::CachePage()
+    : Data(static_cast<u8*>(Mm::PageAllocatorImpl::GetInstance().Alloc(1)))
+    , Key(0)
+    , Device(0)
+    , Block(0)
+    , Referenced(false)
+{
+    Stdlib::MemSet(&Req, 0, sizeof(Req));
+}
+
+CachePage::~CachePage()
+{
+    if (Data != nullptr)
+        Mm::PageAllocatorImpl::GetInstance().Free(Data);
+}
+
+void CachePage::Recycle()
+{
+    Key = 0;
+    Device = 0;
+    Block = 0;
+    Refs.Set(0);
+    Flags.Set(0);
+    Busy.Set(0);
+    Referenced = false;
+    Stdlib::MemSet(&Req, 0, sizeof(Req));
+}
+
+PageCache::PageCache()
+    : MaxPages(0)
+{
+    Mm::ShrinkerTable::GetInstance().Register(*this, "pagecache");
+    ClockList.Init();
+    for (size_t i = 0; i < MaxDevices; i++)
+    {
+        Device& d = Devices[i];
+        d.Dev = nullptr;
+        d.Blocks = 0;
+        d.RaMax = 0;
+        d.RaNext = 0;
+        d.RaEnd = 0;
+        d.RaWindow = 0;
+        d.DirtyList.Init();
+        d.DirtyCount = 0;
+    }
+}
+
+PageCache::~PageCache()
+{
+}
+
+ulong PageCache::AddDevice(BlockDevice& dev)
+{
+    Stdlib::AutoLock lock(DeviceLock);
+
+    ulong count = static_cast<ulong>(DeviceCount.Get());
+    for (ulong i = 0; i < count; i++)
+    {
+        if (Devices[i].Dev == &dev)
+            return i;
+    }
+
+    if (count == MaxDevices)
+        return MaxDevices;
+
+    Device& d = Devices[count];
+    d.Dev = &dev;
+    d.Blocks = dev.GetCapacity() / SectorsPerBlock;
+    d.ReadOnly = dev.IsReadOnly();
+    d.RaMax = Parameters::GetInstance().GetReadahead();
+    if (d.RaMax > MaxReadahead)
+        d.RaMax = MaxReadahead;
+    d.WritebackWork.Init(&PageCache::WritebackFunc, &d);
+
+    if (MaxPages == 0)
+        MaxPages = Mm::PageAllocatorImpl::GetInstance().GetTotalPages() / MaxPagesDivisor;
+
+    // lookups check the id against the count without the lock
+    DeviceCount.Set(count + 1);
+    Trace(0, "PageCache: dev %u blocks %u readahead %u", count, d.Blocks, d.RaMax);
+    return count;
+}
+
+bool PageCache::TryRef(CachePage* page)
+{
+    for (;;)
+    {
+        long refs = page->Refs.Get();
+        if (refs == 0)
+            return false;
+
+        if (page->Refs.Cmpxchg(refs + 1, refs) == refs)
+            return true;
+    }
+}
+
+void PageCache::Put(CachePage* page)
+{
+    // the table keeps a reference until the page is evicted
+    BugOn(page->Refs.DecAndTest());
+}
+
+void PageCache::EndIo(CachePage* page, bool ok)
+{
+    if (ok)
+        page->Flags.SetBit(FlagUptodate);
+
+    // waiters hold references, Busy keeps eviction away until the end
+    page->Flags.ClearBit(FlagIo);
+    page->Waiters.WakeUpAll();
+    page->Busy.Dec();
+}
+
+void PageCache::WaitIo(CachePage* page)
+{
+    for (;;)
+    {
+        page->Waiters.Prepare();
+        if (!page->Flags.TestBit(FlagIo))
+        {
+            page->Waiters.Finish();
+            break;
+        }
+        page->Waiters.Wait();
+    }
+}
+
+void PageCache::ReqDone(BlkRequest* req)
+{
+    auto page = static_cast<CachePage*>(req->Ctx);
+
+    if (!req->Ok)
+    {
+        page->Flags.SetBit(FlagError);
+        GetInstance().IoErrors.Inc();
+    }
+
+    EndIo(page, req->Ok);
+}
+
+void PageCache::Destroy(CachePage* page)
+{
+    Mm::CachedObjectPool<CachePage>::GetInstance().Delete(page);
+}
+
+bool PageCache::TryEvict(CachePage* page)
+{
+    if (page->Busy.Get() != 0 || page->Flags.TestBit(FlagDirty))
+        return false;
+
+    if (page->Refs.Cmpxchg(0, 1) != 1)
+        return false;
+
+    // io may have started before the last reference was dropped
+    if (page->Busy.Get() != 0 || page->Flags.TestBit(FlagDirty))
+    {
+        page->Refs.Set(1);
+        return false;
+    }
+
+    return true;
+}
+
+size_t PageCache::Shrink(size_t count)
+{
+    Stdlib::ListEntry victims;
+    size_t freed = 0;
+
+    {
+        Stdlib::AutoLock lock(ClockLock);
+
+        // every page gets its second chance at most once
+        size_t scan = 2 * static_cast<size_t>(PageCount.Get());
+        while (freed < count && scan != 0 && !ClockList.IsEmpty())
+        {
+            scan--;
+            Stdlib::ListEntry* entry = ClockList.RemoveHead();
+            CachePage* page = CONTAINING_RECORD(entry, CachePage, ClockLink);
+            if (page->Referenced)
+            {
+                page->Referenced = false;
+                ClockList.InsertTail(entry);
+                continue;
+            }
+
+            if (!TryEvict(page))
+            {
+                ClockList.InsertTail(entry);
+                continue;
+            }
+
+            victims.InsertTail(entry);
+            freed++;
+        }
+    }
+
+    while (!victims.IsEmpty())
+    {
+        CachePage* page = CONTAINING_RECORD(victims.RemoveHead(), CachePage, ClockLink);
+        Table.Remove(page->Key);
+        PageCount.Dec();
+        Evictions.Inc();
+        Destroy(page);
+    }
+
+    return freed;
+}
+
+size_t PageCache::CountPages()
+{
+    // recycled pages keep their data page while parked in the pool caches
+    return static_cast<size_t>(PageCount.Get()) +
+        Mm::CachedObjectPool<CachePage>::GetInstance().GetCachedCount();
+}
+
+size_t PageCache::ShrinkPages(size_t pageCount)
+{
+    size_t freed = Shrink(pageCount);
+    if (freed < pageCount)
+        freed += Mm::CachedObjectPool<CachePage>::GetInstance().DrainAll();
+
+    return freed;
+}
+
+void PageCache::Reclaim()
+{
+    // memory pressure comes through ShrinkPages, the limit is polled on
+    // the miss path
+    if (static_cast<size_t>(PageCount.Get()) < MaxPages)
+        return;
+
+    Shrink(ReclaimBatch);
+}
+
+CachePage* PageCache::FindOrCreate(ulong dev, u64 block, bool& created)
+{
+    u64 key = (static_cast<u64>(dev) << KeyDeviceShift) | block;
+    SpinBackoff backoff;
+
+    created = false;
+    for (;;)
+    {
+        CachePage* page = nullptr;
+        bool found = Table.Find(key, [&page](CachePage*& entry)
+        {
+            if (TryRef(entry))
+                page = entry;
+        });
+        if (page != nullptr)
+            return page;
+
+        // being evicted, gone from the table shortly
+        if (found)
+        {
+            backoff.Pause();
+            continue;
+        }
+
+        Reclaim();
+
+        page = Mm::CachedObjectPool<CachePage>::GetInstance().New();
+        if (page == nullptr)
+            return nullptr;
+
+        // not worth caching without its data page
+        if (page->Data == nullptr)
+        {
+            Mm::ObjectPool<CachePage>::GetInstance().Delete(page);
+            return nullptr;
+        }
+
+        // the creator fills it: reads it or overwrites it
+        page->Key = key;
+        page->Device = dev;
+        page->Block = block;
+        page->Refs.Set(2);
+        page->Flags.SetBit(FlagIo);
+        page->Busy.Set(1);
+        page->Referenced = false;
+
+        if (Table.Insert(key, page))
+        {
+            Stdlib::AutoLock lock(ClockLock);
+            ClockList.InsertTail(&page->ClockLink);
+            PageCount.Inc();
+            created = true;
+            return page;
+        }
+
+        Destroy(page);
+
+        // lost a race to another creator, or the table is out of memory
+        if (!Table.Find(key, [](CachePage*& entry) { (void)entry; }))
+            return nullptr;
+    }
+}
+
+void PageCache::SubmitIo(ulong dev, CachePage** pages, size_t count, u32 type, bool retry)
+{
+    Device& d = Devices[dev];
+    BlkRequest* reqs[SubmitChunk];
+    size_t submitted = 0;
+
+    while (submitted < count)
+    {
+        size_t batch = count - submitted;
+        if (batch > SubmitChunk)
+            batch = SubmitChunk;
+        for (size_t i = 0; i < batch; i++)
+        {
+            CachePage* page = pages[submitted + i];
+            page->Flags.ClearBit(FlagError);
+
+            BlkRequest& req = page->Req;
+            req.Type = type;
+            req.Sector = page->Block * SectorsPerBlock;
+            req.Buf = page->Data;
+            req.Sectors = SectorsPerBlock;
+            req.Done = &PageCache::ReqDone;
+            req.Ctx = page;
+            reqs[i] = &req;
+        }
+
+        size_t queued = d.Dev->Submit(reqs, batch);
+        submitted += queued;
+        if (queued == batch)
+            continue;
+
+        // waiting won't make the device take it, fail it and go on
+        if (!d.Dev->IsValid(*reqs[queued]))
+        {
+            reqs[queued]->Ok = false;
+            ReqDone(reqs[queued]);
+            submitted++;
+            continue;
+        }
+
+        // readahead isn't worth waiting for, the pages stay not uptodate
+        // and Get reads them again
+        if (!retry)
+        {
+            for (size_t i = submitted; i < count; i++)
+                EndIo(pages[i], false);
+            break;
+        }
+
+        // the device is full, let completions make room
+        Sleep(Const::NanoSecsInMs);
+    }
+}
+
+void PageCache::Readahead(ulong dev, u64 start, ulong count, u64 mark)
+{
+    Device& d = Devices[dev];
+    CachePage* pages[SubmitChunk];
+    size_t batch = 0;
+
+    if (start >= d.Blocks)
+        return;
+
+    if (count > d.Blocks - start)
+        count = d.Blocks - start;
+
+    for (u64 block = start; block < start + count; block++)
+    {
+        bool created;
+        CachePage* page = FindOrCreate(dev, block, created);
+        if (page == nullptr)
+            break;
+
+        if (block == mark)
+            page->Flags.SetBit(FlagReadahead);
+
+        if (!created)
+        {
+            Put(page);
+            continue;
+        }
+
+        pages[batch++] = page;
+        if (batch == SubmitChunk)
+        {
+            SubmitIo(dev, pages, batch, BlkRequest::TypeRead, false);
+            ReadaheadPages.ReadAndAdd(batch);
+            // the io holds them through Busy
+            for (size_t i = 0; i < batch; i++)
+                Put(pages[i]);
+            batch = 0;
+        }
+    }
+
+    if (batch != 0)
+    {
+        SubmitIo(dev, pages, batch, BlkRequest::TypeRead, false);
+        ReadaheadPages.ReadAndAdd(batch);
+        for (size_t i = 0; i < batch; i++)
+            Put(pages[i]);
+    }
+}
+
+CachePage* PageCache::GetPage(ulong dev, u64 block, bool read, bool& created)
+{
+    created = false;
+    if (dev >= static_cast<ulong>(DeviceCount.Get()))
+        return nullptr;
+
+    Device& d = Devices[dev];
+    if (block >= d.Blocks)
+        return nullptr;
+
+    CachePage* page = FindOrCreate(dev, block, created);
+    if (page == nullptr)
+        return nullptr;
+
+    u64 raStart = 0;
+    ulong raCount = 0;
+    u64 raMark = 0;
+    {
+        Stdlib::AutoLock lock(d.RaLock);
+
+        if (created && read)
+        {
+            if (block == d.RaNext && d.RaMax != 0)
+            {
+                d.RaWindow = (d.RaWindow == 0) ? InitialWindow : 2 * d.RaWindow;
+                d.RaWindow = Stdlib::Min(d.RaWindow, d.RaMax);
+                raStart = block + 1;
+                raCount = d.RaWindow;
+                raMark = raStart + raCount / 2;
+                d.RaEnd = raStart + raCount;
+            }
+            else
+            {
+                d.RaWindow = 0;
+            }
+        }
+        else if (!created && page->Flags.TestAndClearBit(FlagReadahead) && d.RaWindow != 0)
+        {
+            // the reader entered the last window, fetch the one after it
+            d.RaWindow = Stdlib::Min(2 * d.RaWindow, d.RaMax);
+            raStart = d.RaEnd;
+            raCount = d.RaWindow;
+            raMark = raStart;
+            d.RaEnd = raStart + raCount;
+        }
+
+        d.RaNext = block + 1;
+    }
+
+    page->Referenced = true;
+    if (created)
+    {
+        Misses.Inc();
+        if (read)
+            SubmitIo(dev, &page, 1, BlkRequest::TypeRead, true);
+    }
+    else
+    {
+        Hits.Inc();
+
+        // an earlier read failed or was dropped, try again
+        if (!page->Flags.TestBit(FlagUptodate) && !page->Flags.TestAndSetBit(FlagIo))
+        {
+            if (page->Flags.TestBit(FlagUptodate))
+            {
+                page->Flags.ClearBit(FlagIo);
+                page->Waiters.WakeUpAll();
+            }
+            else
+            {
+                page->Busy.Inc();
+                SubmitIo(dev, &page, 1, BlkRequest::TypeRead, true);
+            }
+        }
+    }
+
+    if (raCount != 0)
+        Readahead(dev, raStart, raCount, raMark);
+
+    // a new page the caller overwrites stays in io until it calls EndIo
+    if (created && !read)
+        return page;
+
+    WaitIo(page);
+    if (!page->Flags.TestBit(FlagUptodate))
+    {
+        Put(page);
+        return nullptr;
+    }
+
+    return page;
+}
+
+CachePage* PageCache::Get(ulong dev, u64 block)
+{
+    bool created;
+    return GetPage(dev, block, true, created);
+}
+
+void PageCache::MarkDirty(CachePage* page)
+{
+    if (page->Flags.TestAndSetBit(FlagDirty))
+        return;
+
+    Device& d = Devices[page->Device];
+
+    // the dirty list holds a reference until the page is written
+    page->Refs.Inc();
+    {
+        Stdlib::AutoLock lock(d.DirtyLock);
+        d.DirtyList.InsertTail(&page->DirtyLink);
+        d.DirtyCount++;
+    }
+
+    WorkQueue::GetInstance().Queue(d.WritebackWork);
+}
+
+bool PageCache::Read(ulong dev, u64 offset, void* buf, size_t len)
+{
+    u8* dst = static_cast<u8*>(buf);
+
+    while (len != 0)
+    {
+        size_t off = offset % BlockSize;
+        size_t chunk = Stdlib::Min(BlockSize - off, len);
+
+        CachePage* page = Get(dev, offset / BlockSize);
+        if (page == nullptr)
+            return false;
+
+        Stdlib::MemCpy(dst, page->Data + off, chunk);
+        Put(page);
+
+        dst += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+bool PageCache::Write(ulong dev, u64 offset, const void* buf, size_t len)
+{
+    const u8* src = static_cast<const u8*>(buf);
+
+    // dirty blocks of a read-only device could never be written back
+    if (dev >= static_cast<ulong>(DeviceCount.Get()) || Devices[dev].ReadOnly)
+        return false;
+
+    while (len != 0)
+    {
+        size_t off = offset % BlockSize;
+        size_t chunk = Stdlib::Min(BlockSize - off, len);
+        bool whole = (chunk == BlockSize);
+
+        bool created;
+        CachePage* page = GetPage(dev, offset / BlockSize, !whole, created);
+        if (page == nullptr)
+            return false;
+
+        Stdlib::MemCpy(page->Data + off, src, chunk);
+        if (created && whole)
+            EndIo(page, true);
+
+        MarkDirty(page);
+        Put(page);
+
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+bool PageCache::Writeback(ulong dev)
+{
+    Device& d = Devices[dev];
+    bool ok = true;
+
+    for (;;)
+    {
+        CachePage* pages[WritebackChunk];
+        size_t count = 0;
+        {
+            Stdlib::AutoLock lock(d.DirtyLock);
+            while (count < WritebackChunk && !d.DirtyList.IsEmpty())
+            {
+                pages[count++] = CONTAINING_RECORD(d.DirtyList.RemoveHead(), CachePage, DirtyLink);
+                d.DirtyCount--;
+            }
+        }
+
+        if (count == 0)
+            break;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            CachePage* page = pages[i];
+
+            // one write of a page in flight at a time keeps them in order
+            while (page->Flags.TestAndSetBit(FlagIo))
+                WaitIo(page);
+
+            page->Busy.Inc();
+            // changes from here on dirty it again
+            page->Flags.ClearBit(FlagDirty);
+        }
+
+        SubmitIo(dev, pages, count, BlkRequest::TypeWrite, true);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            WaitIo(pages[i]);
+            if (pages[i]->Flags.TestAndClearBit(FlagError))
+                ok = false;
+            Put(pages[i]);
+        }
+
+        Writebacks.ReadAndAdd(count);
+    }
+
+    return ok;
+}
+
+void PageCache::WritebackFunc(void* ctx)
+{
+    auto& cache = GetInstance();
+    auto d = static_cast<Device*>(ctx);
+
+    if (!cache.Writeback(static_cast<ulong>(d - cache.Devices)))
+        Trace(0, "PageCache: writeback failed");
+}
+
+bool PageCache::Sync(ulong dev)
+{
+    if (dev >= static_cast<ulong>(DeviceCount.Get()))
+        return false;
+
+    bool ok = Writeback(dev);
+    if (!Devices[dev].Dev->Flush())
+        ok = false;
+
+    return ok;
+}
+
+size_t PageCache::GetPageCount()
+{
+    return static_cast<size_t>(PageCount.Get());
+}
+
+void PageCache::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("pages %u cached %u max %u hits %u misses %u readahead %u\n",
+        PageCount.Get(), Mm::CachedObjectPool<CachePage>::GetInstance().GetCachedCount(),
+        MaxPages, Hits.Get(), Misses.Get(), ReadaheadPages.Get());
+    printer.Printf("evictions %u writebacks %u errors %u\n",
+        Evictions.Get(), Writebacks.Get(), IoErrors.Get());
+
+    ulong count = static_cast<ulong>(DeviceCount.Get());
+    for (ulong i = 0; i < count; i++)
+    {
+        Device& d = Devices[i];
+        printer.Printf("dev %u blocks %u window %u/%u dirty %u\n",
+            i, d.Blocks, d.RaWindow, d.RaMax, d.DirtyCount);
+    }
+}
+
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "block_device.h"
+
+#include <include/const.h>
+#include <kernel/atomic.h>
+#include <kernel/rw_spin_lock.h>
+#include <kernel/spin_lock.h>
+#include <kernel/wait_queue.h>
+#include <kernel/work_queue.h>
+#include <lib/hash_table.h>
+#include <lib/list_entry.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+#include <mm/shrinker.h>
+
+namespace Kernel
+{
+
+// One cached block of a device, a page from the page allocator the device
+// reads and writes in place. Pages come from a CachedObjectPool, so an
+// evicted page keeps its data page for the next block it caches
+struct CachePage final
+{
+    // Data is nullptr if the page allocator is out of memory
+    CachePage();
+    ~CachePage();
+
+    // forgets the block, keeps Data
+    void Recycle();
+
+    u8* Data;
+
+    // owned by the cache
+    u64 Key;
+    ulong Device;
+    u64 Block;
+    // the table, every Get, the dirty list; 0 once it is being evicted
+    Atomic Refs;
+    Atomic Flags;
+    // io in flight until its completion is done with the page
+    Atomic Busy;
+    // CLOCK bit, set by hits
+    volatile bool Referenced;
+    BlkRequest Req;
+    WaitQueue Waiters;
+    Stdlib::ListEntry ClockLink;
+    Stdlib::ListEntry DirtyLink;
+};
+
+// Page sized blocks of block devices kept in memory, indexed by (device,
+// block) in a striped hash table. Misses read the block together with a
+// readahead window that doubles while the reader stays sequential; a marked
+// page inside the window prefetches the next one asynchronously when the
+// reader reaches it, so a sequential stream keeps the device busy. Written
+// pages are written back by a worker task. Clean unreferenced pages are
+// evicted in CLOCK order once the cache is over its limit or the page
+// allocator asks its shrinkers for memory.
+class PageCache final : public Mm::Shrinker
+{
+public:
+    static PageCache& GetInstance()
+    {
+        static PageCache Instance;
+        return Instance;
+    }
+
+    // returns the device id for the calls below, the same id if the device
+    // was added before, MaxDevices if the table is full
+    ulong AddDevice(BlockDevice& dev);
+
+    static const ulong BlockSize = Const::PageSize;
+    static const ulong SectorsPerBlock = BlockSize / BlockDevice::SectorSize;
+
+    // referenced page holding the block, read from the device on a miss.
+    // nullptr past the end of the device, on io error or out of memory
+    CachePage* Get(ulong dev, u64 block);
+    void Put(CachePage* page);
+
+    // the caller changed the data of a page it holds
+    void MarkDirty(CachePage* page);
+
+    // byte granular copies through the cache, blocks Write covers whole
+    // aren't read first
+    bool Read(ulong dev, u64 offset, void* buf, size_t len);
+    bool Write(ulong dev, u64 offset, const void* buf, size_t len);
+
+    // writes back every dirty block of the device, waits for it and flushes
+    // the device
+    bool Sync(ulong dev);
+
+    // evicts up to count clean unreferenced pages, returns how many
+    size_t Shrink(size_t count);
+
+    virtual size_t CountPages() override;
+    // evicts, then drops the recycled pages the current cpu keeps
+    virtual size_t ShrinkPages(size_t pageCount) override;
+
+    size_t GetPageCount();
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const ulong MaxDevices = 8;
+    static const ulong MaxReadahead = 256;
+
+private:
+    PageCache();
+    ~PageCache();
+    PageCache(const PageCache& other) = delete;
+    PageCache(PageCache&& other) = delete;
+    PageCache& operator=(const PageCache& other) = delete;
+    PageCache& operator=(PageCache&& other) = delete;
+
+    struct Device final
+    {
+        BlockDevice* Dev;
+        u64 Blocks;
+        bool ReadOnly;
+        ulong RaMax;
+
+        SpinLock RaLock;
+        // block a sequential reader asks for next
+        u64 RaNext;
+        // first block past the last readahead window
+        u64 RaEnd;
+        ulong RaWindow;
+
+        SpinLock DirtyLock;
+        Stdlib::ListEntry DirtyList;
+        ulong DirtyCount;
+        Work WritebackWork;
+    };
+
+    static const ulong FlagUptodate = 0;
+    static const ulong FlagDirty = 1;
+    // read or write in flight, Get and writeback sleep on it
+    static const ulong FlagIo = 2;
+    static const ulong FlagError = 3;
+    // reaching it starts the next readahead window
+    static const ulong FlagReadahead = 4;
+
+    static const ulong KeyDeviceShift = 56;
+    static const ulong InitialWindow = 4;
+    static const size_t SubmitChunk = 32;
+    static const size_t WritebackChunk = 64;
+    static const size_t ReclaimBatch = 32;
+    // the cache takes at most 1/MaxPagesDivisor of memory
+    static const size_t MaxPagesDivisor = 2;
+
+    static void ReqDone(BlkRequest* req);
+    static void WritebackFunc(void* ctx);
+    static bool TryRef(CachePage* page);
+    static void EndIo(CachePage* page, bool ok);
+    static void WaitIo(CachePage* page);
+
+    CachePage* GetPage(ulong dev, u64 block, bool read, bool& created);
+    CachePage* FindOrCreate(ulong dev, u64 block, bool& created);
+    void Destroy(CachePage* page);
+    bool TryEvict(CachePage* page);
+    void Reclaim();
+    void Readahead(ulong dev, u64 start, ulong count, u64 mark);
+    void SubmitIo(ulong dev, CachePage** pages, size_t count, u32 type, bool retry);
+    bool Writeback(ulong dev);
+
+    Stdlib::HashTable<u64, CachePage*, RwSpinLock> Table;
+
+    SpinLock ClockLock;
+    Stdlib::ListEntry ClockList;
+    Atomic PageCount;
+    size_t MaxPages;
+
+    SpinLock DeviceLock;
+    Device Devices[MaxDevices];
+    Atomic DeviceCount;
+
+    Atomic Hits;
+    Atomic Misses;
+    Atomic ReadaheadPages;
+    Atomic Evictions;
+    Atomic Writebacks;
+    Atomic IoErrors;
+};
+
+}
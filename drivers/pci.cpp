@@ -0,0 +1,590 @@
+#include "pci.h"
+
+#include <kernel/asm.h>
+#include <kernel/panic.h>
+#include <kernel/trace.h>
+#include <mm/mmio.h>
+#include <mm/page_table.h>
+#include <mm/vmalloc.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+Pci::Pci()
+    : DeviceCount(0)
+    , Enumerated(false)
+{
+    Stdlib::MemSet(EcamBus, 0, sizeof(EcamBus));
+    Stdlib::MemSet(Devices, 0, sizeof(Devices));
+}
+
+Pci::~Pci()
+{
+}
+
+void* Pci::EcamAddress(u16 segment, u8 bus, u8 slot, u8 func, ulong offset)
+{
+    auto& acpi = Acpi::GetInstance();
+
+    for (size_t i = 0; i < acpi.GetEcamRegionCount(); i++)
+    {
+        const Acpi::EcamRegion& region = acpi.GetEcamRegion(i);
+        if (region.Segment != segment || bus < region.StartBus || bus > region.EndBus)
+            continue;
+
+        void* busBase = EcamBus[i][bus];
+        if (busBase == nullptr)
+            return nullptr;
+
+        return Stdlib::MemAdd(busBase, ((ulong)slot << 15) | ((ulong)func << 12) | offset);
+    }
+
+    return nullptr;
+}
+
+bool Pci::MapEcamBus(u16 segment, u8 bus)
+{
+    auto& acpi = Acpi::GetInstance();
+
+    for (size_t i = 0; i < acpi.GetEcamRegionCount(); i++)
+    {
+        const Acpi::EcamRegion& region = acpi.GetEcamRegion(i);
+        if (region.Segment != segment || bus < region.StartBus || bus > region.EndBus)
+            continue;
+
+        if (EcamBus[i][bus] != nullptr)
+            return true;
+
+        ulong phyAddr = region.Base + ((ulong)(bus - region.StartBus) << 20);
+        void* busBase = Mm::Vmalloc::GetInstance().MapIo(phyAddr, MaxSlots * MaxFuncs * ConfigSize,
+            Mm::PageTable::MapWritable | Mm::PageTable::MapCacheDisabled);
+        if (busBase == nullptr)
+        {
+            Trace(0, "Pci: can't map ecam bus %u addr 0x%p", (ulong)bus, phyAddr);
+            return false;
+        }
+
+        EcamBus[i][bus] = busBase;
+        return true;
+    }
+
+    return false;
+}
+
+u32 Pci::ReadConfig(u16 segment, u8 bus, u8 slot, u8 func, ulong offset, ulong width)
+{
+    if (BugOn(offset & (width - 1)))
+        return 0xFFFFFFFF;
+
+    void* addr = EcamAddress(segment, bus, slot, func, offset);
+    if (addr != nullptr)
+    {
+        switch (width)
+        {
+        case 1:
+            return *static_cast<volatile u8*>(addr);
+        case 2:
+            return *static_cast<volatile u16*>(addr);
+        default:
+            return Mm::MmIo::Read32(addr);
+        }
+    }
+
+    if (segment != 0 || offset >= LegacyConfigSize)
+        return 0xFFFFFFFF;
+
+    u32 value;
+    {
+        Stdlib::AutoLock lock(Lock);
+        Outl(ConfigAddressPort, ConfigEnable | ((u32)bus << 16) | ((u32)slot << 11) |
+            ((u32)func << 8) | (u32)(offset & ~3UL));
+        value = Inl(ConfigDataPort);
+    }
+
+    value >>= (offset & 3) * 8;
+    if (width < 4)
+        value &= (1U << (width * 8)) - 1;
+    return value;
+}
+
+void Pci::WriteConfig(u16 segment, u8 bus, u8 slot, u8 func, ulong offset, ulong width, u32 value)
+{
+    if (BugOn(offset & (width - 1)))
+        return;
+
+    void* addr = EcamAddress(segment, bus, slot, func, offset);
+    if (addr != nullptr)
+    {
+        switch (width)
+        {
+        case 1:
+            *static_cast<volatile u8*>(addr) = static_cast<u8>(value);
+            break;
+        case 2:
+            *static_cast<volatile u16*>(addr) = static_cast<u16>(value);
+            break;
+        default:
+            Mm::MmIo::Write32(addr, value);
+            break;
+        }
+        return;
+    }
+
+    if (segment != 0 || offset >= LegacyConfigSize)
+        return;
+
+    Stdlib::AutoLock lock(Lock);
+    Outl(ConfigAddressPort, ConfigEnable | ((u32)bus << 16) | ((u32)slot << 11) |
+        ((u32)func << 8) | (u32)(offset & ~3UL));
+
+    // the ports only move dwords: merge narrower writes with the current
+    // value, write one clear bits next to the target are written as zero
+    if (width < 4)
+    {
+        ulong shift = (offset & 3) * 8;
+        u32 mask = ((1U << (width * 8)) - 1) << shift;
+        u32 old = Inl(ConfigDataPort);
+        if ((offset & ~3UL) == RegCommand)
+            old &= 0xFFFF;
+        value = (old & ~mask) | ((value << shift) & mask);
+    }
+
+    Outl(ConfigDataPort, value);
+}
+
+u32 Pci::Read(const PciDevice& dev, ulong offset, ulong width)
+{
+    return ReadConfig(dev.Segment, dev.Bus, dev.Slot, dev.Func, offset, width);
+}
+
+void Pci::Write(const PciDevice& dev, ulong offset, ulong width, u32 value)
+{
+    WriteConfig(dev.Segment, dev.Bus, dev.Slot, dev.Func, offset, width, value);
+}
+
+u8 Pci::Read8(const PciDevice& dev, ulong offset)
+{
+    return static_cast<u8>(Read(dev, offset, 1));
+}
+
+u16 Pci::Read16(const PciDevice& dev, ulong offset)
+{
+    return static_cast<u16>(Read(dev, offset, 2));
+}
+
+u32 Pci::Read32(const PciDevice& dev, ulong offset)
+{
+    return Read(dev, offset, 4);
+}
+
+void Pci::Write8(const PciDevice& dev, ulong offset, u8 value)
+{
+    Write(dev, offset, 1, value);
+}
+
+void Pci::Write16(const PciDevice& dev, ulong offset, u16 value)
+{
+    Write(dev, offset, 2, value);
+}
+
+void Pci::Write32(const PciDevice& dev, ulong offset, u32 value)
+{
+    Write(dev, offset, 4, value);
+}
+
+u8 Pci::FindCapability(const PciDevice& dev, u8 id, u8 start)
+{
+    u8 cap;
+
+    if (start == 0)
+    {
+        if (!(Read16(dev, RegStatus) & StatusCapabilities))
+            return 0;
+
+        cap = Read8(dev, RegCapabilities) & 0xFC;
+    }
+    else
+    {
+        cap = Read8(dev, start + 1) & 0xFC;
+    }
+
+    for (ulong i = 0; cap != 0 && i < MaxCapabilities; i++)
+    {
+        if (Read8(dev, cap) == id)
+            return cap;
+
+        cap = Read8(dev, cap + 1) & 0xFC;
+    }
+
+    return 0;
+}
+
+void Pci::ProbeBars(PciDevice& dev)
+{
+    u8 headerType = Read8(dev, RegHeaderType) & HeaderTypeMask;
+    ulong barCount = (headerType == HeaderBridge) ? BridgeBars : PciDevice::MaxBars;
+
+    // sizing writes all ones, keep decoding off meanwhile
+    u16 command = Read16(dev, RegCommand);
+    Write16(dev, RegCommand, command & ~(CommandIo | CommandMemory));
+
+    for (ulong i = 0; i < barCount; i++)
+    {
+        PciBar& bar = dev.Bar[i];
+        ulong reg = RegBar0 + 4 * i;
+        u32 low = Read32(dev, reg);
+
+        Write32(dev, reg, 0xFFFFFFFF);
+        u32 sizeLow = Read32(dev, reg);
+        Write32(dev, reg, low);
+
+        if (low & BarIo)
+        {
+            u32 mask = sizeLow & ~0x3U;
+            if (mask == 0)
+                continue;
+
+            bar.Io = true;
+            bar.Address = low & ~0x3U;
+            bar.Size = (~mask + 1) & 0xFFFF;
+            continue;
+        }
+
+        u64 address = low & ~0xFUL;
+        u64 mask = 0xFFFFFFFF00000000UL | (sizeLow & ~0xFU);
+        bar.Prefetchable = (low & BarPrefetchable) ? true : false;
+        if ((low & BarType64) && i + 1 < barCount)
+        {
+            u32 high = Read32(dev, reg + 4);
+            Write32(dev, reg + 4, 0xFFFFFFFF);
+            u32 sizeHigh = Read32(dev, reg + 4);
+            Write32(dev, reg + 4, high);
+
+            address |= (u64)high << 32;
+            mask = ((u64)sizeHigh << 32) | (sizeLow & ~0xFU);
+            bar.Is64 = true;
+            i++;
+        }
+
+        if ((mask & ~0xFUL) == 0)
+        {
+            bar.Prefetchable = false;
+            bar.Is64 = false;
+            continue;
+        }
+
+        bar.Address = address;
+        bar.Size = ~mask + 1;
+    }
+
+    Write16(dev, RegCommand, command);
+}
+
+void Pci::ScanFunc(u16 segment, u8 bus, u8 slot, u8 func, ulong depth)
+{
+    u16 vendorId = static_cast<u16>(ReadConfig(segment, bus, slot, func, RegVendor, 2));
+    if (vendorId == InvalidVendor)
+        return;
+
+    if (DeviceCount >= MaxDevices)
+    {
+        Trace(0, "Pci: too many devices, skip %u:%u.%u", (ulong)bus, (ulong)slot, (ulong)func);
+        return;
+    }
+
+    PciDevice& dev = Devices[DeviceCount];
+    Stdlib::MemSet(&dev, 0, sizeof(dev));
+    dev.Segment = segment;
+    dev.Bus = bus;
+    dev.Slot = slot;
+    dev.Func = func;
+    dev.VendorId = vendorId;
+    dev.DeviceId = Read16(dev, RegDevice);
+    dev.Revision = Read8(dev, RegRevision);
+    dev.ProgIf = Read8(dev, RegProgIf);
+    dev.SubClass = Read8(dev, RegSubClass);
+    dev.Class = Read8(dev, RegClass);
+    dev.IrqLine = Read8(dev, RegIrqLine);
+    dev.IrqPin = Read8(dev, RegIrqPin);
+
+    ProbeBars(dev);
+
+    dev.MsiCap = FindCapability(dev, CapMsi);
+    dev.MsixCap = FindCapability(dev, CapMsix);
+    if (dev.MsixCap != 0)
+    {
+        u16 control = Read16(dev, dev.MsixCap + 2);
+        u32 table = Read32(dev, dev.MsixCap + 4);
+        dev.MsixTableSize = (control & MsixControlSizeMask) + 1;
+        dev.MsixTableBar = static_cast<u8>(table & MsixBirMask);
+        dev.MsixTableOffset = table & ~MsixBirMask;
+    }
+
+    DeviceCount++;
+
+    Trace(0, "Pci: %u:%u.%u vendor 0x%p device 0x%p class 0x%p msi %u msix %u",
+        (ulong)bus, (ulong)slot, (ulong)func, (ulong)dev.VendorId, (ulong)dev.DeviceId,
+        ((ulong)dev.Class << 8) | dev.SubClass, (ulong)dev.MsiCap, (ulong)dev.MsixTableSize);
+
+    u8 headerType = Read8(dev, RegHeaderType) & HeaderTypeMask;
+    if (headerType == HeaderBridge)
+    {
+        u8 secondary = Read8(dev, RegSecondaryBus);
+        if (secondary > bus && depth < MaxBridgeDepth)
+            ScanBus(segment, secondary, depth + 1);
+    }
+}
+
+void Pci::ScanBus(u16 segment, u8 bus, ulong depth)
+{
+    MapEcamBus(segment, bus);
+
+    for (ulong slot = 0; slot < MaxSlots; slot++)
+    {
+        u16 vendorId = static_cast<u16>(ReadConfig(segment, bus, slot, 0, RegVendor, 2));
+        if (vendorId == InvalidVendor)
+            continue;
+
+        u8 headerType = static_cast<u8>(ReadConfig(segment, bus, slot, 0, RegHeaderType, 1));
+        ulong funcs = (headerType & HeaderMultiFunc) ? MaxFuncs : 1;
+        for (ulong func = 0; func < funcs; func++)
+            ScanFunc(segment, bus, static_cast<u8>(slot), static_cast<u8>(func), depth);
+    }
+}
+
+bool Pci::Enumerate()
+{
+    if (Enumerated)
+        return true;
+
+    auto& acpi = Acpi::GetInstance();
+    size_t regions = acpi.GetEcamRegionCount();
+
+    if (regions == 0)
+    {
+        ScanBus(0, 0, 0);
+    }
+    else
+    {
+        for (size_t i = 0; i < regions; i++)
+        {
+            const Acpi::EcamRegion& region = acpi.GetEcamRegion(i);
+            ScanBus(region.Segment, region.StartBus, 0);
+        }
+    }
+
+    Enumerated = true;
+    Trace(0, "Pci: %u devices ecam regions %u", DeviceCount, regions);
+    return true;
+}
+
+size_t Pci::GetDeviceCount()
+{
+    return DeviceCount;
+}
+
+PciDevice* Pci::GetDevice(size_t index)
+{
+    if (index >= DeviceCount)
+        return nullptr;
+
+    return &Devices[index];
+}
+
+PciDevice* Pci::Find(u16 vendorId, u16 deviceId, PciDevice* prev)
+{
+    size_t start = (prev != nullptr) ? (prev - &Devices[0]) + 1 : 0;
+
+    for (size_t i = start; i < DeviceCount; i++)
+    {
+        if (Devices[i].VendorId == vendorId && Devices[i].DeviceId == deviceId)
+            return &Devices[i];
+    }
+
+    return nullptr;
+}
+
+void* Pci::MapBar(PciDevice& dev, ulong bar)
+{
+    if (bar >= PciDevice::MaxBars)
+        return nullptr;
+
+    PciBar& entry = dev.Bar[bar];
+    if (entry.Size == 0 || entry.Io)
+        return nullptr;
+
+    if (entry.Mapped != nullptr)
+        return entry.Mapped;
+
+    ulong flags = Mm::PageTable::MapWritable;
+    flags |= (entry.Prefetchable) ? Mm::PageTable::MapWriteCombining : Mm::PageTable::MapCacheDisabled;
+
+    void* mapped = Mm::Vmalloc::GetInstance().MapIo(entry.Address, entry.Size, flags);
+    if (mapped == nullptr)
+        return nullptr;
+
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (entry.Mapped == nullptr)
+        {
+            entry.Mapped = mapped;
+            mapped = nullptr;
+        }
+    }
+
+    // lost a race with another mapper
+    if (mapped != nullptr)
+        Mm::Vmalloc::GetInstance().UnmapIo(mapped);
+
+    Write16(dev, RegCommand, Read16(dev, RegCommand) | CommandMemory);
+    return entry.Mapped;
+}
+
+void Pci::EnableBusMaster(PciDevice& dev)
+{
+    Write16(dev, RegCommand, Read16(dev, RegCommand) | CommandMemory | CommandBusMaster);
+}
+
+bool Pci::MsiAddress(ulong cpu, u32& address)
+{
+    // physical destination mode, the apic id has 8 bits in the address
+    if (cpu > 0xFF)
+        return false;
+
+    address = static_cast<u32>(MsiAddressBase | (cpu << MsiDestShift));
+    return true;
+}
+
+bool Pci::EnableMsi(PciDevice& dev, ulong cpu, DeviceInterruptFn fn, void* ctx, u8& vector)
+{
+    if (dev.MsiCap == 0)
+        return false;
+
+    u32 address;
+    if (!MsiAddress(cpu, address))
+        return false;
+
+    if (!Interrupt::AllocVector(fn, ctx, vector))
+        return false;
+
+    ulong cap = dev.MsiCap;
+    u16 control = Read16(dev, cap + 2);
+    control &= ~(MsiControlEnable | MsiControlMultipleMask);
+    Write16(dev, cap + 2, control);
+
+    Write32(dev, cap + 4, address);
+    if (control & MsiControl64)
+    {
+        Write32(dev, cap + 8, 0);
+        Write16(dev, cap + 12, vector);
+    }
+    else
+    {
+        Write16(dev, cap + 8, vector);
+    }
+
+    Write16(dev, RegCommand, Read16(dev, RegCommand) | CommandIntxDisable);
+    Write16(dev, cap + 2, control | MsiControlEnable);
+
+    Trace(0, "Pci: %u:%u.%u msi cpu %u vector 0x%p",
+        (ulong)dev.Bus, (ulong)dev.Slot, (ulong)dev.Func, cpu, (ulong)vector);
+    return true;
+}
+
+void* Pci::MapMsixTable(PciDevice& dev)
+{
+    if (dev.MsixTable != nullptr)
+        return dev.MsixTable;
+
+    PciBar& bar = dev.Bar[dev.MsixTableBar];
+    if (bar.Size == 0 || bar.Io || dev.MsixTableOffset + dev.MsixTableSize * MsixEntrySize > bar.Size)
+        return nullptr;
+
+    // the table must not be write combined even inside a prefetchable bar
+    void* table = Mm::Vmalloc::GetInstance().MapIo(bar.Address + dev.MsixTableOffset,
+        dev.MsixTableSize * MsixEntrySize, Mm::PageTable::MapWritable | Mm::PageTable::MapCacheDisabled);
+    if (table == nullptr)
+        return nullptr;
+
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (dev.MsixTable == nullptr)
+        {
+            dev.MsixTable = table;
+            table = nullptr;
+        }
+    }
+
+    if (table != nullptr)
+        Mm::Vmalloc::GetInstance().UnmapIo(table);
+
+    return dev.MsixTable;
+}
+
+bool Pci::EnableMsix(PciDevice& dev, u16 entry, ulong cpu, DeviceInterruptFn fn, void* ctx, u8& vector)
+{
+    if (dev.MsixCap == 0 || entry >= dev.MsixTableSize)
+        return false;
+
+    u32 address;
+    if (!MsiAddress(cpu, address))
+        return false;
+
+    void* table = MapMsixTable(dev);
+    if (table == nullptr)
+        return false;
+
+    if (!Interrupt::AllocVector(fn, ctx, vector))
+        return false;
+
+    ulong cap = dev.MsixCap;
+    u16 control = Read16(dev, cap + 2);
+    if (!(control & MsixControlEnable))
+    {
+        // function mask holds every entry while the rest are programmed
+        Write16(dev, cap + 2, control | MsixControlEnable | MsixControlMask);
+        Write16(dev, RegCommand, Read16(dev, RegCommand) | CommandMemory | CommandIntxDisable);
+    }
+
+    void* slot = Stdlib::MemAdd(table, entry * MsixEntrySize);
+    Mm::MmIo::Write32(Stdlib::MemAdd(slot, 12), MsixVectorMasked);
+    Mm::MmIo::Write32(slot, address);
+    Mm::MmIo::Write32(Stdlib::MemAdd(slot, 4), 0);
+    Mm::MmIo::Write32(Stdlib::MemAdd(slot, 8), vector);
+    Mm::MmIo::Write32(Stdlib::MemAdd(slot, 12), 0);
+
+    control = Read16(dev, cap + 2);
+    Write16(dev, cap + 2, control & ~MsixControlMask);
+
+    Trace(0, "Pci: %u:%u.%u msix entry %u cpu %u vector 0x%p",
+        (ulong)dev.Bus, (ulong)dev.Slot, (ulong)dev.Func, (ulong)entry, cpu, (ulong)vector);
+    return true;
+}
+
+void Pci::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("ecam regions %u devices %u\n", Acpi::GetInstance().GetEcamRegionCount(), DeviceCount);
+    printer.Printf("seg:bus:slot.func vendor device class irq msi msix\n");
+    for (size_t i = 0; i < DeviceCount; i++)
+    {
+        PciDevice& dev = Devices[i];
+
+        printer.Printf("%u:%u:%u.%u 0x%p 0x%p 0x%p %u %u %u\n",
+            (ulong)dev.Segment, (ulong)dev.Bus, (ulong)dev.Slot, (ulong)dev.Func,
+            (ulong)dev.VendorId, (ulong)dev.DeviceId, ((ulong)dev.Class << 8) | dev.SubClass,
+            (ulong)dev.IrqLine, (ulong)(dev.MsiCap != 0), (ulong)dev.MsixTableSize);
+
+        for (size_t j = 0; j < PciDevice::MaxBars; j++)
+        {
+            PciBar& bar = dev.Bar[j];
+            if (bar.Size == 0)
+                continue;
+
+            printer.Printf("  bar %u addr 0x%p size 0x%p io %u pf %u 64 %u\n",
+                j, bar.Address, bar.Size, (ulong)bar.Io, (ulong)bar.Prefetchable, (ulong)bar.Is64);
+        }
+    }
+}
+
+}
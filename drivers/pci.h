@@ -0,0 +1,205 @@
+#pragma once
+
+#include "acpi.h"
+
+#include <kernel/interrupt.h>
+#include <kernel/spin_lock.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+struct PciBar final
+{
+    ulong Address;
+    ulong Size;
+    bool Io;
+    bool Prefetchable;
+    bool Is64;
+    // set by Pci::MapBar
+    void* Mapped;
+};
+
+struct PciDevice final
+{
+    u16 Segment;
+    u8 Bus;
+    u8 Slot;
+    u8 Func;
+
+    u16 VendorId;
+    u16 DeviceId;
+    u8 Class;
+    u8 SubClass;
+    u8 ProgIf;
+    u8 Revision;
+    u8 IrqLine;
+    u8 IrqPin;
+
+    // config space offsets of the capabilities, zero if absent
+    u8 MsiCap;
+    u8 MsixCap;
+    u16 MsixTableSize;
+    u8 MsixTableBar;
+    u32 MsixTableOffset;
+    // mapped uncached by the first EnableMsix
+    void* MsixTable;
+
+    static const size_t MaxBars = 6;
+    PciBar Bar[MaxBars];
+};
+
+// PCI/PCIe config space and device table. Config space goes through the
+// ECAM regions of the ACPI MCFG table, a bus is mapped uncached the first
+// time it is scanned; buses of segment 0 without one use the 0xCF8/0xCFC
+// ports, which only reach the first 256 bytes. Enumerate walks bus 0 and
+// every bridge below it once at boot. Devices get message signalled
+// interrupts: MSI or an MSI-X table entry is pointed at a vector from
+// Interrupt::AllocVector on the requested cpu.
+class Pci final
+{
+public:
+    static Pci& GetInstance()
+    {
+        static Pci Instance;
+        return Instance;
+    }
+
+    bool Enumerate();
+
+    size_t GetDeviceCount();
+
+    PciDevice* GetDevice(size_t index);
+
+    // next device with the ids after prev, nullptr starts from the first
+    PciDevice* Find(u16 vendorId, u16 deviceId, PciDevice* prev = nullptr);
+
+    u8 Read8(const PciDevice& dev, ulong offset);
+    u16 Read16(const PciDevice& dev, ulong offset);
+    u32 Read32(const PciDevice& dev, ulong offset);
+
+    void Write8(const PciDevice& dev, ulong offset, u8 value);
+    void Write16(const PciDevice& dev, ulong offset, u16 value);
+    void Write32(const PciDevice& dev, ulong offset, u32 value);
+
+    // first capability with the id, zero if the device has none
+    u8 FindCapability(const PciDevice& dev, u8 id, u8 start = 0);
+
+    // uncached, or write combining for prefetchable memory bars
+    void* MapBar(PciDevice& dev, ulong bar);
+
+    // memory decoding and dma
+    void EnableBusMaster(PciDevice& dev);
+
+    // single MSI vector routed to cpu, legacy INTx is turned off
+    bool EnableMsi(PciDevice& dev, ulong cpu, DeviceInterruptFn fn, void* ctx, u8& vector);
+
+    // MSI-X table entry routed to cpu, the table bar is mapped on first use.
+    // Entries stay masked until set up, so enable entries one by one
+    bool EnableMsix(PciDevice& dev, u16 entry, ulong cpu, DeviceInterruptFn fn, void* ctx, u8& vector);
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const u8 CapMsi = 0x05;
+    static const u8 CapVendor = 0x09;
+    static const u8 CapMsix = 0x11;
+
+    static const size_t MaxDevices = 64;
+
+private:
+    Pci();
+    ~Pci();
+    Pci(const Pci& other) = delete;
+    Pci(Pci&& other) = delete;
+    Pci& operator=(const Pci& other) = delete;
+    Pci& operator=(Pci&& other) = delete;
+
+    // ecam address of the register, nullptr if the bus has no mapping
+    void* EcamAddress(u16 segment, u8 bus, u8 slot, u8 func, ulong offset);
+    bool MapEcamBus(u16 segment, u8 bus);
+
+    // width is 1, 2 or 4 bytes, offset aligned to it
+    u32 ReadConfig(u16 segment, u8 bus, u8 slot, u8 func, ulong offset, ulong width);
+    void WriteConfig(u16 segment, u8 bus, u8 slot, u8 func, ulong offset, ulong width, u32 value);
+
+    u32 Read(const PciDevice& dev, ulong offset, ulong width);
+    void Write(const PciDevice& dev, ulong offset, ulong width, u32 value);
+
+    void ScanBus(u16 segment, u8 bus, ulong depth);
+    void ScanFunc(u16 segment, u8 bus, u8 slot, u8 func, ulong depth);
+    void ProbeBars(PciDevice& dev);
+    void* MapMsixTable(PciDevice& dev);
+
+    static bool MsiAddress(ulong cpu, u32& address);
+
+    static const ulong ConfigAddressPort = 0xCF8;
+    static const ulong ConfigDataPort = 0xCFC;
+    static const u32 ConfigEnable = (1U << 31);
+    static const ulong LegacyConfigSize = 0x100;
+    static const ulong ConfigSize = 0x1000;
+
+    static const ulong MaxBuses = 256;
+    static const ulong MaxSlots = 32;
+    static const ulong MaxFuncs = 8;
+    static const ulong MaxBridgeDepth = 8;
+
+    static const ulong RegVendor = 0x00;
+    static const ulong RegDevice = 0x02;
+    static const ulong RegCommand = 0x04;
+    static const ulong RegStatus = 0x06;
+    static const ulong RegRevision = 0x08;
+    static const ulong RegProgIf = 0x09;
+    static const ulong RegSubClass = 0x0A;
+    static const ulong RegClass = 0x0B;
+    static const ulong RegHeaderType = 0x0E;
+    static const ulong RegBar0 = 0x10;
+    static const ulong RegSecondaryBus = 0x19;
+    static const ulong BridgeBars = 2;
+    static const ulong RegCapabilities = 0x34;
+    static const ulong RegIrqLine = 0x3C;
+    static const ulong RegIrqPin = 0x3D;
+
+    static const u16 CommandIo = (1U << 0);
+    static const u16 CommandMemory = (1U << 1);
+    static const u16 CommandBusMaster = (1U << 2);
+    static const u16 CommandIntxDisable = (1U << 10);
+    static const u16 StatusCapabilities = (1U << 4);
+
+    static const u8 HeaderTypeMask = 0x7F;
+    static const u8 HeaderMultiFunc = 0x80;
+    static const u8 HeaderBridge = 0x01;
+
+    static const u32 BarIo = (1U << 0);
+    static const u32 BarType64 = (2U << 1);
+    static const u32 BarPrefetchable = (1U << 3);
+
+    static const u16 MsiControlEnable = (1U << 0);
+    static const u16 MsiControlMultipleMask = (7U << 4);
+    static const u16 MsiControl64 = (1U << 7);
+
+    static const u16 MsixControlSizeMask = 0x7FF;
+    static const u16 MsixControlMask = (1U << 14);
+    static const u16 MsixControlEnable = (1U << 15);
+    static const u32 MsixBirMask = 0x7;
+    static const ulong MsixEntrySize = 16;
+    static const u32 MsixVectorMasked = (1U << 0);
+
+    static const ulong MsiAddressBase = 0xFEE00000;
+    static const ulong MsiDestShift = 12;
+
+    static const ulong InvalidVendor = 0xFFFF;
+    // guards the capability walk against a looping list
+    static const ulong MaxCapabilities = 48;
+
+    SpinLock Lock;
+
+    // mapped config space of every ecam bus, 1MB each
+    void* EcamBus[Acpi::MaxEcamRegions][MaxBuses];
+
+    PciDevice Devices[MaxDevices];
+    size_t DeviceCount;
+    bool Enumerated;
+};
+
+}
@@ -2,10 +2,14 @@
 #include "lapic.h"
 
 #include <kernel/cpu.h>
+#include <kernel/tunable.h>
 
 namespace Kernel
 {
 
+// pithz=<n>, interrupt rate of the pit, the 16 bit reload value bounds it
+DEFINE_TUNABLE(PitHz, "pithz", 100, 19, 1000, nullptr, Tunable::FlagBootOnly);
+
 Pit::Pit()
     : IntVector(-1)
     , TimeMs(0)
@@ -22,13 +26,17 @@ Pit::~Pit()
 
 void Pit::Setup()
 {
-    Stdlib::AutoLock lock(Lock);
-
-    ReloadValue = 11932; // 1193182 / 11932.0 = 99.99849145155883
-    TickMs = 10; // 1000 / 99.99849145155883 = 10.00015085711987
-    TickMsNs = 150857;
+    // 100 Hz: reload 11932, a tick of 10.000150857 ms
+    ulong hz = PitHz.Get();
+    ReloadValue = static_cast<u16>((HighestFrequency + hz / 2) / hz);
+    ulong tickNs = (static_cast<ulong>(ReloadValue) * Const::NanoSecsInSec) / HighestFrequency;
+    TickMs = tickNs / Const::NanoSecsInMs;
+    TickMsNs = tickNs % Const::NanoSecsInMs;
+
+    Seq.WriteBegin();
     TimeMs = 0;
     TimeMsNs = 0;
+    Seq.WriteEnd();
 
     Outb(ModePort, 0b00110100); //channel 0, lobyte/hibyte, rate generator
     Outb(Channel0Port, Stdlib::LowPart(ReloadValue));
@@ -46,32 +54,41 @@ InterruptHandlerFn Pit::GetHandlerFn()
     return PitInterruptStub;
 }
 
-void Pit::Interrupt(Context* ctx)
+void Pit::Interrupt(IrqContext* ctx)
 {
     (void)ctx;
-    {
-        Stdlib::AutoLock lock(Lock);
+    InterruptTime irqTime(static_cast<u8>(IntVector));
 
-        TimeMs += TickMs;
-        TimeMsNs += TickMsNs;
-        while (TimeMsNs >= Const::NanoSecsInMs)
-        {
-            TimeMsNs -= Const::NanoSecsInMs;
-            TimeMs += 1;
-        }
+    Seq.WriteBegin();
 
-        CpuTable::GetInstance().SendIPIAll();
+    ulong timeMs = TimeMs + TickMs;
+    ulong timeMsNs = TimeMsNs + TickMsNs;
+    while (timeMsNs >= Const::NanoSecsInMs)
+    {
+        timeMsNs -= Const::NanoSecsInMs;
+        timeMs += 1;
     }
+    TimeMs = timeMs;
+    TimeMsNs = timeMsNs;
+    Seq.WriteEnd();
 
     Lapic::EOI(IntVector);
 }
 
 Stdlib::Time Pit::GetTime()
 {
-    return Stdlib::Time(TimeMs * Const::NanoSecsInMs + TimeMsNs);
+    ulong seq, timeMs, timeMsNs;
+    do
+    {
+        seq = Seq.ReadBegin();
+        timeMs = TimeMs;
+        timeMsNs = TimeMsNs;
+    } while (Seq.ReadRetry(seq));
+
+    return Stdlib::Time(timeMs * Const::NanoSecsInMs + timeMsNs);
 }
 
-extern "C" void PitInterrupt(Context* ctx)
+extern "C" void PitInterrupt(IrqContext* ctx)
 {
     Pit::GetInstance().Interrupt(ctx);
 }
@@ -79,10 +96,11 @@ extern "C" void PitInterrupt(Context* ctx)
 void Pit::Wait(const Stdlib::Time& timeout)
 {
     Stdlib::Time expired = GetTime() + timeout;
+    SpinBackoff backoff;
 
     while (GetTime() < expired)
     {
-        Pause();
+        backoff.Pause();
     }
 }
 
@@ -3,8 +3,8 @@
 #include <include/types.h>
 #include <kernel/atomic.h>
 #include <kernel/interrupt.h>
-#include <kernel/spin_lock.h>
 #include <kernel/asm.h>
+#include <kernel/seq_lock.h>
 #include <lib/stdlib.h>
 
 namespace Kernel
@@ -23,7 +23,7 @@ public:
     virtual void OnInterruptRegister(u8 irq, u8 vector) override;
     virtual InterruptHandlerFn GetHandlerFn() override;
 
-    void Interrupt(Context* ctx);
+    void Interrupt(IrqContext* ctx);
 
     void Setup();
 
@@ -49,13 +49,14 @@ private:
     static const int ModePort = 0x43;
     static const u32 HighestFrequency = 1193182;
 
+    // guards TimeMs and TimeMsNs. The only writers are Setup and the
+    // interrupt, which runs on one cpu.
+    SeqCount Seq;
     volatile ulong TimeMs;
     volatile ulong TimeMsNs;
     ulong TickMs;
     ulong TickMsNs;
     u16 ReloadValue;
-
-    SpinLock Lock;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,305 @@
+#include "pmu.h"
+#include "lapic.h"
+
+#include <kernel/cpu.h>
+#include <kernel/trace.h>
+#include <kernel/interrupt.h>
+
+namespace Kernel
+{
+
+const Pmu::EventDesc Pmu::Events[EventCount] = {
+    { "cycles", 0x3C, 0x00, 0 },
+    { "instructions", 0xC0, 0x00, 1 },
+    { "llc-misses", 0x2E, 0x41, 4 },
+    { "branch-misses", 0xC5, 0x00, 6 },
+};
+
+Pmu::Pmu()
+    : Version(0)
+    , CounterCount(0)
+    , CounterWidth(0)
+    , UsedCount(0)
+    , Period(0)
+    , Running(false)
+    , State(nullptr)
+    , StateCount(0)
+{
+}
+
+Pmu::~Pmu()
+{
+    if (State != nullptr)
+    {
+        delete [] State;
+        State = nullptr;
+    }
+}
+
+bool Pmu::Probe()
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 0xA)
+        return false;
+
+    Cpuid(0xA, &eax, &ebx, &ecx, &edx);
+    Version = eax & 0xFF;
+    CounterCount = (eax >> 8) & 0xFF;
+    CounterWidth = (eax >> 16) & 0xFF;
+    UsedCount = Stdlib::Min(CounterCount, static_cast<ulong>(EventCount));
+
+    Trace(0, "Pmu: version %u counters %u width %u unavailable 0x%p",
+        Version, CounterCount, CounterWidth, (ulong)ebx);
+
+    // sampling needs the cycles event
+    if (Version == 0 || UsedCount == 0 || (ebx & (1 << Events[EventCycles].UnavailableBit)))
+        return false;
+
+    // events map to counters in order, count up to the first one this cpu lacks
+    for (ulong i = 0; i < UsedCount; i++)
+    {
+        if (ebx & (1UL << Events[i].UnavailableBit))
+        {
+            UsedCount = i;
+            break;
+        }
+    }
+
+    return true;
+}
+
+void Pmu::ProgramCounters()
+{
+    for (ulong i = 0; i < UsedCount; i++)
+    {
+        u64 evtSel = Events[i].Select | ((u64)Events[i].Umask << 8) | EvtSelOs | EvtSelUsr | EvtSelEnable;
+        WriteMsr(EvtSelMsr + i, 0);
+        if (i == EventCycles)
+        {
+            // 32-bit writes are sign extended, so this counts up to the overflow
+            WriteMsr(PmcMsr + i, static_cast<u64>(-static_cast<long>(Period)));
+            evtSel |= EvtSelInt;
+        }
+        else
+        {
+            WriteMsr(PmcMsr + i, 0);
+        }
+        WriteMsr(EvtSelMsr + i, evtSel);
+    }
+
+    if (Version >= 2)
+    {
+        WriteMsr(GlobalOvfCtrlMsr, (1UL << UsedCount) - 1);
+        WriteMsr(GlobalCtrlMsr, (1UL << UsedCount) - 1);
+    }
+}
+
+void Pmu::ClearCounters()
+{
+    if (Version >= 2)
+        WriteMsr(GlobalCtrlMsr, 0);
+
+    for (ulong i = 0; i < UsedCount; i++)
+        WriteMsr(EvtSelMsr + i, 0);
+}
+
+void Pmu::ReadCounters(CpuState& state)
+{
+    u64 mask = (CounterWidth < 64) ? ((1UL << CounterWidth) - 1) : ~((u64)0);
+
+    for (ulong i = 0; i < UsedCount; i++)
+    {
+        u64 value = ReadMsr(PmcMsr + i) & mask;
+        // the cycles counter restarts from -period on every overflow
+        if (i == EventCycles)
+            value = (value + Period - (mask + 1)) & mask;
+        state.Count[i] += value;
+        WriteMsr(PmcMsr + i, (i == EventCycles) ? static_cast<u64>(-static_cast<long>(Period)) : 0);
+    }
+}
+
+void Pmu::StartCpu(void* ctx)
+{
+    auto pmu = static_cast<Pmu*>(ctx);
+
+    pmu->ProgramCounters();
+    Lapic::SetPerfVector(Vector);
+}
+
+void Pmu::StopCpu(void* ctx)
+{
+    auto pmu = static_cast<Pmu*>(ctx);
+
+    Lapic::MaskPerf();
+    pmu->ClearCounters();
+    pmu->ReadCounters(pmu->State[CpuTable::GetInstance().GetCurrentCpuId()]);
+}
+
+void Pmu::ReadCpu(void* ctx)
+{
+    auto pmu = static_cast<Pmu*>(ctx);
+
+    pmu->ReadCounters(pmu->State[CpuTable::GetInstance().GetCurrentCpuId()]);
+}
+
+bool Pmu::Start(ulong period)
+{
+    auto& cpus = CpuTable::GetInstance();
+
+    // the counter is reloaded with a sign extended 32-bit write
+    if (Running || period == 0 || period >= (1UL << 31))
+        return false;
+
+    if (UsedCount == 0 && !Probe())
+        return false;
+
+    if (State == nullptr)
+    {
+        StateCount = cpus.GetCpuLimit();
+        State = new CpuState[StateCount];
+        if (State == nullptr)
+        {
+            StateCount = 0;
+            return false;
+        }
+    }
+
+    Stdlib::MemSet(State, 0, StateCount * sizeof(State[0]));
+    Period = period;
+    Running = true;
+
+    CpuMask running = cpus.GetRunningCpus();
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+        cpus.CallFunction(i, &Pmu::StartCpu, this);
+
+    return true;
+}
+
+void Pmu::Stop()
+{
+    if (!Running)
+        return;
+
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask running = cpus.GetRunningCpus();
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+        cpus.CallFunction(i, &Pmu::StopCpu, this);
+
+    Running = false;
+}
+
+bool Pmu::IsRunning()
+{
+    return Running;
+}
+
+void Pmu::Interrupt(IrqContext* ctx)
+{
+    InterruptTime irqTime(Vector);
+    u64 status = (Version >= 2) ? ReadMsr(GlobalStatusMsr) : 1;
+    ulong index = CpuTable::GetInstance().GetCurrentCpuId();
+
+    if (State != nullptr && index < StateCount && (status & (1UL << EventCycles)))
+    {
+        auto& state = State[index];
+        state.Count[EventCycles] += Period;
+        if (state.SampleIndex < SampleCount)
+            state.Sample[state.SampleIndex++] = ctx->GetRetRip();
+        else
+            state.Lost++;
+
+        WriteMsr(PmcMsr + EventCycles, static_cast<u64>(-static_cast<long>(Period)));
+    }
+
+    if (Version >= 2)
+        WriteMsr(GlobalOvfCtrlMsr, status);
+
+    Lapic::SetPerfVector(Vector);
+    Lapic::EOI(Vector);
+}
+
+void Pmu::Dump(Stdlib::Printer& printer)
+{
+    if (State == nullptr)
+    {
+        printer.Printf("no perf data\n");
+        return;
+    }
+
+    auto& cpus = CpuTable::GetInstance();
+    if (Running)
+    {
+        CpuMask running = cpus.GetRunningCpus();
+        for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+            cpus.CallFunction(i, &Pmu::ReadCpu, this);
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < StateCount; i++)
+    {
+        auto& state = State[i];
+        printer.Printf("cpu %u", i);
+        for (ulong j = 0; j < UsedCount; j++)
+            printer.Printf(" %s %u", Events[j].Name, state.Count[j]);
+        printer.Printf(" samples %u lost %u\n", state.SampleIndex, state.Lost);
+        total += state.SampleIndex;
+    }
+
+    if (total == 0)
+        return;
+
+    ulong* sample = new ulong[total];
+    if (sample == nullptr)
+        return;
+
+    size_t pos = 0;
+    for (size_t i = 0; i < StateCount; i++)
+    {
+        for (size_t j = 0; j < State[i].SampleIndex && pos < total; j++)
+            sample[pos++] = State[i].Sample[j];
+    }
+
+    Stdlib::Sort(sample, pos, [](ulong a, ulong b) { return a < b; });
+
+    // runs of equal addresses, keep the longest ones sorted by count
+    ulong topRip[TopCount] = {0};
+    size_t topHits[TopCount] = {0};
+    for (size_t i = 0; i < pos;)
+    {
+        size_t j = i;
+        while (j < pos && sample[j] == sample[i])
+            j++;
+
+        size_t hits = j - i;
+        for (size_t k = 0; k < TopCount; k++)
+        {
+            if (hits > topHits[k])
+            {
+                for (size_t l = TopCount - 1; l > k; l--)
+                {
+                    topHits[l] = topHits[l - 1];
+                    topRip[l] = topRip[l - 1];
+                }
+                topHits[k] = hits;
+                topRip[k] = sample[i];
+                break;
+            }
+        }
+        i = j;
+    }
+
+    printer.Printf("top of %u samples (rip, resolve with addr2line):\n", pos);
+    for (size_t k = 0; k < TopCount && topHits[k] != 0; k++)
+        printer.Printf("0x%p %u pct\n", topRip[k], (topHits[k] * 100) / pos);
+
+    delete [] sample;
+}
+
+extern "C" void PerfInterrupt(IrqContext* ctx)
+{
+    Pmu::GetInstance().Interrupt(ctx);
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/asm.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+// Architectural performance monitoring (cpuid leaf 0xA): general purpose
+// counters count cycles, instructions, llc misses and branch misses on every
+// running cpu. The cycles counter overflows every period cycles into the lapic
+// perf LVT, the handler samples the interrupted rip into a per-cpu buffer.
+// Samples are only taken where interrupts are enabled. Start, Stop and Dump
+// are serialized by the caller (the shell).
+class Pmu final
+{
+public:
+    static Pmu& GetInstance()
+    {
+        static Pmu Instance;
+        return Instance;
+    }
+
+    static const u8 Vector = 0xFA;
+
+    bool Probe();
+
+    bool Start(ulong period);
+
+    void Stop();
+
+    bool IsRunning();
+
+    // per-cpu counts and the most sampled addresses
+    void Dump(Stdlib::Printer& printer);
+
+    void Interrupt(IrqContext* ctx);
+
+    enum Event
+    {
+        EventCycles,
+        EventInstructions,
+        EventLlcMisses,
+        EventBranchMisses,
+        EventCount,
+    };
+
+private:
+    Pmu();
+    ~Pmu();
+    Pmu(const Pmu& other) = delete;
+    Pmu(Pmu&& other) = delete;
+    Pmu& operator=(const Pmu& other) = delete;
+    Pmu& operator=(Pmu&& other) = delete;
+
+    static const size_t SampleCount = 4096;
+    static const size_t TopCount = 16;
+
+    struct CpuState
+    {
+        u64 Count[EventCount];
+        ulong Sample[SampleCount];
+        size_t SampleIndex;
+        ulong Lost;
+    };
+
+    static void StartCpu(void* ctx);
+    static void StopCpu(void* ctx);
+    static void ReadCpu(void* ctx);
+
+    void ProgramCounters();
+    void ReadCounters(CpuState& state);
+    void ClearCounters();
+
+    static const u32 PmcMsr = 0xC1;
+    static const u32 EvtSelMsr = 0x186;
+    static const u32 GlobalStatusMsr = 0x38E;
+    static const u32 GlobalCtrlMsr = 0x38F;
+    static const u32 GlobalOvfCtrlMsr = 0x390;
+
+    static const u64 EvtSelUsr = (1 << 16);
+    static const u64 EvtSelOs = (1 << 17);
+    static const u64 EvtSelInt = (1 << 20);
+    static const u64 EvtSelEnable = (1 << 22);
+
+    // event select and umask, bit index of the event in cpuid.0xA:EBX
+    struct EventDesc
+    {
+        const char* Name;
+        u8 Select;
+        u8 Umask;
+        ulong UnavailableBit;
+    };
+
+    static const EventDesc Events[EventCount];
+
+    ulong Version;
+    ulong CounterCount;
+    ulong CounterWidth;
+    ulong UsedCount;
+    ulong Period;
+    bool Running;
+    CpuState* State;
+    size_t StateCount;
+};
+
+}
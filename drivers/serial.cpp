@@ -4,6 +4,8 @@
 
 #include <kernel/asm.h>
 #include <kernel/idt.h>
+#include <kernel/panic.h>
+#include <kernel/preempt.h>
 #include <lib/stdlib.h>
 
 namespace Kernel
@@ -11,6 +13,10 @@ namespace Kernel
 
 Serial::Serial()
     : IntVector(-1)
+    , IrqActive(false)
+    , TxActive(false)
+    , DroppedCount(0)
+    , FillWork(&Serial::FillWorkFunc, this)
 {
     Outb(Port + 1, 0x00);    // Disable all interrupts
     Outb(Port + 3, 0x80);    // Enable DLAB (set baud rate divisor)
@@ -21,29 +27,28 @@ Serial::Serial()
     Outb(Port + 4, 0x0B);    // IRQs enabled, RTS/DSR set
 }
 
-void Serial::Send()
+// caller holds Lock, an empty transmitter takes a whole FIFO worth of bytes
+void Serial::FillFifo()
 {
-    ulong flags;
+    if (!IsTransmitEmpty())
+        return;
 
-    for (;;)
-    {
-        Lock.Lock(flags);
-
-        if (!Buf.IsEmpty())
-        {
-            Lock.Unlock(flags);
-            Wait();
-            Lock.Lock(flags);
-            if (!Buf.IsEmpty())
-                Outb(Port, Buf.Get());
-            Lock.Unlock(flags);
-        }
-        else
-        {
-            Lock.Unlock(flags);
-            break;
-        }
-    }
+    char chunk[FifoSize];
+    size_t count = Buf.GetMany(chunk, sizeof(chunk));
+    for (size_t i = 0; i < count; i++)
+        Outb(Port, chunk[i]);
+
+    TxActive = (count != 0) ? true : false;
+}
+
+void Serial::FillWorkFunc(void* ctx)
+{
+    auto serial = static_cast<Serial*>(ctx);
+
+    ulong flags;
+    serial->Lock.Lock(flags);
+    serial->FillFifo();
+    serial->Lock.Unlock(flags);
 }
 
 void Serial::Wait()
@@ -69,43 +74,91 @@ bool Serial::IsTransmitEmpty()
 
 Serial::~Serial()
 {
-    Send();
+    Flush();
 }
 
-void Serial::PrintString(const char *str)
+// queued bytes go out first to keep the order
+void Serial::WriteSync(const char *str, size_t len)
 {
-    Send();
-
-    ulong flags;
-    Lock.Lock(flags);
     for (;;)
     {
-        char c = *str++;
-        if (c == '\0')
-        {
+        Wait();
+        char chunk[FifoSize];
+        size_t count = Buf.GetMany(chunk, sizeof(chunk));
+        if (count == 0)
             break;
-        }
 
-        if (Buf.IsFull())
-        {
-            Lock.Unlock(flags);
-            Send();
-            Lock.Lock(flags);
-        }
+        for (size_t i = 0; i < count; i++)
+            Outb(Port, chunk[i]);
+    }
+
+    while (len != 0)
+    {
+        Wait();
+        size_t count = Stdlib::Min(len, FifoSize);
+        for (size_t i = 0; i < count; i++)
+            Outb(Port, str[i]);
+        str += count;
+        len -= count;
+    }
+}
+
+void Serial::Flush()
+{
+    ulong flags;
+    Lock.Lock(flags);
+    WriteSync(nullptr, 0);
+    Lock.Unlock(flags);
+}
+
+void Serial::PrintString(const char *str)
+{
+    Write(str, Stdlib::StrLen(str));
+}
+
+void Serial::Write(const char *str, size_t len)
+{
+    // other cpus are stopped and may hold the lock
+    if (unlikely(Panicker::GetInstance().IsActive()))
+    {
+        WriteSync(str, len);
+        return;
+    }
 
-        Buf.Put(c);
+    ulong flags;
+    Lock.Lock(flags);
+    if (unlikely(!IrqActive))
+    {
+        WriteSync(str, len);
+    }
+    else
+    {
+        size_t count = Buf.PutMany(str, len);
+        DroppedCount += len - count;
+        if (!TxActive)
+            FillFifo();
     }
     Lock.Unlock(flags);
 }
 
+ulong Serial::GetDroppedCount()
+{
+    ulong flags;
+    Lock.Lock(flags);
+    ulong count = DroppedCount;
+    Lock.Unlock(flags);
+    return count;
+}
+
 void Serial::VPrintf(const char *fmt, va_list args)
 {
 	char str[256];
 
-	if (Stdlib::VsnPrintf(str, sizeof(str), fmt, args) < 0)
+	int size = Stdlib::VsnPrintf(str, sizeof(str), fmt, args);
+	if (size <= 0)
 		return;
 
-	PrintString(str);
+	Write(str, size - 1);
 }
 
 void Serial::Printf(const char *fmt, ...)
@@ -121,7 +174,13 @@ void Serial::OnInterruptRegister(u8 irq, u8 vector)
 {
     (void)irq;
 
+    ulong flags;
+    Lock.Lock(flags);
     IntVector = vector;
+    IrqActive = true;
+    Outb(Port + 1, 0x02);    // Enable transmitter holding register empty interrupt
+    FillFifo();
+    Lock.Unlock(flags);
 }
 
 InterruptHandlerFn Serial::GetHandlerFn()
@@ -129,18 +188,24 @@ InterruptHandlerFn Serial::GetHandlerFn()
     return SerialInterruptStub;
 }
 
-void Serial::Interrupt(Context* ctx)
+void Serial::Interrupt(IrqContext* ctx)
 {
     (void)ctx;
+    InterruptTime irqTime(static_cast<u8>(IntVector));
 
-    Send();
+    Inb(Port + 2);    // reading interrupt identification acks THR empty
+    // a pending fill picks up this interrupt too
+    auto& workQueue = WorkQueue::GetInstance();
+    if (!workQueue.Queue(FillWork) && !workQueue.HasWorker(GetPerCpuIndex()))
+        FillWorkFunc(this);
 
     Lapic::EOI(IntVector);
 }
 
-extern "C" void SerialInterrupt(Context* ctx)
+extern "C" void SerialInterrupt(IrqContext* ctx)
 {
     Serial::GetInstance().Interrupt(ctx);
+    PreemptIrqExit();
 }
 
 }
\ No newline at end of file
@@ -3,12 +3,19 @@
 #include <include/types.h>
 #include <kernel/spin_lock.h>
 #include <kernel/interrupt.h>
+#include <kernel/work_queue.h>
 #include <kernel/asm.h>
 #include <lib/ring_buffer.h>
 
 namespace Kernel
 {
 
+// Output is asynchronous once the irq is registered: callers copy spans into
+// the ring and the transmitter-empty interrupt refills the 16-byte FIFO from
+// it, so nobody spins on the UART; a full ring drops the excess. The refill
+// runs as deferred work once workers are up. Before the
+// irq is registered and while panicking the ring can't drain, so output is
+// written through by polling.
 class Serial final : public InterruptHandler
 {
 public:
@@ -21,20 +28,28 @@ public:
 
     void PrintString(const char *str);
 
+    void Write(const char *str, size_t len);
+
     void VPrintf(const char *fmt, va_list args);
     void Printf(const char *fmt, ...);
 
     virtual void OnInterruptRegister(u8 irq, u8 vector) override;
     virtual InterruptHandlerFn GetHandlerFn() override;
 
-    void Interrupt(Context* ctx);
+    void Interrupt(IrqContext* ctx);
+
+    // drains the ring by polling
+    void Flush();
+
+    ulong GetDroppedCount();
 
 private:
     Serial();
     ~Serial();
 
-    void WriteChar(char c);
-    void Send();
+    void FillFifo();
+    static void FillWorkFunc(void* ctx);
+    void WriteSync(const char *str, size_t len);
     void Wait();
 
     Serial(const Serial& other) = delete;
@@ -44,11 +59,17 @@ private:
 
     bool IsTransmitEmpty();
     int IntVector;
+    volatile bool IrqActive;
+    bool TxActive;
+    ulong DroppedCount;
 
     Stdlib::RingBuffer<char, 4 * Const::PageSize> Buf;
     SpinLock Lock;
+    // refills the FIFO outside of the interrupt
+    Work FillWork;
 
     static const int Port = 0x3F8;
+    static const size_t FifoSize = 16;
 };
 
 }
\ No newline at end of file
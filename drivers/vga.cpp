@@ -8,6 +8,8 @@ namespace Kernel
 
 VgaTerm::VgaTerm()
     : Buf(reinterpret_cast<u16*>(Mm::PageTable::GetInstance().PhysToVirt(BufAddr)))
+    , DirtyRows(0)
+    , CursorOffset(~((u16)0))
     , Row(0)
     , Column(0)
     , Width(MaxWidth)
@@ -17,7 +19,7 @@ VgaTerm::VgaTerm()
     Stdlib::AutoLock lock(Lock);
 
     ClsLockHeld();
-    Cursor();
+    Flush();
 }
 
 VgaTerm::~VgaTerm()
@@ -51,7 +53,8 @@ void VgaTerm::PutCharAt(char c, u8 color, u8 x, u8 y)
     BugOn(x >= Width);
     BugOn(y >= Height);
 
-    Buf[GetIndex(x, y)] = MakeEntry(c, color);
+    Shadow[GetIndex(x, y)] = MakeEntry(c, color);
+    DirtyRows |= (u32)1 << y;
 }
 
 void VgaTerm::Overflow()
@@ -66,11 +69,10 @@ void VgaTerm::Overflow()
     {
         for (size_t row = 0; row < Height - 1; row++)
         {
-            for (size_t column = 0; column < Width; column++)
-            {
-                Buf[GetIndex(column, row)] = Buf[GetIndex(column, row + 1)];
-            }
+            Stdlib::MemCpy(&Shadow[GetIndex(0, row)], &Shadow[GetIndex(0, row + 1)],
+                Width * sizeof(Shadow[0]));
         }
+        DirtyRows = ((u32)1 << Height) - 1;
 
         for (size_t column = 0; column < Width; column++)
             PutCharAt('\0', MakeColor(ColorBlack, ColorBlack), column, Height - 1);
@@ -95,8 +97,6 @@ void VgaTerm::PutChar(char c)
         PutCharAt(c, ColorCode, Column++, Row);
         Overflow();
     }
-
-    Cursor();
 }
 
 void VgaTerm::PutsLockHeld(const char *str)
@@ -116,6 +116,7 @@ void VgaTerm::Puts(const char *str)
     Stdlib::AutoLock lock(Lock);
 
     PutsLockHeld(str);
+    Flush();
 }
 
 void VgaTerm::ClsLockHeld()
@@ -132,7 +133,7 @@ void VgaTerm::Cls()
     ClsLockHeld();
     Row = 0;
     Column = 0;
-    Cursor();
+    Flush();
 }
 
 void VgaTerm::VPrintf(const char *fmt, va_list args)
@@ -145,6 +146,7 @@ void VgaTerm::VPrintf(const char *fmt, va_list args)
     Stdlib::AutoLock lock(Lock);
 
     PutsLockHeld(str);
+    Flush();
 }
 
 void VgaTerm::Printf(const char *fmt, ...)
@@ -161,11 +163,43 @@ void VgaTerm::PrintString(const char *s)
     Stdlib::AutoLock lock(Lock);
 
     PutsLockHeld(s);
+    Flush();
+}
+
+// copies runs of dirty rows to VGA memory, caller holds Lock
+void VgaTerm::Flush()
+{
+    u8 row = 0;
+    while (DirtyRows != 0 && row < Height)
+    {
+        if (!(DirtyRows & ((u32)1 << row)))
+        {
+            row++;
+            continue;
+        }
+
+        u8 end = row;
+        while (end < Height && (DirtyRows & ((u32)1 << end)))
+        {
+            DirtyRows &= ~((u32)1 << end);
+            end++;
+        }
+
+        Stdlib::MemCpy(&Buf[GetIndex(0, row)], &Shadow[GetIndex(0, row)],
+            (end - row) * Width * sizeof(Shadow[0]));
+        row = end;
+    }
+
+    Cursor();
 }
 
 void VgaTerm::Cursor()
 {
     u16 offset = ((Row % Height) * Width + (Column % Width)) % (Width * Height);
+    if (offset == CursorOffset)
+        return;
+
+    CursorOffset = offset;
     Outb(VgaBase, VgaIndex + 1);
     Outb(VgaBase + 1, offset & 0xFF);
     Outb(VgaBase, VgaIndex);
@@ -189,6 +223,7 @@ void VgaTerm::Backspace()
             PutCharAt('\0', MakeColor(ColorBlack, ColorBlack), Column, Row);
         }
     }
+    Flush();
 }
 
 }
@@ -7,6 +7,9 @@
 namespace Kernel
 {
 
+// Output goes to a cached shadow of the screen with per-row dirty bits, the
+// uncached VGA memory gets the dirty rows in bulk and the cursor is moved
+// only once per call.
 class VgaTerm : public Stdlib::Printer
 {
 public:
@@ -66,6 +69,7 @@ private:
 
     void PutChar(char c);
     void Cursor();
+    void Flush();
 
     void PutsLockHeld(const char *s);
     void ClsLockHeld();
@@ -74,8 +78,12 @@ private:
 
     static const u8 MaxWidth = 80;
     static const u8 MaxHeight = 25;
+    static_assert(MaxHeight <= 32, "Dirty row mask too small");
 
     u16 *Buf;
+    u16 Shadow[MaxWidth * MaxHeight];
+    u32 DirtyRows;
+    u16 CursorOffset;
     u8 Row;
     u8 Column;
     u8 Width;
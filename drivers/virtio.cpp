@@ -0,0 +1,535 @@
+#include "virtio.h"
+
+#include <kernel/asm.h>
+#include <kernel/panic.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <mm/mmio.h>
+#include <mm/page_allocator.h>
+#include <mm/page_table.h>
+#include <mm/vmalloc.h>
+
+namespace Kernel
+{
+
+VirtQueue::VirtQueue()
+    : Index(0)
+    , Size(0)
+    , EventIdx(false)
+    , Pages(nullptr)
+    , Desc(nullptr)
+    , Avail(nullptr)
+    , Used(nullptr)
+    , Cookie(nullptr)
+    , FreeHead(0)
+    , FreeCount(0)
+    , AvailShadow(0)
+    , KickedIdx(0)
+    , LastUsed(0)
+    , NotifyAddr(nullptr)
+    , Kicks(0)
+{
+}
+
+VirtQueue::~VirtQueue()
+{
+    Release();
+}
+
+bool VirtQueue::Setup(u16 index, u16 size, bool eventIdx)
+{
+    if (BugOn(Pages != nullptr || size == 0))
+        return false;
+
+    // avail: flags, idx, ring, used event; used: flags, idx, ring, avail
+    // event. The device writes the used ring, keep it off the lines the
+    // driver writes
+    size_t availOffset = size * sizeof(VirtqDesc);
+    size_t usedOffset = Stdlib::RoundUp(availOffset + 6 + 2 * size, Const::CacheLineSize);
+    size_t cookieOffset = Stdlib::RoundUp(usedOffset + 6 + sizeof(VirtqUsedElem) * size, Const::CacheLineSize);
+    size_t pages = Stdlib::SizeInPages(cookieOffset + sizeof(void*) * size);
+
+    Pages = Mm::PageAllocatorImpl::GetInstance().AllocZeroed(pages);
+    if (Pages == nullptr)
+        return false;
+
+    Index = index;
+    Size = size;
+    EventIdx = eventIdx;
+    Desc = static_cast<VirtqDesc*>(Pages);
+    Avail = Stdlib::MemAdd(Pages, availOffset);
+    Used = Stdlib::MemAdd(Pages, usedOffset);
+    Cookie = static_cast<void**>(Stdlib::MemAdd(Pages, cookieOffset));
+
+    for (u16 i = 0; i < size; i++)
+        Desc[i].Next = (i + 1 < size) ? i + 1 : 0;
+
+    FreeHead = 0;
+    FreeCount = size;
+    AvailShadow = 0;
+    KickedIdx = 0;
+    LastUsed = 0;
+    Kicks = 0;
+    return true;
+}
+
+void VirtQueue::Release()
+{
+    if (Pages == nullptr)
+        return;
+
+    Mm::PageAllocatorImpl::GetInstance().Free(Pages);
+    Pages = nullptr;
+    Desc = nullptr;
+    Avail = nullptr;
+    Used = nullptr;
+    Cookie = nullptr;
+    Size = 0;
+    FreeCount = 0;
+}
+
+volatile u16* VirtQueue::AvailFlags()
+{
+    return static_cast<volatile u16*>(Avail);
+}
+
+volatile u16* VirtQueue::AvailIdx()
+{
+    return static_cast<volatile u16*>(Avail) + 1;
+}
+
+volatile u16* VirtQueue::AvailRing()
+{
+    return static_cast<volatile u16*>(Avail) + 2;
+}
+
+volatile u16* VirtQueue::UsedEvent()
+{
+    return static_cast<volatile u16*>(Avail) + 2 + Size;
+}
+
+volatile u16* VirtQueue::UsedFlags()
+{
+    return static_cast<volatile u16*>(Used);
+}
+
+volatile u16* VirtQueue::UsedIdx()
+{
+    return static_cast<volatile u16*>(Used) + 1;
+}
+
+volatile VirtqUsedElem* VirtQueue::UsedRing()
+{
+    return static_cast<volatile VirtqUsedElem*>(Stdlib::MemAdd(Used, 4));
+}
+
+volatile u16* VirtQueue::AvailEvent()
+{
+    return static_cast<volatile u16*>(Stdlib::MemAdd(Used, 4 + sizeof(VirtqUsedElem) * Size));
+}
+
+u16 VirtQueue::GetFreeHead()
+{
+    return FreeHead;
+}
+
+u16 VirtQueue::GetFreeCount()
+{
+    return FreeCount;
+}
+
+bool VirtQueue::Add(const Buffer* bufs, size_t count, void* cookie)
+{
+    if (BugOn(count == 0 || cookie == nullptr))
+        return false;
+
+    if (count > FreeCount)
+        return false;
+
+    u16 head = FreeHead;
+    u16 last = head;
+    u16 desc = head;
+    for (size_t i = 0; i < count; i++)
+    {
+        VirtqDesc& entry = Desc[desc];
+        entry.Addr = bufs[i].PhyAddr;
+        entry.Len = bufs[i].Len;
+        entry.Flags = (bufs[i].DeviceWrite) ? DescWrite : 0;
+        if (i + 1 < count)
+            entry.Flags |= DescNext;
+        last = desc;
+        desc = entry.Next;
+    }
+
+    FreeHead = Desc[last].Next;
+    FreeCount -= count;
+    Cookie[head] = cookie;
+
+    AvailRing()[AvailShadow % Size] = head;
+    AvailShadow++;
+    return true;
+}
+
+bool VirtQueue::Kick()
+{
+    u16 newIdx = AvailShadow;
+    u16 oldIdx = KickedIdx;
+    if (newIdx == oldIdx)
+        return false;
+
+    // ring entries before the index, the index before reading whether the
+    // device wants a notify
+    Barrier();
+    *AvailIdx() = newIdx;
+    KickedIdx = newIdx;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    bool notify;
+    if (EventIdx)
+    {
+        u16 event = *AvailEvent();
+        notify = (static_cast<u16>(newIdx - event - 1) < static_cast<u16>(newIdx - oldIdx)) ? true : false;
+    }
+    else
+    {
+        notify = (*UsedFlags() & UsedNoNotify) ? false : true;
+    }
+
+    if (!notify)
+        return false;
+
+    *static_cast<volatile u16*>(NotifyAddr) = Index;
+    Kicks++;
+    return true;
+}
+
+void* VirtQueue::GetUsed(u32& len)
+{
+    if (LastUsed == *UsedIdx())
+        return nullptr;
+
+    // the index before the entry it covers
+    Barrier();
+    volatile VirtqUsedElem& elem = UsedRing()[LastUsed % Size];
+    u16 head = static_cast<u16>(elem.Id);
+    len = elem.Len;
+    LastUsed++;
+
+    if (BugOn(head >= Size))
+        return nullptr;
+
+    void* cookie = Cookie[head];
+    Cookie[head] = nullptr;
+
+    u16 last = head;
+    u16 count = 1;
+    while (Desc[last].Flags & DescNext)
+    {
+        last = Desc[last].Next;
+        count++;
+    }
+
+    Desc[last].Next = FreeHead;
+    FreeHead = head;
+    FreeCount += count;
+    return cookie;
+}
+
+bool VirtQueue::EnableInterrupt()
+{
+    if (EventIdx)
+        *UsedEvent() = LastUsed;
+    else
+        *AvailFlags() = 0;
+
+    // the event store before the used index load, else a completion in
+    // between is neither seen nor interrupts
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return (LastUsed == *UsedIdx()) ? true : false;
+}
+
+void VirtQueue::DisableInterrupt()
+{
+    // with event indexes the stale used event already keeps the device
+    // quiet until EnableInterrupt moves it
+    if (!EventIdx)
+        *AvailFlags() = AvailNoInterrupt;
+}
+
+u16 VirtQueue::GetIndex()
+{
+    return Index;
+}
+
+u16 VirtQueue::GetSize()
+{
+    return Size;
+}
+
+ulong VirtQueue::GetDescPhyAddr()
+{
+    return Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(Desc));
+}
+
+ulong VirtQueue::GetAvailPhyAddr()
+{
+    return Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(Avail));
+}
+
+ulong VirtQueue::GetUsedPhyAddr()
+{
+    return Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(Used));
+}
+
+void VirtQueue::SetNotifyAddress(void* addr)
+{
+    NotifyAddr = addr;
+}
+
+ulong VirtQueue::GetKicks()
+{
+    return Kicks;
+}
+
+VirtioPci::VirtioPci()
+    : Dev(nullptr)
+    , Common(nullptr)
+    , Notify(nullptr)
+    , Isr(nullptr)
+    , DeviceConfig(nullptr)
+    , NotifyMultiplier(0)
+{
+}
+
+VirtioPci::~VirtioPci()
+{
+}
+
+u8 VirtioPci::ReadCommon8(ulong offset)
+{
+    return *static_cast<volatile u8*>(Stdlib::MemAdd(Common, offset));
+}
+
+u16 VirtioPci::ReadCommon16(ulong offset)
+{
+    return *static_cast<volatile u16*>(Stdlib::MemAdd(Common, offset));
+}
+
+u32 VirtioPci::ReadCommon32(ulong offset)
+{
+    return Mm::MmIo::Read32(Stdlib::MemAdd(Common, offset));
+}
+
+void VirtioPci::WriteCommon8(ulong offset, u8 value)
+{
+    *static_cast<volatile u8*>(Stdlib::MemAdd(Common, offset)) = value;
+}
+
+void VirtioPci::WriteCommon16(ulong offset, u16 value)
+{
+    *static_cast<volatile u16*>(Stdlib::MemAdd(Common, offset)) = value;
+}
+
+void VirtioPci::WriteCommon32(ulong offset, u32 value)
+{
+    Mm::MmIo::Write32(Stdlib::MemAdd(Common, offset), value);
+}
+
+void VirtioPci::WriteCommon64(ulong offset, u64 value)
+{
+    // the spec allows 32-bit halves, low first
+    WriteCommon32(offset, static_cast<u32>(value));
+    WriteCommon32(offset + 4, static_cast<u32>(value >> 32));
+}
+
+void* VirtioPci::MapCap(PciDevice& dev, u8 cap)
+{
+    auto& pci = Pci::GetInstance();
+    u8 bar = pci.Read8(dev, cap + 4);
+    u32 offset = pci.Read32(dev, cap + 8);
+    u32 length = pci.Read32(dev, cap + 12);
+
+    if (bar >= PciDevice::MaxBars || length == 0)
+        return nullptr;
+
+    PciBar& entry = dev.Bar[bar];
+    if (entry.Size == 0 || entry.Io || (ulong)offset + length > entry.Size)
+        return nullptr;
+
+    return Mm::Vmalloc::GetInstance().MapIo(entry.Address + offset, length,
+        Mm::PageTable::MapWritable | Mm::PageTable::MapCacheDisabled);
+}
+
+bool VirtioPci::Setup(PciDevice& dev)
+{
+    auto& pci = Pci::GetInstance();
+
+    for (u8 cap = pci.FindCapability(dev, Pci::CapVendor); cap != 0;
+         cap = pci.FindCapability(dev, Pci::CapVendor, cap))
+    {
+        u8 type = pci.Read8(dev, cap + 3);
+        void** region = nullptr;
+        switch (type)
+        {
+        case CapCommon:
+            region = &Common;
+            break;
+        case CapNotify:
+            region = &Notify;
+            break;
+        case CapIsr:
+            region = &Isr;
+            break;
+        case CapDevice:
+            region = &DeviceConfig;
+            break;
+        default:
+            break;
+        }
+
+        // the first capability of each type is the preferred one
+        if (region == nullptr || *region != nullptr)
+            continue;
+
+        *region = MapCap(dev, cap);
+        if (*region == nullptr)
+        {
+            Trace(0, "Virtio: can't map cap type %u", (ulong)type);
+            return false;
+        }
+
+        if (type == CapNotify)
+            NotifyMultiplier = pci.Read32(dev, cap + 16);
+    }
+
+    if (Common == nullptr || Notify == nullptr || DeviceConfig == nullptr)
+    {
+        Trace(0, "Virtio: %u:%u.%u no modern interface", (ulong)dev.Bus, (ulong)dev.Slot, (ulong)dev.Func);
+        return false;
+    }
+
+    Dev = &dev;
+    pci.EnableBusMaster(dev);
+
+    WriteCommon8(CommonDeviceStatus, 0);
+    for (ulong i = 0; ReadCommon8(CommonDeviceStatus) != 0; i++)
+    {
+        if (i >= ResetTimeoutMs)
+        {
+            Trace(0, "Virtio: reset timeout");
+            return false;
+        }
+        Delay(Const::NanoSecsInMs);
+    }
+
+    WriteCommon8(CommonDeviceStatus, StatusAcknowledge);
+    WriteCommon8(CommonDeviceStatus, StatusAcknowledge | StatusDriver);
+
+    // no config change interrupts
+    WriteCommon16(CommonMsixConfig, NoVector);
+    return true;
+}
+
+u64 VirtioPci::GetFeatures()
+{
+    WriteCommon32(CommonDeviceFeatureSelect, 0);
+    u64 features = ReadCommon32(CommonDeviceFeature);
+    WriteCommon32(CommonDeviceFeatureSelect, 1);
+    features |= (u64)ReadCommon32(CommonDeviceFeature) << 32;
+    return features;
+}
+
+bool VirtioPci::SetFeatures(u64 features)
+{
+    if (!(features & FeatureVersion1))
+        return false;
+
+    WriteCommon32(CommonDriverFeatureSelect, 0);
+    WriteCommon32(CommonDriverFeature, static_cast<u32>(features));
+    WriteCommon32(CommonDriverFeatureSelect, 1);
+    WriteCommon32(CommonDriverFeature, static_cast<u32>(features >> 32));
+
+    WriteCommon8(CommonDeviceStatus, ReadCommon8(CommonDeviceStatus) | StatusFeaturesOk);
+    return (ReadCommon8(CommonDeviceStatus) & StatusFeaturesOk) ? true : false;
+}
+
+u16 VirtioPci::GetQueueCount()
+{
+    return ReadCommon16(CommonNumQueues);
+}
+
+u16 VirtioPci::GetQueueMaxSize(u16 index)
+{
+    WriteCommon16(CommonQueueSelect, index);
+    return ReadCommon16(CommonQueueSize);
+}
+
+bool VirtioPci::EnableQueue(VirtQueue& queue, u16 msixEntry)
+{
+    WriteCommon16(CommonQueueSelect, queue.GetIndex());
+    WriteCommon16(CommonQueueSize, queue.GetSize());
+    WriteCommon64(CommonQueueDesc, queue.GetDescPhyAddr());
+    WriteCommon64(CommonQueueDriver, queue.GetAvailPhyAddr());
+    WriteCommon64(CommonQueueDevice, queue.GetUsedPhyAddr());
+
+    WriteCommon16(CommonQueueMsixVector, msixEntry);
+    if (ReadCommon16(CommonQueueMsixVector) != msixEntry)
+    {
+        Trace(0, "Virtio: queue %u msix entry %u refused", (ulong)queue.GetIndex(), (ulong)msixEntry);
+        return false;
+    }
+
+    u16 notifyOff = ReadCommon16(CommonQueueNotifyOff);
+    queue.SetNotifyAddress(Stdlib::MemAdd(Notify, (ulong)notifyOff * NotifyMultiplier));
+
+    WriteCommon16(CommonQueueEnable, 1);
+    return true;
+}
+
+void VirtioPci::DriverOk()
+{
+    WriteCommon8(CommonDeviceStatus, ReadCommon8(CommonDeviceStatus) | StatusDriverOk);
+}
+
+void VirtioPci::Fail()
+{
+    if (Common != nullptr)
+        WriteCommon8(CommonDeviceStatus, ReadCommon8(CommonDeviceStatus) | StatusFailed);
+}
+
+u8 VirtioPci::ReadConfig8(ulong offset)
+{
+    return *static_cast<volatile u8*>(Stdlib::MemAdd(DeviceConfig, offset));
+}
+
+u16 VirtioPci::ReadConfig16(ulong offset)
+{
+    return *static_cast<volatile u16*>(Stdlib::MemAdd(DeviceConfig, offset));
+}
+
+u32 VirtioPci::ReadConfig32(ulong offset)
+{
+    return Mm::MmIo::Read32(Stdlib::MemAdd(DeviceConfig, offset));
+}
+
+u64 VirtioPci::ReadConfig64(ulong offset)
+{
+    // the halves must come from one config generation
+    u8 generation;
+    u64 value;
+    do
+    {
+        generation = ReadCommon8(CommonConfigGeneration);
+        value = ReadConfig32(offset);
+        value |= (u64)ReadConfig32(offset + 4) << 32;
+    } while (generation != ReadCommon8(CommonConfigGeneration));
+
+    return value;
+}
+
+PciDevice* VirtioPci::GetPciDevice()
+{
+    return Dev;
+}
+
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "pci.h"
+
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+struct VirtqDesc final
+{
+    u64 Addr;
+    u32 Len;
+    u16 Flags;
+    u16 Next;
+} __attribute__((packed));
+
+static_assert(sizeof(VirtqDesc) == 16, "Invalid size");
+
+struct VirtqUsedElem final
+{
+    u32 Id;
+    u32 Len;
+} __attribute__((packed));
+
+// Split virtqueue. Descriptors, avail and used rings live in one physically
+// contiguous block from the page allocator. Add only fills the rings, Kick
+// makes every chain added since the last kick visible with one avail index
+// store and notifies the device unless its event index says it will get to
+// them anyway. With event indexes the device interrupts once the used index
+// passes the used event the driver sets in EnableInterrupt, so entries
+// completing while the driver drains the ring don't interrupt again.
+// Callers serialize access.
+class VirtQueue final
+{
+public:
+    VirtQueue();
+    ~VirtQueue();
+
+    struct Buffer
+    {
+        ulong PhyAddr;
+        u32 Len;
+        // the device writes the buffer
+        bool DeviceWrite;
+    };
+
+    bool Setup(u16 index, u16 size, bool eventIdx);
+    void Release();
+
+    // descriptor the next Add starts its chain at
+    u16 GetFreeHead();
+    u16 GetFreeCount();
+
+    bool Add(const Buffer* bufs, size_t count, void* cookie);
+
+    // true if the device was notified
+    bool Kick();
+
+    // cookie of the next completed chain, nullptr if there is none
+    void* GetUsed(u32& len);
+
+    // asks for an interrupt on the next completion, false if some already
+    // completed and would be missed
+    bool EnableInterrupt();
+    void DisableInterrupt();
+
+    u16 GetIndex();
+    u16 GetSize();
+    ulong GetDescPhyAddr();
+    ulong GetAvailPhyAddr();
+    ulong GetUsedPhyAddr();
+
+    void SetNotifyAddress(void* addr);
+
+    ulong GetKicks();
+
+private:
+    VirtQueue(const VirtQueue& other) = delete;
+    VirtQueue(VirtQueue&& other) = delete;
+    VirtQueue& operator=(const VirtQueue& other) = delete;
+    VirtQueue& operator=(VirtQueue&& other) = delete;
+
+    static const u16 DescNext = 1;
+    static const u16 DescWrite = 2;
+
+    static const u16 AvailNoInterrupt = 1;
+    static const u16 UsedNoNotify = 1;
+
+    volatile u16* AvailFlags();
+    volatile u16* AvailIdx();
+    volatile u16* AvailRing();
+    volatile u16* UsedEvent();
+    volatile u16* UsedFlags();
+    volatile u16* UsedIdx();
+    volatile VirtqUsedElem* UsedRing();
+    volatile u16* AvailEvent();
+
+    u16 Index;
+    u16 Size;
+    bool EventIdx;
+    void* Pages;
+    VirtqDesc* Desc;
+    void* Avail;
+    void* Used;
+    // per head descriptor
+    void** Cookie;
+    u16 FreeHead;
+    u16 FreeCount;
+    // avail index the next Add fills and the one the last Kick published
+    u16 AvailShadow;
+    u16 KickedIdx;
+    u16 LastUsed;
+    void* NotifyAddr;
+    ulong Kicks;
+};
+
+// Virtio 1.0 PCI transport: finds the common, notify, isr and device config
+// regions through the vendor capabilities and maps each one uncached, the
+// bars holding them are often prefetchable.
+class VirtioPci final
+{
+public:
+    VirtioPci();
+    ~VirtioPci();
+
+    // resets the device and acknowledges it
+    bool Setup(PciDevice& dev);
+
+    u64 GetFeatures();
+
+    // FeatureVersion1 is required, false if the device refuses the set
+    bool SetFeatures(u64 features);
+
+    u16 GetQueueCount();
+    u16 GetQueueMaxSize(u16 index);
+
+    // hands the rings of an already Setup queue to the device, interrupts
+    // go to MSI-X table entry msixEntry
+    bool EnableQueue(VirtQueue& queue, u16 msixEntry);
+
+    void DriverOk();
+
+    void Fail();
+
+    u8 ReadConfig8(ulong offset);
+    u16 ReadConfig16(ulong offset);
+    u32 ReadConfig32(ulong offset);
+    u64 ReadConfig64(ulong offset);
+
+    PciDevice* GetPciDevice();
+
+    static const u16 VendorId = 0x1AF4;
+    // modern devices are 0x1040 + type, transitional ones have their own ids
+    static const u16 ModernDeviceBase = 0x1040;
+
+    static const u64 FeatureEventIdx = (1UL << 29);
+    static const u64 FeatureVersion1 = (1UL << 32);
+
+    static const u16 NoVector = 0xFFFF;
+
+private:
+    VirtioPci(const VirtioPci& other) = delete;
+    VirtioPci(VirtioPci&& other) = delete;
+    VirtioPci& operator=(const VirtioPci& other) = delete;
+    VirtioPci& operator=(VirtioPci&& other) = delete;
+
+    void* MapCap(PciDevice& dev, u8 cap);
+
+    static const u8 CapCommon = 1;
+    static const u8 CapNotify = 2;
+    static const u8 CapIsr = 3;
+    static const u8 CapDevice = 4;
+
+    static const ulong CommonDeviceFeatureSelect = 0;
+    static const ulong CommonDeviceFeature = 4;
+    static const ulong CommonDriverFeatureSelect = 8;
+    static const ulong CommonDriverFeature = 12;
+    static const ulong CommonMsixConfig = 16;
+    static const ulong CommonNumQueues = 18;
+    static const ulong CommonDeviceStatus = 20;
+    static const ulong CommonConfigGeneration = 21;
+    static const ulong CommonQueueSelect = 22;
+    static const ulong CommonQueueSize = 24;
+    static const ulong CommonQueueMsixVector = 26;
+    static const ulong CommonQueueEnable = 28;
+    static const ulong CommonQueueNotifyOff = 30;
+    static const ulong CommonQueueDesc = 32;
+    static const ulong CommonQueueDriver = 40;
+    static const ulong CommonQueueDevice = 48;
+
+    static const u8 StatusAcknowledge = 1;
+    static const u8 StatusDriver = 2;
+    static const u8 StatusDriverOk = 4;
+    static const u8 StatusFeaturesOk = 8;
+    static const u8 StatusFailed = 128;
+
+    static const ulong ResetTimeoutMs = 100;
+
+    u8 ReadCommon8(ulong offset);
+    u16 ReadCommon16(ulong offset);
+    u32 ReadCommon32(ulong offset);
+    void WriteCommon8(ulong offset, u8 value);
+    void WriteCommon16(ulong offset, u16 value);
+    void WriteCommon32(ulong offset, u32 value);
+    void WriteCommon64(ulong offset, u64 value);
+
+    PciDevice* Dev;
+    void* Common;
+    void* Notify;
+    void* Isr;
+    void* DeviceConfig;
+    u32 NotifyMultiplier;
+};
+
+}
@@ -0,0 +1,453 @@
+#include "virtio_blk.h"
+
+#include <kernel/completion.h>
+#include <kernel/cpu.h>
+#include <kernel/panic.h>
+#include <kernel/parameters.h>
+#include <kernel/sched.h>
+#include <kernel/trace.h>
+#include <mm/memory_map.h>
+#include <mm/page_allocator.h>
+#include <mm/page_table.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+VirtioBlk::VirtioBlk()
+    : QueueCount(0)
+    , Features(0)
+    , Capacity(0)
+    , SizeMax(0)
+    , SegMax(0)
+    , BlockSize(SectorSize)
+    , Batch(Parameters::DefaultBlkBatch)
+    , Present(false)
+{
+    for (size_t i = 0; i < MaxQueues; i++)
+    {
+        Queue& queue = Queues[i];
+        queue.Headers = nullptr;
+        queue.HeadersPhyAddr = 0;
+        queue.Cpu = 0;
+        queue.Vector = 0;
+        queue.Submitted = 0;
+        queue.Completed = 0;
+        queue.Batches = 0;
+        queue.Interrupts = 0;
+    }
+
+    Stdlib::MemSet(CpuQueue, 0, sizeof(CpuQueue));
+}
+
+VirtioBlk::~VirtioBlk()
+{
+}
+
+bool VirtioBlk::SetupQueue(PciDevice& dev, ulong index, ulong cpu, ulong depth)
+{
+    Queue& queue = Queues[index];
+    u16 index16 = static_cast<u16>(index);
+
+    ulong size = Transport.GetQueueMaxSize(index16);
+    if (size == 0)
+        return false;
+
+    if (size > depth)
+        size = depth;
+
+    // power of two keeps the ring index math cheap
+    while (size & (size - 1))
+        size &= size - 1;
+
+    if (!queue.Vq.Setup(index16, static_cast<u16>(size), (Features & VirtioPci::FeatureEventIdx) ? true : false))
+        return false;
+
+    queue.Headers = static_cast<Header*>(Mm::PageAllocatorImpl::GetInstance().AllocZeroed(
+        Stdlib::SizeInPages(size * sizeof(Header))));
+    if (queue.Headers == nullptr)
+        return false;
+
+    queue.HeadersPhyAddr = Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(queue.Headers));
+    queue.Cpu = cpu;
+
+    if (!Pci::GetInstance().EnableMsix(dev, index16, cpu, &VirtioBlk::InterruptFn, &queue, queue.Vector))
+        return false;
+
+    return Transport.EnableQueue(queue.Vq, index16);
+}
+
+void VirtioBlk::ReleaseQueues()
+{
+    for (size_t i = 0; i < MaxQueues; i++)
+    {
+        Queue& queue = Queues[i];
+        if (queue.Vector != 0)
+        {
+            Interrupt::FreeVector(queue.Vector);
+            queue.Vector = 0;
+        }
+
+        if (queue.Headers != nullptr)
+        {
+            Mm::PageAllocatorImpl::GetInstance().Free(queue.Headers);
+            queue.Headers = nullptr;
+        }
+
+        queue.Vq.Release();
+    }
+
+    QueueCount = 0;
+}
+
+bool VirtioBlk::Probe()
+{
+    auto& pci = Pci::GetInstance();
+
+    PciDevice* dev = pci.Find(VirtioPci::VendorId, DeviceIdModern);
+    if (dev == nullptr)
+        dev = pci.Find(VirtioPci::VendorId, DeviceIdTransitional);
+    if (dev == nullptr)
+    {
+        Trace(0, "VirtioBlk: no device");
+        return false;
+    }
+
+    if (dev->MsixCap == 0)
+    {
+        Trace(0, "VirtioBlk: no msix");
+        return false;
+    }
+
+    if (!Transport.Setup(*dev))
+        return false;
+
+    Features = Transport.GetFeatures() & (VirtioPci::FeatureVersion1 | VirtioPci::FeatureEventIdx |
+        FeatureSizeMax | FeatureSegMax | FeatureRo | FeatureBlkSize | FeatureFlush | FeatureMq);
+    if (!Transport.SetFeatures(Features))
+    {
+        Trace(0, "VirtioBlk: features 0x%p refused", Features);
+        Transport.Fail();
+        return false;
+    }
+
+    Capacity = Transport.ReadConfig64(ConfigCapacity);
+    SizeMax = (Features & FeatureSizeMax) ? Transport.ReadConfig32(ConfigSizeMax) : 0;
+    SegMax = (Features & FeatureSegMax) ? Transport.ReadConfig32(ConfigSegMax) : 0;
+    BlockSize = (Features & FeatureBlkSize) ? Transport.ReadConfig32(ConfigBlkSize) : SectorSize;
+
+    auto& params = Parameters::GetInstance();
+    Batch = params.GetBlkBatch();
+
+    CpuMask running = CpuTable::GetInstance().GetRunningCpus();
+    ulong queueCount = (Features & FeatureMq) ? Transport.ReadConfig16(ConfigNumQueues) : 1;
+    if (queueCount > running.Count())
+        queueCount = running.Count();
+    if (queueCount > MaxQueues)
+        queueCount = MaxQueues;
+    if (queueCount > dev->MsixTableSize)
+        queueCount = dev->MsixTableSize;
+    if (queueCount == 0)
+        queueCount = 1;
+
+    ulong index = 0;
+    for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+    {
+        if (index < queueCount && !SetupQueue(*dev, index, cpu, params.GetBlkQueueDepth()))
+        {
+            Trace(0, "VirtioBlk: can't setup queue %u", index);
+            Transport.Fail();
+            ReleaseQueues();
+            return false;
+        }
+
+        // cpus beyond the queues share them round robin
+        CpuQueue[cpu] = static_cast<u8>(index % queueCount);
+        index++;
+    }
+
+    QueueCount = queueCount;
+    Transport.DriverOk();
+    Present = true;
+
+    Trace(0, "VirtioBlk: capacity %u queues %u depth %u batch %u features 0x%p",
+        Capacity, QueueCount, (ulong)Queues[0].Vq.GetSize(), Batch, Features);
+    return true;
+}
+
+bool VirtioBlk::IsPresent()
+{
+    return Present;
+}
+
+bool VirtioBlk::IsReadOnly()
+{
+    return (Features & FeatureRo) ? true : false;
+}
+
+u64 VirtioBlk::GetCapacity()
+{
+    return Capacity;
+}
+
+void* VirtioBlk::AllocBuffer(size_t pages)
+{
+    return Mm::PageAllocatorImpl::GetInstance().Alloc(pages);
+}
+
+void VirtioBlk::FreeBuffer(void* buf)
+{
+    Mm::PageAllocatorImpl::GetInstance().Free(buf);
+}
+
+size_t VirtioBlk::SegmentCount(const BlkRequest& req)
+{
+    size_t bytes = req.Sectors * SectorSize;
+    if (bytes == 0)
+        return 0;
+
+    return (SizeMax != 0) ? (bytes + SizeMax - 1) / SizeMax : 1;
+}
+
+bool VirtioBlk::IsValid(const BlkRequest& req)
+{
+    if (!Present)
+        return false;
+
+    if (req.Type == BlkRequest::TypeFlush)
+        return (Features & FeatureFlush) ? true : false;
+
+    if (req.Type != BlkRequest::TypeRead && req.Type != BlkRequest::TypeWrite)
+        return false;
+
+    if (req.Type == BlkRequest::TypeWrite && (Features & FeatureRo))
+        return false;
+
+    if (req.Sectors == 0 || req.Sector >= Capacity || req.Sectors > Capacity - req.Sector)
+        return false;
+
+    // the device gets physical addresses, only the direct map has them
+    ulong addr = reinterpret_cast<ulong>(req.Buf);
+    if (addr < Mm::MemoryMap::KernelSpaceBase ||
+        addr - Mm::MemoryMap::KernelSpaceBase + req.Sectors * SectorSize > Mm::PageTable::GetInstance().GetDirectMapEnd())
+        return false;
+
+    size_t segments = SegmentCount(req);
+    if (segments > MaxSegments || (SegMax != 0 && segments > SegMax))
+        return false;
+
+    return true;
+}
+
+size_t VirtioBlk::Submit(BlkRequest** reqs, size_t count)
+{
+    if (!Present || count == 0)
+        return 0;
+
+    auto& pt = Mm::PageTable::GetInstance();
+    Queue& queue = Queues[CpuQueue[GetPerCpuIndex()]];
+    VirtQueue::Buffer bufs[MaxSegments + 2];
+    size_t batched = 0;
+    size_t i;
+
+    Stdlib::AutoLock lock(queue.Lock);
+
+    for (i = 0; i < count; i++)
+    {
+        BlkRequest* req = reqs[i];
+        if (!IsValid(*req))
+            break;
+
+        size_t segments = (req->Type == BlkRequest::TypeFlush) ? 0 : SegmentCount(*req);
+        if (segments + 2 > queue.Vq.GetFreeCount())
+            break;
+
+        // the header slot is the head descriptor of the chain
+        u16 slot = queue.Vq.GetFreeHead();
+        Header& header = queue.Headers[slot];
+        header.Type = req->Type;
+        header.Reserved = 0;
+        header.Sector = (req->Type == BlkRequest::TypeFlush) ? 0 : req->Sector;
+        header.Status = StatusPending;
+
+        ulong headerPhyAddr = queue.HeadersPhyAddr + slot * sizeof(Header);
+        bufs[0].PhyAddr = headerPhyAddr;
+        bufs[0].Len = HeaderOutSize;
+        bufs[0].DeviceWrite = false;
+
+        ulong dataPhyAddr = (segments != 0) ? pt.VirtToPhys(reinterpret_cast<ulong>(req->Buf)) : 0;
+        size_t left = req->Sectors * SectorSize;
+        for (size_t j = 0; j < segments; j++)
+        {
+            size_t len = (SizeMax != 0 && left > SizeMax) ? SizeMax : left;
+            bufs[1 + j].PhyAddr = dataPhyAddr;
+            bufs[1 + j].Len = static_cast<u32>(len);
+            bufs[1 + j].DeviceWrite = (req->Type == BlkRequest::TypeRead) ? true : false;
+            dataPhyAddr += len;
+            left -= len;
+        }
+
+        bufs[1 + segments].PhyAddr = headerPhyAddr + HeaderOutSize;
+        bufs[1 + segments].Len = 1;
+        bufs[1 + segments].DeviceWrite = true;
+
+        req->Slot = slot;
+        req->Ok = false;
+        req->Next = nullptr;
+        if (BugOn(!queue.Vq.Add(bufs, segments + 2, req)))
+            break;
+
+        queue.Submitted++;
+        if (++batched == Batch)
+        {
+            queue.Vq.Kick();
+            queue.Batches++;
+            batched = 0;
+        }
+    }
+
+    if (batched != 0)
+    {
+        queue.Vq.Kick();
+        queue.Batches++;
+    }
+
+    return i;
+}
+
+void VirtioBlk::InterruptFn(void* ctx)
+{
+    VirtioBlk::GetInstance().Complete(*static_cast<Queue*>(ctx));
+}
+
+void VirtioBlk::Complete(Queue& queue)
+{
+    BlkRequest* done = nullptr;
+
+    {
+        Stdlib::AutoLock lock(queue.Lock);
+        queue.Interrupts++;
+
+        for (;;)
+        {
+            u32 len;
+            void* cookie;
+            while ((cookie = queue.Vq.GetUsed(len)) != nullptr)
+            {
+                BlkRequest* req = static_cast<BlkRequest*>(cookie);
+                req->Ok = (queue.Headers[req->Slot].Status == StatusOk) ? true : false;
+                req->Next = done;
+                done = req;
+                queue.Completed++;
+            }
+
+            if (queue.Vq.EnableInterrupt())
+                break;
+        }
+    }
+
+    // outside the lock, so callbacks may submit again
+    while (done != nullptr)
+    {
+        BlkRequest* req = done;
+        done = req->Next;
+        if (req->Done != nullptr)
+            req->Done(req);
+    }
+}
+
+void VirtioBlk::ExecuteDone(BlkRequest* req)
+{
+    static_cast<Completion*>(req->Ctx)->Complete(req->Ok);
+}
+
+bool VirtioBlk::Execute(BlkRequest** reqs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!IsValid(*reqs[i]))
+            return false;
+    }
+
+    Completion done(0);
+    for (size_t i = 0; i < count; i++)
+    {
+        reqs[i]->Done = &VirtioBlk::ExecuteDone;
+        reqs[i]->Ctx = &done;
+    }
+
+    bool ok = true;
+    size_t submitted = 0;
+    while (submitted < count)
+    {
+        // counted before the submit, completions may run before it returns
+        size_t batch = count - submitted;
+        done.Reset(batch);
+        size_t queued = Submit(reqs + submitted, batch);
+        for (size_t i = queued; i < batch; i++)
+            done.Complete();
+        submitted += queued;
+
+        // the queue is full: wait for ours in flight, or for anyone's if
+        // none of ours are, then go on
+        if (!done.Wait())
+            ok = false;
+        if (queued == 0)
+            Sleep(Const::NanoSecsInMs);
+    }
+
+    return ok;
+}
+
+bool VirtioBlk::Transfer(u32 type, u64 sector, void* buf, size_t sectors)
+{
+    BlkRequest req;
+    req.Type = type;
+    req.Sector = sector;
+    req.Buf = buf;
+    req.Sectors = sectors;
+    BlkRequest* reqs[1] = { &req };
+
+    return Execute(reqs, 1);
+}
+
+bool VirtioBlk::Read(u64 sector, void* buf, size_t sectors)
+{
+    return Transfer(BlkRequest::TypeRead, sector, buf, sectors);
+}
+
+bool VirtioBlk::Write(u64 sector, void* buf, size_t sectors)
+{
+    return Transfer(BlkRequest::TypeWrite, sector, buf, sectors);
+}
+
+bool VirtioBlk::Flush()
+{
+    // without the feature writes are durable once completed
+    if (!(Features & FeatureFlush))
+        return true;
+
+    return Transfer(BlkRequest::TypeFlush, 0, nullptr, 0);
+}
+
+void VirtioBlk::Dump(Stdlib::Printer& printer)
+{
+    if (!Present)
+    {
+        printer.Printf("no virtio-blk device\n");
+        return;
+    }
+
+    printer.Printf("capacity %u sectors block size %u size max %u seg max %u features 0x%p\n",
+        Capacity, (ulong)BlockSize, (ulong)SizeMax, (ulong)SegMax, Features);
+    printer.Printf("queues %u depth %u batch %u\n", QueueCount, (ulong)Queues[0].Vq.GetSize(), Batch);
+    printer.Printf("queue cpu vector submitted completed batches kicks interrupts\n");
+    for (size_t i = 0; i < QueueCount; i++)
+    {
+        Queue& queue = Queues[i];
+        printer.Printf("%u %u 0x%p %u %u %u %u %u\n", i, queue.Cpu, (ulong)queue.Vector,
+            queue.Submitted, queue.Completed, queue.Batches, queue.Vq.GetKicks(), queue.Interrupts);
+    }
+}
+
+}
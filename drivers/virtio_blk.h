@@ -0,0 +1,141 @@
+#pragma once
+
+#include "block_device.h"
+#include "virtio.h"
+
+#include <kernel/atomic.h>
+#include <kernel/cpu_mask.h>
+#include <kernel/spin_lock.h>
+#include <kernel/wait_queue.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+// virtio-blk over the virtio 1.0 PCI transport with one virtqueue per cpu
+// (as many as the device and the MSI-X table allow, cpus share queues
+// beyond that), each interrupting its own cpu. Submit adds a batch of
+// requests to the queue of the current cpu and notifies the device once per
+// blkbatch requests; completion interrupts are suppressed through event
+// indexes while a queue is being drained. Request headers live in a per-queue
+// array indexed by the head descriptor and data buffers come straight from
+// the page allocator, so nothing is copied.
+class VirtioBlk final : public BlockDevice
+{
+public:
+    static VirtioBlk& GetInstance()
+    {
+        static VirtioBlk Instance;
+        return Instance;
+    }
+
+    // takes the first virtio-blk device pci found, false if there is none
+    bool Probe();
+
+    bool IsPresent();
+
+    virtual u64 GetCapacity() override;
+
+    virtual bool IsReadOnly() override;
+
+    // physically contiguous pages usable as request buffers
+    void* AllocBuffer(size_t pages);
+    void FreeBuffer(void* buf);
+
+    virtual bool IsValid(const BlkRequest& req) override;
+
+    // adds to the queue of the current cpu
+    virtual size_t Submit(BlkRequest** reqs, size_t count) override;
+
+    // submits and sleeps until every request completes, replaces their Done
+    // and Ctx. False if any failed
+    bool Execute(BlkRequest** reqs, size_t count);
+
+    bool Read(u64 sector, void* buf, size_t sectors);
+    bool Write(u64 sector, void* buf, size_t sectors);
+    virtual bool Flush() override;
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t MaxQueues = 16;
+    // data descriptors of one request, more than one only under size max
+    static const size_t MaxSegments = 16;
+
+private:
+    VirtioBlk();
+    virtual ~VirtioBlk();
+    VirtioBlk(const VirtioBlk& other) = delete;
+    VirtioBlk(VirtioBlk&& other) = delete;
+    VirtioBlk& operator=(const VirtioBlk& other) = delete;
+    VirtioBlk& operator=(VirtioBlk&& other) = delete;
+
+    // the device reads the first 16 bytes and writes status
+    struct Header final
+    {
+        u32 Type;
+        u32 Reserved;
+        u64 Sector;
+        u8 Status;
+        u8 Pad[15];
+    } __attribute__((packed));
+
+    static_assert(sizeof(Header) == 32, "Invalid size");
+
+    static const ulong HeaderOutSize = 16;
+    static const u8 StatusOk = 0;
+    static const u8 StatusPending = 0xFF;
+
+    struct Queue final
+    {
+        VirtQueue Vq;
+        FastSpinLock Lock;
+        Header* Headers;
+        ulong HeadersPhyAddr;
+        ulong Cpu;
+        u8 Vector;
+        ulong Submitted;
+        ulong Completed;
+        ulong Batches;
+        ulong Interrupts;
+    } __attribute__((aligned(Const::CacheLineSize)));
+
+    static void InterruptFn(void* ctx);
+    static void ExecuteDone(BlkRequest* req);
+
+    void Complete(Queue& queue);
+    size_t SegmentCount(const BlkRequest& req);
+    bool SetupQueue(PciDevice& dev, ulong index, ulong cpu, ulong depth);
+    void ReleaseQueues();
+    bool Transfer(u32 type, u64 sector, void* buf, size_t sectors);
+
+    static const u16 DeviceIdModern = VirtioPci::ModernDeviceBase + 2;
+    static const u16 DeviceIdTransitional = 0x1001;
+
+    static const u64 FeatureSizeMax = (1UL << 1);
+    static const u64 FeatureSegMax = (1UL << 2);
+    static const u64 FeatureRo = (1UL << 5);
+    static const u64 FeatureBlkSize = (1UL << 6);
+    static const u64 FeatureFlush = (1UL << 9);
+    static const u64 FeatureMq = (1UL << 12);
+
+    static const ulong ConfigCapacity = 0;
+    static const ulong ConfigSizeMax = 8;
+    static const ulong ConfigSegMax = 12;
+    static const ulong ConfigBlkSize = 20;
+    static const ulong ConfigNumQueues = 34;
+
+    VirtioPci Transport;
+    Queue Queues[MaxQueues];
+    u8 CpuQueue[MaxCpus];
+    ulong QueueCount;
+    u64 Features;
+    u64 Capacity;
+    u32 SizeMax;
+    u32 SegMax;
+    u32 BlockSize;
+    ulong Batch;
+    bool Present;
+};
+
+}
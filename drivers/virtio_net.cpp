@@ -0,0 +1,526 @@
+#include "virtio_net.h"
+
+#include <kernel/cpu.h>
+#include <kernel/panic.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <mm/page_allocator.h>
+#include <mm/page_table.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+VirtioNet::VirtioNet()
+    : PairCount(0)
+    , CtrlPage(nullptr)
+    , Features(0)
+    , RxFn(nullptr)
+    , RxCtx(nullptr)
+    , Present(false)
+{
+    for (size_t i = 0; i < MaxPairs; i++)
+    {
+        QueuePair& pair = Pairs[i];
+        pair.PollWork.Init(&VirtioNet::PollFunc, &pair);
+        pair.Cpu = 0;
+        pair.Vector = 0;
+        pair.Pool = nullptr;
+        pair.PoolCount = 0;
+        pair.RxPackets = 0;
+        pair.TxPackets = 0;
+        pair.Interrupts = 0;
+        pair.Polls = 0;
+        pair.BusyPolls = 0;
+        pair.TxFull = 0;
+    }
+
+    Stdlib::MemSet(CpuPair, 0, sizeof(CpuPair));
+    Stdlib::MemSet(Mac, 0, sizeof(Mac));
+}
+
+VirtioNet::~VirtioNet()
+{
+}
+
+ulong VirtioNet::BufferPhyAddr(NetBuffer* buf)
+{
+    return Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(buf) + Headroom);
+}
+
+NetBuffer* VirtioNet::PoolGet(QueuePair& pair)
+{
+    NetBuffer* buf = pair.Pool;
+    if (buf != nullptr)
+    {
+        pair.Pool = buf->Next;
+        pair.PoolCount--;
+    }
+    else
+    {
+        buf = static_cast<NetBuffer*>(Mm::PageAllocatorImpl::GetInstance().Alloc(1));
+        if (buf == nullptr)
+            return nullptr;
+    }
+
+    buf->Data = reinterpret_cast<u8*>(buf) + Headroom + HeaderSize;
+    buf->Len = 0;
+    buf->Pair = static_cast<u16>(&pair - &Pairs[0]);
+    buf->Next = nullptr;
+    return buf;
+}
+
+void VirtioNet::PoolPut(QueuePair& pair, NetBuffer* buf)
+{
+    if (pair.PoolCount >= PoolMaxFactor * pair.Rx.GetSize())
+    {
+        Mm::PageAllocatorImpl::GetInstance().Free(buf);
+        return;
+    }
+
+    buf->Next = pair.Pool;
+    pair.Pool = buf;
+    pair.PoolCount++;
+}
+
+void VirtioNet::Recycle(NetBuffer* buf)
+{
+    if (BugOn(buf->Pair >= PairCount))
+        return;
+
+    QueuePair& pair = Pairs[buf->Pair];
+    Stdlib::AutoLock lock(pair.Lock);
+    PoolPut(pair, buf);
+}
+
+void VirtioNet::RecycleList(NetBuffer* list)
+{
+    while (list != nullptr)
+    {
+        NetBuffer* buf = list;
+        list = buf->Next;
+        Recycle(buf);
+    }
+}
+
+void VirtioNet::RefillRx(QueuePair& pair)
+{
+    while (pair.Rx.GetFreeCount() != 0)
+    {
+        NetBuffer* buf = PoolGet(pair);
+        if (buf == nullptr)
+            break;
+
+        VirtQueue::Buffer desc;
+        desc.PhyAddr = BufferPhyAddr(buf);
+        desc.Len = HeaderSize + MaxFrame;
+        desc.DeviceWrite = true;
+        if (BugOn(!pair.Rx.Add(&desc, 1, buf)))
+            break;
+    }
+
+    pair.Rx.Kick();
+}
+
+// completed tx buffers, recycled by the caller once it drops the lock as
+// they may belong to another pair
+NetBuffer* VirtioNet::ReapTx(QueuePair& pair)
+{
+    NetBuffer* done = nullptr;
+    u32 len;
+    void* cookie;
+
+    while ((cookie = pair.Tx.GetUsed(len)) != nullptr)
+    {
+        NetBuffer* buf = static_cast<NetBuffer*>(cookie);
+        buf->Next = done;
+        done = buf;
+    }
+
+    return done;
+}
+
+bool VirtioNet::SetupPair(PciDevice& dev, ulong index, ulong cpu)
+{
+    QueuePair& pair = Pairs[index];
+    u16 rxIndex = static_cast<u16>(2 * index);
+    u16 txIndex = static_cast<u16>(2 * index + 1);
+    bool eventIdx = (Features & VirtioPci::FeatureEventIdx) ? true : false;
+
+    u16 rxSize = Transport.GetQueueMaxSize(rxIndex);
+    u16 txSize = Transport.GetQueueMaxSize(txIndex);
+    if (rxSize == 0 || txSize == 0)
+        return false;
+
+    if (!pair.Rx.Setup(rxIndex, rxSize, eventIdx) || !pair.Tx.Setup(txIndex, txSize, eventIdx))
+        return false;
+
+    pair.Cpu = cpu;
+    if (!Pci::GetInstance().EnableMsix(dev, static_cast<u16>(index), cpu, &VirtioNet::InterruptFn, &pair, pair.Vector))
+        return false;
+
+    // tx completions are reaped by Send and the poll
+    return Transport.EnableQueue(pair.Rx, static_cast<u16>(index)) &&
+        Transport.EnableQueue(pair.Tx, VirtioPci::NoVector);
+}
+
+void VirtioNet::ReleasePairs()
+{
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+
+    for (size_t i = 0; i < MaxPairs; i++)
+    {
+        QueuePair& pair = Pairs[i];
+        if (pair.Vector != 0)
+        {
+            Interrupt::FreeVector(pair.Vector);
+            pair.Vector = 0;
+        }
+
+        while (pair.Pool != nullptr)
+        {
+            NetBuffer* buf = pair.Pool;
+            pair.Pool = buf->Next;
+            pageAllocator.Free(buf);
+        }
+        pair.PoolCount = 0;
+
+        pair.Rx.Release();
+        pair.Tx.Release();
+    }
+
+    Ctrl.Release();
+    if (CtrlPage != nullptr)
+    {
+        pageAllocator.Free(CtrlPage);
+        CtrlPage = nullptr;
+    }
+
+    PairCount = 0;
+}
+
+// the device starts with one pair, the control queue turns on the rest
+bool VirtioNet::SetPairs(ulong pairs)
+{
+    u8* cmd = static_cast<u8*>(CtrlPage);
+    ulong phyAddr = Mm::PageTable::GetInstance().VirtToPhys(reinterpret_cast<ulong>(cmd));
+
+    cmd[0] = CtrlMq;
+    cmd[1] = CtrlMqPairsSet;
+    *reinterpret_cast<u16*>(&cmd[2]) = static_cast<u16>(pairs);
+    cmd[4] = 0xFF;
+
+    VirtQueue::Buffer bufs[3];
+    bufs[0].PhyAddr = phyAddr;
+    bufs[0].Len = 2;
+    bufs[0].DeviceWrite = false;
+    bufs[1].PhyAddr = phyAddr + 2;
+    bufs[1].Len = 2;
+    bufs[1].DeviceWrite = false;
+    bufs[2].PhyAddr = phyAddr + 4;
+    bufs[2].Len = 1;
+    bufs[2].DeviceWrite = true;
+
+    if (!Ctrl.Add(bufs, 3, cmd))
+        return false;
+    Ctrl.Kick();
+
+    // runs once at probe, poll instead of spending a vector on it
+    u32 len;
+    for (ulong i = 0; Ctrl.GetUsed(len) == nullptr; i++)
+    {
+        if (i >= CtrlTimeoutMs)
+            return false;
+        Delay(Const::NanoSecsInMs);
+    }
+
+    return (*static_cast<volatile u8*>(&cmd[4]) == CtrlOk) ? true : false;
+}
+
+bool VirtioNet::Probe()
+{
+    auto& pci = Pci::GetInstance();
+
+    PciDevice* dev = pci.Find(VirtioPci::VendorId, DeviceIdModern);
+    if (dev == nullptr)
+        dev = pci.Find(VirtioPci::VendorId, DeviceIdTransitional);
+    if (dev == nullptr)
+    {
+        Trace(0, "VirtioNet: no device");
+        return false;
+    }
+
+    if (dev->MsixCap == 0)
+    {
+        Trace(0, "VirtioNet: no msix");
+        return false;
+    }
+
+    if (!Transport.Setup(*dev))
+        return false;
+
+    Features = Transport.GetFeatures() & (VirtioPci::FeatureVersion1 | VirtioPci::FeatureEventIdx |
+        FeatureMac | FeatureCtrlVq | FeatureMq);
+    // pairs beyond the first are only reachable through the control queue
+    if (!(Features & FeatureCtrlVq))
+        Features &= ~FeatureMq;
+
+    if (!Transport.SetFeatures(Features))
+    {
+        Trace(0, "VirtioNet: features 0x%p refused", Features);
+        Transport.Fail();
+        return false;
+    }
+
+    if (Features & FeatureMac)
+    {
+        for (size_t i = 0; i < sizeof(Mac); i++)
+            Mac[i] = Transport.ReadConfig8(ConfigMac + i);
+    }
+
+    ulong maxPairs = (Features & FeatureMq) ? Transport.ReadConfig16(ConfigMaxPairs) : 1;
+    CpuMask running = CpuTable::GetInstance().GetRunningCpus();
+    ulong pairCount = maxPairs;
+    if (pairCount > running.Count())
+        pairCount = running.Count();
+    if (pairCount > MaxPairs)
+        pairCount = MaxPairs;
+    if (pairCount > dev->MsixTableSize)
+        pairCount = dev->MsixTableSize;
+    if (pairCount == 0)
+        pairCount = 1;
+
+    bool ok = true;
+    ulong index = 0;
+    for (ulong cpu = running.First(); ok && cpu < MaxCpus; cpu = running.Next(cpu + 1))
+    {
+        if (index < pairCount && !SetupPair(*dev, index, cpu))
+        {
+            Trace(0, "VirtioNet: can't setup pair %u", index);
+            ok = false;
+            break;
+        }
+
+        CpuPair[cpu] = static_cast<u8>(index % pairCount);
+        index++;
+    }
+
+    if (ok && (Features & FeatureCtrlVq))
+    {
+        u16 ctrlIndex = static_cast<u16>(2 * maxPairs);
+        u16 ctrlSize = Transport.GetQueueMaxSize(ctrlIndex);
+        CtrlPage = Mm::PageAllocatorImpl::GetInstance().AllocZeroed(1);
+        ok = (ctrlSize != 0 && CtrlPage != nullptr &&
+              Ctrl.Setup(ctrlIndex, ctrlSize, false) &&
+              Transport.EnableQueue(Ctrl, VirtioPci::NoVector)) ? true : false;
+    }
+
+    if (!ok)
+    {
+        Transport.Fail();
+        ReleasePairs();
+        return false;
+    }
+
+    PairCount = pairCount;
+    Transport.DriverOk();
+
+    if (PairCount > 1 && !SetPairs(PairCount))
+    {
+        Trace(0, "VirtioNet: can't set %u pairs", PairCount);
+        for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+            CpuPair[cpu] = 0;
+    }
+
+    for (size_t i = 0; i < PairCount; i++)
+    {
+        QueuePair& pair = Pairs[i];
+        Stdlib::AutoLock lock(pair.Lock);
+        RefillRx(pair);
+        pair.Rx.EnableInterrupt();
+    }
+
+    Present = true;
+
+    Trace(0, "VirtioNet: mac %p:%p:%p:%p:%p:%p pairs %u features 0x%p",
+        (ulong)Mac[0], (ulong)Mac[1], (ulong)Mac[2], (ulong)Mac[3], (ulong)Mac[4], (ulong)Mac[5],
+        PairCount, Features);
+    return true;
+}
+
+bool VirtioNet::IsPresent()
+{
+    return Present;
+}
+
+void VirtioNet::GetMac(u8 mac[6])
+{
+    Stdlib::MemCpy(mac, Mac, sizeof(Mac));
+}
+
+void VirtioNet::SetReceiver(NetRxFn fn, void* ctx)
+{
+    RxCtx = ctx;
+    Barrier();
+    RxFn = fn;
+}
+
+NetBuffer* VirtioNet::AllocBuffer()
+{
+    if (!Present)
+        return nullptr;
+
+    QueuePair& pair = Pairs[CpuPair[GetPerCpuIndex()]];
+    Stdlib::AutoLock lock(pair.Lock);
+    return PoolGet(pair);
+}
+
+size_t VirtioNet::Send(NetBuffer** bufs, size_t count)
+{
+    if (!Present || count == 0)
+        return 0;
+
+    QueuePair& pair = Pairs[CpuPair[GetPerCpuIndex()]];
+    NetBuffer* done;
+    size_t i;
+
+    {
+        Stdlib::AutoLock lock(pair.Lock);
+        done = ReapTx(pair);
+
+        for (i = 0; i < count; i++)
+        {
+            NetBuffer* buf = bufs[i];
+            if (buf->Len == 0 || buf->Len > MaxFrame)
+                break;
+
+            if (pair.Tx.GetFreeCount() == 0)
+            {
+                pair.TxFull++;
+                break;
+            }
+
+            // the frame must still start right after the header
+            u8* header = reinterpret_cast<u8*>(buf) + Headroom;
+            if (buf->Data != header + HeaderSize)
+                break;
+
+            // no offloads: an all zero header
+            Stdlib::MemSet(header, 0, HeaderSize);
+
+            VirtQueue::Buffer desc;
+            desc.PhyAddr = BufferPhyAddr(buf);
+            desc.Len = static_cast<u32>(HeaderSize + buf->Len);
+            desc.DeviceWrite = false;
+            if (BugOn(!pair.Tx.Add(&desc, 1, buf)))
+                break;
+
+            pair.TxPackets++;
+        }
+
+        pair.Tx.Kick();
+    }
+
+    RecycleList(done);
+    return i;
+}
+
+void VirtioNet::InterruptFn(void* ctx)
+{
+    QueuePair& pair = *static_cast<QueuePair*>(ctx);
+
+    {
+        Stdlib::AutoLock lock(pair.Lock);
+        pair.Interrupts++;
+        pair.Rx.DisableInterrupt();
+    }
+
+    // already queued if a poll is pending, it re-arms the interrupt
+    WorkQueue::GetInstance().QueueOn(pair.Cpu, pair.PollWork);
+}
+
+void VirtioNet::PollFunc(void* ctx)
+{
+    VirtioNet::GetInstance().Poll(*static_cast<QueuePair*>(ctx));
+}
+
+void VirtioNet::Poll(QueuePair& pair)
+{
+    NetBuffer* received = nullptr;
+    NetBuffer** tail = &received;
+    NetBuffer* sent;
+    size_t count = 0;
+    bool more;
+
+    {
+        Stdlib::AutoLock lock(pair.Lock);
+        pair.Polls++;
+        sent = ReapTx(pair);
+
+        u32 len;
+        void* cookie;
+        while (count < PollBudget && (cookie = pair.Rx.GetUsed(len)) != nullptr)
+        {
+            NetBuffer* buf = static_cast<NetBuffer*>(cookie);
+            buf->Data = reinterpret_cast<u8*>(buf) + Headroom + HeaderSize;
+            buf->Len = (len > HeaderSize) ? len - HeaderSize : 0;
+            buf->Next = nullptr;
+            *tail = buf;
+            tail = &buf->Next;
+            count++;
+        }
+
+        pair.RxPackets += count;
+        RefillRx(pair);
+
+        // a full budget means traffic keeps coming, stay in polling mode
+        more = (count == PollBudget || !pair.Rx.EnableInterrupt()) ? true : false;
+        if (more)
+        {
+            pair.Rx.DisableInterrupt();
+            if (count == PollBudget)
+                pair.BusyPolls++;
+        }
+    }
+
+    RecycleList(sent);
+
+    NetRxFn rxFn = RxFn;
+    void* rxCtx = RxCtx;
+    while (received != nullptr)
+    {
+        NetBuffer* buf = received;
+        received = buf->Next;
+        buf->Next = nullptr;
+        if (rxFn != nullptr)
+            rxFn(rxCtx, buf);
+        else
+            Recycle(buf);
+    }
+
+    if (more)
+        WorkQueue::GetInstance().QueueOn(pair.Cpu, pair.PollWork);
+}
+
+void VirtioNet::Dump(Stdlib::Printer& printer)
+{
+    if (!Present)
+    {
+        printer.Printf("no virtio-net device\n");
+        return;
+    }
+
+    printer.Printf("mac %p:%p:%p:%p:%p:%p pairs %u features 0x%p\n",
+        (ulong)Mac[0], (ulong)Mac[1], (ulong)Mac[2], (ulong)Mac[3], (ulong)Mac[4], (ulong)Mac[5],
+        PairCount, Features);
+    printer.Printf("pair cpu vector rx tx interrupts polls busypolls txfull pool\n");
+    for (size_t i = 0; i < PairCount; i++)
+    {
+        QueuePair& pair = Pairs[i];
+        printer.Printf("%u %u 0x%p %u %u %u %u %u %u %u\n", i, pair.Cpu, (ulong)pair.Vector,
+            pair.RxPackets, pair.TxPackets, pair.Interrupts, pair.Polls, pair.BusyPolls,
+            pair.TxFull, pair.PoolCount);
+    }
+}
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "virtio.h"
+
+#include <kernel/cpu_mask.h>
+#include <kernel/spin_lock.h>
+#include <kernel/work_queue.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+// A frame in one page from a queue pair's pool. The struct sits at the
+// start of the page, then the virtio header, then the frame, so a received
+// page can be handed up, changed and sent again without a copy.
+struct NetBuffer final
+{
+    u8* Data;
+    size_t Len;
+
+    // owned by the driver
+    u16 Pair;
+    NetBuffer* Next;
+};
+
+// runs in the poll work of the queue pair, the receiver owns buf until it
+// passes it to Send or Recycle
+using NetRxFn = void (*)(void* ctx, NetBuffer* buf);
+
+// virtio-net over the virtio 1.0 PCI transport with one rx/tx queue pair
+// per cpu, as many as the device (MQ through the control queue) and the
+// MSI-X table allow. Rx queues are kept full of pool pages and interrupt
+// their cpu; the interrupt turns that queue's interrupts off and queues a
+// poll work on the cpu (NAPI). The poll takes up to PollBudget frames and
+// requeues itself while the queue keeps it busy, re-arming the interrupt
+// once a pass finds less. Tx completions are reaped by Send and the poll,
+// tx queues don't interrupt.
+class VirtioNet final
+{
+public:
+    static VirtioNet& GetInstance()
+    {
+        static VirtioNet Instance;
+        return Instance;
+    }
+
+    // takes the first virtio-net device pci found, false if there is none
+    bool Probe();
+
+    bool IsPresent();
+
+    void GetMac(u8 mac[6]);
+
+    // frames arriving before a receiver is set are dropped
+    void SetReceiver(NetRxFn fn, void* ctx);
+
+    // page from the current cpu's pool, nullptr if out of memory
+    NetBuffer* AllocBuffer();
+
+    void Recycle(NetBuffer* buf);
+
+    // queues frames on the current cpu's tx queue with one notify, returns
+    // how many were taken; the driver recycles them once sent
+    size_t Send(NetBuffer** bufs, size_t count);
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t MaxPairs = 16;
+    static const size_t PollBudget = 64;
+    static const size_t Headroom = 64;
+    static const size_t HeaderSize = 12;
+    static const size_t MaxFrame = Const::PageSize - Headroom - HeaderSize;
+
+private:
+    VirtioNet();
+    ~VirtioNet();
+    VirtioNet(const VirtioNet& other) = delete;
+    VirtioNet(VirtioNet&& other) = delete;
+    VirtioNet& operator=(const VirtioNet& other) = delete;
+    VirtioNet& operator=(VirtioNet&& other) = delete;
+
+    static_assert(sizeof(NetBuffer) <= Headroom, "Invalid size");
+
+    struct QueuePair final
+    {
+        VirtQueue Rx;
+        VirtQueue Tx;
+        FastSpinLock Lock;
+        Work PollWork;
+        ulong Cpu;
+        u8 Vector;
+        NetBuffer* Pool;
+        ulong PoolCount;
+        ulong RxPackets;
+        ulong TxPackets;
+        ulong Interrupts;
+        ulong Polls;
+        // polls that used the whole budget and stayed in polling mode
+        ulong BusyPolls;
+        ulong TxFull;
+    } __attribute__((aligned(Const::CacheLineSize)));
+
+    static void InterruptFn(void* ctx);
+    static void PollFunc(void* ctx);
+
+    void Poll(QueuePair& pair);
+    NetBuffer* PoolGet(QueuePair& pair);
+    void PoolPut(QueuePair& pair, NetBuffer* buf);
+    void RecycleList(NetBuffer* list);
+    NetBuffer* ReapTx(QueuePair& pair);
+    void RefillRx(QueuePair& pair);
+    bool SetupPair(PciDevice& dev, ulong index, ulong cpu);
+    bool SetPairs(ulong pairs);
+    void ReleasePairs();
+
+    static ulong BufferPhyAddr(NetBuffer* buf);
+
+    static const u16 DeviceIdModern = VirtioPci::ModernDeviceBase + 1;
+    static const u16 DeviceIdTransitional = 0x1000;
+
+    static const u64 FeatureMac = (1UL << 5);
+    static const u64 FeatureCtrlVq = (1UL << 17);
+    static const u64 FeatureMq = (1UL << 22);
+
+    static const ulong ConfigMac = 0;
+    static const ulong ConfigMaxPairs = 8;
+
+    static const u8 CtrlMq = 4;
+    static const u8 CtrlMqPairsSet = 0;
+    static const u8 CtrlOk = 0;
+    static const ulong CtrlTimeoutMs = 100;
+
+    // pool pages beyond this go back to the page allocator
+    static const ulong PoolMaxFactor = 2;
+
+    VirtioPci Transport;
+    QueuePair Pairs[MaxPairs];
+    u8 CpuPair[MaxCpus];
+    ulong PairCount;
+    VirtQueue Ctrl;
+    void* CtrlPage;
+    u64 Features;
+    u8 Mac[6];
+    NetRxFn RxFn;
+    void* RxCtx;
+    bool Present;
+};
+
+}
@@ -7,6 +7,8 @@ namespace Const
     const size_t PageSize = 4096;
     const size_t PageShift = 12;
 
+    const size_t CacheLineSize = 64;
+
     const size_t SectorSize = 512;
     const size_t SectorShift = 9;
 
@@ -7,6 +7,12 @@ extern IO8042Interrupt
 extern SerialInterrupt
 extern PitInterrupt
 extern IPInterrupt
+extern ReschedInterrupt
+extern CallInterrupt
+extern StopInterrupt
+extern PerfInterrupt
+extern DeviceInterrupt
+extern SyscallDispatch
 
 extern ExcDivideByZero
 extern ExcDebugger
@@ -36,7 +42,9 @@ global GetCr1
 global GetCr2
 global GetCr3
 global GetCr4
+global SetCr0
 global SetCr3
+global SetCr4
 global GetRsp
 global GetRip
 global GetRflags
@@ -56,6 +64,8 @@ global SpinLockLock
 global SpinLockUnlock
 global Outb
 global Inb
+global Outl
+global Inl
 global ReadMsr
 global WriteMsr
 global InterruptEnable
@@ -66,22 +76,20 @@ global ReadTsc
 global ReadTscp
 
 global SwitchContext
-
-global AtomicInc
-global AtomicDec
-global AtomicRead
-global AtomicWrite
-global AtomicReadAndDec
-global AtomicReadAndInc
-global AtomicTestAndSetBit
-global AtomicTestBit
-global AtomicCmpxchg
+global TaskEntryStub
+global SyscallEntry
+global EnterUser
 
 global DummyInterruptStub
 global IO8042InterruptStub
 global SerialInterruptStub
 global PitInterruptStub
 global IPInterruptStub
+global ReschedInterruptStub
+global CallInterruptStub
+global StopInterruptStub
+global PerfInterruptStub
+global DeviceInterruptStubTable
 
 global ExcDivideByZeroStub
 global ExcDebuggerStub
@@ -132,6 +140,14 @@ GetCr4:
 	mov rax, cr4
 	ret
 
+SetCr0:
+	mov cr0, rdi
+	ret
+
+SetCr4:
+	mov cr4, rdi
+	ret
+
 GetRsp:
 	mov rax, rsp
 	ret
@@ -235,6 +251,22 @@ Inb:
 	pop rdx
 	ret
 
+Outl:
+	push rdx
+	mov rdx, rdi
+	mov rax, rsi
+	out dx, eax
+	pop rdx
+	ret
+
+Inl:
+	push rdx
+	mov rdx, rdi
+	xor rax, rax
+	in eax, dx
+	pop rdx
+	ret
+
 ReadMsr: ;Read MSR specified by ECX into EDX:EAX.
 	mov ecx, edi
 	rdmsr
@@ -329,85 +361,101 @@ ReadTscp:
 SwitchContext:
 	;rdi = nextTask->Rsp
 	;rsi = &currTask->Rsp
-	;rdx = complete callback
-	;rcx = complete callback ctx
-	PushAll
-	mov rax, rsp
+	;callee-saved registers only, the caller's frame holds the rest
+	pushfq
+	push rbp
+	push rbx
+	push r12
+	push r13
+	push r14
+	push r15
+	mov [rsi], rsp
 	mov rsp, rdi
-	mov [rsi], rax
-	mov rdi, rcx
-	call rdx ; call complete callback
-	PopAll
-	sti
-	ret
-
-AtomicInc:
-	lock inc qword [rdi]
-	ret
-
-AtomicDec:
-	lock dec qword [rdi]
-	ret
-
-AtomicRead:
-	xor rax, rax
-	lock xadd qword [rdi], rax
-	ret
-
-AtomicWrite:
-	lock xchg qword [rdi], rsi
-	ret
-
-AtomicReadAndDec:
-	xor rax, rax
-	dec rax
-	lock xadd qword [rdi], rax
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	pop rbp
+	popfq
 	ret
 
-AtomicReadAndInc:
-	xor rax, rax
-	inc rax
-	lock xadd qword [rdi], rax
-	ret
+TaskEntryStub:
+	;first return of a new task, see Task::Start
+	mov rdi, r12
+	jmp r13
 
-AtomicTestAndSetBit:
-	xor rax, rax
-	lock bts qword [rdi], rsi
-	jnc .return
-	inc rax
-.return:
-	ret
+;GS holds the user base while user mode runs, entries from ring 3 swap in
+;the per-cpu one. The argument is the offset of the saved CS from rsp
+%macro SwapGsIfUser 1
+	test qword [rsp + %1], 3
+	jz %%kernel
+	swapgs
+%%kernel:
+%endmacro
 
-AtomicTestBit:
-	xor rax, rax
-	bt qword [rdi], rsi
-	jnc .return
-	inc rax
-.return:
-	ret
+;Interrupt handlers are C functions, they keep the callee saved registers
+;themselves, so only the rest is saved, see IrqContext. A handler that
+;switches tasks saves the callee saved ones in SwitchContext
+%macro PushCallerSaved 0
+	push rax
+	push rcx
+	push rdx
+	push rdi
+	push rsi
+	push r8
+	push r9
+	push r10
+	push r11
+%endmacro
 
-AtomicCmpxchg:
-	mov rax, rdx
-	lock cmpxchg qword [rdi], rsi
-	ret
+%macro PopCallerSaved 0
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rsi
+	pop rdi
+	pop rdx
+	pop rcx
+	pop rax
+%endmacro
 
 %macro InterruptStub 1
 %1InterruptStub:
-	PushAll
+	SwapGsIfUser 8
+	PushCallerSaved
 	mov rdi, rsp
 	cld
 	call %1Interrupt
-	PopAll
+	PopCallerSaved
+	SwapGsIfUser 8
 	iretq
 %endmacro
 
 %macro ExceptionStub 1
 %1Stub:
+	SwapGsIfUser 8
+	PushAll
+	mov rdi, rsp
+	cld
+	call %1
+	PopAll
+	SwapGsIfUser 8
+	iretq
+%endmacro
+
+;exceptions with an error code drop it before returning
+%macro ExceptionStubErrorCode 1
+%1Stub:
+	SwapGsIfUser 16
 	PushAll
 	mov rdi, rsp
 	cld
 	call %1
 	PopAll
+	add rsp, 8
+	SwapGsIfUser 8
 	iretq
 %endmacro
 
@@ -416,6 +464,50 @@ InterruptStub IO8042
 InterruptStub Serial
 InterruptStub Pit
 InterruptStub IP
+InterruptStub Resched
+InterruptStub Call
+InterruptStub Stop
+InterruptStub Perf
+
+;device vectors 0x30 - 0xEF, see Interrupt::AllocVector. Each stub saves
+;rax and passes its vector in it, the common part saves the rest of the
+;IrqContext and passes the vector on
+DEVICE_VECTOR_BASE equ 0x30
+DEVICE_VECTOR_COUNT equ 0xC0
+
+%assign vec DEVICE_VECTOR_BASE
+%rep DEVICE_VECTOR_COUNT
+DeviceInterruptStub%[vec]:
+	push rax
+	mov eax, vec
+	jmp DeviceInterruptCommon
+%assign vec vec + 1
+%endrep
+
+DeviceInterruptCommon:
+	SwapGsIfUser 16
+	push rcx
+	push rdx
+	push rdi
+	push rsi
+	push r8
+	push r9
+	push r10
+	push r11
+	mov rdi, rsp
+	mov rsi, rax
+	cld
+	call DeviceInterrupt
+	PopCallerSaved
+	SwapGsIfUser 8
+	iretq
+
+DeviceInterruptStubTable:
+%assign vec DEVICE_VECTOR_BASE
+%rep DEVICE_VECTOR_COUNT
+	dq DeviceInterruptStub%[vec]
+%assign vec vec + 1
+%endrep
 
 ExceptionStub ExcDivideByZero
 ExceptionStub ExcDebugger
@@ -425,20 +517,89 @@ ExceptionStub ExcOverflow
 ExceptionStub ExcBounds
 ExceptionStub ExcInvalidOpcode
 ExceptionStub ExcCoprocessorNotAvailable
-ExceptionStub ExcDoubleFault
+ExceptionStubErrorCode ExcDoubleFault
 ExceptionStub ExcCoprocessorSegmentOverrun
-ExceptionStub ExcInvalidTaskStateSegment
-ExceptionStub ExcSegmentNotPresent
-ExceptionStub ExcStackFault
-ExceptionStub ExcGeneralProtectionFault
-ExceptionStub ExcPageFault
+ExceptionStubErrorCode ExcInvalidTaskStateSegment
+ExceptionStubErrorCode ExcSegmentNotPresent
+ExceptionStubErrorCode ExcStackFault
+ExceptionStubErrorCode ExcGeneralProtectionFault
+ExceptionStubErrorCode ExcPageFault
 ExceptionStub ExcReserved
 ExceptionStub ExcMathFault
-ExceptionStub ExcAlignmentCheck
+ExceptionStubErrorCode ExcAlignmentCheck
 ExceptionStub ExcMachineCheck
 ExceptionStub ExcSIMDFpException
 ExceptionStub ExcVirtException
-ExceptionStub ExcControlProtection
+ExceptionStubErrorCode ExcControlProtection
+
+;PerCpu fields the syscall entry uses, see the static_asserts in syscall.cpp
+PERCPU_KERNEL_RSP equ 24
+PERCPU_USER_RSP equ 32
+
+USER_CODE equ 0x23
+USER_DATA equ 0x1B
+
+SyscallEntry:
+	;rcx = user rip, r11 = user rflags, interrupts masked through FMASK.
+	;Only the argument registers are saved, the C code keeps the callee
+	;saved ones and rax, rcx, r11 are clobbered by the abi
+	swapgs
+	mov [gs:PERCPU_USER_RSP], rsp
+	mov rsp, [gs:PERCPU_KERNEL_RSP]
+	push qword [gs:PERCPU_USER_RSP]
+	push r11
+	push rcx
+	push r9
+	push r8
+	push r10
+	push rdx
+	push rsi
+	push rdi
+	push rax
+	mov rdi, rsp
+	sti
+	cld
+	call SyscallDispatch
+	cli
+	;the saved rip is canonical, user ranges end below the top user page
+	add rsp, 8
+	pop rdi
+	pop rsi
+	pop rdx
+	pop r10
+	pop r8
+	pop r9
+	pop rcx
+	pop r11
+	pop rsp
+	swapgs
+	o64 sysret
+
+EnterUser:
+	;rdi = user rip, rsi = user rsp, interrupts are off
+	push USER_DATA
+	push rsi
+	push 0x202
+	push USER_CODE
+	push rdi
+	;nothing of the kernel leaks into the new task
+	xor eax, eax
+	xor ebx, ebx
+	xor ecx, ecx
+	xor edx, edx
+	xor esi, esi
+	xor edi, edi
+	xor ebp, ebp
+	xor r8, r8
+	xor r9, r9
+	xor r10, r10
+	xor r11, r11
+	xor r12, r12
+	xor r13, r13
+	xor r14, r14
+	xor r15, r15
+	swapgs
+	iretq
 
 SetJmp:
 	pop rsi
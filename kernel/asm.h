@@ -13,7 +13,9 @@ ulong GetCr2(void);
 ulong GetCr3(void);
 ulong GetCr4(void);
 
+void SetCr0(ulong value);
 void SetCr3(ulong addr);
+void SetCr4(ulong value);
 
 ulong GetRsp(void);
 ulong GetRip(void);
@@ -42,6 +44,9 @@ void SpinLockUnlock(ulong *lock);
 void Outb(u16 port, u8 data);
 u8 Inb(u16 port);
 
+void Outl(u16 port, u32 data);
+u32 Inl(u16 port);
+
 u64 ReadMsr(u32 msr);
 void WriteMsr(u32 msr, u64 value);
 
@@ -54,27 +59,32 @@ u64 ReadTsc();
 
 u64 ReadTscp(u64 *cpuIndex);
 
-void SwitchContext(ulong nextRsp, ulong* currRsp, void (*callback)(void* ctx), void* ctx);
+// saves a SwitchFrame on the current stack into *currRsp and resumes the
+// one at nextRsp
+void SwitchContext(ulong nextRsp, ulong* currRsp);
 
-void AtomicInc(volatile long *pvalue);
-void AtomicDec(volatile long *pvalue);
-long AtomicRead(volatile long *pvalue);
-void AtomicWrite(volatile long *pvalue, long newValue);
-long AtomicReadAndDec(volatile long *pvalue);
-long AtomicReadAndInc(volatile long *pvalue);
+void TaskEntryStub();
 
-long AtomicCmpxchg(volatile long *pvalue, long exchange, long comparand);
+// SYSCALL target, see Syscall::InitCpu
+void SyscallEntry();
 
-long AtomicTestAndSetBit(volatile long *pvalue, ulong bit);
-long AtomicTestBit(volatile long *pvalue, ulong bit);
+// drops to ring 3 at rip with rsp, never returns
+void EnterUser(ulong rip, ulong rsp);
 
 void IO8042InterruptStub();
 void SerialInterruptStub();
 void PitInterruptStub();
 void IPInterruptStub();
+void ReschedInterruptStub();
+void CallInterruptStub();
+void StopInterruptStub();
+void PerfInterruptStub();
 
 void DummyInterruptStub();
 
+// one entry per device vector from Interrupt::DeviceVectorBase
+extern void (*DeviceInterruptStubTable[])();
+
 void ExcDivideByZeroStub();
 void ExcDebuggerStub();
 void ExcNMIStub();
@@ -113,6 +123,23 @@ static inline void Invlpg(void* m)
     asm volatile ( "invlpg (%0)" : : "b"(m) : "memory" );
 }
 
+// orders earlier memory accesses before a non-serializing x2apic msr write
+static inline void WrmsrFence()
+{
+    asm volatile ("mfence; lfence" : : : "memory");
+}
+
+static inline void Cpuid(u32 leaf, u32* eax, u32* ebx, u32* ecx, u32* edx)
+{
+    asm volatile ( "cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0) );
+}
+
+// leaves with subleaves, like the topology and cache ones
+static inline void CpuidCount(u32 leaf, u32 subleaf, u32* eax, u32* ebx, u32* ecx, u32* edx)
+{
+    asm volatile ( "cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf) );
+}
+
 namespace Kernel
 {
 
@@ -159,6 +186,52 @@ private:
     Context& operator=(Context&& other) = delete;
 };
 
+// Frame of the interrupt stubs: the caller saved registers over the frame
+// the cpu pushed. The handlers are C functions that keep the callee saved
+// ones, and SwitchContext saves those only if the handler switches tasks
+struct IrqContext final
+{
+    ulong R11;
+    ulong R10;
+    ulong R9;
+    ulong R8;
+    ulong Rsi;
+    ulong Rdi;
+    ulong Rdx;
+    ulong Rcx;
+    ulong Rax;
+    ulong Rip;
+    ulong Cs;
+    ulong Rflags;
+    ulong Rsp;
+    ulong Ss;
+
+    ulong GetRetRip()
+    {
+        return Rip;
+    }
+private:
+    IrqContext(const IrqContext& other) = delete;
+    IrqContext(IrqContext&& other) = delete;
+    IrqContext& operator=(const IrqContext& other) = delete;
+    IrqContext& operator=(IrqContext&& other) = delete;
+};
+
+static_assert(sizeof(IrqContext) == 14 * sizeof(ulong), "Invalid size");
+
+// what SwitchContext leaves on the stack of a switched out task
+struct SwitchFrame final
+{
+    ulong R15;
+    ulong R14;
+    ulong R13;
+    ulong R12;
+    ulong Rbx;
+    ulong Rbp;
+    ulong Rflags;
+    ulong RetAddr;
+};
+
 static inline bool IsInterruptEnabled()
 {
     return (GetRflags() & 0x200) ? true : false;
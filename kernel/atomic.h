@@ -5,31 +5,267 @@
 namespace Kernel
 {
 
+// On x86 relaxed, acquire and seq-cst loads and relaxed and release stores
+// are plain movs, a seq-cst store is an xchg
+enum MemoryOrder
+{
+    MemoryOrderRelaxed = __ATOMIC_RELAXED,
+    MemoryOrderAcquire = __ATOMIC_ACQUIRE,
+    MemoryOrderRelease = __ATOMIC_RELEASE,
+    MemoryOrderAcqRel = __ATOMIC_ACQ_REL,
+    MemoryOrderSeqCst = __ATOMIC_SEQ_CST,
+};
+
+// Exponential backoff for polling loops, doubles the pause count up to
+// MaxCount so a crowd of polling cpus leaves the line to the one writing it
+class SpinBackoff final
+{
+public:
+    SpinBackoff()
+        : Count(1)
+    {
+    }
+
+    void Pause()
+    {
+        for (ulong i = 0; i < Count; i++)
+            asm volatile("pause" ::: "memory");
+
+        if (Count < MaxCount)
+            Count *= 2;
+    }
+
+    void Reset()
+    {
+        Count = 1;
+    }
+
+private:
+    static const ulong MaxCount = 64;
+    ulong Count;
+};
+
+template<typename T>
+class AtomicValue final
+{
+public:
+    AtomicValue()
+        : Value()
+    {
+    }
+
+    AtomicValue(T value)
+        : Value(value)
+    {
+    }
+
+    ~AtomicValue()
+    {
+    }
+
+    T Load(MemoryOrder order = MemoryOrderSeqCst) const
+    {
+        return __atomic_load_n(&Value, order);
+    }
+
+    void Store(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        __atomic_store_n(&Value, value, order);
+    }
+
+    // polls with loads only, returns the first value pred accepts
+    template<typename Pred>
+    T WaitUntil(Pred pred, MemoryOrder order = MemoryOrderAcquire) const
+    {
+        SpinBackoff backoff;
+
+        for (;;)
+        {
+            T value = Load(order);
+            if (pred(value))
+                return value;
+            backoff.Pause();
+        }
+    }
+
+    T Exchange(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_exchange_n(&Value, value, order);
+    }
+
+    // on failure expected is updated with the current value
+    bool CompareExchange(T& expected, T desired, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_compare_exchange_n(&Value, &expected, desired, false, order,
+            FailureOrder(order));
+    }
+
+    T FetchAdd(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_fetch_add(&Value, value, order);
+    }
+
+    T FetchSub(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_fetch_sub(&Value, value, order);
+    }
+
+    T FetchOr(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_fetch_or(&Value, value, order);
+    }
+
+    T FetchAnd(T value, MemoryOrder order = MemoryOrderSeqCst)
+    {
+        return __atomic_fetch_and(&Value, value, order);
+    }
+
+private:
+    AtomicValue(const AtomicValue& other) = delete;
+    AtomicValue(AtomicValue&& other) = delete;
+    AtomicValue& operator=(const AtomicValue& other) = delete;
+    AtomicValue& operator=(AtomicValue&& other) = delete;
+
+    // a failed compare exchange only loads
+    static constexpr int FailureOrder(MemoryOrder order)
+    {
+        return (order == MemoryOrderAcqRel) ? __ATOMIC_ACQUIRE :
+            ((order == MemoryOrderRelease) ? __ATOMIC_RELAXED : order);
+    }
+
+    T Value;
+};
+
 class Atomic final
 {
 public:
-    Atomic();
-    Atomic(long value);
-    void Inc();
-    void Dec();
-    bool DecAndTest();
-    long Get();
-    void Set(long value);
-    void SetBit(ulong bit);
-    bool TestBit(ulong bit);
+    Atomic()
+        : Value(0)
+    {
+    }
+
+    Atomic(long value)
+        : Value(value)
+    {
+    }
+
+    ~Atomic()
+    {
+    }
+
+    void Inc()
+    {
+        Value.FetchAdd(1);
+    }
+
+    void Dec()
+    {
+        Value.FetchSub(1);
+    }
+
+    bool DecAndTest()
+    {
+        return (Value.FetchSub(1) == 1) ? true : false;
+    }
+
+    long ReadAndInc()
+    {
+        return Value.FetchAdd(1);
+    }
+
+    long ReadAndAdd(long value)
+    {
+        return Value.FetchAdd(value);
+    }
 
-    long Cmpxchg(long exchange, long comparand);
+    long Get()
+    {
+        return Value.Load();
+    }
 
-    ~Atomic();
+    // a full barrier, use Store with release ordering where that's enough
+    void Set(long value)
+    {
+        Value.Store(value);
+    }
 
-    Atomic& operator=(Atomic&& other);
-    Atomic(Atomic&& other);
+    long Load(MemoryOrder order = MemoryOrderAcquire)
+    {
+        return Value.Load(order);
+    }
+
+    template<typename Pred>
+    long WaitUntil(Pred pred, MemoryOrder order = MemoryOrderAcquire)
+    {
+        return Value.WaitUntil(pred, order);
+    }
+
+    void Store(long value, MemoryOrder order)
+    {
+        Value.Store(value, order);
+    }
+
+    // bit must be below the width of long
+    void SetBit(ulong bit)
+    {
+        Value.FetchOr(BitMask(bit));
+    }
+
+    bool TestBit(ulong bit)
+    {
+        return (Value.Load() & BitMask(bit)) ? true : false;
+    }
+
+    void ClearBit(ulong bit)
+    {
+        Value.FetchAnd(~BitMask(bit));
+    }
+
+    // both return the previous state of the bit
+    bool TestAndSetBit(ulong bit)
+    {
+        return (Value.FetchOr(BitMask(bit)) & BitMask(bit)) ? true : false;
+    }
+
+    bool TestAndClearBit(ulong bit)
+    {
+        return (Value.FetchAnd(~BitMask(bit)) & BitMask(bit)) ? true : false;
+    }
+
+    // returns the previous value, exchange is stored if it was comparand
+    long Cmpxchg(long exchange, long comparand)
+    {
+        Value.CompareExchange(comparand, exchange);
+        return comparand;
+    }
+
+    long Xchg(long exchange)
+    {
+        return Value.Exchange(exchange);
+    }
+
+    Atomic& operator=(Atomic&& other)
+    {
+        Set(other.Get());
+        return *this;
+    }
+
+    Atomic(Atomic&& other)
+        : Value(other.Get())
+    {
+    }
 
 private:
     Atomic(const Atomic& other) = delete;
     Atomic& operator=(const Atomic& other) = delete;
 
-    volatile long Value;
+    // shift unsigned, 1L << 63 is undefined
+    static long BitMask(ulong bit)
+    {
+        return static_cast<long>(1UL << bit);
+    }
+
+    AtomicValue<long> Value;
 };
 
 static_assert(sizeof(Atomic) == sizeof(long), "Invalid size");
@@ -0,0 +1,437 @@
+#include "bench.h"
+#include "asm.h"
+#include "cpu.h"
+#include "task.h"
+#include "time.h"
+#include "trace.h"
+#include "spin_lock.h"
+#include "mutex.h"
+
+namespace Kernel
+{
+
+// global constructors don't run, function statics are built on first use
+struct BaseBenchState
+{
+    Atomic Counter;
+    SpinLock Lock;
+    Mutex Mutex;
+};
+
+static BaseBenchState& GetBaseBenchState()
+{
+    static BaseBenchState State;
+    return State;
+}
+
+static void BenchTsc(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+
+    for (ulong i = 0; i < ops; i++)
+        ReadTsc();
+}
+
+static void BenchAtomicInc(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    auto& counter = GetBaseBenchState().Counter;
+
+    for (ulong i = 0; i < ops; i++)
+        counter.Inc();
+}
+
+static void BenchSpinLock(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    auto& lock = GetBaseBenchState().Lock;
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        lock.Lock();
+        lock.Unlock();
+    }
+}
+
+static void BenchMutex(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    auto& mutex = GetBaseBenchState().Mutex;
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        mutex.Lock();
+        mutex.Unlock();
+    }
+}
+
+// a software int into the call vector, entry and exit of the interrupt
+// stubs with an empty call queue, the EOI finds nothing in service
+static void BenchIrq(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+
+    for (ulong i = 0; i < ops; i++)
+        asm volatile("int %0" : : "i"(CpuTable::CallVector) : "memory");
+}
+
+static const Benchmark BaseBenchmarks[] = {
+    BENCHMARK("base.tsc", BenchTsc, 64),
+    BENCHMARK_FLAGS("base.atomic", BenchAtomicInc, 64, BenchScale),
+    BENCHMARK_FLAGS("base.spinlock", BenchSpinLock, 64, BenchScale),
+    BENCHMARK_FLAGS("base.mutex", BenchMutex, 64, BenchScale),
+    BENCHMARK("base.irq", BenchIrq, 64),
+};
+
+BenchTable::BenchTable()
+    : SuiteCount(0)
+{
+    Register(BaseBenchmarks, Stdlib::ArraySize(BaseBenchmarks));
+    RegisterSchedBenchmarks(*this);
+    RegisterAllocBenchmarks(*this);
+    RegisterContainerBenchmarks(*this);
+    RegisterBlkBenchmarks(*this);
+}
+
+BenchTable::~BenchTable()
+{
+}
+
+bool BenchTable::Register(const Benchmark* suite, size_t count)
+{
+    if (SuiteCount >= MaxSuites)
+        return false;
+
+    Suite[SuiteCount] = suite;
+    SuiteSize[SuiteCount] = count;
+    SuiteCount++;
+    return true;
+}
+
+void BenchTable::List(Stdlib::Printer& printer)
+{
+    for (size_t i = 0; i < SuiteCount; i++)
+        for (size_t j = 0; j < SuiteSize[i]; j++)
+            printer.Printf("%s\n", Suite[i][j].Name);
+}
+
+void BenchTable::WaitRunners(Atomic& arrived, ulong target)
+{
+    arrived.WaitUntil([target](long value) { return static_cast<ulong>(value) >= target; });
+}
+
+void BenchTable::RunnerFunc(void* ctx)
+{
+    auto runner = static_cast<Runner*>(ctx);
+    auto& bench = *runner->Bench;
+    auto& benchCtx = runner->Ctx;
+    bool setup = true;
+
+    if (bench.Setup != nullptr && !bench.Setup(benchCtx))
+    {
+        runner->Failed->Inc();
+        setup = false;
+    }
+
+    // everyone is set up before anyone warms up, and warmed up before
+    // anyone is measured, so the samples overlap in time
+    runner->Arrived->Inc();
+    WaitRunners(*runner->Arrived, benchCtx.RunnerCount);
+
+    bool failed = (runner->Failed->Get() != 0);
+    if (!failed)
+    {
+        for (size_t i = 0; i < WarmupSamples; i++)
+            bench.Func(benchCtx, bench.Ops);
+    }
+
+    runner->Arrived->Inc();
+    WaitRunners(*runner->Arrived, 2 * benchCtx.RunnerCount);
+
+    if (!failed)
+    {
+        u64 start = ReadTsc();
+        for (size_t i = 0; i < SampleCount; i++)
+        {
+            u64 t0 = ReadTsc();
+            bench.Func(benchCtx, bench.Ops);
+            runner->Ticks[i] = ReadTsc() - t0;
+        }
+        runner->Elapsed = ReadTsc() - start;
+    }
+
+    if (setup && bench.Teardown != nullptr)
+        bench.Teardown(benchCtx);
+}
+
+bool BenchTable::RunOne(const Benchmark& bench, const CpuMask& cpus, Stdlib::Printer& printer, bool keyValue)
+{
+    size_t runnerCount = cpus.Count();
+    if (runnerCount == 0 || bench.Ops == 0)
+        return false;
+
+    Runner* runner = new Runner[runnerCount];
+    if (runner == nullptr)
+        return false;
+
+    Task** task = new Task*[runnerCount];
+    if (task == nullptr)
+    {
+        delete [] runner;
+        return false;
+    }
+
+    Atomic arrived, failed;
+    bool result = true;
+    ulong cpu = cpus.First();
+    for (size_t i = 0; i < runnerCount; i++, cpu = cpus.Next(cpu + 1))
+    {
+        runner[i].Ctx.Runner = i;
+        runner[i].Ctx.RunnerCount = runnerCount;
+        runner[i].Ctx.Cpu = cpu;
+        runner[i].Ctx.Ctx = nullptr;
+        runner[i].Ctx.Printer = &printer;
+        runner[i].Bench = &bench;
+        runner[i].Arrived = &arrived;
+        runner[i].Failed = &failed;
+        runner[i].Ticks = new u64[SampleCount];
+        runner[i].Elapsed = 0;
+        task[i] = (runner[i].Ticks != nullptr) ? new Task("bench%u", cpu) : nullptr;
+    }
+
+    for (size_t i = 0; i < runnerCount; i++)
+    {
+        bool started = false;
+        if (task[i] != nullptr)
+        {
+            CpuMask affinity;
+            affinity.Set(runner[i].Ctx.Cpu);
+            task[i]->SetCpuAffinity(affinity);
+            started = task[i]->Start(&BenchTable::RunnerFunc, &runner[i]);
+        }
+
+        if (!started)
+        {
+            if (task[i] != nullptr)
+            {
+                task[i]->Put();
+                task[i] = nullptr;
+            }
+
+            // let the started runners pass both barriers without measuring
+            failed.Inc();
+            arrived.ReadAndAdd(2);
+            result = false;
+        }
+    }
+
+    for (size_t i = 0; i < runnerCount; i++)
+    {
+        if (task[i] == nullptr)
+            continue;
+
+        task[i]->Wait();
+        task[i]->Put();
+    }
+
+    if (failed.Get() != 0)
+    {
+        if (keyValue)
+            printer.Printf("perftest bench name=%s cpus=%u status=failed\n", bench.Name, runnerCount);
+        else
+            printer.Printf("%s cpus %u failed\n", bench.Name, runnerCount);
+        result = false;
+    }
+    else
+    {
+        Report(bench, runner, runnerCount, printer, keyValue);
+    }
+
+    for (size_t i = 0; i < runnerCount; i++)
+    {
+        if (runner[i].Ticks != nullptr)
+            delete [] runner[i].Ticks;
+    }
+    delete [] task;
+    delete [] runner;
+    return result;
+}
+
+void BenchTable::Report(const Benchmark& bench, Runner* runner, size_t runnerCount, Stdlib::Printer& printer,
+    bool keyValue)
+{
+    u64 ticksPerMs = TscClock::GetInstance().GetTicksPerMs();
+    size_t count = runnerCount * SampleCount;
+    u64* nsPerOp = new u64[count];
+    if (ticksPerMs == 0 || nsPerOp == nullptr)
+    {
+        if (nsPerOp != nullptr)
+            delete [] nsPerOp;
+        if (keyValue)
+            printer.Printf("perftest bench name=%s cpus=%u status=notsc\n", bench.Name, runnerCount);
+        else
+            printer.Printf("%s cpus %u no tsc clock\n", bench.Name, runnerCount);
+        return;
+    }
+
+    u64 totalTicks = 0, opsPerSec = 0;
+    u64 runnerOps = SampleCount * bench.Ops;
+    for (size_t i = 0; i < runnerCount; i++)
+    {
+        for (size_t j = 0; j < SampleCount; j++)
+        {
+            u64 ticks = runner[i].Ticks[j];
+            totalTicks += ticks;
+            nsPerOp[i * SampleCount + j] = (ticks * Const::NanoSecsInMs) / (ticksPerMs * bench.Ops);
+        }
+
+        // throughput includes the gaps between samples
+        u64 elapsedNs = (runner[i].Elapsed * Const::NanoSecsInMs) / ticksPerMs;
+        if (elapsedNs != 0)
+            opsPerSec += (runnerOps * Const::NanoSecsInSec) / elapsedNs;
+    }
+
+    Stdlib::Sort(nsPerOp, count, [](u64 a, u64 b) { return a < b; });
+
+    u64 mean = (totalTicks * Const::NanoSecsInMs) / (ticksPerMs * runnerOps * runnerCount);
+    u64 p50 = nsPerOp[(count - 1) * 50 / 100];
+    u64 p90 = nsPerOp[(count - 1) * 90 / 100];
+    u64 p99 = nsPerOp[(count - 1) * 99 / 100];
+    if (keyValue)
+        printer.Printf("perftest bench name=%s cpus=%u status=ok ops_per_sec=%u mean_ns=%u "
+            "p50_ns=%u p90_ns=%u p99_ns=%u max_ns=%u\n",
+            bench.Name, runnerCount, opsPerSec, mean, p50, p90, p99, nsPerOp[count - 1]);
+    else
+        printer.Printf("%s cpus %u ops/s %u mean %u p50 %u p90 %u p99 %u max %u ns\n",
+            bench.Name, runnerCount, opsPerSec, mean, p50, p90, p99, nsPerOp[count - 1]);
+
+    delete [] nsPerOp;
+}
+
+bool BenchTable::Run(const char* prefix, Stdlib::Printer& printer, bool keyValue)
+{
+    CpuMask running = CpuTable::GetInstance().GetRunningCpus();
+    size_t runningCount = running.Count();
+    bool all = (Stdlib::StrCmp(prefix, "all") == 0);
+    size_t prefixLen = Stdlib::StrLen(prefix);
+    bool found = false, result = true;
+
+    for (size_t i = 0; i < SuiteCount; i++)
+    {
+        for (size_t j = 0; j < SuiteSize[i]; j++)
+        {
+            auto& bench = Suite[i][j];
+            if (!all && Stdlib::StrnCmp(bench.Name, prefix, prefixLen) != 0)
+                continue;
+
+            found = true;
+            Trace(0, "Bench %s", bench.Name);
+
+            // runner sets are the first n running cpus
+            for (size_t n = 1; n <= runningCount;)
+            {
+                CpuMask cpus;
+                ulong cpu = running.First();
+                for (size_t k = 0; k < n; k++, cpu = running.Next(cpu + 1))
+                    cpus.Set(cpu);
+
+                if (!RunOne(bench, cpus, printer, keyValue))
+                    result = false;
+
+                if (n == runningCount)
+                    break;
+
+                if (bench.Flags & BenchScale)
+                    n = (2 * n < runningCount) ? 2 * n : runningCount;
+                else if (bench.Flags & BenchSmp)
+                    n = runningCount;
+                else
+                    break;
+            }
+        }
+    }
+
+    if (!found)
+    {
+        if (keyValue)
+            printer.Printf("perftest bench name=%s status=missing\n", prefix);
+        else
+            printer.Printf("no benchmark %s\n", prefix);
+        return false;
+    }
+
+    return result;
+}
+
+void BenchTable::PrintCpuInfo(Stdlib::Printer& printer)
+{
+    u32 regs[12];
+    char vendor[13];
+    Cpuid(0, &regs[0], &regs[1], &regs[2], &regs[3]);
+    Stdlib::MemCpy(&vendor[0], &regs[1], 4);
+    Stdlib::MemCpy(&vendor[4], &regs[3], 4);
+    Stdlib::MemCpy(&vendor[8], &regs[2], 4);
+    vendor[12] = '\0';
+
+    u32 eax, ebx, ecx, edx;
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    ulong family = (eax >> 8) & 0xf;
+    ulong model = (eax >> 4) & 0xf;
+    if (family == 0xf)
+        family += (eax >> 20) & 0xff;
+    if (family == 0x6 || family >= 0xf)
+        model |= ((eax >> 16) & 0xf) << 4;
+
+    // 48 byte brand string, padded with spaces on some parts
+    char brand[49] = "unknown";
+    Cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000004)
+    {
+        for (u32 i = 0; i < 3; i++)
+            Cpuid(0x80000002 + i, &regs[4 * i], &regs[4 * i + 1], &regs[4 * i + 2], &regs[4 * i + 3]);
+        Stdlib::MemCpy(brand, regs, 48);
+        brand[48] = '\0';
+    }
+
+    const char* name = brand;
+    while (*name == ' ')
+        name++;
+
+    printer.Printf("perftest begin vendor=%s family=%u model=%u cpus=%u tsc_khz=%u brand=\"%s\"\n",
+        vendor, family, model, CpuTable::GetInstance().GetRunningCpus().Count(),
+        TscClock::GetInstance().GetTicksPerMs(), name);
+}
+
+bool BenchTable::RunPerfTest(const char* list, Stdlib::Printer& printer)
+{
+    PrintCpuInfo(printer);
+
+    bool result = true;
+    char prefix[32];
+    for (const char* curr = list; *curr != '\0';)
+    {
+        const char* end = curr;
+        while (*end != '\0' && *end != ',')
+            end++;
+
+        size_t len = static_cast<size_t>(end - curr);
+        if (len != 0 && len < sizeof(prefix))
+        {
+            Stdlib::MemCpy(prefix, curr, len);
+            prefix[len] = '\0';
+            if (!Run(prefix, printer, true))
+                result = false;
+        }
+        else if (len != 0)
+        {
+            result = false;
+        }
+
+        curr = (*end == ',') ? end + 1 : end;
+    }
+
+    printer.Printf("perftest end status=%s\n", result ? "ok" : "failed");
+    return result;
+}
+
+}
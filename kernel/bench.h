@@ -0,0 +1,117 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "atomic.h"
+#include "cpu_mask.h"
+
+namespace Kernel
+{
+
+// What a benchmark function sees: its runner among the ones started at once
+// and the per-runner context installed by the setup function. Teardown may
+// print extra results before the summary line.
+struct BenchContext
+{
+    ulong Runner;
+    ulong RunnerCount;
+    ulong Cpu;
+    void* Ctx;
+    Stdlib::Printer* Printer;
+};
+
+// performs ops operations, the harness times each call as one sample
+typedef void (*BenchFunc)(BenchContext& ctx, ulong ops);
+typedef bool (*BenchSetupFunc)(BenchContext& ctx);
+typedef void (*BenchTeardownFunc)(BenchContext& ctx);
+
+struct Benchmark
+{
+    const char* Name;
+    BenchFunc Func;
+    BenchSetupFunc Setup;
+    BenchTeardownFunc Teardown;
+    ulong Ops;
+    ulong Flags;
+};
+
+// run on one cpu and again on every running cpu at once
+static const ulong BenchSmp = 0x1;
+// run on 1, 2, 4, ... running cpus at once
+static const ulong BenchScale = 0x2;
+
+#define BENCHMARK(name, func, ops) \
+    { name, func, nullptr, nullptr, ops, 0 }
+
+#define BENCHMARK_FLAGS(name, func, ops, flags) \
+    { name, func, nullptr, nullptr, ops, flags }
+
+#define BENCHMARK_SETUP(name, func, setup, teardown, ops, flags) \
+    { name, func, setup, teardown, ops, flags }
+
+class BenchTable final
+{
+public:
+    static BenchTable& GetInstance()
+    {
+        static BenchTable Instance;
+        return Instance;
+    }
+
+    // adds a static array of benchmarks, global constructors don't run so
+    // suites are registered explicitly by the constructor
+    bool Register(const Benchmark* suite, size_t count);
+
+    void List(Stdlib::Printer& printer);
+
+    // runs every benchmark whose name starts with prefix, "all" runs them
+    // all. keyValue reports "perftest bench name=... ops_per_sec=..." lines
+    // for scripts instead of the text summary
+    bool Run(const char* prefix, Stdlib::Printer& printer, bool keyValue = false);
+
+    // runs the comma separated prefixes of list in key=value mode, between
+    // a "perftest begin" line describing the cpu and a "perftest end" line
+    bool RunPerfTest(const char* list, Stdlib::Printer& printer);
+
+private:
+    BenchTable();
+    ~BenchTable();
+    BenchTable(const BenchTable& other) = delete;
+    BenchTable(BenchTable&& other) = delete;
+    BenchTable& operator=(const BenchTable& other) = delete;
+    BenchTable& operator=(BenchTable&& other) = delete;
+
+    static const size_t MaxSuites = 16;
+    static const size_t WarmupSamples = 8;
+    static const size_t SampleCount = 128;
+
+    struct Runner
+    {
+        BenchContext Ctx;
+        const Benchmark* Bench;
+        Atomic* Arrived;
+        Atomic* Failed;
+        u64* Ticks;
+        u64 Elapsed;
+    };
+
+    static void RunnerFunc(void* ctx);
+    static void WaitRunners(Atomic& arrived, ulong target);
+
+    bool RunOne(const Benchmark& bench, const CpuMask& cpus, Stdlib::Printer& printer, bool keyValue);
+    void Report(const Benchmark& bench, Runner* runner, size_t runnerCount, Stdlib::Printer& printer,
+        bool keyValue);
+    void PrintCpuInfo(Stdlib::Printer& printer);
+
+    const Benchmark* Suite[MaxSuites];
+    size_t SuiteSize[MaxSuites];
+    size_t SuiteCount;
+};
+
+void RegisterSchedBenchmarks(BenchTable& table);
+void RegisterAllocBenchmarks(BenchTable& table);
+void RegisterContainerBenchmarks(BenchTable& table);
+void RegisterBlkBenchmarks(BenchTable& table);
+
+}
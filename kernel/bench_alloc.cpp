@@ -0,0 +1,171 @@
+#include "bench.h"
+#include "asm.h"
+
+#include <mm/page_allocator.h>
+#include <lib/ring_buffer.h>
+
+namespace Kernel
+{
+
+// One block per op: new and delete of the same size back to back, mostly
+// served by the per-cpu magazine.
+template<size_t Size>
+static void BenchNew(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        u8* block = new u8[Size];
+        if (block == nullptr)
+            continue;
+
+        block[0] = 1;
+        delete [] block;
+    }
+}
+
+static const size_t AllocBurst = 64;
+
+// Bursts twice the magazine size, so the pool lock is taken on every burst
+template<size_t Size>
+static void BenchNewBurst(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    u8* block[AllocBurst];
+
+    for (ulong i = 0; i < ops; i += AllocBurst)
+    {
+        for (size_t j = 0; j < AllocBurst; j++)
+        {
+            block[j] = new u8[Size];
+            if (block[j] != nullptr)
+                block[j][0] = 1;
+        }
+
+        for (size_t j = 0; j < AllocBurst; j++)
+        {
+            if (block[j] != nullptr)
+                delete [] block[j];
+        }
+    }
+}
+
+template<size_t Order>
+static void BenchPages(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        void* pages = pageAllocator.Alloc(static_cast<size_t>(1) << Order);
+        if (pages != nullptr)
+            pageAllocator.Free(pages);
+    }
+}
+
+// Producer-consumer: even runners allocate and pass blocks to the next runner
+// through a single producer single consumer ring, which frees them on its
+// own cpu. An unpaired last runner allocates and frees locally.
+using AllocChannel = Stdlib::SpscRingBuffer<u8*, 256>;
+
+static AllocChannel*& GetAllocChannel(ulong pair)
+{
+    static AllocChannel* Channel[MaxCpus / 2];
+    return Channel[pair];
+}
+
+static bool AllocIsPaired(BenchContext& ctx)
+{
+    return ((ctx.Runner | 1) < ctx.RunnerCount) ? true : false;
+}
+
+static bool CrossFreeSetup(BenchContext& ctx)
+{
+    // channels are published before the setup barrier, consumers look
+    // them up only once measuring starts
+    if (AllocIsPaired(ctx) && (ctx.Runner % 2) == 0)
+    {
+        auto channel = new AllocChannel();
+        if (channel == nullptr)
+            return false;
+
+        GetAllocChannel(ctx.Runner / 2) = channel;
+    }
+    return true;
+}
+
+static void CrossFreeTeardown(BenchContext& ctx)
+{
+    // the consumer sees the last block after the producer is done with it
+    if (AllocIsPaired(ctx) && (ctx.Runner % 2) == 1)
+    {
+        delete GetAllocChannel(ctx.Runner / 2);
+        GetAllocChannel(ctx.Runner / 2) = nullptr;
+    }
+}
+
+static void BenchCrossFree(BenchContext& ctx, ulong ops)
+{
+    if (!AllocIsPaired(ctx))
+    {
+        BenchNew<64>(ctx, ops);
+        return;
+    }
+
+    auto channel = GetAllocChannel(ctx.Runner / 2);
+    if ((ctx.Runner % 2) == 0)
+    {
+        for (ulong i = 0; i < ops; i++)
+        {
+            u8* block = new u8[64];
+            if (block != nullptr)
+                block[0] = 1;
+
+            while (!channel->Put(block))
+                Pause();
+        }
+    }
+    else
+    {
+        // the producer runs the same number of ops, so every pop is matched
+        for (ulong i = 0; i < ops; i++)
+        {
+            u8* block = nullptr;
+            while (!channel->Get(block))
+                Pause();
+
+            if (block != nullptr)
+                delete [] block;
+        }
+    }
+}
+
+// the largest pool class is 2016 bytes, 2 KiB already goes to the page allocator
+static const Benchmark AllocBenchmarks[] = {
+    BENCHMARK_FLAGS("alloc.new8", BenchNew<8>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new16", BenchNew<16>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new32", BenchNew<32>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new64", BenchNew<64>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new128", BenchNew<128>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new256", BenchNew<256>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new512", BenchNew<512>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new1024", BenchNew<1024>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.new2016", BenchNew<2016>, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.burst16", BenchNewBurst<16>, AllocBurst, BenchScale),
+    BENCHMARK_FLAGS("alloc.burst256", BenchNewBurst<256>, AllocBurst, BenchScale),
+    BENCHMARK_FLAGS("alloc.burst2016", BenchNewBurst<2016>, AllocBurst, BenchScale),
+    BENCHMARK_SETUP("alloc.crossfree", BenchCrossFree, CrossFreeSetup, CrossFreeTeardown, 64, BenchScale),
+    BENCHMARK_FLAGS("alloc.page0", BenchPages<0>, 16, BenchScale),
+    BENCHMARK_FLAGS("alloc.page1", BenchPages<1>, 16, BenchScale),
+    BENCHMARK_FLAGS("alloc.page2", BenchPages<2>, 16, BenchScale),
+    BENCHMARK_FLAGS("alloc.page3", BenchPages<3>, 16, BenchScale),
+};
+
+void RegisterAllocBenchmarks(BenchTable& table)
+{
+    table.Register(AllocBenchmarks, Stdlib::ArraySize(AllocBenchmarks));
+}
+
+}
@@ -0,0 +1,167 @@
+#include "bench.h"
+
+#include <drivers/page_cache.h>
+#include <drivers/virtio_blk.h>
+
+namespace Kernel
+{
+
+static const size_t BlkBenchOps = 32;
+static const size_t BlkBenchSectors = Const::PageSize / VirtioBlk::SectorSize;
+
+struct BlkBenchState
+{
+    BlkRequest Req[BlkBenchOps];
+    BlkRequest* ReqPtr[BlkBenchOps];
+    void* Buf[BlkBenchOps];
+    ulong Next;
+};
+
+static bool BlkSetup(BenchContext& ctx)
+{
+    auto& blk = VirtioBlk::GetInstance();
+    if (!blk.IsPresent() || blk.GetCapacity() < BlkBenchSectors)
+        return false;
+
+    auto state = new BlkBenchState();
+    if (state == nullptr)
+        return false;
+
+    for (size_t i = 0; i < BlkBenchOps; i++)
+    {
+        state->Buf[i] = blk.AllocBuffer(1);
+        state->ReqPtr[i] = &state->Req[i];
+        if (state->Buf[i] == nullptr)
+        {
+            for (size_t j = 0; j < i; j++)
+                blk.FreeBuffer(state->Buf[j]);
+            delete state;
+            return false;
+        }
+    }
+
+    state->Next = ctx.Runner;
+    ctx.Ctx = state;
+    return true;
+}
+
+static void BlkTeardown(BenchContext& ctx)
+{
+    auto state = static_cast<BlkBenchState*>(ctx.Ctx);
+
+    for (size_t i = 0; i < BlkBenchOps; i++)
+        VirtioBlk::GetInstance().FreeBuffer(state->Buf[i]);
+    delete state;
+}
+
+// page sized reads at scattered page aligned sectors
+static void BlkFill(BlkBenchState* state, size_t count)
+{
+    u64 pages = VirtioBlk::GetInstance().GetCapacity() / BlkBenchSectors;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        BlkRequest& req = state->Req[i];
+        req.Type = BlkRequest::TypeRead;
+        req.Sector = (Stdlib::Mix64(state->Next++) % pages) * BlkBenchSectors;
+        req.Buf = state->Buf[i];
+        req.Sectors = BlkBenchSectors;
+    }
+}
+
+// one request in flight, every op waits for its completion interrupt
+static void BenchBlkRead(BenchContext& ctx, ulong ops)
+{
+    auto state = static_cast<BlkBenchState*>(ctx.Ctx);
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        BlkFill(state, 1);
+        VirtioBlk::GetInstance().Execute(state->ReqPtr, 1);
+    }
+}
+
+// every op submitted at once, notifies go out per blkbatch requests
+static void BenchBlkReadBatch(BenchContext& ctx, ulong ops)
+{
+    auto state = static_cast<BlkBenchState*>(ctx.Ctx);
+    size_t count = (ops < BlkBenchOps) ? ops : BlkBenchOps;
+
+    BlkFill(state, count);
+    VirtioBlk::GetInstance().Execute(state->ReqPtr, count);
+}
+
+struct CacheBenchState
+{
+    ulong Dev;
+    u64 Blocks;
+    u64 Next;
+    u8 Buf[PageCache::BlockSize];
+};
+
+static bool CacheSetup(BenchContext& ctx)
+{
+    auto& blk = VirtioBlk::GetInstance();
+    if (!blk.IsPresent())
+        return false;
+
+    auto& cache = PageCache::GetInstance();
+    ulong dev = cache.AddDevice(blk);
+    u64 blocks = blk.GetCapacity() / PageCache::SectorsPerBlock;
+    if (dev == PageCache::MaxDevices || blocks < BlkBenchOps)
+        return false;
+
+    auto state = new CacheBenchState();
+    if (state == nullptr)
+        return false;
+
+    // runners stream through their own part of the disk
+    state->Dev = dev;
+    state->Blocks = blocks;
+    state->Next = (blocks / ctx.RunnerCount) * ctx.Runner;
+    ctx.Ctx = state;
+    return true;
+}
+
+static void CacheTeardown(BenchContext& ctx)
+{
+    delete static_cast<CacheBenchState*>(ctx.Ctx);
+}
+
+// a small set of blocks read over and over, served from memory after the
+// first pass
+static void BenchCacheReadHit(BenchContext& ctx, ulong ops)
+{
+    auto state = static_cast<CacheBenchState*>(ctx.Ctx);
+    auto& cache = PageCache::GetInstance();
+
+    for (ulong i = 0; i < ops; i++)
+        cache.Read(state->Dev, (i % BlkBenchOps) * PageCache::BlockSize, state->Buf, sizeof(state->Buf));
+}
+
+// consecutive blocks, readahead keeps the device ahead of the reader
+static void BenchCacheReadSeq(BenchContext& ctx, ulong ops)
+{
+    auto state = static_cast<CacheBenchState*>(ctx.Ctx);
+    auto& cache = PageCache::GetInstance();
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        cache.Read(state->Dev, state->Next * PageCache::BlockSize, state->Buf, sizeof(state->Buf));
+        state->Next = (state->Next + 1) % state->Blocks;
+    }
+}
+
+static const Benchmark BlkBenchmarks[] = {
+    BENCHMARK_SETUP("blk.read4k", BenchBlkRead, BlkSetup, BlkTeardown, BlkBenchOps, BenchScale),
+    BENCHMARK_SETUP("blk.read4k.batch", BenchBlkReadBatch, BlkSetup, BlkTeardown, BlkBenchOps, BenchScale),
+    BENCHMARK_SETUP("cache.read4k.hit", BenchCacheReadHit, CacheSetup, CacheTeardown, 4 * BlkBenchOps, BenchScale),
+    BENCHMARK_SETUP("cache.read4k.seq", BenchCacheReadSeq, CacheSetup, CacheTeardown, 4 * BlkBenchOps, BenchScale),
+};
+
+void RegisterBlkBenchmarks(BenchTable& table)
+{
+    table.Register(BlkBenchmarks, Stdlib::ArraySize(BlkBenchmarks));
+}
+
+}
@@ -0,0 +1,348 @@
+#include "bench.h"
+
+#include <lib/btree.h>
+#include <lib/bplus_tree.h>
+#include <lib/vector.h>
+#include <lib/small_vector.h>
+#include <lib/list.h>
+#include <lib/intrusive_list.h>
+#include <lib/ring_buffer.h>
+#include <mm/pool.h>
+#include <mm/page_allocator.h>
+
+namespace Kernel
+{
+
+// keys every workload draws from, more than warm-up plus samples consume so
+// insert and delete never run out
+static const ulong TreeKeyCount = 16384;
+
+template<typename TreeType>
+struct TreeState
+{
+    TreeState()
+        : Cursor(0)
+    {
+    }
+
+    TreeType Tree;
+    ulong Cursor;
+};
+
+using PoolBtree = Stdlib::Btree<u64, u64, 8, Stdlib::NopLock, Mm::PoolAllocator>;
+
+// nodes from a pool of node sized blocks instead of the general allocator
+template<>
+struct TreeState<PoolBtree>
+{
+    TreeState()
+        : Tree(Mm::PoolAllocator(&Pool))
+        , Cursor(0)
+    {
+        Pool.Setup(PoolBtree::GetNodeSize(), &Mm::PageAllocatorImpl::GetInstance());
+    }
+
+    Mm::Pool Pool;
+    PoolBtree Tree;
+    ulong Cursor;
+};
+
+// Random keys are Mix64 of the index, a bijection, so they never collide
+template<typename TreeType, bool Random>
+struct TreeBench
+{
+    using State = TreeState<TreeType>;
+
+    static u64 Key(ulong index)
+    {
+        return Random ? Stdlib::Mix64(index) : index;
+    }
+
+    static bool Setup(BenchContext& ctx, ulong count)
+    {
+        auto state = new State();
+        if (state == nullptr)
+            return false;
+
+        for (ulong i = 0; i < count; i++)
+        {
+            if (!state->Tree.Insert(Key(i), i))
+            {
+                delete state;
+                return false;
+            }
+        }
+
+        ctx.Ctx = state;
+        return true;
+    }
+
+    static bool SetupEmpty(BenchContext& ctx)
+    {
+        return Setup(ctx, 0);
+    }
+
+    static bool SetupFull(BenchContext& ctx)
+    {
+        return Setup(ctx, TreeKeyCount);
+    }
+
+    static void Teardown(BenchContext& ctx)
+    {
+        delete static_cast<State*>(ctx.Ctx);
+    }
+
+    static void Lookup(BenchContext& ctx, ulong ops)
+    {
+        auto state = static_cast<State*>(ctx.Ctx);
+        bool exist;
+
+        for (ulong i = 0; i < ops; i++)
+        {
+            state->Tree.Lookup(Key(state->Cursor), exist);
+            state->Cursor = (state->Cursor + 1) % TreeKeyCount;
+        }
+    }
+
+    static void Insert(BenchContext& ctx, ulong ops)
+    {
+        auto state = static_cast<State*>(ctx.Ctx);
+
+        for (ulong i = 0; i < ops; i++)
+        {
+            state->Tree.Insert(Key(state->Cursor), state->Cursor);
+            state->Cursor++;
+        }
+    }
+
+    static void Delete(BenchContext& ctx, ulong ops)
+    {
+        auto state = static_cast<State*>(ctx.Ctx);
+
+        for (ulong i = 0; i < ops; i++)
+        {
+            state->Tree.Delete(Key(state->Cursor));
+            state->Cursor++;
+        }
+    }
+
+    // half lookups of present keys, a quarter inserts of new keys and a
+    // quarter deletes of them, so the tree size stays at TreeKeyCount
+    static void Mixed(BenchContext& ctx, ulong ops)
+    {
+        auto state = static_cast<State*>(ctx.Ctx);
+        bool exist;
+
+        for (ulong i = 0; i < ops; i++)
+        {
+            ulong index = state->Cursor / 4;
+            switch (state->Cursor % 4)
+            {
+            case 1:
+                state->Tree.Insert(Key(TreeKeyCount + index), index);
+                break;
+            case 3:
+                state->Tree.Delete(Key(TreeKeyCount + index));
+                break;
+            default:
+                state->Tree.Lookup(Key(index % TreeKeyCount), exist);
+                break;
+            }
+            state->Cursor++;
+        }
+    }
+};
+
+#define TREE_BENCHMARK(name, workload, setup, TreeType, random) \
+    BENCHMARK_SETUP(name, (TreeBench<TreeType, random>::workload), \
+        (TreeBench<TreeType, random>::setup), (TreeBench<TreeType, random>::Teardown), 64, 0)
+
+#define TREE_BENCHMARKS(prefix, TreeType) \
+    TREE_BENCHMARK(prefix ".lookup.seq", Lookup, SetupFull, TreeType, false), \
+    TREE_BENCHMARK(prefix ".lookup.rand", Lookup, SetupFull, TreeType, true), \
+    TREE_BENCHMARK(prefix ".insert.seq", Insert, SetupEmpty, TreeType, false), \
+    TREE_BENCHMARK(prefix ".insert.rand", Insert, SetupEmpty, TreeType, true), \
+    TREE_BENCHMARK(prefix ".delete.seq", Delete, SetupFull, TreeType, false), \
+    TREE_BENCHMARK(prefix ".delete.rand", Delete, SetupFull, TreeType, true), \
+    TREE_BENCHMARK(prefix ".mixed.seq", Mixed, SetupFull, TreeType, false), \
+    TREE_BENCHMARK(prefix ".mixed.rand", Mixed, SetupFull, TreeType, true)
+
+using Btree2 = Stdlib::Btree<u64, u64, 2>;
+using Btree4 = Stdlib::Btree<u64, u64, 4>;
+using Btree8 = Stdlib::Btree<u64, u64, 8>;
+using Btree16 = Stdlib::Btree<u64, u64, 16>;
+using Btree32 = Stdlib::Btree<u64, u64, 32>;
+
+// a cache line per value, so node shifts and splits dominate over compares
+struct BenchBigValue
+{
+    BenchBigValue(ulong value = 0)
+    {
+        for (size_t i = 0; i < Stdlib::ArraySize(Data); i++)
+            Data[i] = value;
+    }
+
+    u64 Data[8];
+};
+
+using BtreeBig = Stdlib::Btree<u64, BenchBigValue, 8>;
+using BplusTree256 = Stdlib::BplusTree<u64, u64, 256>;
+using BplusTree512 = Stdlib::BplusTree<u64, u64, 512>;
+using BplusTree1024 = Stdlib::BplusTree<u64, u64, 1024>;
+
+// a fresh vector per call, so every call pays the growth from empty
+static void BenchVectorPushBack(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    Stdlib::Vector<u64> vec;
+
+    for (ulong i = 0; i < ops; i++)
+        vec.PushBack(i);
+}
+
+static void BenchVectorReserve(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    Stdlib::Vector<u64> vec;
+
+    if (!vec.Reserve(ops))
+        return;
+
+    for (ulong i = 0; i < ops; i++)
+        vec.PushBack(i);
+}
+
+// 64 pushes fit inline, so the allocator is never hit
+static void BenchSmallVectorPushBack(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    Stdlib::SmallVector<u64, 64> vec;
+
+    for (ulong i = 0; i < ops; i++)
+        vec.PushBack(i);
+}
+
+// an op is one node allocated at the tail and freed from the head
+static void BenchLinkedList(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+    Stdlib::LinkedList<u64> list;
+
+    for (ulong i = 0; i < ops; i++)
+        list.AddTail(i);
+
+    for (ulong i = 0; i < ops; i++)
+        list.PopHead();
+}
+
+struct BenchListItem
+{
+    u64 Value;
+    Stdlib::ListEntry Link;
+};
+
+static const ulong BenchListOps = 64;
+
+// same as list.addtail, but the nodes live in a preallocated array
+static bool IntrusiveListSetup(BenchContext& ctx)
+{
+    auto items = new BenchListItem[BenchListOps];
+    if (items == nullptr)
+        return false;
+
+    ctx.Ctx = items;
+    return true;
+}
+
+static void IntrusiveListTeardown(BenchContext& ctx)
+{
+    delete[] static_cast<BenchListItem*>(ctx.Ctx);
+}
+
+static void BenchIntrusiveList(BenchContext& ctx, ulong ops)
+{
+    auto items = static_cast<BenchListItem*>(ctx.Ctx);
+    Stdlib::IntrusiveList<BenchListItem, &BenchListItem::Link> list;
+
+    BugOn(ops > BenchListOps);
+
+    for (ulong i = 0; i < ops; i++)
+    {
+        items[i].Value = i;
+        list.AddTail(&items[i]);
+    }
+
+    for (ulong i = 0; i < ops; i++)
+        list.PopHead();
+}
+
+using BenchRing = Stdlib::RingBuffer<u64, 256>;
+using BenchSpscRing = Stdlib::SpscRingBuffer<u64, 256>;
+
+template<typename RingType>
+static bool RingSetup(BenchContext& ctx)
+{
+    auto ring = new RingType();
+    if (ring == nullptr)
+        return false;
+
+    ctx.Ctx = ring;
+    return true;
+}
+
+template<typename RingType>
+static void RingTeardown(BenchContext& ctx)
+{
+    delete static_cast<RingType*>(ctx.Ctx);
+}
+
+// an op is one Put and one Get
+static void BenchRingBuffer(BenchContext& ctx, ulong ops)
+{
+    auto ring = static_cast<BenchRing*>(ctx.Ctx);
+
+    for (ulong i = 0; i < ops; i++)
+        ring->Put(i);
+
+    for (ulong i = 0; i < ops; i++)
+        ring->Get();
+}
+
+static void BenchSpscRingBuffer(BenchContext& ctx, ulong ops)
+{
+    auto ring = static_cast<BenchSpscRing*>(ctx.Ctx);
+    u64 value;
+
+    for (ulong i = 0; i < ops; i++)
+        ring->Put(i);
+
+    for (ulong i = 0; i < ops; i++)
+        ring->Get(value);
+}
+
+static const Benchmark ContainerBenchmarks[] = {
+    TREE_BENCHMARKS("btree.t2", Btree2),
+    TREE_BENCHMARKS("btree.t4", Btree4),
+    TREE_BENCHMARKS("btree.t8", Btree8),
+    TREE_BENCHMARKS("btree.t16", Btree16),
+    TREE_BENCHMARKS("btree.t32", Btree32),
+    TREE_BENCHMARKS("btree.pool.t8", PoolBtree),
+    TREE_BENCHMARKS("btree.big.t8", BtreeBig),
+    TREE_BENCHMARKS("bplus.256", BplusTree256),
+    TREE_BENCHMARKS("bplus.512", BplusTree512),
+    TREE_BENCHMARKS("bplus.1024", BplusTree1024),
+    BENCHMARK("vector.pushback", BenchVectorPushBack, 64),
+    BENCHMARK("vector.reserve", BenchVectorReserve, 64),
+    BENCHMARK("smallvector.pushback", BenchSmallVectorPushBack, 64),
+    BENCHMARK("list.addtail", BenchLinkedList, 64),
+    BENCHMARK_SETUP("list.intrusive", BenchIntrusiveList, IntrusiveListSetup, IntrusiveListTeardown, BenchListOps, 0),
+    BENCHMARK_SETUP("ring.putget", BenchRingBuffer, RingSetup<BenchRing>, RingTeardown<BenchRing>, 64, 0),
+    BENCHMARK_SETUP("ring.spsc.putget", BenchSpscRingBuffer, RingSetup<BenchSpscRing>, RingTeardown<BenchSpscRing>, 64, 0),
+};
+
+void RegisterContainerBenchmarks(BenchTable& table)
+{
+    table.Register(ContainerBenchmarks, Stdlib::ArraySize(ContainerBenchmarks));
+}
+
+}
@@ -0,0 +1,347 @@
+#include "bench.h"
+#include "cpu.h"
+#include "sched.h"
+#include "task.h"
+#include "trace.h"
+#include "wait_queue.h"
+
+namespace Kernel
+{
+
+// Counter deltas of the queues a benchmark runs on, printed by teardown
+struct SchedCounters
+{
+    ulong Cpu[2];
+    long Schedule[2];
+    long SwitchContext[2];
+    long Handoff[2];
+    size_t Count;
+};
+
+static void SchedCountersStart(SchedCounters& counters, ulong cpu, ulong otherCpu)
+{
+    auto& cpus = CpuTable::GetInstance();
+
+    counters.Count = (otherCpu != cpu) ? 2 : 1;
+    counters.Cpu[0] = cpu;
+    counters.Cpu[1] = otherCpu;
+    for (size_t i = 0; i < counters.Count; i++)
+    {
+        auto& taskQueue = cpus.GetCpu(counters.Cpu[i]).GetTaskQueue();
+        counters.Schedule[i] = taskQueue.GetScheduleCounter();
+        counters.SwitchContext[i] = taskQueue.GetSwitchContextCounter();
+        counters.Handoff[i] = taskQueue.GetHandoffCounter();
+    }
+}
+
+static void SchedCountersDump(SchedCounters& counters, Stdlib::Printer& printer)
+{
+    auto& cpus = CpuTable::GetInstance();
+
+    for (size_t i = 0; i < counters.Count; i++)
+    {
+        auto& taskQueue = cpus.GetCpu(counters.Cpu[i]).GetTaskQueue();
+        printer.Printf("  cpu %u schedule %u switch context %u handoff %u\n", counters.Cpu[i],
+            taskQueue.GetScheduleCounter() - counters.Schedule[i],
+            taskQueue.GetSwitchContextCounter() - counters.SwitchContext[i],
+            taskQueue.GetHandoffCounter() - counters.Handoff[i]);
+    }
+}
+
+// some other running cpu than cpu, MaxCpus if there is none
+static ulong SchedOtherCpu(ulong cpu)
+{
+    CpuMask running = CpuTable::GetInstance().GetRunningCpus();
+    running.Reset(cpu);
+    return running.First();
+}
+
+static Task* SchedStartPinned(const char* name, ulong cpu, Task::Func func, void* ctx)
+{
+    Task* task = new Task(name);
+    if (task == nullptr)
+        return nullptr;
+
+    CpuMask affinity;
+    affinity.Set(cpu);
+    task->SetCpuAffinity(affinity);
+    if (!task->Start(func, ctx))
+    {
+        task->Put();
+        return nullptr;
+    }
+    return task;
+}
+
+static void SchedStop(Task* task)
+{
+    task->SetStopping();
+    task->Wait();
+    task->Put();
+}
+
+// Ping-pong: the runner hands the turn to a peer and blocks until it comes
+// back, so every round trip is two wakeups and two context switches. With
+// Handoff each side blocks by switching straight to the other one.
+struct PingPong
+{
+    WaitQueue TurnQueue[2];
+    Atomic Turn;
+    Task* Peer;
+    Task* Runner;
+    bool Handoff;
+    SchedCounters Counters;
+};
+
+static void PingPongWait(WaitQueue& waitQueue, Atomic& turn, long value, Task* handoff)
+{
+    auto task = Task::GetCurrentTask();
+    for (;;)
+    {
+        waitQueue.Prepare();
+        if (turn.Get() == value || task->IsStopping())
+        {
+            waitQueue.Finish();
+            break;
+        }
+        waitQueue.Wait(handoff);
+    }
+}
+
+static void PingPongPeer(void* ctx)
+{
+    auto pingPong = static_cast<PingPong*>(ctx);
+    auto task = Task::GetCurrentTask();
+
+    for (;;)
+    {
+        PingPongWait(pingPong->TurnQueue[1], pingPong->Turn, 1,
+            pingPong->Handoff ? pingPong->Runner : nullptr);
+        if (task->IsStopping())
+            break;
+
+        pingPong->Turn.Set(0);
+        pingPong->TurnQueue[0].WakeUpOne();
+    }
+}
+
+static bool PingPongSetup(BenchContext& ctx, ulong peerCpu, bool handoff)
+{
+    if (peerCpu >= MaxCpus)
+    {
+        Trace(0, "Bench needs another running cpu");
+        return false;
+    }
+
+    auto pingPong = new PingPong();
+    if (pingPong == nullptr)
+        return false;
+
+    pingPong->Runner = nullptr;
+    pingPong->Handoff = handoff;
+
+    pingPong->Peer = SchedStartPinned("pingpong", peerCpu, PingPongPeer, pingPong);
+    if (pingPong->Peer == nullptr)
+    {
+        delete pingPong;
+        return false;
+    }
+
+    SchedCountersStart(pingPong->Counters, ctx.Cpu, peerCpu);
+    ctx.Ctx = pingPong;
+    return true;
+}
+
+static bool PingPongLocalSetup(BenchContext& ctx)
+{
+    return PingPongSetup(ctx, ctx.Cpu, false);
+}
+
+static bool PingPongHandoffSetup(BenchContext& ctx)
+{
+    return PingPongSetup(ctx, ctx.Cpu, true);
+}
+
+static bool PingPongRemoteSetup(BenchContext& ctx)
+{
+    return PingPongSetup(ctx, SchedOtherCpu(ctx.Cpu), false);
+}
+
+static void PingPongTeardown(BenchContext& ctx)
+{
+    auto pingPong = static_cast<PingPong*>(ctx.Ctx);
+
+    SchedCountersDump(pingPong->Counters, *ctx.Printer);
+
+    pingPong->Peer->SetStopping();
+    pingPong->TurnQueue[1].WakeUpOne();
+    pingPong->Peer->Wait();
+    pingPong->Peer->Put();
+    delete pingPong;
+}
+
+static void BenchPingPong(BenchContext& ctx, ulong ops)
+{
+    auto pingPong = static_cast<PingPong*>(ctx.Ctx);
+
+    // published before the first turn, the peer reads it only afterwards
+    pingPong->Runner = Task::GetCurrentTask();
+    Task* handoff = pingPong->Handoff ? pingPong->Peer : nullptr;
+    for (ulong i = 0; i < ops; i++)
+    {
+        pingPong->Turn.Set(1);
+        pingPong->TurnQueue[1].WakeUpOne();
+        PingPongWait(pingPong->TurnQueue[0], pingPong->Turn, 0, handoff);
+    }
+}
+
+// Migration: the runner moves itself to the other cpu and back, each
+// operation is one affinity change, switch out and insert on the remote queue.
+struct Migrate
+{
+    ulong OtherCpu;
+    SchedCounters Counters;
+};
+
+static bool MigrateSetup(BenchContext& ctx)
+{
+    ulong otherCpu = SchedOtherCpu(ctx.Cpu);
+    if (otherCpu >= MaxCpus)
+    {
+        Trace(0, "Bench needs another running cpu");
+        return false;
+    }
+
+    auto migrate = new Migrate();
+    if (migrate == nullptr)
+        return false;
+
+    migrate->OtherCpu = otherCpu;
+    SchedCountersStart(migrate->Counters, ctx.Cpu, otherCpu);
+    ctx.Ctx = migrate;
+    return true;
+}
+
+static void MigrateTeardown(BenchContext& ctx)
+{
+    auto migrate = static_cast<Migrate*>(ctx.Ctx);
+
+    SchedCountersDump(migrate->Counters, *ctx.Printer);
+    delete migrate;
+}
+
+static void MigrateTo(ulong cpu)
+{
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask affinity;
+    affinity.Set(cpu);
+    Task::GetCurrentTask()->SetCpuAffinity(affinity);
+    while (cpus.GetCurrentCpuId() != cpu)
+        Schedule();
+}
+
+static void BenchMigrate(BenchContext& ctx, ulong ops)
+{
+    auto migrate = static_cast<Migrate*>(ctx.Ctx);
+
+    // an operation starts and ends on the runner cpu, so count both hops
+    for (ulong i = 0; i < ops; i += 2)
+    {
+        MigrateTo(migrate->OtherCpu);
+        MigrateTo(ctx.Cpu);
+    }
+}
+
+// Queue length: TaskCount - 1 peers pinned to the runner cpu keep calling
+// Schedule(), the runner measures its own Schedule() calls among them.
+struct QueueLoad
+{
+    Task** Peer;
+    size_t PeerCount;
+    SchedCounters Counters;
+};
+
+static void QueueLoadPeer(void* ctx)
+{
+    (void)ctx;
+    auto task = Task::GetCurrentTask();
+
+    while (!task->IsStopping())
+        Schedule();
+}
+
+static void QueueLoadTeardown(BenchContext& ctx)
+{
+    auto load = static_cast<QueueLoad*>(ctx.Ctx);
+
+    SchedCountersDump(load->Counters, *ctx.Printer);
+    for (size_t i = 0; i < load->PeerCount; i++)
+        SchedStop(load->Peer[i]);
+
+    delete [] load->Peer;
+    delete load;
+}
+
+static bool QueueLoadSetup(BenchContext& ctx, size_t taskCount)
+{
+    auto load = new QueueLoad();
+    if (load == nullptr)
+        return false;
+
+    load->PeerCount = 0;
+    load->Peer = new Task*[taskCount];
+    if (load->Peer == nullptr)
+    {
+        delete load;
+        return false;
+    }
+
+    ctx.Ctx = load;
+    for (size_t i = 1; i < taskCount; i++)
+    {
+        Task* peer = SchedStartPinned("queueload", ctx.Cpu, QueueLoadPeer, nullptr);
+        if (peer == nullptr)
+        {
+            QueueLoadTeardown(ctx);
+            ctx.Ctx = nullptr;
+            return false;
+        }
+        load->Peer[load->PeerCount++] = peer;
+    }
+
+    SchedCountersStart(load->Counters, ctx.Cpu, ctx.Cpu);
+    return true;
+}
+
+template<size_t TaskCount>
+static bool QueueLoadSetup(BenchContext& ctx)
+{
+    return QueueLoadSetup(ctx, TaskCount);
+}
+
+static void BenchSchedule(BenchContext& ctx, ulong ops)
+{
+    (void)ctx;
+
+    for (ulong i = 0; i < ops; i++)
+        Schedule();
+}
+
+static const Benchmark SchedBenchmarks[] = {
+    BENCHMARK_SETUP("sched.pingpong", BenchPingPong, PingPongLocalSetup, PingPongTeardown, 16, 0),
+    BENCHMARK_SETUP("sched.pingpong.handoff", BenchPingPong, PingPongHandoffSetup, PingPongTeardown, 16, 0),
+    BENCHMARK_SETUP("sched.pingpong.remote", BenchPingPong, PingPongRemoteSetup, PingPongTeardown, 16, 0),
+    BENCHMARK_SETUP("sched.migrate", BenchMigrate, MigrateSetup, MigrateTeardown, 16, 0),
+    BENCHMARK_SETUP("sched.queue1", BenchSchedule, QueueLoadSetup<1>, QueueLoadTeardown, 64, 0),
+    BENCHMARK_SETUP("sched.queue4", BenchSchedule, QueueLoadSetup<4>, QueueLoadTeardown, 64, 0),
+    BENCHMARK_SETUP("sched.queue16", BenchSchedule, QueueLoadSetup<16>, QueueLoadTeardown, 64, 0),
+    BENCHMARK_SETUP("sched.queue64", BenchSchedule, QueueLoadSetup<64>, QueueLoadTeardown, 64, 0),
+    BENCHMARK_SETUP("sched.queue256", BenchSchedule, QueueLoadSetup<256>, QueueLoadTeardown, 64, 0),
+};
+
+void RegisterSchedBenchmarks(BenchTable& table)
+{
+    table.Register(SchedBenchmarks, Stdlib::ArraySize(SchedBenchmarks));
+}
+
+}
@@ -0,0 +1,53 @@
+#include "boot_profile.h"
+#include "asm.h"
+#include "time.h"
+
+namespace Kernel
+{
+
+BootProfile::BootProfile()
+    : PhaseCount(0)
+{
+}
+
+BootProfile::~BootProfile()
+{
+}
+
+void BootProfile::Mark(const char* name)
+{
+    // only the BSP marks phases, anything past the limit is dropped
+    if (PhaseCount >= MaxPhases)
+        return;
+
+    Phases[PhaseCount].Name = name;
+    Phases[PhaseCount].Tsc = ReadTsc();
+    PhaseCount++;
+}
+
+ulong BootProfile::TicksToUsecs(u64 ticks, ulong ticksPerMs)
+{
+    return (ticks * 1000) / ticksPerMs;
+}
+
+void BootProfile::Dump(Stdlib::Printer& printer)
+{
+    ulong ticksPerMs = TscClock::GetInstance().GetTicksPerMs();
+    if (PhaseCount == 0 || ticksPerMs == 0)
+    {
+        printer.Printf("no boot profile\n");
+        return;
+    }
+
+    for (size_t i = 0; i < PhaseCount; i++)
+    {
+        // the last phase lasts until now
+        u64 end = (i + 1 < PhaseCount) ? Phases[i + 1].Tsc : ReadTsc();
+        printer.Printf("%s %u us\n", Phases[i].Name, TicksToUsecs(end - Phases[i].Tsc, ticksPerMs));
+    }
+
+    u64 total = Phases[PhaseCount - 1].Tsc - Phases[0].Tsc;
+    printer.Printf("total to %s %u us\n", Phases[PhaseCount - 1].Name, TicksToUsecs(total, ticksPerMs));
+}
+
+}
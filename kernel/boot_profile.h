@@ -0,0 +1,49 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+// Startup phase timestamps in raw TSC ticks, the PIT doesn't tick before
+// interrupts are enabled and the TSC isn't calibrated yet either, so
+// ticks are converted only when dumped.
+class BootProfile final
+{
+public:
+    static BootProfile& GetInstance()
+    {
+        static BootProfile Instance;
+        return Instance;
+    }
+
+    // starts a phase and ends the previous one, name must be a static string
+    void Mark(const char* name);
+
+    // prints every phase with its duration and the total
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    BootProfile();
+    ~BootProfile();
+    BootProfile(const BootProfile& other) = delete;
+    BootProfile(BootProfile&& other) = delete;
+    BootProfile& operator=(const BootProfile& other) = delete;
+    BootProfile& operator=(BootProfile&& other) = delete;
+
+    static ulong TicksToUsecs(u64 ticks, ulong ticksPerMs);
+
+    static const size_t MaxPhases = 32;
+
+    struct Phase
+    {
+        const char* Name;
+        u64 Tsc;
+    };
+
+    Phase Phases[MaxPhases];
+    size_t PhaseCount;
+};
+
+}
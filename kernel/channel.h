@@ -0,0 +1,264 @@
+#pragma once
+
+#include <include/const.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+#include "atomic.h"
+#include "wait_queue.h"
+
+namespace Kernel
+{
+
+// Bounded multi producer multi consumer queue of N values between tasks.
+// Every slot has a sequence number: pos while it is free for the sender
+// claiming position pos, pos + 1 once it holds the value for the receiver
+// claiming pos, pos + N after that receiver took it. Each side claims
+// positions with a cmpxchg on its own cache line and then only touches its
+// slot, so neither takes a lock and slots don't share lines.
+// Send and Recv block on wait queues while the channel is full or empty.
+// A side that sleeps counts itself first, so the other side only takes the
+// wait queue lock when somebody sleeps. Batches pay the wakeup check once.
+// T must be default constructible and copy assignable. Task context only.
+template<typename T, size_t N>
+class Channel final
+{
+public:
+    Channel()
+    {
+        for (size_t i = 0; i < N; i++)
+            Slots[i].Seq.Store(i, MemoryOrderRelaxed);
+        SendPos.Store(0, MemoryOrderRelaxed);
+        RecvPos.Store(0, MemoryOrderRelaxed);
+    }
+
+    ~Channel()
+    {
+    }
+
+    // false if the channel is full
+    bool TrySend(const T& value)
+    {
+        if (!Enqueue(value))
+            return false;
+
+        WakeUp(RecvWaiters, Receivers, 1);
+        return true;
+    }
+
+    // false if the channel is empty
+    bool TryRecv(T& value)
+    {
+        if (!Dequeue(value))
+            return false;
+
+        WakeUp(SendWaiters, Senders, 1);
+        return true;
+    }
+
+    // blocks while the channel is full
+    void Send(const T& value)
+    {
+        while (!TrySend(value))
+        {
+            SendWaiters.Inc();
+            Senders.Prepare();
+            if (Enqueue(value))
+            {
+                Senders.Finish();
+                SendWaiters.Dec();
+                WakeUp(RecvWaiters, Receivers, 1);
+                return;
+            }
+            Senders.Wait();
+            SendWaiters.Dec();
+        }
+    }
+
+    // blocks while the channel is empty
+    void Recv(T& value)
+    {
+        while (!TryRecv(value))
+        {
+            RecvWaiters.Inc();
+            Receivers.Prepare();
+            if (Dequeue(value))
+            {
+                Receivers.Finish();
+                RecvWaiters.Dec();
+                WakeUp(SendWaiters, Senders, 1);
+                return;
+            }
+            Receivers.Wait();
+            RecvWaiters.Dec();
+        }
+    }
+
+    // sends values in order until the channel is full, returns how many
+    size_t TrySendBatch(const T* values, size_t count)
+    {
+        size_t sent = 0;
+        while (sent < count && Enqueue(values[sent]))
+            sent++;
+
+        if (sent != 0)
+            WakeUp(RecvWaiters, Receivers, sent);
+        return sent;
+    }
+
+    // takes up to count values, returns how many
+    size_t TryRecvBatch(T* values, size_t count)
+    {
+        size_t received = 0;
+        while (received < count && Dequeue(values[received]))
+            received++;
+
+        if (received != 0)
+            WakeUp(SendWaiters, Senders, received);
+        return received;
+    }
+
+    // sends all values, blocks whenever the channel is full
+    void SendBatch(const T* values, size_t count)
+    {
+        size_t sent = TrySendBatch(values, count);
+        while (sent < count)
+        {
+            Send(values[sent++]);
+            sent += TrySendBatch(&values[sent], count - sent);
+        }
+    }
+
+    // blocks until there is a value, then takes up to count, returns how
+    // many
+    size_t RecvBatch(T* values, size_t count)
+    {
+        if (count == 0)
+            return 0;
+
+        size_t received = TryRecvBatch(values, count);
+        if (received != 0)
+            return received;
+
+        Recv(values[0]);
+        return 1 + TryRecvBatch(&values[1], count - 1);
+    }
+
+    // a snapshot, racing senders and receivers may move it right away
+    size_t GetCount()
+    {
+        size_t recvPos = RecvPos.Load(MemoryOrderRelaxed);
+        size_t sendPos = SendPos.Load(MemoryOrderRelaxed);
+        return (sendPos > recvPos) ? (sendPos - recvPos) : 0;
+    }
+
+    static constexpr size_t GetCapacity()
+    {
+        return N;
+    }
+
+    // operator new only guarantees 16 bytes
+    static void* operator new(size_t size) noexcept
+    {
+        return Mm::NewAligned(size, alignof(Channel));
+    }
+
+    static void operator delete(void* ptr) noexcept
+    {
+        ::operator delete(ptr);
+    }
+
+private:
+    Channel(const Channel& other) = delete;
+    Channel(Channel&& other) = delete;
+    Channel& operator=(const Channel& other) = delete;
+    Channel& operator=(Channel&& other) = delete;
+
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "Invalid capacity");
+
+    bool Enqueue(const T& value)
+    {
+        size_t pos = SendPos.Load(MemoryOrderRelaxed);
+        for (;;)
+        {
+            Slot& slot = Slots[pos & (N - 1)];
+            long diff = static_cast<long>(slot.Seq.Load(MemoryOrderAcquire) - pos);
+            if (diff == 0)
+            {
+                // a failed cmpxchg reloads pos
+                if (SendPos.CompareExchange(pos, pos + 1, MemoryOrderRelaxed))
+                {
+                    slot.Value = value;
+                    slot.Seq.Store(pos + 1, MemoryOrderRelease);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                // the value of the previous lap is still there
+                return false;
+            }
+            else
+            {
+                pos = SendPos.Load(MemoryOrderRelaxed);
+            }
+        }
+    }
+
+    bool Dequeue(T& value)
+    {
+        size_t pos = RecvPos.Load(MemoryOrderRelaxed);
+        for (;;)
+        {
+            Slot& slot = Slots[pos & (N - 1)];
+            long diff = static_cast<long>(slot.Seq.Load(MemoryOrderAcquire) - (pos + 1));
+            if (diff == 0)
+            {
+                if (RecvPos.CompareExchange(pos, pos + 1, MemoryOrderRelaxed))
+                {
+                    value = slot.Value;
+                    slot.Seq.Store(pos + N, MemoryOrderRelease);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                // not sent yet
+                return false;
+            }
+            else
+            {
+                pos = RecvPos.Load(MemoryOrderRelaxed);
+            }
+        }
+    }
+
+    // wakes up to count sleepers of the other side
+    void WakeUp(Atomic& waiters, WaitQueue& waitQueue, size_t count)
+    {
+        // orders the slot store before the waiter count load, a sleeper
+        // counts itself before it retries, so one of both sees the other
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        long sleeping = waiters.Load(MemoryOrderRelaxed);
+        for (long i = 0; i < sleeping && static_cast<size_t>(i) < count; i++)
+            waitQueue.WakeUpOne();
+    }
+
+    struct Slot final
+    {
+        AtomicValue<size_t> Seq;
+        T Value;
+    } __attribute__((aligned(Const::CacheLineSize)));
+
+    AtomicValue<size_t> SendPos __attribute__((aligned(Const::CacheLineSize)));
+    AtomicValue<size_t> RecvPos __attribute__((aligned(Const::CacheLineSize)));
+    Slot Slots[N];
+
+    Atomic SendWaiters __attribute__((aligned(Const::CacheLineSize)));
+    Atomic RecvWaiters;
+    WaitQueue Senders;
+    WaitQueue Receivers;
+};
+
+}
@@ -5,8 +5,30 @@
 #include "cpu.h"
 #include "time.h"
 #include "watchdog.h"
+#include "lock_elision.h"
+#include "boot_profile.h"
+#include "bench.h"
+#include "interrupt.h"
+#include "work_queue.h"
+#include "stack_allocator.h"
+#include "irq_affinity.h"
+#include "syscall.h"
+#include "static_key.h"
+#include "tunable.h"
 
 #include <drivers/vga.h>
+#include <drivers/pmu.h>
+#include <drivers/kvm.h>
+#include <drivers/pci.h>
+#include <drivers/page_cache.h>
+#include <drivers/virtio_blk.h>
+#include <drivers/virtio_net.h>
+#include <mm/page_allocator.h>
+#include <mm/allocator.h>
+#include <mm/object_pool.h>
+#include <mm/vmalloc.h>
+#include <mm/early_allocator.h>
+#include <mm/shrinker.h>
 
 namespace Kernel
 {
@@ -53,11 +75,173 @@ void Cmd::ProcessCmd(const char *cmd)
 
         vga.Printf("cr0 0x%p cr2 0x%p cr3 0x%p cr4 0x%p",
             GetCr0(), GetCr2(), GetCr3(), GetCr4());
+
+        Kvm::GetInstance().Dump(vga);
+        CpuTable::GetInstance().DumpTopology(vga);
     }
     else if (Stdlib::StrCmp(cmd, "dmesg") == 0)
     {
         Dmesg::GetInstance().Dump(vga);
     }
+    else if (Stdlib::StrCmp(cmd, "dmesg -w") == 0)
+    {
+        FollowDmesg();
+    }
+    else if (Stdlib::StrCmp(cmd, "trace") == 0)
+    {
+        TraceBuffer::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "boottime") == 0)
+    {
+        BootProfile::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "bench") == 0)
+    {
+        BenchTable::GetInstance().List(vga);
+    }
+    else if (Stdlib::StrnCmp(cmd, "bench ", Stdlib::StrLen("bench ")) == 0)
+    {
+        BenchTable::GetInstance().Run(cmd + Stdlib::StrLen("bench "), vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "perf") == 0)
+    {
+        Pmu::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "perf start") == 0)
+    {
+        if (!Pmu::GetInstance().Start(PerfPeriod))
+            vga.Printf("can't start perf\n");
+    }
+    else if (Stdlib::StrCmp(cmd, "perf stop") == 0)
+    {
+        Pmu::GetInstance().Stop();
+    }
+    else if (Stdlib::StrCmp(cmd, "interrupts") == 0)
+    {
+        Interrupt::Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "irq") == 0)
+    {
+        IrqAffinity::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "irq balance on") == 0)
+    {
+        IrqAffinity::GetInstance().StartBalance();
+    }
+    else if (Stdlib::StrCmp(cmd, "irq balance off") == 0)
+    {
+        IrqAffinity::GetInstance().StopBalance();
+    }
+    else if (Stdlib::StrnCmp(cmd, "irq set ", Stdlib::StrLen("irq set ")) == 0)
+    {
+        const char* args = cmd + Stdlib::StrLen("irq set ");
+        const char* sep = Stdlib::StrChrOnce(args, ' ');
+        char irqStr[8];
+        ulong irq, mask;
+        CpuMask cpuMask;
+
+        if (sep == nullptr || sep == args || static_cast<size_t>(sep - args) >= sizeof(irqStr))
+        {
+            vga.Printf("usage: irq set <irq> <cpu mask>\n");
+        }
+        else
+        {
+            Stdlib::StrnCpy(irqStr, args, sep - args);
+            irqStr[sep - args] = '\0';
+            if (!Stdlib::StringToUlong(irqStr, irq) || !Stdlib::StringToUlong(sep + 1, mask) ||
+                irq >= IrqAffinity::MaxIrqs)
+            {
+                vga.Printf("usage: irq set <irq> <cpu mask>\n");
+            }
+            else
+            {
+                cpuMask.SetWord(0, mask);
+                if (!IrqAffinity::GetInstance().Set(static_cast<u8>(irq), cpuMask))
+                    vga.Printf("can't set irq %u affinity\n", irq);
+            }
+        }
+    }
+    else if (Stdlib::StrCmp(cmd, "get") == 0)
+    {
+        TunableTable::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrnCmp(cmd, "get ", Stdlib::StrLen("get ")) == 0)
+    {
+        Tunable* tunable = TunableTable::GetInstance().Find(cmd + Stdlib::StrLen("get "));
+        if (tunable == nullptr)
+            vga.Printf("no tunable %s\n", cmd + Stdlib::StrLen("get "));
+        else
+            vga.Printf("%s %u\n", tunable->GetName(), tunable->Get());
+    }
+    else if (Stdlib::StrnCmp(cmd, "set ", Stdlib::StrLen("set ")) == 0)
+    {
+        const char* args = cmd + Stdlib::StrLen("set ");
+        const char* sep = Stdlib::StrChrOnce(args, ' ');
+        char name[32];
+
+        if (sep == nullptr || sep == args || static_cast<size_t>(sep - args) >= sizeof(name))
+        {
+            vga.Printf("usage: set <name> <value>\n");
+        }
+        else
+        {
+            Stdlib::StrnCpy(name, args, sep - args);
+            name[sep - args] = '\0';
+            if (!TunableTable::GetInstance().Set(name, sep + 1, false))
+                vga.Printf("can't set %s to %s\n", name, sep + 1);
+        }
+    }
+    else if (Stdlib::StrCmp(cmd, "key") == 0)
+    {
+        StaticKeys::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrnCmp(cmd, "key ", Stdlib::StrLen("key ")) == 0)
+    {
+        const char* args = cmd + Stdlib::StrLen("key ");
+        const char* sep = Stdlib::StrChrOnce(args, ' ');
+        char name[32];
+        StaticKey* key = nullptr;
+
+        if (sep != nullptr && sep != args && static_cast<size_t>(sep - args) < sizeof(name))
+        {
+            Stdlib::StrnCpy(name, args, sep - args);
+            name[sep - args] = '\0';
+            key = StaticKeys::GetInstance().Find(name);
+        }
+
+        if (key == nullptr)
+            vga.Printf("usage: key <name> on|off\n");
+        else if (Stdlib::StrCmp(sep + 1, "on") == 0)
+            StaticKeys::GetInstance().Set(*key, true);
+        else if (Stdlib::StrCmp(sep + 1, "off") == 0)
+            StaticKeys::GetInstance().Set(*key, false);
+        else
+            vga.Printf("usage: key <name> on|off\n");
+    }
+    else if (Stdlib::StrCmp(cmd, "blk") == 0)
+    {
+        VirtioBlk::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "cache") == 0)
+    {
+        PageCache::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "net") == 0)
+    {
+        VirtioNet::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "pci") == 0)
+    {
+        Pci::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "syscall") == 0)
+    {
+        Syscall::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "top") == 0)
+    {
+        Top();
+    }
     else if (Stdlib::StrCmp(cmd, "uptime") == 0)
     {
         auto time = GetBootTime();
@@ -71,14 +255,56 @@ void Cmd::ProcessCmd(const char *cmd)
     {
         Watchdog::GetInstance().Dump(vga);
     }
+    else if (Stdlib::StrCmp(cmd, "workqueue") == 0)
+    {
+        WorkQueue::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "locks") == 0)
+    {
+        Watchdog::GetInstance().DumpLockStats(vga);
+        LockElision::GetInstance().Dump(vga);
+    }
+    else if (Stdlib::StrCmp(cmd, "meminfo") == 0)
+    {
+        auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+        pageAllocator.Dump(vga);
+        Mm::AllocatorImpl::GetInstance(pageAllocator).Dump(vga);
+        StackAllocator::GetInstance().Dump(vga);
+        Mm::Pool::PoolStats stats;
+        Mm::ObjectPool<class Task>::GetInstance().GetStats(stats);
+        vga.Printf("task pool %u %u %u %u %u %u\n", stats.Size, stats.Usage, stats.PeakUsage,
+            stats.FreeBlocks, stats.PageCount, stats.AllocFailures);
+        Mm::Vmalloc::GetInstance().Dump(vga);
+        Mm::EarlyAllocator::GetInstance().Dump(vga);
+        Mm::ShrinkerTable::GetInstance().Dump(vga);
+        vga.Printf("dmesg %u\n", Dmesg::GetInstance().GetSize());
+    }
     else if (Stdlib::StrCmp(cmd, "help") == 0)
     {
+        vga.Printf("bench [name|all] - list or run benchmarks\n");
+        vga.Printf("blk - show virtio-blk queues\n");
+        vga.Printf("boottime - show boot phase durations\n");
+        vga.Printf("cache - show block page cache\n");
         vga.Printf("cls - clear screen\n");
         vga.Printf("cpu - dump cpu state\n");
-        vga.Printf("dmesg - dump kernel log\n");
+        vga.Printf("dmesg [-w] - dump kernel log, -w follows it until a key is pressed\n");
         vga.Printf("exit - shutdown kernel\n");
+        vga.Printf("get [name] - show tunables\n");
+        vga.Printf("interrupts - show per-vector interrupt counts and handler times\n");
+        vga.Printf("irq [balance on|off|set <irq> <cpu mask>] - show or control irq affinity\n");
+        vga.Printf("key [<name> on|off] - show or switch static keys\n");
+        vga.Printf("locks - show most contended locks and lock elision stats\n");
+        vga.Printf("meminfo - show memory allocator stats\n");
+        vga.Printf("net - show virtio-net queues\n");
+        vga.Printf("pci - show pci devices\n");
+        vga.Printf("perf [start|stop] - show or control cpu counters and samples\n");
         vga.Printf("ps - show tasks\n");
+        vga.Printf("set <name> <value> - set a tunable\n");
+        vga.Printf("syscall - show system call counts\n");
+        vga.Printf("top - refresh cpu and task stats until a key is pressed\n");
+        vga.Printf("trace - dump binary trace buffers\n");
         vga.Printf("watchdog - show watchdog stats\n");
+        vga.Printf("workqueue - show per-cpu worker stats\n");
         vga.Printf("help - help\n");
     }
     else
@@ -88,6 +314,97 @@ void Cmd::ProcessCmd(const char *cmd)
     vga.Printf("$");
 }
 
+bool Cmd::TakeKey()
+{
+    Stdlib::AutoLock lock(Lock);
+    if (Buf.IsEmpty())
+        return false;
+
+    Buf.Get();
+    return true;
+}
+
+void Cmd::FollowDmesg()
+{
+    auto& vga = VgaTerm::GetInstance();
+    auto& dmesg = Dmesg::GetInstance();
+    DmesgCursor cursor;
+
+    while (!Task::GetCurrentTask()->IsStopping())
+    {
+        dmesg.DumpFrom(cursor, vga);
+        Sleep(FollowPeriod);
+
+        if (TakeKey())
+            break;
+    }
+}
+
+void Cmd::Top()
+{
+    auto& vga = VgaTerm::GetInstance();
+    auto& cpus = CpuTable::GetInstance();
+    size_t cpuLimit = cpus.GetCpuLimit();
+
+    CpuStats* prev = new CpuStats[cpuLimit];
+    CpuStats* curr = new CpuStats[cpuLimit];
+    if (prev == nullptr || curr == nullptr)
+    {
+        if (prev != nullptr)
+            delete [] prev;
+        if (curr != nullptr)
+            delete [] curr;
+        vga.Printf("no memory\n");
+        return;
+    }
+
+    CpuMask running = cpus.GetRunningCpus();
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+        cpus.GetCpu(i).GetStats(prev[i]);
+    auto prevTime = GetBootTime();
+
+    while (!Task::GetCurrentTask()->IsStopping())
+    {
+        Sleep(TopPeriod);
+
+        if (TakeKey())
+            break;
+
+        auto now = GetBootTime();
+        ulong interval = (now - prevTime).GetValue();
+        prevTime = now;
+        if (interval == 0)
+            continue;
+
+        vga.Cls();
+        vga.Printf("cpu busy(pct) idle(pct) irq(pct) irqs sched switch migin migout ready tasks\n");
+        for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+        {
+            auto& stats = curr[i];
+            auto& last = prev[i];
+            cpus.GetCpu(i).GetStats(stats);
+            vga.Printf("%u %u %u %u %u %u %u %u %u %u %u\n", i,
+                ((stats.BusyTime - last.BusyTime).GetValue() * 100) / interval,
+                ((stats.IdleTime - last.IdleTime).GetValue() * 100) / interval,
+                ((stats.IrqTime - last.IrqTime).GetValue() * 100) / interval,
+                stats.IrqCount - last.IrqCount,
+                stats.ScheduleCount - last.ScheduleCount,
+                stats.SwitchCount - last.SwitchCount,
+                stats.MigrateInCount - last.MigrateInCount,
+                stats.MigrateOutCount - last.MigrateOutCount,
+                stats.ReadyCount, stats.TaskCount);
+        }
+        TaskTable::GetInstance().Ps(vga);
+
+        CpuStats* tmp = prev;
+        prev = curr;
+        curr = tmp;
+    }
+
+    delete [] prev;
+    delete [] curr;
+}
+
 bool Cmd::IsExit()
 {
     return Exit;
@@ -100,6 +417,7 @@ void Cmd::Stop()
         BugOn(Task == nullptr);
         Active = false;
         Task->SetStopping();
+        KeyWaitQueue.WakeUpAll();
         Task->Wait();
     }
 }
@@ -113,6 +431,9 @@ bool Cmd::Start()
     if (task == nullptr)
         return false;
 
+    // shell is interactive, prefer it over bulk workers
+    task->SetNice(-5);
+
     {
         Stdlib::AutoLock lock(Lock);
         if (Task == nullptr)
@@ -153,74 +474,87 @@ void Cmd::Run()
 
     auto& vga = VgaTerm::GetInstance();
 
-    while (!Task::GetCurrentTask()->IsStopping())
+    for (;;)
     {
         KeyEvent keyEvent = {};
-        bool hasEvent = false;
-        bool backspace = false;
+        if (!WaitKey(keyEvent))
+            break;
+
+        bool backspace = (keyEvent.Code == 0xE) ? true : false;
+
+        if (backspace)
         {
-            Stdlib::AutoLock lock(Lock);
-            if (!Buf.IsEmpty())
-            {
-                keyEvent = Buf.Get();
-                hasEvent = true;
-                backspace = (keyEvent.Code == 0xE) ? true : false;
-            }
+            if (pos > 0)
+                vga.Backspace();
+        }
+        else
+        {
+            vga.Printf("%c", keyEvent.Char);
         }
 
-        if (hasEvent)
+        if (keyEvent.Char == '\n')
         {
-            if (backspace)
+            CmdLine[Stdlib::ArraySize(CmdLine) - 1] = '\0';
+            if (!overflow)
             {
-                if (pos > 0)
-                    vga.Backspace();
+                ProcessCmd(CmdLine);
             }
             else
             {
-                vga.Printf("%c", keyEvent.Char);
+                vga.Printf("command too large\n");
+                vga.Printf("$");
+                overflow = false;
             }
-
-            if (keyEvent.Char == '\n')
+            Stdlib::MemSet(CmdLine, 0, Stdlib::StrLen(CmdLine));
+            pos = 0;
+        }
+        else
+        {
+            if (pos < (Stdlib::ArraySize(CmdLine) - 1))
             {
-                CmdLine[Stdlib::ArraySize(CmdLine) - 1] = '\0';
-                if (!overflow)
+                if (backspace)
                 {
-                    ProcessCmd(CmdLine);
+                    if (pos > 0)
+                    {
+                        pos--;
+                        CmdLine[pos] = '\0';
+                    }
                 }
                 else
                 {
-                    vga.Printf("command too large\n");
-                    vga.Printf("$");
-                    overflow = false;
+                    CmdLine[pos++] = keyEvent.Char;
                 }
-                Stdlib::MemSet(CmdLine, 0, Stdlib::StrLen(CmdLine));
-                pos = 0;
             }
             else
             {
-                if (pos < (Stdlib::ArraySize(CmdLine) - 1))
-                {
-                    if (backspace)
-                    {
-                        if (pos > 0)
-                        {
-                            pos--;
-                            CmdLine[pos] = '\0';
-                        }
-                    }
-                    else
-                    {
-                        CmdLine[pos++] = keyEvent.Char;
-                    }
-                }
-                else
-                {
-                    overflow = true;
-                }
+                overflow = true;
+            }
+        }
+    }
+}
+
+bool Cmd::WaitKey(KeyEvent& keyEvent)
+{
+    for (;;)
+    {
+        KeyWaitQueue.Prepare();
+        {
+            Stdlib::AutoLock lock(Lock);
+            if (!Buf.IsEmpty())
+            {
+                keyEvent = Buf.Get();
+                KeyWaitQueue.Finish();
+                return true;
             }
         }
 
-        Sleep(10 * Const::NanoSecsInMs);
+        if (Task::GetCurrentTask()->IsStopping())
+        {
+            KeyWaitQueue.Finish();
+            return false;
+        }
+
+        KeyWaitQueue.Wait();
     }
 }
 
@@ -232,19 +566,23 @@ void Cmd::RunFunc(void *ctx)
 
 void Cmd::OnChar(char c, u8 code)
 {
-    Stdlib::AutoLock lock(Lock);
-    if (!Active)
-        return;
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (!Active)
+            return;
 
-    KeyEvent e;
-    e.Char = c;
-    e.Code = code;
+        KeyEvent e;
+        e.Char = c;
+        e.Code = code;
 
-    if (!Buf.Put(e))
-    {
-        Trace(0, "Can't save char");
-        return;
+        if (!Buf.Put(e))
+        {
+            Trace(0, "Can't save char");
+            return;
+        }
     }
+
+    KeyWaitQueue.WakeUpAll();
 }
 
 }
\ No newline at end of file
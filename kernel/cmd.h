@@ -1,5 +1,6 @@
 #include "spin_lock.h"
 #include "task.h"
+#include "wait_queue.h"
 
 #include <drivers/8042.h>
 #include <lib/stdlib.h>
@@ -30,6 +31,23 @@ public:
 private:
     void ProcessCmd(const char *cmd);
 
+    // refreshes per-cpu deltas and the task list until a key is pressed
+    void Top();
+
+    // prints new dmesg records until a key is pressed
+    void FollowDmesg();
+
+    // consumes a pending key
+    bool TakeKey();
+
+    struct KeyEvent {
+        char Char;
+        u8 Code;
+    };
+
+    // blocks until a key comes, false once the task is stopping
+    bool WaitKey(KeyEvent& keyEvent);
+
     Cmd();
     ~Cmd();
     Cmd(const Cmd& other) = delete;
@@ -41,15 +59,16 @@ private:
     static void RunFunc(void *ctx);
 
     static const size_t CmdSizeMax = 80;
-
-    struct KeyEvent {
-        char Char;
-        u8 Code;
-    };
+    // cycles between perf samples
+    static const ulong PerfPeriod = 1000000;
+    static const ulong TopPeriod = 1000 * Const::NanoSecsInMs;
+    static const ulong FollowPeriod = 100 * Const::NanoSecsInMs;
 
     Stdlib::RingBuffer<KeyEvent, Const::PageSize> Buf;
     char CmdLine[CmdSizeMax + 1];
     SpinLock Lock;
+    // the shell task sleeps here while no key is pending
+    WaitQueue KeyWaitQueue;
     Task *Task;
     bool Exit;
     bool Active;
@@ -0,0 +1,216 @@
+#include "completion.h"
+#include "panic.h"
+
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+CompletionCallback::CompletionCallback(Func func, void* ctx)
+    : Fn(func)
+    , Ctx(ctx)
+{
+    Link.Init();
+}
+
+Completion::Completion(long count)
+    : Pending(count)
+    , Done(count == 0)
+{
+    Callbacks.Init();
+}
+
+Completion::~Completion()
+{
+    WaitCompleting();
+    BugOn(!Callbacks.IsEmpty());
+}
+
+void Completion::Reset(long count)
+{
+    WaitCompleting();
+
+    Stdlib::AutoLock lock(Lock);
+    BugOn(!Callbacks.IsEmpty());
+    Pending.Set(count);
+    Failed.Set(0);
+    Done = (count == 0);
+}
+
+void Completion::Add(long count)
+{
+    BugOn(Done);
+    Pending.ReadAndAdd(count);
+}
+
+void Completion::Complete(bool ok)
+{
+    Completing.Inc();
+    if (!ok)
+        Failed.Inc();
+
+    if (Pending.DecAndTest())
+    {
+        Stdlib::ListEntry callbacks;
+        {
+            Stdlib::AutoLock lock(Lock);
+            Done = true;
+            callbacks.MoveTailList(&Callbacks);
+        }
+
+        bool result = IsOk();
+        while (!callbacks.IsEmpty())
+        {
+            auto callback = CONTAINING_RECORD(callbacks.RemoveHead(), CompletionCallback, Link);
+            callback->Link.Init();
+            callback->Fn(callback, result);
+        }
+
+        Waiters.WakeUpAll();
+    }
+
+    Completing.Dec();
+}
+
+bool Completion::IsDone()
+{
+    return Done;
+}
+
+bool Completion::IsOk()
+{
+    return (Failed.Get() == 0) ? true : false;
+}
+
+bool Completion::Wait()
+{
+    for (;;)
+    {
+        Waiters.Prepare();
+        if (Done)
+        {
+            Waiters.Finish();
+            break;
+        }
+        Waiters.Wait();
+    }
+
+    // the last completer may still be waking us up
+    WaitCompleting();
+    return IsOk();
+}
+
+void Completion::OnDone(CompletionCallback& callback)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (!Done)
+        {
+            Callbacks.InsertTail(&callback.Link);
+            return;
+        }
+    }
+
+    callback.Fn(&callback, IsOk());
+}
+
+bool Completion::RemoveCallback(CompletionCallback& callback)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (!Done)
+        {
+            callback.Link.RemoveInit();
+            return true;
+        }
+    }
+
+    // detached by the last Complete, which may still run it
+    WaitCompleting();
+    return false;
+}
+
+void Completion::CompleteNext(CompletionCallback* callback, bool ok)
+{
+    static_cast<Completion*>(callback->Ctx)->Complete(ok);
+}
+
+void Completion::Chain(CompletionCallback& link, Completion& next)
+{
+    link.Fn = &Completion::CompleteNext;
+    link.Ctx = &next;
+    OnDone(link);
+}
+
+void Completion::WaitCompleting()
+{
+    Completing.WaitUntil([](long value) { return value == 0; });
+}
+
+void Completion::WakeUpAny(CompletionCallback* callback, bool ok)
+{
+    (void)ok;
+
+    static_cast<WaitQueue*>(callback->Ctx)->WakeUpAll();
+}
+
+size_t Completion::WaitAny(Completion** completions, size_t count)
+{
+    BugOn(count == 0);
+
+    // one wait queue for all, each completion wakes it through a callback
+    const size_t maxCount = 16;
+    BugOn(count > maxCount);
+
+    WaitQueue waiters;
+    CompletionCallback callback[maxCount];
+    size_t index = count;
+    for (;;)
+    {
+        waiters.Prepare();
+        for (size_t i = 0; i < count && index == count; i++)
+        {
+            if (completions[i]->IsDone())
+                index = i;
+        }
+        if (index != count)
+        {
+            waiters.Finish();
+            break;
+        }
+
+        // registered after Prepare, a completion done meanwhile wakes us
+        for (size_t i = 0; i < count; i++)
+        {
+            if (callback[i].Fn == nullptr)
+            {
+                callback[i].Fn = &Completion::WakeUpAny;
+                callback[i].Ctx = &waiters;
+                completions[i]->OnDone(callback[i]);
+            }
+        }
+        waiters.Wait();
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (callback[i].Fn != nullptr)
+            completions[i]->RemoveCallback(callback[i]);
+    }
+
+    return index;
+}
+
+bool Completion::WaitAll(Completion** completions, size_t count)
+{
+    bool ok = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!completions[i]->Wait())
+            ok = false;
+    }
+
+    return ok;
+}
+
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/list_entry.h>
+
+#include "atomic.h"
+#include "spin_lock.h"
+#include "wait_queue.h"
+
+namespace Kernel
+{
+
+class Completion;
+
+// Callback of a Completion, owned by the caller until it ran or was removed
+struct CompletionCallback final
+{
+    using Func = void (*)(CompletionCallback* callback, bool ok);
+
+    CompletionCallback(Func func = nullptr, void* ctx = nullptr);
+
+    Func Fn;
+    void* Ctx;
+    Stdlib::ListEntry Link;
+
+private:
+    CompletionCallback(const CompletionCallback& other) = delete;
+    CompletionCallback(CompletionCallback&& other) = delete;
+    CompletionCallback& operator=(const CompletionCallback& other) = delete;
+    CompletionCallback& operator=(CompletionCallback&& other) = delete;
+};
+
+// Event that is done once Complete was called count times, from a task,
+// the work queue or an interrupt handler. The last Complete runs the
+// callbacks and wakes the waiting tasks; ok is false if any Complete
+// failed. Waiters and the destructor wait for a Complete that is still
+// waking them up, so a completion may live on the stack of its waiter.
+class Completion final
+{
+public:
+    explicit Completion(long count = 1);
+    ~Completion();
+
+    // starts over, nobody may wait or complete meanwhile
+    void Reset(long count = 1);
+
+    // count more Complete calls are needed, before it is done
+    void Add(long count = 1);
+
+    void Complete(bool ok = true);
+
+    bool IsDone();
+
+    // false if any Complete failed, meaningful once done
+    bool IsOk();
+
+    // blocks until done, returns IsOk
+    bool Wait();
+
+    // runs callback once done, in the context of the last Complete, or
+    // right here if it already is
+    void OnDone(CompletionCallback& callback);
+
+    // false if callback already ran, or was running and has returned
+    bool RemoveCallback(CompletionCallback& callback);
+
+    // completes next with the result once this is done, link is the
+    // callback storage
+    void Chain(CompletionCallback& link, Completion& next);
+
+    // blocks until one of them is done, returns its index
+    static size_t WaitAny(Completion** completions, size_t count);
+
+    // blocks until all of them are done, false if any failed
+    static bool WaitAll(Completion** completions, size_t count);
+
+private:
+    Completion(const Completion& other) = delete;
+    Completion(Completion&& other) = delete;
+    Completion& operator=(const Completion& other) = delete;
+    Completion& operator=(Completion&& other) = delete;
+
+    static void CompleteNext(CompletionCallback* callback, bool ok);
+    static void WakeUpAny(CompletionCallback* callback, bool ok);
+
+    // returns once no Complete runs anymore
+    void WaitCompleting();
+
+    FastSpinLock Lock;
+    Stdlib::ListEntry Callbacks;
+    Atomic Pending;
+    Atomic Failed;
+    // Complete calls that still touch the completion
+    Atomic Completing;
+    volatile bool Done;
+    WaitQueue Waiters;
+};
+
+// Value set once by a producer, read by tasks after waiting for it
+template<typename T>
+class Future final
+{
+public:
+    Future()
+        : Value()
+    {
+    }
+
+    ~Future()
+    {
+    }
+
+    void Set(const T& value, bool ok = true)
+    {
+        Value = value;
+        Done.Complete(ok);
+    }
+
+    // the value, after it's set
+    T& Get()
+    {
+        Done.Wait();
+        return Value;
+    }
+
+    bool IsReady()
+    {
+        return Done.IsDone();
+    }
+
+    bool IsOk()
+    {
+        return Done.IsOk();
+    }
+
+    // for OnDone, Chain and WaitAny
+    Completion& GetCompletion()
+    {
+        return Done;
+    }
+
+private:
+    Future(const Future& other) = delete;
+    Future(Future&& other) = delete;
+    Future& operator=(const Future& other) = delete;
+    Future& operator=(Future&& other) = delete;
+
+    T Value;
+    Completion Done;
+};
+
+}
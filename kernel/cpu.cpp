@@ -3,20 +3,62 @@
 #include "trace.h"
 #include "watchdog.h"
 #include "timer.h"
+#include "preempt.h"
+#include "time.h"
+#include "parameters.h"
+#include "rcu.h"
+#include "trace_buffer.h"
+#include "interrupt.h"
 
 #include <boot/boot64.h>
 
 #include <drivers/lapic.h>
-#include <drivers/pit.h>
+#include <drivers/acpi.h>
+
+#include <mm/page_allocator.h>
 
 namespace Kernel
 {
 
+CpuCall::CpuCall()
+    : Next(nullptr)
+    , Func(nullptr)
+    , Ctx(nullptr)
+{
+}
+
+static inline void Monitor(const void* addr)
+{
+    asm volatile ("monitor" : : "a"(addr), "c"(0UL), "d"(0UL));
+}
+
+// sti takes effect after the next instruction, so an interrupt that
+// arrives meanwhile still ends the mwait
+static inline void StiMwait()
+{
+    asm volatile ("sti; mwait" : : "a"(0UL), "c"(0UL) : "memory");
+}
+
+CpuTopology::CpuTopology()
+    : Valid(false)
+    , ApicId(0)
+    , CoreId(0)
+    , LlcId(0)
+    , PackageId(0)
+{
+}
+
 Cpu::Cpu()
     : Index(0)
     , State(0)
+    , IdleMode(Parameters::IdleHlt)
     , Task(nullptr)
+    , TaskQueue(this)
+    , Stack(nullptr)
+    , WakeLine(WakeIdleRunning)
 {
+    Stdlib::MemSet(&PerCpu, 0, sizeof(PerCpu));
+    Stdlib::MemSet(&IrqStats, 0, sizeof(IrqStats));
 }
 
 ulong Cpu::GetIndex()
@@ -26,44 +68,145 @@ ulong Cpu::GetIndex()
 
 void Cpu::Idle()
 {
-    if (BugOn(!(State & StateRunning)))
+    if (BugOn(!(State.Load(MemoryOrderRelaxed) & StateRunning)))
         return;
 
     if (BugOn(!IsInterruptEnabled()))
         return;
 
+    if (PreemptIsOn() && TaskQueue.Steal())
+    {
+        Schedule();
+        return;
+    }
+
+    Rcu::GetInstance().QuiescentState();
+
+    // spare cycles go to zeroing pages, the caller loops back here
+    if (Mm::PageAllocatorImpl::GetInstance().FillZeroPool())
+        return;
+
+    switch (IdleMode)
+    {
+    case Parameters::IdlePoll:
+        IdlePoll();
+        break;
+    case Parameters::IdleMwait:
+        IdleMwait();
+        break;
+    default:
+        IdleHlt();
+        break;
+    }
+}
+
+void Cpu::IdleHlt()
+{
+    InterruptDisable();
+    UpdateTick();
+    InterruptEnable();
+
     Hlt();
 }
 
+void Cpu::IdlePoll()
+{
+    InterruptDisable();
+    UpdateTick();
+    WakeLine.Store(WakeIdleWatching);
+    InterruptEnable();
+
+    // the tick and other IPIs end the poll like they end hlt
+    ulong ipiCounter = PerCpu.IPICounter;
+    while (WakeLine.Load(MemoryOrderAcquire) == WakeIdleWatching &&
+        *static_cast<volatile ulong*>(&PerCpu.IPICounter) == ipiCounter)
+    {
+        Pause();
+    }
+
+    IdleWoken();
+}
+
+void Cpu::IdleMwait()
+{
+    InterruptDisable();
+    UpdateTick();
+    WakeLine.Store(WakeIdleWatching);
+    Monitor(&WakeLine);
+    // a wake that came before the monitor was armed is seen here
+    if (WakeLine.Load(MemoryOrderAcquire) == WakeIdleWatching)
+        StiMwait();
+    else
+        InterruptEnable();
+
+    IdleWoken();
+}
+
+void Cpu::IdleWoken()
+{
+    if (WakeLine.Exchange(WakeIdleRunning) != WakeIdleWoken)
+        return;
+
+    InterruptDisable();
+    UpdateTick();
+    InterruptEnable();
+
+    Schedule();
+}
+
+bool Cpu::WakeIdle()
+{
+    ulong expected = WakeIdleWatching;
+    if (WakeLine.CompareExchange(expected, WakeIdleWoken))
+        return true;
+
+    // already woken by another cpu and not yet running
+    return (expected == WakeIdleWoken) ? true : false;
+}
+
 ulong Cpu::GetState()
 {
-    Stdlib::AutoLock lock(Lock);
-    return State;
+    // writers serialize on the lock, readers poll without touching it
+    return State.Load(MemoryOrderAcquire);
 }
 
 void Cpu::SetRunning()
 {
     Stdlib::AutoLock lock(Lock);
-    if (BugOn(State & StateRunning))
+    if (BugOn(State.Load(MemoryOrderRelaxed) & StateRunning))
         return;
 
-    State |= StateRunning;
+    State.FetchOr(StateRunning, MemoryOrderRelease);
+    CpuTable::GetInstance().SetCpuRunning(Index);
 }
 
 void Cpu::SetExiting()
 {
     Stdlib::AutoLock lock(Lock);
-    State |= StateExiting;
+    State.FetchOr(StateExiting, MemoryOrderRelease);
 }
 
 void Cpu::Init(ulong index)
 {
     Stdlib::AutoLock lock(Lock);
-    if (BugOn(State & StateInited))
+    if (BugOn(State.Load(MemoryOrderRelaxed) & StateInited))
         return;
 
     Index = index;
-    State |= StateInited;
+
+    IdleMode = Parameters::GetInstance().GetIdleMode();
+    if (IdleMode == Parameters::IdleMwait)
+    {
+        u32 eax, ebx, ecx, edx;
+        Cpuid(1, &eax, &ebx, &ecx, &edx);
+        if (!(ecx & CpuidMonitor))
+        {
+            Trace(0, "Cpu %u no monitor/mwait, idle with hlt", index);
+            IdleMode = Parameters::IdleHlt;
+        }
+    }
+
+    State.FetchOr(StateInited, MemoryOrderRelease);
 
     Trace(0, "Cpu 0x%p %u inited", this, Index);
 }
@@ -77,15 +220,133 @@ Cpu::~Cpu()
         Task->Put();
         Task = nullptr;
     }
+
+    if (Stack != nullptr)
+    {
+        Mm::PageAllocatorImpl::GetInstance().Free(Stack);
+        Stack = nullptr;
+    }
+}
+
+bool Cpu::AllocStack()
+{
+    if (Stack == nullptr)
+        Stack = Mm::PageAllocatorImpl::GetInstance().Alloc(StackSize / Const::PageSize);
+
+    return (Stack != nullptr) ? true : false;
+}
+
+ulong Cpu::GetStackTop()
+{
+    BugOn(Stack == nullptr);
+    return reinterpret_cast<ulong>(Stack) + StackSize;
+}
+
+void Cpu::DetectTopology(CpuTopology& topo)
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+    u32 maxLeaf = eax;
+    Cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    u32 maxExtLeaf = eax;
+
+    ulong smtShift = 0;
+    ulong packageShift = 0;
+    bool found = false;
+
+    // 0x1F adds module, tile and die levels to 0xB, both end at the core
+    // level whose shift gives the package
+    u32 leaves[] = { 0x1F, 0xB };
+    for (size_t i = 0; i < Stdlib::ArraySize(leaves) && !found; i++)
+    {
+        if (maxLeaf < leaves[i])
+            continue;
+
+        for (u32 subleaf = 0; subleaf < 8; subleaf++)
+        {
+            CpuidCount(leaves[i], subleaf, &eax, &ebx, &ecx, &edx);
+            u32 type = (ecx >> 8) & 0xFF;
+            if (type == 0 || (ebx & 0xFFFF) == 0)
+                break;
+
+            if (type == TopologyLevelSmt)
+                smtShift = eax & 0x1F;
+            packageShift = eax & 0x1F;
+            topo.ApicId = edx;
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        // no topology leaves, every logical cpu of the package is a core
+        Cpuid(1, &eax, &ebx, &ecx, &edx);
+        ulong count = (edx & CpuidHtt) ? ((ebx >> 16) & 0xFF) : 1;
+        packageShift = Stdlib::Log2(count);
+        topo.ApicId = ebx >> 24;
+    }
+
+    // the highest cache level reported, intel leaf 4 or amd 0x8000001D
+    ulong llcShift = packageShift;
+    u32 llcLevel = 0;
+    u32 cacheLeaves[] = { 4, 0x8000001D };
+    for (size_t i = 0; i < Stdlib::ArraySize(cacheLeaves) && llcLevel == 0; i++)
+    {
+        u32 max = (cacheLeaves[i] & 0x80000000) ? maxExtLeaf : maxLeaf;
+        if (max < cacheLeaves[i])
+            continue;
+
+        for (u32 subleaf = 0; subleaf < 16; subleaf++)
+        {
+            CpuidCount(cacheLeaves[i], subleaf, &eax, &ebx, &ecx, &edx);
+            if ((eax & 0x1F) == 0)
+                break;
+
+            u32 level = (eax >> 5) & 0x7;
+            if (level >= llcLevel)
+            {
+                llcLevel = level;
+                llcShift = Stdlib::Log2(((eax >> 14) & 0xFFF) + 1);
+            }
+        }
+    }
+
+    if (llcShift > packageShift)
+        llcShift = packageShift;
+
+    topo.CoreId = topo.ApicId >> smtShift;
+    topo.LlcId = topo.ApicId >> llcShift;
+    topo.PackageId = topo.ApicId >> packageShift;
+    topo.Valid = true;
+
+    Trace(0, "Cpu %u apic %u core %u llc %u package %u",
+        Index, topo.ApicId, topo.CoreId, topo.LlcId, topo.PackageId);
+}
+
+bool Cpu::IsIdle()
+{
+    return (GetRunningTask() == Task && TaskQueue.GetReadyCount() == 0) ? true : false;
 }
 
 CpuTable::CpuTable()
-    : BspIndex(0)
+    : CpuLimit(0)
+    , BspIndex(0)
 {
+    for (ulong i = 0; i < Stdlib::ArraySize(CpuArray); i++)
+        CpuArray[i] = nullptr;
 }
 
 CpuTable::~CpuTable()
 {
+    for (ulong i = 0; i < Stdlib::ArraySize(CpuArray); i++)
+    {
+        if (CpuArray[i] != nullptr)
+        {
+            delete CpuArray[i];
+            CpuArray[i] = nullptr;
+        }
+    }
 }
 
 bool CpuTable::InsertCpu(ulong index)
@@ -94,24 +355,64 @@ bool CpuTable::InsertCpu(ulong index)
     if (index >= Stdlib::ArraySize(CpuArray))
         return false;
 
-    auto& cpu = CpuArray[index];
-    if (cpu.GetState() & Cpu::StateInited)
+    if (PresentMask.Test(index))
         return false;
 
-    cpu.Init(index);
+    PresentMask.Set(index);
+    if (index >= CpuLimit)
+        CpuLimit = index + 1;
+    return true;
+}
+
+bool CpuTable::Setup()
+{
+    Stdlib::AutoLock lock(Lock);
+
+    for (ulong i = PresentMask.First(); i < MaxCpus; i = PresentMask.Next(i + 1))
+    {
+        if (CpuArray[i] != nullptr)
+            continue;
+
+        Cpu* cpu = new Cpu();
+        if (cpu == nullptr)
+            return false;
+
+        cpu->Init(i);
+        CpuArray[i] = cpu;
+
+        if (!TraceBuffer::GetInstance().SetupCpu(i))
+            return false;
+    }
+
+    Trace(0, "Cpus present %u limit %u", PresentMask.Count(), CpuLimit);
     return true;
 }
 
 Cpu& CpuTable::GetCpu(ulong index)
 {
     BugOn(index >= Stdlib::ArraySize(CpuArray));
-    Cpu& cpu = CpuArray[index];
+    BugOn(CpuArray[index] == nullptr);
+    Cpu& cpu = *CpuArray[index];
     return cpu;
 }
 
+Cpu* CpuTable::FindCpu(ulong index)
+{
+    if (index >= Stdlib::ArraySize(CpuArray))
+        return nullptr;
+
+    return CpuArray[index];
+}
+
+ulong CpuTable::GetCpuLimit()
+{
+    Stdlib::SharedAutoLock lock(Lock);
+    return CpuLimit;
+}
+
 ulong CpuTable::GetBspIndex()
 {
-    Stdlib::AutoLock lock(Lock);
+    Stdlib::SharedAutoLock lock(Lock);
     return GetBspIndexLockHeld();
 }
 
@@ -127,7 +428,10 @@ bool CpuTable::SetBspIndex(ulong index)
     if (BugOn(index >= Stdlib::ArraySize(CpuArray)))
         return false;
 
-    auto& cpu = CpuArray[BspIndex];
+    if (BugOn(CpuArray[index] == nullptr))
+        return false;
+
+    auto& cpu = *CpuArray[index];
     if (BugOn(!(cpu.GetState() & Cpu::StateInited)))
         return false;
 
@@ -136,9 +440,39 @@ bool CpuTable::SetBspIndex(ulong index)
     return true;
 }
 
+bool CpuTable::NeedInitDelay()
+{
+    u32 eax, ebx, ecx, edx;
+
+    // only pre-P6 cpus need 10ms between INIT and SIPI, virtual ones never do
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (ecx & CpuidHypervisor)
+        return false;
+
+    return (((eax >> 8) & 0xF) < 6) ? true : false;
+}
+
+bool CpuTable::WaitCpus(AtomicCpuMask& mask, const CpuMask& target, ulong timeout)
+{
+    Stdlib::Time expired = GetBootTime() + Stdlib::Time(timeout);
+    for (;;)
+    {
+        CpuMask reached = mask.Get();
+        reached &= target;
+        if (reached == target)
+            return true;
+
+        if (GetBootTime() >= expired)
+            return false;
+
+        Pause();
+    }
+}
+
 bool CpuTable::StartAll()
 {
     ulong startupCode = (ulong)ApStart16;
+    auto start = GetBootTime();
 
     Trace(0, "Starting cpus, startupCode 0x%p", startupCode);
 
@@ -148,109 +482,408 @@ bool CpuTable::StartAll()
     if (startupCode >= 0x100000)
         return false;
 
+    CpuMask apMask;
     {
         Stdlib::AutoLock lock(Lock);
-        for (ulong index = 0; index < Stdlib::ArraySize(CpuArray); index++)
+        apMask = PresentMask;
+        apMask.Reset(GetBspIndexLockHeld());
+    }
+
+    for (ulong index = apMask.First(); index < MaxCpus; index = apMask.Next(index + 1))
+    {
+        // ApMain switches to it right away
+        if (!CpuArray[index]->AllocStack())
         {
-            if (index != GetBspIndexLockHeld() && (CpuArray[index].GetState() & Cpu::StateInited))
-            {
-                Lapic::SendInit(index);
-            }
+            Trace(0, "Can't allocate cpu %u stack", index);
+            return false;
         }
     }
 
-    Pit::GetInstance().Wait(10 * Const::NanoSecsInMs); // 10ms
+    for (ulong index = apMask.First(); index < MaxCpus; index = apMask.Next(index + 1))
+        Lapic::SendInit(index);
 
+    if (NeedInitDelay())
+        Delay(InitDelay);
+
+    for (ulong index = apMask.First(); index < MaxCpus; index = apMask.Next(index + 1))
+        Lapic::SendStartup(index, startupCode >> Const::PageShift);
+
+    // the second SIPI goes only to cpus which didn't report in
+    if (!WaitCpus(AliveMask, apMask, SipiRetryDelay))
     {
-        Stdlib::AutoLock lock(Lock);
-        for (ulong index = 0; index < Stdlib::ArraySize(CpuArray); index++)
+        for (ulong index = apMask.First(); index < MaxCpus; index = apMask.Next(index + 1))
         {
-            if (index != GetBspIndexLockHeld() && (CpuArray[index].GetState() & Cpu::StateInited))
-            {
+            if (!AliveMask.Test(index))
                 Lapic::SendStartup(index, startupCode >> Const::PageShift);
-            }
         }
     }
 
-    Pit::GetInstance().Wait(100 * Const::NanoSecsInMs); // 100ms
-
+    // APs do their init in parallel, continue once the last one runs
+    if (!WaitCpus(AliveMask, apMask, StartTimeout) ||
+        !WaitCpus(RunningMask, apMask, StartTimeout))
     {
-        Stdlib::AutoLock lock(Lock);
-        for (ulong index = 0; index < Stdlib::ArraySize(CpuArray); index++)
+        for (ulong index = apMask.First(); index < MaxCpus; index = apMask.Next(index + 1))
         {
-            if (index != GetBspIndexLockHeld() && (CpuArray[index].GetState() & Cpu::StateInited))
-            {
-                if (!(CpuArray[index].GetState() & Cpu::StateRunning))
-                {
-                    Trace(0, "Cpu %u still not running", index);
-                    return false;
-                }
-            }
+            if (!RunningMask.Test(index))
+                Trace(0, "Cpu %u still not running, alive %u", index, (ulong)AliveMask.Test(index));
         }
+        return false;
     }
 
-    Trace(0, "Cpus started");
+    auto elapsed = GetBootTime() - start;
+    Trace(0, "Cpus started %u in %u.%u", apMask.Count(), elapsed.GetSecs(), elapsed.GetUsecs());
 
     return true;
 }
 
+void CpuTable::SetCpuAlive(ulong index)
+{
+    AliveMask.Set(index);
+}
+
 ulong CpuTable::GetCurrentCpuId()
 {
+    // every running cpu has loaded its per-cpu area before preemption is on
+    if (likely(PreemptIsOn()))
+        return GetPerCpuIndex();
+
     return Lapic::GetApicId();
 }
 
 Cpu& CpuTable::GetCurrentCpu()
 {
-    return GetCpu(GetCurrentCpuId());
+    if (likely(PreemptIsOn()))
+        return *GetPerCpuCpu();
+
+    return GetCpu(Lapic::GetApicId());
 }
 
 void CpuTable::ExitAllExceptSelf()
 {
     auto& self = GetCurrentCpu();
 
-    ulong cpuMask = GetRunningCpus();
-    for (ulong i = 0; i < 8 * sizeof(ulong); i++)
+    CpuMask cpuMask = GetRunningCpus();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
     {
-        if ((cpuMask & ((ulong)1 << i)) && (i != self.GetIndex()))
+        if (i == self.GetIndex())
+            continue;
+
+        auto& cpu = GetCpu(i);
+        cpu.SetExiting();
+
+        SpinBackoff backoff;
+        while (!(cpu.GetState() & Cpu::StateExited))
         {
-            auto& cpu = GetCpu(i);
-            cpu.SetExiting();
+            SendIPI(i, StopVector);
+            backoff.Pause();
+        }
+    }
+}
+
+bool CpuTable::CanBroadcast()
+{
+    // PresentMask is only written before the APs are started
+    return (PresentMask == RunningMask.Get()) ? true : false;
+}
+
+void CpuTable::SendIPIAllExclude(ulong excludeIndex, u8 vector)
+{
+    if (excludeIndex == GetCurrentCpuId() && CanBroadcast())
+    {
+        Lapic::SendIPIAllExcludingSelf(vector);
+        return;
+    }
+
+    CpuMask cpuMask = GetRunningCpus();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+    {
+        if (i != excludeIndex)
+            Lapic::SendIPI(i, vector);
+    }
+}
+
+void CpuTable::SendIPIAll(u8 vector)
+{
+    if (CanBroadcast())
+    {
+        Lapic::SendIPIAllIncludingSelf(vector);
+        return;
+    }
+
+    CpuMask cpuMask = GetRunningCpus();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+        Lapic::SendIPI(i, vector);
+}
+
+void CpuTable::WaitCall(CpuCall& call)
+{
+    // the target may be waiting for our own queue, so keep draining it
+    auto& self = GetCurrentCpu();
+    while (call.Done.Get() == 0)
+    {
+        self.ProcessCalls();
+        Pause();
+    }
+}
+
+bool CpuTable::CallFunction(ulong index, CpuCallFunc func, void* ctx)
+{
+    if (BugOn(index >= MaxCpus))
+        return false;
+
+    PreemptDisable();
+    if (index == GetCurrentCpuId())
+    {
+        func(ctx);
+        PreemptEnable();
+        return true;
+    }
+
+    if (!IsCpuRunning(index))
+    {
+        PreemptEnable();
+        return false;
+    }
 
-            while (!(cpu.GetState() & Cpu::StateExited))
+    CpuCall call;
+    call.Func = func;
+    call.Ctx = ctx;
+    if (CpuArray[index]->QueueCall(&call))
+        Lapic::SendIPI(index, CallVector);
+
+    WaitCall(call);
+    PreemptEnable();
+    return true;
+}
+
+void CpuTable::CallFunctionAllExcludeSelf(CpuCallFunc func, void* ctx)
+{
+    CpuCall call[CallBatch];
+
+    PreemptDisable();
+    CpuMask cpuMask = GetRunningCpus();
+    cpuMask.Reset(GetCurrentCpuId());
+    // a single shorthand IPI covers everyone when the targets fit one batch
+    bool broadcast = (cpuMask.Count() <= CallBatch && CanBroadcast());
+    ulong next = cpuMask.First();
+    while (next < MaxCpus)
+    {
+        size_t count = 0;
+        bool ipi = false;
+        for (; next < MaxCpus && count < CallBatch; next = cpuMask.Next(next + 1))
+        {
+            CpuCall& entry = call[count];
+            entry.Func = func;
+            entry.Ctx = ctx;
+            entry.Done.Set(0);
+            count++;
+            if (CpuArray[next]->QueueCall(&entry))
             {
-                cpu.SendIPISelf();
-                Pause();
+                ipi = true;
+                if (!broadcast)
+                    Lapic::SendIPI(next, CallVector);
             }
         }
+
+        if (ipi && broadcast)
+            Lapic::SendIPIAllExcludingSelf(CallVector);
+
+        for (size_t i = 0; i < count; i++)
+            WaitCall(call[i]);
     }
+    PreemptEnable();
 }
 
-void CpuTable::SendIPIAllExclude(ulong excludeIndex)
+void CpuTable::SetTopology(ulong index, const CpuTopology& topo)
 {
-    ulong cpuMask = GetRunningCpus();
-    for (ulong i = 0; i < 8 * sizeof(ulong); i++)
+    if (BugOn(index >= MaxCpus))
+        return;
+
+    Stdlib::AutoLock lock(Lock);
+
+    Topology[index] = topo;
+    CoreCpus[index].Set(index);
+    LlcCpus[index].Set(index);
+    PackageCpus[index].Set(index);
+
+    for (ulong i = 0; i < MaxCpus; i++)
     {
-        if ((cpuMask & ((ulong)1 << i)) && (i != excludeIndex))
+        auto& other = Topology[i];
+        if (i == index || !other.Valid)
+            continue;
+
+        if (other.CoreId == topo.CoreId)
+        {
+            CoreCpus[index].Set(i);
+            CoreCpus[i].Set(index);
+        }
+
+        if (other.LlcId == topo.LlcId)
         {
-            auto& cpu = GetCpu(i);
+            LlcCpus[index].Set(i);
+            LlcCpus[i].Set(index);
+        }
 
-            cpu.SendIPISelf();
+        if (other.PackageId == topo.PackageId)
+        {
+            PackageCpus[index].Set(i);
+            PackageCpus[i].Set(index);
         }
     }
 }
 
-void CpuTable::SendIPIAll()
+const CpuMask& CpuTable::GetCoreCpus(ulong index)
+{
+    BugOn(index >= MaxCpus);
+    return CoreCpus[index];
+}
+
+const CpuMask& CpuTable::GetLlcCpus(ulong index)
+{
+    BugOn(index >= MaxCpus);
+    return LlcCpus[index];
+}
+
+const CpuMask& CpuTable::GetPackageCpus(ulong index)
+{
+    BugOn(index >= MaxCpus);
+    return PackageCpus[index];
+}
+
+ulong CpuTable::FindIdleCpu(const CpuMask& domain, bool wholeCore)
 {
-    ulong cpuMask = GetRunningCpus();
-    for (ulong i = 0; i < 8 * sizeof(ulong); i++)
+    for (ulong i = domain.First(); i < MaxCpus; i = domain.Next(i + 1))
     {
-        if ((cpuMask & ((ulong)1 << i)))
+        if (!CpuArray[i]->IsIdle())
+            continue;
+
+        if (!wholeCore)
+            return i;
+
+        // an idle sibling shares its core with a busy one
+        bool coreIdle = true;
+        const CpuMask& core = CoreCpus[i];
+        for (ulong j = core.First(); j < MaxCpus; j = core.Next(j + 1))
         {
-            auto& cpu = GetCpu(i);
+            if (j != i && IsCpuRunning(j) && !CpuArray[j]->IsIdle())
+            {
+                coreIdle = false;
+                break;
+            }
+        }
+
+        if (coreIdle)
+            return i;
+    }
 
-            cpu.SendIPISelf();
+    return MaxCpus;
+}
+
+ulong CpuTable::GetDistance(ulong from, ulong to)
+{
+    if (from == to)
+        return 0;
+    if (CoreCpus[from].Test(to))
+        return 1;
+    if (LlcCpus[from].Test(to))
+        return 2;
+    if (PackageCpus[from].Test(to))
+        return 3;
+    return 4;
+}
+
+ulong CpuTable::SelectCpu(ulong prev, const CpuMask& allowed)
+{
+    if (allowed.IsEmpty())
+        return MaxCpus;
+
+    if (prev >= MaxCpus)
+        prev = allowed.First();
+
+    if (allowed.Test(prev) && CpuArray[prev]->IsIdle())
+        return prev;
+
+    // closest domain first, a whole idle core beats an idle sibling
+    const CpuMask* domains[] = { &LlcCpus[prev], &PackageCpus[prev], &allowed };
+    for (size_t i = 0; i < Stdlib::ArraySize(domains); i++)
+    {
+        CpuMask domain = *domains[i];
+        domain &= allowed;
+
+        ulong cpu = FindIdleCpu(domain, true);
+        if (cpu < MaxCpus)
+            return cpu;
+
+        cpu = FindIdleCpu(domain, false);
+        if (cpu < MaxCpus)
+            return cpu;
+    }
+
+    ulong best = MaxCpus;
+    long bestCount = 0;
+    ulong bestDistance = 0;
+    for (ulong i = allowed.First(); i < MaxCpus; i = allowed.Next(i + 1))
+    {
+        long count = CpuArray[i]->GetTaskQueue().GetTaskCount();
+        ulong distance = GetDistance(prev, i);
+        if (best == MaxCpus || count < bestCount ||
+            (count == bestCount && distance < bestDistance))
+        {
+            best = i;
+            bestCount = count;
+            bestDistance = distance;
         }
     }
+
+    return best;
+}
+
+void CpuTable::DumpTopology(Stdlib::Printer& printer)
+{
+    CpuMask running = GetRunningCpus();
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+    {
+        auto& topo = Topology[i];
+        printer.Printf("cpu %u apic %u core %u llc %u package %u\n",
+            i, topo.ApicId, topo.CoreId, topo.LlcId, topo.PackageId);
+    }
+}
+
+bool Cpu::QueueCall(CpuCall* call)
+{
+    for (;;)
+    {
+        long head = CallQueue.Get();
+        call->Next = reinterpret_cast<CpuCall*>(head);
+        if (CallQueue.Cmpxchg(reinterpret_cast<long>(call), head) == head)
+            return (head == 0) ? true : false;
+    }
+}
+
+void Cpu::ProcessCalls()
+{
+    CpuCall* list = reinterpret_cast<CpuCall*>(CallQueue.Xchg(0));
+    if (list == nullptr)
+        return;
+
+    // pushed as a stack, run in queueing order
+    CpuCall* prev = nullptr;
+    while (list != nullptr)
+    {
+        CpuCall* next = list->Next;
+        list->Next = prev;
+        prev = list;
+        list = next;
+    }
+
+    while (prev != nullptr)
+    {
+        // the caller may reuse the entry as soon as Done is set
+        CpuCall* next = prev->Next;
+        prev->Func(prev->Ctx);
+        prev->Done.Set(1);
+        prev = next;
+    }
 }
 
 void Cpu::OnPanic()
@@ -262,11 +895,8 @@ void Cpu::OnPanic()
     }
 }
 
-void Cpu::IPI(Context* ctx)
+void Cpu::CheckStop()
 {
-    (void)ctx;
-    IPIConter.Inc();
-
     if (Panicker::GetInstance().IsActive())
     {
         OnPanic();
@@ -276,34 +906,177 @@ void Cpu::IPI(Context* ctx)
     bool exit;
     {
         Stdlib::AutoLock lock(Lock);
-        exit = (State & StateExiting) ? true : false;
+        exit = (State.Load(MemoryOrderRelaxed) & StateExiting) ? true : false;
         if (exit)
-            State |= StateExited;
+            State.FetchOr(StateExited, MemoryOrderRelease);
     }
 
     if (exit)
     {
         Trace(0, "Cpu %u exited, state 0x%p, IPI count %u",
-            Index, State, IPIConter.Get());
+            Index, State.Load(MemoryOrderRelaxed), PerCpu.IPICounter);
 
         InterruptDisable();
         for (;;)
         {
             Pause();
         }
+    }
+}
+
+void Cpu::IPI(IrqContext* ctx)
+{
+    (void)ctx;
+    PerCpu.IPICounter++;
+
+    CheckStop();
+
+    {
+        InterruptTime irqTime(CpuTable::IPIVector);
+
+        TimerWheel.Process(GetBootTime());
+        if (Index == TimerTable::TimerCpuIndex)
+        {
+            Rcu::GetInstance().Tick();
+            Watchdog::GetInstance().Check();
+        }
+
+        if (PreemptIsOn())
+            TaskQueue.Tick(Task::GetCurrentTask());
+
+        UpdateTick();
+
+        Lapic::EOI(CpuTable::IPIVector);
+    }
+
+    // a tick that doesn't switch still ends the read sections on this cpu
+    if (PreemptIsOn() && GetPerCpuPreemptCount() == 0 && !PerCpuNeedResched())
+        Rcu::GetInstance().QuiescentState();
+
+    PreemptIrqExit();
+}
+
+void Cpu::ReschedIPI(IrqContext* ctx)
+{
+    (void)ctx;
+    PerCpu.IPICounter++;
+
+    {
+        InterruptTime irqTime(CpuTable::ReschedVector);
+
+        // a halted cpu may have its tick stopped, rearm it for the new work
+        UpdateTick();
+
+        Lapic::EOI(CpuTable::ReschedVector);
+    }
+
+    // a remote wakeup or an rcu kick, either way the scheduler runs
+    PerCpuSetNeedResched();
+    PreemptIrqExit();
+}
+
+void Cpu::CallIPI(IrqContext* ctx)
+{
+    (void)ctx;
+    PerCpu.IPICounter++;
+
+    {
+        InterruptTime irqTime(CpuTable::CallVector);
+
+        ProcessCalls();
+
+        Lapic::EOI(CpuTable::CallVector);
+    }
+
+    PreemptIrqExit();
+}
+
+void Cpu::StopIPI(IrqContext* ctx)
+{
+    (void)ctx;
+    PerCpu.IPICounter++;
+
+    CheckStop();
+
+    Lapic::EOI(CpuTable::StopVector);
+}
+
+void Cpu::UpdateTick()
+{
+    // busy cpu ticks periodically, idle one only wakes up for timers
+    bool busy = Parameters::GetInstance().IsTickPeriodic() ||
+        (TaskQueue.GetReadyCount() != 0) || (Task::GetCurrentTask() != Task) ||
+        (Index == TimerTable::TimerCpuIndex && Rcu::GetInstance().HasPending());
+    auto now = GetBootTime();
+    Stdlib::Time expired = now + TickPeriod;
+    bool arm = busy;
+
+    Stdlib::Time timerExpired;
+    if (TimerWheel.GetNextExpiry(timerExpired))
+    {
+        if (!arm || timerExpired < expired)
+            expired = timerExpired;
+        arm = true;
+    }
+    TimerWheel.SetArmedExpiry((arm) ? expired : Stdlib::Time(~((ulong)0)));
+
+    if (!arm)
+    {
+        Lapic::StopTimer();
         return;
     }
 
-    Watchdog::GetInstance().Check();
+    auto delta = expired - now;
+    if (delta < TickMin)
+        delta = TickMin;
+
+    Lapic::SetTimer(CpuTable::IPIVector, delta.GetValue());
+}
+
+void Cpu::GetStats(CpuStats& stats)
+{
+    auto& tsc = TscClock::GetInstance();
+    u64 idleTicks = 0;
+    u64 busyTicks = 0;
 
-    if (Index == 0)
+    // ticks of the running task are charged on its next switch, so only
+    // the idle task is extrapolated
+    if (Task != nullptr)
     {
-        TimerTable::GetInstance().ProcessTimers();
+        Stdlib::AutoLock lock(Task->Lock);
+        u64 runTicks = PerCpu.RunTicks;
+        idleTicks = Task->RuntimeTsc;
+        busyTicks = (runTicks > idleTicks) ? (runTicks - idleTicks) : 0;
+        if (Task->State.Get() == Task::StateRunning)
+            idleTicks += ReadTsc() - Task->RunStartTsc;
     }
 
-    Lapic::EOI(CpuTable::IPIVector);
+    stats.IdleTime = tsc.TicksToTime(idleTicks);
+    stats.BusyTime = tsc.TicksToTime(busyTicks);
+    stats.IrqTime = tsc.TicksToTime(PerCpu.IrqTicks);
+    stats.IrqCount = PerCpu.IrqCounter;
+
+    stats.ScheduleCount = TaskQueue.GetScheduleCounter();
+    stats.SwitchCount = TaskQueue.GetSwitchContextCounter();
+    stats.MigrateInCount = TaskQueue.GetMigrateInCounter();
+    stats.MigrateOutCount = TaskQueue.GetMigrateOutCounter();
+    stats.ReadyCount = TaskQueue.GetReadyCount();
+    stats.TaskCount = TaskQueue.GetTaskCount();
+}
 
-    Schedule();
+InterruptStats& Cpu::GetIrqStats()
+{
+    return IrqStats;
+}
+
+KvmCpuArea& Cpu::GetKvmArea()
+{
+    return KvmArea;
+}
+
+Task* Cpu::GetRunningTask()
+{
+    return *static_cast<class Task* volatile*>(&PerCpu.Task);
 }
 
 TaskQueue& Cpu::GetTaskQueue()
@@ -311,60 +1084,115 @@ TaskQueue& Cpu::GetTaskQueue()
     return TaskQueue;
 }
 
-extern "C" void IPInterrupt(Context* ctx)
+TimerWheel& Cpu::GetTimerWheel()
+{
+    return TimerWheel;
+}
+
+extern "C" void IPInterrupt(IrqContext* ctx)
 {
     auto& cpu = CpuTable::GetInstance().GetCurrentCpu();
     cpu.IPI(ctx);
 }
 
-void Cpu::SendIPISelf()
+extern "C" void ReschedInterrupt(IrqContext* ctx)
 {
-    Stdlib::AutoLock lock(Lock);
+    auto& cpu = CpuTable::GetInstance().GetCurrentCpu();
+    cpu.ReschedIPI(ctx);
+}
+
+extern "C" void CallInterrupt(IrqContext* ctx)
+{
+    auto& cpu = CpuTable::GetInstance().GetCurrentCpu();
+    cpu.CallIPI(ctx);
+}
+
+extern "C" void StopInterrupt(IrqContext* ctx)
+{
+    auto& cpu = CpuTable::GetInstance().GetCurrentCpu();
+    cpu.StopIPI(ctx);
+}
 
-    if (BugOn(!(State & Cpu::StateRunning)))
+void CpuTable::SendIPI(ulong index, u8 vector)
+{
+    if (BugOn(index >= Stdlib::ArraySize(CpuArray)))
         return;
 
-    if (State & Cpu::StateExited)
+    // an exited cpu spins with interrupts disabled, so no state check
+    if (BugOn(!IsCpuRunning(index)))
         return;
 
-    Lapic::SendIPI(Index, CpuTable::IPIVector);
+    Lapic::SendIPI(index, vector);
 }
 
-void CpuTable::SendIPI(ulong index)
+CpuMask CpuTable::GetRunningCpus()
 {
-    Stdlib::AutoLock lock(Lock);
+    return RunningMask.Get();
+}
 
-    if (BugOn(index >= Stdlib::ArraySize(CpuArray)))
-        return;
+bool CpuTable::IsCpuRunning(ulong index)
+{
+    return RunningMask.Test(index);
+}
 
-    auto& cpu = CpuArray[index];
-    cpu.SendIPISelf();
+void CpuTable::SetCpuRunning(ulong index)
+{
+    RunningMask.Set(index);
 }
 
-ulong CpuTable::GetRunningCpus()
+// no constructor, so it lives in zeroed bss
+static PerCpu BootPerCpu;
+
+PerCpu* GetBootPerCpu()
 {
-    Stdlib::AutoLock lock(Lock);
+    return &BootPerCpu;
+}
 
-    ulong result = 0;
-    for (ulong i = 0; i < Stdlib::ArraySize(CpuArray); i++)
-    {
-        auto& cpu = CpuArray[i];
-        if (cpu.GetState() & Cpu::StateRunning)
-            result |= (ulong)1 << i;
-    }
+void LoadBootPerCpu()
+{
+    BootPerCpu.Self = &BootPerCpu;
+    BootPerCpu.PreemptCount = PreemptNoReschedBit;
+    WriteMsr(GsBaseMsr, (ulong)&BootPerCpu);
+}
 
-    return result;
+PerCpu& Cpu::GetPerCpuArea()
+{
+    return PerCpu;
+}
+
+void Cpu::LoadPerCpu()
+{
+    BugOn(Index != Lapic::GetApicId());
+
+    PerCpu.Self = &PerCpu;
+    PerCpu.Cpu = this;
+    PerCpu.Index = Index;
+    PerCpu.Node = Acpi::GetInstance().GetCpuNode(Index);
+    PerCpu.PreemptCount = PreemptNoReschedBit;
+    PerCpu.IrqStats = &IrqStats;
+    WriteMsr(GsBaseMsr, (ulong)&PerCpu);
 }
 
 bool Cpu::Run(Task::Func func, void *ctx)
 {
+    LoadPerCpu();
+
+    CpuTopology topo;
+    DetectTopology(topo);
+    CpuTable::GetInstance().SetTopology(Index, topo);
+
     Task = new class Task("idle%u", Index);
     if (Task == nullptr)
     {
         return false;
     }
 
-    Task->SetCpuAffinity((ulong)1 << Index);
+    PerCpu.Task = Task;
+
+    CpuMask affinity;
+    affinity.Set(Index);
+    Task->SetCpuAffinity(affinity);
+    Task->SetPriority(Kernel::Task::PriorityIdle);
 
     return Task->Run(TaskQueue, func, ctx);
 }
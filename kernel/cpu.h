@@ -5,11 +5,61 @@
 #include "task.h"
 #include "sched.h"
 #include "asm.h"
+#include "per_cpu.h"
+#include "atomic.h"
+#include "cpu_mask.h"
+#include "interrupt.h"
+#include "timer.h"
+
+#include <mm/new.h>
+#include <drivers/kvm.h>
 
 namespace Kernel
 {
 
-const ulong MaxCpus = 8;
+typedef void (*CpuCallFunc)(void* ctx);
+
+// Cross-cpu function call request, lives on the caller's stack until the
+// target cpu sets Done
+struct CpuCall final
+{
+    CpuCall();
+
+    CpuCall* Next;
+    CpuCallFunc Func;
+    void* Ctx;
+    Atomic Done;
+};
+
+// Snapshot of a cpu's scheduling counters, times are totals since boot
+struct CpuStats final
+{
+    Stdlib::Time IdleTime;
+    // time charged to tasks other than the idle one
+    Stdlib::Time BusyTime;
+    Stdlib::Time IrqTime;
+    ulong IrqCount;
+    long ScheduleCount;
+    long SwitchCount;
+    long MigrateInCount;
+    long MigrateOutCount;
+    long ReadyCount;
+    long TaskCount;
+};
+
+// Where a cpu sits, from cpuid on the cpu itself. The ids are the x2apic
+// id shifted right by the width of the levels below, so they are unique
+// system wide and equal ids share the core, last level cache or package
+struct CpuTopology final
+{
+    CpuTopology();
+
+    bool Valid;
+    u32 ApicId;
+    u32 CoreId;
+    u32 LlcId;
+    u32 PackageId;
+};
 
 class Cpu final
 {
@@ -26,9 +76,17 @@ public:
 
     void Idle();
 
+    // a cpu idling in poll or mwait watches its wake line, so writing the
+    // line makes it reschedule. False if it isn't watching, then the
+    // caller sends ReschedVector as before
+    bool WakeIdle();
+
     ulong GetState();
 
-    void IPI(Context* ctx);
+    void IPI(IrqContext* ctx);
+    void ReschedIPI(IrqContext* ctx);
+    void CallIPI(IrqContext* ctx);
+    void StopIPI(IrqContext* ctx);
 
     static const ulong StateInited = 0x1;
     static const ulong StateRunning = 0x2;
@@ -37,10 +95,40 @@ public:
 
     bool Run(Task::Func func, void *ctx);
 
-    void SendIPISelf();
-
     TaskQueue& GetTaskQueue();
 
+    // task the cpu runs now, a snapshot other cpus may compare but not use
+    class Task* GetRunningTask();
+
+    // runs only the idle task and nothing is ready, a snapshot
+    bool IsIdle();
+
+    // other cpus only read counters from it
+    struct PerCpu& GetPerCpuArea();
+
+    TimerWheel& GetTimerWheel();
+
+    // idle time is the runtime of the idle task, so it includes the irqs
+    // that woke the cpu from hlt
+    void GetStats(CpuStats& stats);
+
+    InterruptStats& GetIrqStats();
+
+    KvmCpuArea& GetKvmArea();
+
+    // stack for an AP, allocated before it is started
+    bool AllocStack();
+    ulong GetStackTop();
+
+    static const size_t StackSize = 8 * Const::PageSize;
+
+    // lock-free push, returns true if the queue was empty so the caller
+    // has to send CallVector
+    bool QueueCall(CpuCall* call);
+
+    // runs queued calls of the current cpu
+    void ProcessCalls();
+
 private:
     Cpu(const Cpu& other) = delete;
     Cpu(Cpu&& other) = delete;
@@ -49,14 +137,72 @@ private:
 
     void OnPanic();
 
+    // handles panic and exit requests, returns only if there is none
+    void CheckStop();
+
+    void UpdateTick();
+
+    void LoadPerCpu();
+
+    // reads the topology leaves on this cpu, 0x1F or 0xB for the levels,
+    // 4 or 0x8000001D for the cache shared at the last level
+    void DetectTopology(CpuTopology& topo);
+
+    void IdleHlt();
+    void IdlePoll();
+    void IdleMwait();
+
+    // after a wake through the line, does what ReschedIPI would
+    void IdleWoken();
+
+    static const ulong WakeIdleRunning = 0;
+    static const ulong WakeIdleWatching = 1;
+    static const ulong WakeIdleWoken = 2;
+
+    static const u32 CpuidMonitor = (1U << 3);
+    static const u32 CpuidHtt = (1U << 28);
+    static const u32 TopologyLevelSmt = 1;
+
+    static const ulong TickPeriod = 10 * Const::NanoSecsInMs;
+    static const ulong TickMin = 1 * Const::NanoSecsInMs;
+
+    // cpus sit next to each other in memory, so every group other cpus
+    // write or poll starts a cache line: the run queue (enqueues and steals),
+    // the per-cpu area (owner hot path), the call queue and the wake line
     ulong Index;
-    ulong State;
-    SpinLock Lock;
+    AtomicValue<ulong> State;
+    ulong IdleMode;
+    FastSpinLock Lock;
     Task* Task;
-    TaskQueue TaskQueue;
-    Atomic IPIConter;
+    TaskQueue TaskQueue __attribute__((aligned(Const::CacheLineSize)));
+    TimerWheel TimerWheel;
+    PerCpu PerCpu __attribute__((aligned(Const::CacheLineSize)));
+    InterruptStats IrqStats;
+    void* Stack;
+    // CpuCall list head, pushed by any cpu and taken whole by the owner
+    Atomic CallQueue __attribute__((aligned(Const::CacheLineSize)));
+    // MONITOR target, alone on its cache line so only wakers write it
+    AtomicValue<ulong> WakeLine __attribute__((aligned(Const::CacheLineSize)));
+    u8 WakeLinePad[Const::CacheLineSize - sizeof(ulong)];
+    // written by the host
+    KvmCpuArea KvmArea;
+
+public:
+    // operator new only guarantees 16 bytes
+    static void* operator new(size_t size) noexcept
+    {
+        return Mm::NewAligned(size, alignof(Cpu));
+    }
+
+    static void operator delete(void* ptr) noexcept
+    {
+        ::operator delete(ptr);
+    }
 };
 
+static_assert(alignof(Cpu) == Const::CacheLineSize, "Invalid alignment");
+static_assert(sizeof(Cpu) % Const::CacheLineSize == 0, "Invalid size");
+
 class CpuTable final
 {
 public:
@@ -66,10 +212,20 @@ public:
         return Instance;
     }
 
+    // records a cpu found in the MADT, runs before the allocator exists
     bool InsertCpu(ulong index);
 
+    // allocates the cpus recorded by InsertCpu
+    bool Setup();
+
     Cpu& GetCpu(ulong index);
 
+    // nullptr if the cpu isn't present or not set up yet
+    Cpu* FindCpu(ulong index);
+
+    // one past the highest cpu index, sizes per-cpu arrays
+    ulong GetCpuLimit();
+
     bool StartAll();
 
     ulong GetBspIndex();
@@ -79,17 +235,54 @@ public:
 
     Cpu& GetCurrentCpu();
 
+    // IPIVector is the tick (lapic timer and timer cpu kick), the others say
+    // why the IPI was sent
     static const u8 IPIVector = 0xFE;
+    static const u8 ReschedVector = 0xFD;
+    static const u8 CallVector = 0xFC;
+    static const u8 StopVector = 0xFB;
+
+    void SendIPI(ulong index, u8 vector = IPIVector);
+
+    CpuMask GetRunningCpus();
 
-    void SendIPI(ulong index);
+    bool IsCpuRunning(ulong index);
 
-    ulong GetRunningCpus();
+    void SetCpuRunning(ulong index);
+
+    // first thing an AP does on its own stack, StartAll polls for it
+    void SetCpuAlive(ulong index);
 
     void ExitAllExceptSelf();
 
-    void SendIPIAllExclude(ulong excludeIndex);
+    void SendIPIAllExclude(ulong excludeIndex, u8 vector = IPIVector);
+
+    void SendIPIAll(u8 vector = IPIVector);
+
+    // runs func(ctx) on cpu index and waits for it to return, false if
+    // the cpu is not running
+    bool CallFunction(ulong index, CpuCallFunc func, void* ctx);
+
+    // runs func(ctx) on every other running cpu and waits for all of them
+    void CallFunctionAllExcludeSelf(CpuCallFunc func, void* ctx);
 
-    void SendIPIAll();
+    // records the topology of cpu index and links it with the cpus that
+    // share its core, last level cache and package
+    void SetTopology(ulong index, const CpuTopology& topo);
+
+    // cpus sharing the core, the last level cache and the package with cpu
+    // index, itself included. Set up while cpus start, read without locks
+    const CpuMask& GetCoreCpus(ulong index);
+    const CpuMask& GetLlcCpus(ulong index);
+    const CpuMask& GetPackageCpus(ulong index);
+
+    // cpu of allowed a task that last ran on prev should go to: prev if it
+    // is idle, then an idle core and an idle cpu in the last level cache of
+    // prev, then in its package, then anywhere, else the least loaded one
+    // with ties going to the closest. MaxCpus if allowed is empty
+    ulong SelectCpu(ulong prev, const CpuMask& allowed);
+
+    void DumpTopology(Stdlib::Printer& printer);
 
 private:
     CpuTable();
@@ -101,10 +294,44 @@ private:
 
     ulong GetBspIndexLockHeld();
 
+    // shorthand broadcasts also reach cpus that are present but not yet
+    // running, so they are used only once every present cpu runs
+    bool CanBroadcast();
+
+    void WaitCall(CpuCall& call);
+
+    // max calls CallFunctionAllExcludeSelf keeps on the stack at once
+    static const size_t CallBatch = 32;
+
+    bool NeedInitDelay();
+
+    // polls until every cpu of target is in mask, false on timeout
+    bool WaitCpus(AtomicCpuMask& mask, const CpuMask& target, ulong timeout);
+
+    static const ulong InitDelay = 10 * Const::NanoSecsInMs;
+    static const ulong SipiRetryDelay = 200 * Const::NanoSecsInUsec;
+    static const ulong StartTimeout = 1000 * Const::NanoSecsInMs;
+    static const u32 CpuidHypervisor = (u32)1 << 31;
+
+    // the first idle cpu of domain, one with its whole core idle if
+    // wholeCore
+    ulong FindIdleCpu(const CpuMask& domain, bool wholeCore);
+
+    // 0 for the same cpu up to 4 for another package
+    ulong GetDistance(ulong from, ulong to);
+
     SpinLock Lock;
-    Cpu CpuArray[MaxCpus];
+    Cpu* CpuArray[MaxCpus];
+    CpuTopology Topology[MaxCpus];
+    CpuMask CoreCpus[MaxCpus];
+    CpuMask LlcCpus[MaxCpus];
+    CpuMask PackageCpus[MaxCpus];
+    CpuMask PresentMask;
+    ulong CpuLimit;
 
     ulong BspIndex;
+    AtomicCpuMask RunningMask;
+    AtomicCpuMask AliveMask;
 
 };
 
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <lib/stdlib.h>
+
+#include "atomic.h"
+#include "per_cpu.h"
+
+namespace Kernel
+{
+
+// Set of cpu indexes, visit the members with
+//     for (ulong cpu = mask.First(); cpu < MaxCpus; cpu = mask.Next(cpu + 1))
+class CpuMask final
+{
+public:
+    CpuMask()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        for (size_t i = 0; i < WordCount; i++)
+            Word[i] = 0;
+    }
+
+    void Fill()
+    {
+        for (size_t i = 0; i < WordCount; i++)
+            Word[i] = ~((ulong)0);
+    }
+
+    void Set(ulong cpu)
+    {
+        if (cpu < MaxCpus)
+            Word[cpu / BitsPerWord] |= (ulong)1 << (cpu % BitsPerWord);
+    }
+
+    void Reset(ulong cpu)
+    {
+        if (cpu < MaxCpus)
+            Word[cpu / BitsPerWord] &= ~((ulong)1 << (cpu % BitsPerWord));
+    }
+
+    bool Test(ulong cpu) const
+    {
+        if (cpu >= MaxCpus)
+            return false;
+
+        return (Word[cpu / BitsPerWord] & ((ulong)1 << (cpu % BitsPerWord))) ? true : false;
+    }
+
+    bool IsEmpty() const
+    {
+        for (size_t i = 0; i < WordCount; i++)
+            if (Word[i] != 0)
+                return false;
+        return true;
+    }
+
+    size_t Count() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < WordCount; i++)
+            count += __builtin_popcountl(Word[i]);
+        return count;
+    }
+
+    // lowest member >= cpu, MaxCpus if there is none
+    ulong Next(ulong cpu) const
+    {
+        if (cpu >= MaxCpus)
+            return MaxCpus;
+
+        size_t i = cpu / BitsPerWord;
+        ulong word = Word[i] & (~((ulong)0) << (cpu % BitsPerWord));
+        for (;;)
+        {
+            if (word != 0)
+                return i * BitsPerWord + Stdlib::FindFirstSetBit(word);
+
+            if (++i == WordCount)
+                return MaxCpus;
+            word = Word[i];
+        }
+    }
+
+    ulong First() const
+    {
+        return Next(0);
+    }
+
+    CpuMask& operator&=(const CpuMask& other)
+    {
+        for (size_t i = 0; i < WordCount; i++)
+            Word[i] &= other.Word[i];
+        return *this;
+    }
+
+    bool operator==(const CpuMask& other) const
+    {
+        for (size_t i = 0; i < WordCount; i++)
+            if (Word[i] != other.Word[i])
+                return false;
+        return true;
+    }
+
+    bool operator!=(const CpuMask& other) const
+    {
+        return !(*this == other);
+    }
+
+    ulong GetWord(size_t index) const
+    {
+        return Word[index];
+    }
+
+    void SetWord(size_t index, ulong value)
+    {
+        Word[index] = value;
+    }
+
+    static const size_t BitsPerWord = 8 * sizeof(ulong);
+    static const size_t WordCount = MaxCpus / BitsPerWord;
+
+    static_assert(MaxCpus % BitsPerWord == 0, "Invalid max cpus");
+
+private:
+    ulong Word[WordCount];
+};
+
+// CpuMask whose members are added concurrently, readers take a snapshot
+class AtomicCpuMask final
+{
+public:
+    AtomicCpuMask()
+    {
+    }
+
+    void Set(ulong cpu)
+    {
+        if (cpu < MaxCpus)
+            Word[cpu / CpuMask::BitsPerWord].SetBit(cpu % CpuMask::BitsPerWord);
+    }
+
+    bool Test(ulong cpu)
+    {
+        if (cpu >= MaxCpus)
+            return false;
+
+        return Word[cpu / CpuMask::BitsPerWord].TestBit(cpu % CpuMask::BitsPerWord);
+    }
+
+    CpuMask Get()
+    {
+        CpuMask mask;
+        for (size_t i = 0; i < CpuMask::WordCount; i++)
+            mask.SetWord(i, static_cast<ulong>(Word[i].Get()));
+        return mask;
+    }
+
+private:
+    AtomicCpuMask(const AtomicCpuMask& other) = delete;
+    AtomicCpuMask(AtomicCpuMask&& other) = delete;
+    AtomicCpuMask& operator=(const AtomicCpuMask& other) = delete;
+    AtomicCpuMask& operator=(AtomicCpuMask&& other) = delete;
+
+    Atomic Word[CpuMask::WordCount];
+};
+
+}
@@ -1,11 +1,21 @@
 #include "dmesg.h"
+#include "asm.h"
 #include "panic.h"
+#include "tunable.h"
+#include "trace.h"
+
+#include <mm/early_allocator.h>
+#include <mm/memory_map.h>
+
+DEFINE_TUNABLE(DmesgPages, "dmesgpages", 0, 0, 1024, nullptr, Kernel::Tunable::FlagBootOnly);
 
 namespace Kernel
 {
 
 Dmesg::Dmesg()
-    : Active(false)
+    : Slots(BootSlots)
+    , SlotCount(BootSlotCount)
+    , Active(false)
 {
 }
 
@@ -18,54 +28,140 @@ bool Dmesg::Setup()
     if (Active)
         return false;
 
-    Active = MsgBuf.Setup((ulong)&Buf[0], (ulong)&Buf[0] + sizeof(Buf), sizeof(DmesgMsg));
+    // stamp slots as if written one lap before, no stamp matches yet
+    for (size_t i = 0; i < SlotCount; i++)
+    {
+        Slots[i].Abs = (u32)(i - SlotCount);
+        Slots[i].Flags = 0;
+    }
+    Head.Set(0);
+    Barrier();
+    Active = true;
     return Active;
 }
 
-void Dmesg::VPrintf(const char *fmt, va_list args)
+bool Dmesg::Grow()
 {
-    if (!Active)
-        return;
+    if (!Active || Slots != BootSlots)
+        return false;
 
-restart:
-    DmesgMsg* msg = (DmesgMsg*)MsgBuf.Alloc();
-    if (msg == nullptr)
+    // 32 pages up to 512MB of ram, twice that per doubling up to 256
+    size_t pages = DmesgPages.Get();
+    if (pages == 0)
     {
-        Stdlib::AutoLock lock(Lock);
-        if (MsgList.IsEmpty())
-            return;
+        pages = Mm::MemoryMap::GetInstance().GetAvailableEnd() / (16 * Const::MB);
+        pages = Stdlib::Max(pages, (size_t)32);
+        pages = Stdlib::Min(pages, (size_t)256);
+    }
+
+    size_t slotCount = (pages * Const::PageSize) / SlotSize;
+    while (slotCount & (slotCount - 1))
+        slotCount &= slotCount - 1;
+
+    if (slotCount <= SlotCount)
+        return true;
 
-        for (auto listEntry = MsgList.Flink; listEntry != &MsgList; listEntry = listEntry->Flink)
+    Slot* slots = static_cast<Slot*>(Mm::EarlyAllocator::GetInstance().Alloc(
+        (slotCount * SlotSize) / Const::PageSize));
+    if (slots == nullptr)
+        return false;
+
+    // no writer is inside its slots with interrupts off, so every slot of
+    // the old ring carries its own stamp. Copy them to the same absolute
+    // index and stamp the older part of the new ring as record middles,
+    // which readers skip
+    ulong flags = GetRflags();
+    InterruptDisable();
+
+    u32 headAbs = (u32)Head.Get();
+    for (u32 i = slotCount; i > 0; i--)
+    {
+        u32 abs = headAbs - i;
+        Slot& slot = slots[abs & (slotCount - 1)];
+        if (i <= SlotCount)
         {
-            auto candMsg = CONTAINING_RECORD(listEntry, DmesgMsg, ListEntry);
-            if (candMsg->Usage.Get() == 0)
-            {
-                msg = candMsg;
-                msg->ListEntry.RemoveInit();
-                break;
-            }
+            slot = GetSlot(abs);
         }
-
-        if (msg == nullptr)
+        else
         {
-            goto restart;
+            slot.Abs = abs;
+            slot.Flags = 0;
         }
     }
-    else
+    Barrier();
+    Slots = slots;
+    SlotCount = (u32)slotCount;
+    Barrier();
+
+    SetRflags(flags);
+
+    Trace(0, "Dmesg slots %u", (ulong)SlotCount);
+    return true;
+}
+
+size_t Dmesg::GetSize()
+{
+    return SlotCount * SlotSize;
+}
+
+void Dmesg::VPrintf(const char *fmt, va_list args)
+{
+    if (!Active)
+        return;
+
+    char msg[MaxMsgSize];
+    int size = Stdlib::VsnPrintf(msg, sizeof(msg), fmt, args);
+    if (size <= 0)
+        return;
+
+    Write(msg, size - 1);
+}
+
+void Dmesg::Write(const char *msg, size_t length)
+{
+    if (!Active)
+        return;
+
+    if (length >= MaxMsgSize)
+        length = MaxMsgSize - 1;
+
+    u32 slotCount = (length == 0) ? 1 : (length + SlotDataSize - 1) / SlotDataSize;
+
+    ulong head, newHead;
+    for (;;)
     {
-        msg->Init();
+        head = Head.Get();
+        newHead = (((head >> 32) + 1) << 32) | (u32)(head + slotCount);
+        if ((ulong)Head.Cmpxchg(newHead, head) == head)
+            break;
     }
 
-	int size = Stdlib::VsnPrintf(msg->Str, sizeof(msg->Str), fmt, args);
-    if (size < 0)
+    u32 seq = (u32)(head >> 32);
+    u32 abs = (u32)head;
+
+    for (u32 i = 0; i < slotCount; i++)
     {
-        MsgBuf.Free(msg);
-		return;
+        GetSlot(abs + i).Abs = abs + i - SlotCount;
     }
+    Barrier();
 
-    Stdlib::AutoLock lock(Lock);
-    BugOn(msg->Usage.Get() != 0);
-    MsgList.InsertTail(&msg->ListEntry);
+    for (u32 i = 0; i < slotCount; i++)
+    {
+        Slot& slot = GetSlot(abs + i);
+        size_t offset = i * SlotDataSize;
+        size_t chunk = Stdlib::Min((size_t)SlotDataSize, (size_t)(length - offset));
+
+        slot.Seq = seq;
+        slot.Length = (u32)length;
+        slot.Flags = (i == 0) ? SlotFlagStart : 0;
+        Stdlib::MemCpy(slot.Data, &msg[offset], chunk);
+    }
+    Barrier();
+
+    for (u32 i = slotCount; i > 0; i--)
+    {
+        GetSlot(abs + i - 1).Abs = abs + i - 1;
+    }
 }
 
 void Dmesg::Printf(const char *fmt, ...)
@@ -79,43 +175,139 @@ void Dmesg::Printf(const char *fmt, ...)
 
 void Dmesg::PrintString(const char *s)
 {
-    Printf("%s", s);
+    Write(s, Stdlib::StrLen(s));
 }
 
-DmesgMsg* Dmesg::Next(DmesgMsg* current)
+bool Dmesg::Next(DmesgCursor& cursor, char* buf, size_t size, ulong& lost)
 {
-    BugOn(current != nullptr && current->Usage.Get() == 0);
+    size_t length;
 
-    Stdlib::AutoLock lock(Lock);
+    return Copy(cursor, buf, size, lost, length);
+}
 
-    Stdlib::ListEntry* nextListEntry;
-    if (current == nullptr)
-    {
-        nextListEntry = MsgList.Flink;
-    }
-    else
+bool Dmesg::Copy(DmesgCursor& cursor, char* buf, size_t size, ulong& lost, size_t& length)
+{
+    lost = 0;
+    length = 0;
+    if (BugOn(size == 0))
+        return false;
+
+    for (;;)
     {
-        nextListEntry = current->ListEntry.Flink;
-        BugOn(current->Usage.Get() <= 0);
-        current->Usage.Dec();
+        ulong head = Head.Get();
+        u32 headAbs = (u32)head;
+        if (cursor.Slot == headAbs)
+            return false;
+
+        // lapped by writers, resync to the oldest slot
+        if ((u32)(headAbs - cursor.Slot) > SlotCount)
+            cursor.Slot = headAbs - SlotCount;
+
+        Slot& first = GetSlot(cursor.Slot);
+        u32 abs = first.Abs;
+        Barrier();
+        u32 flags = first.Flags;
+        u32 seq = first.Seq;
+        u32 recordLength = first.Length;
+        Barrier();
+
+        if (abs != cursor.Slot)
+        {
+            // not overwritten, so the record is still being written
+            if ((u32)(Head.Get() - cursor.Slot) <= SlotCount)
+                return false;
+            continue;
+        }
+
+        if (!(flags & SlotFlagStart))
+        {
+            // middle of a record after a resync
+            cursor.Slot++;
+            continue;
+        }
+
+        u32 slotCount = (recordLength == 0) ? 1 : (recordLength + SlotDataSize - 1) / SlotDataSize;
+        size_t copied = 0;
+        for (u32 i = 0; i < slotCount && copied + 1 < size; i++)
+        {
+            Slot& slot = GetSlot(cursor.Slot + i);
+            size_t chunk = Stdlib::Min((size_t)SlotDataSize, (size_t)(recordLength - i * SlotDataSize));
+            chunk = Stdlib::Min(chunk, size - 1 - copied);
+            Stdlib::MemCpy(&buf[copied], slot.Data, chunk);
+            copied += chunk;
+        }
+        buf[copied] = '\0';
+        Barrier();
+
+        bool valid = ((u32)(Head.Get() - cursor.Slot) <= SlotCount);
+        for (u32 i = 0; valid && i < slotCount; i++)
+        {
+            if (GetSlot(cursor.Slot + i).Abs != cursor.Slot + i)
+                valid = false;
+        }
+
+        if (!valid)
+            continue;
+
+        lost = (u32)(seq - cursor.Seq);
+        length = recordLength;
+        cursor.Slot += slotCount;
+        cursor.Seq = seq + 1;
+        return true;
     }
+}
 
-    if (nextListEntry == &MsgList)
+size_t Dmesg::Read(DmesgCursor& cursor, char* buf, size_t size, ulong& lost)
+{
+    lost = 0;
+    if (BugOn(size == 0))
+        return 0;
+
+    size_t pos = 0;
+    buf[0] = '\0';
+    while (pos + 1 < size)
     {
-        return nullptr;
+        DmesgCursor next = cursor;
+        ulong recordLost;
+        size_t length;
+
+        if (!Copy(next, &buf[pos], size - pos, recordLost, length))
+            break;
+
+        // a record that doesn't fit whole is left for the next call, unless
+        // it wouldn't fit into an empty buffer either
+        if (length >= size - pos && pos != 0)
+        {
+            buf[pos] = '\0';
+            break;
+        }
+
+        cursor = next;
+        lost += recordLost;
+        pos += Stdlib::Min(length, size - 1 - pos);
     }
 
-    DmesgMsg* next = CONTAINING_RECORD(nextListEntry, DmesgMsg, ListEntry);
-    next->Usage.Inc();
-    return next;
+    return pos;
 }
 
-void Dmesg::Dump(Stdlib::Printer& printer)
+void Dmesg::DumpFrom(DmesgCursor& cursor, Stdlib::Printer& printer)
 {
-    for (DmesgMsg* msg = Next(nullptr); msg != nullptr; msg = Next(msg))
+    char buf[4 * MaxMsgSize];
+    ulong lost;
+
+    while (Read(cursor, buf, sizeof(buf), lost) != 0)
     {
-        printer.PrintString(msg->Str);
+        if (lost != 0)
+            printer.Printf("... %u messages lost\n", lost);
+        printer.PrintString(buf);
     }
 }
 
-}
\ No newline at end of file
+void Dmesg::Dump(Stdlib::Printer& printer)
+{
+    DmesgCursor cursor;
+
+    DumpFrom(cursor, printer);
+}
+
+}
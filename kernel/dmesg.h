@@ -1,30 +1,34 @@
 #pragma once
 
-#include "spin_lock.h"
 #include "atomic.h"
 
+#include <include/const.h>
 #include <lib/stdlib.h>
 #include <lib/printer.h>
-#include <mm/block_allocator.h>
 
 namespace Kernel
 {
 
-struct DmesgMsg final
+// position of a reader in the log, starts at the oldest record
+struct DmesgCursor final
 {
-    char Str[256 - sizeof(Stdlib::ListEntry) - sizeof(Atomic)];
-    Stdlib::ListEntry ListEntry;
-    Atomic Usage;
+    u32 Slot;
+    u32 Seq;
 
-    void Init()
+    DmesgCursor()
+        : Slot(0)
+        , Seq(0)
     {
-        ListEntry.Init();
-        Usage.Set(0);
     }
 };
 
-static_assert(sizeof(DmesgMsg) == 256, "Invalid size");
-
+// Circular log of variable length records stored in consecutive 64-byte
+// slots. Head packs the next record sequence number and the next absolute
+// slot index, so a writer reserves both with one cmpxchg, copies its text
+// without any lock and commits by stamping the slots with their absolute
+// index, the first slot last. Readers validate stamps after copying, so an
+// overwritten record is skipped and a lapped cursor resyncs to the oldest
+// record; a sequence gap tells how many records were lost.
 class Dmesg final
 {
 public:
@@ -37,13 +41,35 @@ public:
 
     bool Setup();
 
+    // moves the log from the boot ring into a ring from the early allocator,
+    // dmesgpages sets its size, 0 sizes it by ram. Runs on the boot cpu
+    // before any other cpu starts
+    bool Grow();
+
+    size_t GetSize();
+
     void VPrintf(const char *fmt, va_list args);
     void Printf(const char *fmt, ...);
     void PrintString(const char *s);
 
+    // appends length bytes of already formatted text as one record
+    void Write(const char *msg, size_t length);
+
     void Dump(Stdlib::Printer& printer);
 
-    DmesgMsg* Next(DmesgMsg* current);
+    // prints the records past cursor and advances it, so repeated calls
+    // follow the log without re-reading it
+    void DumpFrom(DmesgCursor& cursor, Stdlib::Printer& printer);
+
+    // copies the record at cursor into buf and advances the cursor, false
+    // if there is nothing more or the next record is still being written
+    bool Next(DmesgCursor& cursor, char* buf, size_t size, ulong& lost);
+
+    // copies as many whole records as fit into buf back to back, returns
+    // their length without the terminator, lost sums the gaps before them
+    size_t Read(DmesgCursor& cursor, char* buf, size_t size, ulong& lost);
+
+    static const size_t MaxMsgSize = 256;
 
 private:
     Dmesg();
@@ -54,15 +80,42 @@ private:
     Dmesg& operator=(const Dmesg& other) = delete;
     Dmesg& operator=(Dmesg&& other) = delete;
 
-    char Buf[32 * Const::PageSize]  __attribute__((aligned(sizeof(DmesgMsg))));
+    static const u32 SlotFlagStart = 0x1;
+    static const size_t SlotSize = 64;
 
-    Mm::BlockAllocatorImpl MsgBuf;
+    struct Slot final
+    {
+        volatile u32 Abs;
+        u32 Seq;
+        u32 Length;
+        u32 Flags;
+        char Data[SlotSize - 4 * sizeof(u32)];
+    };
+
+    static_assert(sizeof(Slot) == SlotSize, "Invalid size");
+
+    static const size_t SlotDataSize = sizeof(Slot::Data);
+    // logs up to the early allocator, see Grow
+    static const size_t BootSlotCount = (4 * Const::PageSize) / sizeof(Slot);
+
+    static_assert((BootSlotCount & (BootSlotCount - 1)) == 0, "Invalid slot count");
+
+    // length is set even if the record didn't fit and was truncated
+    bool Copy(DmesgCursor& cursor, char* buf, size_t size, ulong& lost, size_t& length);
+
+    Slot& GetSlot(u32 abs)
+    {
+        return Slots[abs & (SlotCount - 1)];
+    }
 
-    Stdlib::ListEntry MsgList;
+    Slot BootSlots[BootSlotCount];
+    Slot* Slots;
+    // power of 2
+    u32 SlotCount;
 
-    SpinLock Lock;
+    Atomic Head;
 
     volatile bool Active;
 };
 
-}
\ No newline at end of file
+}
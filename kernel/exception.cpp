@@ -5,6 +5,10 @@
 #include "panic.h"
 #include "trace.h"
 #include "cpu.h"
+#include "task.h"
+#include "static_key.h"
+
+#include <mm/vmalloc.h>
 
 namespace Kernel
 {
@@ -110,11 +114,24 @@ void ExceptionTable::RegisterExceptionHandlers()
     }
 }
 
+void ExceptionTable::ExitUserFault(Context* ctx, bool errorCode, const char* name)
+{
+    // [error code,] rip, cs, rflags, rsp, ss
+    ulong* frame = reinterpret_cast<ulong*>(ctx->Rsp) + (errorCode ? 1 : 0);
+    if (!(frame[1] & 3))
+        return;
+
+    Trace(0, "EXC: %s in user task %u rip 0x%p rsp 0x%p",
+        name, Task::GetCurrentTask()->Pid, frame[0], frame[3]);
+    Task::ExitCurrent(-1);
+}
+
 void ExceptionTable::ExcDivideByZero(Context* ctx)
 {
     (void)ctx;
 
     ExcDivideByZeroCounter.Inc();
+    ExitUserFault(ctx, false, "DivideByZero");
 
     Panic("EXC: DivideByZero");
 }
@@ -139,9 +156,12 @@ void ExceptionTable::ExcNMI(Context* ctx)
 
 void ExceptionTable::ExcBreakpoint(Context* ctx)
 {
-    (void)ctx;
+    // a static key site being patched, not a real breakpoint
+    if (StaticKeys::GetInstance().HandleBreakpoint(ctx))
+        return;
 
     ExcBreakpointCounter.Inc();
+    ExitUserFault(ctx, false, "Breakpoint");
 
     Panic("EXC: Breakpoint");
 }
@@ -151,6 +171,7 @@ void ExceptionTable::ExcOverflow(Context* ctx)
     (void)ctx;
 
     ExcOverflowCounter.Inc();
+    ExitUserFault(ctx, false, "Overflow");
 
     Panic("EXC: Overflow");
 }
@@ -160,6 +181,7 @@ void ExceptionTable::ExcBounds(Context* ctx)
     (void)ctx;
 
     ExcBoundsCounter.Inc();
+    ExitUserFault(ctx, false, "Bounds");
 
     Panic("EXC: Bounds");
 }
@@ -169,6 +191,7 @@ void ExceptionTable::ExcInvalidOpcode(Context* ctx)
     (void)ctx;
 
     ExcInvalidOpcodeCounter.Inc();
+    ExitUserFault(ctx, false, "InvalidOpcode");
 
     Panic("EXC: InvalidOpcode cpu %u rip 0x%p rsp 0x%p",
         CpuTable::GetInstance().GetCurrentCpuId(), ctx->GetRetRip(), ctx->Rsp);
@@ -179,8 +202,10 @@ void ExceptionTable::ExcCoprocessorNotAvailable(Context* ctx)
     (void)ctx;
 
     ExcCoprocessorNotAvailableCounter.Inc();
+    ExitUserFault(ctx, false, "CoprocessorNotAvailable");
 
-    Panic("EXC: CoprocessorNotAvailable");
+    // CR0.TS is clear only inside KernelFpuBegin/End
+    Panic("EXC: CoprocessorNotAvailable, fpu used outside a kernel fpu section");
 }
 
 void ExceptionTable::ExcDoubleFault(Context* ctx)
@@ -215,6 +240,7 @@ void ExceptionTable::ExcSegmentNotPresent(Context* ctx)
     (void)ctx;
 
     ExcSegmentNotPresentCounter.Inc();
+    ExitUserFault(ctx, true, "SegmentNotPresent");
 
     Panic("EXC: SegmentNotPresent");
 }
@@ -224,6 +250,7 @@ void ExceptionTable::ExcStackFault(Context* ctx)
     (void)ctx;
 
     ExcStackFaultCounter.Inc();
+    ExitUserFault(ctx, true, "StackFault");
 
     Panic("EXC: StackFault");
 }
@@ -233,23 +260,35 @@ void ExceptionTable::ExcGeneralProtectionFault(Context* ctx)
     (void)ctx;
 
     ExcGeneralProtectionFaultCounter.Inc();
+    ExitUserFault(ctx, true, "GP");
 
-    Panic("EXC: GP cpu %u rip 0x%p rsp 0x%p",
-        CpuTable::GetInstance().GetCurrentCpuId(), ctx->GetRetRip(), ctx->Rsp);
+    // the error code sits below the return frame
+    ulong* frame = reinterpret_cast<ulong*>(ctx->Rsp);
+    Panic("EXC: GP cpu %u rip 0x%p rsp 0x%p error 0x%p",
+        CpuTable::GetInstance().GetCurrentCpuId(), frame[1], ctx->Rsp, frame[0]);
 }
 
 void ExceptionTable::ExcPageFault(Context* ctx)
 {
-    (void)ctx;
-
     ExcPageFaultCounter.Inc();
 
+    // the cpu pushed an error code below the return frame
+    ulong* frame = reinterpret_cast<ulong*>(ctx->Rsp);
+    ulong error = frame[0];
     ulong cr2 = GetCr2();
+
+    // not present page of a lazily backed range, retry the access; user
+    // accesses to kernel ranges are never backed
+    if (!(error & (PageFaultPresent | PageFaultUser)) && Mm::Vmalloc::GetInstance().HandleFault(cr2))
+        return;
+
+    ExitUserFault(ctx, true, "PageFault");
+
     ulong cr3 = GetCr3();
 
-    Panic("EXC: PageFault cpu %u rip 0x%p rsp 0x%p cr2 0x%p cr3 0x%p",
-        CpuTable::GetInstance().GetCurrentCpuId(), ctx->GetRetRip(), ctx->Rsp,
-        cr2, cr3);
+    Panic("EXC: PageFault cpu %u rip 0x%p rsp 0x%p cr2 0x%p cr3 0x%p error 0x%p",
+        CpuTable::GetInstance().GetCurrentCpuId(), frame[1], ctx->Rsp,
+        cr2, cr3, error);
 }
 
 void ExceptionTable::ExcReserved(Context* ctx)
@@ -266,6 +305,7 @@ void ExceptionTable::ExcMathFault(Context* ctx)
     (void)ctx;
 
     ExcMathFaultCounter.Inc();
+    ExitUserFault(ctx, false, "MathFault");
 
     Panic("EXC: MathFault");
 }
@@ -275,6 +315,7 @@ void ExceptionTable::ExcAlignmentCheck(Context* ctx)
     (void)ctx;
 
     ExcAlignmentCheckCounter.Inc();
+    ExitUserFault(ctx, true, "AlignmentCheck");
 
     Panic("EXC: AlignmentCheck");
 }
@@ -293,6 +334,7 @@ void ExceptionTable::ExcSIMDFpException(Context* ctx)
     (void)ctx;
 
     ExcSIMDFpExceptionCounter.Inc();
+    ExitUserFault(ctx, false, "SIMDFpException");
 
     Panic("EXC: SIMDFpException");
 }
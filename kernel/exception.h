@@ -1,6 +1,7 @@
 #pragma once
 
 #include "atomic.h"
+#include "per_cpu_counter.h"
 #include "asm.h"
 
 #include <include/types.h>
@@ -56,32 +57,40 @@ private:
 
     using ExcHandler = void (*)();
 
+    // page fault error code bits
+    static const ulong PageFaultPresent = 0x1;
+    static const ulong PageFaultUser = 0x4;
+
     bool SetHandler(size_t index, ExcHandler handler);
 
+    // ends the current task if the fault came from user mode, returns
+    // otherwise
+    void ExitUserFault(Context* ctx, bool errorCode, const char* name);
+
     ExcHandler Handler[0x16];
 
-    Atomic ExcDivideByZeroCounter;
-    Atomic ExcDebuggerCounter;
-    Atomic ExcNMICounter;
-    Atomic ExcBreakpointCounter;
-    Atomic ExcOverflowCounter;
-    Atomic ExcBoundsCounter;
-    Atomic ExcInvalidOpcodeCounter;
-    Atomic ExcCoprocessorNotAvailableCounter;
-    Atomic ExcDoubleFaultCounter;
-    Atomic ExcCoprocessorSegmentOverrunCounter;
-    Atomic ExcInvalidTaskStateSegmentCounter;
-    Atomic ExcSegmentNotPresentCounter;
-    Atomic ExcStackFaultCounter;
-    Atomic ExcGeneralProtectionFaultCounter;
-    Atomic ExcPageFaultCounter;
-    Atomic ExcReservedCounter;
-    Atomic ExcMathFaultCounter;
-    Atomic ExcAlignmentCheckCounter;
-    Atomic ExcMachineCheckCounter;
-    Atomic ExcSIMDFpExceptionCounter;
-    Atomic ExcVirtExceptionCounter;
-    Atomic ExcControlProtectionCounter;
+    PerCpuCounter ExcDivideByZeroCounter;
+    PerCpuCounter ExcDebuggerCounter;
+    PerCpuCounter ExcNMICounter;
+    PerCpuCounter ExcBreakpointCounter;
+    PerCpuCounter ExcOverflowCounter;
+    PerCpuCounter ExcBoundsCounter;
+    PerCpuCounter ExcInvalidOpcodeCounter;
+    PerCpuCounter ExcCoprocessorNotAvailableCounter;
+    PerCpuCounter ExcDoubleFaultCounter;
+    PerCpuCounter ExcCoprocessorSegmentOverrunCounter;
+    PerCpuCounter ExcInvalidTaskStateSegmentCounter;
+    PerCpuCounter ExcSegmentNotPresentCounter;
+    PerCpuCounter ExcStackFaultCounter;
+    PerCpuCounter ExcGeneralProtectionFaultCounter;
+    PerCpuCounter ExcPageFaultCounter;
+    PerCpuCounter ExcReservedCounter;
+    PerCpuCounter ExcMathFaultCounter;
+    PerCpuCounter ExcAlignmentCheckCounter;
+    PerCpuCounter ExcMachineCheckCounter;
+    PerCpuCounter ExcSIMDFpExceptionCounter;
+    PerCpuCounter ExcVirtExceptionCounter;
+    PerCpuCounter ExcControlProtectionCounter;
 };
 
 }
\ No newline at end of file
@@ -5,5 +5,8 @@ namespace Kernel
 {
 
 class TaskQueue;
+class Cpu;
+class Task;
+class WaitQueue;
 
 }
\ No newline at end of file
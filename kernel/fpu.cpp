@@ -0,0 +1,145 @@
+#include "fpu.h"
+#include "asm.h"
+#include "per_cpu.h"
+#include "preempt.h"
+#include "panic.h"
+#include "trace.h"
+
+#include <mm/page_allocator.h>
+
+namespace Kernel
+{
+
+static inline void Clts()
+{
+    asm volatile ("clts" : : : "memory");
+}
+
+static inline void Xsetbv(u32 index, u64 value)
+{
+    asm volatile ("xsetbv" : : "c"(index), "a"((u32)value), "d"((u32)(value >> 32)));
+}
+
+static inline void FpuReset()
+{
+    u32 mxcsr = 0x1F80;
+
+    asm volatile ("fninit; ldmxcsr %0" : : "m"(mxcsr) : "memory");
+}
+
+Fpu::Fpu()
+    : UseXsave(false)
+    , Avx(false)
+    , Xcr0(0)
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    UseXsave = (ecx & CpuidXsave) ? true : false;
+    Avx = (UseXsave && (ecx & CpuidAvx)) ? true : false;
+    Xcr0 = XcrX87 | XcrSse | (Avx ? XcrAvx : 0);
+}
+
+Fpu::~Fpu()
+{
+}
+
+bool Fpu::InitCpu()
+{
+    auto perCpu = GetPerCpu();
+    if (perCpu->FpuState == nullptr)
+    {
+        // page aligned, XSAVE wants 64 bytes and FXSAVE 16
+        perCpu->FpuState = Mm::PageAllocatorImpl::GetInstance().Alloc(1);
+        if (perCpu->FpuState == nullptr)
+            return false;
+    }
+
+    SetCr0((GetCr0() & ~Cr0Em) | Cr0Mp | Cr0Ne);
+    ulong cr4 = GetCr4() | Cr4OsFxsr | Cr4OsXmmExcpt;
+    if (UseXsave)
+        cr4 |= Cr4OsXsave;
+    SetCr4(cr4);
+
+    if (UseXsave)
+    {
+        Xsetbv(0, Xcr0);
+
+        u32 eax, ebx, ecx, edx;
+        Cpuid(0xD, &eax, &ebx, &ecx, &edx);
+        if (BugOn(ebx > StateSize))
+            return false;
+    }
+
+    Clts();
+    FpuReset();
+    SetCr0(GetCr0() | Cr0Ts);
+    perCpu->FpuDepth = 0;
+
+    Trace(0, "Cpu %u fpu xsave %u avx %u", GetPerCpuIndex(), (ulong)UseXsave, (ulong)Avx);
+    return true;
+}
+
+bool Fpu::HasAvx()
+{
+    return Avx;
+}
+
+void Fpu::Save(void* area)
+{
+    if (UseXsave)
+        asm volatile ("xsave64 (%0)" : : "r"(area), "a"((u32)Xcr0), "d"((u32)(Xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+void Fpu::Restore(void* area)
+{
+    if (UseXsave)
+        asm volatile ("xrstor64 (%0)" : : "r"(area), "a"((u32)Xcr0), "d"((u32)(Xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+void Fpu::Begin()
+{
+    PreemptDisable();
+
+    // depth and TS change together, an interrupt in between would see
+    // a section without access or save registers with TS set
+    ulong flags = GetRflags();
+    InterruptDisable();
+    auto perCpu = GetPerCpu();
+    if (perCpu->FpuDepth == 0)
+    {
+        Clts();
+    }
+    else
+    {
+        // only an interrupt handler can nest, and it can't be interrupted
+        BugOn(perCpu->FpuDepth != 1);
+        Save(perCpu->FpuState);
+    }
+    perCpu->FpuDepth++;
+    SetRflags(flags);
+    Barrier();
+}
+
+void Fpu::End()
+{
+    Barrier();
+    ulong flags = GetRflags();
+    InterruptDisable();
+    auto perCpu = GetPerCpu();
+    BugOn(perCpu->FpuDepth == 0);
+    perCpu->FpuDepth--;
+    if (perCpu->FpuDepth == 0)
+        SetCr0(GetCr0() | Cr0Ts);
+    else
+        Restore(perCpu->FpuState);
+    SetRflags(flags);
+
+    PreemptEnable();
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Kernel
+{
+
+// Kernel code runs with CR0.TS set, so any x87/SSE/AVX instruction outside
+// a KernelFpuBegin/End section faults with #NM. Sections disable preemption
+// and never sleep, so no task owns fpu state across a context switch and
+// SwitchContext stays general purpose only. Registers are saved only when an
+// interrupt handler opens a section inside an interrupted one.
+class Fpu final
+{
+public:
+    static Fpu& GetInstance()
+    {
+        static Fpu Instance;
+        return Instance;
+    }
+
+    // enables x87/SSE (and AVX under XSAVE) on the current cpu, runs after
+    // its per-cpu area is loaded
+    bool InitCpu();
+
+    void Begin();
+    void End();
+
+    bool HasAvx();
+
+private:
+    Fpu();
+    ~Fpu();
+    Fpu(const Fpu& other) = delete;
+    Fpu(Fpu&& other) = delete;
+    Fpu& operator=(const Fpu& other) = delete;
+    Fpu& operator=(Fpu&& other) = delete;
+
+    void Save(void* area);
+    void Restore(void* area);
+
+    static const ulong Cr0Mp = (1UL << 1);
+    static const ulong Cr0Em = (1UL << 2);
+    static const ulong Cr0Ts = (1UL << 3);
+    static const ulong Cr0Ne = (1UL << 5);
+    static const ulong Cr4OsFxsr = (1UL << 9);
+    static const ulong Cr4OsXmmExcpt = (1UL << 10);
+    static const ulong Cr4OsXsave = (1UL << 18);
+
+    static const u32 CpuidXsave = (1U << 26);
+    static const u32 CpuidAvx = (1U << 28);
+
+    static const u64 XcrX87 = (1UL << 0);
+    static const u64 XcrSse = (1UL << 1);
+    static const u64 XcrAvx = (1UL << 2);
+
+    // one saved section per cpu, x87/SSE/AVX XSAVE area fits with room
+    static const size_t StateSize = 2048;
+
+    bool UseXsave;
+    bool Avx;
+    u64 Xcr0;
+};
+
+static inline void KernelFpuBegin()
+{
+    Fpu::GetInstance().Begin();
+}
+
+static inline void KernelFpuEnd()
+{
+    Fpu::GetInstance().End();
+}
+
+}
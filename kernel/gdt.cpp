@@ -8,13 +8,30 @@ namespace Kernel
 Gdt::Gdt()
 {
     Entry[1].SetValue(((u64)1<<43) | ((u64)1<<44) | ((u64)1<<47) | ((u64)1<<53));
+    Entry[2].SetValue(((u64)1<<41) | ((u64)1<<44) | ((u64)1<<47));
+    Entry[3].SetValue(((u64)1<<41) | ((u64)1<<44) | ((u64)3<<45) | ((u64)1<<47));
+    Entry[4].SetValue(((u64)1<<43) | ((u64)1<<44) | ((u64)3<<45) | ((u64)1<<47) | ((u64)1<<53));
+
+    Stdlib::MemSet(CpuTss, 0, sizeof(CpuTss));
+    for (size_t i = 0; i < MaxCpus; i++)
+    {
+        // no io permission bitmap
+        CpuTss[i].IoMapBase = sizeof(Tss);
+
+        u64 base = reinterpret_cast<u64>(&CpuTss[i]);
+        u64 limit = sizeof(Tss) - 1;
+        // available 64-bit tss, present
+        Entry[5 + 2 * i].SetValue(limit | ((base & 0xFFFFFF) << 16) | ((u64)0x9 << 40) |
+            ((u64)1 << 47) | (((base >> 24) & 0xFF) << 56));
+        Entry[6 + 2 * i].SetValue(base >> 32);
+    }
 }
 
 void Gdt::Save()
 {
     TableDesc desc = {
+        .Limit = sizeof(Entry) - 1,
         .Base = reinterpret_cast<u64>(&Entry[0]),
-        .Limit = sizeof(Entry),
     };
 
     LoadGdt(&desc);
@@ -23,8 +40,20 @@ void Gdt::Save()
     Limit = desc.Limit;
 }
 
+void Gdt::LoadTss(ulong cpu)
+{
+    u16 selector = static_cast<u16>(TssBase + 16 * cpu);
+
+    asm volatile ("ltr %0" : : "r"(selector) : "memory");
+}
+
+void Gdt::SetKernelStack(ulong cpu, ulong rsp)
+{
+    CpuTss[cpu].Rsp0 = rsp;
+}
+
 Gdt::~Gdt()
 {
 }
 
-}
\ No newline at end of file
+}
@@ -1,11 +1,29 @@
 #pragma once
 
 #include "gdt_descriptor.h"
+#include "per_cpu.h"
 #include <lib/stdlib.h>
 
 namespace Kernel
 {
 
+// 64-bit task state segment, only the ring 0 stack is used: interrupts
+// from user mode switch to it
+struct Tss final
+{
+    u32 Reserved0;
+    u64 Rsp0;
+    u64 Rsp1;
+    u64 Rsp2;
+    u64 Reserved1;
+    u64 Ist[7];
+    u64 Reserved2;
+    u16 Reserved3;
+    u16 IoMapBase;
+} __attribute__((packed));
+
+static_assert(sizeof(Tss) == 104, "Invalid size");
+
 class Gdt final
 {
 public:
@@ -17,6 +35,20 @@ public:
 
     void Save();
 
+    // loads the task register of the current cpu
+    void LoadTss(ulong cpu);
+
+    // stack interrupts from user mode start on
+    void SetKernelStack(ulong cpu, ulong rsp);
+
+    // SYSCALL loads KernelCode and KernelData, SYSRET UserCode and UserData,
+    // which is why user data comes first
+    static const u16 KernelCode = 0x08;
+    static const u16 KernelData = 0x10;
+    static const u16 UserData = 0x18 | 3;
+    static const u16 UserCode = 0x20 | 3;
+    static const u16 TssBase = 0x28;
+
 private:
     Gdt();
     ~Gdt();
@@ -29,7 +61,9 @@ private:
     u64 Base;
     u16 Limit;
 
-    GdtDescriptor Entry[2];
+    // a 16 byte tss descriptor per cpu follows the segments
+    GdtDescriptor Entry[5 + 2 * MaxCpus];
+    Tss CpuTss[MaxCpus];
 };
 
-}
\ No newline at end of file
+}
@@ -2,8 +2,13 @@
 #include "idt.h"
 #include "cpu.h"
 #include "trace.h"
+#include "time.h"
+#include "irq_affinity.h"
+#include "preempt.h"
 
 #include <drivers/ioapic.h>
+#include <drivers/lapic.h>
+#include <lib/lock.h>
 
 namespace Kernel
 {
@@ -13,10 +18,131 @@ void Interrupt::Register(InterruptHandler& handler, u8 irq, u8 vector)
     Trace(0, "Register interrupt irq 0x%p vector 0x%p fn 0x%p",
         (ulong)irq, (ulong)vector, handler.GetHandlerFn());
 
-    IoApic::GetInstance().SetIrq(irq, CpuTable::GetInstance().GetCurrentCpuId(), vector);
+    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
+    IoApic::GetInstance().SetIrq(irq, cpu, vector);
+    IrqAffinity::GetInstance().Add(irq, vector, cpu);
     Idt::GetInstance().SetDescriptor(vector, IdtDescriptor::Encode(handler.GetHandlerFn()));
 
     handler.OnInterruptRegister(irq, vector);
 }
 
-}
\ No newline at end of file
+Interrupt::DeviceHandler Interrupt::DeviceHandlers[DeviceVectorCount];
+SpinLock Interrupt::DeviceLock;
+
+bool Interrupt::AllocVector(DeviceInterruptFn fn, void* ctx, u8& vector)
+{
+    if (BugOn(fn == nullptr))
+        return false;
+
+    Stdlib::AutoLock lock(DeviceLock);
+
+    for (size_t i = 0; i < DeviceVectorCount; i++)
+    {
+        DeviceHandler& handler = DeviceHandlers[i];
+        if (handler.Fn != nullptr)
+            continue;
+
+        handler.Ctx = ctx;
+        // the stub may run on another cpu as soon as the device is told
+        Barrier();
+        handler.Fn = fn;
+        vector = static_cast<u8>(DeviceVectorBase + i);
+        Idt::GetInstance().SetDescriptor(vector, IdtDescriptor::Encode(DeviceInterruptStubTable[i]));
+
+        Trace(0, "Alloc vector 0x%p fn 0x%p ctx 0x%p", (ulong)vector, fn, ctx);
+        return true;
+    }
+
+    return false;
+}
+
+void Interrupt::FreeVector(u8 vector)
+{
+    if (BugOn(vector < DeviceVectorBase || vector >= DeviceVectorBase + DeviceVectorCount))
+        return;
+
+    Stdlib::AutoLock lock(DeviceLock);
+
+    DeviceHandler& handler = DeviceHandlers[vector - DeviceVectorBase];
+    BugOn(handler.Fn == nullptr);
+    handler.Fn = nullptr;
+    handler.Ctx = nullptr;
+}
+
+void Interrupt::DeviceInterrupt(u8 vector)
+{
+    {
+        InterruptTime irqTime(vector);
+
+        DeviceHandler& handler = DeviceHandlers[vector - DeviceVectorBase];
+        DeviceInterruptFn fn = handler.Fn;
+        if (likely(fn != nullptr))
+            fn(handler.Ctx);
+    }
+
+    Lapic::EOI();
+}
+
+extern "C" void DeviceInterrupt(IrqContext* ctx, ulong vector)
+{
+    (void)ctx;
+    Interrupt::DeviceInterrupt(static_cast<u8>(vector));
+    PreemptIrqExit();
+}
+
+static ulong TicksToNs(ulong ticks, ulong ticksPerMs)
+{
+    if (ticksPerMs == 0)
+        return 0;
+
+    return (ticks / ticksPerMs) * Const::NanoSecsInMs +
+        ((ticks % ticksPerMs) * Const::NanoSecsInMs) / ticksPerMs;
+}
+
+void Interrupt::Dump(Stdlib::Printer& printer)
+{
+    auto& cpus = CpuTable::GetInstance();
+    ulong ticksPerMs = TscClock::GetInstance().GetTicksPerMs();
+    CpuMask running = cpus.GetRunningCpus();
+
+    for (size_t vector = 0; vector < InterruptStats::VectorCount; vector++)
+    {
+        ulong count = 0;
+        ulong maxTicks = 0;
+        ulong bucket[InterruptStats::BucketCount] = {0};
+
+        for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+        {
+            auto& stats = cpus.GetCpu(i).GetIrqStats();
+            count += stats.Count[vector];
+            maxTicks = Stdlib::Max(maxTicks, stats.MaxTicks[vector]);
+            for (size_t j = 0; j < InterruptStats::BucketCount; j++)
+                bucket[j] += stats.Bucket[vector][j];
+        }
+
+        if (count == 0)
+            continue;
+
+        printer.Printf("vector 0x%p count %u max %u ns\n", vector, count, TicksToNs(maxTicks, ticksPerMs));
+
+        printer.Printf(" ");
+        for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+            printer.Printf(" cpu%u %u", i, cpus.GetCpu(i).GetIrqStats().Count[vector]);
+        printer.Printf("\n");
+
+        printer.Printf(" ");
+        for (size_t j = 0; j < InterruptStats::BucketCount; j++)
+        {
+            if (bucket[j] == 0)
+                continue;
+
+            if (j == InterruptStats::BucketCount - 1)
+                printer.Printf(" slower %u", bucket[j]);
+            else
+                printer.Printf(" <%uns %u", TicksToNs((ulong)1 << (j + InterruptStats::BucketShift), ticksPerMs), bucket[j]);
+        }
+        printer.Printf("\n");
+    }
+}
+
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "asm.h"
+#include "per_cpu.h"
+#include "spin_lock.h"
 
 namespace Kernel
 {
@@ -14,10 +19,89 @@ public:
     virtual InterruptHandlerFn GetHandlerFn() = 0;
 };
 
+// Per-cpu counts and handler durations of every vector. Bucket i counts
+// handlers that took less than 2^(i + BucketShift) tsc ticks, the last one
+// everything slower. Written only by the owning cpu with interrupts off.
+struct InterruptStats final
+{
+    static const size_t VectorCount = 256;
+    static const size_t BucketCount = 12;
+    static const size_t BucketShift = 10;
+
+    void Record(u8 vector, u64 ticks)
+    {
+        size_t bucket = 0;
+        u64 bound = ticks >> BucketShift;
+        if (bound != 0)
+            bucket = Stdlib::Min(static_cast<size_t>(64 - __builtin_clzl(bound)), BucketCount - 1);
+
+        Count[vector]++;
+        Bucket[vector][bucket]++;
+        if (ticks > MaxTicks[vector])
+            MaxTicks[vector] = ticks;
+    }
+
+    ulong Count[VectorCount];
+    ulong MaxTicks[VectorCount];
+    ulong Bucket[VectorCount][BucketCount];
+};
+
+// Accounts its lifetime as irq time of the current cpu and as a handler
+// run of vector, handlers keep it in a scope that ends before they can
+// schedule
+class InterruptTime final
+{
+public:
+    explicit InterruptTime(u8 vector)
+        : Start(ReadTsc())
+        , Vector(vector)
+    {
+    }
+
+    ~InterruptTime()
+    {
+        u64 ticks = ReadTsc() - Start;
+        InterruptStats* stats;
+
+        PER_CPU_ADD(IrqTicks, ticks);
+        PER_CPU_ADD(IrqCounter, 1);
+        PER_CPU_READ(IrqStats, stats);
+        if (stats != nullptr)
+            stats->Record(Vector, ticks);
+    }
+
+private:
+    InterruptTime(const InterruptTime& other) = delete;
+    InterruptTime(InterruptTime&& other) = delete;
+    InterruptTime& operator=(const InterruptTime& other) = delete;
+    InterruptTime& operator=(InterruptTime&& other) = delete;
+
+    u64 Start;
+    u8 Vector;
+};
+
+using DeviceInterruptFn = void (*)(void* ctx);
+
 class Interrupt
 {
 public:
     static void Register(InterruptHandler& handler, u8 irq, u8 vector);
+
+    // Vectors for message signalled interrupts. Each has a stub that
+    // passes the vector to a common entry, which runs fn and sends the
+    // eoi. The caller points the device at the vector after it is
+    // allocated and stops it before freeing.
+    static bool AllocVector(DeviceInterruptFn fn, void* ctx, u8& vector);
+    static void FreeVector(u8 vector);
+
+    // common entry of the device vector stubs
+    static void DeviceInterrupt(u8 vector);
+
+    static const u8 DeviceVectorBase = 0x30;
+    static const size_t DeviceVectorCount = 0xC0;
+
+    // vectors that fired on any cpu with per-cpu counts and duration histograms
+    static void Dump(Stdlib::Printer& printer);
 private:
     Interrupt() = delete;
     ~Interrupt() = delete;
@@ -25,6 +109,15 @@ private:
     Interrupt(Interrupt&& other) = delete;
     Interrupt& operator=(const Interrupt& other) = delete;
     Interrupt& operator=(Interrupt&& other) = delete;
+
+    struct DeviceHandler
+    {
+        DeviceInterruptFn Fn;
+        void* Ctx;
+    };
+
+    static DeviceHandler DeviceHandlers[DeviceVectorCount];
+    static SpinLock DeviceLock;
 };
 
 }
\ No newline at end of file
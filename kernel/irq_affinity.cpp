@@ -0,0 +1,259 @@
+#include "irq_affinity.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "parameters.h"
+#include "trace.h"
+
+#include <drivers/ioapic.h>
+#include <drivers/lapic.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+IrqAffinity::IrqAffinity()
+    : BalanceWork(BalanceWorkFunc, this)
+    , Balancing(false)
+    , BalancePasses(0)
+{
+    for (size_t i = 0; i < MaxIrqs; i++)
+    {
+        Irq& entry = IrqTable[i];
+        entry.Used = false;
+        entry.Lowest = false;
+        entry.Vector = 0;
+        entry.Cpu = 0;
+        entry.LastCount = 0;
+        entry.Moves = 0;
+    }
+
+    for (size_t i = 0; i < MaxCpus; i++)
+        LastIrqTicks[i] = 0;
+}
+
+IrqAffinity::~IrqAffinity()
+{
+}
+
+void IrqAffinity::Add(u8 irq, u8 vector, ulong cpu)
+{
+    if (BugOn(irq >= MaxIrqs))
+        return;
+
+    Stdlib::AutoLock lock(Lock);
+    Irq& entry = IrqTable[irq];
+    entry.Used = true;
+    entry.Lowest = false;
+    entry.Vector = vector;
+    entry.Cpu = cpu;
+    entry.Affinity.Fill();
+}
+
+void IrqAffinity::Route(u8 irq, const CpuMask& targets, ulong preferred)
+{
+    Irq& entry = IrqTable[irq];
+
+    // lowest priority delivery needs every target in the flat logical ids
+    u8 logicalMask = 0;
+    bool flat = (targets.Count() > 1) ? true : false;
+    for (ulong cpu = targets.First(); flat && cpu < MaxCpus; cpu = targets.Next(cpu + 1))
+    {
+        u8 id = Lapic::GetFlatLogicalId(cpu);
+        if (id == 0)
+            flat = false;
+        logicalMask |= id;
+    }
+
+    if (flat)
+    {
+        IoApic::GetInstance().SetIrqLowestPriority(irq, logicalMask, entry.Vector);
+        entry.Lowest = true;
+        entry.Cpu = targets.First();
+        return;
+    }
+
+    ulong cpu = targets.Test(preferred) ? preferred : targets.First();
+    IoApic::GetInstance().SetIrq(irq, cpu, entry.Vector);
+    if (entry.Cpu != cpu)
+        entry.Moves++;
+    entry.Lowest = false;
+    entry.Cpu = cpu;
+}
+
+bool IrqAffinity::Set(u8 irq, const CpuMask& mask)
+{
+    if (irq >= MaxIrqs)
+        return false;
+
+    CpuMask targets = CpuTable::GetInstance().GetRunningCpus();
+    targets &= mask;
+    if (targets.IsEmpty())
+        return false;
+
+    Stdlib::AutoLock lock(Lock);
+    Irq& entry = IrqTable[irq];
+    if (!entry.Used)
+        return false;
+
+    entry.Affinity = mask;
+    Route(irq, targets, entry.Cpu);
+
+    Trace(0, "Irq %u affinity 0x%p cpu %u lowest %u",
+        (ulong)irq, mask.GetWord(0), entry.Cpu, (ulong)entry.Lowest);
+    return true;
+}
+
+void IrqAffinity::Setup()
+{
+    auto& params = Parameters::GetInstance();
+
+    ulong irqMask = params.GetIrqMask();
+    if (irqMask != 0)
+    {
+        CpuMask mask;
+        mask.SetWord(0, irqMask);
+        for (size_t i = 0; i < MaxIrqs; i++)
+        {
+            if (IrqTable[i].Used && !Set(static_cast<u8>(i), mask))
+                Trace(0, "Can't set irq %u affinity 0x%p", i, irqMask);
+        }
+    }
+
+    if (params.IsIrqBalance())
+        StartBalance();
+}
+
+void IrqAffinity::StartBalance()
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (Balancing)
+            return;
+        Balancing = true;
+    }
+
+    TimerTable::GetInstance().StartTimer(BalanceTimer, *this,
+        Stdlib::Time(BalancePeriodMs * Const::NanoSecsInMs),
+        Stdlib::Time(BalancePeriodMs * Const::NanoSecsInMs));
+}
+
+void IrqAffinity::StopBalance()
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (!Balancing)
+            return;
+        Balancing = false;
+    }
+
+    TimerTable::GetInstance().StopTimer(BalanceTimer);
+}
+
+void IrqAffinity::OnTick(TimerCallback& callback)
+{
+    (void)callback;
+
+    // the pass reads every cpu's stats, keep it out of interrupt context
+    WorkQueue::GetInstance().Queue(BalanceWork);
+}
+
+void IrqAffinity::BalanceWorkFunc(void* ctx)
+{
+    static_cast<IrqAffinity*>(ctx)->Balance();
+}
+
+void IrqAffinity::Balance()
+{
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask running = cpus.GetRunningCpus();
+    ulong load[MaxCpus];
+
+    // irq time of every cpu since the last pass, the stats are read racily
+    // which is fine for a heuristic
+    for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+    {
+        ulong ticks = cpus.GetCpu(cpu).GetPerCpuArea().IrqTicks;
+        load[cpu] = ticks - LastIrqTicks[cpu];
+        LastIrqTicks[cpu] = ticks;
+    }
+
+    ulong busiest = running.First();
+    for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+    {
+        if (load[cpu] > load[busiest])
+            busiest = cpu;
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    if (!Balancing)
+        return;
+
+    BalancePasses++;
+
+    size_t moveIrq = MaxIrqs;
+    ulong moveCount = 0;
+    for (size_t i = 0; i < MaxIrqs; i++)
+    {
+        Irq& entry = IrqTable[i];
+        if (!entry.Used)
+            continue;
+
+        ulong count = 0;
+        for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+            count += cpus.GetCpu(cpu).GetIrqStats().Count[entry.Vector];
+
+        ulong delta = count - entry.LastCount;
+        entry.LastCount = count;
+
+        if (entry.Lowest || entry.Cpu != busiest || delta <= moveCount)
+            continue;
+
+        moveIrq = i;
+        moveCount = delta;
+    }
+
+    if (moveIrq == MaxIrqs)
+        return;
+
+    Irq& entry = IrqTable[moveIrq];
+    CpuMask targets = running;
+    targets &= entry.Affinity;
+    targets.Reset(busiest);
+
+    ulong idlest = MaxCpus;
+    for (ulong cpu = targets.First(); cpu < MaxCpus; cpu = targets.Next(cpu + 1))
+    {
+        if (idlest == MaxCpus || load[cpu] < load[idlest])
+            idlest = cpu;
+    }
+
+    // moving costs a cold cache on the new cpu, only do it for a clear
+    // imbalance
+    if (idlest == MaxCpus || load[busiest] - load[idlest] < load[busiest] / 4)
+        return;
+
+    CpuMask target;
+    target.Set(idlest);
+    Route(static_cast<u8>(moveIrq), target, idlest);
+
+    Trace(0, "Irq %u moved cpu %u -> %u", moveIrq, busiest, idlest);
+}
+
+void IrqAffinity::Dump(Stdlib::Printer& printer)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    printer.Printf("balance %u passes %u\n", (ulong)Balancing, BalancePasses);
+    printer.Printf("irq vector affinity cpu lowest moves\n");
+    for (size_t i = 0; i < MaxIrqs; i++)
+    {
+        Irq& entry = IrqTable[i];
+        if (!entry.Used)
+            continue;
+
+        printer.Printf("%u 0x%p 0x%p %u %u %u\n", i, (ulong)entry.Vector,
+            entry.Affinity.GetWord(0), entry.Cpu, (ulong)entry.Lowest, entry.Moves);
+    }
+}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "cpu_mask.h"
+#include "spin_lock.h"
+#include "timer.h"
+#include "work_queue.h"
+
+namespace Kernel
+{
+
+// Tracks which cpus may take each io apic irq and where its entry points.
+// Interrupt::Register adds irqs targeted at the boot cpu; Setup applies the
+// boot parameters once the other cpus run. An irq allowed on several of the
+// first 8 cpus uses lowest priority delivery in xAPIC flat mode and the
+// lapics spread it; otherwise it goes to a single cpu and the balancer may
+// move it. The balancer runs every BalancePeriod from a work item and
+// moves at most one irq per pass, the busiest one of the cpu with the most
+// irq time, to the allowed cpu with the least.
+class IrqAffinity final : public TimerCallback
+{
+public:
+    static IrqAffinity& GetInstance()
+    {
+        static IrqAffinity Instance;
+        return Instance;
+    }
+
+    // irq was just routed to cpu
+    void Add(u8 irq, u8 vector, ulong cpu);
+
+    // running cpus of mask may take irq, false if there are none
+    bool Set(u8 irq, const CpuMask& mask);
+
+    // irqmask= and irqbalance= after the other cpus have started
+    void Setup();
+
+    void StartBalance();
+    void StopBalance();
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t MaxIrqs = 64;
+
+private:
+    IrqAffinity();
+    ~IrqAffinity();
+    IrqAffinity(const IrqAffinity& other) = delete;
+    IrqAffinity(IrqAffinity&& other) = delete;
+    IrqAffinity& operator=(const IrqAffinity& other) = delete;
+    IrqAffinity& operator=(IrqAffinity&& other) = delete;
+
+    virtual void OnTick(TimerCallback& callback) override;
+
+    static void BalanceWorkFunc(void* ctx);
+
+    void Balance();
+
+    // caller holds Lock
+    void Route(u8 irq, const CpuMask& targets, ulong preferred);
+
+    struct Irq
+    {
+        bool Used;
+        bool Lowest;
+        u8 Vector;
+        // cpu the entry points to, the first allowed one under lowest
+        // priority delivery
+        ulong Cpu;
+        CpuMask Affinity;
+        // vector count summed over cpus at the last balance pass
+        ulong LastCount;
+        ulong Moves;
+    };
+
+    static const ulong BalancePeriodMs = 1000;
+
+    SpinLock Lock;
+    Irq IrqTable[MaxIrqs];
+    // per-cpu irq ticks at the last balance pass, owned by the balancer
+    ulong LastIrqTicks[MaxCpus];
+    Timer BalanceTimer;
+    Work BalanceWork;
+    bool Balancing;
+    ulong BalancePasses;
+};
+
+}
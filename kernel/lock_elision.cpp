@@ -0,0 +1,58 @@
+#include "lock_elision.h"
+#include "tunable.h"
+
+namespace Kernel
+{
+
+StaticKey LockElisionKey("lockelision", false);
+
+bool LockElisionRtm = false;
+
+static bool OnLockElision(ulong value)
+{
+    return LockElision::GetInstance().Enable(value != 0);
+}
+
+// lockelision=1 elides shared SpinLock and RwSpinLock sections, it stays 0
+// on cpus without rtm
+DEFINE_TUNABLE(LockElisionTunable, "lockelision", 0, 0, 1, OnLockElision);
+
+LockElision::LockElision()
+{
+    u32 eax, ebx, ecx, edx;
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7)
+        return;
+
+    CpuidCount(7, 0, &eax, &ebx, &ecx, &edx);
+    LockElisionRtm = (ebx & CpuidRtm) ? true : false;
+}
+
+LockElision::~LockElision()
+{
+}
+
+bool LockElision::IsSupported()
+{
+    return LockElisionRtm;
+}
+
+bool LockElision::Enable(bool enabled)
+{
+    if (enabled && !LockElisionRtm)
+        return false;
+
+    StaticKeys::GetInstance().Set(LockElisionKey, enabled);
+    return true;
+}
+
+void LockElision::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("elision rtm %u on %u starts %u commits %u\n",
+        (ulong)LockElisionRtm, (ulong)LockElisionKey.IsEnabled(),
+        Starts.Get(), Commits.Get());
+    printer.Printf("elision aborts busy %u conflict %u capacity %u other %u fallbacks %u\n",
+        Busy.Get(), Conflicts.Get(), Capacity.Get(), Other.Get(), Fallbacks.Get());
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+#include "asm.h"
+#include "per_cpu_counter.h"
+#include "static_key.h"
+
+namespace Kernel
+{
+
+// off by default, the lockelision tunable switches it on cpus with rtm
+extern StaticKey LockElisionKey;
+
+// set once cpuid reported rtm, xtest is only valid then
+extern bool LockElisionRtm;
+
+static const u32 XBeginStarted = ~0U;
+static const u32 XAbortExplicit = (1U << 0);
+static const u32 XAbortRetry = (1U << 1);
+static const u32 XAbortConflict = (1U << 2);
+static const u32 XAbortCapacity = (1U << 3);
+
+// xabort code of a section that found the lock taken
+static const u32 XAbortLockBusy = 0xff;
+
+static inline u32 XBegin()
+{
+    u32 status = XBeginStarted;
+    asm volatile ("xbegin 1f\n1:" : "+a"(status) : : "memory");
+    return status;
+}
+
+static inline void XEnd()
+{
+    asm volatile ("xend" : : : "memory");
+}
+
+static inline void XAbortBusy()
+{
+    asm volatile ("xabort $0xff" : : : "memory");
+}
+
+static inline bool XTest()
+{
+    u8 inTransaction;
+    asm volatile ("xtest; setnz %0" : "=r"(inTransaction) : : "memory", "cc");
+    return inTransaction != 0;
+}
+
+// Runs the shared sections of SpinLock and RwSpinLock as rtm transactions
+// that only read the lock word. Sections on different cpus that touch
+// different data then commit in parallel, a writer taking the lock aborts
+// them. A section aborted Retries times, or by something a transaction
+// can't do (io, cpuid, a page walk that faults), takes the lock for real.
+class LockElision final
+{
+public:
+    static LockElision& GetInstance()
+    {
+        static LockElision Instance;
+        return Instance;
+    }
+
+    // false if the cpu has no rtm
+    bool Enable(bool enabled);
+
+    bool IsSupported();
+
+    // with interrupts off: true if the section now runs transactionally
+    // and saw isFree, false if the caller has to take the lock
+    template<typename Pred>
+    bool Begin(Pred isFree)
+    {
+        for (ulong i = 0; i < Retries; i++)
+        {
+            Starts.Inc();
+            u32 status = XBegin();
+            if (status == XBeginStarted)
+            {
+                // the lock word joins the read set, taking it aborts us
+                if (isFree())
+                    return true;
+
+                XAbortBusy();
+            }
+
+            if ((status & XAbortExplicit) && (status >> 24) == XAbortLockBusy)
+            {
+                Busy.Inc();
+                while (!isFree())
+                    Pause();
+                continue;
+            }
+
+            if (status & XAbortConflict)
+                Conflicts.Inc();
+            else if (status & XAbortCapacity)
+                Capacity.Inc();
+            else
+                Other.Inc();
+
+            if (!(status & XAbortRetry))
+                break;
+        }
+
+        Fallbacks.Inc();
+        return false;
+    }
+
+    void End()
+    {
+        XEnd();
+        Commits.Inc();
+    }
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const ulong Retries = 3;
+
+private:
+    LockElision();
+    ~LockElision();
+    LockElision(const LockElision& other) = delete;
+    LockElision(LockElision&& other) = delete;
+    LockElision& operator=(const LockElision& other) = delete;
+    LockElision& operator=(LockElision&& other) = delete;
+
+    static const u32 CpuidRtm = (1U << 11);
+
+    PerCpuCounter Starts;
+    PerCpuCounter Commits;
+    PerCpuCounter Busy;
+    PerCpuCounter Conflicts;
+    PerCpuCounter Capacity;
+    PerCpuCounter Other;
+    PerCpuCounter Fallbacks;
+};
+
+}
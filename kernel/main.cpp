@@ -14,10 +14,21 @@
 #include "preempt.h"
 #include "dmesg.h"
 #include "watchdog.h"
+#include "lock_elision.h"
+#include "static_key.h"
 #include "parameters.h"
+#include "time.h"
+#include "boot_profile.h"
+#include "bench.h"
+#include "work_queue.h"
+#include "parallel.h"
+#include "fpu.h"
+#include "irq_affinity.h"
+#include "syscall.h"
 
 #include <boot/grub.h>
 
+#include <lib/checksum.h>
 #include <lib/error.h>
 #include <lib/stdlib.h>
 
@@ -26,30 +37,43 @@
 #include <mm/memory_map.h>
 #include <mm/allocator.h>
 #include <mm/page_table.h>
+#include <mm/early_allocator.h>
+#include <mm/tlb.h>
 
 #include <drivers/8042.h>
 #include <drivers/vga.h>
 #include <drivers/serial.h>
 #include <drivers/pic.h>
 #include <drivers/pit.h>
+#include <drivers/hpet.h>
+#include <drivers/kvm.h>
+#include <drivers/pci.h>
+#include <drivers/page_cache.h>
+#include <drivers/virtio_blk.h>
+#include <drivers/virtio_net.h>
 #include <drivers/acpi.h>
 #include <drivers/lapic.h>
 #include <drivers/ioapic.h>
+#include <drivers/pmu.h>
 
 using namespace Kernel;
 using namespace Stdlib;
 using namespace Const;
 
-const size_t CpuStackSize = 8 * Const::PageSize;
-static char Stack[MaxCpus][8 * Const::PageSize] __attribute__((aligned(Const::PageSize)));
-static long StackIndex;
+static char BspStack[Cpu::StackSize] __attribute__((aligned(Const::PageSize)));
 
-#define ALLOC_CPU_STACK()                               \
-do {                                                    \
-    auto index = AtomicReadAndInc(&StackIndex);         \
-    if (index >= (long)MaxCpus)                         \
-        Panic("Can't allocate stack for cpu");          \
-    SetRsp((long)&Stack[index][CpuStackSize]);          \
+#define SWITCH_BSP_STACK()                                      \
+do {                                                            \
+    SetRsp((long)&BspStack[Cpu::StackSize]);                    \
+} while (false)
+
+// AP stacks are allocated by the BSP before it starts them, the lapic of an
+// AP isn't enabled yet so the cpu is found by its initial APIC ID
+#define SWITCH_AP_STACK()                                       \
+do {                                                            \
+    auto& apCpu = CpuTable::GetInstance().GetCpu(               \
+        Lapic::GetInitialApicId());                             \
+    SetRsp((long)apCpu.GetStackTop());                          \
 } while (false)
 
 void TraceCpuState(ulong cpu)
@@ -78,10 +102,40 @@ void ApStartup(void *ctx)
 
     TraceCpuState(cpu.GetIndex());
 
+    if (!Fpu::GetInstance().InitCpu())
+    {
+        Panic("Can't init fpu");
+        return;
+    }
+
+    if (!Kvm::GetInstance().InitCpu(cpu.GetKvmArea()))
+    {
+        Panic("Can't init kvm");
+        return;
+    }
+
+    if (!Syscall::GetInstance().InitCpu())
+    {
+        Panic("Can't init syscall");
+        return;
+    }
+
     Idt::GetInstance().Save();
 
     SetCr3(Mm::PageTable::GetInstance().GetRoot());
 
+    if (!Mm::Tlb::GetInstance().InitCpu())
+    {
+        Panic("Can't init tlb");
+        return;
+    }
+
+    if (!Mm::PageTable::GetInstance().InitCpu())
+    {
+        Panic("Can't init pat");
+        return;
+    }
+
     BugOn(IsInterruptEnabled());
     InterruptEnable();
 
@@ -98,6 +152,14 @@ void ApStartup(void *ctx)
         return;
     }
 
+    auto err = TestTimer();
+    if (!err.Ok())
+    {
+        TraceError(err, "Timer test failed");
+        Panic("Timer test failed");
+        return;
+    }
+
     for (;;)
     {
         cpu.Idle();
@@ -106,7 +168,8 @@ void ApStartup(void *ctx)
 
 extern "C" void ApMain()
 {
-    ALLOC_CPU_STACK();
+    SWITCH_AP_STACK();
+    LoadBootPerCpu();
 
     Gdt::GetInstance().Save();
     Idt::GetInstance().Save();
@@ -117,6 +180,7 @@ extern "C" void ApMain()
     Lapic::Enable();
 
     auto& cpu = CpuTable::GetInstance().GetCurrentCpu();
+    CpuTable::GetInstance().SetCpuAlive(cpu.GetIndex());
 
     Trace(0, "Cpu %u rsp 0x%p", cpu.GetIndex(), GetRsp());
 
@@ -127,6 +191,38 @@ extern "C" void ApMain()
     }
 }
 
+// perftest lines go to the serial port, flushed one by one so a full ring
+// doesn't drop any
+class PerfTestPrinter final : public Stdlib::Printer
+{
+public:
+    virtual void VPrintf(const char *fmt, va_list args) override
+    {
+        auto& serial = Serial::GetInstance();
+        serial.VPrintf(fmt, args);
+        serial.Flush();
+    }
+
+    virtual void Printf(const char *fmt, ...) override
+    {
+        va_list args;
+        va_start(args, fmt);
+        VPrintf(fmt, args);
+        va_end(args);
+    }
+
+    virtual void PrintString(const char *s) override
+    {
+        auto& serial = Serial::GetInstance();
+        serial.PrintString(s);
+        serial.Flush();
+    }
+
+    virtual void Backspace() override
+    {
+    }
+};
+
 void Exit()
 {
     PreemptDisable();
@@ -162,12 +258,33 @@ void BpStartup(void* ctx)
     auto& cpus = CpuTable::GetInstance();
     auto& cpu = cpus.GetCurrentCpu();
     auto& acpi = Acpi::GetInstance();
+    auto& profile = BootProfile::GetInstance();
 
     Trace(0, "Cpu %u running rflags 0x%p task 0x%p",
         cpu.GetIndex(), GetRflags(), Task::GetCurrentTask());
 
     TraceCpuState(cpu.GetIndex());
 
+    if (!Fpu::GetInstance().InitCpu())
+    {
+        Panic("Can't init fpu");
+        return;
+    }
+
+    if (!Kvm::GetInstance().InitCpu(cpu.GetKvmArea()))
+    {
+        Panic("Can't init kvm");
+        return;
+    }
+
+    if (!Syscall::GetInstance().InitCpu())
+    {
+        Panic("Can't init syscall");
+        return;
+    }
+
+    profile.Mark("interrupts");
+
     ioApic.Enable();
 
     //TODO: irq -> gsi remap by ACPI MADT
@@ -178,6 +295,10 @@ void BpStartup(void* ctx)
     Trace(0, "Interrupts registered");
 
     idt.SetDescriptor(CpuTable::IPIVector, IdtDescriptor::Encode(IPInterruptStub));
+    idt.SetDescriptor(CpuTable::ReschedVector, IdtDescriptor::Encode(ReschedInterruptStub));
+    idt.SetDescriptor(CpuTable::CallVector, IdtDescriptor::Encode(CallInterruptStub));
+    idt.SetDescriptor(CpuTable::StopVector, IdtDescriptor::Encode(StopInterruptStub));
+    idt.SetDescriptor(Pmu::Vector, IdtDescriptor::Encode(PerfInterruptStub));
 
     Trace(0, "IPI registred");
 
@@ -198,6 +319,19 @@ void BpStartup(void* ctx)
 
     Trace(0, "Interrupts enabled");
 
+    profile.Mark("hpet");
+    Hpet::GetInstance().Setup();
+
+    profile.Mark("tsc calibrate");
+    TscClock::GetInstance().Calibrate();
+    Kvm::GetInstance().EnableClock();
+    profile.Mark("lapic calibrate");
+    Lapic::CalibrateTimer();
+
+    Watchdog::GetInstance().SetCheckPeriod(
+        Parameters::GetInstance().GetWatchdogPeriodMs() * Const::NanoSecsInMs);
+
+    profile.Mark("start cpus");
     if (!Parameters::GetInstance().IsSmpOff())
     {
         if (!cpus.StartAll())
@@ -207,23 +341,65 @@ void BpStartup(void* ctx)
         }
     }
 
+    // every cpu now runs on its own per-cpu area, which halted waiters
+    // are found by
+    if (Kvm::GetInstance().HasPvUnhalt())
+    {
+        CpuMask running = cpus.GetRunningCpus();
+        ulong cpuCount = 0;
+        for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+            cpuCount = i + 1;
+
+        RawSpinLock::EnableParavirt(cpuCount);
+        Trace(0, "Paravirt spin locks on, cpus %u", cpuCount);
+    }
+
     PreemptOn();
     PreemptOnWaiting = false;
 
+    IrqAffinity::GetInstance().Setup();
+
+    profile.Mark("workers");
+    if (!WorkQueue::GetInstance().Setup())
+    {
+        Panic("Can't start workers");
+        return;
+    }
+
+    // keys typed before the workers existed
+    kbd.DecodePending();
+
+    if (!ParallelPool::GetInstance().Setup())
+    {
+        Panic("Can't start parallel workers");
+        return;
+    }
+
+    profile.Mark("pci");
+    if (!Pci::GetInstance().Enumerate())
+    {
+        Panic("Can't enumerate pci");
+        return;
+    }
+
+    // optional, the kernel runs without a disk or a nic
+    if (VirtioBlk::GetInstance().Probe())
+        PageCache::GetInstance().AddDevice(VirtioBlk::GetInstance());
+    VirtioNet::GetInstance().Probe();
+
+    profile.Mark("ipi test");
     VgaTerm::GetInstance().Printf("IPI test...\n");
 
-    ulong cpuMask = cpus.GetRunningCpus();
-    for (ulong i = 0; i < 8 * sizeof(ulong); i++)
+    CpuMask cpuMask = cpus.GetRunningCpus();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
     {
-        if (cpuMask & ((ulong)1 << i))
+        if (i != cpu.GetIndex())
         {
-            if (i != cpu.GetIndex())
-            {
-                cpus.SendIPI(i);
-            }
+            cpus.SendIPI(i);
         }
     }
 
+    profile.Mark("task test");
     VgaTerm::GetInstance().Printf("Task test...\n");
 
     if (!TestMultiTasking())
@@ -232,6 +408,92 @@ void BpStartup(void* ctx)
         return;
     }
 
+    auto err = TestTimer();
+    if (!err.Ok())
+    {
+        TraceError(err, "Timer test failed");
+        Panic("Timer test failed");
+        return;
+    }
+
+    err = TestParallel();
+    if (!err.Ok())
+    {
+        TraceError(err, "Parallel test failed");
+        Panic("Parallel test failed");
+        return;
+    }
+
+    err = TestMutex();
+    if (!err.Ok())
+    {
+        TraceError(err, "Mutex test failed");
+        Panic("Mutex test failed");
+        return;
+    }
+
+    err = TestTaskSnapshot();
+    if (!err.Ok())
+    {
+        TraceError(err, "Task snapshot test failed");
+        Panic("Task snapshot test failed");
+        return;
+    }
+
+    err = TestChannel();
+    if (!err.Ok())
+    {
+        TraceError(err, "Channel test failed");
+        Panic("Channel test failed");
+        return;
+    }
+
+    err = TestCompletion();
+    if (!err.Ok())
+    {
+        TraceError(err, "Completion test failed");
+        Panic("Completion test failed");
+        return;
+    }
+
+    err = TestFpu();
+    if (!err.Ok())
+    {
+        TraceError(err, "Fpu test failed");
+        Panic("Fpu test failed");
+        return;
+    }
+
+    err = TestUserMode();
+    if (!err.Ok())
+    {
+        TraceError(err, "User mode test failed");
+        Panic("User mode test failed");
+        return;
+    }
+
+    profile.Mark("ready");
+
+    const char* perfTest = Parameters::GetInstance().GetPerfTest();
+    if (perfTest[0] != '\0')
+    {
+        VgaTerm::GetInstance().Printf("Perf test %s...\n", perfTest);
+        PerfTestPrinter printer;
+        bool ok = BenchTable::GetInstance().RunPerfTest(perfTest, printer);
+        Trace(0, "Perf test %s ok %u", perfTest, (ulong)ok);
+        ParallelPool::GetInstance().Stop();
+        WorkQueue::GetInstance().Stop();
+        Exit();
+        return;
+    }
+
+    const char* bench = Parameters::GetInstance().GetBench();
+    if (bench[0] != '\0')
+    {
+        VgaTerm::GetInstance().Printf("Bench %s...\n", bench);
+        BenchTable::GetInstance().Run(bench, VgaTerm::GetInstance());
+    }
+
     VgaTerm::GetInstance().Printf("Idle looping...\n");
 
     if (!cmd.Start())
@@ -247,6 +509,8 @@ void BpStartup(void* ctx)
         {
             Trace(0, "Exit requested");
             cmd.Stop();
+            ParallelPool::GetInstance().Stop();
+            WorkQueue::GetInstance().Stop();
             break;
         }
     }
@@ -258,7 +522,14 @@ extern "C" void Main(Grub::MultiBootInfoHeader *MbInfo)
 {
     do {
 
-    ALLOC_CPU_STACK();
+    SWITCH_BSP_STACK();
+    LoadBootPerCpu();
+
+    // before the first trace or lock, they are patched branch sites
+    StaticKeys::GetInstance().Setup();
+
+    auto& profile = BootProfile::GetInstance();
+    profile.Mark("early");
 
     auto& pic = Pic::GetInstance();
     pic.Remap();
@@ -268,6 +539,7 @@ extern "C" void Main(Grub::MultiBootInfoHeader *MbInfo)
     ExceptionTable::GetInstance().RegisterExceptionHandlers();
     Idt::GetInstance().Save();
 
+    profile.Mark("dmesg");
     if (!Dmesg::GetInstance().Setup())
     {
         Panic("Can't setup dmesg");
@@ -280,12 +552,27 @@ extern "C" void Main(Grub::MultiBootInfoHeader *MbInfo)
 
     VgaTerm::GetInstance().Printf("Hello!\n");
 
+    profile.Mark("multiboot");
     Grub::ParseMultiBootInfo(MbInfo);
 
     auto& mmap = Mm::MemoryMap::GetInstance();
     Trace(0, "Enter kernel: start 0x%p end 0x%p",
         mmap.GetKernelStart(), mmap.GetKernelEnd());
 
+    // buffers sized by the hardware come from the ram past the kernel
+    // until the page allocator takes it over
+    profile.Mark("early alloc");
+    auto& earlyAllocator = Mm::EarlyAllocator::GetInstance();
+    if (!earlyAllocator.Setup())
+    {
+        Panic("Can't setup early allocator");
+        break;
+    }
+
+    if (!Dmesg::GetInstance().Grow())
+        Trace(0, "Can't grow dmesg, size %u", Dmesg::GetInstance().GetSize());
+
+    profile.Mark("paging");
     auto& pt = Mm::PageTable::GetInstance();
     if (!pt.Setup())
     {
@@ -297,50 +584,91 @@ extern "C" void Main(Grub::MultiBootInfoHeader *MbInfo)
     SetCr3(pt.GetRoot());
     Trace(0, "Set new cr3 0x%p", GetCr3());
 
-    if (!pt.Setup2())
+    if (!Mm::Tlb::GetInstance().InitCpu())
     {
-        Panic("Can't setup paging 2");
+        Panic("Can't init tlb");
         break;
     }
 
-    Trace(0, "Paging root 0x%p old cr3 0x%p", pt.GetRoot(), GetCr3());
-    SetCr3(pt.GetRoot());
-    Trace(0, "Set new cr3 0x%p", GetCr3());
+    if (!pt.InitCpu())
+    {
+        Panic("Can't init pat");
+        break;
+    }
 
-    ulong memStart, memEnd;
     if (mmap.GetKernelEnd() <= pt.PhysToVirt(MB))
     {
         Panic("Kernel end is lower than kernel space base");
         break;
     }
 
-    //Since paging only setup for first 4GB use only first 4GB
-    if (!mmap.FindRegion(pt.VirtToPhys(mmap.GetKernelEnd()), 4 * GB, memStart, memEnd))
+    // SRAT is needed to split memory by node
+    profile.Mark("acpi");
+    auto& acpi = Acpi::GetInstance();
+    auto err = acpi.Parse();
+    if (!err.Ok())
     {
-        Panic("Can't get available memory region");
+        TraceError(err, "Can't parse ACPI");
+        Panic("Can't parse ACPI");
         break;
     }
 
-    Trace(0, "Memory region 0x%p 0x%p", memStart, memEnd);
-    if (!Mm::PageAllocatorImpl::GetInstance().Setup(pt.PhysToVirt(memStart), pt.PhysToVirt(memEnd)))
+    // every ram region above the kernel that the direct map covers, split
+    // by node
+    profile.Mark("page allocator");
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    ulong memBase = earlyAllocator.Seal();
+    Trace(0, "Early allocator pages %u", earlyAllocator.GetPageCount());
+    ulong memLimit = pt.GetDirectMapEnd();
+    size_t zoneCount = 0;
+    for (size_t i = 0; i < mmap.GetRegionCount(); i++)
+    {
+        ulong memStart, memEnd;
+        if (!mmap.GetAvailableRegion(i, memBase, memLimit, memStart, memEnd))
+            continue;
+
+        Trace(0, "Memory region 0x%p 0x%p", memStart, memEnd);
+        for (ulong start = memStart; start < memEnd;)
+        {
+            ulong end;
+            ulong node = acpi.GetMemoryNode(start, end);
+            end = Stdlib::Min(end, memEnd);
+            if (pageAllocator.Setup(pt.PhysToVirt(start), pt.PhysToVirt(end), node))
+                zoneCount++;
+            start = end;
+        }
+    }
+
+    if (zoneCount == 0)
     {
         Panic("Can't setup page allocator");
         break;
     }
 
-    Mm::AllocatorImpl::GetInstance(Mm::PageAllocatorImpl::GetInstance());
+    for (size_t i = 0; i < acpi.GetNodeCount(); i++)
+    {
+        for (size_t j = 0; j < acpi.GetNodeCount(); j++)
+        {
+            pageAllocator.SetNodeDistance(i, j, acpi.GetNodeDistance(i, j));
+        }
+    }
 
-    VgaTerm::GetInstance().Printf("Self test begin, please wait...\n");
+    profile.Mark("allocator");
+    Mm::AllocatorImpl::GetInstance(pageAllocator);
 
-    auto& acpi = Acpi::GetInstance();
-    auto err = acpi.Parse();
-    if (!err.Ok())
+    if (!CpuTable::GetInstance().Setup())
     {
-        TraceError(err, "Can't parse ACPI");
-        Panic("Can't parse ACPI");
+        Panic("Can't setup cpus");
         break;
     }
 
+    Stdlib::ChecksumSetup();
+    Trace(0, "Crc32c hw %u", (ulong)Stdlib::Crc32cIsHw());
+    Trace(0, "Lock elision rtm %u", (ulong)LockElision::GetInstance().IsSupported());
+
+    VgaTerm::GetInstance().Printf("Self test begin, please wait...\n");
+
+    profile.Mark("self test");
     Trace(0, "Before test");
 
     err = Test();
@@ -352,6 +680,7 @@ extern "C" void Main(Grub::MultiBootInfoHeader *MbInfo)
     }
 
     Trace(0, "After test");
+    profile.Mark("bsp task");
     VgaTerm::GetInstance().Printf("Self test complete, error %u\n", (ulong)err.GetCode());
 
     auto& kbd = IO8042::GetInstance();
@@ -0,0 +1,180 @@
+#include "mutex.h"
+#include "task.h"
+#include "cpu.h"
+#include "preempt.h"
+#include "panic.h"
+#include "asm.h"
+
+namespace Kernel
+{
+
+Mutex::Mutex()
+    : OwnerCpu(0)
+{
+    Owner.Set(0);
+}
+
+Mutex::~Mutex()
+{
+    BugOn(Owner.Get() != 0);
+}
+
+bool Mutex::TryLock()
+{
+    long curr = (long)Task::GetCurrentTask();
+
+    if (Owner.Get() != 0 || Owner.Cmpxchg(curr, 0) != 0)
+        return false;
+
+    OwnerCpu = GetPerCpuIndex();
+    return true;
+}
+
+bool Mutex::IsOwnerRunning(long owner)
+{
+    auto& cpus = CpuTable::GetInstance();
+    ulong cpu = OwnerCpu;
+
+    if (cpu == GetPerCpuIndex() || !cpus.IsCpuRunning(cpu))
+        return false;
+
+    return (long)cpus.GetCpu(cpu).GetRunningTask() == owner;
+}
+
+void Mutex::Lock()
+{
+    BugOn(IsOwner());
+
+    for (;;)
+    {
+        if (TryLock())
+            return;
+
+        for (ulong i = 0; i < SpinMax; i++)
+        {
+            long owner = Owner.Get();
+            if (owner == 0 || (PreemptIsOn() && !IsOwnerRunning(owner)))
+                break;
+            Pause();
+        }
+
+        if (!PreemptIsOn())
+            continue;
+
+        WaitQueue.Prepare();
+        if (TryLock())
+        {
+            WaitQueue.Finish();
+            return;
+        }
+        WaitQueue.Wait();
+    }
+}
+
+void Mutex::Unlock()
+{
+    BugOn(!IsOwner());
+
+    // the xchg orders waiter lookup after the release, a waiter links
+    // itself before its last TryLock
+    Owner.Xchg(0);
+    if (!WaitQueue.IsEmpty())
+        WaitQueue.WakeUpOne();
+}
+
+void Mutex::Lock(ulong& flags)
+{
+    (void)flags;
+    Lock();
+}
+
+void Mutex::Unlock(ulong flags)
+{
+    (void)flags;
+    Unlock();
+}
+
+bool Mutex::IsOwner()
+{
+    return Owner.Get() == (long)Task::GetCurrentTask();
+}
+
+Semaphore::Semaphore(long count)
+{
+    Count.Set(count);
+}
+
+Semaphore::~Semaphore()
+{
+}
+
+bool Semaphore::TryDown()
+{
+    for (;;)
+    {
+        long count = Count.Get();
+        if (count <= 0)
+            return false;
+
+        if (Count.Cmpxchg(count - 1, count) == count)
+            return true;
+    }
+}
+
+void Semaphore::Down()
+{
+    for (;;)
+    {
+        if (TryDown())
+            return;
+
+        WaitQueue.Prepare();
+        if (TryDown())
+        {
+            WaitQueue.Finish();
+            return;
+        }
+        WaitQueue.Wait();
+    }
+}
+
+void Semaphore::Up()
+{
+    Count.Inc();
+    if (!WaitQueue.IsEmpty())
+        WaitQueue.WakeUpOne();
+}
+
+long Semaphore::GetCount()
+{
+    return Count.Get();
+}
+
+CondVar::CondVar()
+{
+}
+
+CondVar::~CondVar()
+{
+}
+
+void CondVar::Wait(Mutex& mutex)
+{
+    // linked before the unlock, so a signal after it isn't lost
+    WaitQueue.Prepare();
+    mutex.Unlock();
+    WaitQueue.Wait();
+    mutex.Lock();
+}
+
+void CondVar::Signal()
+{
+    WaitQueue.WakeUpOne();
+}
+
+void CondVar::Broadcast()
+{
+    WaitQueue.WakeUpAll();
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <lib/lock.h>
+
+#include "atomic.h"
+#include "wait_queue.h"
+
+namespace Kernel
+{
+
+// Sleeping lock for task context: contenders spin while the owner runs on
+// another cpu, then block on the wait queue. Interrupts and preemption stay
+// enabled inside, so it must not be taken from interrupt handlers or under
+// a spin lock. Before preemption is on it only spins.
+class Mutex final : public Stdlib::LockInterface
+{
+public:
+    Mutex();
+    virtual ~Mutex();
+
+    void Lock();
+
+    bool TryLock();
+
+    void Unlock();
+
+    // flags are unused, for Stdlib::AutoLock
+    virtual void Lock(ulong& flags) override;
+
+    virtual void Unlock(ulong flags) override;
+
+    bool IsOwner();
+
+private:
+    Mutex(const Mutex& other) = delete;
+    Mutex(Mutex&& other) = delete;
+    Mutex& operator=(const Mutex& other) = delete;
+    Mutex& operator=(Mutex&& other) = delete;
+
+    // true if the owner is the current task of the cpu it locked on, read
+    // without dereferencing the owner which may exit once it unlocks
+    bool IsOwnerRunning(long owner);
+
+    static const ulong SpinMax = 4096;
+
+    // Task* of the owner or zero
+    Atomic Owner;
+    volatile ulong OwnerCpu;
+    WaitQueue WaitQueue;
+};
+
+// Counting semaphore, Down blocks while the count is zero
+class Semaphore final
+{
+public:
+    explicit Semaphore(long count = 0);
+    ~Semaphore();
+
+    void Down();
+
+    bool TryDown();
+
+    void Up();
+
+    long GetCount();
+
+private:
+    Semaphore(const Semaphore& other) = delete;
+    Semaphore(Semaphore&& other) = delete;
+    Semaphore& operator=(const Semaphore& other) = delete;
+    Semaphore& operator=(Semaphore&& other) = delete;
+
+    Atomic Count;
+    WaitQueue WaitQueue;
+};
+
+// Condition variable paired with a Mutex, callers recheck their condition
+// after Wait returns
+class CondVar final
+{
+public:
+    CondVar();
+    ~CondVar();
+
+    // unlocks mutex, blocks until signaled and locks it again
+    void Wait(Mutex& mutex);
+
+    void Signal();
+
+    void Broadcast();
+
+private:
+    CondVar(const CondVar& other) = delete;
+    CondVar(CondVar&& other) = delete;
+    CondVar& operator=(const CondVar& other) = delete;
+    CondVar& operator=(CondVar&& other) = delete;
+
+    WaitQueue WaitQueue;
+};
+
+}
@@ -1,82 +1,192 @@
 #include "object_table.h"
+#include "asm.h"
+#include "panic.h"
 
 namespace Kernel
 {
 
+ObjectTable::Slot::Slot()
+    : NextFree(InvalidIndex)
+    , Index(InvalidIndex)
+    , Table(nullptr)
+    , Removed(nullptr)
+{
+}
+
 ObjectTable::ObjectTable()
+    : ChunkCount(0)
+    , FreeHead(InvalidIndex)
+    , Count(0)
 {
-    for (ObjectId objectId = 0; objectId < Stdlib::ArraySize(ObjectArray); objectId++)
+    for (size_t i = 0; i < Stdlib::ArraySize(Chunk); i++)
     {
-        ObjectArray[objectId] = nullptr;
+        Chunk[i] = nullptr;
     }
 }
 
-ulong ObjectTable::Insert(Object *object)
+ObjectTable::Slot* ObjectTable::GetSlot(ulong index)
 {
-    object->Get();
+    ulong chunkIndex = index >> ChunkShift;
+    if (chunkIndex >= MaxChunks)
+        return nullptr;
+
+    Slot* chunk = Chunk[chunkIndex];
+    if (chunk == nullptr)
+        return nullptr;
+
+    return &chunk[index & (ChunkSize - 1)];
+}
+
+bool ObjectTable::Grow()
+{
+    Slot* chunk = new Slot[ChunkSize];
+    if (chunk == nullptr)
+        return false;
+
     {
         Stdlib::AutoLock lock(Lock);
-        for (ObjectId objectId = 0; objectId < Stdlib::ArraySize(ObjectArray); objectId++)
+        if (FreeHead != InvalidIndex)
         {
-            if (ObjectArray[objectId] == nullptr)
+            delete[] chunk;
+            return true;
+        }
+
+        if (ChunkCount == MaxChunks)
+        {
+            delete[] chunk;
+            return false;
+        }
+
+        ulong base = ChunkCount << ChunkShift;
+        for (ulong i = 0; i < ChunkSize; i++)
+        {
+            chunk[i].NextFree = (i + 1 < ChunkSize) ? (base + i + 1) : InvalidIndex;
+            chunk[i].Index = base + i;
+            chunk[i].Table = this;
+        }
+
+        Barrier();
+        Chunk[ChunkCount] = chunk;
+        ChunkCount++;
+        FreeHead = base;
+    }
+
+    return true;
+}
+
+ObjectId ObjectTable::Insert(Object *object)
+{
+    object->Get();
+    for (;;)
+    {
+        {
+            Stdlib::AutoLock lock(Lock);
+            if (FreeHead != InvalidIndex)
             {
-                ObjectArray[objectId] = object;
-                return objectId;
+                ulong index = FreeHead;
+                Slot* slot = GetSlot(index);
+                FreeHead = slot->NextFree;
+                slot->NextFree = InvalidIndex;
+                ulong generation = slot->Generation.Get();
+                slot->Ptr.Set(reinterpret_cast<long>(object));
+                Count++;
+                return (generation << IndexBits) | index;
             }
         }
+
+        if (!Grow())
+            break;
     }
     object->Put();
     return InvalidObjectId;
 }
 
-void ObjectTable::Remove(ulong objectId)
+void ObjectTable::ReleaseSlot(RcuHead* head)
 {
-    if (objectId >= Stdlib::ArraySize(ObjectArray))
-        return;
+    Slot* slot = CONTAINING_RECORD(head, Slot, RcuEntry);
+    ObjectTable* table = slot->Table;
+    Object* object = slot->Removed;
+    slot->Removed = nullptr;
 
-    Object* object = nullptr;
     {
-        Stdlib::AutoLock lock(Lock);
-        object = ObjectArray[objectId];
-        ObjectArray[objectId] = nullptr;
+        Stdlib::AutoLock lock(table->Lock);
+        slot->NextFree = table->FreeHead;
+        table->FreeHead = slot->Index;
+        table->Count--;
     }
 
-    if (object != nullptr)
-    {
-        object->Put();
-    }
+    object->Put();
 }
 
-Object* ObjectTable::Lookup(ulong objectId)
+void ObjectTable::Remove(ObjectId objectId)
 {
-    if (objectId >= Stdlib::ArraySize(ObjectArray))
-        return nullptr;
+    ulong index = objectId & IndexMask;
+    ulong generation = objectId >> IndexBits;
+    Slot* slot = GetSlot(index);
+    if (slot == nullptr)
+        return;
 
-    Object* object = nullptr;
     {
         Stdlib::AutoLock lock(Lock);
-        object = ObjectArray[objectId];
-        if (object != nullptr)
-        {
-            object->Get();
-            return object;
-        }
+        if (static_cast<ulong>(slot->Generation.Get()) != generation)
+            return;
+
+        Object* object = reinterpret_cast<Object*>(slot->Ptr.Xchg(0));
+        if (object == nullptr)
+            return;
+
+        slot->Generation.Set((generation + 1) & GenerationMask);
+        slot->Removed = object;
     }
 
-    return nullptr;
+    // a lookup that saw the object may still be taking its reference
+    Rcu::GetInstance().Call(&slot->RcuEntry, &ObjectTable::ReleaseSlot);
+}
+
+Object* ObjectTable::Lookup(ObjectId objectId)
+{
+    ulong index = objectId & IndexMask;
+    ulong generation = objectId >> IndexBits;
+    Slot* slot = GetSlot(index);
+    if (slot == nullptr)
+        return nullptr;
+
+    RcuReadLock();
+    Object* object = reinterpret_cast<Object*>(slot->Ptr.Get());
+    if (object != nullptr && static_cast<ulong>(slot->Generation.Get()) == generation)
+        object->Get();
+    else
+        object = nullptr;
+    RcuReadUnlock();
+
+    return object;
+}
+
+size_t ObjectTable::GetCount()
+{
+    Stdlib::SharedAutoLock lock(Lock);
+    return Count;
 }
 
 ObjectTable::~ObjectTable()
 {
-    for (size_t objectId = 0; objectId < Stdlib::ArraySize(ObjectArray); objectId++)
+    // slots of removed objects are still queued for release
+    Rcu::GetInstance().WaitForCallbacks();
+
+    for (size_t i = 0; i < ChunkCount; i++)
     {
-        Object* object = ObjectArray[objectId];
-        ObjectArray[objectId] = nullptr;
-        if (object != nullptr)
+        Slot* chunk = Chunk[i];
+        for (size_t j = 0; j < ChunkSize; j++)
         {
-            object->Put();
+            Object* object = reinterpret_cast<Object*>(chunk[j].Ptr.Xchg(0));
+            if (object != nullptr)
+            {
+                object->Put();
+            }
         }
+        Chunk[i] = nullptr;
+        delete[] chunk;
     }
 }
 
-}
\ No newline at end of file
+}
@@ -2,6 +2,8 @@
 
 #include <lib/stdlib.h>
 #include "spin_lock.h"
+#include "atomic.h"
+#include "rcu.h"
 
 namespace Kernel
 {
@@ -17,17 +19,50 @@ using ObjectId = ulong;
 
 const ObjectId InvalidObjectId = ~((ObjectId)0);
 
+// Id is (generation << IndexBits) | slot index. Slots live in chunks that are
+// allocated on demand and never freed before the table, free slots form a
+// list, so Insert and Remove are O(1) under Lock. Lookup is an RCU read
+// section: Remove unpublishes the object and bumps the generation, so stale
+// ids miss, and drops the table reference and frees the slot only after a
+// grace period.
 class ObjectTable final
 {
 public:
     ObjectTable();
     ~ObjectTable();
 
-    ulong Insert(Object *object);
+    ObjectId Insert(Object *object);
 
-    void Remove(ulong objectId);
+    void Remove(ObjectId objectId);
 
-    Object* Lookup(ulong objectId);
+    Object* Lookup(ObjectId objectId);
+
+    size_t GetCount();
+
+    // calls func(id, object) for every object in an RCU read section, so
+    // no lock is taken and func must not block. Objects removed meanwhile
+    // may or may not be seen, but stay valid until func returns
+    template<typename Func>
+    void ForEach(Func func)
+    {
+        RcuReadLock();
+        for (ulong i = 0; i < MaxChunks; i++)
+        {
+            Slot* chunk = Chunk[i];
+            if (chunk == nullptr)
+                break;
+
+            for (ulong j = 0; j < ChunkSize; j++)
+            {
+                Slot& slot = chunk[j];
+                ulong generation = static_cast<ulong>(slot.Generation.Get());
+                Object* object = reinterpret_cast<Object*>(slot.Ptr.Get());
+                if (object != nullptr)
+                    func((generation << IndexBits) | slot.Index, object);
+            }
+        }
+        RcuReadUnlock();
+    }
 
 private:
     ObjectTable(const ObjectTable& other) = delete;
@@ -35,11 +70,41 @@ private:
     ObjectTable& operator=(const ObjectTable& other) = delete;
     ObjectTable& operator=(ObjectTable&& other) = delete;
 
-    static const ulong MaxObjectId = 256;
+    static const ulong ChunkShift = 8;
+    static const ulong ChunkSize = 1UL << ChunkShift;
+    static const ulong MaxChunks = 256;
+    static const ulong IndexBits = 16;
+    static const ulong IndexMask = (1UL << IndexBits) - 1;
+    // top bit stays clear so no id equals InvalidObjectId
+    static const ulong GenerationMask = (1UL << (63 - IndexBits)) - 1;
+    static const ulong InvalidIndex = ~0UL;
+
+    static_assert(ChunkSize * MaxChunks == (1UL << IndexBits), "Invalid index bits");
+
+    struct Slot
+    {
+        Slot();
+
+        Atomic Ptr;
+        Atomic Generation;
+        ulong NextFree;
+        ulong Index;
+        ObjectTable* Table;
+        Object* Removed;
+        RcuHead RcuEntry;
+    };
+
+    Slot* GetSlot(ulong index);
+    bool Grow();
+
+    static void ReleaseSlot(RcuHead* head);
 
-    Object* ObjectArray[MaxObjectId];
+    Slot* volatile Chunk[MaxChunks];
+    ulong ChunkCount;
+    ulong FreeHead;
+    ulong Count;
 
     SpinLock Lock;
 };
 
-}
\ No newline at end of file
+}
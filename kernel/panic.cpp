@@ -39,8 +39,9 @@ void Panicker::DoPanic(const char *fmt, ...)
     PreemptDisable();
     InterruptDisable();
 
-    Cpu& cpu = CpuTable::GetInstance().GetCurrentCpu();
-    CpuTable::GetInstance().SendIPIAllExclude(cpu.GetIndex());
+    // cpus may not be allocated yet this early
+    auto& cpus = CpuTable::GetInstance();
+    cpus.SendIPIAllExclude(cpus.GetCurrentCpuId(), CpuTable::StopVector);
 
     if (first && Parameters::GetInstance().IsPanicVga())
     {
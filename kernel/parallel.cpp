@@ -0,0 +1,352 @@
+#include "parallel.h"
+#include "cpu.h"
+#include "task.h"
+#include "preempt.h"
+#include "panic.h"
+
+namespace Kernel
+{
+
+TaskGroup::TaskGroup()
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    BugOn(Pending.Get() != 0);
+}
+
+void TaskGroup::Run(JobFunc func, void* ctx)
+{
+    auto job = new Job();
+    if (job == nullptr)
+    {
+        func(ctx);
+        return;
+    }
+
+    job->Func = func;
+    job->Ctx = ctx;
+    job->Group = this;
+    Pending.Inc();
+    if (!ParallelPool::GetInstance().Push(job))
+        ParallelPool::RunJob(job);
+}
+
+void TaskGroup::OnJobDone()
+{
+    Completing.Inc();
+    if (Pending.DecAndTest())
+        WaitQueue.WakeUpAll();
+    Completing.Dec();
+}
+
+void TaskGroup::Wait()
+{
+    auto& pool = ParallelPool::GetInstance();
+
+    while (Pending.Get() != 0)
+    {
+        // run anything while waiting, the jobs of this group may be queued
+        // under other jobs on this cpu
+        Job* job = pool.Take();
+        if (job != nullptr)
+        {
+            ParallelPool::RunJob(job);
+            continue;
+        }
+
+        WaitQueue.Prepare();
+        if (Pending.Get() == 0)
+        {
+            WaitQueue.Finish();
+            break;
+        }
+        WaitQueue.Wait();
+    }
+
+    // the last completer may still be waking us up
+    Completing.WaitUntil([](long value) { return value == 0; });
+}
+
+struct ParallelRange
+{
+    TaskGroup* Group;
+    ulong Begin;
+    ulong End;
+    ulong Grain;
+    ParallelForFunc Func;
+    void* Ctx;
+};
+
+static void ParallelRangeRun(void* ctx)
+{
+    auto range = static_cast<ParallelRange*>(ctx);
+
+    while (range->End - range->Begin > range->Grain)
+    {
+        ulong middle = range->Begin + (range->End - range->Begin) / 2;
+        auto upper = new ParallelRange(*range);
+        if (upper == nullptr)
+            break;
+
+        upper->Begin = middle;
+        range->End = middle;
+        range->Group->Run(ParallelRangeRun, upper);
+    }
+
+    range->Func(range->Begin, range->End, range->Ctx);
+    delete range;
+}
+
+void ParallelFor(ulong begin, ulong end, ulong grain, ParallelForFunc func, void* ctx)
+{
+    if (begin >= end)
+        return;
+
+    TaskGroup group;
+    auto range = new ParallelRange();
+    if (range == nullptr)
+    {
+        func(begin, end, ctx);
+        return;
+    }
+
+    range->Group = &group;
+    range->Begin = begin;
+    range->End = end;
+    range->Grain = (grain != 0) ? grain : 1;
+    range->Func = func;
+    range->Ctx = ctx;
+
+    ParallelRangeRun(range);
+    group.Wait();
+}
+
+ParallelPool::Deque::Deque()
+    : Top(0)
+    , Bottom(0)
+    , Task(nullptr)
+{
+}
+
+ParallelPool::ParallelPool()
+    : Active(false)
+{
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuDeque); i++)
+        CpuDeque[i] = nullptr;
+}
+
+ParallelPool::~ParallelPool()
+{
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuDeque); i++)
+    {
+        if (CpuDeque[i] != nullptr)
+        {
+            if (CpuDeque[i]->Task != nullptr)
+                CpuDeque[i]->Task->Put();
+            delete CpuDeque[i];
+            CpuDeque[i] = nullptr;
+        }
+    }
+}
+
+void ParallelPool::RunJob(Job* job)
+{
+    TaskGroup* group = job->Group;
+    JobFunc func = job->Func;
+    void* ctx = job->Ctx;
+
+    delete job;
+    func(ctx);
+    group->OnJobDone();
+}
+
+bool ParallelPool::Push(Job* job)
+{
+    if (!Active)
+        return false;
+
+    bool result = false;
+    PreemptDisable();
+    auto deque = CpuDeque[GetPerCpuIndex()];
+    if (deque != nullptr)
+    {
+        Stdlib::AutoLock lock(deque->Lock);
+        if (deque->Bottom - deque->Top < DequeSize)
+        {
+            deque->Slot[deque->Bottom % DequeSize] = job;
+            deque->Bottom = deque->Bottom + 1;
+            result = true;
+        }
+    }
+    PreemptEnable();
+
+    // sleepers link themselves before they look at the deques
+    if (result)
+        IdleQueue.WakeUpOne();
+
+    return result;
+}
+
+Job* ParallelPool::PopBottom(Deque* deque)
+{
+    Stdlib::AutoLock lock(deque->Lock);
+    if (deque->Bottom == deque->Top)
+        return nullptr;
+
+    deque->Bottom = deque->Bottom - 1;
+    return deque->Slot[deque->Bottom % DequeSize];
+}
+
+Job* ParallelPool::PopTop(Deque* deque)
+{
+    Stdlib::AutoLock lock(deque->Lock);
+    if (deque->Bottom == deque->Top)
+        return nullptr;
+
+    Job* job = deque->Slot[deque->Top % DequeSize];
+    deque->Top = deque->Top + 1;
+    return job;
+}
+
+Job* ParallelPool::Take()
+{
+    ulong self;
+    PreemptDisable();
+    self = GetPerCpuIndex();
+    PreemptEnable();
+
+    if (CpuDeque[self] != nullptr)
+    {
+        Job* job = PopBottom(CpuDeque[self]);
+        if (job != nullptr)
+            return job;
+    }
+
+    // steal starting after ourselves so thieves spread over the victims
+    CpuMask mask = DequeMask.Get();
+    for (ulong i = mask.Next(self + 1); i < MaxCpus; i = mask.Next(i + 1))
+    {
+        Job* job = Steal(CpuDeque[i]);
+        if (job != nullptr)
+            return job;
+    }
+
+    for (ulong i = mask.First(); i < self; i = mask.Next(i + 1))
+    {
+        Job* job = Steal(CpuDeque[i]);
+        if (job != nullptr)
+            return job;
+    }
+
+    return nullptr;
+}
+
+Job* ParallelPool::Steal(Deque* deque)
+{
+    if (deque->Bottom == deque->Top)
+        return nullptr;
+
+    return PopTop(deque);
+}
+
+bool ParallelPool::HasJob()
+{
+    CpuMask mask = DequeMask.Get();
+    for (ulong i = mask.First(); i < MaxCpus; i = mask.Next(i + 1))
+    {
+        auto deque = CpuDeque[i];
+        if (deque->Bottom != deque->Top)
+            return true;
+    }
+
+    return false;
+}
+
+void ParallelPool::RunFunc(void* ctx)
+{
+    auto pool = static_cast<ParallelPool*>(ctx);
+    auto task = Task::GetCurrentTask();
+
+    while (!task->IsStopping())
+    {
+        Job* job = pool->Take();
+        if (job != nullptr)
+        {
+            RunJob(job);
+            continue;
+        }
+
+        pool->IdleQueue.Prepare();
+        if (pool->HasJob() || task->IsStopping())
+        {
+            pool->IdleQueue.Finish();
+            continue;
+        }
+        pool->IdleQueue.Wait();
+    }
+}
+
+bool ParallelPool::Setup()
+{
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask running = cpus.GetRunningCpus();
+
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+    {
+        if (CpuDeque[i] != nullptr)
+            continue;
+
+        auto deque = new Deque();
+        if (deque == nullptr)
+            return false;
+
+        deque->Task = new class Task("parallel%u", i);
+        if (deque->Task == nullptr)
+        {
+            delete deque;
+            return false;
+        }
+
+        CpuMask affinity;
+        affinity.Set(i);
+        deque->Task->SetCpuAffinity(affinity);
+        CpuDeque[i] = deque;
+        if (!deque->Task->Start(&ParallelPool::RunFunc, this))
+        {
+            CpuDeque[i] = nullptr;
+            deque->Task->Put();
+            delete deque;
+            return false;
+        }
+        DequeMask.Set(i);
+    }
+
+    Barrier();
+    Active = true;
+    return true;
+}
+
+void ParallelPool::Stop()
+{
+    if (!Active)
+        return;
+
+    // new jobs run inline, queued ones are taken by their waiters
+    Active = false;
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuDeque); i++)
+    {
+        if (CpuDeque[i] != nullptr)
+            CpuDeque[i]->Task->SetStopping();
+    }
+
+    IdleQueue.WakeUpAll();
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuDeque); i++)
+    {
+        if (CpuDeque[i] != nullptr)
+            CpuDeque[i]->Task->Wait();
+    }
+}
+
+}
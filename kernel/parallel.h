@@ -0,0 +1,124 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/stdlib.h>
+
+#include "atomic.h"
+#include "cpu_mask.h"
+#include "per_cpu.h"
+#include "spin_lock.h"
+#include "wait_queue.h"
+#include "forward.h"
+
+namespace Kernel
+{
+
+typedef void (*JobFunc)(void* ctx);
+
+class TaskGroup;
+
+struct Job final
+{
+    JobFunc Func;
+    void* Ctx;
+    TaskGroup* Group;
+};
+
+// Fork-join group: Run queues a job on the current cpu's deque, Wait runs
+// queued and stolen jobs until every job of the group is done, so a job may
+// itself Run and Wait on a nested group.
+class TaskGroup final
+{
+public:
+    TaskGroup();
+    ~TaskGroup();
+
+    // runs func inline if the job can't be queued
+    void Run(JobFunc func, void* ctx);
+
+    void Wait();
+
+    // called by the pool after a job of the group returns
+    void OnJobDone();
+
+private:
+    TaskGroup(const TaskGroup& other) = delete;
+    TaskGroup(TaskGroup&& other) = delete;
+    TaskGroup& operator=(const TaskGroup& other) = delete;
+    TaskGroup& operator=(TaskGroup&& other) = delete;
+
+    Atomic Pending;
+    // completers still touching the group after Pending dropped to zero
+    Atomic Completing;
+    WaitQueue WaitQueue;
+};
+
+typedef void (*ParallelForFunc)(ulong begin, ulong end, void* ctx);
+
+// calls func on disjoint subranges of [begin, end) no shorter than grain
+// (but the last), halving the range so idle cpus steal the larger halves
+void ParallelFor(ulong begin, ulong end, ulong grain, ParallelForFunc func, void* ctx);
+
+// Persistent worker per cpu: each cpu has a deque of jobs, the owner pushes
+// and pops at the bottom, idle workers and waiters steal from the top of the
+// others.
+class ParallelPool final
+{
+public:
+    static ParallelPool& GetInstance()
+    {
+        static ParallelPool Instance;
+        return Instance;
+    }
+
+    // starts a worker pinned to every running cpu
+    bool Setup();
+
+    void Stop();
+
+    // false if the deque of the current cpu is full or the pool isn't set up
+    bool Push(Job* job);
+
+    // a job of the current cpu or stolen from another one, nullptr if none
+    Job* Take();
+
+    static void RunJob(Job* job);
+
+private:
+    ParallelPool();
+    ~ParallelPool();
+    ParallelPool(const ParallelPool& other) = delete;
+    ParallelPool(ParallelPool&& other) = delete;
+    ParallelPool& operator=(const ParallelPool& other) = delete;
+    ParallelPool& operator=(ParallelPool&& other) = delete;
+
+    static const size_t DequeSize = 256;
+
+    struct Deque
+    {
+        Deque();
+
+        FastSpinLock Lock;
+        // jobs are Slot[Top % DequeSize] .. Slot[(Bottom - 1) % DequeSize]
+        volatile ulong Top;
+        volatile ulong Bottom;
+        Job* Slot[DequeSize];
+        class Task* Task;
+    };
+
+    static void RunFunc(void* ctx);
+
+    Job* PopBottom(Deque* deque);
+    Job* PopTop(Deque* deque);
+    Job* Steal(Deque* deque);
+    bool HasJob();
+
+    Deque* CpuDeque[MaxCpus];
+    // cpus whose CpuDeque is set, so scans skip the empty slots
+    AtomicCpuMask DequeMask;
+    volatile bool Active;
+    // idle workers sleep here
+    WaitQueue IdleQueue;
+};
+
+}
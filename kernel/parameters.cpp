@@ -1,6 +1,7 @@
 #include "parameters.h"
 #include "panic.h"
 #include "trace.h"
+#include "tunable.h"
 
 namespace Kernel
 {
@@ -9,7 +10,17 @@ Parameters::Parameters()
     : TraceVga(false)
     , PanicVga(false)
     , SmpOff(false)
+    , TickPeriodic(false)
+    , IdleMode(IdleHlt)
+    , WatchdogPeriodMs(DefaultWatchdogPeriodMs)
+    , IrqMask(0)
+    , IrqBalance(false)
+    , BlkQueueDepth(DefaultBlkQueueDepth)
+    , BlkBatch(DefaultBlkBatch)
+    , Readahead(DefaultReadahead)
 {
+    Bench[0] = '\0';
+    PerfTest[0] = '\0';
 }
 
 Parameters::~Parameters()
@@ -31,12 +42,64 @@ bool Parameters::IsSmpOff()
     return SmpOff;
 }
 
+bool Parameters::IsTickPeriodic()
+{
+    return TickPeriodic;
+}
+
+const char* Parameters::GetBench()
+{
+    return Bench;
+}
+
+const char* Parameters::GetPerfTest()
+{
+    return PerfTest;
+}
+
+ulong Parameters::GetIdleMode()
+{
+    return IdleMode;
+}
+
+ulong Parameters::GetWatchdogPeriodMs()
+{
+    return WatchdogPeriodMs;
+}
+
+ulong Parameters::GetIrqMask()
+{
+    return IrqMask;
+}
+
+bool Parameters::IsIrqBalance()
+{
+    return IrqBalance;
+}
+
+ulong Parameters::GetBlkQueueDepth()
+{
+    return BlkQueueDepth;
+}
+
+ulong Parameters::GetBlkBatch()
+{
+    return BlkBatch;
+}
+
+ulong Parameters::GetReadahead()
+{
+    return Readahead;
+}
+
 bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
 {
     if (BugOn(start >= end))
         return false;
 
-    const size_t maxLen = 20;
+    // room for the longest key and a value that fills the largest string
+    // parameter, so perftest=alloc,sched,btree and the like fit
+    const size_t maxLen = MaxKeyLen + 1 + (Stdlib::ArraySize(PerfTest) - 1);
     char param[maxLen + 1];
     size_t len = end - start;
     if (len > maxLen)
@@ -73,7 +136,7 @@ bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
             Trace(0, "Unknown value %s, key %s", value, key);
         }
     }
-    if (Stdlib::StrCmp(key, "panic") == 0)
+    else if (Stdlib::StrCmp(key, "panic") == 0)
     {
         if (Stdlib::StrCmp(value, "vga") == 0)
         {
@@ -84,7 +147,7 @@ bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
             Trace(0, "Unknown value %s, key %s", value, key);
         }        
     }
-    if (Stdlib::StrCmp(key, "smp") == 0)
+    else if (Stdlib::StrCmp(key, "smp") == 0)
     {
         if (Stdlib::StrCmp(value, "off") == 0)
         {
@@ -95,6 +158,114 @@ bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
             Trace(0, "Unknown value %s, key %s", value, key);
         }
     }
+    else if (Stdlib::StrCmp(key, "tick") == 0)
+    {
+        if (Stdlib::StrCmp(value, "periodic") == 0)
+        {
+            TickPeriodic = true;
+        }
+        else
+        {
+            Trace(0, "Unknown value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "idle") == 0)
+    {
+        if (Stdlib::StrCmp(value, "hlt") == 0)
+        {
+            IdleMode = IdleHlt;
+        }
+        else if (Stdlib::StrCmp(value, "poll") == 0)
+        {
+            IdleMode = IdlePoll;
+        }
+        else if (Stdlib::StrCmp(value, "mwait") == 0)
+        {
+            IdleMode = IdleMwait;
+        }
+        else
+        {
+            Trace(0, "Unknown value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "watchdog") == 0)
+    {
+        if (!Stdlib::StringToUlong(value, WatchdogPeriodMs))
+        {
+            WatchdogPeriodMs = DefaultWatchdogPeriodMs;
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "irqmask") == 0)
+    {
+        if (!Stdlib::StringToUlong(value, IrqMask))
+        {
+            IrqMask = 0;
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "irqbalance") == 0)
+    {
+        if (Stdlib::StrCmp(value, "on") == 0)
+        {
+            IrqBalance = true;
+        }
+        else if (Stdlib::StrCmp(value, "off") == 0)
+        {
+            IrqBalance = false;
+        }
+        else
+        {
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "blkqdepth") == 0)
+    {
+        if (!Stdlib::StringToUlong(value, BlkQueueDepth) || BlkQueueDepth == 0)
+        {
+            BlkQueueDepth = DefaultBlkQueueDepth;
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "blkbatch") == 0)
+    {
+        if (!Stdlib::StringToUlong(value, BlkBatch) || BlkBatch == 0)
+        {
+            BlkBatch = DefaultBlkBatch;
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "readahead") == 0)
+    {
+        if (!Stdlib::StringToUlong(value, Readahead))
+        {
+            Readahead = DefaultReadahead;
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "bench") == 0)
+    {
+        if (Stdlib::SnPrintf(Bench, Stdlib::ArraySize(Bench), "%s", value) < 0)
+        {
+            Bench[0] = '\0';
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "perftest") == 0)
+    {
+        if (Stdlib::SnPrintf(PerfTest, Stdlib::ArraySize(PerfTest), "%s", value) < 0)
+        {
+            PerfTest[0] = '\0';
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
+    else if (TunableTable::GetInstance().Find(key) != nullptr)
+    {
+        if (!TunableTable::GetInstance().Set(key, value, true))
+        {
+            Trace(0, "Invalid value %s, key %s", value, key);
+        }
+    }
     else
     {
         Trace(0, "Unknown key %s, skipping", key);
@@ -17,15 +17,73 @@ public:
     bool IsTraceVga();
     bool IsPanicVga();
     bool IsSmpOff();
+    bool IsTickPeriodic();
+
+    // benchmark prefix to run at boot, empty if none
+    const char* GetBench();
+
+    // perftest=<prefix>[,<prefix>...] runs those benchmarks at boot,
+    // reports them on the serial port as key=value lines and exits, empty
+    // if none
+    const char* GetPerfTest();
+
+    // how idle cpus wait for work, idle=hlt|poll|mwait
+    static const ulong IdleHlt = 0;
+    static const ulong IdlePoll = 1;
+    static const ulong IdleMwait = 2;
+
+    ulong GetIdleMode();
+
+    // watchdog=<ms>, time to check every registered lock once, 0 turns
+    // the checks off
+    ulong GetWatchdogPeriodMs();
+
+    static const ulong DefaultWatchdogPeriodMs = 100;
+
+    // irqmask=<decimal cpu bitmask> restricts every io apic irq to those
+    // cpus, 0 leaves them on any cpu
+    ulong GetIrqMask();
+
+    // irqbalance=on starts the irq balancer at boot
+    bool IsIrqBalance();
+
+    // blkqdepth=<n> descriptors per virtio-blk queue, clipped to what the
+    // device allows and rounded down to a power of two
+    ulong GetBlkQueueDepth();
+
+    static const ulong DefaultBlkQueueDepth = 128;
+
+    // blkbatch=<n> requests submitted per device notify
+    ulong GetBlkBatch();
+
+    static const ulong DefaultBlkBatch = 16;
+
+    // readahead=<n> largest readahead window of the page cache in pages,
+    // 0 turns readahead off
+    ulong GetReadahead();
+
+    static const ulong DefaultReadahead = 32;
 
     Parameters();
     ~Parameters();
 private:
     bool ParseParameter(const char *cmdline, size_t start, size_t end);
 
+    static const size_t MaxKeyLen = 20;
+
     char Cmdline[256];
     bool TraceVga;
     bool PanicVga;
     bool SmpOff;
+    bool TickPeriodic;
+    ulong IdleMode;
+    ulong WatchdogPeriodMs;
+    ulong IrqMask;
+    bool IrqBalance;
+    ulong BlkQueueDepth;
+    ulong BlkBatch;
+    ulong Readahead;
+    char Bench[16];
+    char PerfTest[64];
 };
 }
\ No newline at end of file
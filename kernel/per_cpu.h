@@ -0,0 +1,159 @@
+#pragma once
+
+#include <include/types.h>
+
+#include "forward.h"
+
+namespace Kernel
+{
+
+const ulong MaxCpus = 256;
+
+// slots of PerCpuCounter in every per-cpu area
+const ulong PerCpuCounterSlots = 128;
+
+// Per-cpu area, the GS base of every cpu points to its own instance so
+// fields are read by a single gs-relative load. Fields are written only
+// by the owning cpu.
+struct PerCpu final
+{
+    PerCpu* Self;
+    class Cpu* Cpu;
+    class Task* Task;
+    // the syscall entry switches to KernelRsp, the stack of the current
+    // user task, and parks the user rsp in UserRsp meanwhile
+    ulong KernelRsp;
+    ulong UserRsp;
+    ulong Index;
+    ulong Node;
+    ulong IPICounter;
+    // raw tsc ticks spent in interrupt handlers and their count
+    ulong IrqTicks;
+    ulong IrqCounter;
+    // raw tsc ticks charged to tasks, the idle task included
+    ulong RunTicks;
+    struct InterruptStats* IrqStats;
+    // preemption disable depth, the top bit is set while no reschedule is
+    // pending so a decrement hits zero only when one is due
+    ulong PreemptCount;
+    // KernelFpuBegin nesting depth and the area the outer section's
+    // registers are saved to when an interrupt nests
+    ulong FpuDepth;
+    void* FpuState;
+    // kvm areas of this cpu, null until registered with the host, and the
+    // steal time already taken out of task runtime
+    struct KvmCpuArea* Kvm;
+    u32* PvEoi;
+    u64 StealNs;
+    // PerCpuCounter values, written by the owning cpu only
+    ulong Counter[PerCpuCounterSlots];
+};
+
+static const u32 GsBaseMsr = 0xC0000101;
+
+// points GS at a shared area until the cpu loads its own, so per-cpu
+// accesses in early boot don't go through a zero base
+void LoadBootPerCpu();
+
+// area early per-cpu accesses of every cpu share
+PerCpu* GetBootPerCpu();
+static const ulong PreemptNoReschedBit = (ulong)1 << 63;
+
+#define PER_CPU_READ(field, value)                                  \
+    asm volatile ("movq %%gs:%c1, %0"                               \
+        : "=r"(value)                                               \
+        : "i"(__builtin_offsetof(struct PerCpu, field)))
+
+#define PER_CPU_ADD(field, value)                                   \
+    asm volatile ("addq %0, %%gs:%c1"                               \
+        :                                                           \
+        : "r"((ulong)(value)),                                      \
+          "i"(__builtin_offsetof(struct PerCpu, field))             \
+        : "memory", "cc")
+
+static inline PerCpu* GetPerCpu()
+{
+    PerCpu* perCpu;
+    PER_CPU_READ(Self, perCpu);
+    return perCpu;
+}
+
+static inline class Cpu* GetPerCpuCpu()
+{
+    class Cpu* cpu;
+    PER_CPU_READ(Cpu, cpu);
+    return cpu;
+}
+
+static inline class Task* GetPerCpuTask()
+{
+    class Task* task;
+    PER_CPU_READ(Task, task);
+    return task;
+}
+
+static inline ulong GetPerCpuIndex()
+{
+    ulong index;
+    PER_CPU_READ(Index, index);
+    return index;
+}
+
+static inline ulong GetPerCpuNode()
+{
+    ulong node;
+    PER_CPU_READ(Node, node);
+    return node;
+}
+
+static inline ulong GetPerCpuPreemptCount()
+{
+    ulong count;
+    PER_CPU_READ(PreemptCount, count);
+    return count & ~PreemptNoReschedBit;
+}
+
+static inline void PerCpuPreemptInc()
+{
+    asm volatile ("incq %%gs:%c0"
+        :
+        : "i"(__builtin_offsetof(struct PerCpu, PreemptCount))
+        : "memory", "cc");
+}
+
+// returns true if the count dropped to zero with a reschedule pending
+static inline bool PerCpuPreemptDec()
+{
+    bool resched;
+    asm volatile ("decq %%gs:%c1\n\t"
+                  "sete %0"
+        : "=q"(resched)
+        : "i"(__builtin_offsetof(struct PerCpu, PreemptCount))
+        : "memory", "cc");
+    return resched;
+}
+
+static inline void PerCpuSetNeedResched()
+{
+    asm volatile ("btrq $63, %%gs:%c0"
+        :
+        : "i"(__builtin_offsetof(struct PerCpu, PreemptCount))
+        : "memory", "cc");
+}
+
+static inline bool PerCpuNeedResched()
+{
+    ulong count;
+    PER_CPU_READ(PreemptCount, count);
+    return (count & PreemptNoReschedBit) ? false : true;
+}
+
+static inline void PerCpuClearNeedResched()
+{
+    asm volatile ("btsq $63, %%gs:%c0"
+        :
+        : "i"(__builtin_offsetof(struct PerCpu, PreemptCount))
+        : "memory", "cc");
+}
+
+}
@@ -0,0 +1,97 @@
+#include "per_cpu_counter.h"
+#include "cpu.h"
+#include "raw_spin_lock.h"
+
+namespace Kernel
+{
+
+// counters are members of singletons built before the allocator, so slots
+// come from a fixed bitmap under a raw lock (SpinLock registers with the
+// watchdog, which has counters itself)
+struct PerCpuCounterSlotMap
+{
+    RawSpinLock Lock;
+    ulong Used[PerCpuCounterSlots / 64];
+};
+
+static PerCpuCounterSlotMap& GetSlotMap()
+{
+    static PerCpuCounterSlotMap SlotMap;
+    return SlotMap;
+}
+
+static void ClearSlot(ulong slot)
+{
+    auto& cpus = CpuTable::GetInstance();
+
+    GetBootPerCpu()->Counter[slot] = 0;
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        Cpu* cpu = cpus.FindCpu(i);
+        if (cpu != nullptr)
+            cpu->GetPerCpuArea().Counter[slot] = 0;
+    }
+}
+
+PerCpuCounter::PerCpuCounter()
+    : Offset(0)
+    , Slot(InvalidSlot)
+{
+    Shared.Set(0);
+
+    auto& map = GetSlotMap();
+    map.Lock.Lock();
+    for (ulong i = 0; i < PerCpuCounterSlots; i++)
+    {
+        if (!(map.Used[i / 64] & (1UL << (i % 64))))
+        {
+            map.Used[i / 64] |= (1UL << (i % 64));
+            Slot = i;
+            break;
+        }
+    }
+    map.Lock.Unlock();
+
+    if (Slot == InvalidSlot)
+        return;
+
+    Offset = __builtin_offsetof(struct PerCpu, Counter) + Slot * sizeof(ulong);
+}
+
+PerCpuCounter::~PerCpuCounter()
+{
+    if (Slot == InvalidSlot)
+        return;
+
+    // the next owner of the slot starts from zero, the cpu table isn't
+    // touched on construction as it may not be built yet
+    Offset = 0;
+    Barrier();
+    ClearSlot(Slot);
+
+    auto& map = GetSlotMap();
+    map.Lock.Lock();
+    map.Used[Slot / 64] &= ~(1UL << (Slot % 64));
+    map.Lock.Unlock();
+    Slot = InvalidSlot;
+}
+
+long PerCpuCounter::Get()
+{
+    long sum = Shared.Get();
+    if (Slot == InvalidSlot)
+        return sum;
+
+    auto& cpus = CpuTable::GetInstance();
+    sum += static_cast<long>(*static_cast<volatile ulong*>(&GetBootPerCpu()->Counter[Slot]));
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        Cpu* cpu = cpus.FindCpu(i);
+        if (cpu != nullptr)
+            sum += static_cast<long>(*static_cast<volatile ulong*>(&cpu->GetPerCpuArea().Counter[Slot]));
+    }
+
+    return sum;
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <include/types.h>
+
+#include "atomic.h"
+#include "per_cpu.h"
+
+namespace Kernel
+{
+
+// Statistics counter with a slot in every per-cpu area: updates are a single
+// gs-relative add without lock prefix and stay in the local cache, Get sums
+// the slots of all cpus. Once the slots run out counters fall back to a
+// shared Atomic.
+class PerCpuCounter final
+{
+public:
+    PerCpuCounter();
+    ~PerCpuCounter();
+
+    void Inc()
+    {
+        Add(1);
+    }
+
+    void Dec()
+    {
+        Add(-1);
+    }
+
+    void Add(long value)
+    {
+        if (likely(Offset != 0))
+            asm volatile ("addq %0, %%gs:(%1)"
+                :
+                : "r"(value), "r"(Offset)
+                : "memory", "cc");
+        else
+            Shared.ReadAndAdd(value);
+    }
+
+    // sum of all cpus, a snapshot while others update
+    long Get();
+
+private:
+    PerCpuCounter(const PerCpuCounter& other) = delete;
+    PerCpuCounter(PerCpuCounter&& other) = delete;
+    PerCpuCounter& operator=(const PerCpuCounter& other) = delete;
+    PerCpuCounter& operator=(PerCpuCounter&& other) = delete;
+
+    static const ulong InvalidSlot = ~0UL;
+
+    // offset of the slot in PerCpu, zero if there is no slot
+    ulong Offset;
+    ulong Slot;
+    Atomic Shared;
+};
+
+}
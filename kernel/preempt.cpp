@@ -3,6 +3,8 @@
 #include "panic.h"
 #include "asm.h"
 #include "debug.h"
+#include "per_cpu.h"
+#include "sched.h"
 
 namespace Kernel
 {
@@ -31,8 +33,7 @@ void PreemptDisable()
 {
     if (likely(PreemptIsOn()))
     {
-        auto task = Task::GetCurrentTask();
-        task->PreemptDisableCounter.Inc();
+        PerCpuPreemptInc();
     }
 }
 
@@ -40,10 +41,21 @@ void PreemptEnable()
 {
     if (likely(PreemptIsOn()))
     {
-        auto task = Task::GetCurrentTask();
-        BugOn(task->PreemptDisableCounter.Get() == 0);
-        task->PreemptDisableCounter.Dec();
+        BugOn(GetPerCpuPreemptCount() == 0);
+        // run the reschedule deferred while preemption was disabled
+        if (PerCpuPreemptDec() && IsInterruptEnabled())
+            Schedule();
     }
 }
 
+void PreemptIrqExit()
+{
+    if (unlikely(!PreemptIsOn()))
+        return;
+
+    // otherwise the PreemptEnable of the interrupted code switches
+    if (PerCpuNeedResched() && GetPerCpuPreemptCount() == 0)
+        Schedule();
+}
+
 }
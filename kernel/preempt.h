@@ -15,4 +15,8 @@ void PreemptDisable();
 
 void PreemptEnable();
 
+// called by interrupt handlers last, switches if a reschedule is pending
+// and the interrupted code was preemptible
+void PreemptIrqExit();
+
 }
\ No newline at end of file
@@ -6,6 +6,11 @@
 namespace Kernel
 {
 
+// FIFO ticket lock: waiters are served in arrival order.
+// In paravirt mode a waiter that spun ParavirtSpins times without its
+// turn coming halts its vcpu with interrupts off, so a preempted holder
+// gets the host cpu back, and the unlocker kicks the vcpu whose ticket is
+// next. The unlock then costs a locked xchg instead of a plain store.
 class RawSpinLock final
 {
 public:
@@ -14,16 +19,63 @@ public:
 
     void Lock();
     void Unlock();
+    bool TryLock();
+
+    // a snapshot, for elided sections that only watch the lock
+    bool IsLocked();
 
 	ulong LockIrqSave();
 	void UnlockIrqRestore(ulong flags);
 
+    // every cpu below cpuCount must run on its own per-cpu area
+    static void EnableParavirt(ulong cpuCount);
+
+    static const ulong ParavirtSpins = 1 << 12;
+
 private:
     RawSpinLock(const RawSpinLock& other) = delete;
     RawSpinLock(RawSpinLock&& other) = delete;
     RawSpinLock& operator=(const RawSpinLock& other) = delete;
     RawSpinLock& operator=(RawSpinLock&& other) = delete;
 
-    Atomic Value;
+    void WaitParavirt(long ticket);
+    void KickParavirt(long ticket);
+
+    static bool Paravirt;
+
+    Atomic NextTicket;
+    volatile long OwnerTicket;
+};
+
+// MCS queue lock: every waiter spins on its own node, so a release
+// touches only the next waiter's cache line. The node must stay alive
+// and unmoved between Lock and Unlock (usually on the caller's stack).
+class McsLock final
+{
+public:
+    struct Node final
+    {
+        Node* volatile Next;
+        volatile bool Locked;
+    };
+
+    McsLock();
+    ~McsLock();
+
+    void Lock(Node& node);
+    void Unlock(Node& node);
+    bool TryLock(Node& node);
+
+	ulong LockIrqSave(Node& node);
+	void UnlockIrqRestore(Node& node, ulong flags);
+
+private:
+    McsLock(const McsLock& other) = delete;
+    McsLock(McsLock&& other) = delete;
+    McsLock& operator=(const McsLock& other) = delete;
+    McsLock& operator=(McsLock&& other) = delete;
+
+    Atomic Tail;
 };
-}
\ No newline at end of file
+
+}
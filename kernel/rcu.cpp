@@ -0,0 +1,166 @@
+#include "rcu.h"
+#include "cpu.h"
+#include "sched.h"
+#include "asm.h"
+#include "panic.h"
+
+namespace Kernel
+{
+
+Rcu::Rcu()
+    : Head(nullptr)
+    , Tail(&Head)
+{
+}
+
+Rcu::~Rcu()
+{
+}
+
+ulong Rcu::StartGracePeriod()
+{
+    return GracePeriod.ReadAndInc() + 1;
+}
+
+void Rcu::QuiescentState()
+{
+    ulong gracePeriod = GracePeriod.Get();
+    auto& quiescent = CpuQuiescent[GetPerCpuIndex()];
+
+    // only write when a grace period is waiting, keeps the line shared
+    if (quiescent.Get() != (long)gracePeriod)
+        quiescent.Set(gracePeriod);
+}
+
+ulong Rcu::GetCompleted()
+{
+    CpuMask cpuMask = CpuTable::GetInstance().GetRunningCpus();
+    ulong completed = GracePeriod.Get();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+    {
+        ulong quiescent = CpuQuiescent[i].Get();
+        if (quiescent < completed)
+            completed = quiescent;
+    }
+    return completed;
+}
+
+void Rcu::Kick(ulong gracePeriod)
+{
+    auto& cpuTable = CpuTable::GetInstance();
+    CpuMask cpuMask = cpuTable.GetRunningCpus();
+    ulong self = GetPerCpuIndex();
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+    {
+        if (i == self)
+            continue;
+
+        if ((ulong)CpuQuiescent[i].Get() < gracePeriod && !cpuTable.GetCpu(i).WakeIdle())
+            cpuTable.SendIPI(i, CpuTable::ReschedVector);
+    }
+}
+
+void Rcu::Synchronize()
+{
+    if (!PreemptIsOn())
+        return;
+
+    BugOn(GetPerCpuPreemptCount() != 0);
+    BugOn(!IsInterruptEnabled());
+
+    ulong gracePeriod = StartGracePeriod();
+
+    // pinned to this cpu, no other task can be inside a read section here
+    PreemptDisable();
+    QuiescentState();
+    PreemptEnable();
+
+    while (GetCompleted() < gracePeriod)
+    {
+        Kick(gracePeriod);
+        Sleep(WaitPeriod);
+    }
+}
+
+void Rcu::Call(RcuHead* head, RcuFunc func)
+{
+    head->Func = func;
+    head->Next = nullptr;
+
+    if (!PreemptIsOn())
+    {
+        func(head);
+        return;
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    head->GracePeriod = StartGracePeriod();
+    *Tail = head;
+    Tail = &head->Next;
+    PendingCount.Inc();
+}
+
+void Rcu::ProcessCallbacks()
+{
+    if (PendingCount.Get() == 0)
+        return;
+
+    ulong completed = GetCompleted();
+    RcuHead* ready = nullptr;
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        // the queue is ordered by grace period
+        RcuHead** link = &Head;
+        while (*link != nullptr && (*link)->GracePeriod <= completed)
+            link = &(*link)->Next;
+
+        if (link != &Head)
+        {
+            ready = Head;
+            Head = *link;
+            *link = nullptr;
+            if (Head == nullptr)
+                Tail = &Head;
+        }
+    }
+
+    while (ready != nullptr)
+    {
+        RcuHead* next = ready->Next;
+        ready->Func(ready);
+        PendingCount.Dec();
+        ready = next;
+    }
+}
+
+void Rcu::Tick()
+{
+    ProcessCallbacks();
+
+    ulong oldest = 0;
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (Head != nullptr)
+            oldest = Head->GracePeriod;
+    }
+
+    if (oldest != 0)
+        Kick(oldest);
+}
+
+void Rcu::WaitForCallbacks()
+{
+    while (HasPending())
+    {
+        Synchronize();
+        ProcessCallbacks();
+    }
+}
+
+bool Rcu::HasPending()
+{
+    return (PendingCount.Get() != 0) ? true : false;
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <include/const.h>
+#include <lib/stdlib.h>
+
+#include "atomic.h"
+#include "preempt.h"
+#include "spin_lock.h"
+#include "per_cpu.h"
+
+namespace Kernel
+{
+
+struct RcuHead;
+
+using RcuFunc = void (*)(RcuHead* head);
+
+// embedded into the object whose reclamation is deferred
+struct RcuHead
+{
+    RcuHead* Next;
+    ulong GracePeriod;
+    RcuFunc Func;
+};
+
+// Quiescent state based reclamation. Readers run with preemption disabled,
+// so a cpu passing through Schedule with no preemption disabled, or going
+// idle, can't be inside a read section. A writer starts a grace period by
+// bumping GracePeriod and waits, or queues a callback, until every running
+// cpu reported a quiescent state at or after it. Lagging cpus are kicked by
+// IPI, whose handler goes through Schedule.
+class Rcu final
+{
+public:
+    static Rcu& GetInstance()
+    {
+        static Rcu Instance;
+        return Instance;
+    }
+
+    // blocks until every read section active on entry has finished, must
+    // not be called from a read section or with interrupts disabled
+    void Synchronize();
+
+    // runs func(head) once a grace period passed, from the timer cpu tick
+    void Call(RcuHead* head, RcuFunc func);
+
+    // waits until every callback queued so far has run
+    void WaitForCallbacks();
+
+    // called by the current cpu outside any read section
+    void QuiescentState();
+
+    // runs completed callbacks and kicks cpus that hold the oldest one back
+    void Tick();
+
+    bool HasPending();
+
+private:
+    Rcu();
+    ~Rcu();
+    Rcu(const Rcu& other) = delete;
+    Rcu(Rcu&& other) = delete;
+    Rcu& operator=(const Rcu& other) = delete;
+    Rcu& operator=(Rcu&& other) = delete;
+
+    ulong StartGracePeriod();
+    ulong GetCompleted();
+    void Kick(ulong gracePeriod);
+    void ProcessCallbacks();
+
+    static const ulong WaitPeriod = 1 * Const::NanoSecsInMs;
+
+    Atomic GracePeriod;
+    Atomic CpuQuiescent[MaxCpus];
+    Atomic PendingCount;
+
+    SpinLock Lock;
+    RcuHead* Head;
+    RcuHead** Tail;
+};
+
+static inline void RcuReadLock()
+{
+    PreemptDisable();
+}
+
+static inline void RcuReadUnlock()
+{
+    PreemptEnable();
+}
+
+}
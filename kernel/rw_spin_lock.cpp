@@ -0,0 +1,105 @@
+#include "rw_spin_lock.h"
+#include "asm.h"
+#include "preempt.h"
+#include "panic.h"
+#include "lock_elision.h"
+
+namespace Kernel
+{
+
+RwSpinLock::RwSpinLock()
+    : Value(0)
+{
+}
+
+RwSpinLock::~RwSpinLock()
+{
+    BugOn(Value.Get() & ~WriterWaitingBit);
+}
+
+void RwSpinLock::Lock()
+{
+    for (;;)
+    {
+        long value = Value.Get();
+        if ((value & ~WriterWaitingBit) == 0)
+        {
+            // acquiring drops the waiting bit, other waiting writers set it again
+            if (Value.Cmpxchg(WriterBit, value) == value)
+                break;
+        }
+        else if (!(value & WriterWaitingBit))
+        {
+            Value.Cmpxchg(value | WriterWaitingBit, value);
+        }
+
+        Pause();
+    }
+}
+
+void RwSpinLock::Unlock()
+{
+    Value.ReadAndAdd(-WriterBit);
+}
+
+void RwSpinLock::SharedLock()
+{
+    for (;;)
+    {
+        long value = Value.Get();
+        if (!(value & (WriterBit | WriterWaitingBit)))
+        {
+            if (Value.Cmpxchg(value + ReaderUnit, value) == value)
+                break;
+        }
+
+        Pause();
+    }
+}
+
+void RwSpinLock::SharedUnlock()
+{
+    Value.ReadAndAdd(-ReaderUnit);
+}
+
+void RwSpinLock::Lock(ulong& flags)
+{
+    PreemptDisable();
+    flags = GetRflags();
+    InterruptDisable();
+    Lock();
+}
+
+void RwSpinLock::Unlock(ulong flags)
+{
+    Unlock();
+    SetRflags(flags);
+    PreemptEnable();
+}
+
+void RwSpinLock::SharedLock(ulong& flags)
+{
+    PreemptDisable();
+    flags = GetRflags();
+    InterruptDisable();
+
+    // elided readers don't bounce the reader count between cpus
+    if (StaticBranchUnlikely(LockElisionKey) && LockElisionRtm &&
+        LockElision::GetInstance().Begin([this]() {
+            return (Value.Get() & (WriterBit | WriterWaitingBit)) == 0; }))
+        return;
+
+    SharedLock();
+}
+
+void RwSpinLock::SharedUnlock(ulong flags)
+{
+    if (LockElisionRtm && XTest())
+        LockElision::GetInstance().End();
+    else
+        SharedUnlock();
+    SetRflags(flags);
+    PreemptEnable();
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "atomic.h"
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+// Reader-writer spin lock: any number of readers or one writer. A waiting
+// writer blocks new readers, so readers can't starve writers.
+class RwSpinLock final
+	: public Stdlib::LockInterface
+	, public Stdlib::SharedLockInterface
+{
+public:
+	RwSpinLock();
+
+	void Lock();
+
+	void Unlock();
+
+	void SharedLock();
+
+	void SharedUnlock();
+
+	virtual void Lock(ulong& flags) override;
+
+	virtual void Unlock(ulong flags) override;
+
+	virtual void SharedLock(ulong& flags) override;
+
+	virtual void SharedUnlock(ulong flags) override;
+
+	virtual ~RwSpinLock();
+
+private:
+	RwSpinLock(const RwSpinLock& other) = delete;
+	RwSpinLock(RwSpinLock&& other) = delete;
+	RwSpinLock& operator=(const RwSpinLock& other) = delete;
+	RwSpinLock& operator=(RwSpinLock&& other) = delete;
+
+	static const long WriterBit = 0x1;
+	static const long WriterWaitingBit = 0x2;
+	static const long ReaderUnit = 0x4;
+
+	Atomic Value;
+};
+
+}
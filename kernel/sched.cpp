@@ -6,54 +6,157 @@
 #include "asm.h"
 #include "debug.h"
 #include "cpu.h"
+#include "timer.h"
+#include "rcu.h"
+#include "gdt.h"
+#include "tunable.h"
+
+#include <mm/address_space.h>
 
 namespace Kernel
 {
 
-TaskQueue::TaskQueue()
+ulong TaskQueue::TimeSlice[Task::PriorityCount];
+
+// slice=<ms>, time slice of the priority levels SetTimeSlice didn't set
+DEFINE_TUNABLE(SliceMs, "slice", 10, 1, 1000);
+
+TaskQueue::TaskQueue(class Cpu* cpu)
+    : ReadyMask(0)
+    , MinVirtualRuntime(0)
+    , Cpu(cpu)
 {
     Stdlib::AutoLock lock(Lock);
     TaskList.Init();
+    for (size_t i = 0; i < Stdlib::ArraySize(ReadyList); i++)
+    {
+        ReadyList[i].Init();
+    }
 
+    TaskCount.Set(0);
+    ReadyCount.Set(0);
     SwitchContextCounter.Set(0);
     ScheduleCounter.Set(0);
+    StealCounter.Set(0);
+    MigrateInCounter.Set(0);
+    MigrateOutCounter.Set(0);
+    HandoffCounter.Set(0);
+    SliceExpiredCounter.Set(0);
+}
+
+void TaskQueue::EnqueueReady(Task* task)
+{
+    BugOn(task->Priority >= Stdlib::ArraySize(ReadyList));
+    BugOn(!task->ReadyListEntry.IsEmpty());
+
+    // keep each level ordered by virtual runtime, usually the task goes to the tail
+    auto& readyList = ReadyList[task->Priority];
+    auto prevEntry = readyList.Blink;
+    while (prevEntry != &readyList)
+    {
+        Task* prev = CONTAINING_RECORD(prevEntry, Task, ReadyListEntry);
+        if (prev->VirtualRuntime <= task->VirtualRuntime)
+            break;
+
+        prevEntry = prevEntry->Blink;
+    }
+    prevEntry->Flink->InsertTail(&task->ReadyListEntry);
+    ReadyMask |= ((ulong)1 << task->Priority);
+    ReadyCount.Inc();
+    task->ReadyTime = GetBootTime();
 }
 
-void TaskQueue::SwitchComplete(Task* curr)
+void TaskQueue::DequeueReady(Task* task)
+{
+    BugOn(task->ReadyListEntry.IsEmpty());
+
+    task->ReadyListEntry.RemoveInit();
+    ReadyCount.Dec();
+    if (ReadyList[task->Priority].IsEmpty())
+        ReadyMask &= ~((ulong)1 << task->Priority);
+
+    auto wait = GetBootTime() - task->ReadyTime;
+    task->WaitTime += wait;
+    if (wait > task->MaxWaitTime)
+        task->MaxWaitTime = wait;
+}
+
+void TaskQueue::UpdateMinVirtualRuntime(Task* curr)
+{
+    ulong minVirtualRuntime = ~((ulong)0);
+
+    if (curr->State.Get() == Task::StateRunning)
+        minVirtualRuntime = curr->VirtualRuntime;
+
+    for (ulong mask = ReadyMask; mask != 0; mask &= (mask - 1))
+    {
+        auto& readyList = ReadyList[Stdlib::FindFirstSetBit(mask)];
+        Task* task = CONTAINING_RECORD(readyList.Flink, Task, ReadyListEntry);
+        if (task->VirtualRuntime < minVirtualRuntime)
+            minVirtualRuntime = task->VirtualRuntime;
+    }
+
+    if (minVirtualRuntime != ~((ulong)0) && minVirtualRuntime > MinVirtualRuntime)
+        MinVirtualRuntime = minVirtualRuntime;
+}
+
+bool TaskQueue::SwitchComplete(Task* curr)
 {
     Task* prev = curr->Prev;
+    bool exited = (prev->State.Get() == Task::StateExited);
+    bool migrate = false;
 
     curr->Prev = nullptr;
+    if (!exited && prev->State.Get() != Task::StateBlocked)
+    {
+        // prev context is saved now, so it's safe to make it visible for selection
+        if (prev->CpuAffinity.Test(Cpu->GetIndex()))
+            EnqueueReady(prev);
+        else
+            migrate = true;
+    }
     curr->Lock.Unlock();
     prev->Lock.Unlock();
     Lock.Unlock();
 
-    if (prev->State.Get() != Task::StateExited)
+    // interrupts are still off, so a pending reschedule is left to the caller
+    bool resched = PerCpuPreemptDec();
+
+    if (!exited)
     {
-        auto taskQueue = prev->SelectNextTaskQueue();
-        if (taskQueue != nullptr)
+        if (migrate)
         {
-            prev->Get();
-            prev->TaskQueue->Remove(prev);
-            taskQueue->Insert(prev);
-            prev->Put();
+            auto taskQueue = prev->SelectNextTaskQueue();
+            if (taskQueue != nullptr && taskQueue != this)
+            {
+                MigrateOutCounter.Inc();
+                taskQueue->MigrateInCounter.Inc();
+                prev->Get();
+                prev->TaskQueue->Remove(prev);
+                taskQueue->Insert(prev);
+                prev->Put();
+            }
+            else
+            {
+                Stdlib::AutoLock lock(Lock);
+                Stdlib::AutoLock lock2(prev->Lock);
+                EnqueueReady(prev);
+            }
         }
-
-        prev->PreemptDisableCounter.Dec();
     } else {
-
-        prev->PreemptDisableCounter.Dec();
         prev->Put();
     }
+
+    // the requeue above may have asked for one too
+    return resched || PerCpuNeedResched();
 }
 
-void TaskQueue::SwitchComplete(void* ctx)
+bool TaskQueue::FinishSwitch(Task* curr)
 {
-    Task* curr = static_cast<Task*>(ctx);
-    curr->TaskQueue->SwitchComplete(curr);
+    return curr->TaskQueue->SwitchComplete(curr);
 }
 
-void TaskQueue::Switch(Task* next, Task* curr)
+bool TaskQueue::Switch(Task* next, Task* curr)
 {
     SwitchContextCounter.Inc();
 
@@ -62,47 +165,96 @@ void TaskQueue::Switch(Task* next, Task* curr)
     BugOn(next->Rsp == 0);
 
     if (curr->State.Get() != Task::StateExited)
-        curr->State.Set(Task::StateWaiting);
+    {
+        if (curr->BlockPending)
+        {
+            // off the queue until WaitQueue wakes it up
+            curr->BlockPending = false;
+            curr->State.Set(Task::StateBlocked);
+        }
+        else
+        {
+            curr->State.Set(Task::StateWaiting);
+        }
+    }
 
     curr->ContextSwitches.Inc();
-    curr->UpdateRuntime();
 
     BugOn(next->State.Get() == Task::StateExited);
     next->State.Set(Task::StateRunning);
-    next->RunStartTime = GetBootTime();
+    next->RunStartTsc = ReadTsc();
+    next->SliceStartTsc = next->RunStartTsc;
     next->Prev = curr;
-    SwitchContext(next->Rsp, &curr->Rsp, &TaskQueue::SwitchComplete, next);
+    GetPerCpu()->Task = next;
+
+    // user tasks enter the kernel on their own stack, kernel tasks run in
+    // whatever space is loaded until a user task left it
+    auto space = next->GetAddressSpace();
+    if (space != nullptr)
+    {
+        ulong stackTop = next->GetKernelStackTop();
+        Gdt::GetInstance().SetKernelStack(Cpu->GetIndex(), stackTop);
+        GetPerCpu()->KernelRsp = stackTop;
+        space->Activate();
+    }
+    else if (curr->GetAddressSpace() != nullptr)
+    {
+        Mm::AddressSpace::ActivateKernel();
+    }
+
+    SwitchContext(next->Rsp, &curr->Rsp);
+
+    // curr runs again, maybe on another cpu, so this queue is stale
+    return FinishSwitch(curr);
 }
 
-Task* TaskQueue::SelectNext(Task *curr)
+bool TaskQueue::CanYieldTo(Task* curr, Task* target)
 {
-    Task* next = nullptr;
+    if (target == curr || target->TaskQueue != this || target->ReadyListEntry.IsEmpty())
+        return false;
+
+    if (target->Priority > Stdlib::FindFirstSetBit(ReadyMask))
+        return false;
 
-    for (auto currEntry = TaskList.Flink;
-        currEntry != &TaskList;
-        currEntry = currEntry->Flink)
+    // a coupled pair handing off to each other must not starve its level
+    auto& readyList = ReadyList[target->Priority];
+    Task* first = CONTAINING_RECORD(readyList.Flink, Task, ReadyListEntry);
+    return (target->VirtualRuntime < first->VirtualRuntime + WakeupCredit) ? true : false;
+}
+
+Task* TaskQueue::SelectNext(Task *curr, Task* target)
+{
+    if (ReadyMask == 0)
+        return nullptr;
+
+    if (target != nullptr && CanYieldTo(curr, target))
     {
-        Task* cand = CONTAINING_RECORD(currEntry, Task, ListEntry);
-        if (cand == curr)
-        {
-            BugOn(cand->State.Get() == Task::StateExited);
-            cand->ListEntry.Remove();
-            TaskList.InsertTail(&cand->ListEntry);
-            break;
-        }
+        HandoffCounter.Inc();
+        DequeueReady(target);
+        return target;
+    }
 
-        if (cand->PreemptDisableCounter.Get() != 0)
-        {
-            continue;
-        }
-        next = cand;
-        break;
+    ulong priority = Stdlib::FindFirstSetBit(ReadyMask);
+    Task* next = CONTAINING_RECORD(ReadyList[priority].Flink, Task, ReadyListEntry);
+    // a task whose affinity no longer allows this cpu is migrated on switch out
+    if (curr->State.Get() != Task::StateExited && !curr->BlockPending &&
+        curr->CpuAffinity.Test(Cpu->GetIndex()))
+    {
+        if (priority > curr->Priority)
+            return nullptr;
+
+        // let curr run until it's ahead of the leftmost task by the granularity
+        if (priority == curr->Priority &&
+            curr->VirtualRuntime < next->VirtualRuntime + Granularity)
+            return nullptr;
     }
 
+    BugOn(next == curr);
+    DequeueReady(next);
     return next;
 }
 
-void TaskQueue::Schedule(Task* curr)
+void TaskQueue::Schedule(Task* curr, Task* target)
 {
     ScheduleCounter.Inc();
 
@@ -110,64 +262,130 @@ void TaskQueue::Schedule(Task* curr)
     InterruptDisable();
     Lock.Lock();
 
-    Task* next = nullptr;
-    do {
-        curr->Lock.Lock();
-        BugOn(TaskList.IsEmpty());
-
-        if (curr->State.Get() == Task::StateExited)
-        {
-            BugOn(curr->TaskQueue != this);
-            BugOn(curr->ListEntry.IsEmpty());
-            curr->TaskQueue = nullptr;
-            curr->ListEntry.RemoveInit();
-        }
-
-        next = SelectNext(curr);
-        if (next == nullptr)
-        {
-            break;
-        }
+    curr->Lock.Lock();
+    BugOn(TaskList.IsEmpty());
 
-        next->Lock.Lock();
-        next->ListEntry.Remove();
-        if (curr->TaskQueue != nullptr)
-        {
-            BugOn(curr->TaskQueue != this);
-            curr->ListEntry.Remove();
-            TaskList.InsertTail(&curr->ListEntry);
-        }
-        TaskList.InsertTail(&next->ListEntry);
+    if (curr->State.Get() == Task::StateExited)
+    {
+        BugOn(curr->TaskQueue != this);
+        BugOn(curr->ListEntry.IsEmpty());
+        curr->TaskQueue = nullptr;
+        curr->ListEntry.RemoveInit();
+        TaskCount.Dec();
+    }
 
-    } while (false);
+    curr->UpdateRuntime();
+    UpdateMinVirtualRuntime(curr);
 
+    Task* next = SelectNext(curr, target);
     if (next == nullptr)
     {
-        curr->UpdateRuntime();
+        // curr keeps the cpu for another slice
+        curr->SliceStartTsc = curr->RunStartTsc;
         curr->Lock.Unlock();
         Lock.Unlock();
         SetRflags(flags);
-        curr->PreemptDisableCounter.Dec();
         BugOn(curr->State.Get() == Task::StateExited);
+        if (PerCpuPreemptDec() && IsInterruptEnabled())
+            Kernel::Schedule();
         return;
     }
 
-    Switch(next, curr);
+    next->Lock.Lock();
+    bool resched = Switch(next, curr);
     SetRflags(flags);
+    if (resched && IsInterruptEnabled())
+        Kernel::Schedule();
 }
 
 void TaskQueue::Insert(Task* task)
 {
     task->Get();
 
-    Stdlib::AutoLock lock(Lock);
-    Stdlib::AutoLock lock2(task->Lock);
+    bool kick = false;
+    bool preempt = false;
+    {
+        Stdlib::AutoLock lock(Lock);
+        Stdlib::AutoLock lock2(task->Lock);
+
+        BugOn(task->TaskQueue != nullptr);
+        BugOn(!(task->ListEntry.IsEmpty()));
+
+        task->TaskQueue = this;
+        task->VirtualRuntime += MinVirtualRuntime;
+        TaskList.InsertTail(&task->ListEntry);
+        TaskCount.Inc();
+        if (task->State.Get() != Task::StateRunning)
+        {
+            EnqueueReady(task);
+            kick = true;
+            preempt = ShouldPreempt(task);
+        }
+    }
+
+    if (kick)
+        Kick(preempt);
+}
+
+bool TaskQueue::ShouldPreempt(Task* task)
+{
+    // only meaningful on the queue's own cpu, where curr is the waker
+    if (!PreemptIsOn())
+        return false;
+
+    Task* curr = GetPerCpuTask();
+    if (task->Priority != curr->Priority)
+        return (task->Priority < curr->Priority) ? true : false;
+
+    // the same margin SelectNext wants before it switches
+    return (task->VirtualRuntime + Granularity < curr->VirtualRuntime) ? true : false;
+}
+
+void TaskQueue::Kick(bool preempt)
+{
+    // remote cpu might be halted without tick, so wake it up for the new task
+    if (!PreemptIsOn())
+        return;
+
+    auto& cpus = CpuTable::GetInstance();
+    if (Cpu->GetIndex() == cpus.GetCurrentCpuId())
+    {
+        // switched on the next interrupt return or PreemptEnable
+        if (preempt)
+            PerCpuSetNeedResched();
+        return;
+    }
+
+    // a cpu idling on its wake line needs only the store, no interrupt
+    if (cpus.IsCpuRunning(Cpu->GetIndex()) && !Cpu->WakeIdle())
+        cpus.SendIPI(Cpu->GetIndex(), CpuTable::ReschedVector);
+}
+
+void TaskQueue::WakeUp(Task* task)
+{
+    bool preempt = false;
+    {
+        Stdlib::AutoLock lock(Lock);
+        Stdlib::AutoLock lock2(task->Lock);
+
+        BugOn(task->TaskQueue != this);
 
-    BugOn(task->TaskQueue != nullptr);
-    BugOn(!(task->ListEntry.IsEmpty()));
+        // task is still running and has not switched out yet, so it just won't block
+        task->BlockPending = false;
+        if (task->State.Get() != Task::StateBlocked)
+            return;
 
-    task->TaskQueue = this;
-    TaskList.InsertTail(&task->ListEntry);
+        // sleepers get a bounded credit so interactive tasks run soon after wakeup
+        ulong minVirtualRuntime = (MinVirtualRuntime > WakeupCredit) ? (MinVirtualRuntime - WakeupCredit) : 0;
+        if (task->VirtualRuntime < minVirtualRuntime)
+            task->VirtualRuntime = minVirtualRuntime;
+
+        task->State.Set(Task::StateWaiting);
+        EnqueueReady(task);
+        preempt = ShouldPreempt(task);
+    }
+
+    Kick(preempt);
 }
 
 void TaskQueue::Remove(Task* task)
@@ -178,19 +396,174 @@ void TaskQueue::Remove(Task* task)
 
         BugOn(task->TaskQueue != this);
         BugOn(task->ListEntry.IsEmpty());
+        if (!task->ReadyListEntry.IsEmpty())
+            DequeueReady(task);
         task->TaskQueue = nullptr;
+        task->VirtualRuntime -= Stdlib::Min(task->VirtualRuntime, MinVirtualRuntime);
         task->ListEntry.RemoveInit();
+        TaskCount.Dec();
     }
 
     task->Put();
 }
 
+bool TaskQueue::SetSchedParams(Task* task, ulong priority, long nice)
+{
+    Stdlib::AutoLock lock(Lock);
+    Stdlib::AutoLock lock2(task->Lock);
+
+    if (task->TaskQueue != this)
+        return false;
+
+    bool queued = !task->ReadyListEntry.IsEmpty();
+    if (queued)
+        DequeueReady(task);
+
+    task->Priority = priority;
+    task->Nice = nice;
+    task->Weight = Task::NiceToWeight(nice);
+
+    if (queued)
+        EnqueueReady(task);
+
+    return true;
+}
+
+void TaskQueue::Tick(Task* curr)
+{
+    if (ReadyCount.Get() == 0)
+        return;
+
+    u64 ran = ReadTsc() - curr->SliceStartTsc;
+    if (TscClock::GetInstance().TicksToTime(ran).GetValue() < GetTimeSlice(curr->Priority))
+        return;
+
+    SliceExpiredCounter.Inc();
+    PerCpuSetNeedResched();
+}
+
+bool TaskQueue::SetTimeSlice(ulong priority, ulong nanoSecs)
+{
+    if (priority >= Task::PriorityIdle)
+        return false;
+
+    TimeSlice[priority] = nanoSecs;
+    return true;
+}
+
+ulong TaskQueue::GetTimeSlice(ulong priority)
+{
+    if (priority >= Task::PriorityIdle)
+        return 0;
+
+    ulong slice = *static_cast<volatile ulong*>(&TimeSlice[priority]);
+    if (slice == 0)
+        slice = SliceMs.Get() * Const::NanoSecsInMs;
+
+    return slice;
+}
+
+Task* TaskQueue::StealTask(ulong cpuIndex)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    for (ulong mask = ReadyMask; mask != 0; mask &= (mask - 1))
+    {
+        auto& readyList = ReadyList[Stdlib::FindFirstSetBit(mask)];
+
+        for (auto currEntry = readyList.Flink;
+            currEntry != &readyList;
+            currEntry = currEntry->Flink)
+        {
+            Task* cand = CONTAINING_RECORD(currEntry, Task, ReadyListEntry);
+
+            // ready tasks have their context saved: SwitchComplete and
+            // WakeUp enqueue them only after the switch released our lock
+            if (!cand->CpuAffinity.Test(cpuIndex))
+                continue;
+
+            Stdlib::AutoLock lock2(cand->Lock);
+
+            BugOn(cand->TaskQueue != this);
+            BugOn(cand->State.Get() != Task::StateWaiting);
+            DequeueReady(cand);
+            cand->TaskQueue = nullptr;
+            cand->VirtualRuntime -= Stdlib::Min(cand->VirtualRuntime, MinVirtualRuntime);
+            cand->ListEntry.RemoveInit();
+            TaskCount.Dec();
+            return cand;
+        }
+    }
+
+    return nullptr;
+}
+
+bool TaskQueue::Steal()
+{
+    auto& cpuTable = CpuTable::GetInstance();
+    ulong cpuIndex = Cpu->GetIndex();
+
+    if (ReadyCount.Get() != 0)
+        return false;
+
+    // the busiest queue sharing the last level cache, then the package,
+    // only then a remote one
+    class TaskQueue* victim = nullptr;
+    CpuMask running = cpuTable.GetRunningCpus();
+    const CpuMask* domains[] = { &cpuTable.GetLlcCpus(cpuIndex),
+        &cpuTable.GetPackageCpus(cpuIndex), &running };
+    for (size_t d = 0; d < Stdlib::ArraySize(domains) && victim == nullptr; d++)
+    {
+        CpuMask cpuMask = *domains[d];
+        cpuMask &= running;
+        for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+        {
+            if (i == cpuIndex)
+                continue;
+
+            auto& candTaskQueue = cpuTable.GetCpu(i).GetTaskQueue();
+            // idle task + at least one waiting task
+            if (candTaskQueue.GetReadyCount() <= 1)
+                continue;
+
+            if (victim == nullptr || victim->GetReadyCount() < candTaskQueue.GetReadyCount())
+            {
+                victim = &candTaskQueue;
+            }
+        }
+    }
+
+    if (victim == nullptr)
+        return false;
+
+    Task* task = victim->StealTask(cpuIndex);
+    if (task == nullptr)
+        return false;
+
+    Insert(task);
+    task->Put();
+    StealCounter.Inc();
+    victim->MigrateOutCounter.Inc();
+    MigrateInCounter.Inc();
+    return true;
+}
+
 void TaskQueue::Clear()
 {
     Stdlib::ListEntry taskList;
     {
         Stdlib::AutoLock lock(Lock);
+        for (size_t i = 0; i < Stdlib::ArraySize(ReadyList); i++)
+        {
+            while (!ReadyList[i].IsEmpty())
+            {
+                ReadyList[i].RemoveHead()->Init();
+            }
+        }
+        ReadyMask = 0;
+        ReadyCount.Set(0);
         taskList.MoveTailList(&TaskList);
+        TaskCount.Set(0);
     }
 
     if (taskList.IsEmpty())
@@ -205,8 +578,9 @@ void TaskQueue::Clear()
         task->Put();
     }
 
-    Trace(0, "TaskQueue 0x%p counters: sched %u switch context %u",
-        this, ScheduleCounter.Get(), SwitchContextCounter.Get());
+    Trace(0, "TaskQueue 0x%p counters: sched %u switch context %u steal %u slice expired %u",
+        this, ScheduleCounter.Get(), SwitchContextCounter.Get(), StealCounter.Get(),
+        SliceExpiredCounter.Get());
 }
 
 TaskQueue::~TaskQueue()
@@ -214,12 +588,52 @@ TaskQueue::~TaskQueue()
     Clear();
 }
 
+long TaskQueue::GetScheduleCounter()
+{
+    return ScheduleCounter.Get();
+}
+
+long TaskQueue::GetHandoffCounter()
+{
+    return HandoffCounter.Get();
+}
+
 long TaskQueue::GetSwitchContextCounter()
 {
     return SwitchContextCounter.Get();
 }
 
-void Schedule()
+long TaskQueue::GetSliceExpiredCounter()
+{
+    return SliceExpiredCounter.Get();
+}
+
+long TaskQueue::GetMigrateInCounter()
+{
+    return MigrateInCounter.Get();
+}
+
+long TaskQueue::GetMigrateOutCounter()
+{
+    return MigrateOutCounter.Get();
+}
+
+long TaskQueue::GetTaskCount()
+{
+    return TaskCount.Get();
+}
+
+long TaskQueue::GetReadyCount()
+{
+    return ReadyCount.Get();
+}
+
+class Cpu* TaskQueue::GetCpu()
+{
+    return Cpu;
+}
+
+static void ScheduleTo(Task* target)
 {
     if (unlikely(!PreemptIsOn()))
     {
@@ -227,26 +641,86 @@ void Schedule()
     }
 
     Task *curr = Task::GetCurrentTask();
-    curr->PreemptDisableCounter.Inc();
-    if (curr->PreemptDisableCounter.Get() > 1)
+    PerCpuPreemptInc();
+    if (GetPerCpuPreemptCount() > 1)
     {
-        Stdlib::AutoLock lock(curr->Lock);
-        curr->UpdateRuntime();
-        curr->PreemptDisableCounter.Dec();
+        // PreemptEnable reschedules once the count drops to zero
+        PerCpuSetNeedResched();
+        {
+            Stdlib::AutoLock lock(curr->Lock);
+            curr->UpdateRuntime();
+        }
+        PerCpuPreemptDec();
         return;
     }
 
-    curr->TaskQueue->Schedule(curr);
+    PerCpuClearNeedResched();
+    // preemption was enabled on entry: no read section is active here
+    Rcu::GetInstance().QuiescentState();
+    curr->TaskQueue->Schedule(curr, target);
 }
 
+void Schedule()
+{
+    ScheduleTo(nullptr);
+}
+
+void YieldTo(Task* target)
+{
+    ScheduleTo(target);
+}
+
+// Wakes a sleeping task from the timer of the cpu it slept on
+class SleepTimer final : public TimerCallback
+{
+public:
+    SleepTimer()
+        : Expired(false)
+    {
+    }
+
+    virtual void OnTick(TimerCallback& callback) override
+    {
+        (void)callback;
+
+        Expired = true;
+        WaitQueue.WakeUpAll();
+    }
+
+    Timer Timer;
+    WaitQueue WaitQueue;
+    volatile bool Expired;
+};
+
 void Sleep(ulong nanoSecs)
 {
     auto expired = GetBootTime() + nanoSecs;
+    auto& timers = TimerTable::GetInstance();
+    SleepTimer sleeper;
 
-    while (GetBootTime() < expired)
+    timers.StartTimer(sleeper.Timer, sleeper, Stdlib::Time(nanoSecs));
+    for (;;)
     {
-        Schedule();
+        if (unlikely(!PreemptIsOn()))
+        {
+            if (GetBootTime() >= expired)
+                break;
+
+            Pause();
+            continue;
+        }
+
+        sleeper.WaitQueue.Prepare();
+        if (sleeper.Expired)
+        {
+            sleeper.WaitQueue.Finish();
+            break;
+        }
+        sleeper.WaitQueue.Wait();
     }
+
+    // the task may run elsewhere while the callback still touches sleeper
+    timers.StopTimer(sleeper.Timer);
 }
 
 }
\ No newline at end of file
@@ -12,42 +12,117 @@ namespace Kernel
 class TaskQueue
 {
 public:
-    TaskQueue();
+    TaskQueue(class Cpu* cpu);
     ~TaskQueue();
 
     void Insert(Task* task);
     void Remove(Task* task);
 
-    void Schedule(Task* curr);
+    void WakeUp(Task* task);
+
+    bool SetSchedParams(Task* task, ulong priority, long nice);
+
+    // switches to target instead of the scheduler's pick if target is ready
+    // on this queue and not behind a higher priority or much fairer task
+    void Schedule(Task* curr, Task* target = nullptr);
 
     void Clear();
 
+    // called by the tick of the queue's cpu, asks for a reschedule once
+    // curr used up its time slice and another task is ready
+    void Tick(Task* curr);
+
+    // time slice of a priority level, 0 for the default of the slice
+    // tunable. The idle level is always preempted at once
+    static bool SetTimeSlice(ulong priority, ulong nanoSecs);
+    static ulong GetTimeSlice(ulong priority);
+
+    bool Steal();
+
+    long GetScheduleCounter();
+
     long GetSwitchContextCounter();
 
+    // switches that went to a YieldTo target
+    long GetHandoffCounter();
+
+    // ticks that found curr's time slice used up
+    long GetSliceExpiredCounter();
+
+    // tasks moved here from other queues and away from this one
+    long GetMigrateInCounter();
+    long GetMigrateOutCounter();
+
+    long GetTaskCount();
+
+    long GetReadyCount();
+
+    class Cpu* GetCpu();
+
+    // completes the switch to curr on its own stack: releases the locks the
+    // previous task held across SwitchContext and requeues it. True if a
+    // reschedule was deferred meanwhile, the caller runs it once interrupts
+    // are on again
+    static bool FinishSwitch(Task* curr);
+
 private:
     TaskQueue(const TaskQueue &other) = delete;
     TaskQueue(TaskQueue&& other) = delete;
     TaskQueue& operator=(const TaskQueue& other) = delete;
     TaskQueue& operator=(TaskQueue&& other) = delete;
 
-    Task* SelectNext(Task* curr);
+    static const ulong Granularity = 1 * Const::NanoSecsInMs;
+    static const ulong WakeupCredit = 5 * Const::NanoSecsInMs;
+
+    Task* SelectNext(Task* curr, Task* target);
+
+    bool CanYieldTo(Task* curr, Task* target);
+
+    void EnqueueReady(Task* task);
+    void DequeueReady(Task* task);
+
+    void UpdateMinVirtualRuntime(Task* curr);
 
-    void Switch(Task* curr, Task* next);
+    bool ShouldPreempt(Task* task);
 
-    void SwitchComplete(Task* curr);
+    // preempt tells if a wakeup on this cpu should switch to the task
+    void Kick(bool preempt);
 
-    static void SwitchComplete(void* ctx);
+    bool Switch(Task* curr, Task* next);
+
+    bool SwitchComplete(Task* curr);
+
+    Task* StealTask(ulong cpuIndex);
 
     using ListEntry = Stdlib::ListEntry;
     ListEntry TaskList;
-    SpinLock Lock;
+    ListEntry ReadyList[Task::PriorityCount];
+    ulong ReadyMask;
+    ulong MinVirtualRuntime;
+    FastSpinLock Lock;
+
+    class Cpu* Cpu;
 
-    Atomic ScheduleCounter;
+    Atomic TaskCount;
+    Atomic ReadyCount;
+    // statistics, off the line of the lock and the lists
+    Atomic ScheduleCounter __attribute__((aligned(Const::CacheLineSize)));
     Atomic SwitchContextCounter;
+    Atomic StealCounter;
+    Atomic MigrateInCounter;
+    Atomic MigrateOutCounter;
+    Atomic HandoffCounter;
+    Atomic SliceExpiredCounter;
+
+    static ulong TimeSlice[Task::PriorityCount];
 };
 
 
 void Schedule();
 void Sleep(ulong nanoSecs);
 
+// gives the rest of the current slice to a ready task on this cpu, falls back
+// to Schedule() if the handoff isn't allowed
+void YieldTo(Task* target);
+
 }
\ No newline at end of file
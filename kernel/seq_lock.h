@@ -0,0 +1,109 @@
+#pragma once
+
+#include <include/types.h>
+
+#include "asm.h"
+#include "spin_lock.h"
+
+namespace Kernel
+{
+
+// Sequence counter for read-mostly data: the writer makes the count odd
+// while it updates, readers retry until they see the same even count before
+// and after their reads. Writers are serialized by the caller. x86 keeps
+// stores and loads in order, so compiler barriers order the count against
+// the data.
+class SeqCount final
+{
+public:
+    SeqCount()
+        : Seq(0)
+    {
+    }
+
+    void WriteBegin()
+    {
+        Seq = Seq + 1;
+        Barrier();
+    }
+
+    void WriteEnd()
+    {
+        Barrier();
+        Seq = Seq + 1;
+    }
+
+    ulong ReadBegin()
+    {
+        for (;;)
+        {
+            ulong seq = Seq;
+            if (likely(!(seq & 1)))
+            {
+                Barrier();
+                return seq;
+            }
+            Pause();
+        }
+    }
+
+    // true if a writer ran since ReadBegin returned seq
+    bool ReadRetry(ulong seq)
+    {
+        Barrier();
+        return unlikely(Seq != seq);
+    }
+
+private:
+    SeqCount(const SeqCount& other) = delete;
+    SeqCount(SeqCount&& other) = delete;
+    SeqCount& operator=(const SeqCount& other) = delete;
+    SeqCount& operator=(SeqCount&& other) = delete;
+
+    volatile ulong Seq;
+};
+
+// Multiword value with lock-free readers, T is copied as plain memory so it
+// must not own resources. Writers take the lock with interrupts off.
+template<typename T>
+class SeqLock final
+{
+public:
+    SeqLock()
+        : Value()
+    {
+    }
+
+    void Write(const T& value)
+    {
+        Stdlib::AutoLock lock(Lock);
+        Count.WriteBegin();
+        Value = value;
+        Count.WriteEnd();
+    }
+
+    T Read()
+    {
+        T value;
+        ulong seq;
+        do
+        {
+            seq = Count.ReadBegin();
+            value = Value;
+        } while (Count.ReadRetry(seq));
+
+        return value;
+    }
+
+private:
+    SeqLock(const SeqLock& other) = delete;
+    SeqLock(SeqLock&& other) = delete;
+    SeqLock& operator=(const SeqLock& other) = delete;
+    SeqLock& operator=(SeqLock&& other) = delete;
+
+    FastSpinLock Lock;
+    SeqCount Count;
+    T Value;
+};
+
+}
@@ -0,0 +1,51 @@
+#include "simd.h"
+#include "fpu.h"
+
+#include <include/const.h>
+
+#include <emmintrin.h>
+
+namespace Kernel
+{
+
+// four 16 byte registers per iteration, non-temporal stores so a page
+// written once doesn't evict the working set
+void SimdCopyPage(void* dst, const void* src)
+{
+    auto d = static_cast<__m128i*>(dst);
+    auto s = static_cast<const __m128i*>(src);
+
+    KernelFpuBegin();
+    for (size_t i = 0; i < Const::PageSize / sizeof(__m128i); i += 4)
+    {
+        __m128i x0 = _mm_load_si128(s + i);
+        __m128i x1 = _mm_load_si128(s + i + 1);
+        __m128i x2 = _mm_load_si128(s + i + 2);
+        __m128i x3 = _mm_load_si128(s + i + 3);
+        _mm_stream_si128(d + i, x0);
+        _mm_stream_si128(d + i + 1, x1);
+        _mm_stream_si128(d + i + 2, x2);
+        _mm_stream_si128(d + i + 3, x3);
+    }
+    _mm_sfence();
+    KernelFpuEnd();
+}
+
+void SimdZeroPage(void* dst)
+{
+    auto d = static_cast<__m128i*>(dst);
+
+    KernelFpuBegin();
+    __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < Const::PageSize / sizeof(__m128i); i += 4)
+    {
+        _mm_stream_si128(d + i, zero);
+        _mm_stream_si128(d + i + 1, zero);
+        _mm_stream_si128(d + i + 2, zero);
+        _mm_stream_si128(d + i + 3, zero);
+    }
+    _mm_sfence();
+    KernelFpuEnd();
+}
+
+}
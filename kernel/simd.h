@@ -0,0 +1,14 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Kernel
+{
+
+// SSE2 page helpers, built with SSE enabled and bracketed by a kernel fpu
+// section, both pointers are page aligned
+void SimdCopyPage(void* dst, const void* src);
+
+void SimdZeroPage(void* dst);
+
+}
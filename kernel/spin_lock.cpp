@@ -4,14 +4,20 @@
 #include "preempt.h"
 #include "time.h"
 #include "watchdog.h"
+#include "static_key.h"
+#include "lock_elision.h"
 
 namespace Kernel
 {
 
+StaticKey LockStatsKey("lockstats", true);
+
 SpinLock::SpinLock()
     : Owner(nullptr)
+    , Caller(nullptr)
     , LockTime(0)
 {
+    Stdlib::MemSet(&Stats, 0, sizeof(Stats));
     Watchdog::GetInstance().RegisterSpinLock(*this);
 }
 
@@ -21,28 +27,63 @@ SpinLock::~SpinLock()
 }
 
 
+void SpinLock::LockImpl(void* caller)
+{
+    if (!StaticBranchLikely(LockStatsKey))
+    {
+        RawLock.Lock();
+        Owner = (PreemptIsOn()) ? Task::GetCurrentTask() : nullptr;
+        Caller = caller;
+        return;
+    }
+
+    if (RawLock.TryLock())
+    {
+        Owner = (PreemptIsOn()) ? Task::GetCurrentTask() : nullptr;
+        LockTime.Set(GetBootTime().GetValue());
+    }
+    else
+    {
+        Stdlib::Time spinStart = GetBootTime();
+        RawLock.Lock();
+        Owner = (PreemptIsOn()) ? Task::GetCurrentTask() : nullptr;
+        Stdlib::Time now = GetBootTime();
+        LockTime.Set(now.GetValue());
+
+        ulong spinTime = (now - spinStart).GetValue();
+        Stats.ContendedCount++;
+        Stats.SpinTimeTotal += spinTime;
+        if (spinTime > Stats.SpinTimeMax)
+            Stats.SpinTimeMax = spinTime;
+    }
+
+    Caller = caller;
+    Stats.AcquireCount++;
+}
+
 void SpinLock::Lock()
 {
-    RawLock.Lock();
-    Owner = (PreemptIsOn()) ? Task::GetCurrentTask() : nullptr;
-    LockTime.Set(GetBootTime().GetValue());
+    LockImpl(__builtin_return_address(0));
 }
 
 void SpinLock::Unlock()
 {
+    // LockTime is 0 if the stats were off when the lock was taken
     Stdlib::Time lockTime(LockTime.Get());
-    if (lockTime.GetValue() != 0)
+    if (StaticBranchLikely(LockStatsKey) && lockTime.GetValue() != 0)
     {
-        Stdlib::Time now = GetBootTime();
-        Stdlib::Time delta = now - lockTime;
-        if (delta > Stdlib::Time(20 * Const::NanoSecsInMs))
+        ulong holdTime = (GetBootTime() - lockTime).GetValue();
+        Stats.HoldTimeTotal += holdTime;
+        if (holdTime > Stats.HoldTimeMax)
         {
-            //Panic("Spin lock 0x%p was held too long %u", this, delta.GetValue());
+            Stats.HoldTimeMax = holdTime;
+            Stats.MaxHoldCaller = Caller;
         }
     }
 
     LockTime.Set(0);
     Owner = nullptr;
+    Caller = nullptr;
     RawLock.Unlock();
 }
 
@@ -51,7 +92,7 @@ void SpinLock::Lock(ulong& flags)
     PreemptDisable();
     flags = GetRflags();
     InterruptDisable();
-    Lock();
+    LockImpl(__builtin_return_address(0));
 }
 
 void SpinLock::Unlock(ulong flags)
@@ -63,12 +104,72 @@ void SpinLock::Unlock(ulong flags)
 
 void SpinLock::SharedLock(ulong& flags)
 {
-    Lock(flags);
+    PreemptDisable();
+    flags = GetRflags();
+    InterruptDisable();
+    if (StaticBranchUnlikely(LockElisionKey) && LockElisionRtm &&
+        LockElision::GetInstance().Begin([this]() { return !RawLock.IsLocked(); }))
+        return;
+
+    LockImpl(__builtin_return_address(0));
 }
 
 void SpinLock::SharedUnlock(ulong flags)
+{
+    // the key may have changed since, xtest tells how the section runs
+    if (LockElisionRtm && XTest())
+        LockElision::GetInstance().End();
+    else
+        Unlock();
+    SetRflags(flags);
+    PreemptEnable();
+}
+
+#if !defined(__LOCK_DEBUG__)
+
+FastSpinLock::FastSpinLock()
+{
+}
+
+FastSpinLock::~FastSpinLock()
+{
+}
+
+void FastSpinLock::Lock()
+{
+    RawLock.Lock();
+}
+
+void FastSpinLock::Unlock()
+{
+    RawLock.Unlock();
+}
+
+void FastSpinLock::Lock(ulong& flags)
+{
+    PreemptDisable();
+    flags = GetRflags();
+    InterruptDisable();
+    RawLock.Lock();
+}
+
+void FastSpinLock::Unlock(ulong flags)
+{
+    RawLock.Unlock();
+    SetRflags(flags);
+    PreemptEnable();
+}
+
+void FastSpinLock::SharedLock(ulong& flags)
+{
+    Lock(flags);
+}
+
+void FastSpinLock::SharedUnlock(ulong flags)
 {
     Unlock(flags);
 }
 
-}
\ No newline at end of file
+#endif
+
+}
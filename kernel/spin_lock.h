@@ -34,12 +34,71 @@ private:
 	SpinLock& operator=(const SpinLock& other) = delete;
 	SpinLock& operator=(SpinLock&& other) = delete;
 
+	void LockImpl(void* caller);
+
 	RawSpinLock RawLock;
 	volatile void* Owner;
+	void* Caller;
 
 public:
+	// updated by the owner only, readers get an approximate snapshot
+	struct LockStats final
+	{
+		ulong AcquireCount;
+		ulong ContendedCount;
+		ulong SpinTimeTotal;
+		ulong SpinTimeMax;
+		ulong HoldTimeTotal;
+		ulong HoldTimeMax;
+		void* MaxHoldCaller;
+	};
+
 	Stdlib::ListEntry ListEntry;
+	// 0 while free or taken with the lockstats key off, the watchdog then
+	// skips the lock
 	Atomic LockTime;
+	LockStats Stats;
 };
 
-}
\ No newline at end of file
+// Spin lock for hot embedded locks (tasks, run queues, pools): no watchdog
+// registration, owner tracking or timestamps. Debug builds use SpinLock
+// instead to keep full watchdog coverage.
+#if defined(__LOCK_DEBUG__)
+
+using FastSpinLock = SpinLock;
+
+#else
+
+class FastSpinLock final
+	: public Stdlib::LockInterface
+	, public Stdlib::SharedLockInterface
+{
+public:
+	FastSpinLock();
+
+	void Lock();
+
+	void Unlock();
+
+	virtual void Lock(ulong& flags) override;
+
+	virtual void Unlock(ulong flags) override;
+
+	virtual void SharedLock(ulong& flags) override;
+
+	virtual void SharedUnlock(ulong flags) override;
+
+	virtual ~FastSpinLock();
+
+private:
+	FastSpinLock(const FastSpinLock& other) = delete;
+	FastSpinLock(FastSpinLock&& other) = delete;
+	FastSpinLock& operator=(const FastSpinLock& other) = delete;
+	FastSpinLock& operator=(FastSpinLock&& other) = delete;
+
+	RawSpinLock RawLock;
+};
+
+#endif
+
+}
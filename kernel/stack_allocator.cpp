@@ -0,0 +1,136 @@
+#include "stack_allocator.h"
+#include "preempt.h"
+#include "asm.h"
+#include "trace.h"
+
+#include <mm/memory_map.h>
+#include <mm/page_table.h>
+#include <mm/page_allocator.h>
+
+namespace Kernel
+{
+
+StackAllocator::StackAllocator()
+    : FreeList(nullptr)
+    , FreeCount(0)
+    , NextSlot(0)
+    , MappedCount(0)
+{
+    Stdlib::MemSet(Cache, 0, sizeof(Cache));
+}
+
+StackAllocator::~StackAllocator()
+{
+}
+
+void* StackAllocator::MapSlot()
+{
+    auto& pt = Mm::PageTable::GetInstance();
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    size_t slot;
+
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (NextSlot >= Mm::MemoryMap::StackSpaceSize / SlotSize)
+            return nullptr;
+        slot = NextSlot++;
+    }
+
+    // the lower half of the slot is the guard
+    ulong base = Mm::MemoryMap::StackSpaceBase + slot * SlotSize + StackSize;
+    void* page[StackSize / Const::PageSize];
+    for (size_t i = 0; i < Stdlib::ArraySize(page); i++)
+    {
+        page[i] = pageAllocator.Alloc(1);
+        if (page[i] == nullptr || !pt.MapPage(base + i * Const::PageSize, pt.VirtToPhys((ulong)page[i])))
+        {
+            // the slot was never touched, so only this cpu may cache its
+            // mappings and a local unmap is enough; the slot itself is lost
+            if (page[i] != nullptr)
+                pageAllocator.Free(page[i]);
+
+            while (i != 0)
+            {
+                i--;
+                pt.UnmapPage(base + i * Const::PageSize);
+                pageAllocator.Free(page[i]);
+            }
+            Trace(0, "Can't map stack slot %u", slot);
+            return nullptr;
+        }
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    MappedCount++;
+    return reinterpret_cast<void*>(base);
+}
+
+void* StackAllocator::Alloc()
+{
+    void* stack = nullptr;
+
+    ulong flags = GetRflags();
+    InterruptDisable();
+    PreemptDisable();
+    auto& cache = Cache[GetPerCpuIndex()];
+    if (cache.Count != 0)
+        stack = cache.Stack[--cache.Count];
+    PreemptEnable();
+    SetRflags(flags);
+
+    if (stack != nullptr)
+        return stack;
+
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (FreeList != nullptr)
+        {
+            FreeStack* entry = FreeList;
+            FreeList = entry->Next;
+            FreeCount--;
+            return entry;
+        }
+    }
+
+    return MapSlot();
+}
+
+void StackAllocator::Free(void* stack)
+{
+    if (stack == nullptr)
+        return;
+
+    bool cached = false;
+    ulong flags = GetRflags();
+    InterruptDisable();
+    PreemptDisable();
+    auto& cache = Cache[GetPerCpuIndex()];
+    if (cache.Count < CpuCacheSize)
+    {
+        cache.Stack[cache.Count++] = stack;
+        cached = true;
+    }
+    PreemptEnable();
+    SetRflags(flags);
+
+    if (cached)
+        return;
+
+    Stdlib::AutoLock lock(Lock);
+    FreeStack* entry = static_cast<FreeStack*>(stack);
+    entry->Next = FreeList;
+    FreeList = entry;
+    FreeCount++;
+}
+
+void StackAllocator::Dump(Stdlib::Printer& printer)
+{
+    size_t cached = 0;
+    for (size_t i = 0; i < Stdlib::ArraySize(Cache); i++)
+        cached += Cache[i].Count;
+
+    Stdlib::AutoLock lock(Lock);
+    printer.Printf("stacks: mapped %u free %u cached %u\n", MappedCount, FreeCount, cached);
+}
+
+}
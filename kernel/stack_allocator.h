@@ -0,0 +1,68 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "spin_lock.h"
+#include "per_cpu.h"
+
+namespace Kernel
+{
+
+// Task stacks in their own virtual range: every slot is a StackSize aligned
+// stack below which StackSize of address space stays unmapped, so an overflow
+// faults instead of running into the neighbour. Freed stacks stay mapped and
+// go to a per-cpu cache, then to a global list, so a task start is a list pop.
+// The range never shrinks, which keeps stale tlb entries of other cpus valid.
+class StackAllocator final
+{
+public:
+    static StackAllocator& GetInstance()
+    {
+        static StackAllocator Instance;
+        return Instance;
+    }
+
+    static const size_t StackSize = 8 * Const::PageSize;
+
+    void* Alloc();
+
+    void Free(void* stack);
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    StackAllocator();
+    ~StackAllocator();
+    StackAllocator(const StackAllocator& other) = delete;
+    StackAllocator(StackAllocator&& other) = delete;
+    StackAllocator& operator=(const StackAllocator& other) = delete;
+    StackAllocator& operator=(StackAllocator&& other) = delete;
+
+    static const size_t SlotSize = 2 * StackSize;
+    static const size_t CpuCacheSize = 8;
+
+    // free stacks are linked through their first word
+    struct FreeStack
+    {
+        FreeStack* Next;
+    };
+
+    struct CpuCache
+    {
+        void* Stack[CpuCacheSize];
+        size_t Count;
+    };
+
+    void* MapSlot();
+
+    SpinLock Lock;
+    FreeStack* FreeList;
+    size_t FreeCount;
+    size_t NextSlot;
+    size_t MappedCount;
+    CpuCache Cache[MaxCpus];
+};
+
+}
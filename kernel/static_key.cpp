@@ -0,0 +1,229 @@
+#include "static_key.h"
+#include "cpu.h"
+#include "preempt.h"
+#include "trace.h"
+
+#include <lib/lock.h>
+#include <lib/stdlib.h>
+
+extern "C" Kernel::StaticKeyEntry StaticKeysStart[];
+extern "C" Kernel::StaticKeyEntry StaticKeysEnd[];
+
+namespace Kernel
+{
+
+StaticKeys::StaticKeys()
+    : Patching(nullptr)
+    , PatchCount(0)
+{
+}
+
+StaticKeys::~StaticKeys()
+{
+}
+
+StaticKey* StaticKeys::GetKey(const StaticKeyEntry& entry)
+{
+    return reinterpret_cast<StaticKey*>(entry.Key & ~LikelyBit);
+}
+
+bool StaticKeys::IsJmp(const StaticKeyEntry& entry)
+{
+    bool likely = (entry.Key & LikelyBit) ? true : false;
+    return (GetKey(entry)->IsEnabled() != likely) ? true : false;
+}
+
+void StaticKeys::MakeInsn(const StaticKeyEntry& entry, u8 insn[SiteSize])
+{
+    static const u8 Nop[SiteSize] = {0x0F, 0x1F, 0x44, 0x00, 0x00};
+
+    if (!IsJmp(entry))
+    {
+        Stdlib::MemCpy(insn, Nop, SiteSize);
+        return;
+    }
+
+    u32 rel = static_cast<u32>(entry.Target - (entry.Code + SiteSize));
+    insn[0] = JmpRel32;
+    Stdlib::MemCpy(&insn[1], &rel, sizeof(rel));
+}
+
+void StaticKeys::Write(ulong addr, const u8* data, size_t len)
+{
+    // the text may be mapped read only, supervisor writes then need WP off
+    ulong flags = GetRflags();
+    InterruptDisable();
+    ulong cr0 = GetCr0();
+    SetCr0(cr0 & ~(1UL << 16));
+    volatile u8* code = reinterpret_cast<volatile u8*>(addr);
+    for (size_t i = 0; i < len; i++)
+        code[i] = data[i];
+    SetCr0(cr0);
+    SetRflags(flags);
+}
+
+void StaticKeys::Serialize(void* ctx)
+{
+    (void)ctx;
+
+    // cross modified code needs a serializing instruction, an iretq isn't
+    // there when a waiting cpu runs its calls inline
+    u32 eax, ebx, ecx, edx;
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+}
+
+void StaticKeys::SyncCpus()
+{
+    // only the boot cpu runs before preemption is on
+    if (!PreemptIsOn())
+        return;
+
+    // the task may have moved since the write, the cpu it runs on now is
+    // the one the call leaves out
+    PreemptDisable();
+    Serialize(nullptr);
+    CpuTable::GetInstance().CallFunctionAllExcludeSelf(Serialize, nullptr);
+    PreemptEnable();
+}
+
+void StaticKeys::Setup()
+{
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        if (!IsJmp(*entry))
+            continue;
+
+        u8 insn[SiteSize];
+        MakeInsn(*entry, insn);
+        Write(entry->Code, insn, SiteSize);
+    }
+}
+
+void StaticKeys::Set(StaticKey& key, bool enabled)
+{
+    // the boot cpu alone runs before preemption is on, not yet as a task
+    // the mutex could record as owner
+    if (!PreemptIsOn())
+    {
+        Patch(key, enabled);
+        return;
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    Patch(key, enabled);
+}
+
+void StaticKeys::Patch(StaticKey& key, bool enabled)
+{
+    if (key.Enabled == enabled)
+        return;
+
+    Patching = &key;
+    key.Enabled = enabled;
+    Barrier();
+
+    u8 int3 = Int3;
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        if (GetKey(*entry) == &key)
+            Write(entry->Code, &int3, sizeof(int3));
+    }
+    SyncCpus();
+
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        if (GetKey(*entry) != &key)
+            continue;
+
+        u8 insn[SiteSize];
+        MakeInsn(*entry, insn);
+        Write(entry->Code + 1, &insn[1], SiteSize - 1);
+    }
+    SyncCpus();
+
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        if (GetKey(*entry) != &key)
+            continue;
+
+        u8 insn[SiteSize];
+        MakeInsn(*entry, insn);
+        Write(entry->Code, &insn[0], 1);
+    }
+    // a cpu in the int3 handler has interrupts off, so once every cpu took
+    // the IPI nobody looks at Patching anymore
+    SyncCpus();
+
+    Patching = nullptr;
+    PatchCount++;
+}
+
+bool StaticKeys::HandleBreakpoint(Context* ctx)
+{
+    StaticKey* key = Patching;
+    if (key == nullptr)
+        return false;
+
+    // rip, cs, rflags, rsp, ss; rip is past the int3
+    ulong* frame = reinterpret_cast<ulong*>(ctx->Rsp);
+    if (frame[1] & 3)
+        return false;
+
+    ulong code = frame[0] - 1;
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        if (entry->Code != code || GetKey(*entry) != key)
+            continue;
+
+        frame[0] = (IsJmp(*entry)) ? entry->Target : entry->Code + SiteSize;
+        return true;
+    }
+
+    return false;
+}
+
+StaticKey* StaticKeys::Find(const char* name)
+{
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        StaticKey* key = GetKey(*entry);
+        if (Stdlib::StrCmp(key->GetName(), name) == 0)
+            return key;
+    }
+
+    return nullptr;
+}
+
+void StaticKeys::Dump(Stdlib::Printer& printer)
+{
+    size_t sites = StaticKeysEnd - StaticKeysStart;
+    printer.Printf("sites %u patches %u\n", sites, PatchCount);
+
+    // keys in order of their first site, counted once
+    for (StaticKeyEntry* entry = StaticKeysStart; entry != StaticKeysEnd; entry++)
+    {
+        StaticKey* key = GetKey(*entry);
+        bool seen = false;
+        for (StaticKeyEntry* prev = StaticKeysStart; prev != entry; prev++)
+        {
+            if (GetKey(*prev) == key)
+            {
+                seen = true;
+                break;
+            }
+        }
+        if (seen)
+            continue;
+
+        size_t count = 0;
+        for (StaticKeyEntry* next = entry; next != StaticKeysEnd; next++)
+        {
+            if (GetKey(*next) == key)
+                count++;
+        }
+
+        printer.Printf("%s %s sites %u\n", key->GetName(), (key->IsEnabled()) ? "on" : "off", count);
+    }
+}
+
+}
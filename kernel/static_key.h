@@ -0,0 +1,163 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+#include "mutex.h"
+#include "asm.h"
+
+namespace Kernel
+{
+
+// Boolean switch for branch sites that are patched instead of tested. Keys
+// are global objects, constant initialized so sites may use them before
+// any constructor runs, and change only through StaticKeys::Set.
+class StaticKey final
+{
+public:
+    constexpr StaticKey(const char* name, bool enabled)
+        : Name(name)
+        , Enabled(enabled)
+    {
+    }
+
+    bool IsEnabled() const
+    {
+        return Enabled;
+    }
+
+    const char* GetName() const
+    {
+        return Name;
+    }
+
+private:
+    friend class StaticKeys;
+
+    StaticKey(const StaticKey& other) = delete;
+    StaticKey(StaticKey&& other) = delete;
+    StaticKey& operator=(const StaticKey& other) = delete;
+    StaticKey& operator=(StaticKey&& other) = delete;
+
+    const char* Name;
+    volatile bool Enabled;
+};
+
+// one per branch site, emitted into .static_keys next to the site. The low
+// bit of Key is set for likely sites, whose jmp skips the enabled path
+struct StaticKeyEntry final
+{
+    ulong Code;
+    ulong Target;
+    ulong Key;
+};
+
+// Every site is a 5 byte nop at first. Setup patches the sites of enabled
+// unlikely keys and disabled likely keys to a jmp before anything else
+// runs, Set repatches the sites of one key later on. Other cpus may run a
+// site while it changes, so Set first puts an int3 on its first byte,
+// writes the other bytes, then the first one, with every cpu running cpuid
+// from an IPI between the steps; a cpu hitting the int3 meanwhile continues
+// as the new instruction would. Set sleeps, it must not be called under a
+// spin lock or with interrupts off.
+class StaticKeys final
+{
+public:
+    static StaticKeys& GetInstance()
+    {
+        static StaticKeys Instance;
+        return Instance;
+    }
+
+    void Setup();
+
+    void Set(StaticKey& key, bool enabled);
+
+    // true if the int3 at the return rip of the frame belongs to a site
+    // being patched, the frame then resumes as the new instruction would
+    bool HandleBreakpoint(Context* ctx);
+
+    // nullptr if no site uses a key of that name
+    StaticKey* Find(const char* name);
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t SiteSize = 5;
+
+private:
+    StaticKeys();
+    ~StaticKeys();
+    StaticKeys(const StaticKeys& other) = delete;
+    StaticKeys(StaticKeys&& other) = delete;
+    StaticKeys& operator=(const StaticKeys& other) = delete;
+    StaticKeys& operator=(StaticKeys&& other) = delete;
+
+    static const ulong LikelyBit = 1;
+    static const u8 Int3 = 0xCC;
+    static const u8 JmpRel32 = 0xE9;
+
+    static StaticKey* GetKey(const StaticKeyEntry& entry);
+    static bool IsJmp(const StaticKeyEntry& entry);
+    static void MakeInsn(const StaticKeyEntry& entry, u8 insn[SiteSize]);
+    static void Write(ulong addr, const u8* data, size_t len);
+    static void Serialize(void* ctx);
+    static void SyncCpus();
+
+    void Patch(StaticKey& key, bool enabled);
+
+    // a sleeping lock, Set waits for every cpu three times
+    Mutex Lock;
+    // the key Set is patching, read by HandleBreakpoint
+    StaticKey* volatile Patching;
+    ulong PatchCount;
+};
+
+}
+
+// gcc takes a global address with -mcmodel=large only as an "X" operand.
+// The entry joins the section group of the site, so it goes away with the
+// copies of inline functions and templates the linker drops
+#if defined(__clang__)
+#define STATIC_KEY_OPERAND(key) "i"(&(key))
+#define STATIC_KEY_REF "%c0"
+#else
+#define STATIC_KEY_OPERAND(key) "X"(&(key))
+#define STATIC_KEY_REF "%p0"
+#endif
+
+#define STATIC_KEY_SITE(key, likelyBit, label)                      \
+    asm goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"            \
+        ".pushsection .static_keys, \"aw?\"\n\t"                    \
+        ".balign 8\n\t"                                             \
+        ".quad 1b, %l[" #label "], " STATIC_KEY_REF " + " #likelyBit "\n\t" \
+        ".popsection"                                               \
+        : : STATIC_KEY_OPERAND(key) : : label)
+
+// true if key is enabled, the enabled path is kept out of line. key must
+// be a global Kernel::StaticKey
+#define StaticBranchUnlikely(key)                                   \
+({                                                                  \
+    __label__ staticKeyYes, staticKeyDone;                          \
+    bool staticKeyValue;                                            \
+    STATIC_KEY_SITE(key, 0, staticKeyYes);                          \
+    staticKeyValue = false;                                         \
+    goto staticKeyDone;                                             \
+staticKeyYes:                                                       \
+    staticKeyValue = true;                                          \
+staticKeyDone:                                                      \
+    staticKeyValue;                                                 \
+})
+
+// true if key is enabled, the enabled path falls through
+#define StaticBranchLikely(key)                                     \
+({                                                                  \
+    __label__ staticKeyNo, staticKeyDone;                           \
+    bool staticKeyValue;                                            \
+    STATIC_KEY_SITE(key, 1, staticKeyNo);                           \
+    staticKeyValue = true;                                          \
+    goto staticKeyDone;                                             \
+staticKeyNo:                                                        \
+    staticKeyValue = false;                                         \
+staticKeyDone:                                                      \
+    staticKeyValue;                                                 \
+})
@@ -0,0 +1,101 @@
+#include "syscall.h"
+#include "asm.h"
+#include "gdt.h"
+#include "per_cpu.h"
+#include "sched.h"
+#include "task.h"
+#include "time.h"
+#include "trace.h"
+
+#include <mm/address_space.h>
+
+namespace Kernel
+{
+
+static_assert(__builtin_offsetof(PerCpu, KernelRsp) == 24, "Invalid offset, see asm.asm");
+static_assert(__builtin_offsetof(PerCpu, UserRsp) == 32, "Invalid offset, see asm.asm");
+static_assert(sizeof(SyscallFrame) == 10 * sizeof(ulong), "Invalid size, see asm.asm");
+
+Syscall::Syscall()
+{
+}
+
+Syscall::~Syscall()
+{
+}
+
+bool Syscall::InitCpu()
+{
+    Gdt::GetInstance().LoadTss(GetPerCpuIndex());
+
+    // SYSRET takes CS from base + 16 and SS from base + 8
+    u64 star = ((u64)(Gdt::UserData - 8 - 3) << 48) | ((u64)Gdt::KernelCode << 32);
+    WriteMsr(StarMsr, star);
+    WriteMsr(LstarMsr, (ulong)&SyscallEntry);
+    WriteMsr(FmaskMsr, Fmask);
+    // user GS base, swapped in by the first entry to user mode
+    WriteMsr(KernelGsBaseMsr, 0);
+    WriteMsr(EferMsr, ReadMsr(EferMsr) | EferSce);
+    return true;
+}
+
+ulong Syscall::Write(ulong buf, ulong len)
+{
+    auto task = Task::GetCurrentTask();
+    char msg[MaxWrite + 1];
+
+    if (len > MaxWrite)
+        len = MaxWrite;
+
+    if (!task->GetAddressSpace()->CopyFrom(msg, buf, len))
+        return ErrInvalid;
+
+    msg[len] = '\0';
+    Trace(0, "task %u: %s", task->Pid, msg);
+    return len;
+}
+
+ulong Syscall::Dispatch(SyscallFrame* frame)
+{
+    ulong nr = frame->Rax;
+    if (nr >= NrCount)
+    {
+        Invalid.Inc();
+        return ErrInvalid;
+    }
+
+    Counter[nr].Inc();
+    switch (nr)
+    {
+    case NrExit:
+        Task::ExitCurrent(static_cast<long>(frame->Rdi));
+        return ErrInvalid;
+    case NrWrite:
+        return Write(frame->Rdi, frame->Rsi);
+    case NrYield:
+        Schedule();
+        return 0;
+    case NrGetPid:
+        return Task::GetCurrentTask()->Pid;
+    case NrGetTime:
+        return GetBootTime().GetValue();
+    default:
+        return ErrInvalid;
+    }
+}
+
+void Syscall::Dump(Stdlib::Printer& printer)
+{
+    static const char* names[NrCount] = { "exit", "write", "yield", "getpid", "gettime" };
+
+    for (size_t i = 0; i < NrCount; i++)
+        printer.Printf("%s %u\n", names[i], Counter[i].Get());
+    printer.Printf("invalid %u\n", Invalid.Get());
+}
+
+extern "C" ulong SyscallDispatch(SyscallFrame* frame)
+{
+    return Syscall::GetInstance().Dispatch(frame);
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+#include "atomic.h"
+
+namespace Kernel
+{
+
+// user registers the syscall entry saves, in push order reversed
+struct SyscallFrame final
+{
+    ulong Rax;
+    ulong Rdi;
+    ulong Rsi;
+    ulong Rdx;
+    ulong R10;
+    ulong R8;
+    ulong R9;
+    ulong Rip;
+    ulong Rflags;
+    ulong Rsp;
+};
+
+// User tasks enter the kernel through SYSCALL: the number in rax, arguments
+// in rdi, rsi, rdx, r10, r8, r9 and the result back in rax. The entry swaps
+// GS, moves to the task's kernel stack and saves only the argument
+// registers; SYSRET returns without an interrupt frame.
+class Syscall final
+{
+public:
+    static Syscall& GetInstance()
+    {
+        static Syscall Instance;
+        return Instance;
+    }
+
+    // enables SYSCALL on the current cpu and loads its TSS, runs after its
+    // per-cpu area is loaded
+    bool InitCpu();
+
+    ulong Dispatch(SyscallFrame* frame);
+
+    void Dump(Stdlib::Printer& printer);
+
+    // exit(code), never returns
+    static const ulong NrExit = 0;
+    // write(buf, len), to the kernel log
+    static const ulong NrWrite = 1;
+    static const ulong NrYield = 2;
+    static const ulong NrGetPid = 3;
+    // boot time in nanoseconds
+    static const ulong NrGetTime = 4;
+    static const ulong NrCount = 5;
+
+    static const ulong ErrInvalid = static_cast<ulong>(-1);
+
+    static const size_t MaxWrite = 256;
+
+private:
+    Syscall();
+    ~Syscall();
+    Syscall(const Syscall& other) = delete;
+    Syscall(Syscall&& other) = delete;
+    Syscall& operator=(const Syscall& other) = delete;
+    Syscall& operator=(Syscall&& other) = delete;
+
+    ulong Write(ulong buf, ulong len);
+
+    static const u32 EferMsr = 0xC0000080;
+    static const u32 StarMsr = 0xC0000081;
+    static const u32 LstarMsr = 0xC0000082;
+    static const u32 FmaskMsr = 0xC0000084;
+    static const u32 KernelGsBaseMsr = 0xC0000102;
+
+    static const u64 EferSce = (1UL << 0);
+
+    // masked on entry: interrupts, trap, direction and alignment check
+    static const u64 Fmask = (1UL << 8) | (1UL << 9) | (1UL << 10) | (1UL << 18);
+
+    Atomic Counter[NrCount];
+    Atomic Invalid;
+};
+
+}
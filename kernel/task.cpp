@@ -5,25 +5,58 @@
 #include "cpu.h"
 #include "sched.h"
 #include "preempt.h"
+#include "stack_allocator.h"
+#include "time.h"
+
+#include <mm/new.h>
+#include <mm/address_space.h>
+#include <mm/object_pool.h>
+#include <drivers/kvm.h>
 
 namespace Kernel
 {
 
+void* Task::operator new(size_t size) noexcept
+{
+    BugOn(size != sizeof(Task));
+    return Mm::ObjectPool<Task>::GetInstance().AllocSlot();
+}
+
+void Task::operator delete(void* ptr) noexcept
+{
+    if (ptr != nullptr)
+        Mm::ObjectPool<Task>::GetInstance().FreeSlot(ptr);
+}
+
 Task::Task()
-    : TaskQueue(nullptr)
-    , Rsp(0)
-    , State(0)
+    : State(0)
     , Flags(0)
+    , TaskQueue(nullptr)
+    , Rsp(0)
+    , RunStartTsc(0)
+    , SliceStartTsc(0)
+    , RuntimeTsc(0)
+    , Priority(PriorityDefault)
+    , Weight(WeightDefault)
+    , VirtualRuntime(0)
+    , BlockPending(false)
     , Prev(nullptr)
     , Magic(TaskMagic)
-    , CpuAffinity(~((ulong)0))
+    , Nice(0)
     , Pid(InvalidObjectId)
     , Stack(nullptr)
     , Function(nullptr)
     , Ctx(nullptr)
+    , Space(nullptr)
+    , UserEntry(0)
+    , UserStack(0)
+    , ExitCode(0)
 {
     RefCounter.Set(1);
+    CpuAffinity.Fill();
     ListEntry.Init();
+    ReadyListEntry.Init();
+    WaitListEntry.Init();
     Name[0] = '\0';
 }
 
@@ -48,9 +81,17 @@ void Task::Release()
 
     if (Stack != nullptr)
     {
-        delete Stack;
+        Stack->~Stack();
+        StackAllocator::GetInstance().Free(Stack);
         Stack = nullptr;
     }
+
+    // the cpu switched away from it when the task exited
+    if (Space != nullptr)
+    {
+        delete Space;
+        Space = nullptr;
+    }
 }
 
 void Task::Get()
@@ -86,14 +127,33 @@ void Task::Exit()
     State.Set(StateExited);
     ExitTime = GetBootTime();
     TaskTable::GetInstance().Remove(this);
+    ExitWaitQueue.WakeUpAll();
 
     Schedule();
 
     Panic("Can't be here");
 }
 
+void Task::ExitCurrent(long code)
+{
+    Task* task = GetCurrentTask();
+
+    task->ExitCode = code;
+    task->Exit();
+}
+
+long Task::GetExitCode()
+{
+    return ExitCode;
+}
+
 void Task::ExecCallback()
 {
+    bool resched = TaskQueue::FinishSwitch(this);
+    InterruptEnable();
+    if (resched)
+        Schedule();
+
     BugOn(this != GetCurrentTask());
     StartTime = GetBootTime();
     Function(Ctx);
@@ -107,9 +167,15 @@ void Task::Exec(void *task)
 
 void Task::Wait()
 {
-    while (State.Get() != StateExited)
+    for (;;)
     {
-        Sleep(1 * Const::NanoSecsInMs);
+        ExitWaitQueue.Prepare();
+        if (State.Load() == StateExited)
+        {
+            ExitWaitQueue.Finish();
+            break;
+        }
+        ExitWaitQueue.Wait();
     }
 }
 
@@ -118,15 +184,17 @@ bool Task::PrepareStart(Func func, void* ctx)
     BugOn(Stack != nullptr);
     BugOn(Function != nullptr);
 
-    Stack = new struct Stack(this);
-    if (Stack == nullptr)
+    void* stack = StackAllocator::GetInstance().Alloc();
+    if (stack == nullptr)
     {
         return false;
     }
+    Stack = new (stack) struct Stack(this);
 
     if (!TaskTable::GetInstance().Insert(this))
     {
-        delete Stack;
+        Stack->~Stack();
+        StackAllocator::GetInstance().Free(Stack);
         Stack = nullptr;
         return false;
     }
@@ -142,13 +210,19 @@ bool Task::Start(Func func, void* ctx)
     if (!PrepareStart(func, ctx))
         return false;
 
-    ulong* rsp = (ulong *)&Stack->StackTop[0];
-    *(--rsp) = (ulong)&Task::Exec;//setup return address
-    Context* regs = (Context*)((ulong)rsp - sizeof(*regs));
-    Stdlib::MemSet(regs, 0, sizeof(*regs));
-    regs->Rdi = (ulong)this; //setup 1arg for Task::Exec
-    regs->Rflags = (1 << 9); //setup IF
-    Rsp = (ulong)regs;
+    // the first switch to the task returns into TaskEntryStub, which jumps
+    // to Exec(r12) with a zero return address on top, so rsp is 8 mod 16
+    // at Exec entry as after a call
+    ulong* rsp = (ulong *)GetKernelStackTop();
+    *(--rsp) = 0;
+    SwitchFrame* frame = (SwitchFrame*)((ulong)rsp - sizeof(*frame));
+    Stdlib::MemSet(frame, 0, sizeof(*frame));
+    frame->R12 = (ulong)this;
+    frame->R13 = (ulong)&Task::Exec;
+    frame->RetAddr = (ulong)&TaskEntryStub;
+    // interrupts stay off until Exec completes the switch
+    frame->Rflags = 0;
+    Rsp = (ulong)frame;
 
     StartTime = GetBootTime();
     State.Set(StateWaiting);
@@ -158,6 +232,30 @@ bool Task::Start(Func func, void* ctx)
     return true;
 }
 
+void Task::UserExec(void *task)
+{
+    Task* self = static_cast<Task *>(task);
+
+    // the switch to the task loaded its space and kernel stack
+    InterruptDisable();
+    EnterUser(self->UserEntry, self->UserStack);
+}
+
+bool Task::StartUser(Mm::AddressSpace* space, ulong entry, ulong stack)
+{
+    BugOn(Space != nullptr);
+
+    Space = space;
+    UserEntry = entry;
+    UserStack = stack;
+    return Start(&Task::UserExec, this);
+}
+
+ulong Task::GetKernelStackTop()
+{
+    return reinterpret_cast<ulong>(&Stack->StackTop[0]) & ~(ulong)0xF;
+}
+
 bool Task::Run(class TaskQueue& taskQueue, Func func, void* ctx)
 {
     if (!PrepareStart(func, ctx))
@@ -166,7 +264,8 @@ bool Task::Run(class TaskQueue& taskQueue, Func func, void* ctx)
     SetRsp((ulong)&Stack->StackTop[0]);
 
     StartTime = GetBootTime();
-    RunStartTime = GetBootTime();
+    RunStartTsc = ReadTsc();
+    SliceStartTsc = RunStartTsc;
     State.Set(StateRunning);
 
     taskQueue.Insert(this);
@@ -183,6 +282,10 @@ bool Task::Run(class TaskQueue& taskQueue, Func func, void* ctx)
 
 Task* Task::GetCurrentTask()
 {
+    // per-cpu current task is switched together with the stack
+    if (likely(PreemptIsOn()))
+        return GetPerCpuTask();
+
     ulong rsp = GetRsp();
     struct Stack* stack = reinterpret_cast<struct Stack *>(rsp & (~(StackSize - 1)));
     if (BugOn(stack->Magic1 != StackMagic1))
@@ -221,18 +324,29 @@ const char* Task::GetName()
 
 void Task::UpdateRuntime()
 {
-    auto now = GetBootTime();
-    Runtime += (now - RunStartTime);
-    RunStartTime = now;
+    u64 now = ReadTsc();
+    u64 delta = now - RunStartTsc;
+    // time the host ran something else is nobody's runtime
+    u64 steal = Kvm::GetInstance().ConsumeSteal();
+    delta -= Stdlib::Min(steal, delta);
+    RuntimeTsc += delta;
+    PER_CPU_ADD(RunTicks, delta);
+    VirtualRuntime += (TscClock::GetInstance().TicksToTime(delta).GetValue() * WeightDefault) / Weight;
+    RunStartTsc = now;
+}
+
+Stdlib::Time Task::GetRuntime()
+{
+    return TscClock::GetInstance().TicksToTime(RuntimeTsc);
 }
 
-void Task::SetCpuAffinity(ulong affinity)
+void Task::SetCpuAffinity(const CpuMask& affinity)
 {
     Stdlib::AutoLock lock(Lock);
     CpuAffinity = affinity;
 }
 
-ulong Task::GetCpuAffinity()
+CpuMask Task::GetCpuAffinity()
 {
     Stdlib::AutoLock lock(Lock);
     return CpuAffinity;
@@ -240,60 +354,94 @@ ulong Task::GetCpuAffinity()
 
 TaskQueue* Task::SelectNextTaskQueue()
 {
-    class TaskQueue* taskQueue = nullptr;
-    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus() & CpuAffinity;
-    if (cpuMask != 0)
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask cpuMask = cpus.GetRunningCpus();
+    cpuMask &= CpuAffinity;
+
+    // a new task starts near the one that created it
+    ulong prev = (TaskQueue != nullptr) ? TaskQueue->GetCpu()->GetIndex() : cpus.GetCurrentCpuId();
+    ulong cpu = cpus.SelectCpu(prev, cpuMask);
+    if (cpu >= MaxCpus)
+        return nullptr;
+
+    return &cpus.GetCpu(cpu).GetTaskQueue();
+}
+
+ulong Task::NiceToWeight(long nice)
+{
+    // each nice step changes cpu share by ~10%
+    static const ulong Weights[NiceMax - NiceMin + 1] = {
+        /* -10 */ 9548, 7620, 6100, 4904, 3906,
+        /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+        /*   0 */ 1024, 820, 655, 526, 423,
+        /*   5 */ 335, 272, 215, 172, 137,
+    };
+
+    if (BugOn(nice < NiceMin || nice > NiceMax))
+        return WeightDefault;
+
+    return Weights[nice - NiceMin];
+}
+
+void Task::SetSchedParams(ulong priority, long nice)
+{
+    for (;;)
     {
-        for (ulong i = 0; i < 8 * sizeof(ulong); i++)
+        class TaskQueue* taskQueue;
         {
-            if (cpuMask & ((ulong)1 << i))
+            Stdlib::AutoLock lock(Lock);
+            taskQueue = TaskQueue;
+            if (taskQueue == nullptr)
             {
-                auto& candTaskQueue = CpuTable::GetInstance().GetCpu(i).GetTaskQueue();
-                if (&candTaskQueue == TaskQueue)
-                    continue;
-
-                if (taskQueue == nullptr)
-                {
-                    taskQueue = &candTaskQueue;
-                }
-                else
-                {
-                    if (taskQueue->GetSwitchContextCounter() > candTaskQueue.GetSwitchContextCounter())
-                    {
-                        taskQueue = &candTaskQueue;
-                    }
-                }
-
-                continue;
+                Priority = priority;
+                Nice = nice;
+                Weight = NiceToWeight(nice);
+                return;
             }
         }
+
+        // task might be migrated meanwhile, so retry
+        if (taskQueue->SetSchedParams(this, priority, nice))
+            return;
     }
+}
 
-    return taskQueue;
+bool Task::SetPriority(ulong priority)
+{
+    if (priority >= PriorityCount)
+        return false;
+
+    SetSchedParams(priority, GetNice());
+    return true;
 }
 
-TaskTable::TaskTable()
+ulong Task::GetPriority()
 {
+    Stdlib::AutoLock lock(Lock);
+    return Priority;
 }
 
-TaskTable::~TaskTable()
+bool Task::SetNice(long nice)
 {
-    for (size_t i = 0; i < Stdlib::ArraySize(TaskList); i++)
-    {
-        Stdlib::ListEntry taskList;
+    if (nice < NiceMin || nice > NiceMax)
+        return false;
 
-        {
-            Stdlib::AutoLock lock(Lock[i]);
-            taskList.MoveTailList(&TaskList[i]);
-        }
+    SetSchedParams(GetPriority(), nice);
+    return true;
+}
 
-        while (!taskList.IsEmpty())
-        {
-            Task* task = CONTAINING_RECORD(taskList.RemoveHead(), Task, TableListEntry);
-            task->TableListEntry.Init();
-            task->Put();
-        }
-    }
+long Task::GetNice()
+{
+    Stdlib::AutoLock lock(Lock);
+    return Nice;
+}
+
+TaskTable::TaskTable()
+{
+}
+
+TaskTable::~TaskTable()
+{
 }
 
 bool TaskTable::Insert(Task *task)
@@ -304,56 +452,72 @@ bool TaskTable::Insert(Task *task)
         return false;
     }
     task->Pid = pid;
-
-    task->Get();
-    size_t i = Stdlib::HashPtr(task) % Stdlib::ArraySize(TaskList);
-    Stdlib::AutoLock lock(Lock[i]);
-
-    BugOn(!task->TableListEntry.IsEmpty());
-    TaskList[i].InsertTail(&task->TableListEntry);
-
     return true;
 }
 
 void TaskTable::Remove(Task *task)
 {
-    {
-        size_t i = Stdlib::HashPtr(task) % Stdlib::ArraySize(TaskList);
-
-        TaskObjectTable.Remove(task->Pid);
-
-        Stdlib::AutoLock lock(Lock[i]);
-
-        BugOn(task->TableListEntry.IsEmpty());
-        task->TableListEntry.RemoveInit();
-    }
-
-    task->Put();
+    TaskObjectTable.Remove(task->Pid);
 }
 
 Task* TaskTable::Lookup(ulong pid)
 {
-    return reinterpret_cast<Task*>(TaskObjectTable.Lookup(pid));
+    return static_cast<Task*>(TaskObjectTable.Lookup(pid));
 }
 
-void TaskTable::Ps(Stdlib::Printer& printer)
+size_t TaskTable::Snapshot(TaskStats* stats, size_t maxCount)
 {
-    printer.Printf("pid state flags runtime ctxswitches name\n");
+    size_t count = 0;
 
-    for (size_t i = 0; i < Stdlib::ArraySize(TaskList); i++)
+    TaskObjectTable.ForEach([stats, maxCount, &count](ObjectId pid, Object* object)
     {
-        Stdlib::AutoLock lock(Lock[i]);
+        (void)pid;
+
+        if (count == maxCount)
+            return;
+
+        Task* task = static_cast<Task*>(object);
+        auto& entry = stats[count++];
+        entry.Pid = task->Pid;
+        entry.State = task->State.Get();
+        entry.Flags = task->Flags.Get();
+        entry.Runtime = task->GetRuntime();
+        entry.WaitTime = task->WaitTime;
+        entry.MaxWaitTime = task->MaxWaitTime;
+        entry.ContextSwitches = task->ContextSwitches.Get();
+        entry.Priority = task->Priority;
+        entry.Weight = task->Weight;
+        Stdlib::StrnCpy(entry.Name, task->GetName(), sizeof(entry.Name));
+        entry.Name[sizeof(entry.Name) - 1] = '\0';
+    });
+
+    return count;
+}
 
-        for (auto currEntry = TaskList[i].Flink;
-            currEntry != &TaskList[i];
-            currEntry = currEntry->Flink)
-        {
-            Task* task = CONTAINING_RECORD(currEntry, Task, TableListEntry);
-            printer.Printf("%u %u 0x%p %u.%u %u %s\n",
-                task->Pid, task->State.Get(), task->Flags.Get(), task->Runtime.GetSecs(),
-                task->Runtime.GetUsecs(), task->ContextSwitches.Get(), task->GetName());
-        }
+void TaskTable::Ps(Stdlib::Printer& printer)
+{
+    size_t maxCount = TaskObjectTable.GetCount() + SnapshotSlack;
+    TaskStats* stats = new TaskStats[maxCount];
+    if (stats == nullptr)
+    {
+        printer.Printf("no memory\n");
+        return;
     }
+
+    size_t count = Snapshot(stats, maxCount);
+
+    printer.Printf("pid state flags runtime wait maxwait(us) ctxswitches prio weight name\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& entry = stats[i];
+        printer.Printf("%u %u 0x%p %u.%u %u.%u %u %u %u %u %s\n",
+            entry.Pid, entry.State, entry.Flags, entry.Runtime.GetSecs(),
+            entry.Runtime.GetUsecs(), entry.WaitTime.GetSecs(), entry.WaitTime.GetUsecs(),
+            entry.MaxWaitTime.GetValue() / Const::NanoSecsInUsec, entry.ContextSwitches,
+            entry.Priority, entry.Weight, entry.Name);
+    }
+
+    delete[] stats;
 }
 
-}
\ No newline at end of file
+}
@@ -9,10 +9,20 @@
 #include "spin_lock.h"
 #include "panic.h"
 #include "object_table.h"
+#include "cpu_mask.h"
+#include "wait_queue.h"
+#include "stack_allocator.h"
+
+#include <mm/new.h>
 
 namespace Kernel
 {
 
+namespace Mm
+{
+class AddressSpace;
+}
+
 class Task final : public Object
 {
 public:
@@ -55,6 +65,7 @@ public:
     } __attribute__((packed));
 
     static_assert(sizeof(Stack) == StackSize, "Invalid size");
+    static_assert(StackAllocator::StackSize == StackSize, "Invalid stack allocator size");
 
     using Func = void (*)(void *ctx);
 
@@ -70,6 +81,24 @@ public:
 
     bool Start(Func func, void* ctx);
 
+    // runs the task in ring 3 at entry with the user stack, the task owns
+    // space from here on, even if starting fails
+    bool StartUser(Mm::AddressSpace* space, ulong entry, ulong stack);
+
+    // nullptr for kernel tasks
+    Mm::AddressSpace* GetAddressSpace()
+    {
+        return Space;
+    }
+
+    // where the entries from user mode start, 16 byte aligned
+    ulong GetKernelStackTop();
+
+    // ends the current task, Wait returns and GetExitCode tells the code
+    static void ExitCurrent(long code);
+
+    long GetExitCode();
+
     void Wait();
 
     void SetStopping();
@@ -78,42 +107,82 @@ public:
     void SetName(const char *fmt, ...);
     const char* GetName();
 
+    // charges the tsc ticks since RunStartTsc, called by the cpu running
+    // the task with its lock held
     void UpdateRuntime();
 
-    void SetCpuAffinity(ulong affinity);
-    ulong GetCpuAffinity();
+    Stdlib::Time GetRuntime();
+
+    void SetCpuAffinity(const CpuMask& affinity);
+    CpuMask GetCpuAffinity();
 
     TaskQueue* SelectNextTaskQueue();
 
+    bool SetPriority(ulong priority);
+    ulong GetPriority();
+
+    bool SetNice(long nice);
+    long GetNice();
+
+    static ulong NiceToWeight(long nice);
+
+    // exact size cache line aligned slots of ObjectPool<Task>
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* ptr) noexcept;
+
     static const long StateWaiting = 1;
     static const long StateRunning = 2;
     static const long StateExited = 3;
+    static const long StateBlocked = 4;
 
     static const long FlagStoppingBit = 1;
 
-public:
-    Stdlib::ListEntry ListEntry;
-    Stdlib::ListEntry TableListEntry;
+    static const ulong PriorityCount = 8;
+    static const ulong PriorityDefault = 4;
+    static const ulong PriorityIdle = PriorityCount - 1;
 
-    TaskQueue* TaskQueue;
-    SpinLock Lock;
-    Atomic PreemptDisableCounter;
-    Atomic ContextSwitches;
-    ulong Rsp;
+    static const long NiceMin = -10;
+    static const long NiceMax = 9;
+    static const ulong WeightDefault = 1024;
 
+public:
+    // scheduler state, written on every switch and by waking cpus
+    FastSpinLock Lock __attribute__((aligned(Const::CacheLineSize)));
     Atomic State;
     Atomic Flags;
+    Atomic ContextSwitches;
+    TaskQueue* TaskQueue;
+    ulong Rsp;
+    u64 RunStartTsc;
+    // the time slice runs from here, see TaskQueue::Tick
+    u64 SliceStartTsc;
+    u64 RuntimeTsc;
+    ulong Priority;
+    ulong Weight;
+    ulong VirtualRuntime;
+    volatile bool BlockPending;
 
-    Stdlib::Time RunStartTime;
-    Stdlib::Time Runtime;
-    Stdlib::Time StartTime;
+    Stdlib::ListEntry ListEntry;
+    Stdlib::ListEntry ReadyListEntry;
+    Stdlib::ListEntry WaitListEntry;
+
+    // identity and statistics, read by ps and on exit
+    Stdlib::Time StartTime __attribute__((aligned(Const::CacheLineSize)));
     Stdlib::Time ExitTime;
+    Stdlib::Time WaitDeadline;
+    // runnable but not running: since when, in total and the longest stretch
+    Stdlib::Time ReadyTime;
+    Stdlib::Time WaitTime;
+    Stdlib::Time MaxWaitTime;
 
     Task* Prev;
     ulong Magic;
-    ulong CpuAffinity;
+    CpuMask CpuAffinity;
+    long Nice;
     ulong Pid;
 
+    WaitQueue ExitWaitQueue;
+
 private:
     Task(const Task& other) = delete;
     Task(Task&& other) = delete;
@@ -125,14 +194,39 @@ private:
     void Exit();
     void ExecCallback();
     static void Exec(void *task);
+    static void UserExec(void *task);
 
     bool PrepareStart(Func func, void* ctx);
 
+    void SetSchedParams(ulong priority, long nice);
+
     Stack* Stack;
     Func Function;
     void* Ctx;
     Atomic RefCounter;
 
+    Mm::AddressSpace* Space;
+    ulong UserEntry;
+    ulong UserStack;
+    long ExitCode;
+
+    char Name[32];
+};
+
+static_assert(alignof(Task) == Const::CacheLineSize, "Invalid alignment");
+
+// copy of the fields ps shows, taken by TaskTable::Snapshot
+struct TaskStats final
+{
+    ulong Pid;
+    long State;
+    long Flags;
+    Stdlib::Time Runtime;
+    Stdlib::Time WaitTime;
+    Stdlib::Time MaxWaitTime;
+    long ContextSwitches;
+    ulong Priority;
+    ulong Weight;
     char Name[32];
 };
 
@@ -150,6 +244,12 @@ public:
 
     Task* Lookup(ulong pid);
 
+    // copies the stats of up to maxCount tasks without taking any task or
+    // table lock, returns how many. Fields of a running task may be a few
+    // ticks apart, tasks exiting meanwhile may be missing
+    size_t Snapshot(TaskStats* stats, size_t maxCount);
+
+    // prints a snapshot, no lock is held while formatting
     void Ps(Stdlib::Printer& printer);
 
 private:
@@ -161,10 +261,8 @@ private:
     TaskTable();
     ~TaskTable();
 
-    static const size_t TaskListCount = 512;
-
-    SpinLock Lock[TaskListCount];
-    Stdlib::ListEntry TaskList[TaskListCount];
+    // room for tasks created between counting and copying
+    static const size_t SnapshotSlack = 16;
 
     ObjectTable TaskObjectTable;
 };
@@ -3,12 +3,51 @@
 #include "task.h"
 #include "sched.h"
 #include "cpu.h"
+#include "raw_spin_lock.h"
+#include "rw_spin_lock.h"
+#include "object_table.h"
+#include "rcu.h"
+#include "timer.h"
+#include "parallel.h"
+#include "fpu.h"
+#include "simd.h"
+#include "mutex.h"
+#include "seq_lock.h"
+#include "per_cpu_counter.h"
+#include "preempt.h"
+#include "static_key.h"
+#include "tunable.h"
+#include "channel.h"
+#include "lock_elision.h"
+#include "completion.h"
+#include "work_queue.h"
+#include "parameters.h"
 
 #include <lib/btree.h>
+#include <lib/bplus_tree.h>
+#include <lib/concurrent_bplus_tree.h>
+#include <lib/hash_table.h>
 #include <lib/error.h>
 #include <lib/stdlib.h>
+#include <lib/checksum.h>
 #include <lib/ring_buffer.h>
 #include <lib/vector.h>
+#include <lib/small_vector.h>
+#include <lib/list.h>
+#include <lib/intrusive_ptr.h>
+#include <lib/intrusive_list.h>
+
+#include <mm/page_allocator.h>
+#include <mm/page_table.h>
+#include <mm/early_allocator.h>
+#include <mm/shrinker.h>
+#include <mm/memory_map.h>
+#include <mm/arena.h>
+#include <mm/pool.h>
+#include <mm/object_pool.h>
+#include <mm/vmalloc.h>
+#include <mm/tlb.h>
+#include <mm/address_space.h>
 
 namespace Kernel
 {
@@ -87,6 +126,23 @@ Stdlib::Error TestBtree()
         return MakeError(Stdlib::Error::Unsuccessful);
     }
 
+    for (size_t i = 0; i < keyCount; i++)
+    {
+        bool exist;
+        if (tree.Insert(key[i], value[i] + 1) ||
+            !tree.InsertOrAssign(key[i], value[i]) ||
+            tree.Lookup(key[i], exist) != value[i] || !exist)
+        {
+            Trace(TestLL, "TestBtree: duplicate insert not detected");
+            return MakeError(Stdlib::Error::Unsuccessful);
+        }
+    }
+    if (!tree.Check() || tree.GetCount() != keyCount)
+    {
+        Trace(TestLL, "TestBtree: check failed");
+        return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
     for (size_t i = 0; i < keyCount / 2; i++)
     {
         if (!tree.Delete(key[pos[i]]))
@@ -181,77 +237,1939 @@ Stdlib::Error TestBtree()
     return MakeError(Stdlib::Error::Success);
 }
 
-Stdlib::Error TestAllocator()
+Stdlib::Error TestBtreeBulkLoad()
 {
-    Stdlib::Error err;
+    const size_t keyCount = 500;
+    Stdlib::Vector<u32> key, value;
+    if (!key.ReserveAndUse(keyCount) || !value.ReserveAndUse(keyCount))
+        return MakeError(Stdlib::Error::NoMemory);
 
-    for (size_t size = 1; size <= 8 * Const::PageSize; size++)
+    for (size_t i = 0; i < keyCount; i++)
     {
-        u8 *block = new u8[size];
-        if (block == nullptr)
-        {
-            return Stdlib::Error::NoMemory;
-        }
+        key[i] = 2 * i;
+        value[i] = i;
+    }
 
-        block[0] = 1;
-        block[size / 2] = 1;
-        block[size - 1] = 1;
-        delete [] block;
+    Stdlib::Btree<u32, u32, 4> tree;
+    if (!tree.BulkLoad(key.GetBuf(), value.GetBuf(), keyCount) || !tree.Check())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (tree.GetCount() != keyCount || tree.MinDepth() != tree.MaxDepth())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // odd keys are new, every fourth batch key is already in the tree
+    for (size_t i = 0; i < keyCount; i++)
+    {
+        key[i] = ((i % 4) == 0) ? 2 * i : 2 * (keyCount - i) - 1;
     }
 
+    if (tree.InsertBatch(key.GetBuf(), value.GetBuf(), keyCount) != keyCount - keyCount / 4)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!tree.Check() || tree.GetCount() != 2 * keyCount - keyCount / 4)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    bool exist;
+    if (tree.Lookup(3, exist) != keyCount - 2 || !exist || tree.Lookup(8, exist) != 4 || !exist)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
     return MakeError(Stdlib::Error::Success);
 }
 
-Stdlib::Error TestRingBuffer()
+Stdlib::Error TestBplusTree()
 {
-    Stdlib::RingBuffer<u8, 3> rb;
+    Stdlib::BplusTree<u32, u32> tree;
+    const u32 keyCount = 1000;
 
-    if (!rb.Put(0x1))
+    // insert in a strided order to split both ends of nodes
+    for (u32 i = 0; i < keyCount; i++)
+    {
+        u32 key = (i * 7) % keyCount;
+        if (!tree.Insert(key, key + 1))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (tree.Insert(5, 0) || tree.GetCount() != keyCount || !tree.Check())
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (!rb.Put(0x2))
+    u32 next = 100;
+    size_t calls = tree.Scan(100, 199, [&next](const u32& key, const u32& value)
+    {
+        if (key != next || value != key + 1)
+            return false;
+        next++;
+        return true;
+    });
+
+    if (calls != 100 || next != 200)
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (!rb.Put(0x3))
+    for (u32 i = 0; i < keyCount; i += 3)
+    {
+        if (!tree.Delete(i))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (!tree.Check())
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (rb.Put(0x4))
+    for (u32 i = 0; i < keyCount; i++)
+    {
+        bool exist;
+        u32 value = tree.Lookup(i, exist);
+        if (exist != ((i % 3) != 0) || (exist && value != i + 1))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    tree.Clear();
+    if (tree.GetCount() != 0 || !tree.Check())
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (!rb.IsFull())
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestConcurrentBplusTree()
+{
+    Stdlib::ConcurrentBplusTree<u32, u32> tree;
+    const u32 keyCount = 1000;
+
+    for (u32 i = 0; i < keyCount; i++)
+    {
+        u32 key = (i * 7) % keyCount;
+        if (!tree.Insert(key, key + 1))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (tree.Insert(5, 0) || tree.GetCount() != keyCount || !tree.Check())
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (rb.IsEmpty())
+    for (u32 i = 0; i < keyCount; i += 2)
+    {
+        if (!tree.Delete(i))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    u32 next = 101;
+    size_t calls = tree.Scan(100, 199, [&next](const u32& key, const u32& value)
+    {
+        if (key != next || value != key + 1)
+            return false;
+        next += 2;
+        return true;
+    });
+
+    if (calls != 50 || next != 201 || !tree.Check())
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (rb.Get() != 0x1)
+    bool exist;
+    if (tree.Lookup(998, exist) != 0 || exist || tree.Lookup(999, exist) != 1000 || !exist)
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (rb.Get() != 0x2)
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestHashTable()
+{
+    Stdlib::HashTable<ulong, ulong, RwSpinLock> table;
+    const ulong keyCount = 1000;
+
+    for (ulong i = 0; i < keyCount; i++)
+    {
+        if (!table.Insert(i, i + 1))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (table.Insert(5, 0) || !table.InsertOrAssign(5, 6) || table.GetCount() != keyCount)
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (rb.Get() != 0x3)
+    if (table.GetBucketCount() < keyCount / 2)
         return MakeError(Stdlib::Error::Unsuccessful);
 
-    if (!rb.IsEmpty())
+    for (ulong i = 0; i < keyCount; i += 2)
+    {
+        if (!table.Remove(i) || table.Remove(i))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    ulong sum = 0, count = 0;
+    table.ForEach([&sum, &count](const ulong& key, ulong& value)
+    {
+        sum += value - key;
+        count++;
+    });
+
+    if (count != keyCount / 2 || sum != count || table.GetCount() != count)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    ulong value;
+    if (table.Lookup(998, value) || !table.Lookup(999, value) || value != 1000)
         return MakeError(Stdlib::Error::Unsuccessful);
-   
+
     return MakeError(Stdlib::Error::Success);
 }
 
-Stdlib::Error Test()
+class TestObject final : public Object
+{
+public:
+    virtual void Get() override
+    {
+        RefCounter.Inc();
+    }
+
+    virtual void Put() override
+    {
+        RefCounter.Dec();
+    }
+
+    Atomic RefCounter;
+};
+
+Stdlib::Error TestObjectTable()
+{
+    const size_t objectCount = 600;
+    Stdlib::Vector<TestObject> object;
+    Stdlib::Vector<ObjectId> id;
+    if (!object.ReserveAndUse(objectCount) || !id.ReserveAndUse(objectCount))
+        return MakeError(Stdlib::Error::NoMemory);
+
+    {
+        ObjectTable table;
+        for (size_t i = 0; i < objectCount; i++)
+        {
+            id[i] = table.Insert(&object[i]);
+            if (id[i] == InvalidObjectId)
+                return MakeError(Stdlib::Error::Unsuccessful);
+        }
+
+        table.Remove(id[0]);
+        ObjectId reusedId = table.Insert(&object[0]);
+        if (reusedId == id[0] || table.Lookup(id[0]) != nullptr)
+            return MakeError(Stdlib::Error::Unsuccessful);
+        id[0] = reusedId;
+
+        for (size_t i = 0; i < objectCount; i++)
+        {
+            Object* found = table.Lookup(id[i]);
+            if (found != &object[i] || object[i].RefCounter.Get() != 2)
+                return MakeError(Stdlib::Error::Unsuccessful);
+            found->Put();
+        }
+
+        if (table.GetCount() != objectCount)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    for (size_t i = 0; i < objectCount; i++)
+    {
+        if (object[i].RefCounter.Get() != 0)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+struct TestRcuEntry
+{
+    RcuHead RcuEntry;
+    Atomic* Released;
+};
+
+void TestRcuRelease(RcuHead* head)
+{
+    TestRcuEntry* entry = CONTAINING_RECORD(head, TestRcuEntry, RcuEntry);
+    entry->Released->Inc();
+}
+
+Stdlib::Error TestRcu()
+{
+    auto& rcu = Rcu::GetInstance();
+    Atomic released;
+    TestRcuEntry entry[4];
+
+    rcu.Synchronize();
+    for (size_t i = 0; i < Stdlib::ArraySize(entry); i++)
+    {
+        entry[i].Released = &released;
+        rcu.Call(&entry[i].RcuEntry, TestRcuRelease);
+    }
+
+    rcu.WaitForCallbacks();
+    if (released.Get() != (long)Stdlib::ArraySize(entry))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+void TestCpuCallFunc(void* ctx)
+{
+    static_cast<Atomic*>(ctx)->Inc();
+}
+
+Stdlib::Error TestCpuCall()
+{
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask cpuMask = cpus.GetRunningCpus();
+    long others = (long)cpuMask.Count() - 1;
+
+    Atomic called;
+    cpus.CallFunctionAllExcludeSelf(TestCpuCallFunc, &called);
+    if (called.Get() != others)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    called.Set(0);
+    for (ulong i = cpuMask.First(); i < MaxCpus; i = cpuMask.Next(i + 1))
+    {
+        if (!cpus.CallFunction(i, TestCpuCallFunc, &called))
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (called.Get() != others + 1)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+class TestTimerCallback final : public TimerCallback
+{
+public:
+    virtual void OnTick(TimerCallback& callback) override
+    {
+        (void)callback;
+        Fired.Inc();
+    }
+
+    Atomic Fired;
+};
+
+Stdlib::Error TestTimer()
+{
+    auto& timers = TimerTable::GetInstance();
+    // the longer timeouts start in the second wheel level and cascade down
+    static const ulong TimeoutMs[] = { 1, 3, 30, 70, 140 };
+    TestTimerCallback callback[Stdlib::ArraySize(TimeoutMs)];
+    Timer timer[Stdlib::ArraySize(TimeoutMs)];
+    TestTimerCallback stoppedCallback, periodicCallback;
+    Timer stoppedTimer, periodicTimer;
+
+    for (size_t i = 0; i < Stdlib::ArraySize(TimeoutMs); i++)
+        timers.StartTimer(timer[i], callback[i], Stdlib::Time(TimeoutMs[i] * Const::NanoSecsInMs));
+
+    timers.StartTimer(stoppedTimer, stoppedCallback, Stdlib::Time(20 * Const::NanoSecsInMs));
+    timers.StartTimer(periodicTimer, periodicCallback, Stdlib::Time(10 * Const::NanoSecsInMs),
+        Stdlib::Time(10 * Const::NanoSecsInMs));
+    bool stopped = timers.StopTimer(stoppedTimer);
+
+    Sleep(200 * Const::NanoSecsInMs);
+
+    bool periodicPending = timers.StopTimer(periodicTimer);
+    for (size_t i = 0; i < Stdlib::ArraySize(TimeoutMs); i++)
+    {
+        if (timers.StopTimer(timer[i]) || callback[i].Fired.Get() != 1)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (!stopped || stoppedCallback.Fired.Get() != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!periodicPending || periodicCallback.Fired.Get() < 5)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+static void TestParallelSum(ulong begin, ulong end, void* ctx)
+{
+    ulong sum = 0;
+    for (ulong i = begin; i < end; i++)
+        sum += i;
+
+    static_cast<Atomic*>(ctx)->ReadAndAdd(sum);
+}
+
+static void TestParallelNested(void* ctx)
+{
+    ParallelFor(0, 1000, 10, TestParallelSum, ctx);
+}
+
+Stdlib::Error TestParallel()
+{
+    Atomic sum;
+    ParallelFor(0, 100000, 1000, TestParallelSum, &sum);
+    if (sum.Get() != (100000L * 99999L) / 2)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // groups of jobs which fork and join themselves
+    sum.Set(0);
+    TaskGroup group;
+    for (size_t i = 0; i < 8; i++)
+        group.Run(TestParallelNested, &sum);
+    group.Wait();
+
+    if (sum.Get() != 8 * (1000L * 999L) / 2)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestFpu()
 {
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
     Stdlib::Error err;
 
-    err = TestAllocator();
-    if (!err.Ok())
-        return err;
+    u8* src = static_cast<u8*>(pageAllocator.Alloc(1));
+    u8* dst = static_cast<u8*>(pageAllocator.Alloc(1));
+    if (src == nullptr || dst == nullptr)
+    {
+        err = MakeError(Stdlib::Error::NoMemory);
+        goto cleanup;
+    }
 
-    err = TestBtree();
-    if (!err.Ok())
-        return err;
+    for (size_t i = 0; i < Const::PageSize; i++)
+        src[i] = static_cast<u8>(i * 7 + 1);
 
-    err = TestRingBuffer();
+    SimdCopyPage(dst, src);
+    if (Stdlib::MemCmp(dst, src, Const::PageSize) != 0)
+    {
+        err = MakeError(Stdlib::Error::Unsuccessful);
+        goto cleanup;
+    }
+
+    SimdZeroPage(dst);
+    for (size_t i = 0; i < Const::PageSize; i++)
+    {
+        if (dst[i] != 0)
+        {
+            err = MakeError(Stdlib::Error::Unsuccessful);
+            goto cleanup;
+        }
+    }
+
+    // TS is set again outside the section
+    if (!(GetCr0() & (1UL << 3)))
+    {
+        err = MakeError(Stdlib::Error::Unsuccessful);
+        goto cleanup;
+    }
+
+    err = MakeError(Stdlib::Error::Success);
+
+cleanup:
+    if (src != nullptr)
+        pageAllocator.Free(src);
+    if (dst != nullptr)
+        pageAllocator.Free(dst);
+    return err;
+}
+
+Stdlib::Error TestUserMode()
+{
+    // mov eax, 3 (getpid); syscall; mov edi, eax; mov eax, 0 (exit); syscall
+    static const u8 code[] = { 0xB8, 0x03, 0x00, 0x00, 0x00, 0x0F, 0x05, 0x89, 0xC7,
+        0xB8, 0x00, 0x00, 0x00, 0x00, 0x0F, 0x05 };
+    const ulong codeAddr = Mm::MemoryMap::UserSpaceBase;
+    const ulong stackAddr = codeAddr + 16 * Const::PageSize;
+
+    // the top user page is never mappable
+    if (Mm::AddressSpace::IsUserRange(Mm::MemoryMap::UserSpaceEnd, Const::PageSize) ||
+        !Mm::AddressSpace::IsUserRange(Mm::MemoryMap::UserSpaceEnd - Const::PageSize, Const::PageSize) ||
+        Mm::AddressSpace::IsUserRange(Mm::MemoryMap::UserSpaceEnd - Const::PageSize, 2 * Const::PageSize))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    Mm::AddressSpace* space = new Mm::AddressSpace();
+    if (space == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    if (!space->Setup() ||
+        !space->Map(codeAddr, 1, 0) ||
+        !space->Map(stackAddr, 1, Mm::PageTable::MapWritable) ||
+        !space->CopyTo(codeAddr, code, sizeof(code)))
+    {
+        delete space;
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    Task* task = new Task();
+    if (task == nullptr)
+    {
+        delete space;
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    if (!task->StartUser(space, codeAddr, stackAddr + Const::PageSize))
+    {
+        task->Put();
+        return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    task->Wait();
+
+    Stdlib::Error err;
+    if (task->GetExitCode() != static_cast<long>(task->Pid))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    else
+        err = MakeError(Stdlib::Error::Success);
+
+    task->Put();
+    return err;
+}
+
+struct TestMutexState
+{
+    TestMutexState()
+        : Counter(0)
+        , Done(0)
+    {
+    }
+
+    Mutex Mutex;
+    CondVar DoneCond;
+    Semaphore Items;
+    ulong Counter;
+    ulong Done;
+};
+
+static const ulong TestMutexTasks = 4;
+static const ulong TestMutexLoops = 1000;
+
+static void TestMutexTaskFunc(void* ctx)
+{
+    auto state = static_cast<TestMutexState*>(ctx);
+
+    for (ulong i = 0; i < TestMutexLoops; i++)
+    {
+        Stdlib::AutoLock lock(state->Mutex);
+        ulong value = state->Counter;
+        // give the others a chance to find the mutex held
+        if ((i % 64) == 0)
+            Schedule();
+        state->Counter = value + 1;
+    }
+
+    for (ulong i = 0; i < TestMutexLoops; i++)
+        state->Items.Up();
+
+    Stdlib::AutoLock lock(state->Mutex);
+    state->Done++;
+    state->DoneCond.Signal();
+}
+
+Stdlib::Error TestMutex()
+{
+    auto state = new TestMutexState();
+    if (state == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    Task* task[TestMutexTasks] = {0};
+    size_t started = 0;
+    for (size_t i = 0; i < TestMutexTasks; i++)
+    {
+        task[i] = new Task("testmutex%u", i);
+        if (task[i] == nullptr)
+            break;
+
+        if (!task[i]->Start(TestMutexTaskFunc, state))
+        {
+            task[i]->Put();
+            task[i] = nullptr;
+            break;
+        }
+        started++;
+    }
+
+    for (ulong i = 0; i < started * TestMutexLoops; i++)
+        state->Items.Down();
+
+    {
+        Stdlib::AutoLock lock(state->Mutex);
+        while (state->Done != started)
+            state->DoneCond.Wait(state->Mutex);
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        task[i]->Wait();
+        task[i]->Put();
+    }
+
+    bool ok = (started == TestMutexTasks && state->Counter == started * TestMutexLoops &&
+        state->Items.GetCount() == 0);
+    delete state;
+
+    return ok ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+using TestChannelType = Channel<ulong, 16>;
+
+static const ulong TestChannelTasks = 3;
+static const ulong TestChannelValues = 2000;
+static const ulong TestChannelBatch = 5;
+
+static void TestChannelTaskFunc(void* ctx)
+{
+    auto channel = static_cast<TestChannelType*>(ctx);
+
+    // half one by one, half in batches, 1..TestChannelValues
+    ulong value = 1;
+    for (; value <= TestChannelValues / 2; value++)
+        channel->Send(value);
+
+    ulong batch[TestChannelBatch];
+    while (value <= TestChannelValues)
+    {
+        size_t count = 0;
+        for (; count < TestChannelBatch && value <= TestChannelValues; count++)
+            batch[count] = value++;
+        channel->SendBatch(batch, count);
+    }
+}
+
+Stdlib::Error TestChannel()
+{
+    auto channel = new TestChannelType();
+    if (channel == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    ulong value;
+    bool ok = !channel->TryRecv(value);
+    for (ulong i = 0; ok && i < channel->GetCapacity(); i++)
+        ok = channel->TrySend(i);
+    ok = ok && !channel->TrySend(0) && channel->GetCount() == channel->GetCapacity();
+    for (ulong i = 0; ok && i < channel->GetCapacity(); i++)
+        ok = channel->TryRecv(value) && value == i;
+    if (!ok)
+    {
+        delete channel;
+        return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    Task* task[TestChannelTasks] = {0};
+    size_t started = 0;
+    for (size_t i = 0; i < TestChannelTasks; i++)
+    {
+        task[i] = new Task("testchannel%u", i);
+        if (task[i] == nullptr)
+            break;
+
+        if (!task[i]->Start(TestChannelTaskFunc, channel))
+        {
+            task[i]->Put();
+            task[i] = nullptr;
+            break;
+        }
+        started++;
+    }
+
+    // the small channel keeps the senders blocking on the receiver
+    ulong expected = started * (TestChannelValues * (TestChannelValues + 1) / 2);
+    ulong total = started * TestChannelValues;
+    ulong sum = 0;
+    ulong batch[TestChannelBatch];
+    for (ulong received = 0; received < total;)
+    {
+        size_t count;
+        if (received % 2)
+        {
+            channel->Recv(batch[0]);
+            count = 1;
+        }
+        else
+        {
+            count = channel->RecvBatch(batch, Stdlib::Min(total - received, TestChannelBatch));
+        }
+
+        for (size_t i = 0; i < count; i++)
+            sum += batch[i];
+        received += count;
+    }
+
+    for (size_t i = 0; i < started; i++)
+    {
+        task[i]->Wait();
+        task[i]->Put();
+    }
+
+    ok = (started == TestChannelTasks && sum == expected && !channel->TryRecv(value));
+    delete channel;
+
+    return ok ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+struct TestCompletionState final
+{
+    Future<ulong> Value;
+    Completion Counted;
+    Completion Slow;
+    Completion Chained;
+    CompletionCallback Link;
+    CompletionCallback Callback;
+    Atomic Calls;
+
+    TestCompletionState()
+        : Counted(3)
+    {
+    }
+};
+
+static void TestCompletionTaskFunc(void* ctx)
+{
+    auto state = static_cast<TestCompletionState*>(ctx);
+
+    Sleep(Const::NanoSecsInMs);
+    state->Value.Set(42);
+    state->Counted.Complete();
+    Sleep(10 * Const::NanoSecsInMs);
+    state->Slow.Complete(false);
+}
+
+static void TestCompletionWorkFunc(void* ctx)
+{
+    auto state = static_cast<TestCompletionState*>(ctx);
+
+    state->Counted.Complete();
+}
+
+static void TestCompletionCallback(CompletionCallback* callback, bool ok)
+{
+    auto state = static_cast<TestCompletionState*>(callback->Ctx);
+
+    if (ok)
+        state->Calls.Inc();
+}
+
+Stdlib::Error TestCompletion()
+{
+    auto state = new TestCompletionState();
+    if (state == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    state->Callback.Fn = &TestCompletionCallback;
+    state->Callback.Ctx = state;
+    state->Counted.OnDone(state->Callback);
+    state->Counted.Chain(state->Link, state->Chained);
+
+    Work work(TestCompletionWorkFunc, state);
+    Task* task = new Task("testcompletion");
+    if (task == nullptr)
+    {
+        state->Counted.RemoveCallback(state->Callback);
+        state->Counted.RemoveCallback(state->Link);
+        delete state;
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    bool ok = task->Start(TestCompletionTaskFunc, state);
+    if (!ok)
+    {
+        task->Put();
+        state->Value.Set(42);
+        state->Counted.Complete();
+        state->Slow.Complete(false);
+    }
+
+    if (!WorkQueue::GetInstance().Queue(work))
+        state->Counted.Complete();
+    state->Counted.Complete();
+
+    Completion* any[2] = { &state->Slow, &state->Chained };
+    size_t index = Completion::WaitAny(any, 2);
+    bool passed = (index < 2 && any[index]->IsDone());
+    passed = passed && state->Value.Get() == 42 && state->Value.IsOk();
+    passed = passed && state->Counted.IsDone() && state->Counted.IsOk();
+    passed = passed && state->Calls.Get() == 1;
+    passed = passed && !Completion::WaitAll(any, 2);
+
+    // done already, runs right away
+    state->Chained.OnDone(state->Callback);
+    passed = passed && state->Calls.Get() == 2;
+
+    if (ok)
+    {
+        task->Wait();
+        task->Put();
+    }
+    delete state;
+
+    return passed ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+Stdlib::Error TestTaskSnapshot()
+{
+    const size_t maxCount = 256;
+    TaskStats* stats = new TaskStats[maxCount];
+    if (stats == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    Task* current = Task::GetCurrentTask();
+    size_t count = TaskTable::GetInstance().Snapshot(stats, maxCount);
+    bool found = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (stats[i].Pid == current->Pid &&
+            Stdlib::StrCmp(stats[i].Name, current->GetName()) == 0)
+            found = true;
+    }
+
+    // a short buffer takes what fits
+    bool ok = found && count != 0 && TaskTable::GetInstance().Snapshot(stats, 1) == 1;
+    delete[] stats;
+
+    return ok ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+Stdlib::Error TestAllocator()
+{
+    Stdlib::Error err;
+
+    for (size_t size = 1; size <= 8 * Const::PageSize; size++)
+    {
+        u8 *block = new u8[size];
+        if (block == nullptr)
+        {
+            return Stdlib::Error::NoMemory;
+        }
+
+        block[0] = 1;
+        block[size / 2] = 1;
+        block[size - 1] = 1;
+        delete [] block;
+    }
+
+    const size_t align[] = {8, 16, 64, 256, Const::PageSize};
+    for (size_t i = 0; i < Stdlib::ArraySize(align); i++)
+    {
+        for (size_t size = 1; size <= 3 * Const::PageSize; size += 61)
+        {
+            u8 *block = static_cast<u8*>(Mm::NewAligned(size, align[i]));
+            if (block == nullptr)
+                return MakeError(Stdlib::Error::NoMemory);
+
+            bool aligned = ((ulong)block % align[i]) == 0;
+            block[0] = 1;
+            block[size - 1] = 1;
+            delete [] block;
+            if (!aligned)
+                return MakeError(Stdlib::Error::Unsuccessful);
+        }
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestPageAllocator()
+{
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    size_t freePages = pageAllocator.GetFreePages();
+    const size_t numPages[] = {1, 3, 8, 64, 512, 2, 1};
+    u8* pages[Stdlib::ArraySize(numPages)] = {0};
+
+    for (size_t i = 0; i < Stdlib::ArraySize(numPages); i++)
+    {
+        pages[i] = static_cast<u8*>(pageAllocator.Alloc(numPages[i]));
+        if (pages[i] == nullptr)
+        {
+            for (size_t j = 0; j < i; j++)
+            {
+                pageAllocator.Free(pages[j]);
+            }
+            return MakeError(Stdlib::Error::NoMemory);
+        }
+
+        size_t blockSize = (static_cast<size_t>(1) << Stdlib::Log2(numPages[i])) * Const::PageSize;
+        if (((ulong)pages[i] % blockSize) != 0)
+        {
+            Trace(0, "Pages 0x%p not aligned to 0x%p", pages[i], blockSize);
+            return MakeError(Stdlib::Error::Unsuccessful);
+        }
+
+        pages[i][0] = 1;
+        pages[i][numPages[i] * Const::PageSize - 1] = 1;
+    }
+
+    for (size_t i = 0; i < Stdlib::ArraySize(numPages); i++)
+    {
+        pageAllocator.Free(pages[Stdlib::ArraySize(numPages) - i - 1]);
+    }
+
+    if (pageAllocator.GetFreePages() != freePages)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // from the zero pool or zeroed on the spot, either way no stale bytes
+    const size_t zeroedPages[] = {1, 1, 3};
+    for (size_t i = 0; i < Stdlib::ArraySize(zeroedPages); i++)
+    {
+        size_t size = zeroedPages[i] * Const::PageSize;
+        u8* page = static_cast<u8*>(pageAllocator.AllocZeroed(zeroedPages[i]));
+        if (page == nullptr)
+            return MakeError(Stdlib::Error::NoMemory);
+
+        bool zeroed = true;
+        for (size_t j = 0; j < size; j++)
+        {
+            if (page[j] != 0)
+                zeroed = false;
+        }
+
+        Stdlib::MemSet(page, 0xCC, size);
+        pageAllocator.Free(page);
+        if (!zeroed)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestPageTable()
+{
+    auto& pt = Mm::PageTable::GetInstance();
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    // first address above the direct map slot
+    ulong virtAddr = Mm::MemoryMap::KernelSpaceBase + 512 * Const::GB;
+
+    ulong* page = static_cast<ulong*>(pageAllocator.Alloc(1));
+    if (page == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    page[0] = 0xCBDECBDE;
+
+    Stdlib::Error err;
+    if (!pt.MapPage(virtAddr, pt.VirtToPhys((ulong)page)))
+    {
+        err = MakeError(Stdlib::Error::Unsuccessful);
+        goto freePage;
+    }
+
+    if (*reinterpret_cast<volatile ulong*>(virtAddr) != 0xCBDECBDE)
+    {
+        err = MakeError(Stdlib::Error::Unsuccessful);
+        pt.UnmapPage(virtAddr);
+        goto freePage;
+    }
+
+    if (pt.MapPage(virtAddr, pt.VirtToPhys((ulong)page)) || !pt.UnmapPage(virtAddr) || pt.UnmapPage(virtAddr))
+    {
+        err = MakeError(Stdlib::Error::Unsuccessful);
+        goto freePage;
+    }
+
+    err = MakeError(Stdlib::Error::Success);
+
+freePage:
+    pageAllocator.Free(page);
+    return err;
+}
+
+Stdlib::Error TestVmalloc()
+{
+    auto& vmalloc = Mm::Vmalloc::GetInstance();
+    // backed by single pages, the tail page is partially used
+    const size_t size = 2 * Const::MB + 100;
+
+    ulong* buf = static_cast<ulong*>(vmalloc.Alloc(size));
+    if (buf == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    ulong* buf2 = static_cast<ulong*>(vmalloc.Alloc(Const::PageSize));
+    if (buf2 == nullptr)
+    {
+        vmalloc.Free(buf);
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    Stdlib::Error err = MakeError(Stdlib::Error::Success);
+    size_t count = size / sizeof(ulong);
+    for (size_t i = 0; i < count; i++)
+        buf[i] = i;
+
+    // a guard page separates the areas
+    if (!vmalloc.Contains(buf) || (ulong)buf2 < (ulong)buf + Stdlib::RoundUp(size, Const::PageSize) + Const::PageSize)
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    for (size_t i = 0; err.Ok() && i < count; i++)
+    {
+        if (buf[i] != i)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    vmalloc.Free(buf);
+    vmalloc.Free(buf2);
+    if (!err.Ok())
+        return err;
+
+    // only the touched pages get backed, zeroed
+    u8* lazy = static_cast<u8*>(vmalloc.AllocLazy(Const::MB));
+    if (lazy == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    for (size_t offset = 0; offset < Const::MB; offset += 64 * Const::PageSize)
+    {
+        if (*reinterpret_cast<volatile u8*>(&lazy[offset + 1]) != 0)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        lazy[offset] = 0xCB;
+        if (lazy[offset] != 0xCB)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    vmalloc.Free(lazy);
+    return err;
+}
+
+Stdlib::Error TestTlb()
+{
+    auto& pt = Mm::PageTable::GetInstance();
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+
+    // borrow the address space of a lazy area, nothing is backed by it
+    void* area = Mm::Vmalloc::GetInstance().AllocLazy(Const::PageSize);
+    if (area == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    void* page = pageAllocator.Alloc(1);
+    if (page == nullptr)
+    {
+        Mm::Vmalloc::GetInstance().Free(area);
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    Stdlib::Error err = MakeError(Stdlib::Error::Success);
+    ulong addr = (ulong)area;
+    ulong phyAddr;
+    bool accessed = true;
+
+    // a mapping nobody used needs no shootdown
+    if (!pt.MapPage(addr, pt.VirtToPhys((ulong)page)) || !pt.UnmapPage(addr, phyAddr, accessed) || accessed)
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    if (err.Ok() && pt.MapPage(addr, pt.VirtToPhys((ulong)page)))
+    {
+        (void)*reinterpret_cast<volatile ulong*>(addr);
+        if (!pt.UnmapPage(addr, phyAddr, accessed) || !accessed || phyAddr != pt.VirtToPhys((ulong)page))
+            err = MakeError(Stdlib::Error::Unsuccessful);
+    }
+    else if (err.Ok())
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    Mm::Tlb::Batch batch;
+    batch.Add(addr, 1);
+    batch.Add(addr + Const::PageSize, 2);
+    if (batch.IsEmpty())
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    batch.Flush();
+    if (!batch.IsEmpty())
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    pageAllocator.Free(page);
+    Mm::Vmalloc::GetInstance().Free(area);
+    return err;
+}
+
+Stdlib::Error TestRingBuffer()
+{
+    Stdlib::RingBuffer<u8, 3> rb;
+
+    if (!rb.Put(0x1))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!rb.Put(0x2))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!rb.Put(0x3))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.Put(0x4))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!rb.IsFull())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.Get() != 0x1)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.Get() != 0x2)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.Get() != 0x3)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!rb.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // wrap around in both directions
+    const u8 in[] = {0x5, 0x6, 0x7, 0x8};
+    u8 out[4];
+
+    if (!rb.Put(0x4) || rb.Get() != 0x4)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.PutMany(in, Stdlib::ArraySize(in)) != 3 || !rb.IsFull())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (rb.GetMany(out, Stdlib::ArraySize(out)) != 3 || out[0] != 0x5 || out[1] != 0x6 || out[2] != 0x7)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!rb.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestLockFreeRingBuffer()
+{
+    Stdlib::SpscRingBuffer<u8, 4> spsc;
+    Stdlib::MpscRingBuffer<u8, 4> mpsc;
+    const u8 in[] = {0x1, 0x2, 0x3, 0x4, 0x5};
+    u8 out[4];
+
+    for (size_t round = 0; round < 3; round++)
+    {
+        if (spsc.PutMany(in, Stdlib::ArraySize(in)) != 4 || spsc.Put(0x6) || !spsc.IsFull())
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (mpsc.PutMany(in, Stdlib::ArraySize(in)) != 4 || mpsc.Put(0x6))
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (spsc.GetMany(out, 3) != 3 || out[0] != 0x1 || out[2] != 0x3)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (mpsc.GetMany(out, 3) != 3 || out[0] != 0x1 || out[2] != 0x3)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (!spsc.Get(out[0]) || out[0] != 0x4 || spsc.Get(out[0]) || !spsc.IsEmpty())
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (!mpsc.Get(out[0]) || out[0] != 0x4 || mpsc.Get(out[0]) || !mpsc.IsEmpty())
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+struct TestSeqValue
+{
+    ulong First;
+    ulong Second;
+};
+
+Stdlib::Error TestCounters()
+{
+    auto counter = new PerCpuCounter();
+    if (counter == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    for (ulong i = 0; i < 100; i++)
+        counter->Inc();
+    counter->Add(-10);
+    counter->Dec();
+    long value = counter->Get();
+    delete counter;
+
+    if (value != 89)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // a reused slot starts from zero
+    counter = new PerCpuCounter();
+    if (counter == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+    value = counter->Get();
+    delete counter;
+    if (value != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    auto seqLock = new SeqLock<TestSeqValue>();
+    if (seqLock == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    TestSeqValue seqValue = {1, 2};
+    seqLock->Write(seqValue);
+    seqValue = seqLock->Read();
+    delete seqLock;
+    if (seqValue.First != 1 || seqValue.Second != 2)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestChecksum()
+{
+    const char* check = "123456789";
+    if (Stdlib::Crc32c(0, check, 9) != 0xe3069283)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // long enough for the interleaved streams, compared with odd pieces
+    // that only take the short paths
+    const size_t size = 3 * Const::PageSize * 7 + 5;
+    u8* buf = new u8[size];
+    if (buf == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    for (size_t i = 0; i < size; i++)
+        buf[i] = static_cast<u8>(Stdlib::Mix64(i));
+
+    u32 crc = Stdlib::Crc32c(0, buf + 1, size - 1);
+    u32 pieces = 0;
+    for (size_t offset = 1, piece = 13; offset < size; offset += piece, piece = piece * 3 % 701 + 1)
+        pieces = Stdlib::Crc32c(pieces, buf + offset, Stdlib::Min(piece, size - offset));
+
+    bool ok = (crc == pieces);
+
+    // rfc 1071 example, sums to 0xddf2 in network order
+    u8 header[10] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7, 0x00, 0x00 };
+    u16 sum = Stdlib::InetChecksum(header, 8);
+    ok = ok && (sum == 0x0d22);
+    Stdlib::MemCpy(&header[8], &sum, sizeof(sum));
+    ok = ok && (Stdlib::InetChecksum(header, sizeof(header)) == 0);
+    ok = ok && (Stdlib::InetFold(Stdlib::InetSum(Stdlib::InetSum(0, buf, 64), buf + 64, size - 64)) ==
+        Stdlib::InetChecksum(buf, size));
+
+    u64 hash = Stdlib::Hash64(buf, size);
+    ok = ok && (hash == Stdlib::Hash64(buf, size)) && (hash != Stdlib::Hash64(buf, size, 1)) &&
+        (hash != Stdlib::Hash64(buf, size - 1));
+    for (size_t len = 1; ok && len <= 64; len++)
+        ok = (Stdlib::Hash64(buf, len) != Stdlib::Hash64(buf + 1, len));
+
+    delete[] buf;
+    return ok ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+Stdlib::Error TestParameters()
+{
+    Parameters params;
+
+    if (!params.Parse("smp=off perftest=alloc,sched,btree readahead=8"))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!params.IsSmpOff() || Stdlib::StrCmp(params.GetPerfTest(), "alloc,sched,btree") != 0 ||
+        params.GetReadahead() != 8)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestPrintf()
+{
+    char buf[64];
+
+    int size = Stdlib::SnPrintf(buf, sizeof(buf), "%u %u %p %c%s", 0UL, 18446744073709551615UL,
+        (void*)0xABC, 'x', "yz");
+    if (size <= 0 || Stdlib::StrCmp(buf, "0 18446744073709551615 ABC xyz") != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (Stdlib::SnPrintf(buf, sizeof(buf), "%u", 1234567UL) != 8 ||
+        Stdlib::StrCmp(buf, "1234567") != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // no room for the terminator
+    if (Stdlib::SnPrintf(buf, 4, "abcd") >= 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+struct TestListItem
+{
+    size_t Value;
+    Stdlib::ListEntry Link;
+};
+
+Stdlib::Error TestIntrusiveList()
+{
+    TestListItem item[8];
+    Stdlib::IntrusiveList<TestListItem, &TestListItem::Link> list;
+
+    for (size_t i = 0; i < Stdlib::ArraySize(item); i++)
+    {
+        item[i].Value = i;
+        if (i % 2)
+            list.AddTail(&item[i]);
+        else
+            list.AddHead(&item[i]);
+    }
+
+    if (list.Count() != 8 || list.Head() != &item[6] || list.Tail() != &item[7])
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // erase the even values, leaving 1 3 5 7 in order
+    for (auto it = list.GetIterator(); it.IsValid();)
+    {
+        if (it.Get().Value % 2 == 0)
+            it.Erase();
+        else
+            it.Next();
+    }
+
+    size_t expected = 1;
+    for (auto it = list.GetIterator(); it.IsValid(); it.Next())
+    {
+        if (it.Get().Value != expected)
+            return MakeError(Stdlib::Error::Unsuccessful);
+        expected += 2;
+    }
+
+    list.Remove(&item[3]);
+    if (list.PopHead() != &item[1] || list.PopTail() != &item[7] ||
+        list.PopHead() != &item[5] || !list.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!item[3].Link.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+struct TestRefObject
+{
+    TestRefObject(size_t& released)
+        : Released(released)
+    {
+        RefCount.Set(1);
+    }
+
+    void Get()
+    {
+        RefCount.Inc();
+    }
+
+    void Put()
+    {
+        if (RefCount.DecAndTest())
+            Released++;
+    }
+
+    Atomic RefCount;
+    size_t& Released;
+};
+
+Stdlib::Error TestIntrusivePtr()
+{
+    size_t released = 0;
+    TestRefObject object(released);
+
+    {
+        auto ptr = Stdlib::IntrusivePtr<TestRefObject>::Attach(&object);
+        Stdlib::IntrusivePtr<TestRefObject> copy(ptr);
+        Stdlib::IntrusivePtr<TestRefObject> moved(Stdlib::Move(copy));
+
+        if (copy.Get() != nullptr || moved.Get() != &object || object.RefCount.Get() != 2)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        ptr = moved;
+        if (object.RefCount.Get() != 2)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    if (released != 1)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestSmallVector()
+{
+    Stdlib::SmallVector<size_t, 4> vec;
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        if (!vec.PushBack(i))
+            return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    if (!vec.IsInline() || vec.GetCapacity() != 4)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    for (size_t i = 4; i < 100; i++)
+    {
+        if (!vec.PushBack(i))
+            return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    if (vec.IsInline() || vec.GetCapacity() != 128 || vec.GetSize() != 100)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    for (size_t i = 0; i < vec.GetSize(); i++)
+    {
+        if (vec[i] != i)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    vec.PopBack();
+    if (vec.Back() != 98 || !vec.Truncate(10) || vec.GetSize() != 10)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    vec.Clear();
+    if (!vec.IsInline() || !vec.IsEmpty())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // non trivial elements are moved on growth
+    Stdlib::SmallVector<Stdlib::Vector<size_t>, 2> nested;
+    for (size_t i = 0; i < 8; i++)
+    {
+        Stdlib::Vector<size_t> inner;
+        if (!inner.PushBack(i) || !nested.PushBack(Stdlib::Move(inner)))
+            return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    for (size_t i = 0; i < nested.GetSize(); i++)
+    {
+        if (nested[i].GetSize() != 1 || nested[i][0] != i)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    // pushing an element of a full heap array copies it from the new one
+    for (size_t i = 0; i < 8; i++)
+        vec.PushBack(i + 10);
+    if (vec.IsInline() || vec.GetSize() != vec.GetCapacity() || !vec.PushBack(vec[1]) ||
+        vec.GetSize() != 9 || vec[8] != 11)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestArena()
+{
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    size_t freePages = pageAllocator.GetFreePages();
+
+    {
+        Mm::Arena arena(pageAllocator);
+
+        u8* small = static_cast<u8*>(arena.Alloc(1));
+        u8* next = static_cast<u8*>(arena.Alloc(24));
+        if (small == nullptr || next != small + 16 || arena.GetPageCount() != 1)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        // larger than a chunk gets its own pages
+        if (arena.Alloc(3 * Const::PageSize) == nullptr || arena.GetPageCount() < 4)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        Stdlib::Vector<size_t, Mm::ArenaAllocator> vec{Mm::ArenaAllocator(&arena)};
+        Stdlib::LinkedList<size_t, Mm::ArenaAllocator> list{Mm::ArenaAllocator(&arena)};
+        for (size_t i = 0; i < 100; i++)
+        {
+            if (!vec.PushBack(i) || !list.AddTail(i))
+                return MakeError(Stdlib::Error::NoMemory);
+        }
+
+        if (vec[99] != 99 || list.Count() != 100 || list.Tail() != 99)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        list.Clear();
+        vec.Clear();
+        arena.Reset();
+        if (arena.GetPageCount() != 0 || arena.GetUsage() != 0)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        if (arena.New<size_t>(7) == nullptr)
+            return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    if (pageAllocator.GetFreePages() != freePages)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestPoolBtree()
+{
+    using Tree = Stdlib::Btree<u32, u32, 4, Stdlib::NopLock, Mm::PoolAllocator>;
+
+    Mm::Pool pool;
+    pool.Setup(Tree::GetNodeSize(), &Mm::PageAllocatorImpl::GetInstance());
+
+    {
+        Tree tree{Mm::PoolAllocator(&pool)};
+        for (u32 i = 0; i < 200; i++)
+        {
+            if (!tree.Insert(i, i + 1))
+                return MakeError(Stdlib::Error::Unsuccessful);
+        }
+
+        bool exist;
+        if (tree.Lookup(150, exist) != 151 || !exist || !tree.Check())
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        for (u32 i = 0; i < 200; i += 2)
+        {
+            if (!tree.Delete(i))
+                return MakeError(Stdlib::Error::Unsuccessful);
+        }
+
+        if (!tree.Check())
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    Mm::Pool::PoolStats stats;
+    pool.GetStats(stats);
+    if (stats.Usage != 0 || stats.PeakUsage == 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+struct TestPoolObject final
+{
+    static Atomic Constructed;
+
+    TestPoolObject()
+        : Value(0)
+        , Buf(new u8[64])
+    {
+        Constructed.Inc();
+    }
+
+    TestPoolObject(ulong value)
+        : Value(value)
+        , Buf(new u8[64])
+    {
+        Constructed.Inc();
+    }
+
+    ~TestPoolObject()
+    {
+        delete[] Buf;
+        Constructed.Dec();
+    }
+
+    void Recycle()
+    {
+        Value = 0;
+    }
+
+    ulong Value;
+    u8* Buf;
+    u8 Pad[20];
+};
+
+Atomic TestPoolObject::Constructed;
+
+Stdlib::Error TestObjectPool()
+{
+    auto& pool = Mm::ObjectPool<TestPoolObject>::GetInstance();
+    static_assert(Mm::ObjectPool<TestPoolObject>::SlotSize == 40, "Invalid size");
+
+    TestPoolObject* obj[16];
+    for (size_t i = 0; i < Stdlib::ArraySize(obj); i++)
+    {
+        obj[i] = pool.New(i + 1);
+        if (obj[i] == nullptr || obj[i]->Value != i + 1)
+            return MakeError(Stdlib::Error::Unsuccessful);
+        // slots follow the slab header back to back
+        ulong off = (reinterpret_cast<ulong>(obj[i]) & (Const::PageSize - 1)) - Const::CacheLineSize;
+        if (off % 40 != 0)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    for (size_t i = 0; i < Stdlib::ArraySize(obj); i++)
+        pool.Delete(obj[i]);
+
+    if (TestPoolObject::Constructed.Get() != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // a recycled object comes back without running the constructor again,
+    // the cache is per cpu so stay on this one
+    auto& cached = Mm::CachedObjectPool<TestPoolObject>::GetInstance();
+    PreemptDisable();
+    TestPoolObject* first = cached.New();
+    if (first == nullptr)
+    {
+        PreemptEnable();
+        return MakeError(Stdlib::Error::Unsuccessful);
+    }
+    u8* buf = first->Buf;
+    first->Value = 7;
+    cached.Delete(first);
+
+    TestPoolObject* second = cached.New();
+    bool reused = (second != nullptr && second->Buf == buf && second->Value == 0 &&
+        TestPoolObject::Constructed.Get() == 1) ? true : false;
+    cached.Delete(second);
+    size_t parked = cached.GetCachedCount();
+    PreemptEnable();
+
+    cached.DrainAll();
+    if (second == nullptr || (PreemptIsOn() && (!reused || parked != 1)) || cached.GetCachedCount() != 0)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    Mm::Pool::PoolStats stats;
+    pool.GetStats(stats);
+    if (TestPoolObject::Constructed.Get() != 0 || stats.Usage != 0 || stats.Size != 40)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+StaticKey TestKey("test", false);
+
+// noinline keeps one site per branch
+static __attribute__((noinline)) ulong TestKeyUnlikely()
+{
+    if (StaticBranchUnlikely(TestKey))
+        return 1;
+    return 2;
+}
+
+static __attribute__((noinline)) ulong TestKeyLikely()
+{
+    if (StaticBranchLikely(TestKey))
+        return 1;
+    return 2;
+}
+
+Stdlib::Error TestStaticKey()
+{
+    auto& keys = StaticKeys::GetInstance();
+
+    if (keys.Find("test") != &TestKey || TestKey.IsEnabled())
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (TestKeyUnlikely() != 2 || TestKeyLikely() != 2)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        keys.Set(TestKey, true);
+        if (TestKeyUnlikely() != 1 || TestKeyLikely() != 1)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        keys.Set(TestKey, false);
+        if (TestKeyUnlikely() != 2 || TestKeyLikely() != 2)
+            return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+static ulong TestTunableNotified;
+
+// 13 stands for a value the subsystem can't apply
+static bool OnTestTunable(ulong value)
+{
+    TestTunableNotified = value;
+    return (value != 13) ? true : false;
+}
+
+DEFINE_TUNABLE(TestTunable, "testtunable", 5, 1, 100, OnTestTunable);
+DEFINE_TUNABLE(TestBootTunable, "testboottunable", 0, 0, 1, nullptr, Tunable::FlagBootOnly);
+
+Stdlib::Error TestTunables()
+{
+    auto& table = TunableTable::GetInstance();
+
+    if (table.Find("testtunable") != &TestTunable || table.Find("nosuchtunable") != nullptr)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (TestTunable.Get() != 5 || TestTunable.GetDefault() != 5)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    TestTunableNotified = 0;
+    if (!table.Set("testtunable", "42", false) || TestTunable.Get() != 42 || TestTunableNotified != 42)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // out of range, garbage and rejected values leave the value alone
+    if (table.Set("testtunable", "0", false) || table.Set("testtunable", "101", false) ||
+        table.Set("testtunable", "x", false) || table.Set("testtunable", "13", false) ||
+        TestTunable.Get() != 42)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (table.Set("testboottunable", "on", false) || !table.Set("testboottunable", "on", true) ||
+        TestBootTunable.Get() != 1)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    TestTunable.Set(TestTunable.GetDefault());
+    TestBootTunable.Set(TestBootTunable.GetDefault());
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestEarlyAllocator()
+{
+    auto& earlyAllocator = Mm::EarlyAllocator::GetInstance();
+
+    // sealed before the page allocator took the ram past it
+    ulong end = earlyAllocator.Seal();
+    if (earlyAllocator.Alloc(1) != nullptr)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    auto& pageAllocator = Mm::PageAllocatorImpl::GetInstance();
+    void* page = pageAllocator.Alloc(1);
+    if (page == nullptr)
+        return MakeError(Stdlib::Error::NoMemory);
+
+    ulong phyAddr = Mm::PageTable::GetInstance().VirtToPhys((ulong)page);
+    pageAllocator.Free(page);
+    if (phyAddr < end)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+class TestShrinkerCache final : public Mm::Shrinker
+{
+public:
+    TestShrinkerCache(size_t pages)
+        : Pages(pages)
+        , Calls(0)
+    {
+    }
+
+    virtual size_t CountPages() override
+    {
+        return Pages;
+    }
+
+    virtual size_t ShrinkPages(size_t pageCount) override
+    {
+        size_t freed = Stdlib::Min(pageCount, Pages);
+        Pages -= freed;
+        Calls++;
+        return freed;
+    }
+
+    size_t Pages;
+    size_t Calls;
+};
+
+Stdlib::Error TestShrinkers()
+{
+    auto& table = Mm::ShrinkerTable::GetInstance();
+    TestShrinkerCache small(10), big(30);
+
+    if (!table.Register(small, "testsmall"))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    if (!table.Register(big, "testbig"))
+    {
+        table.Unregister(small);
+        return MakeError(Stdlib::Error::Unsuccessful);
+    }
+
+    // 0 while a background shrink runs
+    size_t freed = 0;
+    for (size_t i = 0; i < 1000 && freed == 0; i++)
+        freed = table.Shrink(8);
+
+    table.Unregister(small);
+    table.Unregister(big);
+
+    // other caches may give their share too, never less than the target
+    size_t smallFreed = 10 - small.Pages;
+    size_t bigFreed = 30 - big.Pages;
+    if (freed < 8 || smallFreed + bigFreed > freed || smallFreed > bigFreed)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    size_t calls = small.Calls + big.Calls;
+    table.Shrink(1);
+    if (small.Calls + big.Calls != calls)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestRawSpinLock()
+{
+    RawSpinLock lock;
+
+    lock.Lock();
+    if (lock.TryLock())
+        return MakeError(Stdlib::Error::Unsuccessful);
+    lock.Unlock();
+
+    if (!lock.TryLock())
+        return MakeError(Stdlib::Error::Unsuccessful);
+    lock.Unlock();
+
+    McsLock mcsLock;
+    McsLock::Node node, node2;
+
+    mcsLock.Lock(node);
+    if (mcsLock.TryLock(node2))
+        return MakeError(Stdlib::Error::Unsuccessful);
+    mcsLock.Unlock(node);
+
+    if (!mcsLock.TryLock(node2))
+        return MakeError(Stdlib::Error::Unsuccessful);
+    mcsLock.Unlock(node2);
+
+    return MakeError(Stdlib::Error::Success);
+}
+
+Stdlib::Error TestLockElision()
+{
+    RawSpinLock rawLock;
+    bool ok = !rawLock.IsLocked();
+    rawLock.Lock();
+    ok = ok && rawLock.IsLocked();
+    rawLock.Unlock();
+    ok = ok && !rawLock.IsLocked();
+    if (!ok)
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    auto& elision = LockElision::GetInstance();
+    if (!elision.IsSupported())
+    {
+        // the tunable keeps reporting off
+        auto& table = TunableTable::GetInstance();
+        if (elision.Enable(true) || table.Set("lockelision", "1", false) ||
+            table.Find("lockelision")->Get() != 0)
+            return MakeError(Stdlib::Error::Unsuccessful);
+
+        return MakeError(Stdlib::Error::Success);
+    }
+
+    if (!elision.Enable(true))
+        return MakeError(Stdlib::Error::Unsuccessful);
+
+    // elided or not, shared sections see what exclusive ones wrote
+    SpinLock lock;
+    RwSpinLock rwLock;
+    ulong value = 0;
+    for (ulong i = 1; ok && i <= 100; i++)
+    {
+        {
+            Stdlib::AutoLock exclusive(lock);
+            value = i;
+        }
+        {
+            Stdlib::SharedAutoLock shared(lock);
+            ok = (value == i);
+        }
+        {
+            Stdlib::SharedAutoLock shared(rwLock);
+            Stdlib::SharedAutoLock nested(lock);
+            ok = ok && (value == i);
+        }
+    }
+
+    elision.Enable(false);
+    ok = ok && !XTest();
+    return ok ? MakeError(Stdlib::Error::Success) : MakeError(Stdlib::Error::Unsuccessful);
+}
+
+Stdlib::Error Test()
+{
+    Stdlib::Error err;
+
+    err = TestStaticKey();
+    if (!err.Ok())
+        return err;
+
+    err = TestTunables();
+    if (!err.Ok())
+        return err;
+
+    err = TestRawSpinLock();
+    if (!err.Ok())
+        return err;
+
+    err = TestLockElision();
+    if (!err.Ok())
+        return err;
+
+    err = TestPageAllocator();
+    if (!err.Ok())
+        return err;
+
+    err = TestEarlyAllocator();
+    if (!err.Ok())
+        return err;
+
+    err = TestShrinkers();
+    if (!err.Ok())
+        return err;
+
+    err = TestAllocator();
+    if (!err.Ok())
+        return err;
+
+    err = TestPageTable();
+    if (!err.Ok())
+        return err;
+
+    err = TestVmalloc();
+    if (!err.Ok())
+        return err;
+
+    err = TestTlb();
+    if (!err.Ok())
+        return err;
+
+    err = TestBtree();
+    if (!err.Ok())
+        return err;
+
+    err = TestBtreeBulkLoad();
+    if (!err.Ok())
+        return err;
+
+    err = TestBplusTree();
+    if (!err.Ok())
+        return err;
+
+    err = TestConcurrentBplusTree();
+    if (!err.Ok())
+        return err;
+
+    err = TestHashTable();
+    if (!err.Ok())
+        return err;
+
+    err = TestRcu();
+    if (!err.Ok())
+        return err;
+
+    err = TestCpuCall();
+    if (!err.Ok())
+        return err;
+
+    err = TestObjectTable();
+    if (!err.Ok())
+        return err;
+
+    err = TestRingBuffer();
+    if (!err.Ok())
+        return err;
+
+    err = TestLockFreeRingBuffer();
+    if (!err.Ok())
+        return err;
+
+    err = TestIntrusivePtr();
+    if (!err.Ok())
+        return err;
+
+    err = TestSmallVector();
+    if (!err.Ok())
+        return err;
+
+    err = TestIntrusiveList();
+    if (!err.Ok())
+        return err;
+
+    err = TestArena();
+    if (!err.Ok())
+        return err;
+
+    err = TestPoolBtree();
+    if (!err.Ok())
+        return err;
+
+    err = TestObjectPool();
+    if (!err.Ok())
+        return err;
+
+    err = TestCounters();
+    if (!err.Ok())
+        return err;
+
+    err = TestPrintf();
+    if (!err.Ok())
+        return err;
+
+    err = TestParameters();
+    if (!err.Ok())
+        return err;
+
+    err = TestChecksum();
     if (!err.Ok())
         return err;
 
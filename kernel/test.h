@@ -9,4 +9,26 @@ Stdlib::Error Test();
 
 bool TestMultiTasking();
 
+// needs the scheduler and the tick running
+Stdlib::Error TestTimer();
+
+// needs the parallel pool
+Stdlib::Error TestParallel();
+
+// needs the scheduler running
+Stdlib::Error TestMutex();
+
+// needs to run in a task
+Stdlib::Error TestTaskSnapshot();
+
+// needs the scheduler running
+Stdlib::Error TestChannel();
+Stdlib::Error TestCompletion();
+
+// needs the fpu of the current cpu initialized
+Stdlib::Error TestFpu();
+
+// needs syscalls set up on every cpu the task may run on
+Stdlib::Error TestUserMode();
+
 }
\ No newline at end of file
@@ -1,11 +1,157 @@
 #include "time.h"
+#include "asm.h"
+#include "trace.h"
+
+#include "atomic.h"
 
 #include <drivers/pit.h>
+#include <drivers/hpet.h>
+#include <drivers/kvm.h>
 
 namespace Kernel
 {
     Stdlib::Time GetBootTime()
     {
+        Stdlib::Time time;
+        if (Kvm::GetInstance().GetTime(time))
+            return time;
+
+        auto& tsc = TscClock::GetInstance();
+        if (likely(tsc.IsClock()))
+            return tsc.GetTime();
+
+        auto& hpet = Hpet::GetInstance();
+        if (hpet.IsEnabled())
+            return hpet.GetTime();
+
         return Pit::GetInstance().GetTime();
     }
-}
\ No newline at end of file
+
+    void Delay(ulong nanoSecs)
+    {
+        Stdlib::Time expired = GetBootTime() + Stdlib::Time(nanoSecs);
+        SpinBackoff backoff;
+
+        while (GetBootTime() < expired)
+        {
+            backoff.Pause();
+        }
+    }
+
+    TscClock::TscClock()
+        : Calibrated(false)
+        , Clock(false)
+        , TicksPerMs(0)
+        , Mult(0)
+        , TscBase(0)
+        , TimeBase(0)
+    {
+    }
+
+    TscClock::~TscClock()
+    {
+    }
+
+    void TscClock::Calibrate()
+    {
+        auto& hpet = Hpet::GetInstance();
+        auto& pit = Pit::GetInstance();
+        Stdlib::Time refStart, refEnd;
+        u64 tscStart, tscEnd;
+
+        if (hpet.IsEnabled())
+        {
+            // the hpet counts continuously, a short window is enough
+            refStart = hpet.GetTime();
+            tscStart = ReadTsc();
+            while (hpet.GetTime() < refStart + HpetCalibrateMs * Const::NanoSecsInMs)
+            {
+                Pause();
+            }
+            refEnd = hpet.GetTime();
+            tscEnd = ReadTsc();
+        }
+        else
+        {
+            // start measuring right after pit tick
+            auto start = pit.GetTime();
+            while (pit.GetTime() == start)
+            {
+                Pause();
+            }
+
+            refStart = pit.GetTime();
+            tscStart = ReadTsc();
+            while (pit.GetTime() < refStart + CalibrateMs * Const::NanoSecsInMs)
+            {
+                Pause();
+            }
+            refEnd = pit.GetTime();
+            tscEnd = ReadTsc();
+        }
+
+        ulong elapsedNs = (refEnd - refStart).GetValue();
+        TicksPerMs = ((tscEnd - tscStart) * Const::NanoSecsInMs) / elapsedNs;
+        // ns = ticks * Mult >> MultShift
+        Mult = (Const::NanoSecsInMs << MultShift) / TicksPerMs;
+        TscBase = tscEnd;
+        TimeBase = refEnd.GetValue();
+        Barrier();
+        Calibrated = true;
+        // a hypervisor often hides the invariant bit of a stable tsc, and
+        // every hpet read there is an exit
+        u32 eax, ebx, ecx, edx;
+        Cpuid(1, &eax, &ebx, &ecx, &edx);
+        Clock = (IsInvariant() || (ecx & CpuidHypervisor) || !hpet.IsEnabled()) ? true : false;
+        Barrier();
+
+        Trace(0, "Tsc: ticks per ms %u invariant %u clock %u",
+            TicksPerMs, (ulong)IsInvariant(), (ulong)Clock);
+    }
+
+    bool TscClock::IsCalibrated()
+    {
+        return Calibrated;
+    }
+
+    bool TscClock::IsClock()
+    {
+        return Clock;
+    }
+
+    bool TscClock::IsInvariant()
+    {
+        u32 eax, ebx, ecx, edx;
+
+        Cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+        if (eax < 0x80000007)
+            return false;
+
+        Cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx & CpuidInvariantTsc) ? true : false;
+    }
+
+    Stdlib::Time TscClock::GetTime()
+    {
+        u64 tsc = ReadTsc();
+        if (unlikely(tsc < TscBase))
+            return Stdlib::Time(TimeBase);
+
+        u64 delta = tsc - TscBase;
+
+        return Stdlib::Time(TimeBase + (ulong)(((unsigned __int128)delta * Mult) >> MultShift));
+    }
+
+    ulong TscClock::GetTicksPerMs()
+    {
+        return TicksPerMs;
+    }
+
+    Stdlib::Time TscClock::TicksToTime(u64 ticks)
+    {
+        if (unlikely(!Calibrated))
+            return Stdlib::Time();
+
+        return Stdlib::Time((ulong)(((unsigned __int128)ticks * Mult) >> MultShift));
+    }
+}
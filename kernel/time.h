@@ -4,5 +4,62 @@
 
 namespace Kernel
 {
+    // tsc once calibrated, unless it isn't invariant and there is an hpet,
+    // before that the hpet or pit ticks
     Stdlib::Time GetBootTime();
-}
\ No newline at end of file
+
+    // busy waits on boot time
+    void Delay(ulong nanoSecs);
+
+    class TscClock final
+    {
+    public:
+        static TscClock& GetInstance()
+        {
+            static TscClock Instance;
+            return Instance;
+        }
+
+        // measure tsc frequency against the hpet or pit, boot time
+        // continues from theirs
+        void Calibrate();
+
+        bool IsCalibrated();
+
+        // calibrated and used for boot time
+        bool IsClock();
+
+        // CPUID.80000007H:EDX, the tsc ticks at a constant rate in every
+        // power state
+        static bool IsInvariant();
+
+        Stdlib::Time GetTime();
+
+        ulong GetTicksPerMs();
+
+        // zero until calibrated, so ticks counted earlier convert once it is
+        Stdlib::Time TicksToTime(u64 ticks);
+
+    private:
+        TscClock();
+        ~TscClock();
+
+        TscClock(const TscClock& other) = delete;
+        TscClock(TscClock&& other) = delete;
+        TscClock& operator=(const TscClock& other) = delete;
+        TscClock& operator=(TscClock&& other) = delete;
+
+        static const ulong CalibrateMs = 50;
+        static const ulong HpetCalibrateMs = 10;
+        static const u32 CpuidInvariantTsc = (1U << 8);
+        static const u32 CpuidHypervisor = (1U << 31);
+        static const ulong MultShift = 32;
+
+        volatile bool Calibrated;
+        volatile bool Clock;
+        ulong TicksPerMs;
+        ulong Mult;
+        u64 TscBase;
+        ulong TimeBase;
+    };
+}
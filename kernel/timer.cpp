@@ -1,66 +1,301 @@
 #include "timer.h"
 #include "time.h"
+#include "cpu.h"
+#include "preempt.h"
 
 namespace Kernel
 {
 
-TimerTable::Timer::Timer()
+Timer::Timer()
     : Callback(nullptr)
+    , Wheel(nullptr)
+    , Level(0)
+    , Pending(false)
 {
 }
 
-TimerTable::TimerTable()
+Timer::~Timer()
 {
 }
 
-TimerTable::~TimerTable()
+TimerWheel::TimerWheel()
+    : TimerCount(0)
+    , CurrTick(0)
+    , ArmedExpiry(0)
+    , Running(nullptr)
+{
+    for (size_t i = 0; i < LevelCount; i++)
+        LevelTimerCount[i] = 0;
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+void TimerWheel::Insert(Timer& timer)
+{
+    ulong tick = (timer.Expired.GetValue() + TickNs - 1) / TickNs;
+    if (tick < CurrTick)
+        tick = CurrTick;
+
+    // beyond the last level the timer is reinserted when its clamped slot fires
+    ulong delta = tick - CurrTick;
+    if (delta > MaxDelta)
+    {
+        delta = MaxDelta;
+        tick = CurrTick + MaxDelta;
+    }
+
+    size_t level = 0;
+    while (level + 1 < LevelCount && delta >= (1UL << ((level + 1) * SlotShift)))
+        level++;
+
+    size_t slot = (tick >> (level * SlotShift)) & (SlotCount - 1);
+    Slot[level][slot].InsertTail(&timer.ListEntry);
+    timer.Level = level;
+    timer.Wheel = this;
+    timer.Pending = true;
+    LevelTimerCount[level]++;
+    TimerCount++;
+}
+
+void TimerWheel::Remove(Timer& timer)
+{
+    timer.ListEntry.RemoveInit();
+    timer.Pending = false;
+    LevelTimerCount[timer.Level]--;
+    TimerCount--;
+}
+
+bool TimerWheel::Start(Timer& timer, Stdlib::Time now)
 {
+    Stdlib::AutoLock lock(Lock);
+
+    // an empty wheel skips the ticks it didn't have to process
+    ulong nowTick = now.GetValue() / TickNs;
+    if (TimerCount == 0 && nowTick > CurrTick)
+        CurrTick = nowTick;
+
+    Insert(timer);
+
+    return (ArmedExpiry != 0 && timer.Expired.GetValue() < ArmedExpiry) ? true : false;
 }
 
-bool TimerTable::StartTimer(TimerCallback& callback, Stdlib::Time period)
+bool TimerWheel::Stop(Timer& timer)
 {
-    for (size_t i = 0; i < Stdlib::ArraySize(Timer); i++)
+    bool pending;
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        pending = timer.Pending;
+        if (pending)
+            Remove(timer);
+        timer.Period.Clear();
+    }
+
+    // on the owning cpu the callback runs only if it is the caller
+    if (&GetCpu().GetTimerWheel() == this)
+        return pending;
+
+    for (;;)
     {
-        auto& timer = Timer[i];
-        if (timer.Callback == nullptr)
         {
-            timer.Period = period;
-            timer.Expired = GetBootTime() + period;
-            timer.Callback = &callback;
-            return true;
+            Stdlib::AutoLock lock(Lock);
+            if (Running != &timer)
+                break;
         }
+        Pause();
     }
 
-    return false;
+    return pending;
+}
+
+void TimerWheel::Cascade(size_t level)
+{
+    Stdlib::ListEntry list;
+    list.MoveTailList(&Slot[level][(CurrTick >> (level * SlotShift)) & (SlotCount - 1)]);
+
+    while (!list.IsEmpty())
+    {
+        Timer* timer = CONTAINING_RECORD(list.Flink, Timer, ListEntry);
+        Remove(*timer);
+        Insert(*timer);
+    }
 }
 
-void TimerTable::StopTimer(TimerCallback& callback)
+void TimerWheel::Fire(Stdlib::Time now)
 {
-    for (size_t i = 0; i < Stdlib::ArraySize(Timer); i++)
+    Stdlib::ListEntry list;
+    list.MoveTailList(&Slot[0][CurrTick & (SlotCount - 1)]);
+
+    // Stop from another cpu may unlink timers of list while the lock is dropped
+    while (!list.IsEmpty())
     {
-        auto& timer = Timer[i];
-        if (timer.Callback == &callback)
+        Timer* timer = CONTAINING_RECORD(list.Flink, Timer, ListEntry);
+        Remove(*timer);
+        if (timer->Expired > now)
         {
-            timer.Callback = nullptr;
+            Insert(*timer);
+            continue;
         }
+
+        TimerCallback* callback = timer->Callback;
+        Running = timer;
+        Lock.Unlock();
+        callback->OnTick(*callback);
+        Lock.Lock();
+
+        // the callback may have restarted or stopped the timer
+        if (!timer->Pending && timer->Wheel == this && timer->Period.GetValue() != 0)
+        {
+            timer->Expired += timer->Period;
+            if (!(timer->Expired > now))
+                timer->Expired = now + timer->Period;
+            Insert(*timer);
+        }
+        Running = nullptr;
     }
 }
 
-void TimerTable::ProcessTimers()
+void TimerWheel::Process(Stdlib::Time now)
 {
-    auto now = GetBootTime();
+    Stdlib::AutoLock lock(Lock);
 
-    for (size_t i = 0; i < Stdlib::ArraySize(Timer); i++)
+    ArmedExpiry = 0;
+    ulong nowTick = now.GetValue() / TickNs;
+    while (CurrTick <= nowTick)
     {
-        auto& timer = Timer[i];
+        if (TimerCount == 0)
+        {
+            CurrTick = nowTick + 1;
+            break;
+        }
+
+        if ((CurrTick & (SlotCount - 1)) == 0)
+        {
+            // a level moves one slot down once every lower level wrapped
+            for (size_t level = 1; level < LevelCount; level++)
+            {
+                Cascade(level);
+                if (((CurrTick >> (level * SlotShift)) & (SlotCount - 1)) != 0)
+                    break;
+            }
+        }
+        else if (LevelTimerCount[0] == 0)
+        {
+            // nothing to fire before the next cascade
+            CurrTick = Stdlib::Min((CurrTick | (SlotCount - 1)) + 1, nowTick + 1);
+            continue;
+        }
+
+        Fire(now);
+        CurrTick++;
+    }
+}
+
+bool TimerWheel::GetNextExpiry(Stdlib::Time& expired)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    if (TimerCount == 0)
+        return false;
 
-        if (timer.Callback != nullptr && now >= timer.Expired)
+    ulong next = ~((ulong)0);
+    if (LevelTimerCount[0] != 0)
+    {
+        for (ulong i = 0; i < SlotCount; i++)
         {
-            timer.Callback->OnTick(*timer.Callback);
+            if (!Slot[0][(CurrTick + i) & (SlotCount - 1)].IsEmpty())
+            {
+                next = CurrTick + i;
+                break;
+            }
+        }
+    }
+
+    // a higher level slot fires no earlier than it cascades, at the start
+    // of its span
+    for (size_t level = 1; level < LevelCount; level++)
+    {
+        if (LevelTimerCount[level] == 0)
+            continue;
 
-            timer.Expired += timer.Period;
+        size_t shift = level * SlotShift;
+        ulong span = CurrTick >> shift;
+        ulong i = ((CurrTick & ((1UL << shift) - 1)) == 0) ? 0 : 1;
+        for (; i <= SlotCount; i++)
+        {
+            if (!Slot[level][(span + i) & (SlotCount - 1)].IsEmpty())
+            {
+                next = Stdlib::Min(next, (span + i) << shift);
+                break;
+            }
         }
     }
+
+    expired = Stdlib::Time(next * TickNs);
+    return true;
+}
+
+void TimerWheel::SetArmedExpiry(Stdlib::Time expired)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    ArmedExpiry = expired.GetValue();
+}
+
+size_t TimerWheel::GetTimerCount()
+{
+    Stdlib::AutoLock lock(Lock);
+
+    return TimerCount;
+}
+
+TimerTable::TimerTable()
+{
 }
 
-}
\ No newline at end of file
+TimerTable::~TimerTable()
+{
+}
+
+void TimerTable::StartTimer(Timer& timer, TimerCallback& callback, Stdlib::Time timeout,
+    Stdlib::Time period)
+{
+    PreemptDisable();
+
+    if (timer.Wheel != nullptr)
+        timer.Wheel->Stop(timer);
+
+    timer.Callback = &callback;
+    timer.Expired = GetBootTime() + timeout;
+    timer.Period = period;
+
+    // the tick is armed too late, let the ipi reprogram it
+    auto& cpus = CpuTable::GetInstance();
+    auto& cpu = cpus.GetCurrentCpu();
+    if (cpu.GetTimerWheel().Start(timer, GetBootTime()) && cpus.IsCpuRunning(cpu.GetIndex()))
+        cpus.SendIPI(cpu.GetIndex());
+
+    PreemptEnable();
+}
+
+bool TimerTable::StopTimer(Timer& timer)
+{
+    if (timer.Wheel == nullptr)
+        return false;
+
+    return timer.Wheel->Stop(timer);
+}
+
+void TimerTable::ProcessTimers()
+{
+    GetCpu().GetTimerWheel().Process(GetBootTime());
+}
+
+bool TimerTable::GetNextExpiry(Stdlib::Time& expired)
+{
+    return GetCpu().GetTimerWheel().GetNextExpiry(expired);
+}
+
+}
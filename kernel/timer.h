@@ -2,6 +2,9 @@
 
 #include <include/types.h>
 #include <lib/stdlib.h>
+#include <lib/list_entry.h>
+
+#include "spin_lock.h"
 
 namespace Kernel
 {
@@ -12,6 +15,90 @@ public:
     virtual void OnTick(TimerCallback& callback) = 0;
 };
 
+class TimerWheel;
+
+// Timer storage is owned by the caller and must stay alive until StopTimer
+// returns, even for a one-shot timer that has fired. Fields are protected
+// by the lock of the wheel the timer was started on.
+struct Timer final
+{
+    Timer();
+    ~Timer();
+
+    Stdlib::ListEntry ListEntry;
+    TimerCallback* Callback;
+    Stdlib::Time Expired;
+    // zero for one-shot timers
+    Stdlib::Time Period;
+    TimerWheel* Wheel;
+    size_t Level;
+    bool Pending;
+
+private:
+    Timer(const Timer& other) = delete;
+    Timer(Timer&& other) = delete;
+    Timer& operator=(const Timer& other) = delete;
+    Timer& operator=(Timer&& other) = delete;
+};
+
+// Hierarchical timing wheel of one cpu: LevelCount levels of SlotCount lists,
+// a slot of level L spans SlotCount^L ticks of TickNs. Timers are inserted in
+// O(1) by their distance from the current tick and are moved one level down
+// when the wheel passes their slot. Callbacks run on the owning cpu from the
+// tick interrupt.
+class TimerWheel final
+{
+public:
+    TimerWheel();
+    ~TimerWheel();
+
+    // true if the timer expires before the tick the owning cpu has armed
+    bool Start(Timer& timer, Stdlib::Time now);
+
+    // true if the timer was pending, waits for a running callback on
+    // another cpu to return
+    bool Stop(Timer& timer);
+
+    void Process(Stdlib::Time now);
+
+    // lower bound of the next expiry, exact for timers in the first level
+    bool GetNextExpiry(Stdlib::Time& expired);
+
+    // tick the owning cpu has armed, ~0 if none and zero while processing
+    void SetArmedExpiry(Stdlib::Time expired);
+
+    size_t GetTimerCount();
+
+    static const ulong TickNs = Const::NanoSecsInMs;
+
+private:
+    TimerWheel(const TimerWheel& other) = delete;
+    TimerWheel(TimerWheel&& other) = delete;
+    TimerWheel& operator=(const TimerWheel& other) = delete;
+    TimerWheel& operator=(TimerWheel&& other) = delete;
+
+    static const size_t LevelCount = 4;
+    static const size_t SlotShift = 6;
+    static const size_t SlotCount = 1UL << SlotShift;
+    static const ulong MaxDelta = (1UL << (LevelCount * SlotShift)) - 1;
+
+    void Insert(Timer& timer);
+    void Remove(Timer& timer);
+    void Cascade(size_t level);
+    void Fire(Stdlib::Time now);
+
+    FastSpinLock Lock;
+    Stdlib::ListEntry Slot[LevelCount][SlotCount];
+    size_t LevelTimerCount[LevelCount];
+    size_t TimerCount;
+    // next tick to process
+    ulong CurrTick;
+    ulong ArmedExpiry;
+    Timer* Running;
+};
+
+// Timers are started on the wheel of the current cpu, so they fire where
+// they were armed
 class TimerTable final
 {
 public:
@@ -22,11 +109,22 @@ public:
         return Instance;
     }
 
-    bool StartTimer(TimerCallback& callback, Stdlib::Time period);
-    void StopTimer(TimerCallback& callback);
+    // fires after timeout and then every period unless period is zero,
+    // restarts a pending timer
+    void StartTimer(Timer& timer, TimerCallback& callback, Stdlib::Time timeout,
+        Stdlib::Time period = Stdlib::Time());
 
+    // true if the timer was pending, on return the callback isn't running
+    bool StopTimer(Timer& timer);
+
+    // runs expired timers of the current cpu
     void ProcessTimers();
 
+    bool GetNextExpiry(Stdlib::Time& expired);
+
+    // cpu that drives rcu grace periods
+    static const ulong TimerCpuIndex = 0;
+
 private:
     TimerTable();
     ~TimerTable();
@@ -35,17 +133,6 @@ private:
     TimerTable(TimerTable&& other) = delete;
     TimerTable& operator=(const TimerTable& other) = delete;
     TimerTable& operator=(TimerTable&& other) = delete;
-
-    struct Timer
-    {
-        Timer();
-
-        TimerCallback *Callback;
-        Stdlib::Time Period;
-        Stdlib::Time Expired;
-    };
-
-    Timer Timer[16];
 };
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #include "trace.h"
 #include "dmesg.h"
 #include "parameters.h"
+#include "tunable.h"
 
 #include <drivers/serial.h>
 #include <drivers/vga.h>
@@ -8,6 +9,20 @@
 namespace Kernel
 {
 
+StaticKey TraceLevelKey[TraceLevelCount] = {
+    {"trace0", true}, {"trace1", false}, {"trace2", false}, {"trace3", false},
+    {"trace4", false}, {"trace5", false}, {"trace6", false}, {"trace7", false},
+};
+
+static bool OnTraceLevel(ulong level)
+{
+    Tracer::GetInstance().SetLevel(static_cast<int>(level));
+    return true;
+}
+
+// tracelevel=<n>, Trace sites above it stay nops
+DEFINE_TUNABLE(TraceLevel, "tracelevel", 1, 0, TraceLevelCount - 1, OnTraceLevel);
+
 Tracer::Tracer()
     : Level(0)
 {
@@ -16,6 +31,8 @@ Tracer::Tracer()
 void Tracer::SetLevel(int level)
 {
     Level = level;
+    for (int i = 0; i < TraceLevelCount; i++)
+        StaticKeys::GetInstance().Set(TraceLevelKey[i], (i <= level) ? true : false);
 }
 
 int Tracer::GetLevel()
@@ -36,11 +53,12 @@ void Tracer::Output(const char *fmt, ...)
     int size = Stdlib::VsnPrintf(msg, sizeof(msg), fmt, args);
     va_end(args);
 
-    if (size < 0)
+    if (size <= 0)
         return;
 
-    Serial::GetInstance().PrintString(msg);
-    Dmesg::GetInstance().PrintString(msg);
+    // formatted once, the size counts the terminator
+    Serial::GetInstance().Write(msg, size - 1);
+    Dmesg::GetInstance().Write(msg, size - 1);
 
     if (Parameters::GetInstance().IsTraceVga())
     {
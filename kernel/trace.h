@@ -6,9 +6,28 @@
 #include <lib/error.h>
 #include <lib/ring_buffer.h>
 
+#include "trace_buffer.h"
+#include "static_key.h"
+
+// trace sites above the build time maximum compile to nothing, the ones
+// below are still filtered by the runtime level
+#if !defined(__TRACE_MAX_LEVEL__)
+#define __TRACE_MAX_LEVEL__ 4
+#endif
+
 namespace Kernel
 {
 
+const int TraceMaxLevel = __TRACE_MAX_LEVEL__;
+
+const int TraceLevelCount = 8;
+
+static_assert(TraceMaxLevel < TraceLevelCount, "Invalid trace level");
+
+// key of a level is on while the runtime level is at or above it, so the
+// sites of filtered out levels are a nop
+extern StaticKey TraceLevelKey[TraceLevelCount];
+
 const int ExcLL = 0;
 const int AcpiLL = 0;
 const int CmdLL = 0;
@@ -16,6 +35,7 @@ const int KbdLL = 3;
 const int PageAllocatorLL = 4;
 const int AllocatorLL = 4;
 const int PoolLL = 4;
+const int ShrinkerLL = 3;
 const int LapicLL = 0;
 const int IoApicLL = 0;
 const int MmIoLL = 4;
@@ -54,9 +74,12 @@ private:
 
 #define Trace(level, fmt, ...)                                      \
 do {                                                                \
-    auto& tracer = Kernel::Tracer::GetInstance();                   \
-    if (unlikely((level) <= tracer.GetLevel()))                     \
+    if ((level) > Kernel::TraceMaxLevel)                            \
+        break;                                                      \
+    if (StaticBranchUnlikely(Kernel::TraceLevelKey[                 \
+        ((level) < Kernel::TraceLevelCount) ? (level) : 0]))        \
     {                                                               \
+        auto& tracer = Kernel::Tracer::GetInstance();               \
         auto time = Kernel::GetBootTime();                          \
         tracer.Output("%u:%u.%u:%s(),%s,%u: " fmt "\n",             \
             (level), time.GetSecs(), time.GetUsecs(),               \
@@ -67,9 +90,9 @@ do {                                                                \
 
 #define TraceError(err, fmt, ...)                                   \
 do {                                                                \
-    auto& tracer = Kernel::Tracer::GetInstance();                   \
-    if (unlikely(0 <= tracer.GetLevel()))                           \
+    if (StaticBranchUnlikely(Kernel::TraceLevelKey[0]))             \
     {                                                               \
+        auto& tracer = Kernel::Tracer::GetInstance();               \
         auto time = Kernel::GetBootTime();                          \
         tracer.Output("%u:%u.%u:%s(),%s,%u: Error %u at %s(),%s,%u: " fmt "\n",    \
             0, time.GetSecs(), time.GetUsecs(),                     \
@@ -0,0 +1,146 @@
+#include "trace_buffer.h"
+#include "trace.h"
+#include "time.h"
+#include "asm.h"
+#include "preempt.h"
+
+namespace Kernel
+{
+
+TraceBuffer::TraceBuffer()
+    : Level(PoolLL)
+{
+    Stdlib::MemSet(&BootRing, 0, sizeof(BootRing));
+    for (size_t cpu = 0; cpu < MaxCpus; cpu++)
+        Rings[cpu] = nullptr;
+    Rings[0] = &BootRing;
+}
+
+TraceBuffer::~TraceBuffer()
+{
+    for (size_t cpu = 1; cpu < MaxCpus; cpu++)
+    {
+        if (Rings[cpu] != nullptr)
+        {
+            delete Rings[cpu];
+            Rings[cpu] = nullptr;
+        }
+    }
+}
+
+bool TraceBuffer::SetupCpu(ulong cpu)
+{
+    if (BugOn(cpu >= MaxCpus))
+        return false;
+
+    if (Rings[cpu] != nullptr)
+        return true;
+
+    Ring* ring = new Ring;
+    if (ring == nullptr)
+        return false;
+
+    Stdlib::MemSet(ring, 0, sizeof(*ring));
+    Barrier();
+    Rings[cpu] = ring;
+    return true;
+}
+
+void TraceBuffer::SetLevel(int level)
+{
+    Level = level;
+}
+
+int TraceBuffer::GetLevel()
+{
+    return Level;
+}
+
+void TraceBuffer::RecordArgs(int level, const char* func, const char* file, ulong line,
+    const char* fmt, const ulong* arg, size_t argCount)
+{
+    // per-cpu area isn't loaded before the scheduler runs
+    Ring* ringPtr = Rings[(PreemptIsOn()) ? GetPerCpuIndex() : 0];
+    if (unlikely(ringPtr == nullptr))
+        return;
+
+    Ring& ring = *ringPtr;
+    ulong seq = ring.Head.ReadAndInc();
+    Entry& entry = ring.Entries[seq % RingSize];
+
+    entry.Seq = 0;
+    Barrier();
+    entry.Time = GetBootTime().GetValue();
+    entry.Fmt = fmt;
+    entry.Func = func;
+    entry.File = file;
+    entry.Line = line;
+    entry.Level = level;
+    for (size_t i = 0; i < MaxArgs; i++)
+        entry.Arg[i] = (i < argCount) ? arg[i] : 0;
+    Barrier();
+    entry.Seq = seq + 1;
+}
+
+bool TraceBuffer::ReadEntry(Ring& ring, ulong pos, Entry& entry)
+{
+    Entry& src = ring.Entries[pos % RingSize];
+    if (src.Seq != pos + 1)
+        return false;
+    Barrier();
+    Stdlib::MemCpy(&entry, &src, sizeof(entry));
+    Barrier();
+    return (src.Seq == pos + 1 && entry.Seq == pos + 1) ? true : false;
+}
+
+void TraceBuffer::Dump(Stdlib::Printer& printer)
+{
+    ulong* pos = new ulong[2 * MaxCpus];
+    if (pos == nullptr)
+        return;
+
+    ulong* end = &pos[MaxCpus];
+    for (size_t cpu = 0; cpu < MaxCpus; cpu++)
+    {
+        end[cpu] = (Rings[cpu] != nullptr) ? Rings[cpu]->Head.Get() : 0;
+        pos[cpu] = (end[cpu] > RingSize) ? (end[cpu] - RingSize) : 0;
+    }
+
+    // the oldest pending record of every ring is reread on each step, so
+    // only one entry is kept however many cpus there are
+    Entry e, cand;
+    for (;;)
+    {
+        size_t next = MaxCpus;
+        for (size_t cpu = 0; cpu < MaxCpus; cpu++)
+        {
+            // skip records overwritten or still being written
+            while (pos[cpu] < end[cpu] && !ReadEntry(*Rings[cpu], pos[cpu], cand))
+                pos[cpu]++;
+
+            if (pos[cpu] < end[cpu] && (next == MaxCpus || cand.Time < e.Time))
+            {
+                Stdlib::MemCpy(&e, &cand, sizeof(e));
+                next = cpu;
+            }
+        }
+
+        if (next == MaxCpus)
+            break;
+
+        char msg[256];
+        Stdlib::SnPrintf(msg, sizeof(msg), e.Fmt, e.Arg[0], e.Arg[1], e.Arg[2],
+            e.Arg[3], e.Arg[4], e.Arg[5]);
+
+        Stdlib::Time time(e.Time);
+        printer.Printf("%u:%u.%u:cpu%u:%s(),%s,%u: %s\n", (ulong)e.Level,
+            time.GetSecs(), time.GetUsecs(), next, e.Func,
+            Stdlib::TruncateFileName(e.File), (ulong)e.Line, msg);
+
+        pos[next]++;
+    }
+
+    delete [] pos;
+}
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "atomic.h"
+#include "per_cpu.h"
+
+namespace Kernel
+{
+
+template<typename T>
+static inline ulong TraceArg(T value)
+{
+    return (ulong)value;
+}
+
+// Per-cpu rings of binary trace records: time, source location, format
+// pointer and raw arguments. Formatting is deferred to Dump, so the format
+// and every %s argument must be static strings. A writer claims a slot by an
+// atomic increment of the ring head, interrupts nesting on the same cpu get
+// their own slots, and a record is published by storing its sequence last so
+// Dump skips records that are being rewritten.
+class TraceBuffer final
+{
+public:
+    static TraceBuffer& GetInstance()
+    {
+        static TraceBuffer Instance;
+        return Instance;
+    }
+
+    static const size_t MaxArgs = 6;
+
+    template<typename... Args>
+    void Record(int level, const char* func, const char* file, ulong line,
+        const char* fmt, Args... args)
+    {
+        static_assert(sizeof...(Args) <= MaxArgs, "Too many trace arguments");
+
+        ulong arg[] = { 0, TraceArg(args)... };
+        RecordArgs(level, func, file, line, fmt, &arg[1], sizeof...(Args));
+    }
+
+    void RecordArgs(int level, const char* func, const char* file, ulong line,
+        const char* fmt, const ulong* arg, size_t argCount);
+
+    void SetLevel(int level);
+
+    int GetLevel();
+
+    // prints records of all cpus merged by time, oldest first
+    void Dump(Stdlib::Printer& printer);
+
+    // allocates the ring of a cpu, records of cpus without one are dropped
+    bool SetupCpu(ulong cpu);
+
+private:
+    TraceBuffer();
+    ~TraceBuffer();
+    TraceBuffer(const TraceBuffer& other) = delete;
+    TraceBuffer(TraceBuffer&& other) = delete;
+    TraceBuffer& operator=(const TraceBuffer& other) = delete;
+    TraceBuffer& operator=(TraceBuffer&& other) = delete;
+
+    static const size_t RingSize = 256;
+
+    struct Entry
+    {
+        volatile ulong Seq;
+        ulong Time;
+        const char* Fmt;
+        const char* Func;
+        const char* File;
+        u32 Line;
+        int Level;
+        ulong Arg[MaxArgs];
+    };
+
+    struct Ring
+    {
+        Atomic Head;
+        Entry Entries[RingSize];
+    };
+
+    bool ReadEntry(Ring& ring, ulong pos, Entry& entry);
+
+    // records made before the scheduler runs go to ring 0, which is this one
+    Ring BootRing;
+    Ring* Rings[MaxCpus];
+    int Level;
+};
+
+}
+
+#define TraceFast(level, fmt, ...)                                  \
+do {                                                                \
+    if ((level) > Kernel::TraceMaxLevel)                            \
+        break;                                                      \
+    auto& traceBuffer = Kernel::TraceBuffer::GetInstance();         \
+    if (unlikely((level) <= traceBuffer.GetLevel()))                \
+    {                                                               \
+        traceBuffer.Record((level), __func__, __FILE__,             \
+            (ulong)__LINE__, fmt, ##__VA_ARGS__);                   \
+    }                                                               \
+} while (false)
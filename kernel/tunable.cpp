@@ -0,0 +1,82 @@
+#include "tunable.h"
+#include "preempt.h"
+
+#include <lib/lock.h>
+#include <lib/stdlib.h>
+
+extern "C" Kernel::Tunable* TunablesStart[];
+extern "C" Kernel::Tunable* TunablesEnd[];
+
+namespace Kernel
+{
+
+bool Tunable::Set(ulong value)
+{
+    if (value < Min || value > Max)
+        return false;
+
+    ulong prev = Value;
+    Value = value;
+    if (Notify != nullptr && !Notify(value))
+    {
+        Value = prev;
+        return false;
+    }
+    return true;
+}
+
+TunableTable::TunableTable()
+{
+}
+
+TunableTable::~TunableTable()
+{
+}
+
+Tunable* TunableTable::Find(const char* name)
+{
+    for (Tunable** entry = TunablesStart; entry != TunablesEnd; entry++)
+    {
+        if (Stdlib::StrCmp((*entry)->GetName(), name) == 0)
+            return *entry;
+    }
+
+    return nullptr;
+}
+
+bool TunableTable::Set(const char* name, const char* value, bool boot)
+{
+    Tunable* tunable = Find(name);
+    if (tunable == nullptr || (!boot && tunable->IsBootOnly()))
+        return false;
+
+    ulong number;
+    if (Stdlib::StrCmp(value, "on") == 0)
+        number = 1;
+    else if (Stdlib::StrCmp(value, "off") == 0)
+        number = 0;
+    else if (!Stdlib::StringToUlong(value, number))
+        return false;
+
+    // the command line is parsed by the boot cpu alone, before it runs a
+    // task the mutex could record as owner
+    if (!PreemptIsOn())
+        return tunable->Set(number);
+
+    Stdlib::AutoLock lock(Lock);
+    return tunable->Set(number);
+}
+
+void TunableTable::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("name value default min max\n");
+    for (Tunable** entry = TunablesStart; entry != TunablesEnd; entry++)
+    {
+        Tunable* tunable = *entry;
+        printer.Printf("%s %u %u %u %u%s\n", tunable->GetName(), tunable->Get(),
+            tunable->GetDefault(), tunable->GetMin(), tunable->GetMax(),
+            (tunable->IsBootOnly()) ? " boot" : "");
+    }
+}
+
+}
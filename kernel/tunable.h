@@ -0,0 +1,124 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+#include "mutex.h"
+
+namespace Kernel
+{
+
+// Named ulong knob. Tunables are global objects, constant initialized since
+// global constructors don't run, so users read them with a plain load from
+// the first instruction on. Set checks the range and calls the notify
+// function of tunables that have to push the value somewhere; a notify
+// function that can't apply the value returns false and the old one stays.
+class Tunable final
+{
+public:
+    using NotifyFunc = bool (*)(ulong value);
+
+    // boot only tunables are read once at setup, the shell can't set them
+    static const ulong FlagBootOnly = 0x1;
+
+    constexpr Tunable(const char* name, ulong value, ulong min, ulong max,
+        NotifyFunc notify = nullptr, ulong flags = 0)
+        : Name(name)
+        , Value(value)
+        , Default(value)
+        , Min(min)
+        , Max(max)
+        , Notify(notify)
+        , Flags(flags)
+    {
+    }
+
+    ulong Get() const
+    {
+        return Value;
+    }
+
+    // false if value is out of range or notify rejected it
+    bool Set(ulong value);
+
+    const char* GetName() const
+    {
+        return Name;
+    }
+
+    ulong GetDefault() const
+    {
+        return Default;
+    }
+
+    ulong GetMin() const
+    {
+        return Min;
+    }
+
+    ulong GetMax() const
+    {
+        return Max;
+    }
+
+    bool IsBootOnly() const
+    {
+        return (Flags & FlagBootOnly) ? true : false;
+    }
+
+private:
+    Tunable(const Tunable& other) = delete;
+    Tunable(Tunable&& other) = delete;
+    Tunable& operator=(const Tunable& other) = delete;
+    Tunable& operator=(Tunable&& other) = delete;
+
+    const char* Name;
+    volatile ulong Value;
+    ulong Default;
+    ulong Min;
+    ulong Max;
+    NotifyFunc Notify;
+    ulong Flags;
+};
+
+// Every tunable defined with DEFINE_TUNABLE, found through the pointers
+// the macro puts into .tunables. The boot command line sets them through
+// Parameters (key=value), the shell through get/set.
+class TunableTable final
+{
+public:
+    static TunableTable& GetInstance()
+    {
+        static TunableTable Instance;
+        return Instance;
+    }
+
+    // nullptr if there is no tunable of that name
+    Tunable* Find(const char* name);
+
+    // parses value as a decimal number, on|off stand for 1|0. boot is
+    // true for the command line, which may set boot only tunables. Sleeps
+    // once preemption is on
+    bool Set(const char* name, const char* value, bool boot);
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    TunableTable();
+    ~TunableTable();
+    TunableTable(const TunableTable& other) = delete;
+    TunableTable(TunableTable&& other) = delete;
+    TunableTable& operator=(const TunableTable& other) = delete;
+    TunableTable& operator=(TunableTable&& other) = delete;
+
+    // serializes setters, so notify functions run one at a time. A
+    // sleeping lock, notify functions may patch static keys
+    Mutex Lock;
+};
+
+}
+
+#define DEFINE_TUNABLE(var, name, value, min, max, ...)             \
+    Kernel::Tunable var(name, value, min, max, ##__VA_ARGS__);      \
+    static Kernel::Tunable* const var##Entry                        \
+        __attribute__((section(".tunables"), used)) = &var
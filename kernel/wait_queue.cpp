@@ -0,0 +1,130 @@
+#include "wait_queue.h"
+#include "task.h"
+#include "sched.h"
+#include "asm.h"
+#include "panic.h"
+
+namespace Kernel
+{
+
+WaitQueue::WaitQueue()
+{
+    WaitList.Init();
+}
+
+WaitQueue::~WaitQueue()
+{
+    BugOn(!WaitList.IsEmpty());
+}
+
+void WaitQueue::Prepare(Stdlib::Time deadline)
+{
+    Task* task = Task::GetCurrentTask();
+
+    Stdlib::AutoLock lock(Lock);
+    BugOn(!task->WaitListEntry.IsEmpty());
+
+    task->WaitDeadline = deadline;
+    Stdlib::ListEntry* before = &WaitList;
+    if (deadline.GetValue() != 0)
+    {
+        for (auto currEntry = WaitList.Flink;
+            currEntry != &WaitList;
+            currEntry = currEntry->Flink)
+        {
+            Task* waiter = CONTAINING_RECORD(currEntry, Task, WaitListEntry);
+            if (waiter->WaitDeadline.GetValue() == 0 || waiter->WaitDeadline > deadline)
+            {
+                before = currEntry;
+                break;
+            }
+        }
+    }
+    before->InsertTail(&task->WaitListEntry);
+
+    Stdlib::AutoLock lock2(task->Lock);
+    task->BlockPending = true;
+}
+
+void WaitQueue::Wait(Task* handoff)
+{
+    Task* task = Task::GetCurrentTask();
+
+    if (handoff != nullptr)
+        YieldTo(handoff);
+    else
+        Schedule();
+
+    // nothing else to run or preemption is disabled, wait for the next interrupt
+    if (task->BlockPending && IsInterruptEnabled())
+        Hlt();
+
+    Finish();
+}
+
+void WaitQueue::Finish()
+{
+    Task* task = Task::GetCurrentTask();
+
+    Stdlib::AutoLock lock(Lock);
+    if (!task->WaitListEntry.IsEmpty())
+        task->WaitListEntry.RemoveInit();
+
+    Stdlib::AutoLock lock2(task->Lock);
+    task->BlockPending = false;
+}
+
+void WaitQueue::WakeUp(Task* task)
+{
+    task->WaitListEntry.RemoveInit();
+    task->TaskQueue->WakeUp(task);
+}
+
+void WaitQueue::WakeUpOne()
+{
+    Stdlib::AutoLock lock(Lock);
+    if (!WaitList.IsEmpty())
+        WakeUp(CONTAINING_RECORD(WaitList.Flink, Task, WaitListEntry));
+}
+
+void WaitQueue::WakeUpAll()
+{
+    Stdlib::AutoLock lock(Lock);
+    while (!WaitList.IsEmpty())
+        WakeUp(CONTAINING_RECORD(WaitList.Flink, Task, WaitListEntry));
+}
+
+void WaitQueue::WakeUpExpired(Stdlib::Time now)
+{
+    Stdlib::AutoLock lock(Lock);
+    while (!WaitList.IsEmpty())
+    {
+        Task* task = CONTAINING_RECORD(WaitList.Flink, Task, WaitListEntry);
+        if (task->WaitDeadline.GetValue() == 0 || task->WaitDeadline > now)
+            break;
+
+        WakeUp(task);
+    }
+}
+
+bool WaitQueue::GetFirstDeadline(Stdlib::Time& deadline)
+{
+    Stdlib::AutoLock lock(Lock);
+    if (WaitList.IsEmpty())
+        return false;
+
+    Task* task = CONTAINING_RECORD(WaitList.Flink, Task, WaitListEntry);
+    if (task->WaitDeadline.GetValue() == 0)
+        return false;
+
+    deadline = task->WaitDeadline;
+    return true;
+}
+
+bool WaitQueue::IsEmpty()
+{
+    Stdlib::AutoLock lock(Lock);
+    return WaitList.IsEmpty();
+}
+
+}
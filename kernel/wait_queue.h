@@ -0,0 +1,55 @@
+#pragma once
+
+#include <lib/stdlib.h>
+#include <lib/list_entry.h>
+
+#include "forward.h"
+#include "spin_lock.h"
+
+namespace Kernel
+{
+
+// Usage:
+//     for (;;) {
+//         waitQueue.Prepare();
+//         if (condition) {
+//             waitQueue.Finish();
+//             break;
+//         }
+//         waitQueue.Wait();
+//     }
+class WaitQueue final
+{
+public:
+    WaitQueue();
+    ~WaitQueue();
+
+    // link current task, deadline != 0 keeps the queue ordered by deadline
+    void Prepare(Stdlib::Time deadline = Stdlib::Time());
+    // block until woken up, unlinks current task on return; a ready handoff
+    // task on this cpu runs next, e.g. the consumer the caller just woke up
+    void Wait(Task* handoff = nullptr);
+    // unlinks current task if it's still linked
+    void Finish();
+
+    void WakeUpOne();
+    void WakeUpAll();
+    void WakeUpExpired(Stdlib::Time now);
+
+    bool IsEmpty();
+
+    bool GetFirstDeadline(Stdlib::Time& deadline);
+
+private:
+    WaitQueue(const WaitQueue& other) = delete;
+    WaitQueue(WaitQueue&& other) = delete;
+    WaitQueue& operator=(const WaitQueue& other) = delete;
+    WaitQueue& operator=(WaitQueue&& other) = delete;
+
+    void WakeUp(Task* task);
+
+    FastSpinLock Lock;
+    Stdlib::ListEntry WaitList;
+};
+
+}
@@ -4,11 +4,18 @@
 #include "time.h"
 #include "panic.h"
 #include "trace.h"
+#include "parameters.h"
+#include "tunable.h"
 
 namespace Kernel
 {
 
+// lockhold=<ms>, a lock held longer than this is reported
+DEFINE_TUNABLE(LockHoldMs, "lockhold", 25, 1, 60000);
+
 Watchdog::Watchdog()
+    : CheckPeriod(Parameters::DefaultWatchdogPeriodMs * Const::NanoSecsInMs)
+    , NextBucket(0)
 {
 }
 
@@ -16,37 +23,66 @@ Watchdog::~Watchdog()
 {
 }
 
-void Watchdog::Check()
+void Watchdog::SetCheckPeriod(Stdlib::Time period)
 {
-    Stdlib::Time now = GetBootTime();
-    Stdlib::Time timeout(25 * Const::NanoSecsInMs);
+    CheckPeriod.Set(period.GetValue());
+}
 
-    for (size_t i = 0; i < Stdlib::ArraySize(SpinLockList); i++)
-    {
-        auto& listLock = SpinLockListLock[i];
-        auto& list = SpinLockList[i];
+void Watchdog::CheckBucket(size_t index, Stdlib::Time now)
+{
+    auto& listLock = SpinLockListLock[index];
+    auto& list = SpinLockList[index];
 
-        if (list.IsEmpty())
-            continue;
+    if (list.IsEmpty())
+        return;
 
-        ulong flags = listLock.LockIrqSave();
-        for (Stdlib::ListEntry* entry = list.Flink;
-            entry != &list;
-            entry = entry->Flink)
+    Stdlib::Time timeout(LockHoldMs.Get() * Const::NanoSecsInMs);
+    ulong flags = listLock.LockIrqSave();
+    for (Stdlib::ListEntry* entry = list.Flink;
+        entry != &list;
+        entry = entry->Flink)
+    {
+        SpinLock* lock = CONTAINING_RECORD(entry, SpinLock, ListEntry);
+        CheckCounter.Inc();
+        Stdlib::Time lockTime(lock->LockTime.Get());
+        if (lockTime.GetValue() != 0)
         {
-            SpinLock* lock = CONTAINING_RECORD(entry, SpinLock, ListEntry);
-            CheckCounter.Inc();
-            Stdlib::Time lockTime(lock->LockTime.Get());
-            if (lockTime.GetValue() != 0)
+            Stdlib::Time delta = now - lockTime;
+            if (delta > timeout)
             {
-                Stdlib::Time delta = now - lockTime;
-                if (delta > timeout)
-                {
-                    Trace(0, "Spinlock 0x%p is held too long %u", lock, delta.GetValue());
-                }
+                Trace(0, "Spinlock 0x%p is held too long %u", lock, delta.GetValue());
             }
         }
-        listLock.UnlockIrqRestore(flags);
+    }
+    listLock.UnlockIrqRestore(flags);
+}
+
+void Watchdog::Check()
+{
+    ulong period = CheckPeriod.Get();
+    if (period == 0)
+        return;
+
+    Stdlib::Time now = GetBootTime();
+    if (LastCheck.GetValue() == 0)
+    {
+        LastCheck = now;
+        return;
+    }
+
+    // a share of the table proportional to the time passed, a stopped tick
+    // catches up with at most one full pass
+    ulong elapsed = (now - LastCheck).GetValue();
+    size_t count = (elapsed >= period) ? SpinLockHashSize :
+        static_cast<size_t>((elapsed * SpinLockHashSize) / period);
+    if (count == 0)
+        return;
+
+    LastCheck = now;
+    for (size_t i = 0; i < count; i++)
+    {
+        CheckBucket(NextBucket, now);
+        NextBucket = (NextBucket + 1) % SpinLockHashSize;
     }
 }
 
@@ -75,7 +111,67 @@ void Watchdog::UnregisterSpinLock(SpinLock& lock)
 
 void Watchdog::Dump(Stdlib::Printer& printer)
 {
-    printer.Printf("%u %u\n", SpinLockCounter.Get(), CheckCounter.Get());
+    printer.Printf("%u %u period %u ms\n", SpinLockCounter.Get(), CheckCounter.Get(),
+        (ulong)CheckPeriod.Get() / Const::NanoSecsInMs);
 }
 
-}
\ No newline at end of file
+void Watchdog::DumpLockStats(Stdlib::Printer& printer)
+{
+    struct Entry
+    {
+        SpinLock* Lock;
+        SpinLock::LockStats Stats;
+    };
+
+    Entry top[LockStatsTop];
+    size_t count = 0;
+
+    for (size_t i = 0; i < Stdlib::ArraySize(SpinLockList); i++)
+    {
+        auto& listLock = SpinLockListLock[i];
+        auto& list = SpinLockList[i];
+
+        if (list.IsEmpty())
+            continue;
+
+        ulong flags = listLock.LockIrqSave();
+        for (Stdlib::ListEntry* entry = list.Flink;
+            entry != &list;
+            entry = entry->Flink)
+        {
+            SpinLock* lock = CONTAINING_RECORD(entry, SpinLock, ListEntry);
+            if (lock->Stats.ContendedCount == 0)
+                continue;
+
+            // keep top sorted by contended count, descending
+            size_t pos = count;
+            while (pos > 0 && top[pos - 1].Stats.ContendedCount < lock->Stats.ContendedCount)
+                pos--;
+
+            if (pos == LockStatsTop)
+                continue;
+
+            if (count < LockStatsTop)
+                count++;
+
+            for (size_t j = count - 1; j > pos; j--)
+                top[j] = top[j - 1];
+
+            top[pos].Lock = lock;
+            top[pos].Stats = lock->Stats;
+        }
+        listLock.UnlockIrqRestore(flags);
+    }
+
+    printer.Printf("lock acquired contended spintotal spinmax holdtotal holdmax caller\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& stats = top[i].Stats;
+        printer.Printf("0x%p %u %u %u %u %u %u 0x%p\n",
+            top[i].Lock, stats.AcquireCount, stats.ContendedCount,
+            stats.SpinTimeTotal, stats.SpinTimeMax, stats.HoldTimeTotal,
+            stats.HoldTimeMax, stats.MaxHoldCaller);
+    }
+}
+
+}
@@ -7,6 +7,7 @@
 #include "spin_lock.h"
 #include "raw_spin_lock.h"
 #include "atomic.h"
+#include "per_cpu_counter.h"
 
 namespace Kernel
 {
@@ -23,10 +24,18 @@ public:
     void RegisterSpinLock(SpinLock& lock);
     void UnregisterSpinLock(SpinLock& lock);
 
+    // checks the buckets that came due since the last call, so every lock
+    // is looked at once per check period. Runs on the timer cpu only
     void Check();
 
+    // zero turns the checks off
+    void SetCheckPeriod(Stdlib::Time period);
+
     void Dump(Stdlib::Printer& printer);
 
+    // print the most contended locks
+    void DumpLockStats(Stdlib::Printer& printer);
+
 private:
     Watchdog(const Watchdog& other) = delete;
     Watchdog(Watchdog&& other) = delete;
@@ -35,12 +44,20 @@ private:
 
 
     static const size_t SpinLockHashSize = 512;
+    static const size_t LockStatsTop = 16;
+
+    void CheckBucket(size_t index, Stdlib::Time now);
 
     Stdlib::ListEntry SpinLockList[SpinLockHashSize];
     RawSpinLock SpinLockListLock[SpinLockHashSize];
 
-    Atomic CheckCounter;
-    Atomic SpinLockCounter;
+    PerCpuCounter CheckCounter;
+    PerCpuCounter SpinLockCounter;
+
+    // owned by the checking cpu
+    Atomic CheckPeriod;
+    Stdlib::Time LastCheck;
+    size_t NextBucket;
 
     Watchdog();
     ~Watchdog();
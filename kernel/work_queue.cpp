@@ -0,0 +1,229 @@
+#include "work_queue.h"
+#include "cpu.h"
+#include "task.h"
+#include "trace.h"
+#include "preempt.h"
+#include "panic.h"
+
+namespace Kernel
+{
+
+Work::Work()
+    : Next(nullptr)
+    , Func(nullptr)
+    , Ctx(nullptr)
+{
+}
+
+Work::Work(WorkFunc func, void* ctx)
+    : Next(nullptr)
+    , Func(func)
+    , Ctx(ctx)
+{
+}
+
+void Work::Init(WorkFunc func, void* ctx)
+{
+    Func = func;
+    Ctx = ctx;
+}
+
+WorkQueue::Worker::Worker()
+    : Task(nullptr)
+    , Active(false)
+    , RunCount(0)
+    , BatchCount(0)
+    , MaxBatch(0)
+{
+}
+
+WorkQueue::WorkQueue()
+{
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuWorker); i++)
+        CpuWorker[i] = nullptr;
+}
+
+WorkQueue::~WorkQueue()
+{
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuWorker); i++)
+    {
+        if (CpuWorker[i] != nullptr)
+        {
+            if (CpuWorker[i]->Task != nullptr)
+                CpuWorker[i]->Task->Put();
+            delete CpuWorker[i];
+            CpuWorker[i] = nullptr;
+        }
+    }
+}
+
+ulong WorkQueue::RunBatch(Worker* worker)
+{
+    Work* list = reinterpret_cast<Work*>(worker->Head.Xchg(0));
+
+    // pushed as a stack, run in queueing order
+    Work* prev = nullptr;
+    while (list != nullptr)
+    {
+        Work* next = list->Next;
+        list->Next = prev;
+        prev = list;
+        list = next;
+    }
+
+    ulong count = 0;
+    while (prev != nullptr)
+    {
+        // the work may be queued again as soon as Queued is clear
+        Work* next = prev->Next;
+        WorkFunc func = prev->Func;
+        void* ctx = prev->Ctx;
+        prev->Queued.Set(0);
+        func(ctx);
+        prev = next;
+        count++;
+    }
+
+    return count;
+}
+
+void WorkQueue::RunFunc(void* ctx)
+{
+    auto worker = static_cast<Worker*>(ctx);
+    auto task = Task::GetCurrentTask();
+
+    for (;;)
+    {
+        worker->WaitQueue.Prepare();
+        if (worker->Head.Get() == 0)
+        {
+            if (task->IsStopping())
+            {
+                worker->WaitQueue.Finish();
+                break;
+            }
+            worker->WaitQueue.Wait();
+            continue;
+        }
+        worker->WaitQueue.Finish();
+
+        ulong count = WorkQueue::GetInstance().RunBatch(worker);
+        worker->RunCount += count;
+        worker->BatchCount++;
+        worker->MaxBatch = Stdlib::Max(worker->MaxBatch, count);
+    }
+}
+
+bool WorkQueue::Setup()
+{
+    auto& cpus = CpuTable::GetInstance();
+    CpuMask running = cpus.GetRunningCpus();
+
+    for (ulong i = running.First(); i < MaxCpus; i = running.Next(i + 1))
+    {
+        if (CpuWorker[i] != nullptr)
+            continue;
+
+        auto worker = new Worker();
+        if (worker == nullptr)
+            return false;
+
+        worker->Task = new class Task("worker%u", i);
+        if (worker->Task == nullptr)
+        {
+            delete worker;
+            return false;
+        }
+
+        CpuMask affinity;
+        affinity.Set(i);
+        worker->Task->SetCpuAffinity(affinity);
+        if (!worker->Task->Start(&WorkQueue::RunFunc, worker))
+        {
+            worker->Task->Put();
+            delete worker;
+            return false;
+        }
+
+        // interrupt handlers look the worker up without a lock
+        CpuWorker[i] = worker;
+        Barrier();
+        worker->Active = true;
+    }
+
+    return true;
+}
+
+void WorkQueue::Stop()
+{
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuWorker); i++)
+    {
+        auto worker = CpuWorker[i];
+        if (worker == nullptr || !worker->Active)
+            continue;
+
+        // a push racing with this may be left unrun
+        worker->Active = false;
+        worker->Task->SetStopping();
+        worker->WaitQueue.WakeUpOne();
+        worker->Task->Wait();
+    }
+}
+
+bool WorkQueue::QueueOn(ulong cpu, Work& work)
+{
+    if (BugOn(cpu >= Stdlib::ArraySize(CpuWorker)))
+        return false;
+
+    auto worker = CpuWorker[cpu];
+    if (worker == nullptr || !worker->Active)
+        return false;
+
+    if (work.Queued.Cmpxchg(1, 0) != 0)
+        return false;
+
+    for (;;)
+    {
+        long head = worker->Head.Get();
+        work.Next = reinterpret_cast<Work*>(head);
+        if (worker->Head.Cmpxchg(reinterpret_cast<long>(&work), head) == head)
+        {
+            // a busy worker rechecks the list before it sleeps
+            if (head == 0)
+                worker->WaitQueue.WakeUpOne();
+            return true;
+        }
+    }
+}
+
+bool WorkQueue::HasWorker(ulong cpu)
+{
+    if (BugOn(cpu >= Stdlib::ArraySize(CpuWorker)))
+        return false;
+
+    auto worker = CpuWorker[cpu];
+    return (worker != nullptr && worker->Active) ? true : false;
+}
+
+bool WorkQueue::Queue(Work& work)
+{
+    PreemptDisable();
+    bool result = QueueOn(GetPerCpuIndex(), work);
+    PreemptEnable();
+    return result;
+}
+
+void WorkQueue::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("cpu run batches maxbatch\n");
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuWorker); i++)
+    {
+        auto worker = CpuWorker[i];
+        if (worker == nullptr)
+            continue;
+
+        printer.Printf("%u %u %u %u\n", i, worker->RunCount, worker->BatchCount, worker->MaxBatch);
+    }
+}
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+
+#include "atomic.h"
+#include "per_cpu.h"
+#include "wait_queue.h"
+#include "forward.h"
+
+namespace Kernel
+{
+
+typedef void (*WorkFunc)(void* ctx);
+
+// Deferred call, the owner keeps it alive while it is queued or running.
+// Queued is cleared just before Func runs, so Func may queue it again.
+struct Work final
+{
+    Work();
+    Work(WorkFunc func, void* ctx);
+
+    void Init(WorkFunc func, void* ctx);
+
+    Work* Next;
+    WorkFunc Func;
+    void* Ctx;
+    Atomic Queued;
+
+private:
+    Work(const Work& other) = delete;
+    Work(Work&& other) = delete;
+    Work& operator=(const Work& other) = delete;
+    Work& operator=(Work&& other) = delete;
+};
+
+// One kernel worker task per cpu runs the work queued on that cpu. Queueing
+// is a lock-free push, safe from interrupt context, and the worker takes the
+// whole list at once and runs it in queueing order.
+class WorkQueue final
+{
+public:
+    static WorkQueue& GetInstance()
+    {
+        static WorkQueue Instance;
+        return Instance;
+    }
+
+    // starts a worker pinned to every running cpu
+    bool Setup();
+
+    // runs what is queued and stops the workers, queueing fails afterwards
+    void Stop();
+
+    // false if the work is already queued or the cpu has no worker, only
+    // in the latter case the caller has to run it inline
+    bool Queue(Work& work);
+    bool QueueOn(ulong cpu, Work& work);
+
+    // true if work queued on cpu runs, before Setup and after Stop false
+    bool HasWorker(ulong cpu);
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    WorkQueue();
+    ~WorkQueue();
+    WorkQueue(const WorkQueue& other) = delete;
+    WorkQueue(WorkQueue&& other) = delete;
+    WorkQueue& operator=(const WorkQueue& other) = delete;
+    WorkQueue& operator=(WorkQueue&& other) = delete;
+
+    struct Worker
+    {
+        Worker();
+
+        // Work list pushed as a stack
+        Atomic Head;
+        WaitQueue WaitQueue;
+        class Task* Task;
+        volatile bool Active;
+        // updated by the worker only
+        ulong RunCount;
+        ulong BatchCount;
+        ulong MaxBatch;
+    };
+
+    static void RunFunc(void* ctx);
+
+    ulong RunBatch(Worker* worker);
+
+    Worker* CpuWorker[MaxCpus];
+};
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "stdlib.h"
+
+#include <mm/new.h>
+
+namespace Stdlib
+{
+
+// Allocator policy of containers: Alloc(size) and Free(ptr), held by value,
+// so stateless policies are free and stateful ones carry a pointer.
+class DefaultAllocator final
+{
+public:
+    void* Alloc(size_t size)
+    {
+        return ::operator new(size);
+    }
+
+    void Free(void* ptr)
+    {
+        ::operator delete(ptr);
+    }
+};
+
+template <typename T, typename Allocator, typename... Args>
+T* New(Allocator& allocator, Args&&... args)
+{
+    void* ptr = allocator.Alloc(sizeof(T));
+    if (ptr == nullptr)
+        return nullptr;
+
+    return new (ptr) T(Stdlib::Forward<Args>(args)...);
+}
+
+template <typename T, typename Allocator>
+void Delete(Allocator& allocator, T* obj)
+{
+    obj->~T();
+    allocator.Free(obj);
+}
+
+}
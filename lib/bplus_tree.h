@@ -0,0 +1,654 @@
+#pragma once
+
+#include "lock.h"
+#include "allocator.h"
+
+#include <include/const.h>
+#include <kernel/trace.h>
+#include <kernel/panic.h>
+
+namespace Stdlib
+{
+
+const int BplusTreeLL = 6;
+
+// B+tree: values live only in leaves, leaves are linked for ordered scans,
+// inner nodes hold raw child pointers and every node fits in NodeSize bytes.
+template<typename K, typename V, size_t NodeSize = 4 * Const::CacheLineSize,
+    typename LockType = Stdlib::NopLock, typename Allocator = DefaultAllocator>
+class BplusTree
+{
+public:
+    BplusTree()
+        : Root(nullptr)
+        , FirstLeaf(nullptr)
+        , Count(0)
+        , Height(0)
+    {
+        Trace(BplusTreeLL, "tree 0x%p ctor", this);
+    }
+
+    explicit BplusTree(const Allocator& allocator)
+        : BplusTree()
+    {
+        Alloc = allocator;
+    }
+
+    virtual ~BplusTree()
+    {
+        Trace(BplusTreeLL, "tree 0x%p dtor", this);
+        Clear();
+    }
+
+    bool Insert(const K& key, const V& value)
+    {
+        Stdlib::AutoLock lock(Lock);
+        return InsertLocked(key, value);
+    }
+
+    bool Delete(const K& key)
+    {
+        Stdlib::AutoLock lock(Lock);
+        return DeleteLocked(key);
+    }
+
+    V Lookup(const K& key, bool& exist)
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+
+        exist = false;
+        if (Root == nullptr)
+            return EmptyValue;
+
+        LeafNode* leaf = FindLeaf(key);
+        size_t pos = LowerBound(leaf->Key, leaf->Count, key);
+        if (pos == leaf->Count || key < leaf->Key[pos])
+            return EmptyValue;
+
+        exist = true;
+        return leaf->Value[pos];
+    }
+
+    // calls func(key, value) in key order for low <= key <= high while it
+    // returns true, returns the number of calls
+    template<typename Func>
+    size_t Scan(const K& low, const K& high, Func func)
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+
+        if (Root == nullptr)
+            return 0;
+
+        size_t calls = 0;
+        LeafNode* leaf = FindLeaf(low);
+        size_t pos = LowerBound(leaf->Key, leaf->Count, low);
+        for (;;)
+        {
+            if (pos == leaf->Count)
+            {
+                leaf = leaf->Next;
+                if (leaf == nullptr)
+                    break;
+                pos = 0;
+                continue;
+            }
+
+            if (high < leaf->Key[pos])
+                break;
+
+            calls++;
+            if (!func(leaf->Key[pos], leaf->Value[pos]))
+                break;
+            pos++;
+        }
+
+        return calls;
+    }
+
+    size_t GetCount()
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+        return Count;
+    }
+
+    size_t GetHeight()
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+        return Height;
+    }
+
+    bool Check()
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+
+        if (Root == nullptr)
+            return (Count == 0 && FirstLeaf == nullptr && Height == 0) ? true : false;
+
+        LeafNode* prevLeaf = nullptr;
+        size_t count = 0;
+        if (!CheckNode(Root, 1, nullptr, nullptr, prevLeaf, count))
+            return false;
+
+        if (prevLeaf->Next != nullptr || count != Count)
+        {
+            Trace(BplusTreeLL, "tree 0x%p count %lu expected %lu", this, count, Count);
+            return false;
+        }
+
+        return true;
+    }
+
+    void Clear()
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        if (Root != nullptr)
+            FreeNode(Root);
+
+        Root = nullptr;
+        FirstLeaf = nullptr;
+        Count = 0;
+        Height = 0;
+    }
+
+private:
+    BplusTree(const BplusTree& other) = delete;
+    BplusTree(BplusTree&& other) = delete;
+    BplusTree& operator=(const BplusTree& other) = delete;
+    BplusTree& operator=(BplusTree&& other) = delete;
+
+    struct Node
+    {
+        u32 Count;
+        bool Leaf;
+    };
+
+    static const size_t InnerMax = (NodeSize - 3 * sizeof(ulong)) / (sizeof(K) + sizeof(void*));
+    static const size_t InnerMin = (InnerMax - 1) / 2;
+    static const size_t LeafMax = (NodeSize - 4 * sizeof(ulong)) / (sizeof(K) + sizeof(V));
+    static const size_t LeafMin = LeafMax / 2;
+    static const size_t MaxHeight = 24;
+
+    struct InnerNode : public Node
+    {
+        K Key[InnerMax];
+        Node* Child[InnerMax + 1];
+    };
+
+    struct LeafNode : public Node
+    {
+        K Key[LeafMax];
+        V Value[LeafMax];
+        LeafNode* Next;
+        LeafNode* Prev;
+    };
+
+    static_assert(InnerMax >= 7 && LeafMax >= 4, "Node size too small");
+    static_assert(sizeof(InnerNode) <= NodeSize && sizeof(LeafNode) <= NodeSize, "Invalid node size");
+
+    // inner nodes visited by a descent and the child index taken in each
+    struct Path
+    {
+        InnerNode* Nodes[MaxHeight];
+        size_t Index[MaxHeight];
+        size_t Depth;
+    };
+
+    static InnerNode* AsInner(Node* node)
+    {
+        return static_cast<InnerNode*>(node);
+    }
+
+    static LeafNode* AsLeaf(Node* node)
+    {
+        return static_cast<LeafNode*>(node);
+    }
+
+    LeafNode* FindLeaf(const K& key, Path* path = nullptr)
+    {
+        Node* node = Root;
+        size_t depth = 0;
+        while (!node->Leaf)
+        {
+            InnerNode* inner = AsInner(node);
+            size_t index = UpperBound(inner->Key, inner->Count, key);
+            if (path != nullptr)
+            {
+                BugOn(depth >= MaxHeight);
+                path->Nodes[depth] = inner;
+                path->Index[depth] = index;
+            }
+            depth++;
+            node = inner->Child[index];
+        }
+
+        if (path != nullptr)
+            path->Depth = depth;
+
+        return AsLeaf(node);
+    }
+
+    LeafNode* NewLeaf()
+    {
+        LeafNode* leaf = Stdlib::New<LeafNode>(Alloc);
+        if (leaf == nullptr)
+            return nullptr;
+
+        leaf->Count = 0;
+        leaf->Leaf = true;
+        leaf->Next = nullptr;
+        leaf->Prev = nullptr;
+        return leaf;
+    }
+
+    InnerNode* NewInner()
+    {
+        InnerNode* inner = Stdlib::New<InnerNode>(Alloc);
+        if (inner == nullptr)
+            return nullptr;
+
+        inner->Count = 0;
+        inner->Leaf = false;
+        return inner;
+    }
+
+    void FreeNode(Node* node)
+    {
+        if (node->Leaf)
+        {
+            Stdlib::Delete(Alloc, AsLeaf(node));
+            return;
+        }
+
+        InnerNode* inner = AsInner(node);
+        for (size_t i = 0; i <= inner->Count; i++)
+        {
+            FreeNode(inner->Child[i]);
+        }
+        Stdlib::Delete(Alloc, inner);
+    }
+
+    static void LeafInsertAt(LeafNode* leaf, size_t pos, const K& key, const V& value)
+    {
+        for (size_t i = leaf->Count; i > pos; i--)
+        {
+            leaf->Key[i] = Stdlib::Move(leaf->Key[i - 1]);
+            leaf->Value[i] = Stdlib::Move(leaf->Value[i - 1]);
+        }
+        leaf->Key[pos] = key;
+        leaf->Value[pos] = value;
+        leaf->Count++;
+    }
+
+    static void LeafRemoveAt(LeafNode* leaf, size_t pos)
+    {
+        for (size_t i = pos + 1; i < leaf->Count; i++)
+        {
+            leaf->Key[i - 1] = Stdlib::Move(leaf->Key[i]);
+            leaf->Value[i - 1] = Stdlib::Move(leaf->Value[i]);
+        }
+        leaf->Count--;
+    }
+
+    // key goes to index pos, child to the right of it
+    static void InnerInsertAt(InnerNode* inner, size_t pos, const K& key, Node* child)
+    {
+        for (size_t i = inner->Count; i > pos; i--)
+        {
+            inner->Key[i] = Stdlib::Move(inner->Key[i - 1]);
+            inner->Child[i + 1] = inner->Child[i];
+        }
+        inner->Key[pos] = key;
+        inner->Child[pos + 1] = child;
+        inner->Count++;
+    }
+
+    // removes key at pos and the child to the right of it
+    static void InnerRemoveAt(InnerNode* inner, size_t pos)
+    {
+        for (size_t i = pos + 1; i < inner->Count; i++)
+        {
+            inner->Key[i - 1] = Stdlib::Move(inner->Key[i]);
+            inner->Child[i] = inner->Child[i + 1];
+        }
+        inner->Count--;
+    }
+
+    bool InsertLocked(const K& key, const V& value)
+    {
+        if (Root == nullptr)
+        {
+            LeafNode* leaf = NewLeaf();
+            if (leaf == nullptr)
+                return false;
+
+            Root = leaf;
+            FirstLeaf = leaf;
+            Height = 1;
+        }
+
+        Path path;
+        LeafNode* leaf = FindLeaf(key, &path);
+        size_t pos = LowerBound(leaf->Key, leaf->Count, key);
+        if (pos < leaf->Count && !(key < leaf->Key[pos]))
+            return false;
+
+        if (leaf->Count < LeafMax)
+        {
+            LeafInsertAt(leaf, pos, key, value);
+            Count++;
+            return true;
+        }
+
+        // allocate every node the split needs up front, so failure leaves the tree intact
+        size_t innerSplits = 0;
+        while (innerSplits < path.Depth && path.Nodes[path.Depth - 1 - innerSplits]->Count == InnerMax)
+            innerSplits++;
+
+        Node* spare[MaxHeight + 2];
+        size_t spareCount = 1 + innerSplits + ((innerSplits == path.Depth) ? 1 : 0);
+        for (size_t i = 0; i < spareCount; i++)
+        {
+            spare[i] = (i == 0) ? static_cast<Node*>(NewLeaf()) : static_cast<Node*>(NewInner());
+            if (spare[i] == nullptr)
+            {
+                while (i != 0)
+                {
+                    i--;
+                    if (spare[i]->Leaf)
+                        Stdlib::Delete(Alloc, AsLeaf(spare[i]));
+                    else
+                        Stdlib::Delete(Alloc, AsInner(spare[i]));
+                }
+                return false;
+            }
+        }
+
+        LeafNode* right = AsLeaf(spare[0]);
+        size_t split = LeafMax / 2;
+        for (size_t i = split; i < LeafMax; i++)
+        {
+            right->Key[i - split] = Stdlib::Move(leaf->Key[i]);
+            right->Value[i - split] = Stdlib::Move(leaf->Value[i]);
+        }
+        right->Count = LeafMax - split;
+        leaf->Count = split;
+
+        right->Next = leaf->Next;
+        right->Prev = leaf;
+        if (leaf->Next != nullptr)
+            leaf->Next->Prev = right;
+        leaf->Next = right;
+
+        if (pos < split)
+            LeafInsertAt(leaf, pos, key, value);
+        else
+            LeafInsertAt(right, pos - split, key, value);
+        Count++;
+
+        K sep = right->Key[0];
+        Node* newChild = right;
+        size_t spareIndex = 1;
+        for (size_t depth = path.Depth; depth > 0; depth--)
+        {
+            InnerNode* parent = path.Nodes[depth - 1];
+            size_t index = path.Index[depth - 1];
+            if (parent->Count < InnerMax)
+            {
+                InnerInsertAt(parent, index, sep, newChild);
+                return true;
+            }
+
+            // push up the middle key, then insert into the half covering index
+            InnerNode* rightInner = AsInner(spare[spareIndex++]);
+            size_t mid = InnerMax / 2;
+            for (size_t i = mid + 1; i < InnerMax; i++)
+            {
+                rightInner->Key[i - mid - 1] = Stdlib::Move(parent->Key[i]);
+                rightInner->Child[i - mid - 1] = parent->Child[i];
+            }
+            rightInner->Child[InnerMax - mid - 1] = parent->Child[InnerMax];
+            rightInner->Count = InnerMax - mid - 1;
+            parent->Count = mid;
+            K up = Stdlib::Move(parent->Key[mid]);
+
+            if (index <= mid)
+                InnerInsertAt(parent, index, sep, newChild);
+            else
+                InnerInsertAt(rightInner, index - mid - 1, sep, newChild);
+
+            sep = Stdlib::Move(up);
+            newChild = rightInner;
+        }
+
+        InnerNode* root = AsInner(spare[spareIndex++]);
+        root->Key[0] = sep;
+        root->Child[0] = Root;
+        root->Child[1] = newChild;
+        root->Count = 1;
+        Root = root;
+        Height++;
+        BugOn(spareIndex != spareCount);
+        return true;
+    }
+
+    bool DeleteLocked(const K& key)
+    {
+        if (Root == nullptr)
+            return false;
+
+        Path path;
+        LeafNode* leaf = FindLeaf(key, &path);
+        size_t pos = LowerBound(leaf->Key, leaf->Count, key);
+        if (pos == leaf->Count || key < leaf->Key[pos])
+            return false;
+
+        LeafRemoveAt(leaf, pos);
+        Count--;
+
+        if (path.Depth == 0)
+        {
+            if (leaf->Count == 0)
+            {
+                Stdlib::Delete(Alloc, leaf);
+                Root = nullptr;
+                FirstLeaf = nullptr;
+                Height = 0;
+            }
+            return true;
+        }
+
+        // separators may go stale, they still route correctly
+        if (leaf->Count >= LeafMin)
+            return true;
+
+        InnerNode* parent = path.Nodes[path.Depth - 1];
+        size_t index = path.Index[path.Depth - 1];
+        LeafNode* left = (index > 0) ? AsLeaf(parent->Child[index - 1]) : nullptr;
+        LeafNode* right = (index < parent->Count) ? AsLeaf(parent->Child[index + 1]) : nullptr;
+
+        if (left != nullptr && left->Count > LeafMin)
+        {
+            LeafInsertAt(leaf, 0, left->Key[left->Count - 1], left->Value[left->Count - 1]);
+            left->Count--;
+            parent->Key[index - 1] = leaf->Key[0];
+            return true;
+        }
+
+        if (right != nullptr && right->Count > LeafMin)
+        {
+            LeafInsertAt(leaf, leaf->Count, right->Key[0], right->Value[0]);
+            LeafRemoveAt(right, 0);
+            parent->Key[index] = right->Key[0];
+            return true;
+        }
+
+        // merge into the left one of the pair and drop the right one
+        size_t sepIndex = index;
+        if (left != nullptr)
+        {
+            right = leaf;
+            leaf = left;
+            sepIndex = index - 1;
+        }
+
+        for (size_t i = 0; i < right->Count; i++)
+        {
+            leaf->Key[leaf->Count + i] = Stdlib::Move(right->Key[i]);
+            leaf->Value[leaf->Count + i] = Stdlib::Move(right->Value[i]);
+        }
+        leaf->Count += right->Count;
+        leaf->Next = right->Next;
+        if (right->Next != nullptr)
+            right->Next->Prev = leaf;
+        Stdlib::Delete(Alloc, right);
+        InnerRemoveAt(parent, sepIndex);
+
+        RebalanceInner(path, path.Depth - 1);
+        return true;
+    }
+
+    void RebalanceInner(Path& path, size_t depth)
+    {
+        for (;;)
+        {
+            InnerNode* inner = path.Nodes[depth];
+            if (depth == 0)
+            {
+                if (inner->Count == 0)
+                {
+                    Root = inner->Child[0];
+                    Stdlib::Delete(Alloc, inner);
+                    Height--;
+                }
+                return;
+            }
+
+            if (inner->Count >= InnerMin)
+                return;
+
+            InnerNode* parent = path.Nodes[depth - 1];
+            size_t index = path.Index[depth - 1];
+            InnerNode* left = (index > 0) ? AsInner(parent->Child[index - 1]) : nullptr;
+            InnerNode* right = (index < parent->Count) ? AsInner(parent->Child[index + 1]) : nullptr;
+
+            // borrow through the parent separator
+            if (left != nullptr && left->Count > InnerMin)
+            {
+                inner->Child[inner->Count + 1] = inner->Child[inner->Count];
+                for (size_t i = inner->Count; i > 0; i--)
+                {
+                    inner->Key[i] = Stdlib::Move(inner->Key[i - 1]);
+                    inner->Child[i] = inner->Child[i - 1];
+                }
+                inner->Key[0] = Stdlib::Move(parent->Key[index - 1]);
+                inner->Child[0] = left->Child[left->Count];
+                inner->Count++;
+                parent->Key[index - 1] = Stdlib::Move(left->Key[left->Count - 1]);
+                left->Count--;
+                return;
+            }
+
+            if (right != nullptr && right->Count > InnerMin)
+            {
+                inner->Key[inner->Count] = Stdlib::Move(parent->Key[index]);
+                inner->Child[inner->Count + 1] = right->Child[0];
+                inner->Count++;
+                parent->Key[index] = Stdlib::Move(right->Key[0]);
+                for (size_t i = 1; i < right->Count; i++)
+                {
+                    right->Key[i - 1] = Stdlib::Move(right->Key[i]);
+                    right->Child[i - 1] = right->Child[i];
+                }
+                right->Child[right->Count - 1] = right->Child[right->Count];
+                right->Count--;
+                return;
+            }
+
+            size_t sepIndex = index;
+            if (left != nullptr)
+            {
+                right = inner;
+                inner = left;
+                sepIndex = index - 1;
+            }
+
+            inner->Key[inner->Count] = Stdlib::Move(parent->Key[sepIndex]);
+            for (size_t i = 0; i < right->Count; i++)
+            {
+                inner->Key[inner->Count + 1 + i] = Stdlib::Move(right->Key[i]);
+                inner->Child[inner->Count + 1 + i] = right->Child[i];
+            }
+            inner->Child[inner->Count + 1 + right->Count] = right->Child[right->Count];
+            inner->Count += 1 + right->Count;
+            Stdlib::Delete(Alloc, right);
+            InnerRemoveAt(parent, sepIndex);
+
+            depth--;
+        }
+    }
+
+    // keys of the subtree must be in [low, high)
+    bool CheckNode(Node* node, size_t level, const K* low, const K* high, LeafNode*& prevLeaf, size_t& count)
+    {
+        bool root = (node == Root) ? true : false;
+        const K* keys = node->Leaf ? AsLeaf(node)->Key : AsInner(node)->Key;
+        size_t max = node->Leaf ? LeafMax : InnerMax;
+        size_t min = root ? 1 : (node->Leaf ? LeafMin : InnerMin);
+
+        if (node->Count > max || node->Count < min)
+        {
+            Trace(BplusTreeLL, "node 0x%p count %lu", node, (ulong)node->Count);
+            return false;
+        }
+
+        for (size_t i = 0; i < node->Count; i++)
+        {
+            if ((i > 0 && !(keys[i - 1] < keys[i])) ||
+                (low != nullptr && keys[i] < *low) ||
+                (high != nullptr && !(keys[i] < *high)))
+            {
+                Trace(BplusTreeLL, "node 0x%p key %lu out of order", node, i);
+                return false;
+            }
+        }
+
+        if (node->Leaf)
+        {
+            LeafNode* leaf = AsLeaf(node);
+            if (level != Height || leaf->Prev != prevLeaf ||
+                (prevLeaf == nullptr && leaf != FirstLeaf) ||
+                (prevLeaf != nullptr && prevLeaf->Next != leaf))
+            {
+                Trace(BplusTreeLL, "leaf 0x%p invalid link", leaf);
+                return false;
+            }
+
+            prevLeaf = leaf;
+            count += leaf->Count;
+            return true;
+        }
+
+        InnerNode* inner = AsInner(node);
+        for (size_t i = 0; i <= inner->Count; i++)
+        {
+            const K* childLow = (i > 0) ? &inner->Key[i - 1] : low;
+            const K* childHigh = (i < inner->Count) ? &inner->Key[i] : high;
+            if (inner->Child[i] == nullptr ||
+                !CheckNode(inner->Child[i], level + 1, childLow, childHigh, prevLeaf, count))
+                return false;
+        }
+
+        return true;
+    }
+
+    Node* Root;
+    LeafNode* FirstLeaf;
+    size_t Count;
+    size_t Height;
+    LockType Lock;
+    Allocator Alloc;
+    V EmptyValue;
+};
+
+}
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "lock.h"
-#include "shared_ptr.h"
+#include "intrusive_ptr.h"
+#include "allocator.h"
+#include "vector.h"
 
 #include <kernel/trace.h>
+#include <kernel/atomic.h>
 #include <mm/new.h>
 #include <kernel/panic.h>
 
@@ -12,15 +15,30 @@ namespace Stdlib
 
 const int BtreeLL = 6;
 
-template<typename K, typename V, size_t T, typename LockType = Stdlib::NopLock>
+template<typename K, typename V, size_t T, typename LockType = Stdlib::NopLock,
+    typename Allocator = DefaultAllocator>
 class Btree
 {
 public:
     Btree()
+        : Count(0)
     {
         Trace(BtreeLL, "tree 0x%p ctor", this);
     }
 
+    // nodes are allocated from the allocator, e.g. a pool of GetNodeSize() blocks
+    explicit Btree(const Allocator& allocator)
+        : Count(0)
+        , Alloc(allocator)
+    {
+        Trace(BtreeLL, "tree 0x%p ctor", this);
+    }
+
+    static constexpr size_t GetNodeSize()
+    {
+        return sizeof(BtreeNode);
+    }
+
     virtual ~Btree()
     {
         Trace(BtreeLL, "tree 0x%p dtor, root 0x%p", this, Root.Get());
@@ -31,17 +49,150 @@ public:
     bool Insert(const K& key, const V& value)
     {
         Stdlib::AutoLock lock(Lock);
+        return InsertLocked(key, value, false);
+    }
 
-        bool exist;
-        LookupLocked(key, exist);
-        if (exist)
+    // inserts the key or replaces the value of an existing one, fails only
+    // on allocation failure
+    bool InsertOrAssign(const K& key, const V& value)
+    {
+        Stdlib::AutoLock lock(Lock);
+        return InsertLocked(key, value, true);
+    }
+
+    // builds an empty tree from strictly increasing keys bottom up, every
+    // node is packed except for the spread of the remainder
+    bool BulkLoad(const K* keys, const V* values, size_t count)
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        if (Root.Get() != nullptr)
+            return false;
+
+        for (size_t i = 1; i < count; i++)
         {
+            if (!(keys[i - 1] < keys[i]))
+                return false;
+        }
+
+        BtreeNodePtr root;
+        if (!Build(keys, values, count, root))
             return false;
+
+        Root = Stdlib::Move(root);
+        Count = count;
+        return true;
+    }
+
+    // inserts keys in sorted order, a batch big compared with the tree is
+    // merged with the existing keys and the tree is rebuilt by Build; keys
+    // which already exist are skipped, returns the number of inserted keys
+    size_t InsertBatch(const K* keys, const V* values, size_t count)
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        Vector<size_t> order;
+        if (!order.ReserveAndUse(count))
+            return 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            order[i] = i;
         }
 
+        // equal keys keep the batch order, so the first one wins
+        Stdlib::Sort(order.GetBuf(), count, [keys](size_t a, size_t b)
+        {
+            if (keys[a] < keys[b])
+                return true;
+            return (!(keys[b] < keys[a]) && a < b) ? true : false;
+        });
+
+        if (count < RebuildFactor * Count || count < RebuildFactor)
+        {
+            size_t inserted = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (InsertLocked(keys[order[i]], values[order[i]], false))
+                    inserted++;
+            }
+            return inserted;
+        }
+
+        Vector<K> oldKeys, mergedKeys;
+        Vector<V> oldValues, mergedValues;
+        if (!oldKeys.Reserve(Count) || !oldValues.Reserve(Count) ||
+            !mergedKeys.Reserve(Count + count) || !mergedValues.Reserve(Count + count))
+            return 0;
+
+        if (Root.Get() != nullptr && !Collect(Root, oldKeys, oldValues))
+            return 0;
+
+        size_t inserted = 0;
+        size_t oldPos = 0;
+        for (size_t i = 0; i < count || oldPos < oldKeys.GetSize();)
+        {
+            bool takeOld = (i == count) ||
+                (oldPos < oldKeys.GetSize() && !(keys[order[i]] < oldKeys[oldPos]));
+            if (takeOld)
+            {
+                // equal batch keys lose to the existing one
+                while (i < count && !(oldKeys[oldPos] < keys[order[i]]))
+                    i++;
+
+                mergedKeys.PushBack(Stdlib::Move(oldKeys[oldPos]));
+                mergedValues.PushBack(Stdlib::Move(oldValues[oldPos]));
+                oldPos++;
+                continue;
+            }
+
+            size_t inPos = order[i];
+            i++;
+            // first of equal batch keys wins
+            if (mergedKeys.GetSize() != 0 && !(mergedKeys[mergedKeys.GetSize() - 1] < keys[inPos]))
+                continue;
+
+            mergedKeys.PushBack(keys[inPos]);
+            mergedValues.PushBack(values[inPos]);
+            inserted++;
+        }
+
+        BtreeNodePtr root;
+        if (!Build(mergedKeys.GetBuf(), mergedValues.GetBuf(), mergedKeys.GetSize(), root))
+            return 0;
+
+        if (Root.Get() != nullptr)
+            Release(Root);
+        Root = Stdlib::Move(root);
+        Count = mergedKeys.GetSize();
+        return inserted;
+    }
+
+    size_t GetCount()
+    {
+        Stdlib::SharedAutoLock lock(Lock);
+        return Count;
+    }
+
+    bool Delete(const K& key)
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        if (!DeleteLocked(key))
+            return false;
+
+        Count--;
+        return true;
+    }
+
+private:
+    // duplicates are detected during the split descent, so a plain insert
+    // of an existing key fails and an assign replaces its value
+    bool InsertLocked(const K& key, const V& value, bool assign)
+    {
         if (Root.Get() == nullptr)
         {
-            Root = MakeShared<BtreeNode>(true);
+            Root = NewNode(Alloc, true);
             if (Root.Get() == nullptr)
             {
                 return false;
@@ -50,12 +201,12 @@ public:
 
         if (Root->IsFull())
         {
-            auto newNode = MakeShared<BtreeNode>();
+            auto newNode = NewNode(Alloc);
             if (newNode.Get() == nullptr)
             {
                 return false;
             }
-            auto newNode2 = MakeShared<BtreeNode>();
+            auto newNode2 = NewNode(Alloc);
             if (newNode2.Get() == nullptr)
             {
                 return false;
@@ -65,13 +216,17 @@ public:
             Root = newNode;
         }
 
-        return Root->InsertNonFull(Root, key, value);
+        bool exist;
+        if (!Root->InsertNonFull(Root, key, value, assign, exist, Alloc))
+            return false;
+
+        if (!exist)
+            Count++;
+        return true;
     }
 
-    bool Delete(const K& key)
+    bool DeleteLocked(const K& key)
     {
-        Stdlib::AutoLock lock(Lock);
-
         Trace(BtreeLL, "root 0x%p", Root.Get());
 
         BtreeNodePtr node = Root;
@@ -188,6 +343,7 @@ restart:
         return false;
     }
 
+public:
     V Lookup(const K& key, bool& exist)
     {
         Stdlib::SharedAutoLock lock(Lock);
@@ -215,7 +371,7 @@ restart:
 
 restart:
         curr = Root;
-        parent.Reset(nullptr);
+        parent.Reset();
         childIndex = -1;
 
         for (;;)
@@ -261,6 +417,7 @@ finish:
             return;
 
         Root.Reset();
+        Count = 0;
     }
 
     size_t MinDepth()
@@ -290,7 +447,164 @@ private:
     Btree& operator=(Btree&& other) = delete;
 
     class BtreeNode;
-    using BtreeNodePtr = SharedPtr<BtreeNode>;
+    using BtreeNodePtr = IntrusivePtr<BtreeNode>;
+
+    // node and its reference count share one allocation
+    static BtreeNodePtr NewNode(Allocator& allocator, bool leaf = false)
+    {
+        return BtreeNodePtr::Attach(Stdlib::New<BtreeNode>(allocator, allocator, leaf));
+    }
+
+    static const size_t RebuildFactor = 4;
+    // every level has at most half the nodes of the one below
+    static const size_t MaxLevels = 64;
+
+    // one level per pass: n items make ceil((n + 1) / 2T) nodes, the items
+    // between nodes go up as separators of the next level
+    bool Build(const K* keys, const V* values, size_t count, BtreeNodePtr& root)
+    {
+        if (count == 0)
+            return true;
+
+        // all nodes are allocated up front from the root level down, so
+        // with a pool or arena allocator the upper levels share the first
+        // pages and the children of every node are adjacent
+        size_t levelNodes[MaxLevels];
+        size_t levelCount = 0, totalNodes = 0;
+        for (size_t n = count;;)
+        {
+            if (BugOn(levelCount == MaxLevels))
+                return false;
+
+            size_t nodeCount = (n + 2 * T) / (2 * T);
+            levelNodes[levelCount++] = nodeCount;
+            totalNodes += nodeCount;
+            if (nodeCount == 1)
+                break;
+            n = nodeCount - 1;
+        }
+
+        Vector<BtreeNodePtr> allNodes;
+        if (!allNodes.Reserve(totalNodes))
+            return false;
+
+        for (size_t level = levelCount; level > 0; level--)
+        {
+            for (size_t i = 0; i < levelNodes[level - 1]; i++)
+            {
+                auto node = NewNode(Alloc, (level == 1) ? true : false);
+                if (node.Get() == nullptr)
+                    return false;
+
+                allNodes.PushBack(Stdlib::Move(node));
+            }
+        }
+
+        // leaves are the last level in allNodes
+        size_t levelStart = totalNodes;
+
+        Vector<BtreeNodePtr> children;
+        Vector<K> levelKeys;
+        Vector<V> levelValues;
+        for (size_t level = 0;; level++)
+        {
+            size_t nodeCount = levelNodes[level];
+            size_t inNodes = count - (nodeCount - 1);
+            size_t base = inNodes / nodeCount;
+            size_t extra = inNodes % nodeCount;
+            levelStart -= nodeCount;
+
+            Vector<BtreeNodePtr> nodes;
+            Vector<K> upKeys;
+            Vector<V> upValues;
+            bool ok = nodes.Reserve(nodeCount) && upKeys.Reserve(nodeCount) && upValues.Reserve(nodeCount);
+
+            size_t pos = 0, childPos = 0;
+            bool leaf = (level == 0) ? true : false;
+            for (size_t i = 0; ok && i < nodeCount; i++)
+            {
+                size_t keyCount = base + ((i < extra) ? 1 : 0);
+                auto node = Stdlib::Move(allNodes[levelStart + i]);
+
+                for (size_t j = 0; j < keyCount; j++, pos++)
+                {
+                    node->SetKey(j, keys[pos]);
+                    node->SetValue(j, values[pos]);
+                }
+
+                node->SetKeyCount(keyCount);
+                if (!leaf)
+                {
+                    for (size_t j = 0; j <= keyCount; j++)
+                    {
+                        node->SetChild(j, Stdlib::Move(children[childPos++]));
+                    }
+                }
+
+                nodes.PushBack(Stdlib::Move(node));
+                if (i + 1 < nodeCount)
+                {
+                    upKeys.PushBack(keys[pos]);
+                    upValues.PushBack(values[pos]);
+                    pos++;
+                }
+            }
+
+            if (!ok)
+            {
+                for (size_t i = 0; i < nodes.GetSize(); i++)
+                    Release(nodes[i]);
+                for (size_t i = childPos; i < children.GetSize(); i++)
+                    Release(children[i]);
+                return false;
+            }
+
+            if (nodeCount == 1)
+            {
+                root = Stdlib::Move(nodes[0]);
+                return true;
+            }
+
+            children = Stdlib::Move(nodes);
+            levelKeys = Stdlib::Move(upKeys);
+            levelValues = Stdlib::Move(upValues);
+            keys = levelKeys.GetConstBuf();
+            values = levelValues.GetConstBuf();
+            count = levelKeys.GetSize();
+        }
+    }
+
+    // drops the children links bottom up, nodes check them in the dtor
+    void Release(const BtreeNodePtr& node)
+    {
+        if (node.Get() == nullptr)
+            return;
+
+        if (!node->IsLeaf())
+        {
+            for (size_t i = 0; i < (node->GetKeyCount() + 1); i++)
+            {
+                Release(node->GetChild(i));
+                node->SetChild(i, BtreeNodePtr());
+            }
+        }
+    }
+
+    // appends keys and values of the subtree in order
+    bool Collect(const BtreeNodePtr& node, Vector<K>& keys, Vector<V>& values)
+    {
+        for (size_t i = 0; i <= node->GetKeyCount(); i++)
+        {
+            if (!node->IsLeaf() && !Collect(node->GetChild(i), keys, values))
+                return false;
+
+            if (i < node->GetKeyCount() &&
+                (!keys.PushBack(node->GetKey(i)) || !values.PushBack(node->GetValue(i))))
+                return false;
+        }
+
+        return true;
+    }
 
     size_t MinDepth(const BtreeNodePtr& node)
     {
@@ -340,7 +654,9 @@ private:
             return EmptyValue;
         }
 
-        BtreeNodePtr node = Root;
+        // raw pointers, the lock keeps the nodes alive and reference
+        // counting every level would dirty their lines
+        BtreeNode* node = Root.Get();
         for (;;)
         {
             if (node->GetKeyCount() == 0)
@@ -358,18 +674,46 @@ private:
             }
             else
             {
-                node = node->GetChild(i);
-                if (BugOn(node.Get() == nullptr))
+                node = node->PeekChild(i);
+                if (BugOn(node == nullptr))
                     return EmptyValue;
+
+                node->Prefetch();
             }
         }
     }
 
+    // moves count items between possibly overlapping ranges, trivially
+    // copyable types go as one MemMove, the rest by move assignment so child
+    // pointers keep their references without touching the counts
+    template<typename E>
+    static void MoveItems(E* dst, E* src, size_t count)
+    {
+        if (__is_trivially_copyable(E))
+        {
+            MemMove(dst, src, count * sizeof(E));
+            return;
+        }
+
+        if (dst < src)
+        {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = Stdlib::Move(src[i]);
+        }
+        else
+        {
+            for (size_t i = count; i > 0; i--)
+                dst[i - 1] = Stdlib::Move(src[i - 1]);
+        }
+    }
+
     class BtreeNode {
     public:
-        BtreeNode(bool leaf = false)
+        BtreeNode(const Allocator& allocator, bool leaf = false)
+            : Alloc(allocator)
         {
             Trace(BtreeLL, "node 0x%p ctor", this);
+            RefCount.Set(1);
             SetLeaf(leaf);
             SetKeyCount(0);
         }
@@ -389,6 +733,21 @@ private:
             Trace(BtreeLL, "node 0x%p dtor complete", this);
         }
 
+        void Get()
+        {
+            RefCount.Inc();
+        }
+
+        // the last reference frees the node with the allocator it came from
+        void Put()
+        {
+            if (RefCount.DecAndTest())
+            {
+                Allocator allocator = Alloc;
+                Stdlib::Delete(allocator, this);
+            }
+        }
+
         bool IsFull()
         {
             bool result = ((2 * T - 1) == KeyCount) ? true : false;
@@ -430,12 +789,7 @@ private:
 
             Trace(BtreeLL, "node 0x%p put key %lu", this, index);
 
-            /* free space */
-            for (ssize_t i = KeyCount - 1; i >= static_cast<ssize_t>(index); i--)
-            {
-                SetKey(i + 1, Stdlib::Move(GetKey(i)));
-                SetValue(i + 1, Stdlib::Move(GetValue(i)));
-            }
+            ShiftKeys(index, index + 1);
 
             SetKey(index, key);
             SetValue(index, value);
@@ -451,12 +805,7 @@ private:
 
             Trace(BtreeLL, "node 0x%p put key %lu", this, index);
 
-            /* free space */
-            for (ssize_t i = KeyCount - 1; i >= static_cast<ssize_t>(index); i--)
-            {
-                SetKey(i + 1, Stdlib::Move(GetKey(i)));
-                SetValue(i + 1, Stdlib::Move(GetValue(i)));
-            }
+            ShiftKeys(index, index + 1);
 
             SetKey(index, Stdlib::Move(src->GetKey(srcIndex)));
             SetValue(index, Stdlib::Move(src->GetValue(srcIndex)));
@@ -532,19 +881,20 @@ private:
         }
 
         void PutChild(size_t index, const BtreeNodePtr& child)
+        {
+            PutChild(index, BtreeNodePtr(child));
+        }
+
+        void PutChild(size_t index, BtreeNodePtr&& child)
         {
             if (BugOn(index < 0 || index >= 2 * T))
                 return;
 
             Trace(BtreeLL, "node 0x%p put child %lu", this, index);
 
-            /* free space */
-            for (ssize_t i = KeyCount; i >= static_cast<ssize_t>(index); i--)
-            {
-                SetChild(i + 1, Stdlib::Move(Child[i]));
-            }
+            ShiftChildren(index, index + 1);
 
-            SetChild(index, child);
+            SetChild(index, Stdlib::Move(child));
         }
 
         void PutChild(size_t index, const BtreeNodePtr& src, size_t srcIndex)
@@ -599,11 +949,7 @@ private:
             Trace(BtreeLL, "node 0x%p delete child %lu 0x%p", this, index, Child[index].Get());
 
             Child[index].Reset();
-
-            for (size_t i = (index + 1); i < (KeyCount + 1); i++)
-            {
-                SetChild(i - 1, Stdlib::Move(Child[i]));
-            }
+            ShiftChildren(index + 1, index);
         }
 
         void DeleteKey(size_t index)
@@ -615,14 +961,11 @@ private:
 
             Trace(BtreeLL, "node 0x%p delete key %lu", this, index);
 
-            SetKey(index, EmptyKey);
-            SetValue(index, EmptyValue);
+            ShiftKeys(index + 1, index);
 
-            for (size_t i = (index + 1); i < KeyCount; i++)
-            {
-                SetKey(i - 1, Stdlib::Move(GetKey(i)));
-                SetValue(i - 1, Stdlib::Move(GetValue(i)));
-            }
+            // drops what the last slot still holds after the shift
+            Key[KeyCount - 1] = EmptyKey;
+            Value[KeyCount - 1] = EmptyValue;
         }
 
         void SplitChild(size_t childIndex, const BtreeNodePtr& sibling)
@@ -639,19 +982,14 @@ private:
                 return;
 
             sibling->SetLeaf(child->IsLeaf());
-            /* copy T-1 keys from child to sibling */
-            for (size_t i = 0; i < (T - 1); i++)
-            {
-                sibling->CopyKey(i,  child, i + T);
-            }
+            /* move T-1 keys from child to sibling */
+            MoveItems(sibling->Key, child->Key + T, T - 1);
+            MoveItems(sibling->Value, child->Value + T, T - 1);
             sibling->SetKeyCount(T - 1);
-            /* copy T childs from child to new */
+            /* move T childs from child to new */
             if (!child->IsLeaf())
             {
-                for (size_t i = 0; i < T; i++)
-                {
-                    sibling->CopyChild(i, child, i + T);
-                }
+                MoveItems(sibling->Child, child->Child + T, T);
             }
             /* setup node new child */
             PutChild(childIndex + 1, sibling);
@@ -667,25 +1005,11 @@ private:
             if (KeyCount == 0)
                 return 0;
 
-            size_t start = 0;
-            size_t end = KeyCount;
-            if (key > Key[end - 1])
-                return end;
-            else if (key < Key[start])
-                return 0;
-
-            while (start < end)
-            {
-                size_t mid = (start + end) / 2;
-                if (key == Key[mid])
-                    return mid;
-                else if (key < Key[mid])
-                    end = mid;
-                else
-                    start = mid + 1;
-            }
+            // in order inserts land past the last key
+            if (key > Key[KeyCount - 1])
+                return KeyCount;
 
-            return end;
+            return LowerBound(Key, KeyCount, key);
         }
 
         bool IsKeyProbablyInside(const K& key)
@@ -706,68 +1030,66 @@ private:
                 return false;
             }
 
-            size_t start = 0;
-            size_t end = KeyCount;
-            while (start < end)
+            size_t i = LowerBound(Key, KeyCount, key);
+            if (i < KeyCount && key == Key[i])
             {
-                size_t mid = (start + end) / 2;
-                if (key == Key[mid])
-                {
-                    Trace(BtreeLL, "node 0x%p get key at %lu", this, mid);
-                    index = mid;
-                    return true;
-                }
-                else if (key < Key[mid])
-                    end = mid;
-                else
-                    start = mid + 1;
+                Trace(BtreeLL, "node 0x%p get key at %lu", this, i);
+                index = i;
+                return true;
             }
 
             Trace(BtreeLL, "node 0x%p key not found", this);
             return false;
         }
 
-        bool InsertNonFull(const BtreeNodePtr& self, const K& key, const V& value)
+        bool InsertNonFull(const BtreeNodePtr& self, const K& key, const V& value, bool assign, bool& exist, Allocator& allocator)
         {
+            exist = false;
             if (BugOn(self.Get() != this))
                 return false;
 
-            BtreeNodePtr node = self;
+            BtreeNode* node = this;
 
             for (;;)
             {
-                size_t i;
-                bool exist = node->GetKeyIndex(key, i);
-                if (exist)
+                size_t i = node->FindKeyIndex(key);
+                if (i < node->KeyCount && key == node->Key[i])
                 {
-                    return false;
+                    exist = true;
+                    if (!assign)
+                        return false;
+
+                    node->SetValue(i, value);
+                    return true;
                 }
 
-                i = node->FindKeyIndex(key);
                 if (node->IsLeaf())
                 {
                     node->PutKey(i, key, value);
                     node->IncKeyCount();
                     return true;
                 }
-                else
-                {
-                    auto child = node->GetChild(i);
-                    if (BugOn(child.Get() == nullptr))
-                        return false;
 
-                    if (child->IsFull())
+                BtreeNode* child = node->Child[i].Get();
+                if (BugOn(child == nullptr))
+                    return false;
+
+                if (child->IsFull())
+                {
+                    auto newNode = NewNode(allocator);
+                    if (newNode.Get() == nullptr)
                     {
-                        auto newNode = MakeShared<BtreeNode>();
-                        if (newNode.Get() == nullptr)
-                        {
-                            return false;
-                        }
-                        node->SplitChild(i, newNode);
-                        continue; /* restart */
+                        return false;
                     }
-                    node = child;
+                    node->SplitChild(i, newNode);
+
+                    /* the median moved up to i, pick the half holding the key */
+                    if (key == node->Key[i])
+                        continue;
+                    else if (key > node->Key[i])
+                        child = node->Child[i + 1].Get();
                 }
+                node = child;
             }
         }
 
@@ -820,29 +1142,20 @@ private:
             SetKey(KeyCount, Stdlib::Move(key));
             SetValue(KeyCount, Stdlib::Move(value));
 
-            size_t pos = KeyCount + 1, i;
-            for (i = 0; i < src->KeyCount; i++, pos++)
-            {
-                SetKey(pos, Stdlib::Move(src->GetKey(i)));
-                SetValue(pos, Stdlib::Move(src->GetValue(i)));
-                SetChild(pos, Stdlib::Move(src->Child[i]));
-            }
-
-            SetChild(pos, Stdlib::Move(src->Child[i]));
+            size_t pos = KeyCount + 1;
+            MoveItems(Key + pos, src->Key, src->KeyCount);
+            MoveItems(Value + pos, src->Value, src->KeyCount);
+            MoveItems(Child + pos, src->Child, src->KeyCount + 1);
             IncKeyCount(1 + src->KeyCount);
         }
 
         void Copy(const BtreeNodePtr& src)
         {
-            size_t i;
+            size_t i = src->GetKeyCount();
 
-            for (i = 0; i < src->GetKeyCount(); i++)
-            {
-                SetKey(i, Stdlib::Move(src->GetKey(i)));
-                SetValue(i, Stdlib::Move(src->GetValue(i)));
-                SetChild(i, Stdlib::Move(src->Child[i]));
-            }
-            SetChild(i, Stdlib::Move(src->Child[i]));
+            MoveItems(Key, src->Key, i);
+            MoveItems(Value, src->Value, i);
+            MoveItems(Child, src->Child, i + 1);
             for (i = i + 1; i < 2 * T; i++)
             {
                 Child[i].Reset();
@@ -1062,6 +1375,22 @@ private:
             return Child[childIndex];
         }
 
+        // no reference taken, for walks under the tree lock
+        BtreeNode* PeekChild(size_t childIndex)
+        {
+            return Child[childIndex].Get();
+        }
+
+        // starts loading the lines a key search reads, so the binary search
+        // doesn't wait for them one after another
+        void Prefetch()
+        {
+            const u8* line = reinterpret_cast<const u8*>(this);
+            const u8* end = reinterpret_cast<const u8*>(&Key[2 * T - 1]);
+            for (; line < end; line += Const::CacheLineSize)
+                __builtin_prefetch(line);
+        }
+
         K& GetKey(size_t keyIndex)
         {
             Trace(BtreeLL, "node 0x%p get key %lu", this, keyIndex);
@@ -1166,19 +1495,43 @@ private:
         BtreeNode& operator=(const BtreeNode& other) = delete;
         BtreeNode& operator=(BtreeNode&& other) = delete;
 
-        K Key[2 * T - 1];
-        V Value[2 * T - 1];
-        BtreeNodePtr Child[2 * T];
+        // moves the keys and values from index from up to KeyCount so they
+        // start at index to
+        void ShiftKeys(size_t from, size_t to)
+        {
+            if (from < KeyCount)
+            {
+                MoveItems(Key + to, Key + from, KeyCount - from);
+                MoveItems(Value + to, Value + from, KeyCount - from);
+            }
+        }
 
+        // same for the children, a node has KeyCount + 1 of them
+        void ShiftChildren(size_t from, size_t to)
+        {
+            if (from < KeyCount + 1)
+                MoveItems(Child + to, Child + from, KeyCount + 1 - from);
+        }
+
+        // what a lookup reads comes first: the header, the keys it searches
+        // and the child it descends to, values only on a match
         size_t KeyCount;
         bool Leaf;
+        Kernel::Atomic RefCount;
+        Allocator Alloc;
+
+        K Key[2 * T - 1];
+        BtreeNodePtr Child[2 * T];
+        V Value[2 * T - 1];
 
         K EmptyKey;
         V EmptyValue;
     };
 
     BtreeNodePtr Root;
+    size_t Count;
     LockType Lock;
+    Allocator Alloc;
     K KeyToDelete;
     K EmptyKey;
     V EmptyValue;
@@ -0,0 +1,366 @@
+#include "checksum.h"
+
+#include <kernel/asm.h>
+
+namespace Stdlib
+{
+
+using UnalignedU64 = u64 __attribute__((aligned(1), may_alias));
+using UnalignedU32 = u32 __attribute__((aligned(1), may_alias));
+using UnalignedU16 = u16 __attribute__((aligned(1), may_alias));
+
+static const u32 Crc32cPoly = 0x82f63b78;
+static const u32 CpuidSse42 = (1U << 20);
+
+// the hardware path runs three crc32 streams over blocks of these sizes
+// and shifts the partial crcs together, the crc32 instruction has a
+// latency of three cycles but issues every cycle
+static const size_t Crc32cLong = 8192;
+static const size_t Crc32cShort = 256;
+
+// reflected byte table of the polynomial
+static const u32 Crc32cTable[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+// appends Crc32cLong and Crc32cShort zero bytes to a crc, byte by byte of
+// the crc, built by ChecksumSetup
+static u32 Crc32cLongZeros[4][256];
+static u32 Crc32cShortZeros[4][256];
+
+static bool UseCrc32cHw = false;
+
+static u32 Crc32cSw(u32 crc, const u8* p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        crc = Crc32cTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static inline u32 Crc32Byte(u32 crc, u8 value)
+{
+    asm ("crc32b %1, %0" : "+r"(crc) : "rm"(value));
+    return crc;
+}
+
+static inline u64 Crc32Quad(u64 crc, u64 value)
+{
+    asm ("crc32q %1, %0" : "+r"(crc) : "rm"(value));
+    return crc;
+}
+
+static u32 Gf2MatrixTimes(const u32* mat, u32 vec)
+{
+    u32 sum = 0;
+    for (; vec != 0; vec >>= 1, mat++)
+    {
+        if (vec & 1)
+            sum ^= *mat;
+    }
+
+    return sum;
+}
+
+static void Gf2MatrixSquare(u32* square, const u32* mat)
+{
+    for (size_t i = 0; i < 32; i++)
+        square[i] = Gf2MatrixTimes(mat, mat[i]);
+}
+
+// operator appending len zero bytes to a crc, len is a power of two
+static void Crc32cZerosOp(u32* even, size_t len)
+{
+    u32 odd[32];
+
+    // one zero bit
+    odd[0] = Crc32cPoly;
+    for (size_t i = 1; i < 32; i++)
+        odd[i] = 1U << (i - 1);
+
+    // two, then four zero bits
+    Gf2MatrixSquare(even, odd);
+    Gf2MatrixSquare(odd, even);
+
+    // squares until len bytes, alternating between the two
+    for (;;)
+    {
+        Gf2MatrixSquare(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+
+        Gf2MatrixSquare(odd, even);
+        len >>= 1;
+        if (len == 0)
+            break;
+    }
+
+    for (size_t i = 0; i < 32; i++)
+        even[i] = odd[i];
+}
+
+static void Crc32cZeros(u32 zeros[4][256], size_t len)
+{
+    u32 op[32];
+    Crc32cZerosOp(op, len);
+
+    for (u32 i = 0; i < 256; i++)
+    {
+        zeros[0][i] = Gf2MatrixTimes(op, i);
+        zeros[1][i] = Gf2MatrixTimes(op, i << 8);
+        zeros[2][i] = Gf2MatrixTimes(op, i << 16);
+        zeros[3][i] = Gf2MatrixTimes(op, i << 24);
+    }
+}
+
+static inline u32 Crc32cShift(u32 zeros[4][256], u32 crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+        zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+// three streams over 3 * block bytes at p, one per block
+static inline u64 Crc32cStreams(u64 crc0, const u8*& p, size_t block, u32 zeros[4][256])
+{
+    u64 crc1 = 0, crc2 = 0;
+    const u8* end = p + block;
+    do {
+        crc0 = Crc32Quad(crc0, *reinterpret_cast<const UnalignedU64*>(p));
+        crc1 = Crc32Quad(crc1, *reinterpret_cast<const UnalignedU64*>(p + block));
+        crc2 = Crc32Quad(crc2, *reinterpret_cast<const UnalignedU64*>(p + 2 * block));
+        p += 8;
+    } while (p < end);
+
+    crc0 = Crc32cShift(zeros, static_cast<u32>(crc0)) ^ crc1;
+    crc0 = Crc32cShift(zeros, static_cast<u32>(crc0)) ^ crc2;
+    p += 2 * block;
+    return crc0;
+}
+
+static u32 Crc32cHw(u32 crc, const u8* p, size_t len)
+{
+    u64 crc0 = crc;
+
+    // up to seven bytes to align the quad loads
+    while (len != 0 && (reinterpret_cast<ulong>(p) & 7) != 0)
+    {
+        crc0 = Crc32Byte(static_cast<u32>(crc0), *p++);
+        len--;
+    }
+
+    while (len >= 3 * Crc32cLong)
+    {
+        crc0 = Crc32cStreams(crc0, p, Crc32cLong, Crc32cLongZeros);
+        len -= 3 * Crc32cLong;
+    }
+
+    while (len >= 3 * Crc32cShort)
+    {
+        crc0 = Crc32cStreams(crc0, p, Crc32cShort, Crc32cShortZeros);
+        len -= 3 * Crc32cShort;
+    }
+
+    for (; len >= 8; len -= 8, p += 8)
+        crc0 = Crc32Quad(crc0, *reinterpret_cast<const UnalignedU64*>(p));
+
+    for (; len != 0; len--)
+        crc0 = Crc32Byte(static_cast<u32>(crc0), *p++);
+
+    return static_cast<u32>(crc0);
+}
+
+static inline u64 WyMix(u64 a, u64 b)
+{
+    unsigned __int128 r = a;
+    r *= b;
+    return static_cast<u64>(r) ^ static_cast<u64>(r >> 64);
+}
+
+static inline u64 WyRead8(const u8* p)
+{
+    return *reinterpret_cast<const UnalignedU64*>(p);
+}
+
+static inline u64 WyRead4(const u8* p)
+{
+    return *reinterpret_cast<const UnalignedU32*>(p);
+}
+
+static const u64 WySecret[4] = { 0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL };
+
+void ChecksumSetup()
+{
+    u32 eax, ebx, ecx, edx;
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CpuidSse42))
+        return;
+
+    Crc32cZeros(Crc32cLongZeros, Crc32cLong);
+    Crc32cZeros(Crc32cShortZeros, Crc32cShort);
+    UseCrc32cHw = true;
+}
+
+bool Crc32cIsHw()
+{
+    return UseCrc32cHw;
+}
+
+u32 Crc32c(u32 crc, const void* buf, size_t len)
+{
+    const u8* p = static_cast<const u8*>(buf);
+
+    crc = ~crc;
+    crc = UseCrc32cHw ? Crc32cHw(crc, p, len) : Crc32cSw(crc, p, len);
+    return ~crc;
+}
+
+u32 InetSum(u32 sum, const void* buf, size_t len)
+{
+    const u8* p = static_cast<const u8*>(buf);
+
+    // 32 bit halves of quad loads into 64 bit sums, no carry is lost
+    // below 2^32 quads
+    u64 sum0 = sum, sum1 = 0;
+    for (; len >= 32; len -= 32, p += 32)
+    {
+        u64 q0 = *reinterpret_cast<const UnalignedU64*>(p);
+        u64 q1 = *reinterpret_cast<const UnalignedU64*>(p + 8);
+        u64 q2 = *reinterpret_cast<const UnalignedU64*>(p + 16);
+        u64 q3 = *reinterpret_cast<const UnalignedU64*>(p + 24);
+        sum0 += (q0 & 0xffffffff) + (q0 >> 32) + (q1 & 0xffffffff) + (q1 >> 32);
+        sum1 += (q2 & 0xffffffff) + (q2 >> 32) + (q3 & 0xffffffff) + (q3 >> 32);
+    }
+
+    for (; len >= 4; len -= 4, p += 4)
+        sum0 += *reinterpret_cast<const UnalignedU32*>(p);
+
+    if (len >= 2)
+    {
+        sum0 += *reinterpret_cast<const UnalignedU16*>(p);
+        len -= 2;
+        p += 2;
+    }
+
+    // the odd byte is the high half of a network order word
+    if (len != 0)
+        sum0 += *p;
+
+    sum0 += sum1;
+    sum0 = (sum0 & 0xffffffff) + (sum0 >> 32);
+    sum0 = (sum0 & 0xffffffff) + (sum0 >> 32);
+    return static_cast<u32>(sum0);
+}
+
+u16 InetFold(u32 sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<u16>(~sum);
+}
+
+u16 InetChecksum(const void* buf, size_t len)
+{
+    return InetFold(InetSum(0, buf, len));
+}
+
+u64 Hash64(const void* buf, size_t len, u64 seed)
+{
+    const u8* p = static_cast<const u8*>(buf);
+    u64 a, b;
+
+    seed ^= WyMix(seed ^ WySecret[0], WySecret[1]);
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // two overlapping pairs of 4 byte reads cover 4..16 bytes
+            a = (WyRead4(p) << 32) | WyRead4(p + ((len >> 3) << 2));
+            b = (WyRead4(p + len - 4) << 32) | WyRead4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = (static_cast<u64>(p[0]) << 16) | (static_cast<u64>(p[len >> 1]) << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i >= 48)
+        {
+            u64 seed1 = seed, seed2 = seed;
+            do {
+                seed = WyMix(WyRead8(p) ^ WySecret[1], WyRead8(p + 8) ^ seed);
+                seed1 = WyMix(WyRead8(p + 16) ^ WySecret[2], WyRead8(p + 24) ^ seed1);
+                seed2 = WyMix(WyRead8(p + 32) ^ WySecret[3], WyRead8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= seed1 ^ seed2;
+        }
+
+        for (; i > 16; i -= 16, p += 16)
+            seed = WyMix(WyRead8(p) ^ WySecret[1], WyRead8(p + 8) ^ seed);
+
+        a = WyRead8(p + i - 16);
+        b = WyRead8(p + i - 8);
+    }
+
+    a ^= WySecret[1];
+    b ^= seed;
+    unsigned __int128 r = a;
+    r *= b;
+    a = static_cast<u64>(r);
+    b = static_cast<u64>(r >> 64);
+    return WyMix(a ^ WySecret[0] ^ len, b ^ WySecret[1]);
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Stdlib
+{
+
+// picks the crc32c implementation from cpuid, the portable one runs until
+// then
+void ChecksumSetup();
+
+// true once ChecksumSetup found the sse4.2 crc32 instruction
+bool Crc32cIsHw();
+
+// crc32c (castagnoli) of buf, pass the previous result as crc to continue
+// over several buffers, 0 to start
+u32 Crc32c(u32 crc, const void* buf, size_t len);
+
+// ones' complement sum of buf for the ip/tcp/udp checksums, pass the
+// previous result as sum to continue, every buffer but the last must have
+// an even length
+u32 InetSum(u32 sum, const void* buf, size_t len);
+
+// folds a sum to the checksum as stored in the header, in network order
+u16 InetFold(u32 sum);
+
+u16 InetChecksum(const void* buf, size_t len);
+
+// fast non cryptographic hash for hash tables, wyhash style
+u64 Hash64(const void* buf, size_t len, u64 seed = 0);
+
+}
@@ -0,0 +1,654 @@
+#pragma once
+
+#include "bplus_tree.h"
+#include "allocator.h"
+
+#include <include/const.h>
+#include <kernel/atomic.h>
+#include <kernel/asm.h>
+#include <kernel/trace.h>
+#include <kernel/panic.h>
+
+namespace Stdlib
+{
+
+// B+tree shared across cpus with optimistic lock coupling: every node has a
+// version lock, readers only read versions and restart if a node changed
+// under them, writers lock just the nodes they modify (parent then child).
+// Delete doesn't merge nodes and no node is freed before Clear, so a reader
+// never dereferences freed memory; Clear and Check need a quiescent tree.
+template<typename K, typename V, size_t NodeSize = 4 * Const::CacheLineSize,
+    typename Allocator = DefaultAllocator>
+class ConcurrentBplusTree
+{
+public:
+    ConcurrentBplusTree()
+        : Root(0)
+        , Count(0)
+    {
+        Trace(BplusTreeLL, "tree 0x%p ctor", this);
+    }
+
+    explicit ConcurrentBplusTree(const Allocator& allocator)
+        : ConcurrentBplusTree()
+    {
+        Alloc = allocator;
+    }
+
+    virtual ~ConcurrentBplusTree()
+    {
+        Trace(BplusTreeLL, "tree 0x%p dtor", this);
+        Clear();
+    }
+
+    bool Insert(const K& key, const V& value)
+    {
+        for (;;)
+        {
+            if (GetRoot() == nullptr && !CreateRoot())
+                return false;
+
+            Result result = TryInsert(key, value);
+            if (result != Restart)
+                return (result == Done) ? true : false;
+        }
+    }
+
+    bool Delete(const K& key)
+    {
+        for (;;)
+        {
+            if (GetRoot() == nullptr)
+                return false;
+
+            Result result = TryDelete(key);
+            if (result != Restart)
+                return (result == Done) ? true : false;
+        }
+    }
+
+    V Lookup(const K& key, bool& exist)
+    {
+        for (;;)
+        {
+            exist = false;
+            if (GetRoot() == nullptr)
+                return V();
+
+            InnerNode* parent;
+            ulong parentVersion, version;
+            LeafNode* leaf = FindLeaf(key, parent, parentVersion, version);
+            if (leaf == nullptr)
+                continue;
+
+            size_t count = Stdlib::Min<size_t>(leaf->Count, LeafMax);
+            size_t pos = LowerBound(leaf->Key, count, key);
+            bool found = (pos < count && !(key < leaf->Key[pos])) ? true : false;
+            V value = found ? leaf->Value[pos] : V();
+            if (!ReadUnlock(leaf, version))
+                continue;
+
+            exist = found;
+            return value;
+        }
+    }
+
+    // calls func(key, value) in key order for low <= key <= high while it
+    // returns true, entries are copied out of a validated leaf before the calls
+    template<typename Func>
+    size_t Scan(const K& low, const K& high, Func func)
+    {
+        LeafNode* leaf;
+        ulong version;
+        for (;;)
+        {
+            if (GetRoot() == nullptr)
+                return 0;
+
+            InnerNode* parent;
+            ulong parentVersion;
+            leaf = FindLeaf(low, parent, parentVersion, version);
+            if (leaf != nullptr)
+                break;
+        }
+
+        K key[LeafMax];
+        V value[LeafMax];
+        K last = low;
+        bool started = false;
+        size_t calls = 0;
+
+        for (;;)
+        {
+            size_t count = Stdlib::Min<size_t>(leaf->Count, LeafMax);
+            size_t taken = 0;
+            bool end = false;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (leaf->Key[i] < low || (started && !(last < leaf->Key[i])))
+                    continue;
+
+                if (high < leaf->Key[i])
+                {
+                    end = true;
+                    break;
+                }
+
+                key[taken] = leaf->Key[i];
+                value[taken] = leaf->Value[i];
+                taken++;
+            }
+            LeafNode* next = leaf->Next;
+
+            if (!ReadUnlock(leaf, version))
+            {
+                // a split only moves entries to leaf->Next, so reread the leaf
+                bool restart;
+                do
+                {
+                    restart = false;
+                    version = ReadLock(leaf, restart);
+                } while (restart);
+                continue;
+            }
+
+            for (size_t i = 0; i < taken; i++)
+            {
+                calls++;
+                if (!func(key[i], value[i]))
+                    return calls;
+                last = key[i];
+                started = true;
+            }
+
+            if (end || next == nullptr)
+                break;
+
+            bool restart;
+            do
+            {
+                restart = false;
+                version = ReadLock(next, restart);
+            } while (restart);
+            leaf = next;
+        }
+
+        return calls;
+    }
+
+    size_t GetCount()
+    {
+        return Count.Get();
+    }
+
+    bool Check()
+    {
+        Node* root = GetRoot();
+        if (root == nullptr)
+            return (Count.Get() == 0) ? true : false;
+
+        LeafNode* prevLeaf = nullptr;
+        size_t count = 0, height = 0;
+        if (!CheckNode(root, 1, height, nullptr, nullptr, prevLeaf, count))
+            return false;
+
+        if (prevLeaf->Next != nullptr || count != static_cast<size_t>(Count.Get()))
+        {
+            Trace(BplusTreeLL, "tree 0x%p count %lu expected %lu", this, count, Count.Get());
+            return false;
+        }
+
+        return true;
+    }
+
+    void Clear()
+    {
+        Node* root = GetRoot();
+        if (root != nullptr)
+            FreeNode(root);
+
+        Root.Set(0);
+        Count.Set(0);
+    }
+
+private:
+    ConcurrentBplusTree(const ConcurrentBplusTree& other) = delete;
+    ConcurrentBplusTree(ConcurrentBplusTree&& other) = delete;
+    ConcurrentBplusTree& operator=(const ConcurrentBplusTree& other) = delete;
+    ConcurrentBplusTree& operator=(ConcurrentBplusTree&& other) = delete;
+
+    static_assert(__is_trivially_copyable(K) && __is_trivially_copyable(V),
+        "Optimistic readers copy keys and values racily");
+
+    // version grows by LockedBit twice per write, bit 0 is reserved
+    static const ulong LockedBit = 2;
+
+    struct Node
+    {
+        Kernel::Atomic Version;
+        u32 Count;
+        bool Leaf;
+    };
+
+    static const size_t InnerMax = (NodeSize - 4 * sizeof(ulong)) / (sizeof(K) + sizeof(void*));
+    static const size_t LeafMax = (NodeSize - 4 * sizeof(ulong)) / (sizeof(K) + sizeof(V));
+
+    struct InnerNode : public Node
+    {
+        K Key[InnerMax];
+        Node* Child[InnerMax + 1];
+    };
+
+    struct LeafNode : public Node
+    {
+        K Key[LeafMax];
+        V Value[LeafMax];
+        LeafNode* Next;
+    };
+
+    static_assert(InnerMax >= 4 && LeafMax >= 4, "Node size too small");
+    static_assert(sizeof(InnerNode) <= NodeSize && sizeof(LeafNode) <= NodeSize, "Invalid node size");
+
+    enum Result
+    {
+        Done,
+        Failed,
+        Restart,
+    };
+
+    static ulong ReadLock(Node* node, bool& restart)
+    {
+        ulong version = node->Version.Get();
+        if (version & LockedBit)
+        {
+            Pause();
+            restart = true;
+        }
+        return version;
+    }
+
+    static bool ReadUnlock(Node* node, ulong version)
+    {
+        // keep the reads of the node before the version check, as SeqCount does
+        Barrier();
+        return (static_cast<ulong>(node->Version.Get()) == version) ? true : false;
+    }
+
+    static bool UpgradeLock(Node* node, ulong version)
+    {
+        return (static_cast<ulong>(node->Version.Cmpxchg(version + LockedBit, version)) == version) ? true : false;
+    }
+
+    static void WriteUnlock(Node* node)
+    {
+        node->Version.ReadAndAdd(LockedBit);
+    }
+
+    static InnerNode* AsInner(Node* node)
+    {
+        return static_cast<InnerNode*>(node);
+    }
+
+    static LeafNode* AsLeaf(Node* node)
+    {
+        return static_cast<LeafNode*>(node);
+    }
+
+    Node* GetRoot()
+    {
+        return reinterpret_cast<Node*>(Root.Get());
+    }
+
+    LeafNode* NewLeaf()
+    {
+        LeafNode* leaf = Stdlib::New<LeafNode>(Alloc);
+        if (leaf == nullptr)
+            return nullptr;
+
+        leaf->Version.Set(0);
+        leaf->Count = 0;
+        leaf->Leaf = true;
+        leaf->Next = nullptr;
+        return leaf;
+    }
+
+    InnerNode* NewInner()
+    {
+        InnerNode* inner = Stdlib::New<InnerNode>(Alloc);
+        if (inner == nullptr)
+            return nullptr;
+
+        inner->Version.Set(0);
+        inner->Count = 0;
+        inner->Leaf = false;
+        for (size_t i = 0; i < InnerMax + 1; i++)
+        {
+            inner->Child[i] = nullptr;
+        }
+        return inner;
+    }
+
+    void FreeNode(Node* node)
+    {
+        if (node->Leaf)
+        {
+            Stdlib::Delete(Alloc, AsLeaf(node));
+            return;
+        }
+
+        InnerNode* inner = AsInner(node);
+        for (size_t i = 0; i <= inner->Count; i++)
+        {
+            FreeNode(inner->Child[i]);
+        }
+        Stdlib::Delete(Alloc, inner);
+    }
+
+    bool CreateRoot()
+    {
+        LeafNode* leaf = NewLeaf();
+        if (leaf == nullptr)
+            return false;
+
+        if (Root.Cmpxchg(reinterpret_cast<long>(leaf), 0) != 0)
+            Stdlib::Delete(Alloc, leaf);
+
+        return true;
+    }
+
+    // optimistic descent, returns nullptr if it has to restart; the parent
+    // and the leaf versions are valid for what was read on the way
+    LeafNode* FindLeaf(const K& key, InnerNode*& parent, ulong& parentVersion, ulong& version)
+    {
+        bool restart = false;
+        Node* node = GetRoot();
+        version = ReadLock(node, restart);
+        if (restart || node != GetRoot())
+            return nullptr;
+
+        parent = nullptr;
+        parentVersion = 0;
+        while (!node->Leaf)
+        {
+            InnerNode* inner = AsInner(node);
+            size_t index = UpperBound(inner->Key, Stdlib::Min<size_t>(inner->Count, InnerMax), key);
+            Node* child = inner->Child[index];
+            if (!ReadUnlock(inner, version) || child == nullptr)
+                return nullptr;
+
+            ulong childVersion = ReadLock(child, restart);
+            if (restart || !ReadUnlock(inner, version))
+                return nullptr;
+
+            parent = inner;
+            parentVersion = version;
+            node = child;
+            version = childVersion;
+        }
+
+        return AsLeaf(node);
+    }
+
+    // splits a full node under the parent lock, the caller restarts after it
+    Result SplitNode(Node* node, ulong version, InnerNode* parent, ulong parentVersion, size_t index)
+    {
+        if (parent != nullptr && !UpgradeLock(parent, parentVersion))
+            return Restart;
+
+        if (!UpgradeLock(node, version))
+        {
+            if (parent != nullptr)
+                WriteUnlock(parent);
+            return Restart;
+        }
+
+        if (parent == nullptr && node != GetRoot())
+        {
+            WriteUnlock(node);
+            return Restart;
+        }
+
+        Node* right = node->Leaf ? static_cast<Node*>(NewLeaf()) : static_cast<Node*>(NewInner());
+        InnerNode* root = (parent == nullptr) ? NewInner() : nullptr;
+        if (right == nullptr || (parent == nullptr && root == nullptr))
+        {
+            // right has no children yet, so it can't go through FreeNode
+            if (right != nullptr && right->Leaf)
+                Stdlib::Delete(Alloc, AsLeaf(right));
+            else if (right != nullptr)
+                Stdlib::Delete(Alloc, AsInner(right));
+            if (root != nullptr)
+                Stdlib::Delete(Alloc, root);
+            WriteUnlock(node);
+            if (parent != nullptr)
+                WriteUnlock(parent);
+            return Failed;
+        }
+
+        K sep;
+        if (node->Leaf)
+        {
+            LeafNode* leaf = AsLeaf(node);
+            LeafNode* rightLeaf = AsLeaf(right);
+            size_t split = LeafMax / 2;
+            for (size_t i = split; i < LeafMax; i++)
+            {
+                rightLeaf->Key[i - split] = leaf->Key[i];
+                rightLeaf->Value[i - split] = leaf->Value[i];
+            }
+            rightLeaf->Count = LeafMax - split;
+            rightLeaf->Next = leaf->Next;
+            leaf->Next = rightLeaf;
+            leaf->Count = split;
+            sep = rightLeaf->Key[0];
+        }
+        else
+        {
+            InnerNode* inner = AsInner(node);
+            InnerNode* rightInner = AsInner(right);
+            size_t mid = InnerMax / 2;
+            for (size_t i = mid + 1; i < InnerMax; i++)
+            {
+                rightInner->Key[i - mid - 1] = inner->Key[i];
+                rightInner->Child[i - mid - 1] = inner->Child[i];
+            }
+            rightInner->Child[InnerMax - mid - 1] = inner->Child[InnerMax];
+            rightInner->Count = InnerMax - mid - 1;
+            inner->Count = mid;
+            sep = inner->Key[mid];
+        }
+
+        if (parent != nullptr)
+        {
+            for (size_t i = parent->Count; i > index; i--)
+            {
+                parent->Key[i] = parent->Key[i - 1];
+                parent->Child[i + 1] = parent->Child[i];
+            }
+            parent->Key[index] = sep;
+            parent->Child[index + 1] = right;
+            parent->Count++;
+            WriteUnlock(node);
+            WriteUnlock(parent);
+        }
+        else
+        {
+            root->Key[0] = sep;
+            root->Child[0] = node;
+            root->Child[1] = right;
+            root->Count = 1;
+            Root.Set(reinterpret_cast<long>(root));
+            WriteUnlock(node);
+        }
+
+        return Restart;
+    }
+
+    // splits full nodes on the way down, so a leaf insert never propagates
+    Result TryInsert(const K& key, const V& value)
+    {
+        bool restart = false;
+        Node* node = GetRoot();
+        ulong version = ReadLock(node, restart);
+        if (restart || node != GetRoot())
+            return Restart;
+
+        InnerNode* parent = nullptr;
+        ulong parentVersion = 0;
+        size_t index = 0;
+        for (;;)
+        {
+            size_t max = node->Leaf ? LeafMax : InnerMax;
+            if (node->Count >= max)
+            {
+                Result result = SplitNode(node, version, parent, parentVersion, index);
+                return (result == Failed) ? Failed : Restart;
+            }
+
+            if (node->Leaf)
+                break;
+
+            if (parent != nullptr && !ReadUnlock(parent, parentVersion))
+                return Restart;
+
+            InnerNode* inner = AsInner(node);
+            index = UpperBound(inner->Key, Stdlib::Min<size_t>(inner->Count, InnerMax), key);
+            Node* child = inner->Child[index];
+            if (!ReadUnlock(inner, version) || child == nullptr)
+                return Restart;
+
+            parent = inner;
+            parentVersion = version;
+            node = child;
+            version = ReadLock(node, restart);
+            if (restart)
+                return Restart;
+        }
+
+        LeafNode* leaf = AsLeaf(node);
+        if (!UpgradeLock(leaf, version))
+            return Restart;
+
+        if (parent != nullptr && !ReadUnlock(parent, parentVersion))
+        {
+            WriteUnlock(leaf);
+            return Restart;
+        }
+
+        size_t pos = LowerBound(leaf->Key, static_cast<size_t>(leaf->Count), key);
+        if (pos < leaf->Count && !(key < leaf->Key[pos]))
+        {
+            WriteUnlock(leaf);
+            return Failed;
+        }
+
+        for (size_t i = leaf->Count; i > pos; i--)
+        {
+            leaf->Key[i] = leaf->Key[i - 1];
+            leaf->Value[i] = leaf->Value[i - 1];
+        }
+        leaf->Key[pos] = key;
+        leaf->Value[pos] = value;
+        leaf->Count++;
+        WriteUnlock(leaf);
+
+        Count.Inc();
+        return Done;
+    }
+
+    Result TryDelete(const K& key)
+    {
+        InnerNode* parent;
+        ulong parentVersion, version;
+        LeafNode* leaf = FindLeaf(key, parent, parentVersion, version);
+        if (leaf == nullptr)
+            return Restart;
+
+        if (!UpgradeLock(leaf, version))
+            return Restart;
+
+        if (parent != nullptr && !ReadUnlock(parent, parentVersion))
+        {
+            WriteUnlock(leaf);
+            return Restart;
+        }
+
+        size_t pos = LowerBound(leaf->Key, static_cast<size_t>(leaf->Count), key);
+        if (pos == leaf->Count || key < leaf->Key[pos])
+        {
+            WriteUnlock(leaf);
+            return Failed;
+        }
+
+        for (size_t i = pos + 1; i < leaf->Count; i++)
+        {
+            leaf->Key[i - 1] = leaf->Key[i];
+            leaf->Value[i - 1] = leaf->Value[i];
+        }
+        leaf->Count--;
+        WriteUnlock(leaf);
+
+        Count.Dec();
+        return Done;
+    }
+
+    // keys of the subtree must be in [low, high), leaves may be empty
+    bool CheckNode(Node* node, size_t level, size_t& height, const K* low, const K* high,
+        LeafNode*& prevLeaf, size_t& count)
+    {
+        const K* keys = node->Leaf ? AsLeaf(node)->Key : AsInner(node)->Key;
+        size_t max = node->Leaf ? LeafMax : InnerMax;
+
+        if (node->Count > max || (!node->Leaf && node->Count == 0) || (node->Version.Get() & LockedBit))
+        {
+            Trace(BplusTreeLL, "node 0x%p count %lu", node, (ulong)node->Count);
+            return false;
+        }
+
+        for (size_t i = 0; i < node->Count; i++)
+        {
+            if ((i > 0 && !(keys[i - 1] < keys[i])) ||
+                (low != nullptr && keys[i] < *low) ||
+                (high != nullptr && !(keys[i] < *high)))
+            {
+                Trace(BplusTreeLL, "node 0x%p key %lu out of order", node, i);
+                return false;
+            }
+        }
+
+        if (node->Leaf)
+        {
+            LeafNode* leaf = AsLeaf(node);
+            if (height == 0)
+                height = level;
+
+            if (level != height || (prevLeaf != nullptr && prevLeaf->Next != leaf))
+            {
+                Trace(BplusTreeLL, "leaf 0x%p invalid link", leaf);
+                return false;
+            }
+
+            prevLeaf = leaf;
+            count += leaf->Count;
+            return true;
+        }
+
+        InnerNode* inner = AsInner(node);
+        for (size_t i = 0; i <= inner->Count; i++)
+        {
+            const K* childLow = (i > 0) ? &inner->Key[i - 1] : low;
+            const K* childHigh = (i < inner->Count) ? &inner->Key[i] : high;
+            if (inner->Child[i] == nullptr ||
+                !CheckNode(inner->Child[i], level + 1, height, childLow, childHigh, prevLeaf, count))
+                return false;
+        }
+
+        return true;
+    }
+
+    Kernel::Atomic Root;
+    Kernel::Atomic Count;
+    Allocator Alloc;
+};
+
+}
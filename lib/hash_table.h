@@ -0,0 +1,446 @@
+#pragma once
+
+#include "stdlib.h"
+#include "lock.h"
+#include "allocator.h"
+
+#include <kernel/atomic.h>
+#include <kernel/panic.h>
+
+namespace Stdlib
+{
+
+template<typename K>
+struct Hasher
+{
+    size_t operator()(const K& key) const
+    {
+        return Mix64(static_cast<u64>(key));
+    }
+};
+
+template<typename T>
+struct Hasher<T*>
+{
+    size_t operator()(T* key) const
+    {
+        return Mix64(reinterpret_cast<ulong>(key));
+    }
+};
+
+// Chained hash table with striped locks: a key hashes to stripe
+// hash % StripeCount and bucket hash % bucket count. Bucket counts are powers
+// of two and multiples of StripeCount, so a bucket and every bucket it splits
+// into on resize belong to one stripe. Resize is incremental: the old bucket
+// array is kept and each write moves a few of its buckets to the new array,
+// lookups check both until the old one is drained. Only installing and
+// dropping a bucket array takes all stripes. LockType needs shared locking
+// and Allocator arbitrary sizes (nodes and bucket arrays).
+template<typename K, typename V, typename LockType = NopLock,
+    typename Allocator = DefaultAllocator, size_t StripeCount = 16>
+class HashTable
+{
+public:
+    HashTable()
+        : Bucket(nullptr)
+        , BucketCount(0)
+        , OldBucket(nullptr)
+        , OldBucketCount(0)
+    {
+        for (size_t i = 0; i < StripeCount; i++)
+            MigrateCursor[i] = 0;
+    }
+
+    explicit HashTable(const Allocator& allocator)
+        : HashTable()
+    {
+        Alloc = allocator;
+    }
+
+    virtual ~HashTable()
+    {
+        Clear();
+        if (Bucket != nullptr)
+            Alloc.Free(Bucket);
+        if (OldBucket != nullptr)
+            Alloc.Free(OldBucket);
+    }
+
+    bool Insert(const K& key, const V& value)
+    {
+        return InsertInternal(key, value, false);
+    }
+
+    // inserts the key or replaces the value of an existing one, fails only
+    // on allocation failure
+    bool InsertOrAssign(const K& key, const V& value)
+    {
+        return InsertInternal(key, value, true);
+    }
+
+    bool Remove(const K& key)
+    {
+        size_t hash = Hash(key);
+        Node* node = nullptr;
+        bool resizing = false, drained = false;
+        {
+            AutoLock lock(StripeLock[hash % StripeCount]);
+            if (BucketCount == 0)
+                return false;
+
+            resizing = (OldBucket != nullptr);
+            MigrateKeyBucket(hash);
+            Node** link = &Bucket[hash & (BucketCount - 1)];
+            for (; *link != nullptr; link = &(*link)->Next)
+            {
+                if ((*link)->Hash == hash && (*link)->Key == key)
+                {
+                    node = *link;
+                    *link = node->Next;
+                    Count.Dec();
+                    break;
+                }
+            }
+        }
+
+        if (resizing)
+            drained = MigrateStep();
+
+        if (drained)
+            DropOldBucket();
+
+        if (node == nullptr)
+            return false;
+
+        Delete(Alloc, node);
+        return true;
+    }
+
+    bool Lookup(const K& key, V& value)
+    {
+        return Find(key, [&value](V& found) { value = found; });
+    }
+
+    // calls func(value) under the stripe lock, e.g. to take a reference
+    template<typename Func>
+    bool Find(const K& key, Func func)
+    {
+        size_t hash = Hash(key);
+        SharedAutoLock lock(StripeLock[hash % StripeCount]);
+        if (BucketCount == 0)
+            return false;
+
+        Node* node = FindNode(Bucket[hash & (BucketCount - 1)], hash, key);
+        if (node == nullptr && OldBucket != nullptr)
+            node = FindNode(OldBucket[hash & (OldBucketCount - 1)], hash, key);
+
+        if (node == nullptr)
+            return false;
+
+        func(node->Value);
+        return true;
+    }
+
+    // calls func(key, value) for every entry, one stripe lock at a time
+    template<typename Func>
+    void ForEach(Func func)
+    {
+        for (size_t s = 0; s < StripeCount; s++)
+        {
+            SharedAutoLock lock(StripeLock[s]);
+            for (size_t i = s; i < BucketCount; i += StripeCount)
+                for (Node* node = Bucket[i]; node != nullptr; node = node->Next)
+                    func(node->Key, node->Value);
+
+            for (size_t i = s; i < OldBucketCount; i += StripeCount)
+                for (Node* node = OldBucket[i]; node != nullptr; node = node->Next)
+                    func(node->Key, node->Value);
+        }
+    }
+
+    // detaches every entry and calls func(key, value) on it without locks
+    // held before freeing it
+    template<typename Func>
+    void Clear(Func func)
+    {
+        Node* list = nullptr;
+        ulong flags[StripeCount];
+        LockAll(flags);
+        for (size_t i = 0; i < BucketCount; i++)
+            list = Detach(Bucket[i], list);
+        for (size_t i = 0; i < OldBucketCount; i++)
+            list = Detach(OldBucket[i], list);
+        Count.Set(0);
+        UnlockAll(flags);
+
+        while (list != nullptr)
+        {
+            Node* next = list->Next;
+            func(list->Key, list->Value);
+            Delete(Alloc, list);
+            list = next;
+        }
+    }
+
+    void Clear()
+    {
+        Clear([](const K& key, V& value) { (void)key; (void)value; });
+    }
+
+    size_t GetCount()
+    {
+        return static_cast<size_t>(Count.Get());
+    }
+
+    size_t GetBucketCount()
+    {
+        SharedAutoLock lock(StripeLock[0]);
+        return BucketCount;
+    }
+
+    bool IsResizing()
+    {
+        SharedAutoLock lock(StripeLock[0]);
+        return (OldBucket != nullptr) ? true : false;
+    }
+
+private:
+    HashTable(const HashTable& other) = delete;
+    HashTable(HashTable&& other) = delete;
+    HashTable& operator=(const HashTable& other) = delete;
+    HashTable& operator=(HashTable&& other) = delete;
+
+    static_assert(StripeCount != 0 && (StripeCount & (StripeCount - 1)) == 0, "Invalid stripe count");
+
+    static const size_t InitialBucketCount = 4 * StripeCount;
+    // old buckets moved by every write while resizing
+    static const size_t MigrateBatch = 4;
+
+    struct Node
+    {
+        Node(const K& key, const V& value, size_t hash)
+            : Next(nullptr)
+            , Hash(hash)
+            , Key(key)
+            , Value(value)
+        {
+        }
+
+        Node* Next;
+        size_t Hash;
+        K Key;
+        V Value;
+    };
+
+    size_t Hash(const K& key)
+    {
+        return Hasher<K>()(key);
+    }
+
+    bool InsertInternal(const K& key, const V& value, bool assign)
+    {
+        size_t hash = Hash(key);
+        Node* node = New<Node>(Alloc, key, value, hash);
+        if (node == nullptr)
+            return false;
+
+        for (;;)
+        {
+            bool inserted = false, exist = false, grow = false;
+            bool resizing = false, drained = false;
+            size_t observedCount = 0;
+            {
+                AutoLock lock(StripeLock[hash % StripeCount]);
+                observedCount = BucketCount;
+                if (BucketCount != 0)
+                {
+                    resizing = (OldBucket != nullptr);
+                    MigrateKeyBucket(hash);
+                    Node** head = &Bucket[hash & (BucketCount - 1)];
+                    Node* found = FindNode(*head, hash, key);
+                    if (found != nullptr)
+                    {
+                        exist = true;
+                        if (assign)
+                            found->Value = value;
+                    }
+                    else
+                    {
+                        node->Next = *head;
+                        *head = node;
+                        inserted = true;
+                        Count.Inc();
+                    }
+                    grow = (!resizing && static_cast<size_t>(Count.Get()) > BucketCount);
+                }
+            }
+
+            if (observedCount == 0)
+            {
+                if (!Grow(0))
+                {
+                    Delete(Alloc, node);
+                    return false;
+                }
+                continue;
+            }
+
+            if (OldBucket != nullptr)
+                drained = MigrateStep();
+
+            if (drained)
+                DropOldBucket();
+
+            // a failed resize keeps the table usable at a higher load
+            if (grow)
+                Grow(observedCount);
+
+            if (!inserted)
+                Delete(Alloc, node);
+
+            return (inserted || (exist && assign)) ? true : false;
+        }
+    }
+
+    static Node* FindNode(Node* node, size_t hash, const K& key)
+    {
+        for (; node != nullptr; node = node->Next)
+        {
+            if (node->Hash == hash && node->Key == key)
+                return node;
+        }
+        return nullptr;
+    }
+
+    static Node* Detach(Node*& head, Node* list)
+    {
+        while (head != nullptr)
+        {
+            Node* node = head;
+            head = node->Next;
+            node->Next = list;
+            list = node;
+        }
+        return list;
+    }
+
+    // moves old bucket index to the new array, caller holds its stripe lock
+    void MigrateBucket(size_t index)
+    {
+        Node* node = OldBucket[index];
+        OldBucket[index] = nullptr;
+        while (node != nullptr)
+        {
+            Node* next = node->Next;
+            Node** head = &Bucket[node->Hash & (BucketCount - 1)];
+            node->Next = *head;
+            *head = node;
+            node = next;
+        }
+    }
+
+    // writes only touch the new array
+    void MigrateKeyBucket(size_t hash)
+    {
+        if (OldBucket != nullptr)
+            MigrateBucket(hash & (OldBucketCount - 1));
+    }
+
+    // moves the next old buckets of a rotating stripe, returns true once the
+    // last old bucket is moved
+    bool MigrateStep()
+    {
+        size_t s = static_cast<size_t>(MigrateStripe.ReadAndInc()) % StripeCount;
+        AutoLock lock(StripeLock[s]);
+        if (OldBucket == nullptr)
+            return false;
+
+        bool drained = false;
+        for (size_t n = 0; n < MigrateBatch && MigrateCursor[s] < OldBucketCount; n++)
+        {
+            MigrateBucket(MigrateCursor[s]);
+            MigrateCursor[s] += StripeCount;
+            if (OldPending.DecAndTest())
+                drained = true;
+        }
+        return drained;
+    }
+
+    void DropOldBucket()
+    {
+        ulong flags[StripeCount];
+        LockAll(flags);
+        Node** oldBucket = OldBucket;
+        OldBucket = nullptr;
+        OldBucketCount = 0;
+        UnlockAll(flags);
+
+        BugOn(oldBucket == nullptr);
+        if (oldBucket != nullptr)
+            Alloc.Free(oldBucket);
+    }
+
+    // installs a bucket array twice the observed size, or the initial one
+    bool Grow(size_t observedCount)
+    {
+        size_t newCount = (observedCount == 0) ? InitialBucketCount : 2 * observedCount;
+        Node** newBucket = static_cast<Node**>(Alloc.Alloc(newCount * sizeof(Node*)));
+        if (newBucket == nullptr)
+            return false;
+
+        for (size_t i = 0; i < newCount; i++)
+            newBucket[i] = nullptr;
+
+        bool installed = false;
+        ulong flags[StripeCount];
+        LockAll(flags);
+        if (BucketCount == observedCount && OldBucket == nullptr)
+        {
+            OldBucket = Bucket;
+            OldBucketCount = BucketCount;
+            Bucket = newBucket;
+            BucketCount = newCount;
+            if (OldBucket != nullptr)
+            {
+                for (size_t s = 0; s < StripeCount; s++)
+                    MigrateCursor[s] = s;
+                OldPending.Set(OldBucketCount);
+            }
+            installed = true;
+        }
+        UnlockAll(flags);
+
+        if (!installed)
+        {
+            Alloc.Free(newBucket);
+            // someone else installed the initial array
+            return (observedCount == 0) ? true : false;
+        }
+        return true;
+    }
+
+    void LockAll(ulong* flags)
+    {
+        for (size_t s = 0; s < StripeCount; s++)
+            StripeLock[s].Lock(flags[s]);
+    }
+
+    void UnlockAll(ulong* flags)
+    {
+        for (size_t s = StripeCount; s > 0; s--)
+            StripeLock[s - 1].Unlock(flags[s - 1]);
+    }
+
+    LockType StripeLock[StripeCount];
+    Node** Bucket;
+    size_t BucketCount;
+    Node** OldBucket;
+    size_t OldBucketCount;
+    size_t MigrateCursor[StripeCount];
+    Kernel::Atomic MigrateStripe;
+    Kernel::Atomic OldPending;
+    Kernel::Atomic Count;
+    Allocator Alloc;
+};
+
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "list_entry.h"
+#include <include/types.h>
+#include <kernel/panic.h>
+
+namespace Stdlib
+{
+
+// list of objects linked through a ListEntry member, e.g.
+// IntrusiveList<Task, &Task::ListEntry>. The list never allocates and never
+// owns the objects: the caller keeps them alive while they are linked.
+template <typename T, ListEntry T::*Member>
+class IntrusiveList final
+{
+public:
+
+    class Iterator final
+    {
+    public:
+        Iterator()
+            : CurrListEntry(nullptr)
+            , EndList(nullptr)
+        {
+        }
+
+        Iterator(IntrusiveList& list)
+            : CurrListEntry(list.ListHead.Flink)
+            , EndList(&list.ListHead)
+        {
+        }
+
+        T& Get()
+        {
+            BugOn(CurrListEntry == EndList);
+            return *IntrusiveList::ToObject(CurrListEntry);
+        }
+
+        bool IsValid()
+        {
+            return (CurrListEntry != nullptr && CurrListEntry != EndList);
+        }
+
+        void Next()
+        {
+            if (IsValid())
+            {
+                CurrListEntry = CurrListEntry->Flink;
+            }
+        }
+
+        // unlinks the current object and moves to the next one
+        T* Erase()
+        {
+            BugOn(!IsValid());
+
+            ListEntry* entry = CurrListEntry;
+            CurrListEntry = entry->Flink;
+            entry->RemoveInit();
+            return IntrusiveList::ToObject(entry);
+        }
+
+    private:
+        ListEntry* CurrListEntry;
+        ListEntry* EndList;
+    };
+
+    IntrusiveList()
+    {
+        ListHead.Init();
+    }
+
+    void AddHead(T* object)
+    {
+        ListHead.InsertHead(&(object->*Member));
+    }
+
+    void AddTail(T* object)
+    {
+        ListHead.InsertTail(&(object->*Member));
+    }
+
+    void AddTail(IntrusiveList&& other)
+    {
+        if (other.ListHead.IsEmpty())
+            return;
+
+        ListEntry* entry = other.ListHead.Flink;
+        other.ListHead.RemoveInit();
+        ListHead.AppendTail(entry);
+    }
+
+    // the object must be linked into this list
+    void Remove(T* object)
+    {
+        (object->*Member).RemoveInit();
+    }
+
+    T* Head()
+    {
+        BugOn(ListHead.IsEmpty());
+
+        return ToObject(ListHead.Flink);
+    }
+
+    T* Tail()
+    {
+        BugOn(ListHead.IsEmpty());
+
+        return ToObject(ListHead.Blink);
+    }
+
+    T* PopHead()
+    {
+        BugOn(ListHead.IsEmpty());
+
+        ListEntry* entry = ListHead.RemoveHead();
+        entry->Init();
+        return ToObject(entry);
+    }
+
+    T* PopTail()
+    {
+        BugOn(ListHead.IsEmpty());
+
+        ListEntry* entry = ListHead.RemoveTail();
+        entry->Init();
+        return ToObject(entry);
+    }
+
+    bool IsEmpty()
+    {
+        return ListHead.IsEmpty();
+    }
+
+    Iterator GetIterator()
+    {
+        return Iterator(*this);
+    }
+
+    size_t Count()
+    {
+        size_t count = 0;
+        for (auto it = GetIterator(); it.IsValid(); it.Next())
+        {
+            count++;
+        }
+        return count;
+    }
+
+    // unlinks every object, the objects themselves are left alone
+    void Clear()
+    {
+        while (!ListHead.IsEmpty())
+        {
+            ListHead.RemoveHead()->Init();
+        }
+    }
+
+    ~IntrusiveList()
+    {
+        Clear();
+    }
+
+private:
+    IntrusiveList(const IntrusiveList& other) = delete;
+    IntrusiveList(IntrusiveList&& other) = delete;
+    IntrusiveList& operator=(const IntrusiveList& other) = delete;
+    IntrusiveList& operator=(IntrusiveList&& other) = delete;
+
+    static T* ToObject(ListEntry* entry)
+    {
+        unsigned long offset = reinterpret_cast<unsigned long>(&(static_cast<T*>(nullptr)->*Member));
+        return reinterpret_cast<T*>(reinterpret_cast<unsigned long>(entry) - offset);
+    }
+
+    ListEntry ListHead;
+};
+
+}
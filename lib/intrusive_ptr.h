@@ -0,0 +1,109 @@
+#pragma once
+
+namespace Stdlib
+{
+
+// pointer to an object that counts its own references through Get and Put,
+// like Kernel::Object. There is no control block: copies touch only the
+// object, and the object frees itself in Put when the count drops to zero.
+template<typename T>
+class IntrusivePtr final
+{
+public:
+    IntrusivePtr()
+        : Object(nullptr)
+    {
+    }
+
+    // takes a new reference on the object
+    explicit IntrusivePtr(T* object)
+        : Object(object)
+    {
+        if (Object != nullptr)
+            Object->Get();
+    }
+
+    // adopts the reference the caller holds, e.g. of a freshly created object
+    static IntrusivePtr Attach(T* object)
+    {
+        IntrusivePtr ptr;
+        ptr.Object = object;
+        return ptr;
+    }
+
+    IntrusivePtr(const IntrusivePtr& other)
+        : IntrusivePtr(other.Object)
+    {
+    }
+
+    IntrusivePtr(IntrusivePtr&& other)
+        : Object(other.Object)
+    {
+        other.Object = nullptr;
+    }
+
+    IntrusivePtr& operator=(const IntrusivePtr& other)
+    {
+        if (this != &other)
+        {
+            if (other.Object != nullptr)
+                other.Object->Get();
+            Reset();
+            Object = other.Object;
+        }
+        return *this;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr&& other)
+    {
+        if (this != &other)
+        {
+            Reset();
+            Object = other.Object;
+            other.Object = nullptr;
+        }
+        return *this;
+    }
+
+    T* Get() const
+    {
+        return Object;
+    }
+
+    T& operator*() const
+    {
+        return *Object;
+    }
+
+    T* operator->() const
+    {
+        return Object;
+    }
+
+    void Reset()
+    {
+        if (Object != nullptr)
+        {
+            Object->Put();
+            Object = nullptr;
+        }
+    }
+
+    // hands the reference over to the caller
+    T* Detach()
+    {
+        T* object = Object;
+        Object = nullptr;
+        return object;
+    }
+
+    ~IntrusivePtr()
+    {
+        Reset();
+    }
+
+private:
+    T* Object;
+};
+
+}
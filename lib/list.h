@@ -1,13 +1,14 @@
 #pragma once
 
 #include "list_entry.h"
+#include "allocator.h"
 #include <include/types.h>
-#include <include/panic.h>
+#include <kernel/panic.h>
 
 namespace Stdlib
 {
 
-template <typename T>
+template <typename T, typename Allocator = DefaultAllocator>
 class LinkedList final
 {
 public:
@@ -18,6 +19,7 @@ public:
         Iterator()
             : CurrListEntry(nullptr)
             , EndList(nullptr)
+            , List(nullptr)
         {
         }
 
@@ -25,6 +27,7 @@ public:
         {
             CurrListEntry = other.CurrListEntry;
             EndList = other.EndList;
+            List = other.List;
         }
 
         Iterator(LinkedList& List)
@@ -32,6 +35,7 @@ public:
         {
             CurrListEntry = List.ListHead.Flink;
             EndList = &List.ListHead;
+            this->List = &List;
         }
 
         Iterator& operator=(const Iterator& other)
@@ -40,6 +44,7 @@ public:
             {
                 CurrListEntry = other.CurrListEntry;
                 EndList = other.EndList;
+                List = other.List;
             }
             return *this;
         }
@@ -50,15 +55,17 @@ public:
             {
                 CurrListEntry = other.CurrListEntry;
                 EndList = other.EndList;
+                List = other.List;
                 other.CurrListEntry = nullptr;
                 other.EndList = nullptr; 
+                other.List = nullptr;
             }
             return *this;
         }
 
         T& Get()
         {
-            panic(CurrListEntry == EndList);
+            BugOn(CurrListEntry == EndList);
             LinkedListNode* node = CONTAINING_RECORD(CurrListEntry,
                                                      LinkedListNode,
                                                      ListLink);
@@ -87,7 +94,7 @@ public:
 
         void Erase()
         {
-            panic(!IsValid());
+            BugOn(!IsValid());
 
             ListEntry* next = CurrListEntry->Flink;
 
@@ -95,7 +102,7 @@ public:
                                                      LinkedListNode,
                                                      ListLink);
             node->ListLink.RemoveInit();
-            delete node;
+            List->FreeNode(node);
             CurrListEntry = next;
         }
 
@@ -106,6 +113,7 @@ public:
     private:
         ListEntry* CurrListEntry;
         ListEntry* EndList;
+        LinkedList* List;
     };
 
     LinkedList()
@@ -113,9 +121,15 @@ public:
         ListHead.Init();
     }
 
+    explicit LinkedList(const Allocator& allocator)
+        : Alloc(allocator)
+    {
+        ListHead.Init();
+    }
+
     bool AddHead(const T& value)
     {
-        LinkedListNode* node = new LinkedListNode(value);
+        LinkedListNode* node = Stdlib::New<LinkedListNode>(Alloc, value);
 
         if (!node)
         {
@@ -127,7 +141,7 @@ public:
 
     bool AddTail(const T& value)
     {
-        LinkedListNode* node = new LinkedListNode(value);
+        LinkedListNode* node = Stdlib::New<LinkedListNode>(Alloc, value);
 
         if (!node)
         {
@@ -139,7 +153,7 @@ public:
 
     bool AddTail(T&& value)
     {
-        LinkedListNode* node = new LinkedListNode(Stdlib::Move(value));
+        LinkedListNode* node = Stdlib::New<LinkedListNode>(Alloc, Stdlib::Move(value));
         if (!node)
         {
             return false;
@@ -148,6 +162,7 @@ public:
         return true;
     }
 
+    // nodes are spliced, so both lists must share the allocator
     void AddTail(LinkedList&& other)
     {
         if (other.ListHead.IsEmpty())
@@ -187,7 +202,7 @@ public:
 
         node = CONTAINING_RECORD(ListHead.RemoveHead(),
                                  LinkedListNode, ListLink);
-        delete node;
+        FreeNode(node);
     }
 
     void PopTail()
@@ -198,7 +213,7 @@ public:
 
         node = CONTAINING_RECORD(ListHead.RemoveTail(),
                                  LinkedListNode, ListLink);
-        delete node;
+        FreeNode(node);
     }
 
     bool IsEmpty()
@@ -212,6 +227,7 @@ public:
     }
 
     LinkedList(LinkedList&& other)
+        : Alloc(other.Alloc)
     {
         ListHead.Init();
         AddTail(Stdlib::Move(other));
@@ -223,6 +239,7 @@ public:
         {
             Release();
 
+            Alloc = other.Alloc;
             ListHead.Init();
             AddTail(Stdlib::Move(other));
         }
@@ -261,10 +278,17 @@ private:
         {
             node = CONTAINING_RECORD(ListHead.RemoveHead(),
                                      LinkedListNode, ListLink);
-            delete node;
+            FreeNode(node);
         }
     }
 
+    class LinkedListNode;
+
+    void FreeNode(LinkedListNode* node)
+    {
+        Stdlib::Delete(Alloc, node);
+    }
+
     class LinkedListNode final
     {
     public:
@@ -287,6 +311,7 @@ private:
         LinkedListNode& operator=(LinkedListNode&& other) = delete;
     };
     ListEntry ListHead;
+    Allocator Alloc;
 };
 
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include "printer.h"
 
 #include <kernel/panic.h>
+#include <kernel/atomic.h>
+#include <kernel/asm.h>
 
 namespace Stdlib
 {
@@ -45,7 +47,7 @@ public:
 
         size_t position = EndIndex;
         Buf[position] = value;
-        EndIndex = (EndIndex + 1) % Capacity;
+        EndIndex = Advance(EndIndex, 1);
         Size++;
         return true;
     }
@@ -61,7 +63,7 @@ public:
 
         size_t position = EndIndex;
         Buf[position] = Stdlib::Move(value);
-        EndIndex = (EndIndex + 1) % Capacity;
+        EndIndex = Advance(EndIndex, 1);
         Size++;
         return true;
     }
@@ -94,6 +96,37 @@ public:
         return Capacity;
     }
 
+    // copies up to count elements in at most two chunks around the wrap point
+    size_t PutMany(const T* values, size_t count)
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        if (count > Capacity - Size)
+            count = Capacity - Size;
+
+        size_t first = Stdlib::Min(count, Capacity - EndIndex);
+        CopySpan(&Buf[EndIndex], values, first);
+        CopySpan(&Buf[0], values + first, count - first);
+        EndIndex = Advance(EndIndex, count);
+        Size += count;
+        return count;
+    }
+
+    size_t GetMany(T* values, size_t count)
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        if (count > Size)
+            count = Size;
+
+        size_t first = Stdlib::Min(count, Capacity - StartIndex);
+        CopySpan(values, &Buf[StartIndex], first);
+        CopySpan(values + first, &Buf[0], count - first);
+        StartIndex = Advance(StartIndex, count);
+        Size -= count;
+        return count;
+    }
+
     T Get()
     {
         Stdlib::AutoLock lock(Lock);
@@ -104,7 +137,7 @@ public:
         }
 
         size_t position = StartIndex;
-        StartIndex = (StartIndex + 1) % Capacity;
+        StartIndex = Advance(StartIndex, 1);
         Size--;
         return Buf[position];
     }
@@ -116,7 +149,7 @@ public:
         if (Size == 0)
             return;
 
-        StartIndex = (StartIndex + 1) % Capacity;
+        StartIndex = Advance(StartIndex, 1);
         Size--;
     }
 
@@ -140,7 +173,7 @@ public:
         for (size_t i = 0; i < Size; i++)
         {
             printer.PrintElement(Buf[index]);
-            index = (index + 1) % Capacity;
+            index = Advance(index, 1);
         }
     }
 
@@ -150,6 +183,30 @@ private:
     RingBuffer& operator=(const RingBuffer& other) = delete;
     RingBuffer& operator=(RingBuffer&& other) = delete;
 
+    static const bool IsPowerOf2 = (Capacity & (Capacity - 1)) == 0;
+
+    // count <= Capacity, so no modulo is needed even for other capacities
+    static size_t Advance(size_t index, size_t count)
+    {
+        if (IsPowerOf2)
+            return (index + count) & (Capacity - 1);
+
+        index += count;
+        return (index >= Capacity) ? index - Capacity : index;
+    }
+
+    static void CopySpan(T* dst, const T* src, size_t count)
+    {
+        if (__is_trivially_copyable(T))
+        {
+            Stdlib::MemCpy(dst, src, count * sizeof(T));
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++)
+            dst[i] = src[i];
+    }
+
     size_t StartIndex;
     size_t EndIndex;
     size_t Size;
@@ -158,4 +215,228 @@ private:
     LockType Lock;
 };
 
+// Lock-free single producer/single consumer ring buffer. Indices grow
+// monotonically, each side caches the other's index on its own cache line
+// and only rereads it when the cached value says full/empty.
+template <typename T, size_t Capacity = Const::PageSize>
+class SpscRingBuffer final
+{
+public:
+    SpscRingBuffer()
+        : Tail(0)
+        , CachedHead(0)
+        , Head(0)
+        , CachedTail(0)
+    {
+    }
+
+    ~SpscRingBuffer()
+    {
+    }
+
+    // producer side
+    bool Put(const T& value)
+    {
+        return PutMany(&value, 1) == 1;
+    }
+
+    size_t PutMany(const T* values, size_t count)
+    {
+        size_t tail = Tail;
+        if (Capacity - (tail - CachedHead) < count)
+            CachedHead = Head;
+
+        size_t free = Capacity - (tail - CachedHead);
+        if (count > free)
+            count = free;
+
+        for (size_t i = 0; i < count; i++)
+            Buf[(tail + i) % Capacity] = values[i];
+
+        // publish elements before the index
+        Barrier();
+        Tail = tail + count;
+        return count;
+    }
+
+    // consumer side
+    bool Get(T& value)
+    {
+        return GetMany(&value, 1) == 1;
+    }
+
+    size_t GetMany(T* values, size_t count)
+    {
+        size_t head = Head;
+        if (CachedTail - head < count)
+            CachedTail = Tail;
+
+        size_t used = CachedTail - head;
+        if (count > used)
+            count = used;
+
+        Barrier();
+        for (size_t i = 0; i < count; i++)
+            values[i] = Buf[(head + i) % Capacity];
+
+        Barrier();
+        Head = head + count;
+        return count;
+    }
+
+    // snapshot, exact only when called by one of the sides
+    size_t GetSize()
+    {
+        return Tail - Head;
+    }
+
+    bool IsEmpty()
+    {
+        return GetSize() == 0;
+    }
+
+    bool IsFull()
+    {
+        return GetSize() == Capacity;
+    }
+
+    size_t GetCapacity()
+    {
+        return Capacity;
+    }
+
+private:
+    SpscRingBuffer(const SpscRingBuffer& other) = delete;
+    SpscRingBuffer(SpscRingBuffer&& other) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer& other) = delete;
+    SpscRingBuffer& operator=(SpscRingBuffer&& other) = delete;
+
+    volatile size_t Tail;
+    size_t CachedHead;
+    u8 ProducerPad[Const::CacheLineSize - 2 * sizeof(size_t)];
+
+    volatile size_t Head;
+    size_t CachedTail;
+    u8 ConsumerPad[Const::CacheLineSize - 2 * sizeof(size_t)];
+
+    T Buf[Capacity];
+};
+
+// Lock-free multi producer/single consumer ring buffer. Producers claim
+// a slot by advancing Tail with cmpxchg and publish it through the slot
+// sequence, so the consumer never touches the producers' cache line.
+template <typename T, size_t Capacity = Const::PageSize>
+class MpscRingBuffer final
+{
+public:
+    MpscRingBuffer()
+        : Tail(0)
+        , Head(0)
+    {
+        for (size_t i = 0; i < Capacity; i++)
+            Slot[i].Sequence = i;
+    }
+
+    ~MpscRingBuffer()
+    {
+    }
+
+    // producer side, any context
+    bool Put(const T& value)
+    {
+        size_t pos;
+        SlotEntry* slot;
+
+        for (;;)
+        {
+            pos = Tail.Get();
+            slot = &Slot[pos % Capacity];
+            long diff = (long)(slot->Sequence - pos);
+            if (diff == 0)
+            {
+                if (Tail.Cmpxchg(pos + 1, pos) == (long)pos)
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // consumer hasn't released the slot yet
+                return false;
+            }
+        }
+
+        slot->Value = value;
+        Barrier();
+        slot->Sequence = pos + 1;
+        return true;
+    }
+
+    size_t PutMany(const T* values, size_t count)
+    {
+        size_t i;
+        for (i = 0; i < count; i++)
+        {
+            if (!Put(values[i]))
+                break;
+        }
+        return i;
+    }
+
+    // consumer side
+    bool Get(T& value)
+    {
+        return GetMany(&value, 1) == 1;
+    }
+
+    size_t GetMany(T* values, size_t count)
+    {
+        size_t head = Head;
+        size_t i;
+
+        for (i = 0; i < count; i++)
+        {
+            SlotEntry* slot = &Slot[(head + i) % Capacity];
+            if (slot->Sequence != head + i + 1)
+                break;
+
+            Barrier();
+            values[i] = slot->Value;
+            Barrier();
+            slot->Sequence = head + i + Capacity;
+        }
+
+        Head = head + i;
+        return i;
+    }
+
+    bool IsEmpty()
+    {
+        return Slot[Head % Capacity].Sequence != Head + 1;
+    }
+
+    size_t GetCapacity()
+    {
+        return Capacity;
+    }
+
+private:
+    MpscRingBuffer(const MpscRingBuffer& other) = delete;
+    MpscRingBuffer(MpscRingBuffer&& other) = delete;
+    MpscRingBuffer& operator=(const MpscRingBuffer& other) = delete;
+    MpscRingBuffer& operator=(MpscRingBuffer&& other) = delete;
+
+    struct SlotEntry
+    {
+        volatile size_t Sequence;
+        T Value;
+    };
+
+    Kernel::Atomic Tail;
+    u8 ProducerPad[Const::CacheLineSize - sizeof(Kernel::Atomic)];
+
+    size_t Head;
+    u8 ConsumerPad[Const::CacheLineSize - sizeof(size_t)];
+
+    SlotEntry Slot[Capacity];
+};
+
 }
@@ -4,17 +4,22 @@
 #include <kernel/atomic.h>
 #include <kernel/panic.h>
 
+#include "allocator.h"
+
 namespace Stdlib
 {
 
 const int SharedPtrLL = 5;
 
-template<typename T>
+template<typename T, typename Allocator = DefaultAllocator>
 class ObjectReference final
 {
 public:
-    ObjectReference(T* object)
+    // inline object shares the allocation with its reference, see MakeShared
+    ObjectReference(T* object, const Allocator& allocator = Allocator(), bool inlineObject = false)
         : Object(nullptr)
+        , Inline(inlineObject)
+        , Alloc(allocator)
     {
         Counter.Set(1);
         Object = object;
@@ -65,6 +70,11 @@ public:
         return Object;
     }
 
+    Allocator& GetAllocator()
+    {
+        return Alloc;
+    }
+
     bool DecCounter()
     {
         if (Counter.DecAndTest())
@@ -76,7 +86,10 @@ public:
                 return false;
 #endif
 
-            delete Object;
+            if (Inline)
+                Object->~T();
+            else
+                Stdlib::Delete(Alloc, Object);
             Object = nullptr;
             return true;
         }
@@ -88,6 +101,8 @@ public:
 private:
     Kernel::Atomic Counter;
     T* Object;
+    bool Inline;
+    Allocator Alloc;
 
     ObjectReference() = delete;
     ObjectReference(const ObjectReference& other) = delete;
@@ -96,7 +111,7 @@ private:
     ObjectReference& operator=(ObjectReference&& other) = delete;
 };
 
-template<typename T>
+template<typename T, typename Allocator = DefaultAllocator>
 class SharedPtr final
 {
 public:
@@ -107,7 +122,7 @@ public:
         Trace(SharedPtrLL, "ptr 0x%p ctor obj 0x%p", this, Get());
     }
 
-    SharedPtr(ObjectReference<T> *objectRef)
+    SharedPtr(ObjectReference<T, Allocator> *objectRef)
     {
         ObjectRef = objectRef;
 
@@ -122,7 +137,7 @@ public:
         Trace(SharedPtrLL, "ptr 0x%p ctor obj 0x%p", this, Get());
     }
 
-    SharedPtr(const SharedPtr<T>& other)
+    SharedPtr(const SharedPtr& other)
         : SharedPtr()
     {
         ObjectRef = other.ObjectRef;
@@ -134,7 +149,7 @@ public:
         Trace(SharedPtrLL, "ptr 0x%p ctor obj 0x%p", this, Get());
     }
 
-    SharedPtr(SharedPtr<T>&& other)
+    SharedPtr(SharedPtr&& other)
         : SharedPtr()
     {
         ObjectRef = other.ObjectRef;
@@ -143,7 +158,7 @@ public:
         Trace(SharedPtrLL, "ptr 0x%p ctor obj 0x%p", this, Get());
     }
 
-    SharedPtr<T>& operator=(const SharedPtr<T>& other)
+    SharedPtr& operator=(const SharedPtr& other)
     {
         if (this != &other)
         {
@@ -160,7 +175,7 @@ public:
         return *this;
     }
 
-    SharedPtr<T>& operator=(SharedPtr<T>&& other)
+    SharedPtr& operator=(SharedPtr&& other)
     {
         if (this != &other)
         {
@@ -209,7 +224,8 @@ public:
         {
             if (ObjectRef->DecCounter())
             {
-                delete ObjectRef;
+                Allocator allocator = ObjectRef->GetAllocator();
+                Stdlib::Delete(allocator, ObjectRef);
             }
         }
 
@@ -217,7 +233,9 @@ public:
 
         if (object != nullptr)
         {
-            ObjectRef = new ObjectReference<T>(object);
+            // object must come from the allocator as it frees it
+            Allocator allocator;
+            ObjectRef = Stdlib::New<ObjectReference<T, Allocator>>(allocator, object, allocator);
             if (ObjectRef == nullptr)
             {
                 return;
@@ -231,25 +249,38 @@ public:
     }
 
 private:
-    ObjectReference<T>* ObjectRef;
+    ObjectReference<T, Allocator>* ObjectRef;
 };
 
-template<typename T, class... Args>
-SharedPtr<T> MakeShared(Args&&... args)
+// reference and object in one block, so fixed size pools fit them
+template<typename T, typename Allocator>
+struct SharedBlock final
 {
-    ObjectReference<T>* objRef = new ObjectReference<T>(nullptr);
-    if (objRef == nullptr)
-        return SharedPtr<T>();
+    ObjectReference<T, Allocator> Ref;
+    alignas(T) u8 Storage[sizeof(T)];
+};
 
-    T* object = new T(Stdlib::Forward<Args>(args)...);
-    if (object == nullptr)
-    {
-        delete objRef;
-        return SharedPtr<T>();
-    }
+template<typename T, typename Allocator, class... Args>
+SharedPtr<T, Allocator> AllocateShared(Allocator& allocator, Args&&... args)
+{
+    using Reference = ObjectReference<T, Allocator>;
+    using Block = SharedBlock<T, Allocator>;
+
+    void* block = allocator.Alloc(sizeof(Block));
+    if (block == nullptr)
+        return SharedPtr<T, Allocator>();
 
+    Reference* objRef = new (block) Reference(nullptr, allocator, true);
+    T* object = new (static_cast<Block*>(block)->Storage) T(Stdlib::Forward<Args>(args)...);
     objRef->SetObject(object);
-    return SharedPtr<T>(objRef);
+    return SharedPtr<T, Allocator>(objRef);
+}
+
+template<typename T, class... Args>
+SharedPtr<T> MakeShared(Args&&... args)
+{
+    DefaultAllocator allocator;
+    return AllocateShared<T>(allocator, Stdlib::Forward<Args>(args)...);
 }
 
-}
\ No newline at end of file
+}
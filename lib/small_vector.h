@@ -0,0 +1,208 @@
+#pragma once
+
+#include "stdlib.h"
+#include "allocator.h"
+
+#include <kernel/panic.h>
+
+namespace Stdlib
+{
+
+// vector that keeps the first N elements inside the object, so short
+// temporaries never touch the allocator. Unlike Vector, slots past the size
+// are raw storage: elements are constructed in place when pushed and
+// destroyed when popped.
+template<class T, size_t N, class Allocator = DefaultAllocator>
+class SmallVector final
+{
+    static_assert(N > 0, "inline capacity must be non zero");
+
+public:
+    SmallVector()
+        : Arr(InlineArr()), Size(0), Capacity(N)
+    {
+    }
+
+    explicit SmallVector(const Allocator& allocator)
+        : Arr(InlineArr()), Size(0), Capacity(N), Alloc(allocator)
+    {
+    }
+
+    size_t GetSize() const
+    {
+        return Size;
+    }
+
+    size_t GetCapacity() const
+    {
+        return Capacity;
+    }
+
+    bool IsInline() const
+    {
+        return Arr == InlineArr();
+    }
+
+    bool IsEmpty() const
+    {
+        return Size == 0;
+    }
+
+    T& operator[](size_t index)
+    {
+        BugOn(index >= Size);
+        return Arr[index];
+    }
+
+    T& Back()
+    {
+        BugOn(Size == 0);
+        return Arr[Size - 1];
+    }
+
+    bool Reserve(size_t capacity)
+    {
+        if (capacity <= Capacity)
+            return true;
+
+        T* newArr = static_cast<T*>(Alloc.Alloc(capacity * sizeof(T)));
+        if (!newArr)
+            return false;
+
+        Relocate(newArr, Arr, Size);
+        if (!IsInline())
+            Alloc.Free(Arr);
+
+        Arr = newArr;
+        Capacity = capacity;
+        return true;
+    }
+
+    bool PushBack(T&& e)
+    {
+        const T* src = &e;
+        if (Size == Capacity && !Grow(src))
+            return false;
+
+        new (&Arr[Size]) T(Stdlib::Move(*const_cast<T*>(src)));
+        Size++;
+        return true;
+    }
+
+    bool PushBack(const T& e)
+    {
+        const T* src = &e;
+        if (Size == Capacity && !Grow(src))
+            return false;
+
+        new (&Arr[Size]) T(*src);
+        Size++;
+        return true;
+    }
+
+    void PopBack()
+    {
+        BugOn(Size == 0);
+        Size--;
+        Arr[Size].~T();
+    }
+
+    bool Truncate(size_t size)
+    {
+        if (size > Size)
+            return false;
+
+        Destroy(Arr + size, Size - size);
+        Size = size;
+        return true;
+    }
+
+    const T* GetConstBuf() const
+    {
+        return Arr;
+    }
+
+    T* GetBuf()
+    {
+        return Arr;
+    }
+
+    // drops the elements and the heap array, if any
+    void Clear()
+    {
+        Destroy(Arr, Size);
+        if (!IsInline())
+            Alloc.Free(Arr);
+
+        Arr = InlineArr();
+        Size = 0;
+        Capacity = N;
+    }
+
+    ~SmallVector()
+    {
+        Clear();
+    }
+
+private:
+    SmallVector(const SmallVector& other) = delete;
+    SmallVector(SmallVector&& other) = delete;
+    SmallVector& operator=(const SmallVector& other) = delete;
+    SmallVector& operator=(SmallVector&& other) = delete;
+
+    T* InlineArr()
+    {
+        return reinterpret_cast<T*>(&InlineStorage[0]);
+    }
+
+    const T* InlineArr() const
+    {
+        return reinterpret_cast<const T*>(&InlineStorage[0]);
+    }
+
+    // amortized doubling, a run of n pushes relocates O(n) elements in total
+    // src may point to an element, it then follows it to the new array
+    bool Grow(const T*& src)
+    {
+        const T* arr = Arr;
+        bool element = (src >= arr && src < arr + Size) ? true : false;
+        size_t index = (element) ? static_cast<size_t>(src - arr) : 0;
+        if (!Reserve(2 * Capacity))
+            return false;
+
+        if (element)
+            src = &Arr[index];
+        return true;
+    }
+
+    static void Relocate(T* dst, T* src, size_t count)
+    {
+        if (__is_trivially_copyable(T))
+        {
+            MemCpy(dst, src, count * sizeof(T));
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            new (&dst[i]) T(Stdlib::Move(src[i]));
+            src[i].~T();
+        }
+    }
+
+    static void Destroy(T* arr, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            arr[i].~T();
+        }
+    }
+
+    alignas(T) u8 InlineStorage[N * sizeof(T)];
+    T* Arr;
+    size_t Size;
+    size_t Capacity;
+    Allocator Alloc;
+};
+
+}
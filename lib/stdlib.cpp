@@ -1,5 +1,7 @@
 #include "stdlib.h"
 
+#include <kernel/asm.h>
+
 namespace Stdlib
 {
 
@@ -13,14 +15,63 @@ const void *MemAdd(const void *ptr, unsigned long len)
     return reinterpret_cast<const void *>(reinterpret_cast<unsigned long>(ptr) + len);
 }
 
+typedef u64 __attribute__((__may_alias__)) AliasU64;
+
+// sizes from which rep movsb/stosb beats the word loops on ERMS cpus
+static const size_t RepThreshold = 256;
+
+static bool HasErms()
+{
+    // 0 - unknown, 1 - supported, 2 - not supported
+    static volatile int ErmsState = 0;
+
+    if (unlikely(ErmsState == 0))
+    {
+        u32 eax, ebx, ecx, edx;
+
+        Cpuid(0, &eax, &ebx, &ecx, &edx);
+        if (eax >= 7)
+            Cpuid(7, &eax, &ebx, &ecx, &edx);
+        else
+            ebx = 0;
+
+        ErmsState = (ebx & (1 << 9)) ? 1 : 2;
+    }
+
+    return ErmsState == 1;
+}
+
 void MemSet(void* ptr, unsigned char c, size_t size)
 {
     unsigned char *p = static_cast<unsigned char *>(ptr);
 
-    for (size_t i = 0; i < size; i++)
+    if (size >= RepThreshold && HasErms())
     {
-        *p = c;
-        p++;
+        asm volatile ("rep stosb"
+            : "+D"(p), "+c"(size)
+            : "a"(c)
+            : "memory");
+        return;
+    }
+
+    while (size != 0 && ((ulong)p & (sizeof(u64) - 1)))
+    {
+        *p++ = c;
+        size--;
+    }
+
+    u64 pattern = 0x0101010101010101ULL * c;
+    while (size >= sizeof(u64))
+    {
+        *reinterpret_cast<AliasU64*>(p) = pattern;
+        p += sizeof(u64);
+        size -= sizeof(u64);
+    }
+
+    while (size != 0)
+    {
+        *p++ = c;
+        size--;
     }
 }
 
@@ -29,6 +80,15 @@ int MemCmp(const void* ptr1, const void* ptr2, size_t size)
     const unsigned char *p1 = static_cast<const unsigned char *>(ptr1);
     const unsigned char *p2 = static_cast<const unsigned char *>(ptr2);
 
+    // skip equal words, the byte loop below finds the first difference
+    while (size >= sizeof(u64) &&
+        *reinterpret_cast<const AliasU64*>(p1) == *reinterpret_cast<const AliasU64*>(p2))
+    {
+        p1 += sizeof(u64);
+        p2 += sizeof(u64);
+        size -= sizeof(u64);
+    }
+
     for (size_t i = 0; i < size; i++)
     {
         if (*p1 > *p2)
@@ -48,11 +108,64 @@ void MemCpy(void* dst, const void* src, size_t size)
     unsigned char *pdst = static_cast<unsigned char *>(dst);
     const unsigned char *psrc = static_cast<const unsigned char *>(src);
 
-    for (size_t i = 0; i < size; i++)
+    if (size >= RepThreshold && HasErms())
     {
-        *pdst = *psrc;
-        pdst++;
-        psrc++;
+        asm volatile ("rep movsb"
+            : "+D"(pdst), "+S"(psrc), "+c"(size)
+            :
+            : "memory");
+        return;
+    }
+
+    // align the destination, unaligned loads are cheap on x86
+    while (size != 0 && ((ulong)pdst & (sizeof(u64) - 1)))
+    {
+        *pdst++ = *psrc++;
+        size--;
+    }
+
+    while (size >= sizeof(u64))
+    {
+        *reinterpret_cast<AliasU64*>(pdst) = *reinterpret_cast<const AliasU64*>(psrc);
+        pdst += sizeof(u64);
+        psrc += sizeof(u64);
+        size -= sizeof(u64);
+    }
+
+    while (size != 0)
+    {
+        *pdst++ = *psrc++;
+        size--;
+    }
+}
+
+void MemMove(void* dst, const void* src, size_t size)
+{
+    unsigned char *pdst = static_cast<unsigned char *>(dst);
+    const unsigned char *psrc = static_cast<const unsigned char *>(src);
+
+    // a forward copy never overwrites source bytes it has yet to read
+    if (pdst <= psrc || pdst >= psrc + size)
+    {
+        MemCpy(dst, src, size);
+        return;
+    }
+
+    pdst += size;
+    psrc += size;
+
+    while (size >= sizeof(u64))
+    {
+        pdst -= sizeof(u64);
+        psrc -= sizeof(u64);
+        size -= sizeof(u64);
+        *reinterpret_cast<AliasU64*>(pdst) = *reinterpret_cast<const AliasU64*>(psrc);
+    }
+
+    while (size != 0)
+    {
+        *--pdst = *--psrc;
+        size--;
     }
 }
 
@@ -130,42 +243,76 @@ char GetHexDigit(u8 val)
     return 'A' + (val - 10);
 }
 
+// two decimal digits per step, the division by a constant compiles to a
+// multiply by its reciprocal
+static const char DecDigitPairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char HexDigits[] = "0123456789ABCDEF";
+
+static const size_t MaxUlongDigits = 20;
+
+// writes digits backwards ending at end, returns the first one
+static char* FormatDec(ulong value, char* end)
+{
+    char* p = end;
+
+    while (value >= 100) {
+        size_t pair = (value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        p[0] = DecDigitPairs[pair];
+        p[1] = DecDigitPairs[pair + 1];
+    }
+
+    if (value >= 10) {
+        p -= 2;
+        p[0] = DecDigitPairs[value * 2];
+        p[1] = DecDigitPairs[value * 2 + 1];
+    } else {
+        *--p = '0' + value;
+    }
+    return p;
+}
+
+static char* FormatHex(ulong value, char* end)
+{
+    char* p = end;
+
+    do {
+        *--p = HexDigits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+    return p;
+}
+
 int __UlongToString(ulong src, u8 dst_base, char *dst, size_t dst_size)
 {
-    size_t pos;
-    u8 val;
-    char digit;
+    char buf[MaxUlongDigits];
+    char* end = buf + sizeof(buf);
+    char* start;
+
+    switch (dst_base) {
+    case 10:
+        start = FormatDec(src, end);
+        break;
+    case 16:
+        start = FormatHex(src, end);
+        break;
+    default:
+        return -1;
+    }
 
-    if (dst_base != 10 && dst_base != 16)
+    size_t len = end - start;
+    if (len > dst_size)
         return -1;
 
-    pos = 0;
-    if (src == 0) {
-        if (!PutChar('0', dst, dst_size, pos++))
-            return -1;
-        goto put_prefix;
-    }
-    while (src) {
-        val = src % dst_base;
-        src = src/dst_base;
-        switch (dst_base) {
-        case 10:
-            digit = GetDecDigit(val);
-            break;
-        case 16:
-            digit = GetHexDigit(val);
-            break;
-        default:
-            return -1;
-        }
-        if (digit == '\0')
-            return -1;
-        if (!PutChar(digit, dst, dst_size, pos++))
-            return -1;
-    }
-put_prefix:
-    MemReverse(dst, pos);
-    return pos;
+    MemCpy(dst, start, len);
+    return len;
 }
 
 int UlongToString(ulong src, u8 dst_base, char *dst, size_t dst_size)
@@ -181,81 +328,99 @@ int UlongToString(ulong src, u8 dst_base, char *dst, size_t dst_size)
     return 0;
 }
 
+bool StringToUlong(const char* s, ulong& value)
+{
+    if (*s == '\0')
+        return false;
+
+    ulong result = 0;
+    for (; *s != '\0'; s++)
+    {
+        if (*s < '0' || *s > '9')
+            return false;
+
+        ulong digit = *s - '0';
+        if (result > (~0UL - digit) / 10)
+            return false;
+
+        result = result * 10 + digit;
+    }
+
+    value = result;
+    return true;
+}
+
+// literal runs are copied with one MemCpy, numbers are formatted into a
+// scratch buffer and copied after a single bounds check
 int VsnPrintf(char *s, size_t size, const char *fmt, va_list arg)
 {
-    size_t i;
-    char t;
-    int pos;
+    const char* p = fmt;
+    size_t pos = 0;
     int rc;
 
-    i = 0;
-    pos = 0;
     while (true) {
-        t = fmt[i++];
-        if (t == '\0')
+        const char* lit = p;
+        while (*p != '\0' && *p != '%')
+            p++;
+
+        size_t lit_len = p - lit;
+        if (lit_len != 0) {
+            if (lit_len > size - pos)
+                return -1;
+            MemCpy(&s[pos], lit, lit_len);
+            pos += lit_len;
+        }
+
+        if (*p == '\0')
             break;
-        if (t == '%') {
-            char tp = fmt[i++];
 
-            if (tp == '\0')
+        char tp = p[1];
+        if (tp == '\0')
+            return -1;
+        p += 2;
+
+        switch (tp) {
+        case 'u': {
+            rc = __UlongToString(va_arg(arg, ulong), 10, &s[pos], size - pos);
+            if (rc < 0)
                 return -1;
-            switch (tp) {
-            case 'u': {
-                ulong val;
-
-                val = va_arg(arg, ulong);
-                rc = __UlongToString(val, 10, &s[pos],
-                            size - pos);
-                if (rc < 0)
-                    return -1;
-                pos += rc;
-                break;
-            }
-            case 'c': {
-                int val;
-                val = va_arg(arg, int);
-                if (!PutChar(val & 0xFF, s, size, pos++))
-                    return -1;
-                break;
-            }
-            case 'p': {
-                void *val;
-                ulong uval;
-
-                if (sizeof(void *) != sizeof(ulong))
-                    return -1;
-
-                val = va_arg(arg, void *);
-                uval = (ulong)val;
-                rc = __UlongToString(uval, 16, &s[pos],
-                            size - pos);
-                if (rc < 0)
-                    return -1;
-                pos += rc;
-                break;
-            }
-            case 's': {
-                char *val;
-                size_t val_len;
-
-                val = va_arg(arg, char *);
-                val_len = StrLen(val);
-                if (val_len > (size - pos))
-                    return -1;
-                MemCpy(&s[pos], val, val_len);
-                pos += val_len;
-                break;
-            }
-            default:
+            pos += rc;
+            break;
+        }
+        case 'c': {
+            int val = va_arg(arg, int);
+            if (pos >= size)
                 return -1;
-            }
-        } else
-            if (!PutChar(t, s, size, pos++))
+            s[pos++] = val & 0xFF;
+            break;
+        }
+        case 'p': {
+            static_assert(sizeof(void *) == sizeof(ulong), "Invalid size");
+
+            rc = __UlongToString((ulong)va_arg(arg, void *), 16, &s[pos], size - pos);
+            if (rc < 0)
+                return -1;
+            pos += rc;
+            break;
+        }
+        case 's': {
+            const char *val = va_arg(arg, const char *);
+            size_t val_len = StrLen(val);
+
+            if (val_len > (size - pos))
                 return -1;
+            MemCpy(&s[pos], val, val_len);
+            pos += val_len;
+            break;
+        }
+        default:
+            return -1;
+        }
     }
 
-    if (!PutChar('\0', s, size, pos++))
+    if (pos >= size)
         return -1;
+    s[pos++] = '\0';
 
     return pos;
 }
@@ -345,18 +510,7 @@ size_t Log2(size_t size)
 
 size_t HashPtr(void *ptr)
 {
-    ulong val = (ulong)ptr;
-    size_t hash, i, c;
-
-    hash = 5381;
-    val = val >> 3;
-    for (i = 0; i < sizeof(val); i++) {
-        c = (unsigned char)val & 0xFF;
-        hash = ((hash << 5) + hash) + c;
-        val = val >> 8;
-    }
-
-    return hash;
+    return Mix64((ulong)ptr);
 }
 
 const char* StrChrOnce(const char* s, char sep)
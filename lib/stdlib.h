@@ -135,6 +135,75 @@ template <class T> void Swap(T& a, T& b)
     T c(Move(a)); a=Move(b); b=Move(c);
 }
 
+// heap sort: in place, no recursion, O(n log n) worst case
+template <typename T, typename Less>
+void Sort(T* arr, size_t count, Less less)
+{
+    auto siftDown = [&arr, &less](size_t root, size_t end)
+    {
+        for (;;)
+        {
+            size_t child = 2 * root + 1;
+            if (child >= end)
+                break;
+
+            if (child + 1 < end && less(arr[child], arr[child + 1]))
+                child++;
+
+            if (!less(arr[root], arr[child]))
+                break;
+
+            Swap(arr[root], arr[child]);
+            root = child;
+        }
+    };
+
+    for (size_t i = count / 2; i > 0; i--)
+        siftDown(i - 1, count);
+
+    for (size_t end = count; end > 1; end--)
+    {
+        Swap(arr[0], arr[end - 1]);
+        siftDown(0, end - 1);
+    }
+}
+
+// first index with key <= keys[index], without data dependent branches
+template<typename K>
+size_t LowerBound(const K* keys, size_t count, const K& key)
+{
+    if (count == 0)
+        return 0;
+
+    const K* base = keys;
+    while (count > 1)
+    {
+        size_t half = count / 2;
+        base = (base[half - 1] < key) ? base + half : base;
+        count -= half;
+    }
+
+    return (base - keys) + ((*base < key) ? 1 : 0);
+}
+
+// first index with key < keys[index]
+template<typename K>
+size_t UpperBound(const K* keys, size_t count, const K& key)
+{
+    if (count == 0)
+        return 0;
+
+    const K* base = keys;
+    while (count > 1)
+    {
+        size_t half = count / 2;
+        base = (key < base[half - 1]) ? base : base + half;
+        count -= half;
+    }
+
+    return (base - keys) + ((key < *base) ? 0 : 1);
+}
+
 template <typename T,unsigned S> unsigned ArraySize(const T (&v)[S])
 {
     (void)v;
@@ -262,6 +331,12 @@ static inline size_t SizeInPages(size_t size)
     return RoundUp(size, Const::PageSize) / Const::PageSize;
 }
 
+// index of the lowest set bit, value must be non zero
+static inline ulong FindFirstSetBit(ulong value)
+{
+    return __builtin_ctzl(value);
+}
+
 void *MemAdd(void *ptr, unsigned long len);
 
 const void *MemAdd(const void *ptr, unsigned long len);
@@ -272,6 +347,9 @@ int MemCmp(const void* ptr1, const void* ptr2, size_t size);
 
 void MemCpy(void* dst, const void* src, size_t size);
 
+// like MemCpy, but the ranges may overlap
+void MemMove(void* dst, const void* src, size_t size);
+
 size_t StrLen(const char* s);
 
 const char *TruncateFileName(const char *fileName);
@@ -290,6 +368,9 @@ int __UlongToString(ulong src, u8 dst_base, char *dst, size_t dst_size);
 
 int UlongToString(ulong src, u8 dst_base, char *dst, size_t dst_size);
 
+// decimal digits only, false on anything else or overflow
+bool StringToUlong(const char* s, ulong& value);
+
 int VsnPrintf(char *s, size_t size, const char *fmt, va_list arg);
 
 int SnPrintf(char* buf, size_t size, const char* fmt, ...);
@@ -304,6 +385,17 @@ const char* StrChrOnce(const char* s, char sep);
 
 size_t Log2(size_t size);
 
+// murmur3 64-bit finalizer: every input bit affects every output bit
+inline u64 Mix64(u64 value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb3fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
 size_t HashPtr(void *ptr);
 
 }
\ No newline at end of file
@@ -2,13 +2,14 @@
 
 #include "stdlib.h"
 #include "error.h"
+#include "allocator.h"
 
 #include <kernel/panic.h>
 
 namespace Stdlib
 {
 
-template<class T>
+template<class T, class Allocator = DefaultAllocator>
 class Vector
 {
 public:
@@ -17,6 +18,11 @@ public:
     {
     }
 
+    explicit Vector(const Allocator& allocator)
+        : Arr(nullptr), Size(0), Capacity(0), Alloc(allocator)
+    {
+    }
+
     size_t GetSize() const
     {
         return Size;
@@ -38,7 +44,7 @@ public:
         if (capacity <= Capacity)
             return true;
 
-        T* newArr = new T[capacity];
+        T* newArr = AllocArray(capacity);
         if (!newArr)
             return false;
 
@@ -48,7 +54,7 @@ public:
             {
                 newArr[i] = Stdlib::Move(Arr[i]);
             }
-            delete[] Arr;
+            FreeArray(Arr, Capacity);
         }
         Arr = newArr;
         Capacity = capacity;
@@ -115,7 +121,7 @@ public:
     }
 
     Vector(Vector&& other)
-        : Vector()
+        : Vector(other.Alloc)
     {
         Arr = other.Arr;
         Size = other.Size;
@@ -128,6 +134,7 @@ public:
     Vector& operator=(Vector&& other)
     {
         Release();
+        Alloc = other.Alloc;
         Arr = other.Arr;
         Size = other.Size;
         Capacity = other.Capacity;
@@ -138,12 +145,12 @@ public:
     }
 
     Vector(const Vector& other, Stdlib::Error& err)
-        : Vector()
+        : Vector(other.Alloc)
     {
         if (!err.Ok())
             return;
 
-        Arr = new T[other.Capacity];
+        Arr = AllocArray(other.Capacity);
         if (!Arr)
         {
             err = MakeError(Stdlib::Error::NoMemory);
@@ -163,12 +170,13 @@ public:
         Panic("Not implemented yet!");
     }
 
-    Vector(const T* arr, size_t size, Stdlib::Error& err)
+    Vector(const T* arr, size_t size, Stdlib::Error& err, const Allocator& allocator = Allocator())
+        : Vector(allocator)
     {
         if (!err.Ok())
             return;
 
-        Arr = new T[size];
+        Arr = AllocArray(size);
         if (!Arr)
         {
             err = MakeError(Stdlib::Error::NoMemory);
@@ -188,11 +196,34 @@ private:
     Vector(const Vector& other) = delete;
     Vector& operator=(const Vector& other) = delete;
 
+    // like new T[count], every slot up to the capacity is constructed
+    T* AllocArray(size_t count)
+    {
+        T* arr = static_cast<T*>(Alloc.Alloc(count * sizeof(T)));
+        if (!arr)
+            return nullptr;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            new (&arr[i]) T();
+        }
+        return arr;
+    }
+
+    void FreeArray(T* arr, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            arr[i].~T();
+        }
+        Alloc.Free(arr);
+    }
+
     void Release()
     {
         if (Arr)
         {
-            delete[] Arr;
+            FreeArray(Arr, Capacity);
             Arr = nullptr;
         }
         Size = 0;
@@ -202,6 +233,7 @@ private:
     T* Arr;
     size_t Size;
     size_t Capacity;
+    Allocator Alloc;
 };
 
 }
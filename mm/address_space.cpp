@@ -0,0 +1,205 @@
+#include "address_space.h"
+#include "memory_map.h"
+#include "page_allocator.h"
+#include "page_table.h"
+#include "tlb.h"
+
+#include <kernel/asm.h>
+#include <kernel/panic.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+AddressSpace::AddressSpace()
+    : Root(nullptr)
+    , RootPhys(0)
+    , Pcid(0)
+{
+}
+
+AddressSpace::~AddressSpace()
+{
+    if (Root == nullptr)
+        return;
+
+    for (size_t i = UserRootFirst; i <= UserRootLast; i++)
+    {
+        if (Root[i] & EntryPresent)
+            FreeTable(reinterpret_cast<ulong*>(PageTable::GetInstance().PhysToVirt(Root[i] & EntryAddressMask)), 3);
+    }
+
+    // entries cached under the PCID go before it is handed out again
+    Tlb::GetInstance().FreePcid(Pcid);
+    PageAllocatorImpl::GetInstance().Free(Root);
+    Root = nullptr;
+}
+
+void AddressSpace::FreeTable(ulong* table, ulong level)
+{
+    auto& pt = PageTable::GetInstance();
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        if (!(table[i] & EntryPresent))
+            continue;
+
+        void* page = reinterpret_cast<void*>(pt.PhysToVirt(table[i] & EntryAddressMask));
+        if (level > 1)
+            FreeTable(static_cast<ulong*>(page), level - 1);
+        else
+            PageAllocatorImpl::GetInstance().Free(page);
+    }
+
+    PageAllocatorImpl::GetInstance().Free(table);
+}
+
+bool AddressSpace::Setup()
+{
+    BugOn(Root != nullptr);
+
+    Root = static_cast<ulong*>(PageAllocatorImpl::GetInstance().AllocZeroed(1));
+    if (Root == nullptr)
+        return false;
+
+    auto& pt = PageTable::GetInstance();
+    if (!pt.CopyKernelRoot(Root))
+    {
+        PageAllocatorImpl::GetInstance().Free(Root);
+        Root = nullptr;
+        return false;
+    }
+
+    RootPhys = pt.VirtToPhys(reinterpret_cast<ulong>(Root));
+    Pcid = Tlb::GetInstance().AllocPcid();
+    return true;
+}
+
+bool AddressSpace::IsUserRange(ulong virtAddr, size_t len)
+{
+    if (virtAddr < MemoryMap::UserSpaceBase || virtAddr >= MemoryMap::UserSpaceEnd)
+        return false;
+
+    return (len <= MemoryMap::UserSpaceEnd - virtAddr) ? true : false;
+}
+
+ulong* AddressSpace::Lookup(ulong virtAddr, bool create)
+{
+    auto& pt = PageTable::GetInstance();
+    ulong* table = Root;
+
+    for (ulong shift = 39; shift > Const::PageShift; shift -= 9)
+    {
+        ulong& entry = table[(virtAddr >> shift) & 0x1FF];
+        if (!(entry & EntryPresent))
+        {
+            if (!create)
+                return nullptr;
+
+            void* page = PageAllocatorImpl::GetInstance().AllocZeroed(1);
+            if (page == nullptr)
+                return nullptr;
+
+            // leaf entries decide, the tables allow everything
+            entry = pt.VirtToPhys(reinterpret_cast<ulong>(page)) | EntryUser | EntryWritable | EntryPresent;
+        }
+
+        table = reinterpret_cast<ulong*>(pt.PhysToVirt(entry & EntryAddressMask));
+    }
+
+    return &table[(virtAddr >> Const::PageShift) & 0x1FF];
+}
+
+bool AddressSpace::Map(ulong virtAddr, size_t pages, ulong flags)
+{
+    if ((virtAddr & (Const::PageSize - 1)) || !IsUserRange(virtAddr, pages * Const::PageSize))
+        return false;
+
+    auto& pt = PageTable::GetInstance();
+    for (size_t i = 0; i < pages; i++)
+    {
+        ulong* entry = Lookup(virtAddr + i * Const::PageSize, true);
+        if (entry == nullptr || (*entry & EntryPresent))
+            return false;
+
+        void* page = PageAllocatorImpl::GetInstance().AllocZeroed(1);
+        if (page == nullptr)
+            return false;
+
+        *entry = pt.VirtToPhys(reinterpret_cast<ulong>(page)) | EntryUser | EntryPresent;
+        if (flags & PageTable::MapWritable)
+            *entry |= EntryWritable;
+    }
+
+    return true;
+}
+
+bool AddressSpace::CopyTo(ulong virtAddr, const void* src, size_t len)
+{
+    if (!IsUserRange(virtAddr, len))
+        return false;
+
+    auto& pt = PageTable::GetInstance();
+    const u8* from = static_cast<const u8*>(src);
+    while (len != 0)
+    {
+        ulong* entry = Lookup(virtAddr, false);
+        if (entry == nullptr || !(*entry & EntryPresent))
+            return false;
+
+        ulong off = virtAddr & (Const::PageSize - 1);
+        size_t chunk = Stdlib::Min(Const::PageSize - off, len);
+        Stdlib::MemCpy(reinterpret_cast<void*>(pt.PhysToVirt(*entry & EntryAddressMask) + off), from, chunk);
+
+        from += chunk;
+        virtAddr += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+bool AddressSpace::CopyFrom(void* dst, ulong virtAddr, size_t len)
+{
+    if (!IsUserRange(virtAddr, len))
+        return false;
+
+    auto& pt = PageTable::GetInstance();
+    u8* to = static_cast<u8*>(dst);
+    while (len != 0)
+    {
+        ulong* entry = Lookup(virtAddr, false);
+        if (entry == nullptr || !(*entry & EntryPresent))
+            return false;
+
+        ulong off = virtAddr & (Const::PageSize - 1);
+        size_t chunk = Stdlib::Min(Const::PageSize - off, len);
+        Stdlib::MemCpy(to, reinterpret_cast<void*>(pt.PhysToVirt(*entry & EntryAddressMask) + off), chunk);
+
+        to += chunk;
+        virtAddr += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+void AddressSpace::Activate()
+{
+    SetCr3(Tlb::GetInstance().MakeCr3(RootPhys, Pcid));
+}
+
+void AddressSpace::ActivateKernel()
+{
+    SetCr3(Tlb::GetInstance().MakeCr3(PageTable::GetInstance().GetRoot(), 0));
+}
+
+ulong AddressSpace::GetPcid()
+{
+    return Pcid;
+}
+
+}
+}
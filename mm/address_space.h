@@ -0,0 +1,64 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Page tables of a user task. The kernel half of the root is shared with
+// the kernel page table, the user half maps pages from the page allocator
+// between UserSpaceBase and UserSpaceEnd, and the PCID keeps its TLB
+// entries across switches. Pages are mapped before the task starts and
+// stay until the space is deleted, so nothing needs a shootdown.
+class AddressSpace final
+{
+public:
+    AddressSpace();
+    ~AddressSpace();
+
+    bool Setup();
+
+    // maps zeroed pages, PageTable::MapWritable makes them writable
+    bool Map(ulong virtAddr, size_t pages, ulong flags);
+
+    // copies through the direct map, false if a page isn't mapped
+    bool CopyTo(ulong virtAddr, const void* src, size_t len);
+    bool CopyFrom(void* dst, ulong virtAddr, size_t len);
+
+    // loads the space on the current cpu, ActivateKernel the kernel root
+    void Activate();
+    static void ActivateKernel();
+
+    ulong GetPcid();
+
+    static bool IsUserRange(ulong virtAddr, size_t len);
+
+private:
+    AddressSpace(const AddressSpace& other) = delete;
+    AddressSpace(AddressSpace&& other) = delete;
+    AddressSpace& operator=(const AddressSpace& other) = delete;
+    AddressSpace& operator=(AddressSpace&& other) = delete;
+
+    static const ulong EntryPresent = (1UL << 0);
+    static const ulong EntryWritable = (1UL << 1);
+    static const ulong EntryUser = (1UL << 2);
+    static const ulong EntryAddressMask = 0x000FFFFFFFFFF000;
+
+    // first and last top level entries of the user half
+    static const size_t UserRootFirst = 1;
+    static const size_t UserRootLast = 255;
+
+    ulong* Lookup(ulong virtAddr, bool create);
+    void FreeTable(ulong* table, ulong level);
+
+    ulong* Root;
+    ulong RootPhys;
+    ulong Pcid;
+};
+
+}
+}
@@ -11,12 +11,30 @@ namespace Kernel
 namespace Mm
 {
 
+constexpr size_t AllocatorImpl::SizeClass[];
+
+#define SIZE_CLASS_1(n) ClassIndex((n) * TableStep)
+#define SIZE_CLASS_8(n) SIZE_CLASS_1(n), SIZE_CLASS_1(n + 1), SIZE_CLASS_1(n + 2), SIZE_CLASS_1(n + 3), \
+	SIZE_CLASS_1(n + 4), SIZE_CLASS_1(n + 5), SIZE_CLASS_1(n + 6), SIZE_CLASS_1(n + 7)
+#define SIZE_CLASS_64(n) SIZE_CLASS_8(n), SIZE_CLASS_8(n + 8), SIZE_CLASS_8(n + 16), SIZE_CLASS_8(n + 24), \
+	SIZE_CLASS_8(n + 32), SIZE_CLASS_8(n + 40), SIZE_CLASS_8(n + 48), SIZE_CLASS_8(n + 56)
+
+const u8 AllocatorImpl::SizeToClass[] = { SIZE_CLASS_64(0), SIZE_CLASS_64(64), SIZE_CLASS_1(128) };
+
 AllocatorImpl::AllocatorImpl(class PageAllocator& pageAllocator)
 	: PageAllocator(pageAllocator)
 {
+#ifdef __ALLOC_TRACK__
+	Stdlib::MemSet(Site, 0, sizeof(Site));
+	SiteOverflow = 0;
+#endif
+
+	static_assert(SizeClass[ClassCount - 1] < Const::PageSize / 2, "Invalid size class");
+	static_assert(ClassIndex(TableMaxSize) < ClassCount - 2, "Invalid size class table");
+
 	for (size_t i = 0; i < Stdlib::ArraySize(Pool); i++)
 	{
-		Pool[i].Setup(static_cast<size_t>(1) << (StartLog + i), &PageAllocator);
+		Pool[i].Setup(SizeClass[i], &PageAllocator);
 	}
 }
 
@@ -24,79 +42,246 @@ AllocatorImpl::~AllocatorImpl()
 {
 }
 
-size_t AllocatorImpl::Log2(size_t size)
+void* AllocatorImpl::Alloc(size_t size)
+{
+	return Alloc(size, __builtin_return_address(0));
+}
+
+void* AllocatorImpl::Alloc(size_t size, void* caller)
 {
-	size_t log;
+	BugOn(size == 0);
+
+#ifdef __ALLOC_TRACK__
+	size_t reqSize = size;
+	size += sizeof(AllocHeader);
+#else
+	(void)caller;
+#endif
+
+	size_t index;
+	if (size <= TableMaxSize)
+	{
+		index = SizeToClass[(size + TableStep - 1) / TableStep];
+	}
+	else if (size <= SizeClass[ClassCount - 1])
+	{
+		index = (size <= SizeClass[ClassCount - 2]) ? ClassCount - 2 : ClassCount - 1;
+	}
+	else
+	{
+		index = ClassCount;
+	}
+
+	TraceFast(AllocatorLL, "0x%p size 0x%p class 0x%p", this, size, index);
 
-	if (size <= 16)
+	void* ptr;
+	if (index == ClassCount)
 	{
-		log = 4;
+		ptr = PageAllocator.Alloc(Stdlib::SizeInPages(size));
 	}
 	else
 	{
-		log = Stdlib::Log2(size);
+		BugOn(SizeClass[index] < size);
+		ptr = Pool[index].Alloc();
 	}
 
-	BugOn((static_cast<size_t>(1) << log) < size);
+#ifdef __ALLOC_TRACK__
+	if (ptr != nullptr)
+	{
+		AllocHeader* header = static_cast<AllocHeader*>(ptr);
+		header->Site = TrackAlloc(caller, reqSize);
+		header->Offset = 0;
+		header->Size = reqSize;
+		ptr = header + 1;
+	}
+#endif
 
-	return log;
+	return ptr;
 }
 
-void* AllocatorImpl::Alloc(size_t size)
+size_t AllocatorImpl::AlignedClassIndex(size_t size, size_t align)
 {
-	BugOn(size == 0);
+	if (align > Const::CacheLineSize)
+		return ClassCount;
 
-	Header* header;
-	size_t reqSize = (size + sizeof(*header));
-	if (reqSize >= (Const::PageSize / 2))
+	for (size_t i = 0; i < ClassCount; i++)
 	{
-		return PageAllocator.Alloc(Stdlib::SizeInPages(size));
+		if (SizeClass[i] >= size && (SizeClass[i] % align) == 0)
+			return i;
 	}
 
-	size_t log = Log2(reqSize);
+	return ClassCount;
+}
 
-	Trace(AllocatorLL, "0x%p size 0x%p log 0x%p", this, size, log);
-	if (BugOn(log < StartLog || log > EndLog || (log - StartLog) >= Stdlib::ArraySize(Pool)))
-	{
+void* AllocatorImpl::AllocAligned(size_t size, size_t align, void* caller)
+{
+	BugOn(size == 0);
+	if (BugOn(align == 0 || (align & (align - 1)) != 0 || align > Const::PageSize))
 		return nullptr;
-	}
 
-	header = static_cast<Header*>(Pool[log - StartLog].Alloc());
-	if (header == nullptr)
+#ifdef __ALLOC_TRACK__
+	// the header goes right before the aligned address
+	size_t reqSize = size;
+	size_t offset = Stdlib::RoundUp(sizeof(AllocHeader), align);
+	size += offset;
+#else
+	(void)caller;
+#endif
+
+	size_t index = AlignedClassIndex(size, align);
+	void* ptr = (index == ClassCount) ?
+		PageAllocator.Alloc(Stdlib::SizeInPages(size)) : Pool[index].Alloc();
+
+#ifdef __ALLOC_TRACK__
+	if (ptr != nullptr)
 	{
-		return nullptr;
+		AllocHeader* header = reinterpret_cast<AllocHeader*>(static_cast<u8*>(ptr) + offset) - 1;
+		header->Site = TrackAlloc(caller, reqSize);
+		header->Offset = offset - sizeof(AllocHeader);
+		header->Size = reqSize;
+		ptr = header + 1;
 	}
+#endif
 
-	header->Magic = Magic;
-	header->Size = size;
-	return header + 1;
+	BugOn(reinterpret_cast<ulong>(ptr) & (align - 1));
+	return ptr;
 }
 
 void AllocatorImpl::Free(void* ptr)
 {
 	BugOn(ptr == nullptr);
 
+#ifdef __ALLOC_TRACK__
+	AllocHeader* header = static_cast<AllocHeader*>(ptr) - 1;
+	TrackFree(header->Site, header->Size);
+	ptr = reinterpret_cast<u8*>(header) - header->Offset;
+#endif
+
+	// page allocations are page aligned, pool blocks never are
 	if ((reinterpret_cast<ulong>(ptr) & (Const::PageSize - 1)) == 0)
 	{
 		PageAllocator.Free(ptr);
 		return;
 	}
 
-	Header *header = static_cast<Header*>(ptr) - 1;
-	if (header->Magic != Magic)
+	class Pool* pool = Pool::GetOwner(ptr);
+	if (pool == nullptr)
 	{
-		Panic("Invalid header magic");
+		Panic("Invalid block owner");
 		return;
 	}
 
-	size_t log = Log2(header->Size + sizeof(*header));
-	if (BugOn(log < StartLog || log > EndLog || (log - StartLog) >= Stdlib::ArraySize(Pool)))
+	pool->Free(ptr);
+}
+
+void AllocatorImpl::Dump(Stdlib::Printer& printer)
+{
+	printer.Printf("size used peak free pages failures\n");
+	for (size_t i = 0; i < Stdlib::ArraySize(Pool); i++)
+	{
+		Pool::PoolStats stats;
+		Pool[i].GetStats(stats);
+		if (stats.PeakUsage == 0 && stats.AllocFailures == 0)
+			continue;
+
+		printer.Printf("%u %u %u %u %u %u\n", stats.Size, stats.Usage, stats.PeakUsage,
+			stats.FreeBlocks, stats.PageCount, stats.AllocFailures);
+	}
+
+#ifdef __ALLOC_TRACK__
+	DumpSites(printer);
+#endif
+}
+
+#ifdef __ALLOC_TRACK__
+
+ulong AllocatorImpl::TrackAlloc(void* caller, size_t size)
+{
+	ulong flags = SiteLock.LockIrqSave();
+
+	// open addressing by caller address, the last slot takes the overflow
+	ulong index = (reinterpret_cast<ulong>(caller) >> 2) % (MaxSites - 1);
+	for (size_t i = 0; i < MaxSites - 1; i++)
+	{
+		if (Site[index].Caller == caller || Site[index].Caller == nullptr)
+			break;
+
+		index = (index + 1) % (MaxSites - 1);
+	}
+
+	if (Site[index].Caller != caller && Site[index].Caller != nullptr)
 	{
+		index = MaxSites - 1;
+		SiteOverflow++;
+	}
+
+	auto& site = Site[index];
+	if (index != MaxSites - 1)
+		site.Caller = caller;
+	site.AllocCount++;
+	site.LiveCount++;
+	site.LiveBytes += size;
+	if (site.LiveBytes > site.PeakBytes)
+		site.PeakBytes = site.LiveBytes;
+
+	SiteLock.UnlockIrqRestore(flags);
+	return index;
+}
+
+void AllocatorImpl::TrackFree(ulong site, size_t size)
+{
+	if (BugOn(site >= MaxSites))
 		return;
+
+	ulong flags = SiteLock.LockIrqSave();
+	Site[site].LiveCount--;
+	Site[site].LiveBytes -= size;
+	SiteLock.UnlockIrqRestore(flags);
+}
+
+void AllocatorImpl::DumpSites(Stdlib::Printer& printer)
+{
+	AllocSite top[SitesTop];
+	size_t count = 0;
+
+	ulong flags = SiteLock.LockIrqSave();
+	for (size_t i = 0; i < MaxSites; i++)
+	{
+		auto& site = Site[i];
+		if (site.LiveBytes == 0)
+			continue;
+
+		// keep top sorted by live bytes, descending
+		size_t pos = count;
+		while (pos > 0 && top[pos - 1].LiveBytes < site.LiveBytes)
+			pos--;
+
+		if (pos == SitesTop)
+			continue;
+
+		if (count < SitesTop)
+			count++;
+
+		for (size_t j = count - 1; j > pos; j--)
+			top[j] = top[j - 1];
+
+		top[pos] = site;
 	}
+	ulong overflow = SiteOverflow;
+	SiteLock.UnlockIrqRestore(flags);
 
-	Pool[log - StartLog].Free(header);
+	printer.Printf("caller allocs live livebytes peakbytes\n");
+	for (size_t i = 0; i < count; i++)
+	{
+		printer.Printf("0x%p %u %u %u %u\n", top[i].Caller, top[i].AllocCount,
+			top[i].LiveCount, top[i].LiveBytes, top[i].PeakBytes);
+	}
+
+	if (overflow != 0)
+		printer.Printf("untracked sites allocs %u\n", overflow);
 }
 
+#endif
+
+}
 }
-}
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 #include <include/const.h>
 #include <kernel/spin_lock.h>
+#include <kernel/raw_spin_lock.h>
+#include <lib/printer.h>
 #include <lib/list_entry.h>
 
 namespace Kernel
@@ -31,6 +33,14 @@ public:
 
 	virtual void* Alloc(size_t size) override;
 	virtual void Free(void* ptr) override;
+
+	// caller is the allocation site reported by the tracker
+	void* Alloc(size_t size, void* caller);
+
+	// align is a power of two up to the page size, Free releases the block
+	void* AllocAligned(size_t size, size_t align, void* caller);
+
+	void Dump(Stdlib::Printer& printer);
 private:
 	AllocatorImpl(PageAllocator& pageAllocator);
 	virtual ~AllocatorImpl();
@@ -40,21 +50,63 @@ private:
 	AllocatorImpl& operator=(const AllocatorImpl& other) = delete;
 	AllocatorImpl& operator=(AllocatorImpl&& other) = delete;
 
-	static const u32 Magic = 0xCBDECBDE;
+	// blocks hold a free list entry, so classes start at 16 bytes; the last
+	// ones split the page space after the slab header into 3 and 2 blocks
+	static constexpr size_t SizeClass[] = {
+		16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+		320, 384, 448, 512, 640, 768, 896, 1024, 1344, 2016 };
+	static const size_t ClassCount = sizeof(SizeClass) / sizeof(SizeClass[0]);
+	static const size_t TableMaxSize = 1024;
+	static const size_t TableStep = 8;
 
-	size_t Log2(size_t size);
-	bool LogBySize(size_t size, size_t& log);
+	static constexpr u8 ClassIndex(size_t size, size_t index = 0)
+	{
+		return (index == ClassCount - 1 || SizeClass[index] >= size) ?
+			static_cast<u8>(index) : ClassIndex(size, index + 1);
+	}
 
-	struct Header {
-		u32 Magic;
-		u32 Size;
-	};
+	// class index by (size + TableStep - 1) / TableStep for size <= TableMaxSize
+	static const u8 SizeToClass[TableMaxSize / TableStep + 1];
 
-	static const size_t StartLog = 3;
-	static const size_t EndLog = Const::PageShift - 1;
+	// blocks of a class that is a multiple of align are aligned when align
+	// doesn't exceed the slab header, ClassCount if pages are needed
+	static size_t AlignedClassIndex(size_t size, size_t align);
 
-	Pool Pool[EndLog - StartLog + 1];
+	Pool Pool[ClassCount];
 	PageAllocator& PageAllocator;
+
+#ifdef __ALLOC_TRACK__
+	// every block is prefixed by the site index and the requested size,
+	// aligned blocks keep the padding before the header in Offset
+	struct AllocHeader
+	{
+		u32 Site;
+		u32 Offset;
+		ulong Size;
+	};
+
+	static_assert(sizeof(AllocHeader) == 16, "Invalid size");
+
+	struct AllocSite
+	{
+		void* Caller;
+		ulong AllocCount;
+		ulong LiveCount;
+		ulong LiveBytes;
+		ulong PeakBytes;
+	};
+
+	static const size_t MaxSites = 256;
+	static const size_t SitesTop = 16;
+
+	ulong TrackAlloc(void* caller, size_t size);
+	void TrackFree(ulong site, size_t size);
+	void DumpSites(Stdlib::Printer& printer);
+
+	AllocSite Site[MaxSites];
+	ulong SiteOverflow;
+	RawSpinLock SiteLock;
+#endif
 };
 
 }
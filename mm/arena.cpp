@@ -0,0 +1,83 @@
+#include "arena.h"
+
+#include <kernel/panic.h>
+#include <kernel/trace.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+Arena::Arena(class PageAllocator& pageAllocator, size_t chunkPages)
+    : ChunkList(nullptr)
+    , Pos(0)
+    , End(0)
+    , ChunkPages((chunkPages != 0) ? chunkPages : 1)
+    , Usage(0)
+    , PageCount(0)
+    , PageAllocator(pageAllocator)
+{
+}
+
+Arena::~Arena()
+{
+    Reset();
+}
+
+void* Arena::Alloc(size_t size)
+{
+    if (BugOn(size == 0))
+        return nullptr;
+
+    size = Stdlib::RoundUp(size, Alignment);
+    if (size > End - Pos)
+    {
+        // the rest of the current chunk is wasted
+        size_t pages = Stdlib::Max(ChunkPages, Stdlib::SizeInPages(size + sizeof(Chunk)));
+        Chunk* chunk = static_cast<Chunk*>(PageAllocator.Alloc(pages));
+        if (chunk == nullptr)
+            return nullptr;
+
+        chunk->Next = ChunkList;
+        chunk->Pages = pages;
+        ChunkList = chunk;
+        PageCount += pages;
+
+        Pos = reinterpret_cast<ulong>(chunk + 1);
+        End = reinterpret_cast<ulong>(chunk) + pages * Const::PageSize;
+    }
+
+    void* ptr = reinterpret_cast<void*>(Pos);
+    Pos += size;
+    Usage += size;
+    return ptr;
+}
+
+void Arena::Reset()
+{
+    while (ChunkList != nullptr)
+    {
+        Chunk* chunk = ChunkList;
+        ChunkList = chunk->Next;
+        PageAllocator.Free(chunk);
+    }
+
+    Pos = 0;
+    End = 0;
+    Usage = 0;
+    PageCount = 0;
+}
+
+size_t Arena::GetUsage()
+{
+    return Usage;
+}
+
+size_t Arena::GetPageCount()
+{
+    return PageCount;
+}
+
+}
+}
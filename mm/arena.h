@@ -0,0 +1,90 @@
+#pragma once
+
+#include "page_allocator.h"
+
+#include <include/const.h>
+#include <lib/stdlib.h>
+#include <lib/allocator.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Bump allocator for short-lived objects: no locking, so an arena must be
+// used by one task at a time, and all memory is released at once by Reset.
+class Arena final
+{
+public:
+    Arena(PageAllocator& pageAllocator, size_t chunkPages = 1);
+    ~Arena();
+
+    void* Alloc(size_t size);
+
+    // releases every allocation, destructors are not run
+    void Reset();
+
+    size_t GetUsage();
+    size_t GetPageCount();
+
+    template <typename T, typename... Args>
+    T* New(Args&&... args)
+    {
+        void* ptr = Alloc(sizeof(T));
+        if (ptr == nullptr)
+            return nullptr;
+
+        return new (ptr) T(Stdlib::Forward<Args>(args)...);
+    }
+
+private:
+    Arena(const Arena& other) = delete;
+    Arena(Arena&& other) = delete;
+    Arena& operator=(const Arena& other) = delete;
+    Arena& operator=(Arena&& other) = delete;
+
+    static const size_t Alignment = 16;
+
+    struct Chunk
+    {
+        Chunk* Next;
+        size_t Pages;
+    };
+
+    static_assert(sizeof(Chunk) % Alignment == 0, "Invalid size");
+
+    Chunk* ChunkList;
+    ulong Pos;
+    ulong End;
+    size_t ChunkPages;
+    size_t Usage;
+    size_t PageCount;
+    PageAllocator& PageAllocator;
+};
+
+// container allocator policy, Free is a no-op until the arena is reset
+class ArenaAllocator final
+{
+public:
+    ArenaAllocator(Arena* arena = nullptr)
+        : Arena(arena)
+    {
+    }
+
+    void* Alloc(size_t size)
+    {
+        return (Arena != nullptr) ? Arena->Alloc(size) : nullptr;
+    }
+
+    void Free(void* ptr)
+    {
+        (void)ptr;
+    }
+
+private:
+    class Arena* Arena;
+};
+
+}
+}
@@ -10,13 +10,15 @@ namespace Mm
 {
 
 BlockAllocatorImpl::BlockAllocatorImpl()
-    : Usage(0)
+    : Bitmap(nullptr)
+    , BitmapWords(0)
+    , Hint(0)
+    , Usage(0)
     , Total(0)
     , StartAddress(0)
     , EndAddress(0)
     , BlockSize(0)
 {
-    BlockList.Init();
 }
 
 bool BlockAllocatorImpl::Setup(ulong startAddress, ulong endAddress, ulong blockSize)
@@ -33,13 +35,27 @@ bool BlockAllocatorImpl::Setup(ulong startAddress, ulong endAddress, ulong block
     if ((startAddress % blockSize) != 0)
         return false;
 
+    ulong blockCount = (endAddress - startAddress) / blockSize;
+    size_t bitmapWords = (blockCount + BitsPerWord - 1) / BitsPerWord;
+    ulong bitmapBlocks = (bitmapWords * sizeof(ulong) + blockSize - 1) / blockSize;
+    if (bitmapBlocks >= blockCount)
+        return false;
+
+    // only the bitmap is touched here, blocks stay cold until allocated
+    Bitmap = reinterpret_cast<ulong*>(startAddress);
+    BitmapWords = (blockCount - bitmapBlocks + BitsPerWord - 1) / BitsPerWord;
+    Stdlib::MemSet(Bitmap, 0, BitmapWords * sizeof(ulong));
+
     BlockSize = blockSize;
-    StartAddress = EndAddress = startAddress;
-    for (ulong blockAddress = startAddress; (blockAddress + BlockSize) <= endAddress; blockAddress+= BlockSize)
+    Total = blockCount - bitmapBlocks;
+    StartAddress = startAddress + bitmapBlocks * blockSize;
+    EndAddress = StartAddress + Total * blockSize;
+    Hint = 0;
+
+    // mark tail bits beyond the last block as allocated
+    for (ulong i = Total; i < BitmapWords * BitsPerWord; i++)
     {
-        BlockList.InsertTail(reinterpret_cast<ListEntry*>(blockAddress));
-        EndAddress = blockAddress + BlockSize;
-        Total++;
+        Bitmap[i / BitsPerWord] |= ((ulong)1 << (i % BitsPerWord));
     }
 
     Trace(0, "0x%p start 0x%p end 0x%p bsize %u total %u", this, StartAddress, EndAddress, BlockSize, Total);
@@ -59,13 +75,27 @@ void* BlockAllocatorImpl::Alloc()
 {
     Stdlib::AutoLock lock(Lock);
 
-    if (BlockList.IsEmpty())
+    if (Usage == Total)
     {
         return nullptr;
     }
 
-    Usage++;
-    return BlockList.RemoveHead();
+    for (size_t i = 0; i < BitmapWords; i++)
+    {
+        size_t wordIndex = (Hint + i) % BitmapWords;
+        ulong freeBits = ~Bitmap[wordIndex];
+        if (freeBits == 0)
+            continue;
+
+        ulong bit = Stdlib::FindFirstSetBit(freeBits);
+        Bitmap[wordIndex] |= ((ulong)1 << bit);
+        Hint = wordIndex;
+        Usage++;
+        return reinterpret_cast<void*>(StartAddress + (wordIndex * BitsPerWord + bit) * BlockSize);
+    }
+
+    BugOn(true);
+    return nullptr;
 }
 
 bool BlockAllocatorImpl::IsOwner(void *block)
@@ -77,10 +107,7 @@ bool BlockAllocatorImpl::IsOwner(void *block)
     if (blockAddr >= EndAddress)
         return false;
 
-    if (blockAddr > (EndAddress - BlockSize))
-        return false;
-
-    if ((blockAddr % BlockSize) != 0)
+    if (((blockAddr - StartAddress) % BlockSize) != 0)
         return false;
 
     return true;
@@ -91,10 +118,27 @@ void BlockAllocatorImpl::Free(void *block)
     BugOn(block == nullptr);
     BugOn(!IsOwner(block));
 
+    ulong index = ((ulong)block - StartAddress) / BlockSize;
+    ulong mask = (ulong)1 << (index % BitsPerWord);
+
     Stdlib::AutoLock lock(Lock);
-    BlockList.InsertTail(reinterpret_cast<ListEntry*>(block));
+    if (BugOn(!(Bitmap[index / BitsPerWord] & mask)))
+        return;
+
+    Bitmap[index / BitsPerWord] &= ~mask;
     Usage--;
 }
 
+ulong BlockAllocatorImpl::GetUsage()
+{
+    Stdlib::AutoLock lock(Lock);
+    return Usage;
+}
+
+ulong BlockAllocatorImpl::GetTotal()
+{
+    return Total;
+}
+
 }
 }
@@ -24,15 +24,21 @@ public:
 
     void Free(void *block);
 
+    ulong GetUsage();
+    ulong GetTotal();
+
 private:
     BlockAllocatorImpl(const BlockAllocatorImpl& other) = delete;
     BlockAllocatorImpl(BlockAllocatorImpl&& other) = delete;
     BlockAllocatorImpl& operator=(const BlockAllocatorImpl& other) = delete;
     BlockAllocatorImpl& operator=(BlockAllocatorImpl&& other) = delete;
 
-    using ListEntry = Stdlib::ListEntry;
+    static const size_t BitsPerWord = 8 * sizeof(ulong);
 
-    ListEntry BlockList;
+    // set bit means allocated block, bitmap lives in the first blocks of the region
+    ulong* Bitmap;
+    size_t BitmapWords;
+    size_t Hint;
     ulong Usage;
     ulong Total;
     ulong StartAddress;
@@ -0,0 +1,93 @@
+#include "early_allocator.h"
+#include "memory_map.h"
+#include "page_table.h"
+
+#include <kernel/trace.h>
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+EarlyAllocator::EarlyAllocator()
+    : Base(0)
+    , Next(0)
+    , Limit(0)
+    , AllocCount(0)
+    , Active(false)
+    , Sealed(false)
+{
+}
+
+EarlyAllocator::~EarlyAllocator()
+{
+}
+
+bool EarlyAllocator::Setup()
+{
+    if (Active)
+        return false;
+
+    auto& mmap = MemoryMap::GetInstance();
+    auto& pt = PageTable::GetInstance();
+
+    // the ram region the kernel image ends in
+    ulong base = pt.VirtToPhys(mmap.GetKernelEnd());
+    for (size_t i = 0; i < mmap.GetRegionCount(); i++)
+    {
+        ulong start, end;
+        if (!mmap.GetAvailableRegion(i, base, BootMapEnd, start, end))
+            continue;
+
+        if (start != base)
+            continue;
+
+        Base = base;
+        Next = base;
+        Limit = Stdlib::RoundDown(end, Const::PageSize);
+        Active = true;
+        Trace(0, "Early allocator 0x%p 0x%p", Base, Limit);
+        return true;
+    }
+
+    return false;
+}
+
+void* EarlyAllocator::Alloc(size_t pageCount)
+{
+    if (!Active || Sealed || pageCount == 0)
+        return nullptr;
+
+    ulong size = pageCount * Const::PageSize;
+    if (size > Limit - Next)
+        return nullptr;
+
+    ulong phyAddr = Next;
+    Next += size;
+    AllocCount++;
+
+    void* ptr = reinterpret_cast<void*>(PageTable::GetInstance().PhysToVirt(phyAddr));
+    Stdlib::MemSet(ptr, 0, size);
+    return ptr;
+}
+
+ulong EarlyAllocator::Seal()
+{
+    Sealed = true;
+    return Next;
+}
+
+size_t EarlyAllocator::GetPageCount()
+{
+    return (Next - Base) / Const::PageSize;
+}
+
+void EarlyAllocator::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("early 0x%p pages %u allocs %u\n", Base, GetPageCount(), AllocCount);
+}
+
+}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Boot time allocator for buffers sized from the hardware. It hands out
+// zeroed pages from the ram right after the kernel image, inside the first
+// gigabyte the boot page tables map, so it works once the memory map is
+// parsed and before the page allocator exists. Seal ends it and tells the
+// page allocator where its memory begins; early pages are never freed.
+class EarlyAllocator final
+{
+public:
+    static EarlyAllocator& GetInstance()
+    {
+        static EarlyAllocator Instance;
+        return Instance;
+    }
+
+    // runs after the multiboot memory map is parsed
+    bool Setup();
+
+    // kernel virtual address of pageCount zeroed pages, nullptr if they
+    // don't fit or the allocator is sealed
+    void* Alloc(size_t pageCount);
+
+    // physical end of the early pages, Alloc fails from now on
+    ulong Seal();
+
+    size_t GetPageCount();
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    EarlyAllocator();
+    ~EarlyAllocator();
+    EarlyAllocator(const EarlyAllocator& other) = delete;
+    EarlyAllocator(EarlyAllocator&& other) = delete;
+    EarlyAllocator& operator=(const EarlyAllocator& other) = delete;
+    EarlyAllocator& operator=(EarlyAllocator&& other) = delete;
+
+    // boot64.asm maps the first gigabyte only
+    static const ulong BootMapEnd = Const::GB;
+
+    ulong Base;
+    ulong Next;
+    ulong Limit;
+    size_t AllocCount;
+    bool Active;
+    bool Sealed;
+};
+
+}
+}
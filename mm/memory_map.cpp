@@ -18,6 +18,17 @@ MemoryMap::MemoryMap()
 
 bool MemoryMap::AddRegion(u64 addr, u64 len, u32 type)
 {
+    // firmware often splits ram into adjacent entries, keep them as one
+    if (Size != 0)
+    {
+        auto& last = Region[Size - 1];
+        if (last.Type == type && last.Addr + last.Len == addr)
+        {
+            last.Len += len;
+            return true;
+        }
+    }
+
     if (Size >= Stdlib::ArraySize(Region))
         return false;
 
@@ -72,6 +83,51 @@ bool MemoryMap::FindRegion(ulong base, ulong limit, ulong& start, ulong& end)
     return false;
 }
 
+bool MemoryMap::GetAvailableRegion(size_t index, ulong base, ulong limit, ulong& start, ulong& end)
+{
+    if (index >= Size)
+        return false;
+
+    auto& region = Region[index];
+    if (region.Type != 1 || region.Len == 0)
+        return false;
+
+    start = Stdlib::Max(static_cast<ulong>(region.Addr), base);
+    end = Stdlib::Min(static_cast<ulong>(region.Addr + region.Len), limit);
+    return (start < end) ? true : false;
+}
+
+bool MemoryMap::HasAvailable(ulong start, ulong end)
+{
+    for (size_t i = 0; i < Size; i++)
+    {
+        auto& region = Region[i];
+        if (region.Type != 1 || region.Len == 0)
+            continue;
+
+        if (region.Addr < end && start < (region.Addr + region.Len))
+            return true;
+    }
+
+    return false;
+}
+
+ulong MemoryMap::GetAvailableEnd()
+{
+    ulong end = 0;
+    for (size_t i = 0; i < Size; i++)
+    {
+        auto& region = Region[i];
+        if (region.Type != 1 || region.Len == 0)
+            continue;
+
+        if ((region.Addr + region.Len) > end)
+            end = region.Addr + region.Len;
+    }
+
+    return end;
+}
+
 MemoryMap::~MemoryMap()
 {
 }
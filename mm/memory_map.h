@@ -1,6 +1,7 @@
 #pragma once
 
 #include <include/types.h>
+#include <include/const.h>
 #include <boot/grub.h>
 
 namespace Kernel
@@ -24,6 +25,10 @@ public:
 
     bool FindRegion(ulong base, ulong limit, ulong& start, ulong& end);
 
+    // available ram of region index clipped to [base, limit), false if the
+    // region isn't ram or nothing of it is left
+    bool GetAvailableRegion(size_t index, ulong base, ulong limit, ulong& start, ulong& end);
+
     ulong GetKernelStart();
 
     ulong GetKernelEnd();
@@ -32,10 +37,31 @@ public:
 
     bool GetRegion(size_t index, u64& addr, u64& len, u32& type);
 
+    // true if [start, end) overlaps any available ram region
+    bool HasAvailable(ulong start, ulong end);
+
+    ulong GetAvailableEnd();
+
     static const ulong KernelSpaceBase = 0xFFFF800000000000;
 
     static const ulong UserSpaceMax = 0x00007FFFFFFFFFFF;
 
+    // user ranges end one page below the canonical limit, so a syscall
+    // from the top user page can't return to a non canonical rip
+    static const ulong UserSpaceEnd = UserSpaceMax + 1 - Const::PageSize;
+
+    // user address spaces map from here, the first top level entry below is
+    // the kernel's low identity map
+    static const ulong UserSpaceBase = 512 * Const::GB;
+
+    // task stacks are mapped page by page from here, see StackAllocator
+    static const ulong StackSpaceBase = KernelSpaceBase + 1024 * Const::GB;
+    static const ulong StackSpaceSize = Const::GB;
+
+    // Vmalloc areas, mapped page by page
+    static const ulong VmallocSpaceBase = KernelSpaceBase + 1536 * Const::GB;
+    static const ulong VmallocSpaceSize = 256 * Const::GB;
+
 private:
     MemoryMap(const MemoryMap& other) = delete;
     MemoryMap(MemoryMap&& other) = delete;
@@ -52,7 +78,9 @@ private:
         u32 Type;
     };
 
-    MemoryRegion Region[64];
+    static const size_t MaxRegions = 128;
+
+    MemoryRegion Region[MaxRegions];
     size_t Size;
 };
 
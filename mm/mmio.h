@@ -24,6 +24,19 @@ public:
         Trace(MmIoLL, "MmIo write 0x%p value 0x%p", addr, (ulong)value);
         *reinterpret_cast<volatile u32 *>(addr) = value;
     }
+
+    static u64 Read64(void *addr)
+    {
+        u64 result = *reinterpret_cast<volatile u64 *>(addr);
+        Trace(MmIoLL, "MmIo read 0x%p result 0x%p", addr, result);
+        return result;
+    }
+
+    static void Write64(void *addr, u64 value)
+    {
+        Trace(MmIoLL, "MmIo write 0x%p value 0x%p", addr, value);
+        *reinterpret_cast<volatile u64 *>(addr) = value;
+    }
 };
 
 }
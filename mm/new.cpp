@@ -11,10 +11,15 @@ namespace Kernel
 namespace Mm
 {
 
-void* New(size_t size) noexcept
+void* New(size_t size, void* caller) noexcept
 {
+	return AllocatorImpl::GetInstance(PageAllocatorImpl::GetInstance()).Alloc(size, caller);
+}
 
-	return AllocatorImpl::GetInstance(PageAllocatorImpl::GetInstance()).Alloc(size);
+void* NewAligned(size_t size, size_t align) noexcept
+{
+	return AllocatorImpl::GetInstance(PageAllocatorImpl::GetInstance()).AllocAligned(size, align,
+		__builtin_return_address(0));
 }
 
 void Delete(void* ptr) noexcept
@@ -27,12 +32,12 @@ void Delete(void* ptr) noexcept
 
 void* operator new(size_t size) noexcept
 {
-	return Kernel::Mm::New(size);
+	return Kernel::Mm::New(size, __builtin_return_address(0));
 }
 
 void* operator new[](size_t size) noexcept
 {
-	return Kernel::Mm::New(size);
+	return Kernel::Mm::New(size, __builtin_return_address(0));
 }
 
 void operator delete(void* ptr) noexcept
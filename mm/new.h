@@ -2,8 +2,33 @@
 
 #include <include/types.h>
 
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// for classes aligned past what operator new guarantees, e.g. to a cache
+// line; the block is released by the usual delete
+void* NewAligned(size_t size, size_t align) noexcept;
+
+}
+}
+
 void* operator new(size_t size) noexcept;
 void* operator new[](size_t size) noexcept;
 
 void operator delete(void* ptr) noexcept;
 void operator delete[](void* ptr) noexcept;
+
+inline void* operator new(size_t size, void* ptr) noexcept
+{
+	(void)size;
+	return ptr;
+}
+
+inline void operator delete(void* ptr, void* place) noexcept
+{
+	(void)ptr;
+	(void)place;
+}
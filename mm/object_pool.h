@@ -0,0 +1,272 @@
+#pragma once
+
+#include "pool.h"
+#include "new.h"
+
+#include <include/const.h>
+#include <kernel/per_cpu.h>
+#include <kernel/cpu.h>
+#include <kernel/preempt.h>
+#include <kernel/atomic.h>
+#include <kernel/asm.h>
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Slab of exact size slots for one type. Slots are sizeof(T) rounded up to
+// its alignment, with no per block header, and the pool magazines give
+// every cpu its own freelist, so a New/Delete pair is a magazine pop/push
+// and the constructor call. Containers whose node type is internal, like
+// LinkedList and Btree, get the same slabs through a PoolAllocator.
+template<typename T>
+class ObjectPool final
+{
+public:
+    static ObjectPool& GetInstance()
+    {
+        static ObjectPool Instance;
+        return Instance;
+    }
+
+    static const size_t SlotAlign = (alignof(T) > sizeof(ulong)) ? alignof(T) : sizeof(ulong);
+    static const size_t SlotSize = ((sizeof(T) + SlotAlign - 1) / SlotAlign) * SlotAlign;
+
+    // raw slots for class operator new/delete
+    void* AllocSlot()
+    {
+        return Slots.Alloc();
+    }
+
+    void FreeSlot(void* ptr)
+    {
+        Slots.Free(ptr);
+    }
+
+    template<typename... Args>
+    T* New(Args&&... args)
+    {
+        void* slot = Slots.Alloc();
+        if (slot == nullptr)
+            return nullptr;
+
+        return new (slot) T(Stdlib::Forward<Args>(args)...);
+    }
+
+    void Delete(T* obj)
+    {
+        if (obj == nullptr)
+            return;
+
+        obj->~T();
+        Slots.Free(obj);
+    }
+
+    void GetStats(Pool::PoolStats& stats)
+    {
+        Slots.GetStats(stats);
+    }
+
+private:
+    // slots start after the 64 byte slab header, so alignment up to a
+    // cache line holds for every slot
+    static_assert(alignof(T) <= Const::CacheLineSize, "Invalid alignment");
+    static_assert(sizeof(Stdlib::ListEntry) <= SlotSize, "Invalid size");
+    static_assert(SlotSize < Const::PageSize - Const::CacheLineSize, "Invalid size");
+
+    ObjectPool()
+    {
+        Slots.Setup(SlotSize, &PageAllocatorImpl::GetInstance());
+    }
+
+    ~ObjectPool()
+    {
+    }
+
+    ObjectPool(const ObjectPool& other) = delete;
+    ObjectPool(ObjectPool&& other) = delete;
+    ObjectPool& operator=(const ObjectPool& other) = delete;
+    ObjectPool& operator=(ObjectPool&& other) = delete;
+
+    Pool Slots;
+};
+
+// Object pool that keeps constructed objects between uses. Delete calls
+// Recycle, which resets the object but keeps what its constructor set up
+// (buffers, registered locks), and parks it in a per-cpu cache; New hands
+// a cached object back without constructing it. Objects overflowing the
+// cache are destroyed and their slot goes back to the pool.
+template<typename T>
+class CachedObjectPool final
+{
+public:
+    static CachedObjectPool& GetInstance()
+    {
+        static CachedObjectPool Instance;
+        return Instance;
+    }
+
+    // a default constructed or recycled object, nullptr if out of memory
+    T* New()
+    {
+        T* obj = Pop();
+        if (obj != nullptr)
+        {
+            Hits.Inc();
+            return obj;
+        }
+
+        return ObjectPool<T>::GetInstance().New();
+    }
+
+    void Delete(T* obj)
+    {
+        if (obj == nullptr)
+            return;
+
+        obj->Recycle();
+        if (!Push(obj))
+            ObjectPool<T>::GetInstance().Delete(obj);
+    }
+
+    // destroys the objects cached by the current cpu, returns how many
+    size_t Drain()
+    {
+        size_t count = 0;
+        for (;;)
+        {
+            T* obj = Pop();
+            if (obj == nullptr)
+                break;
+
+            ObjectPool<T>::GetInstance().Delete(obj);
+            count++;
+        }
+        return count;
+    }
+
+    // destroys the objects cached by every cpu, returns how many. Each cpu
+    // hands over its cache from a call, the objects are destroyed here, so
+    // it runs in task context with interrupts enabled
+    size_t DrainAll()
+    {
+        if (!PreemptIsOn())
+            return 0;
+
+        auto& cpus = CpuTable::GetInstance();
+        CpuMask running = cpus.GetRunningCpus();
+        size_t count = 0;
+        for (ulong cpu = running.First(); cpu < MaxCpus; cpu = running.Next(cpu + 1))
+        {
+            TakeBatch batch;
+            batch.Owner = this;
+            batch.Count = 0;
+            if (!cpus.CallFunction(cpu, &CachedObjectPool::TakeCpuCache, &batch))
+                continue;
+
+            for (size_t i = 0; i < batch.Count; i++)
+                ObjectPool<T>::GetInstance().Delete(batch.Obj[i]);
+            count += batch.Count;
+        }
+        return count;
+    }
+
+    // objects parked in the caches of all cpus
+    size_t GetCachedCount()
+    {
+        return static_cast<size_t>(Cached.Get());
+    }
+
+    ulong GetHits()
+    {
+        return Hits.Get();
+    }
+
+    static const size_t CpuCacheSize = 8;
+
+private:
+    CachedObjectPool()
+    {
+        Stdlib::MemSet(Cache, 0, sizeof(Cache));
+    }
+
+    ~CachedObjectPool()
+    {
+    }
+
+    CachedObjectPool(const CachedObjectPool& other) = delete;
+    CachedObjectPool(CachedObjectPool&& other) = delete;
+    CachedObjectPool& operator=(const CachedObjectPool& other) = delete;
+    CachedObjectPool& operator=(CachedObjectPool&& other) = delete;
+
+    struct CpuCache
+    {
+        T* Obj[CpuCacheSize];
+        size_t Count;
+    };
+
+    struct TakeBatch
+    {
+        CachedObjectPool* Owner;
+        T* Obj[CpuCacheSize];
+        size_t Count;
+    };
+
+    static void TakeCpuCache(void* ctx)
+    {
+        auto batch = static_cast<TakeBatch*>(ctx);
+        T* obj;
+        while (batch->Count < CpuCacheSize && (obj = batch->Owner->Pop()) != nullptr)
+            batch->Obj[batch->Count++] = obj;
+    }
+
+    // before preemption is on only the boot cpu runs and it has no per-cpu
+    // area, so it goes straight to the pool. With interrupts off the task
+    // can't be preempted, so it stays on the cpu of the cache
+    T* Pop()
+    {
+        if (!PreemptIsOn())
+            return nullptr;
+
+        T* obj = nullptr;
+        ulong flags = GetRflags();
+        InterruptDisable();
+        auto& cache = Cache[GetPerCpuIndex()];
+        if (cache.Count != 0)
+        {
+            obj = cache.Obj[--cache.Count];
+            Cached.Dec();
+        }
+        SetRflags(flags);
+        return obj;
+    }
+
+    bool Push(T* obj)
+    {
+        if (!PreemptIsOn())
+            return false;
+
+        bool cached = false;
+        ulong flags = GetRflags();
+        InterruptDisable();
+        auto& cache = Cache[GetPerCpuIndex()];
+        if (cache.Count < CpuCacheSize)
+        {
+            cache.Obj[cache.Count++] = obj;
+            Cached.Inc();
+            cached = true;
+        }
+        SetRflags(flags);
+        return cached;
+    }
+
+    CpuCache Cache[MaxCpus];
+    Atomic Cached;
+    Atomic Hits;
+};
+
+}
+}
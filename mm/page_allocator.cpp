@@ -3,67 +3,609 @@
 #include <include/const.h>
 #include <kernel/panic.h>
 #include <kernel/trace.h>
+#include <kernel/preempt.h>
+#include <kernel/per_cpu.h>
+#include <kernel/asm.h>
 #include <lib/list_entry.h>
 
+#include "shrinker.h"
+
 namespace Kernel
 {
 
 namespace Mm
 {
 
-PageAllocatorImpl::PageAllocatorImpl()
+// movnti writes around the caches and needs no fpu state, the sfence
+// orders the zeroes before the page is handed out
+static inline void ZeroPageNonTemporal(void* page)
 {
+    ulong* word = static_cast<ulong*>(page);
+
+    for (size_t i = 0; i < Const::PageSize / sizeof(ulong); i += 4)
+    {
+        asm volatile (
+            "movnti %4, %0\n"
+            "movnti %4, %1\n"
+            "movnti %4, %2\n"
+            "movnti %4, %3\n"
+            : "=m"(word[i]), "=m"(word[i + 1]), "=m"(word[i + 2]), "=m"(word[i + 3])
+            : "r"(0UL));
+    }
+
+    asm volatile ("sfence" : : : "memory");
 }
 
-bool PageAllocatorImpl::Setup(ulong startAddress, ulong endAddress)
+PageAllocatorImpl::Zone::Zone()
+    : PageState(nullptr)
+    , Base(0)
+    , BasePfn(0)
+    , TotalPages(0)
+    , FreePages(0)
+    , LowWatermark(0)
+    , Node(0)
 {
-    Trace(0, "Setup start 0x%p end 0x%p", startAddress, endAddress);
+    for (size_t i = 0; i < Stdlib::ArraySize(FreeList); i++)
+    {
+        FreeList[i].Init();
+        FreeCount[i] = 0;
+    }
+}
+
+bool PageAllocatorImpl::Zone::Setup(ulong startAddress, ulong endAddress, ulong node)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    if (BugOn(TotalPages != 0))
+        return false;
+
+    startAddress = Stdlib::RoundUp(startAddress, Const::PageSize);
+    endAddress &= ~(Const::PageSize - 1);
+    if (endAddress <= startAddress)
+        return false;
+
+    // page state array lives at the start of the region
+    size_t pageCount = (endAddress - startAddress) / Const::PageSize;
+    size_t statePages = Stdlib::SizeInPages(pageCount);
+    if (statePages >= pageCount)
+        return false;
+
+    Node = node;
+    PageState = reinterpret_cast<u8*>(startAddress);
+    Base = startAddress + statePages * Const::PageSize;
+    TotalPages = pageCount - statePages;
+    LowWatermark = TotalPages / LowWatermarkDivisor;
+    Stdlib::MemSet(PageState, 0, TotalPages);
 
-    BugOn(endAddress <= startAddress);
-    size_t sizePerBalloc = (endAddress - startAddress) / Stdlib::ArraySize(Balloc);
-    for (size_t i = 0; i < Stdlib::ArraySize(Balloc); i++)
+    // blocks are naturally aligned by address, e.g. task stacks rely on it
+    BasePfn = Base / Const::PageSize;
+    size_t pageIndex = 0;
+    while (pageIndex < TotalPages)
     {
-        ulong start = startAddress + i * sizePerBalloc;
-        ulong blockSize = ((ulong)1 << i) * Const::PageSize;
-        if (!Balloc[i].Setup(Stdlib::RoundUp(start, blockSize), start + sizePerBalloc, blockSize))
+        size_t order = MaxOrder;
+        while (((BasePfn + pageIndex) & ((static_cast<size_t>(1) << order) - 1)) != 0 ||
+            (pageIndex + (static_cast<size_t>(1) << order)) > TotalPages)
         {
-            return false;
+            order--;
         }
+
+        InsertFree(pageIndex, order);
+        pageIndex += static_cast<size_t>(1) << order;
     }
 
+    Trace(0, "Zone base 0x%p pages %u node %u", Base, TotalPages, Node);
     return true;
 }
 
+Stdlib::ListEntry* PageAllocatorImpl::Zone::PageToEntry(size_t pageIndex)
+{
+    return reinterpret_cast<ListEntry*>(Base + pageIndex * Const::PageSize);
+}
+
+size_t PageAllocatorImpl::Zone::EntryToPage(ListEntry* entry)
+{
+    return (reinterpret_cast<ulong>(entry) - Base) / Const::PageSize;
+}
+
+void PageAllocatorImpl::Zone::InsertFree(size_t pageIndex, size_t order)
+{
+    PageState[pageIndex] = StateHead | StateFree | order;
+    FreeList[order].InsertTail(PageToEntry(pageIndex));
+    FreeCount[order]++;
+    FreePages += static_cast<size_t>(1) << order;
+}
+
+void PageAllocatorImpl::Zone::RemoveFree(size_t pageIndex, size_t order)
+{
+    PageToEntry(pageIndex)->RemoveInit();
+    PageState[pageIndex] = 0;
+    FreeCount[order]--;
+    FreePages -= static_cast<size_t>(1) << order;
+}
+
+bool PageAllocatorImpl::Zone::Contains(void* pages)
+{
+    ulong addr = reinterpret_cast<ulong>(pages);
+    return (addr >= Base && addr < (Base + TotalPages * Const::PageSize)) ? true : false;
+}
+
+size_t PageAllocatorImpl::Zone::GetOrder(void* pages)
+{
+    // caller owns the block, so its state can't change under us
+    u8 state = PageState[(reinterpret_cast<ulong>(pages) - Base) / Const::PageSize];
+    if ((state & (StateHead | StateFree)) != StateHead)
+        return MaxOrder + 1;
+
+    return state & StateOrderMask;
+}
+
+void* PageAllocatorImpl::Zone::Alloc(size_t order)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    size_t currOrder = order;
+    while (currOrder <= MaxOrder && FreeList[currOrder].IsEmpty())
+    {
+        currOrder++;
+    }
+
+    if (currOrder > MaxOrder)
+        return nullptr;
+
+    size_t pageIndex = EntryToPage(FreeList[currOrder].Flink);
+    RemoveFree(pageIndex, currOrder);
+
+    // give back upper halves until the block has the requested order
+    while (currOrder > order)
+    {
+        currOrder--;
+        InsertFree(pageIndex + (static_cast<size_t>(1) << currOrder), currOrder);
+    }
+
+    PageState[pageIndex] = StateHead | order;
+    return PageToEntry(pageIndex);
+}
+
+void PageAllocatorImpl::Zone::Free(void* pages)
+{
+    ulong addr = reinterpret_cast<ulong>(pages);
+
+    Stdlib::AutoLock lock(Lock);
+
+    size_t pageIndex = (addr - Base) / Const::PageSize;
+    u8 state = PageState[pageIndex];
+    if ((state & (StateHead | StateFree)) != StateHead)
+    {
+        Panic("Can't free pages 0x%p state 0x%p", pages, (ulong)state);
+        return;
+    }
+
+    size_t order = state & StateOrderMask;
+    PageState[pageIndex] = 0;
+
+    while (order < MaxOrder)
+    {
+        size_t buddyIndex = ((BasePfn + pageIndex) ^ (static_cast<size_t>(1) << order)) - BasePfn;
+        if (buddyIndex >= TotalPages || PageState[buddyIndex] != (StateHead | StateFree | order))
+            break;
+
+        RemoveFree(buddyIndex, order);
+        pageIndex = Stdlib::Min(pageIndex, buddyIndex);
+        order++;
+    }
+
+    InsertFree(pageIndex, order);
+}
+
+PageAllocatorImpl::PageAllocatorImpl()
+    : ZoneCount(0)
+{
+    for (size_t i = 0; i < MaxNodes; i++)
+    {
+        for (size_t j = 0; j < MaxNodes; j++)
+        {
+            NodeDistance[i][j] = (i == j) ? 10 : 20;
+        }
+    }
+
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuHotList); i++)
+    {
+        CpuHotList[i].Count = 0;
+    }
+
+    for (size_t i = 0; i < Stdlib::ArraySize(NodeZeroPool); i++)
+    {
+        NodeZeroPool[i].Count = 0;
+    }
+}
+
 PageAllocatorImpl::~PageAllocatorImpl()
 {
     Trace(0, "0x%p dtor", this);
 }
 
+bool PageAllocatorImpl::Setup(ulong startAddress, ulong endAddress, ulong node)
+{
+    Trace(0, "Setup start 0x%p end 0x%p node %u", startAddress, endAddress, node);
+
+    // zones are added during boot on a single cpu
+    if (ZoneCount >= Stdlib::ArraySize(Zones) || node >= MaxNodes)
+        return false;
+
+    auto& zone = Zones[ZoneCount];
+    if (!zone.Setup(startAddress, endAddress, node))
+        return false;
+
+    size_t pos = ZoneCount;
+    while (pos > 0 && SortedZones[pos - 1]->Base > zone.Base)
+    {
+        SortedZones[pos] = SortedZones[pos - 1];
+        pos--;
+    }
+    SortedZones[pos] = &zone;
+
+    ZoneCount++;
+    return true;
+}
+
+void PageAllocatorImpl::SetNodeDistance(ulong fromNode, ulong toNode, u8 distance)
+{
+    if (fromNode >= MaxNodes || toNode >= MaxNodes)
+        return;
+
+    NodeDistance[fromNode][toNode] = distance;
+}
+
+PageAllocatorImpl::Zone* PageAllocatorImpl::LookupZone(void* pages)
+{
+    ulong addr = reinterpret_cast<ulong>(pages);
+
+    // last zone with base <= addr
+    size_t lo = 0, hi = ZoneCount;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (SortedZones[mid]->Base <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || !SortedZones[lo - 1]->Contains(pages))
+        return nullptr;
+
+    return SortedZones[lo - 1];
+}
+
+void* PageAllocatorImpl::AllocFromZone(Zone& zone, size_t order)
+{
+    void* pages = zone.Alloc(order);
+
+    // caches shrink in the background before allocations start failing
+    if (pages != nullptr && zone.FreePages < zone.LowWatermark)
+        ShrinkerTable::GetInstance().Kick();
+
+    return pages;
+}
+
+void* PageAllocatorImpl::AllocFromNode(size_t order, ulong node)
+{
+    for (size_t i = 0; i < ZoneCount; i++)
+    {
+        if (Zones[i].Node != node)
+            continue;
+
+        void* pages = AllocFromZone(Zones[i], order);
+        if (pages != nullptr)
+            return pages;
+    }
+
+    // fall back to remote zones, nearest first
+    u8 minDistance = 0;
+    for (;;)
+    {
+        u8 nextDistance = 0xFF;
+        for (size_t i = 0; i < ZoneCount; i++)
+        {
+            u8 distance = NodeDistance[node][Zones[i].Node];
+            if (Zones[i].Node != node && distance > minDistance && distance < nextDistance)
+                nextDistance = distance;
+        }
+
+        if (nextDistance == 0xFF)
+            return nullptr;
+
+        for (size_t i = 0; i < ZoneCount; i++)
+        {
+            if (Zones[i].Node == node || NodeDistance[node][Zones[i].Node] != nextDistance)
+                continue;
+
+            void* pages = AllocFromZone(Zones[i], order);
+            if (pages != nullptr)
+                return pages;
+        }
+
+        minDistance = nextDistance;
+    }
+}
+
+void PageAllocatorImpl::RefillHotList(HotList& hotList, ulong node)
+{
+    while (hotList.Count < HotListBatch)
+    {
+        void* page = AllocFromNode(0, node);
+        if (page == nullptr)
+            break;
+
+        hotList.Page[hotList.Count++] = page;
+    }
+}
+
+void PageAllocatorImpl::FlushHotList(HotList& hotList, size_t count)
+{
+    while (count != 0 && hotList.Count != 0)
+    {
+        void* page = hotList.Page[--hotList.Count];
+        LookupZone(page)->Free(page);
+        count--;
+    }
+}
+
 void* PageAllocatorImpl::Alloc(size_t numPages)
 {
     BugOn(numPages == 0);
 
-    size_t log = Stdlib::Log2(numPages);
-    if (log >= Stdlib::ArraySize(Balloc))
+    size_t order = Stdlib::Log2(numPages);
+    if (order > MaxOrder)
+    {
+        AllocFailures.Inc();
         return nullptr;
+    }
+
+    void* pages = AllocPages(order);
+
+    // let caches give memory back before failing, but not from interrupt
+    // context or with interrupts off, the caller may hold any lock then
+    if (pages == nullptr && PreemptIsOn() && IsInterruptEnabled())
+    {
+        size_t count = ShrinkerTable::ReclaimBatch;
+        count = Stdlib::Max(count, static_cast<size_t>(1) << order);
+        if (ShrinkerTable::GetInstance().Shrink(count) != 0)
+        {
+            Shrinks.Inc();
+            pages = AllocPages(order);
+        }
+    }
+
+    if (pages == nullptr)
+        AllocFailures.Inc();
+
+    TraceFast(PageAllocatorLL, "Alloc pages %u order %u page 0x%p", numPages, order, pages);
+    return pages;
+}
+
+void* PageAllocatorImpl::AllocPages(size_t order)
+{
+    void* pages = AllocFree(order);
+
+    // the zero pools are free memory too
+    for (ulong node = 0; pages == nullptr && order == 0 && node < MaxNodes; node++)
+        pages = TakeZeroPage(node);
+
+    return pages;
+}
+
+void* PageAllocatorImpl::AllocFree(size_t order)
+{
+    void* pages;
+    if (PreemptIsOn())
+    {
+        ulong flags = GetRflags();
+        InterruptDisable();
+
+        ulong node = GetPerCpuNode();
+        if (order == 0)
+        {
+            auto& hotList = CpuHotList[GetPerCpuIndex()];
+            if (hotList.Count == 0)
+                RefillHotList(hotList, node);
+
+            pages = (hotList.Count != 0) ? hotList.Page[--hotList.Count] : nullptr;
+        }
+        else
+        {
+            pages = AllocFromNode(order, node);
+        }
+
+        SetRflags(flags);
+    }
+    else
+    {
+        pages = AllocFromNode(order, 0);
+    }
+
+    return pages;
+}
+
+void* PageAllocatorImpl::TakeZeroPage(ulong node)
+{
+    auto& pool = NodeZeroPool[node];
+    void* page = nullptr;
+
+    ulong flags = GetRflags();
+    InterruptDisable();
+    {
+        Stdlib::AutoLock lock(pool.Lock);
+        if (pool.Count != 0)
+            page = pool.Page[--pool.Count];
+    }
+    SetRflags(flags);
+
+    return page;
+}
+
+bool PageAllocatorImpl::PutZeroPage(void* page, ulong node)
+{
+    auto& pool = NodeZeroPool[node];
+    bool put = false;
+
+    ulong flags = GetRflags();
+    InterruptDisable();
+    {
+        Stdlib::AutoLock lock(pool.Lock);
+        if (pool.Count < ZeroPoolSize)
+        {
+            pool.Page[pool.Count++] = page;
+            put = true;
+        }
+    }
+    SetRflags(flags);
+
+    return put;
+}
+
+void* PageAllocatorImpl::AllocZeroed(size_t numPages)
+{
+    if (numPages == 1 && PreemptIsOn())
+    {
+        void* page = TakeZeroPage(GetPerCpuNode());
+        if (page != nullptr)
+        {
+            ZeroPoolHits.Inc();
+            return page;
+        }
+    }
+
+    void* pages = Alloc(numPages);
+    if (pages != nullptr)
+        Stdlib::MemSet(pages, 0, numPages * Const::PageSize);
+
+    return pages;
+}
+
+bool PageAllocatorImpl::FillZeroPool()
+{
+    if (!PreemptIsOn())
+        return false;
+
+    ulong node = GetPerCpuNode();
+    for (size_t i = 0; i < ZeroPoolFillBatch; i++)
+    {
+        if (NodeZeroPool[node].Count >= ZeroPoolSize)
+            return (i != 0) ? true : false;
+
+        // only free pages, one from a zero pool is zeroed already and
+        // taking it would keep idle cpus busy while memory is exhausted.
+        // Pages of remote nodes are not worth zeroing for this one
+        void* page = AllocFree(0);
+        if (page == nullptr)
+            return (i != 0) ? true : false;
 
-    return Balloc[log].Alloc();
+        if (LookupZone(page)->Node != node)
+        {
+            Free(page);
+            return (i != 0) ? true : false;
+        }
+
+        ZeroPageNonTemporal(page);
+        if (!PutZeroPage(page, node))
+        {
+            Free(page);
+            return (i != 0) ? true : false;
+        }
+    }
+
+    return true;
 }
 
 void PageAllocatorImpl::Free(void* pages)
 {
-    for (size_t i = 0; i < Stdlib::ArraySize(Balloc); i++)
+    auto zone = LookupZone(pages);
+    if (zone == nullptr || (reinterpret_cast<ulong>(pages) & (Const::PageSize - 1)) != 0)
     {
-        auto& balloc = Balloc[i];
-        if (balloc.IsOwner(pages))
+        Panic("Can't free pages 0x%p", pages);
+        return;
+    }
+
+    if (PreemptIsOn() && zone->GetOrder(pages) == 0)
+    {
+        ulong flags = GetRflags();
+        InterruptDisable();
+
+        // keep only pages of the local node hot
+        if (zone->Node == GetPerCpuNode())
         {
-            balloc.Free(pages);
+            auto& hotList = CpuHotList[GetPerCpuIndex()];
+            if (hotList.Count == HotListSize)
+                FlushHotList(hotList, HotListBatch);
+
+            hotList.Page[hotList.Count++] = pages;
+            SetRflags(flags);
             return;
         }
+
+        SetRflags(flags);
     }
 
-    Panic("Can't free pages 0x%p", pages);
+    zone->Free(pages);
 }
 
+size_t PageAllocatorImpl::GetFreePages()
+{
+    size_t freePages = 0;
+
+    for (size_t i = 0; i < ZoneCount; i++)
+    {
+        Stdlib::AutoLock lock(Zones[i].Lock);
+        freePages += Zones[i].FreePages;
+    }
+
+    // hot pages are free too, the counts are a snapshot
+    for (size_t i = 0; i < Stdlib::ArraySize(CpuHotList); i++)
+    {
+        freePages += CpuHotList[i].Count;
+    }
+
+    for (size_t i = 0; i < Stdlib::ArraySize(NodeZeroPool); i++)
+    {
+        freePages += NodeZeroPool[i].Count;
+    }
+
+    return freePages;
+}
+
+size_t PageAllocatorImpl::GetTotalPages()
+{
+    size_t totalPages = 0;
+
+    for (size_t i = 0; i < ZoneCount; i++)
+    {
+        totalPages += Zones[i].TotalPages;
+    }
+
+    return totalPages;
+}
+
+void PageAllocatorImpl::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("pages total %u free %u failures %u shrinks %u\n",
+        GetTotalPages(), GetFreePages(), (ulong)AllocFailures.Get(), (ulong)Shrinks.Get());
+
+    for (size_t i = 0; i < Stdlib::ArraySize(NodeZeroPool); i++)
+    {
+        if (NodeZeroPool[i].Count != 0)
+            printer.Printf("zero pool node %u pages %u\n", i, NodeZeroPool[i].Count);
+    }
+    printer.Printf("zero pool hits %u\n", (ulong)ZeroPoolHits.Get());
+
+    for (size_t i = 0; i < ZoneCount; i++)
+    {
+        auto& zone = *SortedZones[i];
+        Stdlib::AutoLock lock(zone.Lock);
+        printer.Printf("zone 0x%p node %u total %u free %u\n",
+            zone.Base, zone.Node, zone.TotalPages, zone.FreePages);
+    }
+}
+
+}
 }
-}
\ No newline at end of file
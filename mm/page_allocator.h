@@ -2,9 +2,12 @@
 
 #include <include/const.h>
 #include <kernel/spin_lock.h>
+#include <kernel/cpu.h>
+#include <kernel/atomic.h>
+#include <lib/printer.h>
 #include <lib/list_entry.h>
 
-#include "block_allocator.h"
+#include <lib/stdlib.h>
 
 namespace Kernel
 {
@@ -16,6 +19,8 @@ class PageAllocator
 {
 public:
     virtual void* Alloc(size_t numPages) = 0;
+    // same, the pages are filled with zeroes
+    virtual void* AllocZeroed(size_t numPages) = 0;
     virtual void Free(void* ptr) = 0;
 };
 
@@ -28,11 +33,28 @@ public:
 		return Instance;
 	}
 
-    bool Setup(ulong startAddress, ulong endAddress);
+    // adds a zone of memory which belongs to the node, zones may come in
+    // any order and leave holes between them
+    bool Setup(ulong startAddress, ulong endAddress, ulong node = 0);
+
+    void SetNodeDistance(ulong fromNode, ulong toNode, u8 distance);
 
     virtual void* Alloc(size_t numPages) override;
+    // single pages come from the node's pool of pages zeroed while idle
+    virtual void* AllocZeroed(size_t numPages) override;
     virtual void Free(void* pages) override;
 
+    // zeroes a few pages into the pool of the current cpu node, called by
+    // the idle loop, false once the pool is full
+    bool FillZeroPool();
+
+    size_t GetFreePages();
+    size_t GetTotalPages();
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t MaxNodes = 8;
+
 private:
     PageAllocatorImpl();
     virtual ~PageAllocatorImpl();
@@ -42,11 +64,98 @@ private:
     PageAllocatorImpl& operator=(const PageAllocatorImpl& other) = delete;
     PageAllocatorImpl& operator=(PageAllocatorImpl&& other) = delete;
 
-    static const size_t PageLogLimit = 4;
+    using ListEntry = Stdlib::ListEntry;
+
+    static const size_t MaxOrder = 18;
+    // a zone per ram region and node, e820 maps of big hosts have dozens
+    static const size_t MaxZones = 64;
+
+    // per page state byte, only the first page of a block is marked
+    static const u8 StateHead = 0x40;
+    static const u8 StateFree = 0x80;
+    static const u8 StateOrderMask = 0x3F;
+
+    // buddy allocator over one contiguous range of a node
+    struct Zone final
+    {
+        Zone();
+
+        bool Setup(ulong startAddress, ulong endAddress, ulong node);
+
+        void* Alloc(size_t order);
+        void Free(void* pages);
 
-    BlockAllocatorImpl Balloc[PageLogLimit];
+        bool Contains(void* pages);
+        size_t GetOrder(void* pages);
 
+        ListEntry* PageToEntry(size_t pageIndex);
+        size_t EntryToPage(ListEntry* entry);
+
+        void InsertFree(size_t pageIndex, size_t order);
+        void RemoveFree(size_t pageIndex, size_t order);
+
+        ListEntry FreeList[MaxOrder + 1];
+        size_t FreeCount[MaxOrder + 1];
+        u8* PageState;
+        ulong Base;
+        size_t BasePfn;
+        size_t TotalPages;
+        size_t FreePages;
+        // below it allocations kick the shrinkers
+        size_t LowWatermark;
+        ulong Node;
+        SpinLock Lock;
+    };
+
+    static const size_t LowWatermarkDivisor = 16;
+
+    static const size_t HotListSize = 32;
+    static const size_t HotListBatch = HotListSize / 2;
+
+    // per cpu cache of single pages of the cpu node, only touched by its
+    // cpu with interrupts disabled
+    struct HotList final
+    {
+        size_t Count;
+        void* Page[HotListSize];
+    };
+
+    static const size_t ZeroPoolSize = 64;
+    // pages zeroed per FillZeroPool call, keeps the idle loop responsive
+    static const size_t ZeroPoolFillBatch = 4;
+
+    // free pages of a node that are already zeroed, filled with non
+    // temporal stores so idle cpus don't evict the caches of busy ones
+    struct ZeroPool final
+    {
+        SpinLock Lock;
+        size_t Count;
+        void* Page[ZeroPoolSize];
+    };
+
+    Zone* LookupZone(void* pages);
+    void* TakeZeroPage(ulong node);
+    bool PutZeroPage(void* page, ulong node);
+    void* AllocPages(size_t order);
+    // the zones and the hot lists, but not the zero pools
+    void* AllocFree(size_t order);
+    void* AllocFromZone(Zone& zone, size_t order);
+    void* AllocFromNode(size_t order, ulong node);
+    void RefillHotList(HotList& hotList, ulong node);
+    void FlushHotList(HotList& hotList, size_t count);
+
+    Zone Zones[MaxZones];
+    // zones sorted by base, so LookupZone can bisect
+    Zone* SortedZones[MaxZones];
+    size_t ZoneCount;
+    u8 NodeDistance[MaxNodes][MaxNodes];
+    HotList CpuHotList[MaxCpus];
+    ZeroPool NodeZeroPool[MaxNodes];
+    Atomic AllocFailures;
+    // failed allocations retried after the shrinkers freed pages
+    Atomic Shrinks;
+    Atomic ZeroPoolHits;
 };
 
 }
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #include "page_table.h"
 #include "memory_map.h"
+#include "page_allocator.h"
+#include "early_allocator.h"
 
 #include <kernel/trace.h>
 #include <kernel/asm.h>
@@ -10,21 +12,17 @@ namespace Kernel
 namespace Mm
 {
 
-// N pages
-// N * sizeof(page)
-// N * 8 = sizeof page entries
-
 PageTable::PageTable()
-    : Pages(nullptr)
-    , PageCount(0)
-    , State(1)
+    : State(1)
+    , DirectMapEnd(0)
+    , P2KernelPage(nullptr)
+    , P2KernelPageCount(0)
 {
     Stdlib::MemSet(&P4Page, 0, sizeof(P4Page));
 
     Stdlib::MemSet(&P3KernelPage, 0, sizeof(P3KernelPage));
     Stdlib::MemSet(&P3UserPage, 0, sizeof(P3UserPage));
 
-    Stdlib::MemSet(&P2KernelPage[0], 0, sizeof(P2KernelPage));
     Stdlib::MemSet(&P2UserPage[0], 0, sizeof(P2UserPage));
 
     Trace(0, "PageTable 0x%p P4Page 0x%p", this, &P4Page);
@@ -61,76 +59,253 @@ ulong PageTable::PhysToVirt(ulong phyAddr)
     }
 }
 
+bool PageTable::HasGbPages()
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax < 0x80000001)
+        return false;
+
+    Cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 26)) ? true : false;
+}
+
+void PageTable::SetupP2Page(PtePage& p2Page, ulong phyAddr, bool global)
+{
+    auto& mmap = MemoryMap::GetInstance();
+
+    for (size_t j = 0; j < 512; j++)
+    {
+        auto& p2Entry = p2Page.Entry[j];
+
+        p2Entry.SetAddress(phyAddr);
+        // only holes without ram (mmio) are mapped uncached
+        if (!mmap.HasAvailable(phyAddr, phyAddr + 2 * Const::MB))
+            p2Entry.SetCacheDisabled();
+        p2Entry.SetWritable();
+        p2Entry.SetHuge();
+        if (global)
+            p2Entry.SetGlobal();
+        p2Entry.SetPresent();
+
+        phyAddr += (2 * Const::MB);
+    }
+}
+
 bool PageTable::Setup()
 {
-    //Map first 4GB of kernel address space
+    auto& mmap = MemoryMap::GetInstance();
+    bool gbPages = HasGbPages();
+
+    ulong mapEnd = Stdlib::RoundUp(Stdlib::Max(mmap.GetAvailableEnd(), 4 * Const::GB), Const::GB);
+    mapEnd = Stdlib::Min(mapEnd, Stdlib::ArraySize(P3KernelPage.Entry) * Const::GB);
+
+    P2KernelPageCount = ((gbPages) ? Stdlib::Min(mapEnd, 4 * Const::GB) : mapEnd) / Const::GB;
+    P2KernelPage = static_cast<PtePage*>(EarlyAllocator::GetInstance().Alloc(P2KernelPageCount));
+    if (P2KernelPage == nullptr)
+        return false;
+
+    //Map physical memory into kernel address space
     auto& p4Entry = P4Page.Entry[256];
 
     p4Entry.SetAddress(VirtToPhys((ulong)&P3KernelPage));
-    p4Entry.SetCacheDisabled();
     p4Entry.SetWritable();
     p4Entry.SetPresent();
 
-    ulong addr = MemoryMap::KernelSpaceBase;
-    for (size_t i = 0; i < 4; i++)
+    size_t p2Index = 0;
+    for (ulong addr = 0; addr < mapEnd; addr += Const::GB)
     {
-        auto& p3Entry = P3KernelPage.Entry[i];
-        auto& p2Page = P2KernelPage[i];
+        auto& p3Entry = P3KernelPage.Entry[addr / Const::GB];
 
-        p3Entry.SetAddress(VirtToPhys((ulong)&p2Page));
-        p3Entry.SetCacheDisabled();
-        p3Entry.SetWritable();
-        p3Entry.SetPresent();
-
-        for (size_t j = 0; j < 512; j++)
+        if (addr >= 4 * Const::GB && gbPages)
         {
-            auto& p2Entry = p2Page.Entry[j];
+            p3Entry.SetAddress(addr);
+            if (!mmap.HasAvailable(addr, addr + Const::GB))
+                p3Entry.SetCacheDisabled();
+            p3Entry.SetWritable();
+            p3Entry.SetHuge();
+            p3Entry.SetGlobal();
+            p3Entry.SetPresent();
+        }
+        else
+        {
+            BugOn(p2Index >= P2KernelPageCount);
+            auto& p2Page = P2KernelPage[p2Index++];
 
-            p2Entry.SetAddress(VirtToPhys(addr));
-            p2Entry.SetCacheDisabled();
-            p2Entry.SetWritable();
-            p2Entry.SetHuge();
-            p2Entry.SetPresent();
+            p3Entry.SetAddress(VirtToPhys((ulong)&p2Page));
+            p3Entry.SetWritable();
+            p3Entry.SetPresent();
 
-            addr += (2 * Const::MB);
+            SetupP2Page(p2Page, addr, true);
         }
+
+        DirectMapEnd = addr + Const::GB;
     }
 
+    Trace(0, "PageTable direct map end 0x%p gb pages %u p2 pages %u",
+        DirectMapEnd, (ulong)gbPages, P2KernelPageCount);
+
     //Map first 4GB of user address space
 
     auto& p4Entry2 = P4Page.Entry[0];
 
     p4Entry2.SetAddress(VirtToPhys((ulong)&P3UserPage));
-    p4Entry2.SetCacheDisabled();
     p4Entry2.SetWritable();
     p4Entry2.SetPresent();
 
-    addr = 0;
-    for (size_t i = 0; i < 4; i++)
+    for (size_t i = 0; i < Stdlib::ArraySize(P2UserPage); i++)
     {
         auto& p3Entry = P3UserPage.Entry[i];
         auto& p2Page = P2UserPage[i];
 
         p3Entry.SetAddress(VirtToPhys((ulong)&p2Page));
-        p3Entry.SetCacheDisabled();
         p3Entry.SetWritable();
         p3Entry.SetPresent();
 
-        for (size_t j = 0; j < 512; j++)
+        SetupP2Page(p2Page, i * Const::GB, false);
+    }
+
+    State = 2;
+    return true;
+}
+
+PageTable::Pte* PageTable::LookupPte(ulong virtAddr, bool create)
+{
+    PtePage* table = &P4Page;
+
+    for (ulong shift = 39; shift > Const::PageShift; shift -= 9)
+    {
+        auto& entry = table->Entry[(virtAddr >> shift) & 0x1FF];
+        if (!entry.Present())
         {
-            auto& p2Entry = p2Page.Entry[j];
+            if (!create)
+                return nullptr;
 
-            p2Entry.SetAddress(VirtToPhys(addr));
-            p2Entry.SetCacheDisabled();
-            p2Entry.SetWritable();
-            p2Entry.SetHuge();
-            p2Entry.SetPresent();
+            void* page = PageAllocatorImpl::GetInstance().AllocZeroed(1);
+            if (page == nullptr)
+                return nullptr;
 
-            addr += (2 * Const::MB);
+            entry.SetAddress(VirtToPhys((ulong)page));
+            entry.SetWritable();
+            entry.SetPresent();
         }
+        else if (entry.Huge())
+        {
+            return nullptr;
+        }
+
+        table = reinterpret_cast<PtePage*>(PhysToVirt(entry.Address()));
     }
 
-    State = 2;
+    return &table->Entry[(virtAddr >> Const::PageShift) & 0x1FF];
+}
+
+bool PageTable::InitCpu()
+{
+    u64 pat = ReadMsr(PatMsr);
+    pat &= ~((u64)0xFF << (8 * PatEntryWc));
+    pat |= PatTypeWc << (8 * PatEntryWc);
+    WriteMsr(PatMsr, pat);
+    return true;
+}
+
+bool PageTable::MapPage(ulong virtAddr, ulong phyAddr, ulong flags)
+{
+    if ((virtAddr & (Const::PageSize - 1)) || (phyAddr & (Const::PageSize - 1)))
+        return false;
+
+    Stdlib::AutoLock lock(Lock);
+
+    Pte* pte = LookupPte(virtAddr, true);
+    if (pte == nullptr || pte->Present())
+        return false;
+
+    pte->SetAddress(phyAddr);
+    if (flags & MapWritable)
+        pte->SetWritable();
+    if (flags & MapCacheDisabled)
+        pte->SetCacheDisabled();
+    if (flags & MapWriteThrough)
+        pte->SetWriteThrough();
+    if (flags & MapWriteCombining)
+        pte->SetPat();
+    pte->SetPresent();
+
+    Invlpg((void*)virtAddr);
+    return true;
+}
+
+bool PageTable::UnmapPage(ulong virtAddr)
+{
+    ulong phyAddr;
+    return UnmapPage(virtAddr, phyAddr);
+}
+
+bool PageTable::UnmapPage(ulong virtAddr, ulong& phyAddr)
+{
+    bool accessed;
+    return UnmapPage(virtAddr, phyAddr, accessed);
+}
+
+bool PageTable::UnmapPage(ulong virtAddr, ulong& phyAddr, bool& accessed)
+{
+    if (virtAddr & (Const::PageSize - 1))
+        return false;
+
+    Stdlib::AutoLock lock(Lock);
+
+    Pte* pte = LookupPte(virtAddr, false);
+    if (pte == nullptr || !pte->Present())
+        return false;
+
+    // exchange, so a walk that sets the accessed bit meanwhile isn't lost
+    Pte old;
+    old.Value = __atomic_exchange_n(&pte->Value, 0, __ATOMIC_SEQ_CST);
+    phyAddr = old.Address();
+    accessed = old.Accessed();
+    Invlpg((void*)virtAddr);
+    return true;
+}
+
+bool PageTable::IsMapped(ulong virtAddr)
+{
+    Stdlib::SharedAutoLock lock(Lock);
+
+    Pte* pte = LookupPte(virtAddr, false);
+    return (pte != nullptr && pte->Present()) ? true : false;
+}
+
+ulong PageTable::GetDirectMapEnd()
+{
+    return DirectMapEnd;
+}
+
+bool PageTable::CopyKernelRoot(ulong* root)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    const ulong spaces[] = { MemoryMap::StackSpaceBase, MemoryMap::VmallocSpaceBase };
+    for (size_t i = 0; i < Stdlib::ArraySize(spaces); i++)
+    {
+        auto& entry = P4Page.Entry[(spaces[i] >> 39) & 0x1FF];
+        if (entry.Present())
+            continue;
+
+        void* page = PageAllocatorImpl::GetInstance().AllocZeroed(1);
+        if (page == nullptr)
+            return false;
+
+        entry.SetAddress(VirtToPhys((ulong)page));
+        entry.SetWritable();
+        entry.SetPresent();
+    }
+
+    // the low identity map stays kernel only, user space starts above it
+    root[0] = P4Page.Entry[0].Value;
+    for (size_t i = 256; i < 512; i++)
+        root[i] = P4Page.Entry[i].Value;
+
     return true;
 }
 
@@ -163,48 +338,5 @@ PageTable::~PageTable()
 {
 }
 
-bool PageTable::Setup2()
-{
-    auto& mmap = MemoryMap::GetInstance();
-    ulong memStart, memEnd;
-
-    if (!mmap.FindRegion(VirtToPhys(mmap.GetKernelEnd()), 4 * Const::GB, memStart, memEnd))
-    {
-        Trace(0, "Can't get available memory region");
-        return false;
-    }
-
-    if (memStart % Const::PageSize)
-    {
-        Trace(0, "Invalid memory start");
-        return false;
-    }
-
-    if (memEnd % Const::PageSize)
-    {
-        Trace(0, "Invalid memory end");
-        return false;
-    }
-
-    size_t pageCount = memEnd / Const::PageSize;
-    Trace(0, "Phy page count %u", pageCount);
-
-    Page* pageStart = (Page*)PhysToVirt(memStart);
-    for (size_t i = 0; i < pageCount; i++)
-    {
-        Page* page = &pageStart[i];
-        if ((ulong)Stdlib::MemAdd(page, sizeof(*page)) >= PhysToVirt(memEnd))
-        {
-            Trace(0, "Pages array overflow memory end");
-            return false;
-        }
-
-        page->Pfn = i;
-        FreePagesList.InsertTail(&page->ListEntry);
-    }
-
-    return true;
-}
-
 }
 }
\ No newline at end of file
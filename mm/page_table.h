@@ -29,7 +29,35 @@ public:
 
     void UnmapNull();
 
-    bool Setup2();
+    static const ulong MapWritable = 0x1;
+    static const ulong MapCacheDisabled = 0x2;
+    static const ulong MapWriteThrough = 0x4;
+    // through PAT entry 4, see InitCpu
+    static const ulong MapWriteCombining = 0x8;
+
+    // points PAT entry 4 of the current cpu at write combining, no 4KiB
+    // entry used it before and 2MiB ones can't select it
+    bool InitCpu();
+
+    // 4KiB mapping, intermediate tables are allocated on demand
+    bool MapPage(ulong virtAddr, ulong phyAddr, ulong flags = MapWritable);
+    bool UnmapPage(ulong virtAddr);
+    // same, returns the address the page was mapped to
+    bool UnmapPage(ulong virtAddr, ulong& phyAddr);
+    // same, accessed is false if no cpu used the mapping, so no tlb can
+    // hold it and remote invalidation may be skipped
+    bool UnmapPage(ulong virtAddr, ulong& phyAddr, bool& accessed);
+
+    // true if a 4KiB mapping of the page is present
+    bool IsMapped(ulong virtAddr);
+
+    // physical memory is mapped at KernelSpaceBase up to this address
+    ulong GetDirectMapEnd();
+
+    // copies the kernel entries of the root into the root of a user address
+    // space. The stack and vmalloc top level entries are created first, so
+    // the kernel part of the root doesn't change afterwards
+    bool CopyKernelRoot(ulong* root);
 
 private:
     PageTable(const PageTable& other) = delete;
@@ -39,7 +67,9 @@ private:
     PageTable();
     ~PageTable();
 
-    bool MapPage(ulong virtAddr, ulong phyAddr);
+    static const u32 PatMsr = 0x277;
+    static const ulong PatEntryWc = 4;
+    static const u64 PatTypeWc = 0x1;
 
     SpinLock Lock;
 
@@ -58,7 +88,7 @@ private:
 
         ulong Address()
         {
-            return Value & (~((ulong)Const::PageSize));
+            return Value & AddressMask;
         }
 
         bool Present()
@@ -66,6 +96,16 @@ private:
             return (Value & (1 << PresentBit)) ? true : false;
         }
 
+        bool Huge()
+        {
+            return (Value & (1 << HugeBit)) ? true : false;
+        }
+
+        bool Accessed()
+        {
+            return (Value & (1 << AccessedBit)) ? true : false;
+        }
+
         void SetAddress(ulong address)
         {
             BugOn(address & (Const::PageSize - 1));
@@ -82,6 +122,17 @@ private:
             Value |= (1 << CacheDisabledBit);
         }
 
+        void SetWriteThrough()
+        {
+            Value |= (1 << WriteThrough);
+        }
+
+        // 4KiB entries only, huge ones keep the pat bit at bit 12
+        void SetPat()
+        {
+            Value |= (1 << PatBit);
+        }
+
         void SetHuge()
         {
             Value |= (1 << HugeBit);
@@ -92,6 +143,12 @@ private:
             Value |= (1 << WritableBit);
         }
 
+        // leaf entries only, kept across cr3 reloads once CR4.PGE is set
+        void SetGlobal()
+        {
+            Value |= (1 << GlobalBit);
+        }
+
         void ClearPresent()
         {
             Value &= ~(1 << PresentBit);
@@ -105,6 +162,10 @@ private:
         static const ulong AccessedBit = 5;
         static const ulong DirtyBit = 6;
         static const ulong HugeBit = 7;
+        static const ulong PatBit = 7;
+        static const ulong GlobalBit = 8;
+
+        static const ulong AddressMask = 0x000FFFFFFFFFF000;
     };
 
     static_assert(sizeof(Pte) == 8, "Invalid size");
@@ -119,23 +180,21 @@ private:
     PtePage P4Page __attribute__((aligned(Const::PageSize)));
     PtePage P3KernelPage __attribute__((aligned(Const::PageSize)));
     PtePage P3UserPage __attribute__((aligned(Const::PageSize)));
-    PtePage P2KernelPage[4] __attribute__((aligned(Const::PageSize)));
     PtePage P2UserPage[4] __attribute__((aligned(Const::PageSize)));
 
-    struct Page final
-    {
-        Stdlib::ListEntry ListEntry;
-        Kernel::Atomic RefCounter;
-        ulong Pfn;
-    };
+    void SetupP2Page(PtePage& p2Page, ulong phyAddr, bool global);
+
+    Pte* LookupPte(ulong virtAddr, bool create);
 
-    static_assert(sizeof(Page) == 0x20, "Invalid size");
+    bool HasGbPages();
 
-    struct Page *Pages;
-    size_t PageCount;
     ulong State;
+    ulong DirectMapEnd;
 
-    Stdlib::ListEntry FreePagesList;
+    // 2MiB direct map tables from the early allocator, one per gigabyte of
+    // ram; gigabytes above 4GB use 1GiB pages when cpu supports them
+    PtePage* P2KernelPage;
+    size_t P2KernelPageCount;
 };
 
 }
@@ -3,6 +3,8 @@
 #include <include/const.h>
 #include <kernel/panic.h>
 #include <kernel/trace.h>
+#include <kernel/preempt.h>
+#include <kernel/asm.h>
 
 #include <lib/lock.h>
 #include <lib/stdlib.h>
@@ -15,14 +17,23 @@ namespace Mm
 
 Pool::Pool()
     : Usage(0)
+    , PeakUsage(0)
+    , AllocFailures(0)
     , Size(0)
+    , EmptyCount(0)
+    , PageCount(0)
+    , CpuMagazine(nullptr)
+    , MagazineCount(0)
+    , PageAllocator(nullptr)
 {
-    BlockList.Init();
-    PageList.Init();
+    PartialList.Init();
+    FullList.Init();
+    EmptyList.Init();
 }
 
 Pool::~Pool()
 {
+    DrainMagazines();
     BugOn(Usage != 0);
     Setup(0);
 }
@@ -33,19 +44,44 @@ void Pool::Setup(size_t size, class PageAllocator* pageAllocator)
 
     Stdlib::AutoLock lock(Lock);
 
-    while (!BlockList.IsEmpty())
-    {
-        BlockList.RemoveHead();
-    }
+    FreeMagazines();
 
-    while (!PageList.IsEmpty())
-    {
-        PageAllocator->Free(PageList.RemoveHead());
-    }
+    ReleasePages(PartialList);
+    ReleasePages(FullList);
+    ReleasePages(EmptyList);
+    EmptyCount = 0;
 
     Usage = 0;
+    PeakUsage = 0;
+    AllocFailures = 0;
     Size = size;
     PageAllocator = pageAllocator;
+
+    if (Size != 0 && PageAllocator != nullptr)
+    {
+        size_t count = CpuTable::GetInstance().GetCpuLimit();
+        size_t pages = (count * sizeof(Magazine) + Const::PageSize - 1) / Const::PageSize;
+        if (pages != 0)
+            CpuMagazine = static_cast<Magazine*>(PageAllocator->Alloc(pages));
+
+        // without magazines every request goes through the pool lock
+        if (CpuMagazine != nullptr)
+        {
+            MagazineCount = count;
+            for (size_t i = 0; i < MagazineCount; i++)
+                CpuMagazine[i].Count = 0;
+        }
+    }
+}
+
+void Pool::FreeMagazines()
+{
+    if (CpuMagazine != nullptr)
+    {
+        PageAllocator->Free(CpuMagazine);
+        CpuMagazine = nullptr;
+    }
+    MagazineCount = 0;
 }
 
 bool Pool::CheckSize(size_t size)
@@ -56,47 +92,237 @@ bool Pool::CheckSize(size_t size)
     return true;
 }
 
-void* Pool::Alloc()
+Pool::Page* Pool::CreatePage()
+{
+    // callers hold the pool lock, with interrupts and preemption off, so
+    // the page allocator skips the shrinkers that could free blocks into
+    // this pool
+    Page* page = static_cast<Page*>(PageAllocator->Alloc(1));
+    if (page == nullptr)
+    {
+        return nullptr;
+    }
+
+    page->BlockList.Init();
+    page->Owner = this;
+    page->Live = 0;
+    page->Total = 0;
+
+    ListEntry* block = reinterpret_cast<ListEntry*>(&page->Data[0]);
+    while (Stdlib::MemAdd(block, Size) <= Stdlib::MemAdd(page, Const::PageSize))
+    {
+        page->BlockList.InsertTail(block);
+        page->Total++;
+        block = static_cast<ListEntry*>(Stdlib::MemAdd(block, Size));
+    }
+
+    PageCount++;
+    return page;
+}
+
+void Pool::ReleasePage(Page* page)
+{
+    page->Owner = nullptr;
+    PageAllocator->Free(page);
+    PageCount--;
+}
+
+void Pool::ReleasePages(ListEntry& pageList)
+{
+    while (!pageList.IsEmpty())
+    {
+        ReleasePage(CONTAINING_RECORD(pageList.RemoveHead(), Page, Link));
+    }
+}
+
+void* Pool::AllocLocked()
 {
-    Trace(PoolLL, "0x%p alloc block size 0x%p", this, Size);
+    Page* page;
 
+    // partially used slabs first, then the cached empty one, then a new one
+    if (!PartialList.IsEmpty())
+    {
+        page = CONTAINING_RECORD(PartialList.Flink, Page, Link);
+    }
+    else
+    {
+        if (!EmptyList.IsEmpty())
+        {
+            page = CONTAINING_RECORD(EmptyList.RemoveHead(), Page, Link);
+            EmptyCount--;
+        }
+        else
+        {
+            page = CreatePage();
+            if (page == nullptr)
+            {
+                AllocFailures++;
+                return nullptr;
+            }
+        }
+        PartialList.InsertHead(&page->Link);
+    }
+
+    BugOn(page->BlockList.IsEmpty());
+    void* block = page->BlockList.RemoveHead();
+    page->Live++;
+    if (page->Live == page->Total)
+    {
+        page->Link.RemoveInit();
+        FullList.InsertTail(&page->Link);
+    }
+
+    Usage++;
+    if (Usage > PeakUsage)
+        PeakUsage = Usage;
+    return block;
+}
+
+Pool* Pool::GetOwner(void* ptr)
+{
+    Page* page = reinterpret_cast<Page*>(reinterpret_cast<ulong>(ptr) & ~(Const::PageSize - 1));
+    return page->Owner;
+}
+
+void Pool::GetStats(PoolStats& stats)
+{
     Stdlib::AutoLock lock(Lock);
 
-    if (!CheckSize(Size))
-    {   
-        return nullptr;
+    // blocks cached by magazines are free, the counts are a snapshot
+    ulong cached = 0;
+    for (size_t i = 0; i < MagazineCount; i++)
+    {
+        cached += CpuMagazine[i].Count;
     }
 
-    if (BlockList.IsEmpty())
+    ulong total = (Size != 0) ? PageCount * ((Const::PageSize - sizeof(Page)) / Size) : 0;
+
+    stats.Size = Size;
+    stats.Usage = Usage - cached;
+    stats.PeakUsage = PeakUsage;
+    stats.FreeBlocks = total - stats.Usage;
+    stats.PageCount = PageCount;
+    stats.AllocFailures = AllocFailures;
+}
+
+void Pool::FreeLocked(void* ptr)
+{
+    Page* page = reinterpret_cast<Page*>(reinterpret_cast<ulong>(ptr) & ~(Const::PageSize - 1));
+    if (BugOn(page->Owner != this) || BugOn(page->Live == 0))
+    {
+        return;
+    }
+
+    if (page->Live == page->Total)
+    {
+        page->Link.RemoveInit();
+        PartialList.InsertTail(&page->Link);
+    }
+
+    page->BlockList.InsertHead(static_cast<ListEntry*>(ptr));
+    page->Live--;
+    Usage--;
+
+    if (page->Live == 0)
     {
-        Page* page = static_cast<Page*>(PageAllocator->Alloc(1));
-        if (page == nullptr)
+        page->Link.RemoveInit();
+        if (EmptyCount < EmptyPageLimit)
+        {
+            EmptyList.InsertTail(&page->Link);
+            EmptyCount++;
+        }
+        else
         {
-            return nullptr;
+            ReleasePage(page);
         }
+    }
+}
+
+Pool::Magazine* Pool::GetMagazine()
+{
+    ulong cpuIndex = CpuTable::GetInstance().GetCurrentCpuId();
+    if (cpuIndex >= MagazineCount)
+        return nullptr;
+
+    return &CpuMagazine[cpuIndex];
+}
+
+void Pool::Refill(Magazine& magazine)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    while (magazine.Count < MagazineBatch)
+    {
+        void* block = AllocLocked();
+        if (block == nullptr)
+            break;
+
+        magazine.Block[magazine.Count++] = block;
+    }
+}
+
+void Pool::Flush(Magazine& magazine, size_t count)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    while (count != 0 && magazine.Count != 0)
+    {
+        FreeLocked(magazine.Block[--magazine.Count]);
+        count--;
+    }
+}
+
+void Pool::DrainMagazines()
+{
+    for (size_t i = 0; i < MagazineCount; i++)
+    {
+        Flush(CpuMagazine[i], MagazineSize);
+    }
+}
+
+void* Pool::Alloc()
+{
+    TraceFast(PoolLL, "0x%p alloc block size 0x%p", this, Size);
+
+    if (!CheckSize(Size))
+    {
+        return nullptr;
+    }
 
-        PageList.InsertTail(&page->Link);
+    void* block = nullptr;
+    bool cached = false;
+    if (PreemptIsOn())
+    {
+        ulong flags = GetRflags();
+        InterruptDisable();
 
-        ListEntry* block = reinterpret_cast<ListEntry*>(&page->Data[0]);
-        while (Stdlib::MemAdd(block, Size) <= Stdlib::MemAdd(page, Const::PageSize))
+        auto magazine = GetMagazine();
+        if (magazine != nullptr)
         {
-            BlockList.InsertTail(block);
-            block = static_cast<ListEntry*>(Stdlib::MemAdd(block, Size));
+            if (magazine->Count == 0)
+                Refill(*magazine);
+
+            block = (magazine->Count != 0) ? magazine->Block[--magazine->Count] : nullptr;
+            cached = true;
         }
+
+        SetRflags(flags);
     }
 
-    Usage++;
-    void* block = BlockList.RemoveHead();
-    Trace(PoolLL, "0x%p alloc block %p", this, block);
+    if (!cached)
+    {
+        Stdlib::AutoLock lock(Lock);
+        block = AllocLocked();
+    }
+
+    TraceFast(PoolLL, "0x%p alloc block %p", this, block);
 
     return block;
 }
 
 void Pool::Free(void* ptr)
 {
-    Stdlib::AutoLock lock(Lock);
-
-    Trace(PoolLL, "Free block %p", ptr);
+    TraceFast(PoolLL, "Free block %p", ptr);
 
     if (ptr == nullptr)
     {
@@ -110,10 +336,49 @@ void Pool::Free(void* ptr)
         return;
     }
 
-    ListEntry* block = static_cast<ListEntry*>(ptr);
-    BlockList.InsertTail(block);
-    Usage--;
+    bool cached = false;
+    if (PreemptIsOn())
+    {
+        ulong flags = GetRflags();
+        InterruptDisable();
+
+        auto magazine = GetMagazine();
+        if (magazine != nullptr)
+        {
+            if (magazine->Count == MagazineSize)
+                Flush(*magazine, MagazineBatch);
+
+            magazine->Block[magazine->Count++] = ptr;
+            cached = true;
+        }
+
+        SetRflags(flags);
+    }
+
+    if (!cached)
+    {
+        Stdlib::AutoLock lock(Lock);
+        FreeLocked(ptr);
+    }
 }
 
+size_t Pool::GetSize()
+{
+    return Size;
+}
+
+void* PoolAllocator::Alloc(size_t size)
+{
+    if (BugOn(Pool == nullptr) || BugOn(size > Pool->GetSize()))
+        return nullptr;
+
+    return Pool->Alloc();
+}
+
+void PoolAllocator::Free(void* ptr)
+{
+    Pool->Free(ptr);
+}
+
+}
 }
-}
\ No newline at end of file
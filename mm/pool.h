@@ -4,6 +4,7 @@
 #include "page_allocator.h"
 
 #include <kernel/spin_lock.h>
+#include <kernel/cpu.h>
 #include <lib/list_entry.h>
 
 namespace Kernel
@@ -22,23 +23,101 @@ public:
     void* Alloc();
     void Free(void *ptr);
 
+    size_t GetSize();
+
+    // pool which owns the block, found through its slab header
+    static Pool* GetOwner(void* ptr);
+
+    struct PoolStats
+    {
+        size_t Size;
+        ulong Usage;
+        ulong PeakUsage;
+        ulong FreeBlocks;
+        size_t PageCount;
+        ulong AllocFailures;
+    };
+
+    void GetStats(PoolStats& stats);
+
 private:
     using ListEntry = Stdlib::ListEntry;
 
     bool CheckSize(size_t size);
 
+    void* AllocLocked();
+    void FreeLocked(void* ptr);
+
+    static const size_t MagazineSize = 32;
+    static const size_t MagazineBatch = MagazineSize / 2;
+
+    // per cpu cache of free blocks, only touched by its cpu with interrupts disabled
+    struct Magazine
+    {
+        size_t Count;
+        void* Block[MagazineSize];
+    };
+
+    // nullptr if the cpu has no magazine
+    Magazine* GetMagazine();
+    void FreeMagazines();
+    void Refill(Magazine& magazine);
+    void Flush(Magazine& magazine, size_t count);
+    void DrainMagazines();
+
+    // slab header at the start of each page, blocks follow it. It fills a
+    // cache line, so blocks of sizes that are multiples of the line start
+    // on a line boundary
     struct Page {
         ListEntry Link;
-        u8 Data[1]; 
+        ListEntry BlockList;
+        Pool* Owner;
+        ulong Live;
+        ulong Total;
+        ulong Padding;
+        u8 Data[0];
     };
 
+    static_assert(sizeof(Page) == Const::CacheLineSize, "Invalid size");
+
+    Page* CreatePage();
+    void ReleasePage(Page* page);
+    void ReleasePages(ListEntry& pageList);
+
+    static const size_t EmptyPageLimit = 1;
+
     ulong Usage;
+    ulong PeakUsage;
+    ulong AllocFailures;
     size_t Size;
-    ListEntry PageList;
-    ListEntry BlockList;
-    SpinLock Lock;
+    ListEntry PartialList;
+    ListEntry FullList;
+    ListEntry EmptyList;
+    size_t EmptyCount;
+    size_t PageCount;
+    FastSpinLock Lock;
+
+    // one per cpu index, sized by the cpus found at setup
+    Magazine* CpuMagazine;
+    size_t MagazineCount;
     PageAllocator* PageAllocator;
 };
 
+// container allocator policy over a pool, every request must fit its block
+class PoolAllocator final
+{
+public:
+    PoolAllocator(class Pool* pool = nullptr)
+        : Pool(pool)
+    {
+    }
+
+    void* Alloc(size_t size);
+    void Free(void* ptr);
+
+private:
+    class Pool* Pool;
+};
+
+}
 }
-}
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include "shrinker.h"
+
+#include <kernel/asm.h>
+#include <kernel/preempt.h>
+#include <kernel/trace.h>
+#include <lib/lock.h>
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+ShrinkerTable::ShrinkerTable()
+    : ReclaimWork(ReclaimWorkFunc, this)
+{
+    Stdlib::MemSet(Shrinkers, 0, sizeof(Shrinkers));
+}
+
+ShrinkerTable::~ShrinkerTable()
+{
+}
+
+bool ShrinkerTable::Register(Shrinker& shrinker, const char* name)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    for (size_t i = 0; i < MaxShrinkers; i++)
+    {
+        auto& entry = Shrinkers[i];
+        if (entry.Callback != nullptr)
+            continue;
+
+        entry.Callback = &shrinker;
+        entry.Name = name;
+        entry.Calls = 0;
+        entry.Freed = 0;
+        return true;
+    }
+
+    return false;
+}
+
+void ShrinkerTable::Unregister(Shrinker& shrinker)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        for (size_t i = 0; i < MaxShrinkers; i++)
+        {
+            if (Shrinkers[i].Callback == &shrinker)
+                Shrinkers[i].Callback = nullptr;
+        }
+    }
+
+    // a Shrink that took its snapshot before may still call it
+    while (Running.Get() != 0)
+        Pause();
+}
+
+size_t ShrinkerTable::Shrink(size_t pageCount)
+{
+    if (pageCount == 0)
+        return 0;
+
+    // shrinkers freeing pages may end up here again, and a second cpu
+    // running them wouldn't find more to free
+    if (Running.Cmpxchg(1, 0) != 0)
+    {
+        Busy.Inc();
+        return 0;
+    }
+
+    Shrinker* callback[MaxShrinkers];
+    size_t index[MaxShrinkers];
+    size_t held[MaxShrinkers];
+    size_t count = 0;
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        for (size_t i = 0; i < MaxShrinkers; i++)
+        {
+            if (Shrinkers[i].Callback == nullptr)
+                continue;
+
+            callback[count] = Shrinkers[i].Callback;
+            index[count] = i;
+            count++;
+        }
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        held[i] = callback[i]->CountPages();
+        total += held[i];
+    }
+
+    size_t freed[MaxShrinkers];
+    size_t freedTotal = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        freed[i] = 0;
+        if (held[i] == 0 || freedTotal >= pageCount)
+            continue;
+
+        // share of the target by what the cache holds, rounded up
+        size_t share = (pageCount * held[i] + total - 1) / total;
+        share = Stdlib::Min(share, pageCount - freedTotal);
+        freed[i] = callback[i]->ShrinkPages(share);
+        freedTotal += freed[i];
+    }
+
+    // counts are hints, ask again for what is missing
+    for (size_t i = 0; i < count && freedTotal < pageCount; i++)
+    {
+        size_t more = callback[i]->ShrinkPages(pageCount - freedTotal);
+        freed[i] += more;
+        freedTotal += more;
+    }
+
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            auto& entry = Shrinkers[index[i]];
+            if (entry.Callback != callback[i])
+                continue;
+
+            entry.Calls++;
+            entry.Freed += freed[i];
+        }
+    }
+
+    Running.Set(0);
+
+    Trace(ShrinkerLL, "Shrink pages %u freed %u", pageCount, freedTotal);
+    return freedTotal;
+}
+
+void ShrinkerTable::ReclaimWorkFunc(void* ctx)
+{
+    auto table = static_cast<ShrinkerTable*>(ctx);
+
+    table->Shrink(ReclaimBatch);
+}
+
+void ShrinkerTable::Kick()
+{
+    // the work queue runs once preemption is on
+    if (!PreemptIsOn())
+        return;
+
+    if (WorkQueue::GetInstance().Queue(ReclaimWork))
+        Kicks.Inc();
+}
+
+void ShrinkerTable::Dump(Stdlib::Printer& printer)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    printer.Printf("shrinkers kicks %u busy %u\n", Kicks.Get(), Busy.Get());
+    for (size_t i = 0; i < MaxShrinkers; i++)
+    {
+        auto& entry = Shrinkers[i];
+        if (entry.Callback == nullptr)
+            continue;
+
+        printer.Printf("%s pages %u calls %u freed %u\n", entry.Name,
+            entry.Callback->CountPages(), entry.Calls, entry.Freed);
+    }
+}
+
+}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/spin_lock.h>
+#include <kernel/atomic.h>
+#include <kernel/work_queue.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Cache whose memory can be given back under pressure. ShrinkPages runs
+// from failed page allocations with interrupts enabled, so a shrinker must
+// not allocate pages while holding a lock it takes itself.
+class Shrinker
+{
+public:
+    // pages the cache could free right now, a hint
+    virtual size_t CountPages() = 0;
+
+    // frees up to pageCount pages, returns how many
+    virtual size_t ShrinkPages(size_t pageCount) = 0;
+};
+
+// Registered shrinkers. The page allocator calls Shrink before an
+// allocation fails and Kick once a zone drops below its low watermark,
+// which shrinks from the work queue. Every shrinker is asked for a share
+// of the target in proportion to what it holds.
+class ShrinkerTable final
+{
+public:
+    static ShrinkerTable& GetInstance()
+    {
+        static ShrinkerTable Instance;
+        return Instance;
+    }
+
+    bool Register(Shrinker& shrinker, const char* name);
+
+    // waits for a running Shrink, so it may not be called by a shrinker
+    void Unregister(Shrinker& shrinker);
+
+    // returns the pages freed, 0 if another cpu is shrinking
+    size_t Shrink(size_t pageCount);
+
+    // queues a background shrink, safe from any context
+    void Kick();
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const size_t MaxShrinkers = 16;
+    // background shrinks and the smallest direct ones free this many pages
+    static const size_t ReclaimBatch = 32;
+
+private:
+    ShrinkerTable();
+    ~ShrinkerTable();
+    ShrinkerTable(const ShrinkerTable& other) = delete;
+    ShrinkerTable(ShrinkerTable&& other) = delete;
+    ShrinkerTable& operator=(const ShrinkerTable& other) = delete;
+    ShrinkerTable& operator=(ShrinkerTable&& other) = delete;
+
+    static void ReclaimWorkFunc(void* ctx);
+
+    struct Entry final
+    {
+        Shrinker* Callback;
+        const char* Name;
+        ulong Calls;
+        ulong Freed;
+    };
+
+    SpinLock Lock;
+    Entry Shrinkers[MaxShrinkers];
+    // set by the cpu that runs the shrinkers
+    Atomic Running;
+    Work ReclaimWork;
+    Atomic Kicks;
+    Atomic Busy;
+};
+
+}
+}
@@ -0,0 +1,251 @@
+#include "tlb.h"
+
+#include <kernel/asm.h>
+#include <kernel/cpu.h>
+#include <kernel/panic.h>
+#include <kernel/trace.h>
+#include <kernel/per_cpu.h>
+#include <kernel/preempt.h>
+#include <lib/lock.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+static inline void InvpcidInsn(ulong type, ulong pcid, ulong addr)
+{
+    struct
+    {
+        u64 Pcid;
+        u64 Addr;
+    } desc = { pcid, addr };
+
+    asm volatile ("invpcid %1, %0" : : "r"(type), "m"(desc) : "memory");
+}
+
+Tlb::Tlb()
+    : Pge(false)
+    , Invpcid(false)
+    , Pcid(false)
+    , PcidInUse(false)
+{
+    u32 eax, ebx, ecx, edx;
+
+    Cpuid(1, &eax, &ebx, &ecx, &edx);
+    Pge = (edx & CpuidPge) ? true : false;
+    Pcid = (ecx & CpuidPcid) ? true : false;
+
+    Cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7)
+    {
+        Cpuid(7, &eax, &ebx, &ecx, &edx);
+        Invpcid = (ebx & CpuidInvpcid) ? true : false;
+    }
+
+    if (!Invpcid)
+        Pcid = false;
+
+    Stdlib::MemSet(PcidUsed, 0, sizeof(PcidUsed));
+    Stdlib::MemSet(PcidStale, 0, sizeof(PcidStale));
+    // the kernel root runs with PCID 0
+    PcidUsed[0] = 1;
+}
+
+Tlb::~Tlb()
+{
+}
+
+bool Tlb::InitCpu()
+{
+    if (Pge)
+        SetCr4(GetCr4() | Cr4Pge);
+
+    // CR3 holds PCID 0 here, as setting the bit requires
+    if (Pcid)
+        SetCr4(GetCr4() | Cr4Pcide);
+
+    Trace(0, "Cpu %u tlb pge %u invpcid %u pcid %u",
+        GetPerCpuIndex(), (ulong)Pge, (ulong)Invpcid, (ulong)Pcid);
+    return true;
+}
+
+bool Tlb::HasInvpcid()
+{
+    return Invpcid;
+}
+
+void Tlb::FlushLocalAll()
+{
+    // neither drops global entries, so the direct map stays cached
+    if (PcidInUse)
+        InvpcidInsn(InvpcidAllNonGlobal, 0, 0);
+    else if (Invpcid)
+        InvpcidInsn(InvpcidSingleContext, 0, 0);
+    else
+        SetCr3(GetCr3());
+}
+
+void Tlb::FlushLocal(ulong start, size_t pages)
+{
+    // invlpg reaches the current PCID only
+    if (pages > FullFlushPages || PcidInUse)
+    {
+        FlushLocalAll();
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++)
+        Invlpg(reinterpret_cast<void*>(start + i * Const::PageSize));
+}
+
+ulong Tlb::MakeCr3(ulong root, ulong pcid)
+{
+    if (!Pcid)
+        return root;
+
+    return root | pcid | Cr3NoFlush;
+}
+
+void Tlb::FlushAllCpu(void* ctx)
+{
+    (void)ctx;
+    InvpcidInsn(InvpcidAllNonGlobal, 0, 0);
+}
+
+ulong Tlb::AllocPcid()
+{
+    if (!Pcid)
+        return 0;
+
+    PcidInUse = true;
+    for (;;)
+    {
+        u64 stale[PcidCount / 64];
+        {
+            Stdlib::AutoLock lock(PcidLock);
+            for (size_t i = 0; i < Stdlib::ArraySize(PcidUsed); i++)
+            {
+                u64 free = ~(PcidUsed[i] | PcidStale[i]);
+                if (free == 0)
+                    continue;
+
+                ulong bit = Stdlib::FindFirstSetBit(free);
+                PcidUsed[i] |= (1UL << bit);
+                return i * 64 + bit;
+            }
+
+            Stdlib::MemCpy(stale, PcidStale, sizeof(stale));
+        }
+
+        // every free PCID may still be cached: drop them all, on every cpu,
+        // from task context since the call waits for the other cpus. Ones
+        // freed meanwhile stay stale
+        PreemptDisable();
+        FlushAllCpu(nullptr);
+        CpuTable::GetInstance().CallFunctionAllExcludeSelf(FlushAllCpu, nullptr);
+        PreemptEnable();
+
+        Stdlib::AutoLock lock(PcidLock);
+        for (size_t i = 0; i < Stdlib::ArraySize(PcidStale); i++)
+            PcidStale[i] &= ~stale[i];
+    }
+}
+
+void Tlb::FreePcid(ulong pcid)
+{
+    if (pcid == 0 || BugOn(pcid >= PcidCount))
+        return;
+
+    Stdlib::AutoLock lock(PcidLock);
+    PcidUsed[pcid / 64] &= ~(1UL << (pcid % 64));
+    PcidStale[pcid / 64] |= (1UL << (pcid % 64));
+}
+
+Tlb::Batch::Batch()
+    : RangeCount(0)
+    , TotalPages(0)
+    , Full(false)
+{
+}
+
+Tlb::Batch::~Batch()
+{
+    BugOn(!IsEmpty());
+}
+
+bool Tlb::Batch::IsEmpty()
+{
+    return (RangeCount == 0 && !Full) ? true : false;
+}
+
+void Tlb::Batch::Add(ulong start, size_t pages)
+{
+    if (pages == 0 || Full)
+        return;
+
+    // extend the last range when unmapping page by page
+    if (RangeCount != 0)
+    {
+        Range& last = Ranges[RangeCount - 1];
+        if (last.Start + last.Pages * Const::PageSize == start)
+        {
+            last.Pages += pages;
+            TotalPages += pages;
+            Full = (TotalPages > FullFlushPages) ? true : false;
+            return;
+        }
+    }
+
+    if (RangeCount == MaxRanges)
+    {
+        Full = true;
+        return;
+    }
+
+    Ranges[RangeCount].Start = start;
+    Ranges[RangeCount].Pages = pages;
+    RangeCount++;
+    TotalPages += pages;
+    Full = (TotalPages > FullFlushPages) ? true : false;
+}
+
+void Tlb::Batch::FlushRanges()
+{
+    auto& tlb = Tlb::GetInstance();
+
+    if (Full)
+    {
+        tlb.FlushLocalAll();
+        return;
+    }
+
+    for (size_t i = 0; i < RangeCount; i++)
+        tlb.FlushLocal(Ranges[i].Start, Ranges[i].Pages);
+}
+
+void Tlb::Batch::FlushCpu(void* ctx)
+{
+    static_cast<Batch*>(ctx)->FlushRanges();
+}
+
+void Tlb::Batch::Flush()
+{
+    if (IsEmpty())
+        return;
+
+    // a task that migrated between the local flush and the call would
+    // leave its new cpu, the excluded one, unflushed
+    PreemptDisable();
+    FlushRanges();
+    CpuTable::GetInstance().CallFunctionAllExcludeSelf(FlushCpu, this);
+    PreemptEnable();
+
+    RangeCount = 0;
+    TotalPages = 0;
+    Full = false;
+}
+
+}
+}
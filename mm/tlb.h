@@ -0,0 +1,130 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <kernel/spin_lock.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// TLB invalidation of kernel mappings that change at runtime (vmalloc,
+// MMIO). The direct map is global, which keeps it cached across the full
+// flushes, and INVPCID drops the rest without a CR3 write. User address
+// spaces get a PCID each, so switching between them keeps their entries;
+// once one exists, kernel flushes cover every PCID because the non global
+// kernel entries may be cached under any of them.
+class Tlb final
+{
+public:
+    static Tlb& GetInstance()
+    {
+        static Tlb Instance;
+        return Instance;
+    }
+
+    // enables global pages on the current cpu, runs after it loads the
+    // final page table root
+    bool InitCpu();
+
+    // invalidates pages on the current cpu, large ranges drop every non
+    // global entry instead
+    void FlushLocal(ulong start, size_t pages);
+
+    // drops every non global entry of the current cpu
+    void FlushLocalAll();
+
+    bool HasInvpcid();
+
+    // PCID for a new address space, 0 if the cpu has none and every switch
+    // flushes. Entries of freed PCIDs are dropped on all cpus before reuse
+    ulong AllocPcid();
+    void FreePcid(ulong pcid);
+
+    // CR3 value loading root with pcid without flushing its entries
+    ulong MakeCr3(ulong root, ulong pcid);
+
+    // above this many pages a full flush is cheaper than invlpg per page
+    static const size_t FullFlushPages = 32;
+
+    // Collects unmapped ranges and invalidates them on every cpu with a
+    // single call IPI. Ranges whose entries were never accessed can't be
+    // cached by any cpu and are not added, so a batch of them sends no IPI.
+    // Flush waits for the remote cpus, so it must not run under a spin lock
+    // another cpu may wait for.
+    class Batch final
+    {
+    public:
+        Batch();
+        ~Batch();
+
+        void Add(ulong start, size_t pages);
+
+        void Flush();
+
+        bool IsEmpty();
+
+    private:
+        Batch(const Batch& other) = delete;
+        Batch(Batch&& other) = delete;
+        Batch& operator=(const Batch& other) = delete;
+        Batch& operator=(Batch&& other) = delete;
+
+        static void FlushCpu(void* ctx);
+
+        void FlushRanges();
+
+        struct Range
+        {
+            ulong Start;
+            size_t Pages;
+        };
+
+        static const size_t MaxRanges = 16;
+
+        Range Ranges[MaxRanges];
+        size_t RangeCount;
+        size_t TotalPages;
+        // a range didn't fit or the batch is too large for invlpg
+        bool Full;
+    };
+
+private:
+    Tlb();
+    ~Tlb();
+    Tlb(const Tlb& other) = delete;
+    Tlb(Tlb&& other) = delete;
+    Tlb& operator=(const Tlb& other) = delete;
+    Tlb& operator=(Tlb&& other) = delete;
+
+    static const ulong Cr4Pge = (1UL << 7);
+    static const ulong Cr4Pcide = (1UL << 17);
+    static const ulong Cr3NoFlush = (1UL << 63);
+
+    static const u32 CpuidPge = (1U << 13);
+    static const u32 CpuidPcid = (1U << 17);
+    static const u32 CpuidInvpcid = (1U << 10);
+
+    static const ulong InvpcidSingleContext = 1;
+    static const ulong InvpcidAllNonGlobal = 3;
+
+    static const ulong PcidCount = 4096;
+
+    static void FlushAllCpu(void* ctx);
+
+    bool Pge;
+    bool Invpcid;
+    // PCIDs are used only together with INVPCID
+    bool Pcid;
+    volatile bool PcidInUse;
+
+    SpinLock PcidLock;
+    // allocated, and freed but maybe still cached somewhere
+    u64 PcidUsed[PcidCount / 64];
+    u64 PcidStale[PcidCount / 64];
+};
+
+}
+}
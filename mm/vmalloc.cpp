@@ -0,0 +1,333 @@
+#include "vmalloc.h"
+#include "memory_map.h"
+#include "page_table.h"
+#include "tlb.h"
+
+#include <kernel/panic.h>
+#include <kernel/trace.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+Vmalloc::Vmalloc(class PageAllocator& pageAllocator)
+    : AreaCount(0)
+    , MappedPages(0)
+    , PageAllocator(pageAllocator)
+{
+    AreaList.Init();
+}
+
+Vmalloc::~Vmalloc()
+{
+}
+
+// first fit over the gaps, each area keeps a guard page behind it
+Vmalloc::Area* Vmalloc::Reserve(size_t pages, bool lazy)
+{
+    Area* area = new Area;
+    if (area == nullptr)
+        return nullptr;
+
+    area->Pages = pages;
+    area->Lazy = lazy;
+    area->Io = false;
+    size_t span = (pages + 1) * Const::PageSize;
+    ulong limit = MemoryMap::VmallocSpaceBase + MemoryMap::VmallocSpaceSize;
+
+    Stdlib::AutoLock lock(Lock);
+
+    ulong start = MemoryMap::VmallocSpaceBase;
+    Stdlib::ListEntry* entry = AreaList.Flink;
+    for (; entry != &AreaList; entry = entry->Flink)
+    {
+        Area* next = CONTAINING_RECORD(entry, Area, ListEntry);
+        if (next->Start - start >= span)
+            break;
+
+        start = next->Start + (next->Pages + 1) * Const::PageSize;
+    }
+
+    if (limit - start < span)
+    {
+        delete area;
+        return nullptr;
+    }
+
+    // insert before entry, keeping the list sorted
+    area->Start = start;
+    entry->Blink->Flink = &area->ListEntry;
+    area->ListEntry.Blink = entry->Blink;
+    area->ListEntry.Flink = entry;
+    entry->Blink = &area->ListEntry;
+    AreaCount++;
+    return area;
+}
+
+void Vmalloc::Release(Area* area)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        area->ListEntry.RemoveInit();
+        AreaCount--;
+    }
+
+    delete area;
+}
+
+Vmalloc::Area* Vmalloc::Lookup(ulong addr)
+{
+    Stdlib::SharedAutoLock lock(Lock);
+
+    for (auto entry = AreaList.Flink; entry != &AreaList; entry = entry->Flink)
+    {
+        Area* area = CONTAINING_RECORD(entry, Area, ListEntry);
+        if (area->Start > addr)
+            break;
+
+        if (addr < area->Start + area->Pages * Const::PageSize)
+            return area;
+    }
+
+    return nullptr;
+}
+
+// unmaps the first pages of the area and links their frames through the
+// direct map, the list stays valid while the area is reserved. Pages of a
+// lazy area that were never touched are skipped. Pages some cpu accessed
+// go to the batch for invalidation.
+void* Vmalloc::Unmap(Area* area, size_t pages, Tlb::Batch& batch)
+{
+    auto& pt = PageTable::GetInstance();
+    void* frames = nullptr;
+
+    for (size_t i = 0; i < pages; i++)
+    {
+        ulong addr = area->Start + i * Const::PageSize;
+        ulong phyAddr;
+        bool accessed;
+        if (!pt.UnmapPage(addr, phyAddr, accessed))
+        {
+            if (area->Lazy)
+                continue;
+
+            Panic("Can't unmap vmalloc page 0x%p", addr);
+            break;
+        }
+
+        if (accessed)
+            batch.Add(addr, 1);
+
+        void* frame = reinterpret_cast<void*>(pt.PhysToVirt(phyAddr));
+        *static_cast<void**>(frame) = frames;
+        frames = frame;
+    }
+
+    return frames;
+}
+
+void Vmalloc::FreeFrames(void* frames)
+{
+    size_t count = 0;
+
+    while (frames != nullptr)
+    {
+        void* next = *static_cast<void**>(frames);
+        PageAllocator.Free(frames);
+        frames = next;
+        count++;
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    MappedPages -= count;
+}
+
+void* Vmalloc::Alloc(size_t size)
+{
+    if (BugOn(size == 0))
+        return nullptr;
+
+    size_t pages = Stdlib::SizeInPages(size);
+    Area* area = Reserve(pages, false);
+    if (area == nullptr)
+        return nullptr;
+
+    {
+        Stdlib::AutoLock lock(Lock);
+        MappedPages += pages;
+    }
+
+    // the range was never used, so a failure unwinds without an IPI
+    auto& pt = PageTable::GetInstance();
+    for (size_t i = 0; i < pages; i++)
+    {
+        void* page = PageAllocator.Alloc(1);
+        if (page == nullptr || !pt.MapPage(area->Start + i * Const::PageSize, pt.VirtToPhys((ulong)page)))
+        {
+            if (page != nullptr)
+                PageAllocator.Free(page);
+
+            Trace(0, "Can't map vmalloc area 0x%p pages %u", area->Start, pages);
+            {
+                Stdlib::AutoLock lock(Lock);
+                MappedPages -= pages - i;
+            }
+            Tlb::Batch batch;
+            void* frames = Unmap(area, i, batch);
+            batch.Flush();
+            FreeFrames(frames);
+            Release(area);
+            return nullptr;
+        }
+    }
+
+    return reinterpret_cast<void*>(area->Start);
+}
+
+void* Vmalloc::AllocLazy(size_t size)
+{
+    if (BugOn(size == 0))
+        return nullptr;
+
+    Area* area = Reserve(Stdlib::SizeInPages(size), true);
+    if (area == nullptr)
+        return nullptr;
+
+    return reinterpret_cast<void*>(area->Start);
+}
+
+bool Vmalloc::HandleFault(ulong addr)
+{
+    if (!Contains(reinterpret_cast<void*>(addr)))
+        return false;
+
+    Area* area = Lookup(addr);
+    if (area == nullptr || !area->Lazy)
+        return false;
+
+    void* page = PageAllocator.AllocZeroed(1);
+    if (page == nullptr)
+        return false;
+
+    auto& pt = PageTable::GetInstance();
+    ulong virtAddr = Stdlib::RoundDown(addr, Const::PageSize);
+    if (!pt.MapPage(virtAddr, pt.VirtToPhys((ulong)page)))
+    {
+        // another cpu faulted on the same page first
+        PageAllocator.Free(page);
+        return pt.IsMapped(virtAddr);
+    }
+
+    Stdlib::AutoLock lock(Lock);
+    MappedPages++;
+    return true;
+}
+
+void Vmalloc::Free(void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    Area* area = Lookup(reinterpret_cast<ulong>(ptr));
+    if (area == nullptr || area->Start != reinterpret_cast<ulong>(ptr) || area->Io)
+    {
+        Panic("Can't free vmalloc area 0x%p", ptr);
+        return;
+    }
+
+    // other cpus may still cache the mappings, so the frames go back and
+    // the range is released only after their tlbs are flushed
+    Tlb::Batch batch;
+    void* frames = Unmap(area, area->Pages, batch);
+    batch.Flush();
+    FreeFrames(frames);
+    Release(area);
+}
+
+void Vmalloc::UnmapIoPages(Area* area, size_t pages, Tlb::Batch& batch)
+{
+    auto& pt = PageTable::GetInstance();
+
+    for (size_t i = 0; i < pages; i++)
+    {
+        ulong addr = area->Start + i * Const::PageSize;
+        ulong phyAddr;
+        bool accessed;
+        if (!pt.UnmapPage(addr, phyAddr, accessed))
+        {
+            Panic("Can't unmap io page 0x%p", addr);
+            break;
+        }
+
+        if (accessed)
+            batch.Add(addr, 1);
+    }
+}
+
+void* Vmalloc::MapIo(ulong phyAddr, size_t size, ulong flags)
+{
+    if (BugOn(size == 0))
+        return nullptr;
+
+    ulong start = Stdlib::RoundDown(phyAddr, Const::PageSize);
+    ulong offset = phyAddr - start;
+    size_t pages = Stdlib::SizeInPages(offset + size);
+    Area* area = Reserve(pages, false);
+    if (area == nullptr)
+        return nullptr;
+
+    area->Io = true;
+
+    auto& pt = PageTable::GetInstance();
+    for (size_t i = 0; i < pages; i++)
+    {
+        if (!pt.MapPage(area->Start + i * Const::PageSize, start + i * Const::PageSize, flags))
+        {
+            Trace(0, "Can't map io 0x%p pages %u", phyAddr, pages);
+            Tlb::Batch batch;
+            UnmapIoPages(area, i, batch);
+            batch.Flush();
+            Release(area);
+            return nullptr;
+        }
+    }
+
+    return reinterpret_cast<void*>(area->Start + offset);
+}
+
+void Vmalloc::UnmapIo(void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    ulong start = Stdlib::RoundDown(reinterpret_cast<ulong>(ptr), Const::PageSize);
+    Area* area = Lookup(start);
+    if (area == nullptr || area->Start != start || !area->Io)
+    {
+        Panic("Can't unmap io area 0x%p", ptr);
+        return;
+    }
+
+    Tlb::Batch batch;
+    UnmapIoPages(area, area->Pages, batch);
+    batch.Flush();
+    Release(area);
+}
+
+bool Vmalloc::Contains(void* ptr)
+{
+    ulong addr = reinterpret_cast<ulong>(ptr);
+    return (addr >= MemoryMap::VmallocSpaceBase &&
+        addr < MemoryMap::VmallocSpaceBase + MemoryMap::VmallocSpaceSize) ? true : false;
+}
+
+void Vmalloc::Dump(Stdlib::Printer& printer)
+{
+    Stdlib::AutoLock lock(Lock);
+    printer.Printf("vmalloc: areas %u pages %u\n", AreaCount, MappedPages);
+}
+
+}
+}
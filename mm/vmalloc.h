@@ -0,0 +1,107 @@
+#pragma once
+
+#include "page_allocator.h"
+#include "tlb.h"
+
+#include <include/const.h>
+#include <kernel/spin_lock.h>
+#include <lib/stdlib.h>
+#include <lib/printer.h>
+#include <lib/list_entry.h>
+
+namespace Kernel
+{
+
+namespace Mm
+{
+
+// Large buffers backed by single pages mapped into a contiguous range of
+// kernel address space, so they don't need physically contiguous memory and
+// survive fragmentation. Every area is followed by an unmapped guard page.
+// Free unmaps the pages and waits for every cpu to flush its tlb when any
+// page was used, so it must not be called under a spin lock another cpu may
+// wait for.
+// MapIo maps device memory (PCI BARs) into an area the same way, with the
+// cache attributes the caller asks for.
+// AllocLazy only reserves the range: the page fault handler backs each page
+// with a zeroed one on first touch, so memory tracks actual use. Code that
+// holds page allocator or page table locks must not touch such a range.
+class Vmalloc final
+{
+public:
+    static Vmalloc& GetInstance()
+    {
+        static Vmalloc Instance(PageAllocatorImpl::GetInstance());
+        return Instance;
+    }
+
+    void* Alloc(size_t size);
+
+    void* AllocLazy(size_t size);
+
+    void Free(void* ptr);
+
+    // maps device memory, flags are PageTable cache attributes
+    void* MapIo(ulong phyAddr, size_t size, ulong flags);
+
+    void UnmapIo(void* ptr);
+
+    bool Contains(void* ptr);
+
+    // maps a zeroed page at a not present address of a lazy area, false if
+    // the address doesn't belong to one
+    bool HandleFault(ulong addr);
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    Vmalloc(PageAllocator& pageAllocator);
+    ~Vmalloc();
+    Vmalloc(const Vmalloc& other) = delete;
+    Vmalloc(Vmalloc&& other) = delete;
+    Vmalloc& operator=(const Vmalloc& other) = delete;
+    Vmalloc& operator=(Vmalloc&& other) = delete;
+
+    // areas sorted by start, the gaps between them are free address space
+    struct Area
+    {
+        Stdlib::ListEntry ListEntry;
+        ulong Start;
+        size_t Pages;
+        bool Lazy;
+        // maps device memory, no frames to free
+        bool Io;
+    };
+
+    Area* Reserve(size_t pages, bool lazy);
+    void Release(Area* area);
+    // area holding addr
+    Area* Lookup(ulong addr);
+    void* Unmap(Area* area, size_t pages, Tlb::Batch& batch);
+    void UnmapIoPages(Area* area, size_t pages, Tlb::Batch& batch);
+    void FreeFrames(void* frames);
+
+    SpinLock Lock;
+    Stdlib::ListEntry AreaList;
+    size_t AreaCount;
+    size_t MappedPages;
+    PageAllocator& PageAllocator;
+};
+
+// container allocator policy
+class VmallocAllocator final
+{
+public:
+    void* Alloc(size_t size)
+    {
+        return Vmalloc::GetInstance().Alloc(size);
+    }
+
+    void Free(void* ptr)
+    {
+        Vmalloc::GetInstance().Free(ptr);
+    }
+};
+
+}
+}